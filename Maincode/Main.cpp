@@ -2,16 +2,31 @@
 
 int main(int argc, char* argv[])
 {
+	//Processing process of Routines::sequencer with processInSeparateProcess. Start "Maincode stackProcessor" in one or more consoles. It does not open the FPGA
+	if (argc > 1 && std::string{ argv[1] } == "stackProcessor")
+	{
+		try
+		{
+			Routines::stackProcessor();
+		}
+		catch (const std::exception &e)
+		{
+			std::cout << "An error has occurred in " << e.what() << "\n";
+			Util::pressAnyKeyToCont();
+		}
+		return 0;
+	}
+
 	try
 	{
-		FPGA fpga;		//Create a FPGA session
+		FPGA fpga;		//Create a FPGA session. It is opened in the background while the routine opens the devices
 		try
 		{
 			//SEQUENCES
 			//Routines::stepwiseScan(fpga);
 			//Routines::contScanZ(fpga);
 			//Routines::panoramicScan(fpga);
-			//Routines::sequencer(fpga, 0, false, RUN::EN);
+			//Routines::sequencer(fpga, 0, false, RUN::EN, RESUME::DIS);
 			//Routines::liveScan(fpga);
 			Routines::correctTiffReadFromTileConfiguration(0, 52, { 2 });
 
@@ -29,6 +44,7 @@ int main(int argc, char* argv[])
 			//TestRoutines::galvosLaserSync(fpga);
 
 			//TestRoutines::stagePosition();
+			//TestRoutines::stageMotionBenchmark();
 			//TestRoutines::stageConfig();
 
 			//TestRoutines::shutter(fpga);
@@ -49,10 +65,23 @@ int main(int argc, char* argv[])
 
 			//TestRoutines::correctImageSingle();
 			//TestRoutines::correctImageBatch();
+			//TestRoutines::correctImageBatch("PC1");
+			//TestRoutines::scratchArenaSoak();
 			//TestRoutines::quickStitcher();
 			//TestRoutines::boolmap();
+			//TestRoutines::panoramicPyramid();
+			//TestRoutines::boolmapPrediction(0, 52);
 
 			//TestRoutines::sequencerConcurrentTest();
+			//TestRoutines::sequencerMockDevices();
+			//TestRoutines::commandListBenchmark();
+			//TestRoutines::tileBitmapBruteForce();
+			//TestRoutines::tilePathPlanner();
+			//TestRoutines::tilePathPlannerBruteForce();
+			//TestRoutines::wavelengthScheduler();
+			//TestRoutines::sequenceTimeModel();
+			//TestRoutines::sequenceSimulator();
+			//TestRoutines::sequenceJournal();
 
 			//TestRoutines::PMT16Xconfig();
 			//TestRoutines::PMT16Xdemultiplex(fpga);
@@ -60,6 +89,10 @@ int main(int argc, char* argv[])
 			//TestRoutines::vibratome(fpga);
 			//TestRoutines::filterwheel();
 			//TestRoutines::collectorLens();;
+			//TestRoutines::deviceSessions(fpga);
+			//TestRoutines::deviceExecutorMock();
+			//TestRoutines::serialTransport();
+			//TestRoutines::stackRingBenchmark();
 		}
 		catch (const std::invalid_argument &e)
 		{
@@ -94,7 +127,7 @@ int main(int argc, char* argv[])
 
 		fpga.close(FPGARESET::DIS);		//Close the FPGA connection
 	}
-	//Catch exceptions thrown by the constructor FPGA
+	//Catch exceptions thrown by opening the FPGA session, which are rethrown by fpga.close() if the routine did not access the FPGA
 	catch (const FPGAexception &e)
 	{
 		std::cout << "An FPGA exception has occurred in " << e.what() << "\n";
@@ -54,10 +54,12 @@ namespace Constants
 	enum class RUNMODE { SINGLE, LIVE, AVG, SCANZ, SCANZCENTERED, SCANX, COLLECTLENS, FIELD_ILLUM };
 	enum class COM { VISION = 1, FIDELITY = 8, FWDET = 5, FWEXC = 9, PMT16X = 6};	//*cast
 	enum class RUN { DIS = false, EN = true };
+	enum class RESUME { DIS = false, EN = true };
 
 	extern const std::string g_imagingFolderPath;
 	extern const std::string g_bitfilePath;
 	extern const std::string g_openclFilePath;
+	extern const std::string g_stackRingName;
 
 	extern const double PI;
 	extern const int us;
@@ -1,15 +1,33 @@
 #pragma once
 #include <future>
+#include <functional>									//For std::function
+#include <chrono>
+#include <thread>										//For std::this_thread::sleep_for
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <map>
 #include <fstream>										//file management
 //#include <ctime>										//Clock()
 #include <algorithm>									//std::max and std::min
 #include "FPGAapi.h"
 #include "PI_GCS2_DLL.h"
-#include "serial/serial.h"
+#include "SerialTransport.h"
 #include <memory>										//For smart pointers
 #include "Thorlabs.MotionControl.KCube.StepperMotor.h"	//For the Thorlabs stepper
 #include "SampleConfig.h"
 
+//Layout of the raw data downloaded from the FIFOs of the FPGA. Read from RTseq, or from a StackRing when the stacks are processed in another process
+struct RawStackLayout
+{
+	int mHeightPerBeamletPerFrame_pix;
+	int mWidthPerFrame_pix;
+	int mNframes;
+	bool mMultibeam;
+	RTseq::PMT16XCHAN mPMT16Xchan;
+};
+
 class Image final
 {
 public:
@@ -21,6 +39,7 @@ public:
 	Image& operator=(Image&&) = delete;			//Disable move-assignment constructor
 
 	U8* const data() const;
+	SCANDIR readScanDir() const;
 	void acquire(const bool saveAllPMT = false);
 	void acquireVerticalStrip(const SCANDIR scanDirX);
 	void correct(const double FFOVfast);
@@ -29,12 +48,15 @@ public:
 	void averageEvenOddFrames();
 	void binFrames(const int nFramesPerBin);
 	void save(const std::string folderPath, std::string filename, const TIFFSTRUCT pageStructure, const OVERRIDE override) const;
+	U32 computeCRC32() const;
+	static void demultiplex(const RawStackLayout &layout, const U32 *bufferA, const U32 *bufferB, const bool saveAllPMT, const ImageView &destination);
 private:
 	const RTseq &mRTseq;						//Const because the variables referenced by mRTseq are not changed by the methods in this class
 	TiffU8 mTiff;								//Tiff that stores the content of mBufferA and mBufferB
-	void demultiplex_(const bool saveAllPMT);
-	void demuxSingleChannel_();
-	void demuxAllChannels_(const bool saveAllPMT);
+	SCANDIR mScanDir;							//Scan direction of the data. Read when demultiplexing, so that the Image can be saved after mRTseq has been reinitialized for the next stack
+	void demultiplex_(const bool saveAllPMT, const ImageView &destination);
+	static void demuxSingleChannel_(const RawStackLayout &layout, const U32 *bufferA, const U32 *bufferB, const ImageView &destination);
+	static void demuxAllChannels_(const RawStackLayout &layout, const U32 *bufferA, const U32 *bufferB, const bool saveAllPMT, const ImageView &destination);
 };
 
 class ResonantScanner
@@ -86,18 +108,108 @@ public:
 	void setAllGains(std::vector<uint8_t> gains) const;
 	void suppressGainsLinearly(const double scaleFactor, const RTseq::PMT16XCHAN lowerChan, const RTseq::PMT16XCHAN higherChan) const;
 	void readTemp() const;
+	static std::size_t frameReply(const std::string &buffer);
+	static std::unique_ptr<serial::Serial> openSerial();
 private:
 	std::unique_ptr<serial::Serial> mSerial;
-	const COM mPort{ COM::PMT16X };
-	const int mBaud{ 9600 };
-	const int mTimeout{ 300 * ms };
-	const int mRxBufferSize{ 256 };				//Serial buffer size
+	std::unique_ptr<SerialTransport> mTransport;
+	static const COM mPort;
+	static const int mBaud;
+	static const int mTimeout;
 
 	std::vector<uint8_t> sendCommand_(std::vector<uint8_t> command) const;
 	int PMT16XCHANtoInt_(const RTseq::PMT16XCHAN chan) const;
 	uint8_t sumCheck_(const std::vector<uint8_t> input, const int index) const;		//The PMT requires a sumcheck. Refer to the manual
 };
 
+//Run the commands to the devices in the background and return a future for each command. There is one worker thread per device, so that a device
+//receives its commands in order while different devices work concurrently. The worker of a device is started by the first command to the device
+//The devices detect that a command completed by querying their status through pollUntilDone, instead of sleeping for the worst-case duration
+//A command submitted by a running command shares its cancellation flag, so that cancelling the outer command also cancels the commands it waits for
+class DeviceExecutor final
+{
+public:
+	enum class DEVICE { STAGES, STAGEX, STAGEY, STAGEZ, LASER, FILTERWHEELS, EXCFILTERWHEEL, DETFILTERWHEEL, COLLECTORLENS, PMT16X, NDEVICES };	//STAGES and FILTERWHEELS run the commands to the combined devices
+	DeviceExecutor();
+	~DeviceExecutor();
+	DeviceExecutor(const DeviceExecutor&) = delete;				//Disable copy-constructor
+	DeviceExecutor& operator=(const DeviceExecutor&) = delete;	//Disable assignment-constructor
+	DeviceExecutor(DeviceExecutor&&) = delete;					//Disable move constructor
+	DeviceExecutor& operator=(DeviceExecutor&&) = delete;		//Disable move-assignment constructor
+
+	std::future<void> submit(const DEVICE device, std::function<void()> command);
+	void cancel(const DEVICE device);
+	void cancelAll();
+	static bool isCancelled();
+	static bool pollUntilDone(std::function<bool()> isDone, const double expectedDuration, const double timeout);
+private:
+	struct Command
+	{
+		std::function<void()> mCommand;
+		std::promise<void> mPromise;
+		std::shared_ptr<std::atomic<bool>> mCancelled;
+	};
+	static const int mNdevices{ static_cast<int>(DEVICE::NDEVICES) };
+	static const double mFirstPollFraction;				//Fraction of the expected duration before the first query
+	static const double mMinPollSpacing;				//Spacing between the first 2 queries
+	static const double mMaxPollSpacing;
+	static const double mCancelCheckSpacing;			//Check for a cancellation at this spacing while sleeping before the first query
+	static thread_local std::shared_ptr<std::atomic<bool>> mCurrentCancelled;		//Cancellation flag of the command run by the calling thread, if any
+	std::mutex mMutex;
+	std::condition_variable mCondition;
+	std::array<std::deque<Command>, mNdevices> mQueues;
+	std::array<std::shared_ptr<std::atomic<bool>>, mNdevices> mRunningCancelled;	//Cancellation flag of the command running on each device
+	bool mStop{ false };
+	std::array<std::thread, mNdevices> mThreads;
+
+	void workerLoop_(const DEVICE device);
+	static void throwIfCancelled_();
+};
+
+//Motion layer of the stages. A move is modeled as a trapezoidal velocity profile followed by the settling of the stage on target
+//Instead of polling a stage continuously, the stage is first polled near its predicted arrival and then at a spacing that grows while the stage keeps moving
+//The prediction error is learned move after move. The controllers are reached through 'isMoving', so the same code runs against the PI controllers or a simulation of them
+//The wait throws if a stage has not stopped by its deadline or if it is cancelled by cancel() from another thread (or through DeviceExecutor)
+class StageMotion final
+{
+public:
+	struct AxisKinematics
+	{
+		double mAcc;							//Acceleration and deceleration of the stage
+		double mSettlingTime;					//Time for the stage to settle on target after the trapezoidal profile
+	};
+	StageMotion(const std::array<AxisKinematics, 3> kinematicsXYZ = { { { 100. * mmps / seconds, 20. * ms }, { 25. * mmps / seconds, 20. * ms }, { 10. * mmps / seconds, 20. * ms } } });
+
+	double predictMotionTime(const AXIS axis, const double distance, const double vel) const;
+	void startMove(const AXIS axis, const double distance, const double vel);
+	void waitForMotionToStop(const std::vector<AXIS> axes, std::function<bool(const AXIS)> isMoving);
+	void issueConcurrently(const std::vector<AXIS> axes, std::function<void(const AXIS)> command) const;
+	void cancel();
+	int readNpolls() const;
+	double readArrivalCorrection(const AXIS axis) const;
+private:
+	using TIMEPOINT = std::chrono::time_point<std::chrono::high_resolution_clock>;
+	const std::array<AxisKinematics, 3> mKinematicsXYZ;
+	const double mMinPollSpacing{ 5. * ms };			//Spacing between the first 2 polls after the predicted arrival
+	const double mMaxPollSpacing{ 100. * ms };
+	const double mLearningRate{ 0.3 };					//Weight of the last move in the learned arrival correction and poll latency
+	const double mTimeoutMargin{ 1. * seconds };		//The deadline of a move is twice its predicted duration plus this margin
+	const double mCancelCheckSpacing{ 10. * ms };		//Check for a cancellation at this spacing while sleeping
+	std::array<TIMEPOINT, 3> mPredictedArrivalXYZ;		//Arrival predicted when the last move was started
+	std::array<TIMEPOINT, 3> mDeadlineXYZ;				//The wait throws if the stage is still moving after it
+	std::array<bool, 3> mIsPendingXYZ{ false, false, false };	//A move was started and its arrival was not confirmed yet
+	std::array<double, 3> mArrivalCorrectionXYZ{ 0, 0, 0 };	//Learned difference between the confirmed arrival and the prediction
+	double mPollLatency{ 55. * ms };					//Learned duration of a poll (PI_IsMoving)
+	int mNpolls{ 0 };
+	std::atomic<bool> mCancelled{ false };
+	mutable DeviceExecutor mExecutor;					//Runs the commands to the controllers of the stages concurrently. Declared last, so that it is destroyed first
+
+	void waitForMotionToStopSingle_(const AXIS axis, std::function<bool(const AXIS)> isMoving);
+	double elapsedTime_(const TIMEPOINT from, const TIMEPOINT to) const;
+	void sleep_(const double duration);
+	void throwIfCancelled_();
+};
+
 class Stage final
 {
 public:
@@ -130,9 +242,10 @@ public:
 	bool isDOtriggerEnabled(const AXIS axis, const DIOCHAN DOchan) const;
 	void setDOtriggerEnabled(const AXIS axis, const DIOCHAN DOchan, const BOOL triggerState) const;
 	void printStageConfig(const AXIS axis, const DIOCHAN chan) const;
+	static int connectController(const AXIS axis);
 private:
-	const int mPort_z{ 4 };										//COM port
-	const int mBaud_z{ 38400 };
+	static const int mPort_z;									//COM port
+	static const int mBaud_z;
 	std::array<int, 3> mHandleXYZ;								//Stage handler
 
 	const char mNstagesPerController[2]{ "1" };					//Number of stages per controller (currently 1)
@@ -140,10 +253,13 @@ private:
 	VELOCITY3 mVelXYZ;											//Velocity of the stages
 	std::vector<LIMIT2> mSoftPosLimXYZ{ {0,0},{0,0},{0,0} };	//Travel soft limits (may differ from the hard limits stored in the internal memory of the stages)
 																//Initialized with invalid values (lower limit = upper limit) for safety. It must be overridden by the constructor
+	mutable StageMotion mMotion;								//Predicts the arrival of the stages. Mutable because waiting for the stages refines the prediction
 	double readCurrentPosition_(const AXIS axis) const;
 	void setCurrentPosition_(const AXIS axis, const double position);
 	double readCurrentVelocity_(const AXIS axis) const;
 	void setCurrentVelocity_(const AXIS axis, const double velocity);
+	void checkPositionLimits_(const AXIS axis, const double position) const;
+	void issueMove_(const AXIS axis, const double position);
 	double downloadPositionSingle_(const AXIS axis);
 	double downloadVelSingle_(const AXIS axis) const;
 	double downloadDOtriggerParamSingle_(const AXIS axis, const DIOCHAN DOchan, const DOPARAM triggerParamID) const;
@@ -154,8 +270,10 @@ private:
 class Vibratome
 {
 public:
-	const POSITION2 mStageInitialBladePosXY{ -54. * mm, 5. * mm };	//Position the stages in front oh the vibratome's blade
-	const double mStageFinalBladePosY{ 28. * mm };					//Final position of the Y-stage after slicing
+	static const POSITION2 mStageInitialBladePosXY;					//Position the stages in front oh the vibratome's blade
+	static const double mStageFinalBladePosY;						//Final position of the Y-stage after slicing
+	static const double mSlicingVel;								//Move the Y-stage at this velocity for slicing
+	static const VELOCITY3 mStageConveyingVelXYZ;					//Transport the sample between the objective and vibratome at this velocity
 
 	Vibratome(const FPGA &fpga, Stage &stage);
 	Vibratome(const Vibratome&) = delete;							//Disable copy-constructor
@@ -169,8 +287,6 @@ private:
 	const FPGA &mFpga;
 	Stage &mStage;
 
-	const double mSlicingVel{ 0.1 * mmps };											//Move the Y-stage at this velocity for slicing
-	const VELOCITY3 mStageConveyingVelXYZ{ 10. * mmps, 10.  *mmps, 0.5 * mmps };	//Transport the sample between the objective and vibratome at this velocity
 	//enum MotionDir { BACKWARD = -1, FORWARD = 1 };
 	//double mCuttingSpeed{ 0.5 * mmps };											//Speed of the vibratome for cutting (manual setting)
 	//double mMovingSpeed{ 2.495 * mmps };											//Measured moving speed of the head: 52.4 mm in 21 seconds = 2.495 mm/s. Set by hardware. Cannot be changed
@@ -194,6 +310,9 @@ public:
 
 	void setColor(const COLOR color);
 	void setWavelength(const int wavelength_nm);
+	static COLOR convertWavelengthToColor(const int wavelength_nm);
+	static double determineTurningTime(const ID whichFilterwheel, const COLOR initialColor, const COLOR finalColor);
+	static std::unique_ptr<serial::Serial> openSerial(const ID whichFilterwheel);
 private:
 	/* Excitation wheel with the beamsplitters (as of Feb 2019)
 	position #1, 750 nm beamsplitter
@@ -203,7 +322,7 @@ private:
 	position #5, 1040 nm beamsplitter
 	position #6, open (no beamsplitter)
 	*/
-	const std::vector<COLOR> mExcConfig{ COLOR::BLUE, COLOR::OPEN, COLOR::GREEN, COLOR::OPEN, COLOR::RED, COLOR::OPEN };
+	static const std::vector<COLOR> mExcConfig;
 
 	/* Detection wheel with the emission filters (as of Feb 2019)
 	position #1, FF01-492/sp (blue)
@@ -213,7 +332,7 @@ private:
 	position #5, FF01-514/44 (green)
 	position #6, open (no filter)
 	*/
-	const std::vector<COLOR> mDetConfig{ COLOR::BLUE, COLOR::OPEN, COLOR::RED, COLOR::CLOSED, COLOR::GREEN, COLOR::OPEN };
+	static const std::vector<COLOR> mDetConfig;
 	//Currently, there are 2 green filters set up in the wheel (pos #2 and #5). I write  COLOR::GREEN at the second position to use FF01-520/60 or at the fifth position to use FF01-514/44
 	//Leave the unused filter as COLOR::OPEN
 		
@@ -223,14 +342,18 @@ private:
 	COLOR mColor;									//Current filterwheel color
 	int mPosition;									//Current filterwheel position
 	std::unique_ptr<serial::Serial> mSerial;
+	std::unique_ptr<SerialTransport> mTransport;
 	COM mPort;
-	const int mBaud{ 115200 };
-	const int mTimeout{ 150 * ms };
-	const int mNpos{ 6 };							//Number of filter positions
-	const double mTurningSpeed{ 0.8 / seconds };	//The measured filterwheel turning speed is ~ 1 position/s. Choose a slightly smaller value
-	const int mRxBufSize{ 256 };					//Serial buffer size
-
+	static const int mBaud;
+	static const int mTimeout;
+	static const int mNpos{ 6 };					//Number of filter positions
+	static const double mTurningSpeed;				//The measured filterwheel turning speed is ~ 1 position/s. Choose a slightly smaller value
+	const double mTurningTimeoutMargin{ 2. * seconds };	//Wait for the worst-case turning time plus this margin before giving up
+	const int mUnknownPosition{ 0 };				//The filter positions start from 1
+
+	static int determineNumberOfSteps_(const int initialPosition, const int finalPosition);
 	int downloadPosition_() const;
+	bool isAtPosition_(const int position) const;
 	int convertColorToPosition_(const COLOR color) const;
 	COLOR convertPositionToColor_(const int position) const;
 	std::string convertColorToString_(const COLOR color) const;
@@ -245,6 +368,7 @@ private:
 	const RTseq &mRTseq;
 	Filterwheel mFWexcitation;
 	Filterwheel mFWdetection;
+	DeviceExecutor mExecutor;							//Turns both filterwheels concurrently. Declared last, so that it is destroyed first
 };
 
 class Laser final
@@ -265,17 +389,24 @@ public:
 	void setShutter(const bool state) const;
 	bool isShutterOpen() const;
 	int readCurrentWavelength_nm() const;
+	static double determineTuningTime(const int initialWavelength_nm, const int finalWavelength_nm);
+	static std::unique_ptr<serial::Serial> openSerial(const ID whichLaser);
 private:
 	ID mWhichLaser;
 	int mWavelength_nm;
 	std::unique_ptr<serial::Serial> mSerial;
+	std::unique_ptr<SerialTransport> mTransport;
 	COM  mPort;
-	int mBaud;
-	const int mTimeout{ 100 * ms };
-	const double mTuningSpeed{ 35. / seconds };	//in nm per second. The measured laser tuning speed is ~ 40 nm/s. Choose a slightly smaller value
-	const int mRxBufSize{ 256 };				//Serial buffer size
+	static const int mTimeout;
+	static const double mTuningSpeed;			//in nm per second. The measured laser tuning speed is ~ 40 nm/s. Choose a slightly smaller value
+	const double mTuningTimeoutMargin{ 5. * seconds };	//Wait for the worst-case tuning time plus this margin before giving up
+	const int mUnknownWavelength_nm{ 0 };
 
 	int downloadWavelength_nm_() const;
+	bool isTuning_(int &wavelength_nm) const;
+	std::string queryVision_(const std::string command) const;
+	std::vector<std::string> queryVision_(const std::vector<std::string> commands) const;
+	static std::string trimVisionReply_(const std::string command, std::string RxBuffer);
 };
 
 class Shutter final
@@ -323,12 +454,14 @@ public:
 	Laser::ID readCurrentLaser() const;
 	std::string readCurrentLaser_s(const bool justTheNameInitials) const;
 	int readCurrentWavelength_nm() const;
+	int readVisionWavelength_nm() const;
 	void isLaserInternalShutterOpen() const;
 	void setWavelength(RTseq &realtimeSeq, const int wavelength_nm);
 	void setPowerLinearScaling(const double Pi, const double Pf) const;
 	void setPowerExponentialScaling(const double Pmin, const double distancePerFrame, const double decayLengthZ) const;
 	void openShutter() const;
 	void closeShutter() const;
+	static Laser::ID selectLaser(const Laser::ID whichLaser, const int wavelength_nm);
 private:
 	Laser::ID mWhichLaser;							//use VISION, FIDELITY, or AUTO (let the code decide)
 	Laser::ID mCurrentLaser;						//Current laser in use: VISION or FIDELITY
@@ -338,6 +471,7 @@ private:
 	const double mPockelTimeStep{ 8. * us };		//Time step for the pockels sequence
 
 	std::string convertLaserNameToString_(const Laser::ID whichLaser) const;
+protected:
 	Laser::ID autoSelectLaser_(const int wavelength_nm) const;
 };
 
@@ -354,6 +488,7 @@ public:
 	void move(const double position);
 	void downloadConfig() const;
 	void moveHome();
+	static void open(const std::string serialNumber);
 private:
 	//To obtain the calibration, use Thorlabs APT software to set the position in mm, then read the position in internal-units via downloadConfig() implemented in this class
 	double mPosition;
@@ -363,15 +498,54 @@ private:
 	const std::vector<double> mPosLimit{ 0. * mm, 13. * mm };
 	const int mVel_iu{ 323449856 };									//Equivalent to 3 mm/s
 	const int mAcc_iu{ 11041 };										//Equivalent to 0.5 mm/s^2
+	const double mVel{ 3. * mmps };
+	const double mAcc{ 0.5 * mmps / seconds };
+	const double mMotionTimeout{ 30. * seconds };
+	const double mUnknownPosition{ -1. * mm };						//Out of the travel range
+	const DWORD mMovingBits{ 0x000002F0 };							//Moving or jogging in either direction, or homing. See SCC_GetStatusBits
+	const DWORD mHomedBit{ 0x00000400 };
+
+	bool isMoving_() const;
+	double determineMotionTime_(const double distance) const;
 };
 
 class CollectorLens: public StepperActuator
 {
 public:
+	static const std::string mSerialNumber;
 	CollectorLens();
 	void set(const int wavelength_nm);
 };
 
+//Open the connections to the devices in the background, so that opening them overlaps with each other and with opening the FPGA session (see FPGA::FPGA)
+//Create it in the routines that use the devices, before RTseq. The devices take the connections opened here, or open them themselves if none is pending
+//The vibratome is not listed because it is driven through the FPGA
+class DeviceSessions final
+{
+public:
+	enum class SESSION { STAGES, COLLECTORLENS, LASERS, FILTERWHEELS, PMT16X };
+	DeviceSessions(const std::vector<SESSION> sessions = { SESSION::STAGES, SESSION::COLLECTORLENS, SESSION::LASERS, SESSION::FILTERWHEELS });	//By default, the devices of the Mesoscope
+	~DeviceSessions();
+	DeviceSessions(const DeviceSessions&) = delete;				//Disable copy-constructor
+	DeviceSessions& operator=(const DeviceSessions&) = delete;	//Disable assignment-constructor
+	DeviceSessions(DeviceSessions&&) = delete;					//Disable move constructor
+	DeviceSessions& operator=(DeviceSessions&&) = delete;		//Disable move-assignment constructor
+
+	static int takeStageHandle(const AXIS axis);
+	static bool takeStepper(const std::string serialNumber);
+	static std::unique_ptr<serial::Serial> takeSerial(const COM port);
+	static double readTimeSinceStart();
+	static void printTimeSinceStart(const std::string milestone);
+	static void printFirstAcquisition();
+private:
+	static std::mutex mMutex;
+	static std::array<std::future<int>, 3> mStageHandleXYZ;		//Connections to the PI controllers that were not taken yet
+	static std::future<void> mStepper;							//Connection to the stepper of the collector lens
+	static std::map<COM, std::future<std::unique_ptr<serial::Serial>>> mSerialPorts;	//Serial ports of the lasers, filterwheels and PMT16X that were not taken yet
+	static const std::chrono::time_point<std::chrono::high_resolution_clock> mStartTime;	//Approximately the start of the process (static initialization)
+	static std::once_flag mFirstAcquisitionFlag;
+};
+
 class Galvo final
 {
 public:
@@ -412,6 +586,7 @@ public:
 	Mesoscope& operator=(Mesoscope&&) = delete;			//Disable move-assignment constructor
 
 	void configure(const int wavelength_nm);
+	std::future<void> submit(const DeviceExecutor::DEVICE device, std::function<void()> command);
 	void setPower(const double laserPower) const;
 	void openShutter() const;
 
@@ -419,12 +594,15 @@ public:
 	void setVelSingle(const AXIS axis, const double vel);
 	void moveSingle(const AXIS stage, const double position);
 	void moveXY(const POSITION2 posXY);
+	void moveXY(const POSITION2 posXY, const int wavelength_nm);
 	void moveXYZ(const POSITION3 posXYZ);
 private:
 	RTseq &mRTseq;
 	CombinedFilterwheel mVirtualFilterWheel;
 	//CollectorLens mCollectorLens;
 	Stage mStage;
+	DeviceExecutor mExecutor;							//Declared last, so that it is destroyed first and its commands do not outlive the devices
 
 	POSITION3 determineChromaticShiftXYZ_();
+	POSITION3 determineChromaticShiftXYZ_(const Laser::ID laser, const int wavelength_nm) const;
 };
\ No newline at end of file
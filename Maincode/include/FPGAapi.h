@@ -4,6 +4,7 @@
 #include "Const.h"
 #include "Utilities.h"
 #include <conio.h>					//For _getch()
+#include <future>					//For std::async
 using namespace Constants;
 
 namespace FPGAfunc
@@ -56,7 +57,9 @@ public:
 private:
 	NiFpga_Session mHandle;													//FPGA handle. Non-const to let the FPGA API assign the handle
 	const std::string mBitfile{ g_bitfilePath + NiFpga_FPGAvi_Bitfile };	//FPGA bitfile location
+	std::shared_future<void> mOpened;										//Ready when the session is open. Declared last, so that the session is opened after initializing the other members
 
+	void open_();
 	void initializeFpga_() const;
 	void readChunk_(const int &nPixPerBeamletAllFrames, int &nElemRead, const NiFpga_FPGAvi_TargetToHostFifoU32 &FIFOOUTpc, U32* buffer, int &timeout) const;
 };
@@ -94,6 +97,8 @@ public:
 	void reconfigure(const int heightPerBeamletPerFrame_pix, const int widthPerFrame_pix, const int nFrames, const bool multibeam);
 	void run();
 	void initialize(const MAINTRIG mainTrigger, const int wavelength_nm = 750, const SCANDIR scanDirZ = SCANDIR::UPWARD);
+	void arm(const MAINTRIG mainTrigger, const int wavelength_nm = 750, const SCANDIR scanDirZ = SCANDIR::UPWARD);
+	void enableTrigger();
 	void downloadData();
 	U32* dataBufferA() const;
 	U32* dataBufferB() const;
@@ -119,6 +124,8 @@ private:
 	VQU32 mVecOfqueue;
 	U32* mBufferA{ nullptr };				//Buffer array to read FIFOOUTpc A
 	U32* mBufferB{ nullptr };				//Buffer array to read FIFOOUTpc B
+	bool mIsArmed{ false };					//The control sequence has been uploaded but the main trigger has not been enabled yet
+	MAINTRIG mArmedMainTrigger{ MAINTRIG::PC };
 
 	int convertRTCHANtoU8_(const RTCHAN chan) const;
 	PMT16XCHAN determineRescannerSetpoint_(const bool multibeam) const;
@@ -0,0 +1,352 @@
+#pragma once
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <set>
+#include <memory>
+#include <functional>
+#include <thread>
+#include "Utilities.h"
+using namespace Constants;
+
+//FIFO shared by the stages of a pipeline. push() blocks while the queue is full and pop() blocks while it is empty
+//After close(), push() is rejected and pop() returns false once the queue is drained
+template<class T>
+class BoundedQueue final
+{
+public:
+	BoundedQueue(const int capacity) : mCapacity{ capacity }
+	{
+		if (capacity <= 0)
+			throw std::invalid_argument((std::string)__FUNCTION__ + ": The queue capacity must be > 0");
+	}
+
+	BoundedQueue(const BoundedQueue&) = delete;				//Disable copy-constructor
+	BoundedQueue& operator=(const BoundedQueue&) = delete;	//Disable assignment-constructor
+
+	bool push(T item)
+	{
+		std::unique_lock<std::mutex> lock{ mMutex };
+		mNotFull.wait(lock, [&] { return mClosed || static_cast<int>(mQueue.size()) < mCapacity; });
+		if (mClosed)
+			return false;
+		mQueue.push_back(std::move(item));
+		mNotEmpty.notify_one();
+		return true;
+	}
+
+	bool pop(T &item)
+	{
+		std::unique_lock<std::mutex> lock{ mMutex };
+		mNotEmpty.wait(lock, [&] { return mClosed || !mQueue.empty(); });
+		if (mQueue.empty())
+			return false;
+		item = std::move(mQueue.front());
+		mQueue.pop_front();
+		mNotFull.notify_one();
+		return true;
+	}
+
+	void close()
+	{
+		std::lock_guard<std::mutex> lock{ mMutex };
+		mClosed = true;
+		mNotEmpty.notify_all();
+		mNotFull.notify_all();
+	}
+private:
+	const int mCapacity;
+	bool mClosed{ false };
+	std::deque<T> mQueue;
+	std::mutex mMutex;
+	std::condition_variable mNotEmpty;
+	std::condition_variable mNotFull;
+};
+
+//Post-processing applied to a stack, in this order: RS distortion (GPU), crosstalk suppression, and Gaussian field flattening
+struct CorrectionParam
+{
+	double mFFOVfast{ 150. * um };			//Full FOV in the fast axis for correcting the RS distortion
+	bool mSuppressCrosstalk{ false };
+	double mCrosstalkRatio{ 1.0 };
+	double mFineTuningTop{ 1.0 };
+	double mFineTuningBottom{ 1.0 };
+	bool mFlattenField{ false };
+	double mExpFactor{ 0 };					//Exponential factor of the Gaussian field flattening
+};
+
+struct CorrectionJob
+{
+	std::string mInputFolderPath;
+	std::string mInputFilename;				//Without the extension
+	std::string mOutputFolderPath;
+	std::string mOutputFilename;			//Without the extension
+	CorrectionParam mParam;
+};
+
+//Local checkpoint of the completed jobs, so a restarted batch continues where it stopped
+//Each completed job appends a line "key<TAB>output file" and is flushed. A line torn by a crash is ignored when the journal is reopened
+class CorrectionJournal final
+{
+public:
+	CorrectionJournal(const std::string folderPath, const std::string filename = "_CorrectionJournal");
+	CorrectionJournal(const CorrectionJournal&) = delete;				//Disable copy-constructor
+	CorrectionJournal& operator=(const CorrectionJournal&) = delete;	//Disable assignment-constructor
+	static U64 computeKey(const CorrectionJob &job);
+	bool isDone(const CorrectionJob &job, const U64 key) const;
+	void record(const CorrectionJob &job, const U64 key);
+	int readNrecords() const;
+private:
+	const std::string mFilePath;
+	std::ofstream mFileHandle;
+	std::unordered_map<std::string, U64> mKeyByOutput;		//The latest key recorded for each output file
+	mutable std::mutex mMutex;
+};
+
+//Runs independent correction jobs on a pool of threads. Each thread owns a deque of jobs and, when it runs out, steals from the back of the other threads' deques
+//Jobs recorded as done in the journal are skipped. The order of completion is not deterministic, but each output file is the same as when corrected sequentially
+class CorrectionJobRunner final
+{
+public:
+	CorrectionJobRunner(const int nThreads = 4);
+	void run(const std::vector<CorrectionJob> &vec_job, CorrectionJournal &journal);
+private:
+	struct WorkQueue
+	{
+		std::mutex mMutex;
+		std::deque<int> mJobIndices;
+	};
+
+	const int mNthreads;
+
+	//State of the current run()
+	const std::vector<CorrectionJob> *mJobs;
+	CorrectionJournal *mJournal;
+	std::vector<std::unique_ptr<WorkQueue>> mQueues;
+	std::mutex mMutex;									//Protects the state below
+	int mNcorrected;
+	int mNskipped;
+	int mNstolen;
+	bool mAbort;
+	std::exception_ptr mException;
+	std::mutex mGpuMutex;
+	std::chrono::time_point<std::chrono::high_resolution_clock> mStartTime;
+
+	bool takeJob_(const int threadIndex, int &jobIndex);
+	void workerLoop_(const int threadIndex);
+};
+
+//Lets several processes, on one PC or on several PCs sharing a folder, correct the same batch of stacks
+//A job is claimed by creating its lease file exclusively. The owner refreshes its leases periodically (heartbeat), and a lease not refreshed within the expiry time is reclaimed by the other workers
+//The output is written under a temporary name and renamed when complete, so a published output is never partial. A job is done when its output exists
+class LeasedCorrector final
+{
+public:
+	LeasedCorrector(const std::string leaseFolderPath, const std::string workerName, const int nThreads = 2, const double leaseExpiry_s = 120, const double heartbeatPeriod_s = 10);
+	LeasedCorrector(const LeasedCorrector&) = delete;				//Disable copy-constructor
+	LeasedCorrector& operator=(const LeasedCorrector&) = delete;	//Disable assignment-constructor
+	void run(const std::vector<CorrectionJob> &vec_job);
+private:
+	const std::string mLeaseFolderPath;
+	const std::string mWorkerName;
+	const int mNthreads;
+	const double mLeaseExpiry_s;
+	const double mHeartbeatPeriod_s;
+
+	//State of the current run()
+	const std::vector<CorrectionJob> *mJobs;
+	std::mutex mMutex;									//Protects the state below
+	std::condition_variable mCondition;
+	std::map<std::string, std::string> mHeldLeases;		//Lease files owned by this process and the owner tag written in each
+	std::filesystem::file_time_type mShareTime;			//Time of the filesystem of the shared folder, read from the clock file of this process
+	std::chrono::steady_clock::time_point mShareTimeReadTime;	//Local time when mShareTime was read
+	bool mIsShareTimeRead;
+	int mNcorrected;
+	int mNreclaimed;
+	bool mStop;
+	std::exception_ptr mException;
+	std::mutex mGpuMutex;
+
+	std::string determineLeaseFilePath_(const int jobIndex) const;
+	bool isPublished_(const int jobIndex) const;
+	void refreshShareTime_();
+	bool isExpired_(const std::string leaseFilePath);
+	static bool touch_(const std::string filePath);
+	bool tryAcquireLease_(const std::string leaseFilePath, const std::string ownerTag);
+	void releaseLease_(const std::string leaseFilePath, const std::string ownerTag);
+	void heartbeatLoop_();
+	void workerLoop_(const int threadIndex);
+};
+
+//Staged pipeline for post-processing a batch of stacks: read-ahead readers -> correction workers -> ordered writers
+//The readers and workers are connected by a bounded queue and the workers and writers by a reorder buffer. Both are bounded by the memory budget
+//Each stack goes through the same operations as in the sequential routines, so the output files are byte-identical
+class BatchCorrector final
+{
+public:
+	BatchCorrector(const int nReaders = 2, const int nWorkers = 4, const int nWriters = 2, const U64 memoryBudget_byte = 1000000000);
+	BatchCorrector(const BatchCorrector&) = delete;				//Disable copy-constructor
+	BatchCorrector& operator=(const BatchCorrector&) = delete;	//Disable assignment-constructor
+	void run(const std::vector<CorrectionJob> &vec_job, const std::function<void(const int jobIndex, const U32 checksum)> onSaved = nullptr, CorrectionJournal *journal = nullptr);
+	static void applyCorrection(TiffU8 &image, const CorrectionParam &param, std::mutex *gpuMutex = nullptr);
+	static void applyCorrectionOnWorker(TiffU8 &image, const CorrectionParam &param, std::mutex &gpuMutex);
+private:
+	struct Item
+	{
+		int mJobIndex;
+		U64 mReserved_byte;
+		U64 mKey;
+		std::unique_ptr<TiffU8> mImage;						//Null if the job is skipped
+	};
+
+	const int mNreaders;
+	const int mNworkers;
+	const int mNwriters;
+	const U64 mMemoryBudget_byte;
+
+	//State of the current run()
+	const std::vector<CorrectionJob> *mJobs;
+	std::function<void(const int, const U32)> mOnSaved;
+	CorrectionJournal *mJournal;
+	std::unique_ptr<BoundedQueue<Item>> mReadQueue;
+	std::mutex mMutex;									//Protects the state below
+	std::condition_variable mCondition;
+	std::map<int, Item> mReorderBuffer;					//Corrected stacks waiting for their turn to be written
+	std::vector<bool> mSaved;
+	std::vector<U32> mChecksums;						//Checksum of each saved stack, passed to onSaved
+	int mNextReadIndex;
+	int mNextWriteIndex;
+	int mNextCommitIndex;
+	int mNactiveReaders;
+	U64 mInFlight_byte;
+	U64 mPeakInFlight_byte;
+	U64 mProcessed_byte;
+	int mNskipped;
+	bool mAbort;
+	std::exception_ptr mException;
+	std::mutex mGpuMutex;								//The GPU context is created per call, so serialize the GPU correction
+	std::chrono::time_point<std::chrono::high_resolution_clock> mStartTime;
+
+	U64 estimateMemory_byte_(const int jobIndex) const;
+	void abort_(const std::exception_ptr exception);
+	void readerLoop_();
+	void workerLoop_();
+	void writerLoop_();
+	void commitSaved_(const int jobIndex);
+};
+
+//Ring of raw stacks in shared memory, to run the acquisition and the processing of the stacks in separate processes
+//The acquisition process creates the ring and publishes the raw FIFO buffers of each stack. One or more processing processes open the ring, claim the stacks, process them, and mark them as saved
+//Flow control: publish() blocks while the ring is full. Crash isolation: every process sends heartbeats, and a stack claimed by a processing process that stops sending them is released for another one
+class StackRing final
+{
+public:
+	enum class ROLE { PRODUCER, CONSUMER };
+	//Parameters of the stack needed to process it. Plain data, because it is shared between processes
+	struct StackHeader
+	{
+		U64 mSequence;							//Publication order
+		int mHeightPerBeamletPerFrame_pix;
+		int mWidthPerFrame_pix;
+		int mNframes;
+		int mMultibeam;
+		int mPMT16Xchan;
+		int mScanDir;
+		int mNframesBinning;
+		U32 mNpixA;								//Number of elements of the buffers A and B. 0 if the buffer is not published
+		U32 mNpixB;
+		char mFolderPath[256];
+		char mFilename[128];
+		U32 mChecksum;							//Set by the processing process. CRC-32 of the pixels saved (see TiffU8::computeCRC32)
+	};
+	struct SavedStack
+	{
+		U64 mSequence;
+		U32 mChecksum;
+	};
+	using PROCESSOR = std::function<U32(const StackHeader &header, const U32 *bufferA, const U32 *bufferB)>;		//Process and save the stack. Return the checksum of the saved stack
+
+	StackRing(const std::string name, const int nSlots, const U64 slotCapacity_byte);		//Create the ring (acquisition process)
+	StackRing(const std::string name);														//Open an existing ring (processing process)
+	~StackRing();
+	StackRing(const StackRing&) = delete;				//Disable copy-constructor
+	StackRing& operator=(const StackRing&) = delete;	//Disable assignment-constructor
+	StackRing(StackRing&&) = delete;					//Disable move constructor
+	StackRing& operator=(StackRing&&) = delete;			//Disable move-assignment constructor
+
+	//Acquisition process
+	U64 publish(StackHeader header, const U32 *bufferA, const U32 *bufferB, PROCESSOR fallback = nullptr);
+	std::vector<SavedStack> collectSaved(std::vector<U64> *failed = nullptr);
+	void waitForAll(PROCESSOR fallback = nullptr);
+	void close();
+	int readNpending() const;
+	double readStallTime() const;
+
+	//Processing process
+	bool processNext(PROCESSOR processor, const double timeout);
+	bool isFinished() const;
+	bool isAnyConsumerAlive() const;
+	int readNreclaimed() const;
+private:
+	enum SLOTSTATE { FREE, WRITTEN, CLAIMED, SAVED, FAILED };
+	static const U32 mMagic{ 0x53524E47 };
+	static const int mMaxConsumers{ 16 };
+	static const int mNoConsumer{ -1 };						//Owner of the stacks processed by the producer itself. They are never reclaimed
+	struct Heartbeat_
+	{
+		std::atomic<int> mIsAttached;
+		std::atomic<long long> mLastBeat_ms;
+	};
+	struct RingHeader_
+	{
+		U32 mMagic;
+		int mNslots;
+		U64 mSlotCapacity_byte;
+		U64 mTotalSize_byte;
+		std::atomic<int> mIsClosed;
+		std::atomic<int> mNreclaimed;
+		Heartbeat_ mProducer;
+		Heartbeat_ mConsumers[mMaxConsumers];
+	};
+	struct SlotHeader_
+	{
+		std::atomic<int> mState;				//SLOTSTATE and the index of the consumer that claimed the stack, packed so that a claim changes both at once
+		StackHeader mStack;
+	};
+
+	const std::string mName;
+	const ROLE mRole;
+	const double mHeartbeatPeriod{ 200. * ms };
+	const double mHeartbeatTimeout{ 3. * seconds };			//A process that has not sent a heartbeat within this time is considered dead
+	const double mPollPeriod{ 1. * ms };
+	void *mMapping{ nullptr };								//Handle of the file mapping (Windows)
+	int mFileDescriptor{ -1 };								//Shared-memory object (Linux)
+	U8 *mBase{ nullptr };
+	U64 mMappedSize_byte{ 0 };
+	RingHeader_ *mHeader{ nullptr };
+	int mConsumerIndex{ mNoConsumer };
+	U64 mNextSequence{ 0 };									//Producer. Next sequence to publish
+	U64 mNextCollected{ 0 };								//Producer. Next sequence to collect
+	double mStallTime{ 0 };									//Producer. Time publish() waited for a free slot
+	std::vector<SavedStack> mSaved;							//Producer. Collected but not returned by collectSaved() yet
+	std::vector<U64> mFailed;
+	std::atomic<bool> mStopHeartbeat{ false };
+	std::thread mHeartbeatThread;
+
+	void map_(const U64 size_byte, const bool create);
+	void unmap_();
+	SlotHeader_ &slot_(const int slotIndex) const;
+	U32 *slotData_(const int slotIndex) const;
+	static int encode_(const SLOTSTATE state, const int consumer);
+	static SLOTSTATE decodeState_(const int code);
+	static int decodeConsumer_(const int code);
+	static long long now_ms_();
+	bool isAlive_(const Heartbeat_ &heartbeat) const;
+	void heartbeatLoop_(Heartbeat_ &heartbeat);
+	void collect_();
+	void waitUntil_(std::function<bool()> isDone, PROCESSOR fallback);
+	void reclaimAbandoned_();
+	int claimOldest_();
+	void processSlot_(const int slotIndex, PROCESSOR processor);
+};
@@ -2,6 +2,7 @@
 #include "Devices.h"
 #include "Sequencer.h"
 #include "SampleConfig.h"
+#include "Postprocessing.h"
 
 //MAIN SEQUENCES
 namespace Routines
@@ -9,8 +10,10 @@ namespace Routines
 	void stepwiseScan(const FPGA &fpga);
 	void contScanZ(const FPGA &fpga);
 	void panoramicScan(const FPGA &fpga);
-	void sequencer(const FPGA &fpga, const int firstCommandIndex, const bool forceScanAllStacks, const RUN runSeq);
+	void sequencer(const FPGA &fpga, const int firstCommandIndex, const bool forceScanAllStacks, const RUN runSeq, const RESUME resumeSeq);
 	void liveScan(const FPGA &fpga);
+	void stackProcessor();
+	U32 processRawStack(const StackRing::StackHeader &header, const U32 *bufferA, const U32 *bufferB);
 	void correctTiffReadFromTileConfiguration(const int firstCutNumber, const int lastCutNumber, std::vector<int> vec_wavelengthIndex);
 }
 
@@ -34,6 +37,7 @@ namespace TestRoutines
 	//Stages
 	void stagePosition();
 	void stageConfig();
+	void stageMotionBenchmark();
 
 	//Lasers
 	void shutter(const FPGA &fpga);
@@ -55,12 +59,24 @@ namespace TestRoutines
 
 	//Postprocessing
 	void correctImageSingle();
-	void correctImageBatch();
+	void correctImageBatch(const std::string workerName = "");
+	void scratchArenaSoak();
 	void quickStitcher();
 	void boolmap();
+	void panoramicPyramid();
+	void boolmapPrediction(const int firstCutNumber, const int lastCutNumber);
 
 	//Sequence
 	void sequencerConcurrentTest();
+	void sequencerMockDevices();
+	void commandListBenchmark();
+	void tileBitmapBruteForce();
+	void tilePathPlanner();
+	void tilePathPlannerBruteForce();
+	void wavelengthScheduler();
+	void sequenceTimeModel();
+	void sequenceSimulator();
+	void sequenceJournal();
 
 	//PMT16X
 	void PMT16Xconfig();
@@ -70,5 +86,9 @@ namespace TestRoutines
 	void vibratome(const FPGA &fpga);
 	void filterwheel();
 	void collectorLens();
+	void deviceSessions(const FPGA &fpga);
+	void deviceExecutorMock();
+	void serialTransport();
+	void stackRingBenchmark();
 	void openCV();
 }
@@ -29,6 +29,14 @@ private:
 	std::vector<FluorMarker> mFluorMarkerList;
 };
 
+struct BoolmapPrediction					//Predict the boolmap of the next cut from the frames of the current stacks that lie below the plane to cut
+{
+	bool mEnable{ false };
+	int mMargin_tiles{ 1 };					//Dilate the predicted boolmap by this number of tiles to account for the tissue growing from one cut to the next
+	double mThreshold{ 0.02 };				//Threshold for the average count of a quadrant of a frame, in the range [0-1]
+	int mNverificationPAN{ 1 };				//Number of panoramic scans per cut that are still run to verify the prediction. 0 skips all of them
+};
+
 class Sample : public FluorMarkerList
 {
 public:
@@ -38,8 +46,9 @@ public:
 	double mSurfaceZ{ -1 };
 	const double mBladeFocalplaneOffsetZ{ -0.025 * mm };	// <----CHANGED from 1.620 mm //Positive distance if the blade is higher than the microscope's focal plane; negative otherwise
 	double mCutAboveBottomOfStack{ 0. * um };			//Specify at what height of the overlapping volume to cut
+	BoolmapPrediction mBoolmapPrediction;
 
-	Sample(const std::string sampleName, const std::string immersionMedium, const std::string objectiveCollar, const std::vector<LIMIT2> stageSoftPosLimXYZ, const FluorMarkerList fluorMarkerList = { {} });
+	Sample(const std::string sampleName, const std::string immersionMedium, const std::string objectiveCollar, const std::vector<LIMIT2> stageSoftPosLimXYZ, const FluorMarkerList fluorMarkerList = { {} }, const BoolmapPrediction boolmapPrediction = {});
 	Sample(const Sample& sample, const POSITION2 centerXY, const LENGTH3 LOIxyz, const double sampleSurfaceZ, const double cutOffset);
 	void printSampleParams(std::ofstream *fileHandle) const;
 	std::string readName() const;
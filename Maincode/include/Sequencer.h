@@ -2,6 +2,11 @@
 #include "Utilities.h"
 #include "Devices.h"
 #include "SampleConfig.h"
+#include <functional>			//For std::function
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <queue>				//For std::priority_queue
 using namespace Constants;	
 
 void reverseSCANDIR(SCANDIR &scanDir);
@@ -30,25 +35,78 @@ protected:
 	TILEOVERLAP3 mOverlapIJK_frac;
 };
 
-class QuickStitcher : public TiffU8, public TileArray
+//Stitch the tiles into an out-of-core canvas, so that the memory taken by the stitched image is capped by memoryBudget_byte
+class QuickStitcher : public TileArray
 {
 public:
-	QuickStitcher(const int tileHeight_pix, const int tileWidth_pix, const TILEDIM2 tileArraySizeIJ, const TILEOVERLAP3 overlapIJK_frac);
+	QuickStitcher(const int tileHeight_pix, const int tileWidth_pix, const TILEDIM2 tileArraySizeIJ, const TILEOVERLAP3 overlapIJK_frac, const std::string canvasFolderPath = g_imagingFolderPath, const U64 memoryBudget_byte = 256000000);
 	void push(const U8 *tile, const TILEIJ tileIndicesIJ);
+	void push(const U8 *rows, const TILEIJ tileIndicesIJ, const int top_pix, const int height_pix);
 	void saveToFile(const std::string folderPath, std::string filename, const OVERRIDE override) const;
 	int readFullHeight_pix() const;
 	int readFullWidth_pix() const;
+	const ChunkedCanvas& readCanvas() const;
 private:
 	int mFullHeight;
 	int mFullWidth;
+	ChunkedCanvas mCanvas;
+};
+
+//Multi-resolution pyramid of an image. Level 0 is the full-resolution image and each next level is 2x box-downsampled wrt the previous one
+//Level 0 is not copied: its pixels are read from the input tiff or canvas. The downsampled levels are stored in square tiles, ready to be saved as a tiled Tiff
+//The downsampled levels of an out-of-core level 0 that do not fit in the memory budget are stored in out-of-core canvases too
+class PanoramicPyramid final
+{
+public:
+	PanoramicPyramid(const TiffU8 &level0, const int tileSize_pix = 256);
+	PanoramicPyramid(const ChunkedCanvas &level0, const int tileSize_pix = 256, const U64 memoryBudget_byte = 64000000, const std::string canvasFolderPath = g_imagingFolderPath);
+	PanoramicPyramid(const PanoramicPyramid&) = delete;				//Disable copy-constructor
+	PanoramicPyramid& operator=(const PanoramicPyramid&) = delete;	//Disable assignment-constructor
+	void update(const int rowMin_pix, const int rowMax_pix, const int colMin_pix, const int colMax_pix);
+	void update();
+	int readNlevels() const;
+	int readTileSize_pix() const;
+	int readHeightAtLevel_pix(const int level) const;
+	int readWidthAtLevel_pix(const int level) const;
+	TiffU8 readLevel(const int level) const;
+	void readRect(const int level, U8 *output, const int outputBytesPerRow, const int top_pix, const int left_pix, const int height_pix, const int width_pix) const;
+	void saveToFile(const std::string folderPath, std::string filename, const OVERRIDE override) const;
+	static TiffU8 loadLevel(const std::string folderPath, const std::string filename, const int level);
+private:
+	struct Level
+	{
+		int mHeight_pix;
+		int mWidth_pix;
+		int mNtilesII;				//Number of tiles along the image height
+		int mNtilesJJ;				//Number of tiles along the image width
+		std::vector<U8> mTiles;		//Tiles stored one after the other. Empty for level 0 and for the levels stored in mCanvas
+		std::unique_ptr<ChunkedCanvas> mCanvas;	//Out-of-core storage of a level that does not fit in the memory budget. Null otherwise
+	};
+	const TiffU8 *mLevel0Tiff;				//Full-resolution image. Null if level 0 is read from mLevel0Canvas
+	const ChunkedCanvas *mLevel0Canvas;		//Full-resolution image. Null if level 0 is read from mLevel0Tiff
+	const int mTileSize_pix;				//Pixel height and width of a single tile
+	std::vector<Level> mLevels;
+
+	PanoramicPyramid(const TiffU8 *level0Tiff, const ChunkedCanvas *level0Canvas, int height_pix, int width_pix, const int tileSize_pix, const U64 memoryBudget_byte, const std::string canvasFolderPath);
+	void readLevel0Rect_(U8 *output, const int outputBytesPerRow, const int top_pix, const int left_pix, const int height_pix, const int width_pix) const;
+	void writeRect_(const int level, const U8 *input, const int inputBytesPerRow, const int top_pix, const int left_pix, const int height_pix, const int width_pix);
+	void checkLevel_(const int level) const;
+	int determinePixelIndex_(const Level &level, const int row_pix, const int col_pix) const;
+	void downsampleLevel_(const int level, const int rowMin_pix, const int rowMax_pix, const int colMin_pix, const int colMax_pix);
 };
 
 class PanoramicScan final: public QuickStitcher
 {
 public:
-	PanoramicScan(const POSITION2 ROIcenterXY, const FFOV2 ffov, const LENGTH2 pixelSizeXY, const LENGTH2 LOIxy);
+	PanoramicScan(const POSITION2 ROIcenterXY, const FFOV2 ffov, const LENGTH2 pixelSizeXY, const LENGTH2 LOIxy, const U64 memoryBudget_byte = 256000000);
+	void pushStrip(const U8 *tile, const TILEIJ tileIndicesIJ);		//Unlike QuickStitcher::push, also update the pyramid
+	void pushStrip(const U8 *rows, const TILEIJ tileIndicesIJ, const int top_pix, const int height_pix);
+	void savePyramidToFile(const std::string folderPath, std::string filename, const OVERRIDE override) const;
+	const PanoramicPyramid& readPyramid() const;
 	double determineInitialScanPosX(const double travelOverhead, const SCANDIR scanDir) const;
 	double determineFinalScanPosX(const double travelOverhead, const SCANDIR scanDir) const;
+	double determineInitialScanPosX(const double travelOverhead, const SCANDIR scanDir, const int top_pix, const int height_pix) const;
+	double determineFinalScanPosX(const double travelOverhead, const SCANDIR scanDir, const int top_pix, const int height_pix) const;
 	int readNumberStageYpos() const;
 	double readStageYposFront() const;
 	double readStageYposBack() const;
@@ -60,9 +118,97 @@ private:
 	const LENGTH2 mPixelSizeXY;
 	const LENGTH2 mLOIxy;
 	const int mPanoramicWidth_pix;
+	PanoramicPyramid mPyramid;		//Downsampled levels of the panoramic. Updated every time a strip is pushed
 
 	int castToOddnumber_(const double input) const;
 	LENGTH2 castLOIxy_(const FFOV2 FFOV, const LENGTH2 LOIxy) const;
+	void checkRows_(const int top_pix, const int height_pix) const;
+};
+
+//Boolmap computed strip by strip while the panoramic is being acquired. Call update() after pushing each strip to the panoramic
+//A tile becomes final as soon as one of its quadrants is bright (the quadrant sums only grow) or when all the strips overlapping it have arrived
+//The final boolmap is the same as the one computed by Boolmap on the full-resolution panoramic
+class StreamingBoolmap final
+{
+public:
+	StreamingBoolmap(const PanoramicScan &panoramicScan, const TILEDIM2 tileArraySizeIJ, const PIXDIM2 tileSize_pix, const TILEOVERLAP3 overlapIJK_frac, const double threshold);
+	void update(const int stripIndex);
+	bool isComplete() const;
+	bool isTileFinal(const TILEIJ tileIndicesIJ) const;
+	bool isTileBright(const TILEIJ tileIndicesIJ) const;
+	int readNumberOfFinalTiles() const;
+	TileBitmap readBoolmap() const;
+	PIXDIM2 readTileSize_pix() const;
+	TILEDIM2 readTileArraySizeIJ() const;
+	TILEOVERLAP3 readOverlapIJK_frac() const;
+	double readThreshold() const;
+private:
+	struct TileState
+	{
+		int mTop_pix;						//Top pixel of the tile wrt the panoramic
+		int mLeft_pix;						//Left pixel of the tile wrt the panoramic
+		int mNpendingStrips;				//Number of strips overlapping the tile that have not arrived yet
+		U32 mQuadrantSum[4];				//Partial sum of the quadrants TL, TR, BL, and BR
+		bool mBright;
+		bool mFinal;
+	};
+	const PanoramicScan &mPanoramicScan;
+	const TileArray mTileArray;
+	const double mThreshold;
+	const int mPanoramicHeight_pix;
+	const int mPanoramicWidth_pix;
+	const int mStripWidth_pix;
+	const int mHalfHeight_pix;				//Quadrant height
+	const int mHalfWidth_pix;				//Quadrant width
+	std::vector<bool> mStripArrived;
+	std::vector<TileState> mTileState;
+	int mNfinalTiles{ 0 };
+
+	const TileState& readTileState_(const TILEIJ tileIndicesIJ) const;
+	void finalizeTile_(const int tileIndex, const bool isBright);
+};
+
+//Adaptive panoramic: a coarse panoramic is acquired first by moving the X-stage faster and averaging consecutive lines into each row, then only the parts of the strips that matter to the boolmap are rescanned at full resolution
+//Each tile of the stack tile array is classified from the coarse panoramic as empty, border, or tissue. A strip is rescanned over the rows spanned by the non-empty tiles overlapping it
+//The rest of the full-resolution panoramic is filled by upsampling the coarse panoramic in X. The empty tiles are well below the threshold, so the boolmap is the same as with a full scan
+class AdaptivePanoramic final
+{
+public:
+	enum class REGION { EMPTY, BORDER, TISSUE };
+	struct Segment
+	{
+		int mStripIndex;
+		int mTop_pix;						//First row of the segment wrt the full-resolution panoramic
+		int mHeight_pix;					//Even, so that the segment is acquired as pairs of galvo swings
+	};
+	AdaptivePanoramic(PanoramicScan &panoramicScan, const PanoramicScan &coarseScan, const TILEDIM2 tileArraySizeIJ, const PIXDIM2 tileSize_pix, const TILEOVERLAP3 overlapIJK_frac, const double threshold, const double emptyFactor = 0.5, const double tissueFactor = 2.0);
+	AdaptivePanoramic(const AdaptivePanoramic&) = delete;				//Disable copy-constructor
+	AdaptivePanoramic& operator=(const AdaptivePanoramic&) = delete;	//Disable assignment-constructor
+	REGION readRegion(const TILEIJ tileIndicesIJ) const;
+	int readNumberOfRegions(const REGION region) const;
+	const std::vector<Segment>& readSegments() const;
+	int findSegment(const int stripIndex) const;
+	double readRescannedFraction() const;
+	static std::vector<U8> binLines(const U8 *strip, const int height_pix, const int width_pix, const int nLinesPerRow);
+	void fillStripFromCoarse(const int stripIndex);
+	void saveRegionsToText(const std::string folderPath, std::string filename, const OVERRIDE override) const;
+private:
+	PanoramicScan &mPanoramicScan;
+	const PanoramicScan &mCoarseScan;
+	const TileArray mTileArray;
+	const int mPanoramicHeight_pix;
+	const int mCoarseHeight_pix;
+	const int mStripWidth_pix;
+	const int mNstrips;
+	std::vector<REGION> mRegions;
+	std::vector<Segment> mSegments;			//At most one per strip, in the order of the strips
+	std::vector<int> mSegmentIndexByStrip;	//-1 if the strip is not rescanned
+
+	int convertToCoarseRow_(const int row_pix) const;
+	PIXELij determineTileTopLeft_pix_(const TILEIJ tileIndicesIJ) const;
+	REGION classifyTile_(const TILEIJ tileIndicesIJ, const double emptyFactor, const double tissueFactor, const double threshold) const;
+	void dilateTissue_();
+	void planSegments_();
 };
 
 class Boolmap final
@@ -70,29 +216,120 @@ class Boolmap final
 public:
 	Boolmap(const TiffU8 &tiff, const TILEDIM2 tileArraySizeIJ, const PIXDIM2 tileSize_pix, const TILEOVERLAP3 overlapIJK_frac, const double threshold);
 	Boolmap(const PanoramicScan &panoramicScan, const TILEDIM2 tileArraySizeIJ, const PIXDIM2 tileSize_pix, const TILEOVERLAP3 overlapIJK_frac, const double threshold);
+	Boolmap(const PanoramicPyramid &pyramid, const int level, const TILEDIM2 tileArraySizeIJ, const PIXDIM2 tileSize_pix, const TILEOVERLAP3 overlapIJK_frac, const double threshold);
+	Boolmap(const PanoramicScan &panoramicScan, const StreamingBoolmap &streamingBoolmap);
 	bool isTileBright(const TILEIJ tileIndicesIJ) const;
 	void saveBoolmapToText(const std::string folderPath, std::string filename, const OVERRIDE override);
 	void saveTiffWithBoolmapGridOverlay(const std::string folderPath, std::string filename, const OVERRIDE override) const;
 	void saveTiffWithBoolmapTileOverlay(const std::string folderPath, std::string filename, const OVERRIDE override) const;
 	void fillBoolmapHoles();
-	void replaceInputBoolmapByUnion(std::vector<bool> &vec_input) const;
+	void replaceInputBoolmapByUnion(TileBitmap &input) const;
+	const TileBitmap& readBoolmap() const;
 	int readNumberOfBrightStacks() const;
+	void updateThreshold(const double threshold);
 private:
-	const TiffU8 mTiff;
+	const std::unique_ptr<const TiffU8> mTiff;		//Copy of the input image, owned by the boolmap. Null if the image is read from mCanvas or mPyramid
+	const ChunkedCanvas *mCanvas;					//Out-of-core panoramic of a PanoramicScan. Null if the image is read from mTiff or mPyramid
+	const PanoramicPyramid *mPyramid;				//Pyramid whose level mPyramidLevel is the image. Null if the image is read from mTiff or mCanvas
+	const int mPyramidLevel;
 	const TileArray mTileArray;
-	const double mThreshold;			//Threshold for generating the boolmap
+	double mThreshold;					//Threshold for generating the boolmap
 	const int mPanoramicHeight_pix;		//Pixel height of the tiled image
 	const int mPanoramicWidth_pix;		//Pixel width of the tiled image
-	const int mNpixPanoramic;			//Total number of pixels in mTiff
+	const int mNpixPanoramic;			//Total number of pixels in the image
 	PIXELij mAnchorPixel_pix;			//Reference position for the tile array wrt the Tiff
-	std::vector<bool> mBoolmap;
+	TileBitmap mBoolmap;
 	int mNbrightStacks{ 0 };					//Number of stacks with TRUE in the boolmap
+	std::vector<U32> mQuadrantSums;				//Sums of the quadrants TL, TR, BL, and BR of each tile, 4 per tile in row-major order. Empty until computed
 
+	static int determineSizeAtLevel_pix_(const int size_pix, const int level);
 	PIXELij determineTilePosWrtPanoramic_pix_(const TILEIJ tileIndicesIJ) const;
+	void readRect_(U8 *output, const int outputBytesPerRow, const int top_pix, const int left_pix, const int height_pix, const int width_pix) const;
+	void computeQuadrantSums_();
+	void saveTiffByBands_(const std::string folderPath, std::string filename, const OVERRIDE override, const std::function<void(U8 *band, const int bandTop_pix, const int nRows)> drawBand) const;
 	bool isQuadrantBright_(const double threshold, const TILEIJ tileIndicesIJ) const;
 	void generateBoolmap_();
 };
 
+//Predict the boolmap of the next cut from the frames of the current stacks that lie below the plane to cut. After sectioning, these frames are at the surface of the sample
+//A tile is predicted bright if a quadrant of any of those frames is bright. The prediction is then dilated by a margin of tiles
+class BoolmapPredictor final
+{
+public:
+	BoolmapPredictor(const TILEDIM2 tileArraySizeIJ, const PIXDIM2 tileSize_pix, const int nFrames, const int nFramesBelowCut, const double threshold, const int margin_tiles);
+	void addStack(const U8 *stack, const SCANDIR scanDirZ, const TILEIJ tileIndicesIJ);
+	TileBitmap readPrediction() const;
+	int readNumberOfObservedStacks() const;
+	void savePredictionToText(const std::string folderPath, std::string filename, const OVERRIDE override) const;
+	void reset();
+private:
+	const TILEDIM2 mTileArraySizeIJ;
+	const PIXDIM2 mTileSize_pix;
+	const int mNframes;					//Number of frames of a stack
+	const int mNframesBelowCut;			//Number of frames at the bottom of a stack that are below the plane to cut
+	const int mThreshold_255;			//Threshold in the range [0-255]
+	const int mMargin_tiles;			//Dilation margin
+	TileBitmap mBright;					//Tiles with a bright frame below the plane to cut
+	int mNobservedStacks{ 0 };
+
+	bool isFrameBright_(const U8 *frame) const;
+};
+
+//Kinematics of the X and Y-stages for modeling the duration of a move between tiles
+struct StageKinematics
+{
+	double mVelX{ 5. * mmps };					//Same as the conveying velocity set in Mesoscope
+	double mVelY{ 5. * mmps };
+	double mAccX{ 100. * mmps / seconds };
+	double mAccY{ 25. * mmps / seconds };		//The Y-stage is slower to react because it sits under the 2 other stages
+	double mCommandLatency{ 14. * ms };			//Latency of a move command
+	double mPollDuration{ 55. * ms };			//Duration of PI_IsMoving. Stage::waitForMotionToStopAll polls the X, Y, and Z-stages in turn
+};
+
+//Plan the order for visiting the bright tiles of a cut, so that the X and Y-stages spend less time moving between tiles
+//A move is modeled as a trapezoidal velocity profile on each stage, followed by the polling of the stages until they stop
+//The path starts with a nearest-neighbor tour from the first tile and is then refined by 2-opt
+class TilePathPlanner final
+{
+public:
+	TilePathPlanner(const FFOV2 FFOV, const TILEOVERLAP3 overlapIJK_frac, const StageKinematics kinematics = {});
+	double predictMoveTime(const TILEIJ fromTileIJ, const TILEIJ toTileIJ) const;
+	double simulateMoveTime(const TILEIJ fromTileIJ, const TILEIJ toTileIJ) const;
+	double predictPathTime(const std::vector<TILEIJ> &tilePath) const;
+	double simulatePathTime(const std::vector<TILEIJ> &tilePath) const;
+	double predictTravelTime(const POSITION2 fromXY, const POSITION2 toXY) const;
+	std::vector<TILEIJ> planPath(const std::vector<TILEIJ> &tilePath, const int window2opt = 64, const int maxPasses2opt = 10) const;
+private:
+	const LENGTH2 mTilePitchXY;				//Distance between the centers of neighboring tiles
+	const StageKinematics mKinematics;
+	const double mPollLoopDuration;			//Duration of one iteration of Stage::waitForMotionToStopAll
+
+	double determineMotionTime_(const double distance, const double vel, const double acc) const;
+	double determineCost_(const double motionTimeX, const double motionTimeY) const;
+	std::vector<TILEIJ> planNearestNeighbor_(const std::vector<TILEIJ> &tilePath) const;
+	void improve2opt_(std::vector<TILEIJ> &tilePath, const int window, const int maxPasses) const;
+};
+
+//Order the wavelengths of a cut so that the laser and the filterwheels spend less time switching between them
+//Mesoscope::configure tunes VISION, turns the filterwheels, and moves the collector lens concurrently, so switching lasts as long as the slowest of them. The collector lens is faster than VISION and is not modeled
+class WavelengthScheduler final
+{
+public:
+	struct LaserState
+	{
+		int mWavelength_nm;					//Current wavelength
+		int mVisionWavelength_nm;			//VISION keeps its wavelength while FIDELITY is in use
+	};
+	WavelengthScheduler(const bool multibeam, const Laser::ID whichLaser = Laser::ID::AUTO);
+	double determineSwitchingTime(LaserState &laserState, const int wavelength_nm) const;
+	double determineSwitchingTime(LaserState laserState, const std::vector<int> &wavelengthOrder_nm) const;
+	std::vector<int> planOrder(const LaserState laserState, const std::vector<int> &wavelengthOrder_nm) const;
+private:
+	const bool mMultibeam;					//For singlebeam, the excitation filterwheel is always open
+	const Laser::ID mWhichLaser;
+	const int mMaxWavelengthsToPermute{ 6 };
+};
+
 class Stack final
 {
 public:
@@ -207,6 +444,12 @@ public:
 	Sequencer& operator=(Sequencer&&) = delete;				//Disable move-assignment constructor
 
 	void generateCommandList();
+	void generateCommandList(const TileBitmap &tileMask);
+	int findCommand(const Action::ID actionID, const int startCommandIndex = 0) const;
+	std::vector<TILEIJ> readTilePath(const int firstCommandIndex) const;
+	void reorderTilePath(const int firstCommandIndex, const std::vector<TILEIJ> &tilePath);
+	std::vector<int> readWavelengthOrder(const int firstCommandIndex) const;
+	void reorderWavelengths(const int firstCommandIndex, const std::vector<int> &wavelengthOrder_nm);
 	POSITION2 convertTileIndicesIJToStagePosXY(const TILEIJ tileIndicesIJ) const;
 	std::string printHeader() const;
 	std::string printHeaderUnits() const;
@@ -244,10 +487,344 @@ private:
 	void initializeScanDirIJ_();
 	void initializeScanDirII_();
 	LENGTH3 determineEffectiveLOIxyz() const;
+	int findEndOfTileBlock_(const int firstCommandIndex) const;
 
 	void moveStage_(const TILEIJ tileIndicesIJ);
 	void acqStack_(const int indexFluorMarker);
 	void saveStack_();
 	void cutTissue_();
 	void panoramicScan_(const double distanceUnderTheSurface);
-};
\ No newline at end of file
+};
+
+//Parameters of SequenceTimeModel that are not read from the command list
+struct SequenceTimeParams
+{
+	StageKinematics mStageKinematics;									//Moves between tiles
+	StageKinematics mConveyingKinematics{ Vibratome::mStageConveyingVelXYZ.XX, Vibratome::mStageConveyingVelXYZ.YY };	//Moves to the vibratome and to the panoramic scan
+	double mConveyingVelZ{ Vibratome::mStageConveyingVelXYZ.ZZ };
+	int mInitialWavelength_nm{ 1040 };									//Routines::sequencer configures the laser at 1040 nm before the first action
+	SCANDIR mScanDirZini{ SCANDIR::UPWARD };							//Scan direction of the first stack of each cut
+	double mAcqOverhead{ 150. * ms };									//Trigger, shutter, and download of a stack, in addition to the scan
+	double mArmTime{ 100. * ms };										//Building and uploading the control sequence of a stack. Part of mAcqOverhead
+	double mDemuxThroughput{ 400. };									//MB/s of multiplexed data
+	double mDiskThroughput{ 150. };										//MB/s of binned tiff written to disk
+	POSITION2 mBladePosXY{ Vibratome::mStageInitialBladePosXY };
+	double mFinalBladePosY{ Vibratome::mStageFinalBladePosY };			//The length of the cut is mFinalBladePosY - mBladePosXY.YY
+	double mSlicingVel{ Vibratome::mSlicingVel };
+	double mCutOverhead{ 2. * seconds };								//Turning the vibratome on and off
+	double mPANwidth{ 10. * mm };										//Same as in Routines::sequencer
+	double mPANheight{ 53 * 280. * um };
+	double mPANpixelSizeX{ 1. * um };
+	int mPANwavelength_nm{ 1040 };
+	bool mPANadaptive{ false };
+	int mPANcoarseFactor{ 4 };
+	int mPANcoarseBinning{ 2 };											//Number of lines averaged into each row of the coarse panoramic
+	double mPANrescannedFraction{ 0.5 };								//Fraction of the length of the strips rescanned by the fine pass of the adaptive panoramic scan
+	double mPANstripOverhead{ 600. * ms };								//Moving to the start of a strip, settling, arming, and downloading
+	bool mConfigureDuringCut{ true };									//The laser is tuned for the panoramic scan while the vibratome cuts (Routines::sequencer with scheduleWavelengths)
+};
+
+//Predict the duration of a sequence from its command list without running it (dry run). Each action is modeled from its parameters:
+//MOV from the stage kinematics, SWITCH (tuning the laser and turning the filterwheels) with WavelengthScheduler, ACQ from the number of frames and the line clock,
+//DEMUX and SAV from the data throughput, CUT from the slicing velocity and the length of the cut, and PAN from the number of strips
+//The modeled time of each action type is scaled by a calibration factor = measured/modeled, fitted from the action logs written by Routines::sequencer
+class SequenceTimeModel final
+{
+public:
+	enum class COST { SWITCH, MOV, ACQ, DEMUX, SAV, CUT, PAN, NCOSTS };
+	//Position of the stages and state of the laser while replaying the command list
+	struct State
+	{
+		POSITION3 mStageXYZ;
+		WavelengthScheduler::LaserState mLaserState;
+		SCANDIR mScanDirZ;
+		POSITION2 mTileCenterXY;											//Tile of the last MOV. The stages move to it with the ACQ
+		int mNframesBinning{ 1 };											//Binning of the last ACQ, for its SAV
+		bool mIsAfterCut{ false };
+	};
+	//Modeled times of the action types, per cut
+	struct Prediction
+	{
+		std::vector<std::vector<double>> mBusyTimePerCut;					//[cut][COST]
+		std::vector<double> mWallTimePerCut;								//Demultiplexing and saving overlap with the next stacks, as in Routines::sequencer with runConcurrently
+		int mNstacks{ 0 };
+		double readBusyTime(const COST cost) const;
+		double readSerialTime() const;
+		double readWallTime() const;
+	};
+
+	SequenceTimeModel(const Stack stack, const bool multibeam, const SequenceTimeParams params = {});
+	State initializeState() const;
+	std::vector<double> modelCommandline(const Sequencer::Commandline &commandline, State &state) const;
+	Prediction predict(const Sequencer &sequence, const int firstCommandIndex = 0) const;
+	void printPrediction(const Prediction &prediction) const;
+	void calibrate(const std::string folderPath, const std::string filename);
+	double readCalibrationFactor(const COST cost) const;
+	SequenceTimeParams readParams() const;
+	static std::string convertCostToString(const COST cost);
+	static COST convertStringToCost(const std::string cost_s);
+private:
+	const Stack mStack;
+	const bool mMultibeam;
+	const SequenceTimeParams mParams;
+	const TilePathPlanner mTilePathPlanner;
+	const TilePathPlanner mConveyingPlanner;
+	const WavelengthScheduler mWavelengthScheduler;
+	std::vector<double> mModeledTime;										//Accumulated by calibrate(), per COST
+	std::vector<double> mMeasuredTime;
+
+	double calibrated_(const COST cost, const double modeledTime) const;
+	double determinePANstripScanTime_(const double pixelSizeX, const double heightFraction) const;
+};
+
+//Log of the modeled and measured time of every action run by Routines::sequencer. The actions run on the threads of ActionExecutor record their times concurrently
+//The log is read back by SequenceTimeModel::calibrate() for calibrating the time model of the next sequences
+class ActionTimeLog final
+{
+public:
+	ActionTimeLog(const std::string folderPath, const std::string filename);
+	ActionTimeLog(const ActionTimeLog&) = delete;				//Disable copy-constructor
+	ActionTimeLog& operator=(const ActionTimeLog&) = delete;	//Disable assignment-constructor
+	void record(const SequenceTimeModel::COST cost, const double modeledTime, const double measuredTime);
+	void record(const SequenceTimeModel::COST cost, const std::vector<double> &modeledTime, const std::chrono::time_point<std::chrono::high_resolution_clock> startTime, const std::chrono::time_point<std::chrono::high_resolution_clock> endTime);
+	std::function<void()> timeAction(const SequenceTimeModel::COST cost, const std::vector<double> &modeledTime, std::function<void()> action);
+private:
+	Logger mDatalog;
+	std::mutex mMutex;
+};
+
+//Run the actions of the command list concurrently. Each action is submitted to the resource it uses, and each resource runs its actions one at a time, in the order of submission, on its own thread
+//An action starts when the actions it depends on have completed. If an action fails, the actions that depend on it, directly or not, are cancelled,
+//and the failure is rethrown by submit(), wait(), and waitAll(). The actions that do not depend on the failed one still run, so that the stacks already acquired are saved
+class ActionExecutor final
+{
+public:
+	enum class RESOURCE { STAGES, LASER, FPGA, DEMUX, DISK, NRESOURCES };	//FPGA = arming the control sequence. DEMUX = reading the data of the last acquisition out of the RTseq buffers
+	static constexpr int NONE{ -1 };									//Handle of a nonexistent action. A dependency on NONE is ignored
+
+	ActionExecutor(const int maxQueuedPerResource = 4);
+	~ActionExecutor();
+	ActionExecutor(const ActionExecutor&) = delete;				//Disable copy-constructor
+	ActionExecutor& operator=(const ActionExecutor&) = delete;	//Disable assignment-constructor
+	ActionExecutor(ActionExecutor&&) = delete;					//Disable move constructor
+	ActionExecutor& operator=(ActionExecutor&&) = delete;		//Disable move-assignment constructor
+
+	int submit(const RESOURCE resource, const std::string name, std::function<void()> action, const std::vector<int> dependencies = {});
+	void wait(const int handle);
+	void waitAll();
+	double readBusyTime(const RESOURCE resource) const;
+	int readNcompleted() const;
+	int readNcancelled() const;
+private:
+	enum class STATE { QUEUED, RUNNING, DONE, FAILED, CANCELLED };
+	struct Task
+	{
+		int mHandle;
+		std::string mName;
+		std::function<void()> mAction;
+		std::vector<int> mDependencies;
+	};
+
+	const int mMaxQueuedPerResource;					//Bound the number of actions waiting on each resource. submit() blocks when the queue is full
+	mutable std::mutex mMutex;							//Protects the state below
+	std::condition_variable mCondition;
+	std::vector<STATE> mStates;							//State of every action submitted, indexed by its handle
+	std::vector<std::deque<Task>> mQueues;				//Queue of actions of each resource
+	std::vector<double> mBusyTime;						//Time spent running the actions of each resource
+	int mNrunning{ 0 };
+	int mNcompleted{ 0 };
+	int mNcancelled{ 0 };
+	bool mStop{ false };
+	std::exception_ptr mException;						//First failure
+	std::vector<std::thread> mThreads;
+
+	bool isFinished_(const int handle) const;
+	void workerLoop_(const int resourceIndex);
+};
+
+//Dependencies between the actions of the stacks, shared by Routines::sequencer, SequenceSimulator, and the tests, so that they schedule the stacks the same way.
+//Executor is ActionExecutor or SequenceSimulator: it provides RESOURCE, NONE, and int submit(resource, name, action, dependencies), where the action is a function or a duration
+template<class Executor>
+class StackPipeline final
+{
+public:
+	StackPipeline(Executor &executor, const bool preArm) : mExecutor{ executor }, mPreArm{ preArm } {}
+
+	StackPipeline(const StackPipeline&) = delete;				//Disable copy-constructor
+	StackPipeline& operator=(const StackPipeline&) = delete;	//Disable assignment-constructor
+
+	//Tune the laser and turn the filterwheels while the stages move to the tile. The control sequence overwrites the RTseq buffers, so it is armed once the previous stack has been read out:
+	//while the stages move when pre-arming, after the stages have settled otherwise. Only the trigger is left after the stages settle
+	template<class Configure, class Move, class Arm, class Acquire>
+	void submitAcquisition(const std::string label, Configure configure, Move move, Arm arm, Acquire acquire)
+	{
+		using RESOURCE = typename Executor::RESOURCE;
+		const int configureHandle{ mExecutor.submit(RESOURCE::LASER, "Configure " + label, configure, { mLastACQ }) };
+		mLastMOV = mExecutor.submit(RESOURCE::STAGES, "MOV " + label, move, { mLastACQ });
+		const int armHandle{ mExecutor.submit(mPreArm ? RESOURCE::FPGA : RESOURCE::STAGES, "ARM " + label, arm, { mLastACQ, configureHandle, mLastDEMUX, mPreArm ? Executor::NONE : mLastMOV }) };
+		mLastACQ = mExecutor.submit(RESOURCE::STAGES, "ACQ " + label, acquire, { mLastMOV, armHandle });
+	}
+
+	//Read the data out of the RTseq buffers as soon as the stack is acquired
+	template<class Readout>
+	void submitReadout(const std::string label, Readout readout)
+	{
+		mLastDEMUX = mExecutor.submit(Executor::RESOURCE::DEMUX, "DEMUX " + label, readout, { mLastACQ });
+	}
+
+	//Bin and save the stack read out last while the stages move to and acquire the next stack. The stacks are saved in the order of acquisition
+	template<class Save>
+	void submitSave(const std::string label, Save save)
+	{
+		mExecutor.submit(Executor::RESOURCE::DISK, "SAV " + label, save, { mLastDEMUX });
+	}
+private:
+	Executor &mExecutor;
+	const bool mPreArm;
+	int mLastMOV{ Executor::NONE };
+	int mLastACQ{ Executor::NONE };
+	int mLastDEMUX{ Executor::NONE };
+};
+
+//Settings of Routines::sequencer compared by SequenceSimulator
+struct SimulationPolicy
+{
+	std::string mName{ "Concurrent and pre-armed" };
+	bool mRunConcurrently{ true };										//Same as in Routines::sequencer
+	bool mPreArm{ true };
+	bool mPlanTilePath{ true };
+	bool mScheduleWavelengths{ true };
+	int mMaxQueuedPerResource{ 4 };										//Same as in ActionExecutor
+};
+
+//Discrete-event simulation of Routines::sequencer in virtual time. The devices are replaced by mocks that only take time: each action occupies its device
+//for the time modeled by SequenceTimeModel, and the actions are dispatched like ActionExecutor does. The actions that Routines::sequencer runs on its own thread (CUT and PAN) block the submission of the next actions.
+//A sequence of hours is simulated in a fraction of a second, so that different policies can be compared on the same synthetic sample
+class SequenceSimulator final
+{
+public:
+	enum class DEVICE { STAGES, LASER, FPGA, DEMUX, DISK, VIBRATOME, NDEVICES };	//The first ones are the resources of ActionExecutor. LASER = laser and filterwheels. DEMUX and DISK = storage
+	struct Report
+	{
+		double mMakespan{ 0 };
+		int mNstacks{ 0 };
+		std::vector<double> mBusyTime;									//Per DEVICE
+		std::vector<double> mCriticalPathTime;							//Time of the critical path spent on each DEVICE. Adds up to mMakespan
+		int mNcriticalActions{ 0 };
+		std::string mLongestCriticalAction;								//Name of the longest action on the critical path
+		double mLongestCriticalDuration{ 0 };
+		double mSimulationTime{ 0 };									//Real time spent simulating
+		double readUtilization(const DEVICE device) const;
+	};
+
+	SequenceSimulator(const Stack stack, const bool multibeam, const SimulationPolicy policy = {}, const SequenceTimeParams params = {});
+	void calibrate(const std::string folderPath, const std::string filename);
+	Report simulate(Sequencer &sequence, const TileBitmap &tileBitmap, const int firstCommandIndex = 0);
+	void printReport(const Report &report) const;
+	static std::string convertDeviceToString(const DEVICE device);
+private:
+	friend class StackPipeline<SequenceSimulator>;
+	using RESOURCE = DEVICE;											//For StackPipeline
+	static constexpr int NONE{ -1 };
+	struct Task
+	{
+		DEVICE mDevice;
+		std::string mName;
+		double mDuration;
+		std::vector<int> mDependencies;
+		double mSubmitTime;
+		int mSubmitPredecessor;											//Last action that the submitting thread waited for
+		double mStartTime{ -1 };
+		int mCriticalPredecessor{ NONE };								//Action whose end started this one
+		bool mIsDone{ false };
+	};
+
+	const SimulationPolicy mPolicy;
+	const TilePathPlanner mTilePathPlanner;
+	const WavelengthScheduler mWavelengthScheduler;
+	SequenceTimeModel mTimeModel;
+
+	//State of the simulation
+	double mNow;														//Virtual time
+	std::vector<Task> mTasks;											//Every action simulated, indexed by its handle
+	std::vector<std::deque<int>> mQueues;								//Queue of actions of each device
+	std::vector<int> mRunning;											//Action running on each device
+	std::vector<int> mLastOnDevice;										//Last action started on each device
+	std::priority_queue<std::pair<double, int>, std::vector<std::pair<double, int>>, std::greater<std::pair<double, int>>> mEvents;	//End of the running actions (time, handle)
+	int mMainPredecessor;												//Last action that the submitting thread waited for
+
+	double readEndTime_(const int handle) const;
+	int submit(const DEVICE device, const std::string name, const double duration, const std::vector<int> dependencies = {});
+	int runOnMain_(const DEVICE device, const std::string name, const double duration);
+	void dispatch_();
+	int processNextEvent_();
+	void waitAll_();
+	Report createReport_(const int nStacks) const;
+};
+
+//Append-only binary journal of the actions completed by Routines::sequencer, for resuming a sequence after a crash. Each record is framed by its length and a CRC-32 (see FramedRecordFile),
+//so a record torn by a crash is dropped when the journal is reopened. A run that completes appends an END record, and its journal cannot be resumed. The stacks recorded after the last cut are checked against their files on disk, and the records of incomplete files are dropped too
+//The state of the sequencer is rebuilt by replaying the records on a newly generated command list: the planned tile paths and wavelength orders are reapplied, so that the command indices match
+class SequenceJournal final
+{
+public:
+	enum class RECORD { BEGIN, PLAN, PAN, STACK, CUT, END };
+	//State of Routines::sequencer at the first action not completed
+	struct ResumeState
+	{
+		int mNextCommandIndex;
+		int mCutNumber;
+		SCANDIR mScanDirZ;												//Scan direction of the next stack
+		TileBitmap mTileBitmap;											//Bright tiles of the current cut
+		bool mIsCutPlanned;												//The tile path and the wavelengths of the current cut have already been planned
+		int mNPANinCut;													//Panoramic scans run or skipped in the current cut
+		int mBrightStackIndex;											//Stacks saved in the current cut
+		std::vector<std::string> mSavedFilenames;						//Stacks saved, relative to the folder of the journal
+		std::string mTileConfigurationName;								//Configuration file for the stitchers written by the run, without the extension
+	};
+
+	SequenceJournal(const std::string folderPath, const std::string filename);
+	SequenceJournal(const SequenceJournal&) = delete;				//Disable copy-constructor
+	SequenceJournal& operator=(const SequenceJournal&) = delete;	//Disable assignment-constructor
+	int readNrecords() const;
+	bool isComplete() const;
+	void restart(const Sequencer &sequence, const std::string tileConfigurationName);
+	ResumeState resume(Sequencer &sequence, const SCANDIR scanDirZini, const bool forceScanAllStacks) const;
+	void recordPlan(const int commandIndex, const int cutNumber, const TileBitmap &tileBitmap, const bool isTilePathPlanned, const std::vector<TILEIJ> &tilePath, const bool isWavelengthScheduled, const std::vector<int> &wavelengthOrder_nm);
+	void recordPAN(const int commandIndex, const int cutNumber, const TileBitmap &tileBitmap);
+	void recordStack(const int commandIndex, const int cutNumber, const int wavelength_nm, const TILEIJ tileIndicesIJ, const SCANDIR nextScanDirZ, const TileManifest::Record &manifestRecord);
+	void recordCut(const int commandIndex, const int cutNumber);
+	void recordEnd(const int commandIndex);
+	static ResumeState createInitialState(const Sequencer &sequence, const int firstCommandIndex, const SCANDIR scanDirZini, const bool forceScanAllStacks);
+private:
+	struct Record
+	{
+		RECORD mType{ RECORD::BEGIN };
+		int mCommandIndex{ 0 };
+		int mCutNumber{ 0 };
+		std::vector<I32> mValues;										//BEGIN: fingerprint of the command list. STACK: wavelength, tile indices, and next scan direction
+		std::vector<TILEIJ> mTilePath;									//PLAN
+		std::vector<int> mWavelengthOrder_nm;							//PLAN
+		bool mIsTilePathPlanned{ false };								//PLAN
+		bool mIsWavelengthScheduled{ false };							//PLAN
+		std::vector<U8> mBitmap;										//PLAN and PAN. Packed bright tiles, 1 bit per tile in row-major order
+		U64 mFileSize_byte{ 0 };										//STACK
+		U32 mChecksum{ 0 };												//STACK
+		std::string mFilename;											//STACK: stack. BEGIN: configuration file for the stitchers
+		Record() = default;
+		Record(const RECORD type, const int commandIndex, const int cutNumber) : mType{ type }, mCommandIndex{ commandIndex }, mCutNumber{ cutNumber } {}
+	};
+
+	const std::string mFolderPath;
+	FramedRecordFile mFile;
+	std::vector<Record> mRecords;
+	mutable std::mutex mMutex;											//The stacks are recorded by the thread that saves them
+
+	void append_(const Record &record);
+	bool isStackComplete_(const Record &record, const bool verifyChecksum) const;
+	static std::vector<I32> determineFingerprint_(const Sequencer &sequence);
+	static std::vector<U8> packBitmap_(const TileBitmap &tileBitmap);
+	static TileBitmap unpackBitmap_(const std::vector<U8> &bitmap, const TILEDIM2 tileArraySizeIJ);
+	static std::string encode_(const Record &record);
+	static bool decode_(const std::string &payload, Record &record);
+};
@@ -0,0 +1,92 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <functional>									//For std::function
+#include <chrono>
+#include <mutex>
+#include "serial/serial.h"
+#include "Const.h"
+using namespace Constants;
+
+//Serial transport that returns the reply of a device as soon as it is complete, instead of reading a fixed-size block until the read timeout
+//A reply is complete when the framer of the device recognizes it (e.g. the VISION prompt or the PMT16X sumcheck). Without a framer, the reply is read until the timeout as before
+//The round-trip latency of each command is recorded in a histogram
+class SerialTransport final
+{
+public:
+	using FRAMER = std::function<std::size_t(const std::string &buffer)>;	//Return the length of the first complete reply in 'buffer', or 0 if the reply is incomplete
+	struct Port
+	{
+		std::function<void(const std::string &data)> mWrite;
+		std::function<std::string()> mReadAvailable;						//Return the bytes received so far without blocking
+	};
+	class LatencyHistogram
+	{
+	public:
+		void add(const double latency, const bool timedOut);
+		void print(const std::string name) const;
+		int readCount() const;
+		double readMean() const;
+		double readMax() const;
+		int readNtimeouts() const;
+	private:
+		static const std::vector<double> mBinEdges;							//Upper edges of the bins. The last bin is open
+		std::vector<int> mCounts = std::vector<int>(mBinEdges.size() + 1, 0);
+		int mCount{ 0 };
+		int mNtimeouts{ 0 };
+		double mSum{ 0 };
+		double mMax{ 0 };
+	};
+
+	SerialTransport(const std::string deviceName, const Port port, const FRAMER framer, const double timeout);
+	SerialTransport(const SerialTransport&) = delete;				//Disable copy-constructor
+	SerialTransport& operator=(const SerialTransport&) = delete;	//Disable assignment-constructor
+	SerialTransport(SerialTransport&&) = delete;					//Disable move constructor
+	SerialTransport& operator=(SerialTransport&&) = delete;			//Disable move-assignment constructor
+
+	static Port makePort(serial::Serial &serial);
+	static FRAMER terminatorFramer(const std::string terminator);
+	std::string query(const std::string command, const std::string key);
+	std::vector<std::string> queryPipelined(const std::vector<std::string> commands, const std::vector<std::string> keys);
+	LatencyHistogram readLatencyHistogram(const std::string key) const;
+	void printLatencyHistograms() const;
+private:
+	const std::string mDeviceName;
+	const Port mPort;
+	const FRAMER mFramer;
+	const double mTimeout;
+	const double mReadSpacing{ 1. * ms };							//Spacing between reads while waiting for a reply
+	mutable std::mutex mMutex;										//A command and its reply are not interleaved with those of another thread
+	std::string mPending;											//Bytes received after the last complete reply
+	std::map<std::string, LatencyHistogram> mHistograms;			//Indexed by command key
+
+	std::string readReply_(const FRAMER &framer, const std::chrono::time_point<std::chrono::high_resolution_clock> deadline, bool &timedOut);
+};
+
+//Emulate a serial device behind a Port, so that the transport and the framers can be tested without the devices. A command ends with CR
+//The device replies after its processing time and sends the reply at its baud rate. The commands are processed one at a time
+class SerialEmulator final
+{
+public:
+	SerialEmulator(std::function<std::string(const std::string &command)> respond, const double processingTime, const int baud);
+	SerialEmulator(const SerialEmulator&) = delete;				//Disable copy-constructor
+	SerialEmulator& operator=(const SerialEmulator&) = delete;	//Disable assignment-constructor
+	SerialEmulator(SerialEmulator&&) = delete;					//Disable move constructor
+	SerialEmulator& operator=(SerialEmulator&&) = delete;		//Disable move-assignment constructor
+
+	SerialTransport::Port makePort();
+private:
+	using TIMEPOINT = std::chrono::time_point<std::chrono::high_resolution_clock>;
+	const std::function<std::string(const std::string &command)> mRespond;
+	const double mProcessingTime;
+	const int mBaud;
+	std::mutex mMutex;
+	std::string mReceived;										//Chars of a command not terminated yet
+	std::deque<std::pair<TIMEPOINT, char>> mInTransit;			//Chars of the replies with their arrival time
+	TIMEPOINT mBusyUntil{ std::chrono::high_resolution_clock::now() };	//Arrival of the last char of the last reply
+
+	void write_(const std::string &data);
+	std::string readAvailable_();
+};
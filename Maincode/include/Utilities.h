@@ -6,6 +6,13 @@
 #include <iostream>
 #include <Const.h>
 #include <bitset>					//For std::bitset
+#include <unordered_map>			//For std::unordered_map
+#include <algorithm>				//For std::replace
+#include <list>						//For std::list
+#include <mutex>					//For std::mutex
+#include <atomic>					//For std::atomic
+#include <memory>					//For std::unique_ptr
+#include <cstring>					//For std::memcpy
 #include <tiffio.h>					//Tiff files				
 #include <windows.h>				//For using the ESC key
 #include <CL/cl.hpp>				//OpenCL
@@ -32,17 +39,18 @@ namespace Util
 	void pressAnyKeyToContOrESCtoExit();
 	double multiply16X(const double input);
 	std::string convertWavelengthToFluorMarker_s(const int wavelength_nm);
-	bool isBright(const std::vector<bool> vec_boolmap, const TILEDIM2 tileArraySizeIJ, const TILEIJ tileIndicesIJ);
-	void saveBoolmapToText(const std::string folderPath, std::string filename, const std::vector<bool> vec_boolmap, const TILEDIM2 tileArraySizeIJ, const OVERRIDE override);
-	int determineNumberOf1s(const std::vector<bool> vec_boolmap);
 	std::string zeroPadding(const int inputNumber, const int digits);
+	int convertFluorMarkerToWavelength_nm(const int fluorMarker);
+	U32 computeCRC32(const U8 *data, const std::size_t nBytes, const U32 previousCRC = 0);
+	U32 computeFileCRC32(const std::string filePath);
+	U64 readAvailableMemory_byte();
 }
 
 //For saving the parameters to a text file
 class Logger final
 {
 public:
-	Logger(const std::string folderPath, std::string filename, const OVERRIDE override);
+	Logger(const std::string folderPath, std::string filename, const OVERRIDE override, const bool append = false);
 	~Logger();
 	void record(const std::string description);
 	void record(const std::string description, const double input);
@@ -51,17 +59,217 @@ private:
 	std::ofstream mFileHandle;
 };
 
+//Append-only binary file of records after a signature. Each record is framed by its length and a CRC-32 of its payload, so a record torn by a crash is detected and dropped when the file is reopened
+//The payloads are encoded and decoded by the owner of the file with writeField() and readField()
+class FramedRecordFile final
+{
+public:
+	FramedRecordFile(const std::string folderPath, const std::string filename, const std::string signature);
+	FramedRecordFile(const FramedRecordFile&) = delete;				//Disable copy-constructor
+	FramedRecordFile& operator=(const FramedRecordFile&) = delete;	//Disable assignment-constructor
+	~FramedRecordFile();
+	const std::vector<std::string>& readLoadedPayloads() const;
+	void append(const std::string &payload);
+	void truncate(const int nRecords);
+
+	template<class T> static void writeField(std::string &payload, const T &field)
+	{
+		payload.append(reinterpret_cast<const char*>(&field), sizeof(T));
+	}
+
+	template<class T> static T readField(const std::string &payload, std::size_t &pos)
+	{
+		if (pos + sizeof(T) > payload.size())
+			throw std::runtime_error((std::string)__FUNCTION__ + ": Truncated record");
+		T field;
+		std::memcpy(&field, &payload[pos], sizeof(T));
+		pos += sizeof(T);
+		return field;
+	}
+private:
+	const std::string mFullPath;
+	const std::string mFilename;
+	const std::string mSignature;
+	std::ofstream mFileHandle;
+	std::vector<std::string> mLoadedPayloads;						//Valid records found when the file was opened
+	std::vector<std::streamoff> mRecordPositions;					//Start of each record in the file, including the appended ones
+	std::streamoff mFileSize;
+};
+
+//Append-only binary manifest of the tiles saved to disk. The records are indexed in memory for O(1) lookup by cut, tile, and wavelength
+//Each record is framed by its length and a CRC-32 (see FramedRecordFile), so a record torn by a crash is detected and dropped when the manifest is reopened
+class TileManifest final
+{
+public:
+	struct Record
+	{
+		int mCutNumber;
+		int mWavelength_nm;
+		TILEIJ mTileIndicesIJ;
+		POSITION3 mStagePosXYZ;		//Stage position of the tile center in X and Y, and of the stack start in Z
+		U64 mFileSize_byte;
+		U32 mChecksum;				//CRC-32 of the pixels in the order of the pages of the file (see TiffU8::computeCRC32)
+		std::string mFilename;		//Path relative to the folder of the manifest, including the extension
+	};
+	TileManifest(const std::string folderPath, const std::string filename);
+	TileManifest(const TileManifest&) = delete;				//Disable copy-constructor
+	TileManifest& operator=(const TileManifest&) = delete;	//Disable assignment-constructor
+	void append(const int cutNumber, const int wavelength_nm, const TILEIJ tileIndicesIJ, const POSITION3 stagePosXYZ, const std::string filename, const U32 checksum);
+	void append(const int cutNumber, const int wavelength_nm, const TILEIJ tileIndicesIJ, const POSITION3 stagePosXYZ, const std::string filename);
+	void append(const Record &record);
+	int readNrecords() const;
+	const Record& readRecord(const int recordIndex) const;
+	bool contains(const int cutNumber, const int wavelength_nm, const TILEIJ tileIndicesIJ) const;
+	const Record& findTile(const int cutNumber, const int wavelength_nm, const TILEIJ tileIndicesIJ) const;
+	std::vector<int> findRecordsInCut(const int cutNumber) const;
+	std::vector<int> findRecordsAtWavelength(const int wavelength_nm) const;
+	std::vector<int> findRecordsAtTile(const TILEIJ tileIndicesIJ) const;
+	std::vector<int> findRecords(const int cutNumber, const int wavelength_nm) const;
+	bool verifyRecord(const int recordIndex) const;
+	void saveGridStitcherConfig(const std::string folderPath, std::string filename, const int cutNumber, const int wavelength_nm, const TILEOVERLAP3 tileStepIJK_pix, const OVERRIDE override) const;
+	void saveBigStitcherConfig(const std::string folderPath, std::string filename, const int cutNumber, const int wavelength_nm, const int firstTileNumber, const TILEOVERLAP3 tileStepIJK_pix, const OVERRIDE override) const;
+	static void importTileConfiguration(const std::string folderPath, const std::string tileConfigurationFilename, const std::string manifestFilename);
+	static U32 computeChecksum(const std::string folderPath, const std::string filename);
+private:
+	const std::string mFolderPath;
+	FramedRecordFile mFile;
+	std::vector<Record> mRecords;
+	std::unordered_map<U64, int> mIndexByKey;						//Latest record of each combination of cut, wavelength, and tile
+	std::unordered_map<int, std::vector<int>> mIndexByCut;
+	std::unordered_map<int, std::vector<int>> mIndexByWavelength;
+	std::unordered_map<int, std::vector<int>> mIndexByTile;
+
+	static U64 determineKey_(const int cutNumber, const int wavelength_nm, const TILEIJ tileIndicesIJ);
+	void addToIndex_(const int recordIndex);
+	std::string writeStitcherEntry_(const Record &record, const TILEOVERLAP3 tileStepIJK_pix) const;
+	static bool decode_(const std::string &payload, Record &record);
+};
+
+//Packed map of the bright tiles of a tile array. II is the row index and JJ is the column index wrt the tile array
+//Each row of tiles starts at a new 64-bit word, so that counting, union, intersection, and morphology work on whole words. The bits past the last JJ of a row are kept at 0
+class TileBitmap final
+{
+public:
+	TileBitmap(const TILEDIM2 tileArraySizeIJ, const bool value = false);
+	TILEDIM2 readTileArraySizeIJ() const;
+	bool test(const TILEIJ tileIndicesIJ) const;
+	void set(const TILEIJ tileIndicesIJ, const bool value = true);
+	void assign(const bool value);
+	int count() const;
+	int countAndNot(const TileBitmap &other) const;
+	bool operator==(const TileBitmap &other) const;
+	bool operator!=(const TileBitmap &other) const;
+	TileBitmap& operator|=(const TileBitmap &other);
+	TileBitmap& operator&=(const TileBitmap &other);
+	void dilate(const int margin_tiles);
+	void erode(const int margin_tiles);
+	void fillHoles();
+	void saveToText(const std::string folderPath, std::string filename, const OVERRIDE override) const;
+	static TileBitmap loadFromText(const std::string folderPath, const std::string filename, const TILEDIM2 tileArraySizeIJ);
+private:
+	TILEDIM2 mArraySizeIJ;
+	int mNwordsPerRow;
+	U64 mLastWordMask;				//Valid bits of the last word of a row
+	std::vector<U64> mWords;
+
+	void checkTileIndices_(const TILEIJ tileIndicesIJ) const;
+	void checkSize_(const TileBitmap &other) const;
+	void shiftRow_(const U64 *input, U64 *output, const int shift) const;
+	void morphology_(const int margin_tiles, const bool isDilation);
+};
+
+//Scratch memory of the TiffU8 operators. Each thread owns an arena, so the operators do not lock and the blocks are reused across calls instead of being allocated and freed every time
+//The image block is ping-ponged: the operator writes the corrected stack into the block and swaps it with the array of the image, so the old array becomes the block of the next call
+class ScratchArena final
+{
+public:
+	enum class SLOT { LINE, ACCUMULATOR, LUT };	//Per-row buffer, per-pixel sums, and precomputed lookup tables
+
+	static ScratchArena& local();				//Arena of the calling thread
+	ScratchArena(const ScratchArena&) = delete;				//Disable copy-constructor
+	ScratchArena& operator=(const ScratchArena&) = delete;	//Disable assignment-constructor
+	~ScratchArena();
+	U8* acquireImage(const int nPix);
+	void swapImage(U8* &array);
+	template<class T>
+	T* acquire(const SLOT slot, const int count, const bool zeroed = false)
+	{
+		return reinterpret_cast<T*>(acquireSlot_(slot, count * sizeof(T), zeroed));
+	}
+	void release();
+
+	//Totals over all the threads
+	static U64 readResident_byte();
+	static U64 readHighWater_byte();
+	static U64 readNallocations();
+	static U64 readNreuses();
+private:
+	static const int mNslots{ 3 };
+	U8 *mImage;									//Block swapped with the array of the image
+	std::size_t mImageCapacity_byte;
+	std::unique_ptr<U8[]> mSlots[mNslots];		//The memory returned by new[] is aligned for any fundamental type
+	std::size_t mSlotCapacity_byte[mNslots];
+
+	ScratchArena();
+	U8* acquireSlot_(const SLOT slot, const std::size_t size_byte, const bool zeroed);
+	void resize_(const std::size_t oldSize_byte, const std::size_t newSize_byte);
+};
+
+class TiffU8;
+
+//Non-owning view of the frames of an image. The pixel (frame, row, col) is at mOrigin + frame * mFrameStride + row * mRowStride + col * mColStride
+//The strides can be negative, so that mirroring the rows, reversing the lines, cropping, and splitting or reversing the frames are O(1) and do not touch the pixels
+//The view does not extend the lifetime of the image
+class ImageView final
+{
+public:
+	ImageView(U8 *origin, const int heightPerFrame_pix, const int widthPerFrame_pix, const int nFrames, const std::ptrdiff_t rowStride, const std::ptrdiff_t colStride, const std::ptrdiff_t frameStride);
+	int readHeightPerFrame_pix() const;
+	int readWidthPerFrame_pix() const;
+	int readNframes() const;
+	U8& pixel(const int frameIndex, const int row_pix, const int col_pix) const
+	{
+		const int mappedRow_pix{ (frameIndex & 1) == mMirroredParity ? mHeightPerFrame_pix - 1 - row_pix : row_pix };
+		return mOrigin[frameIndex * mFrameStride + mappedRow_pix * mRowStride + col_pix * mColStride];
+	}
+	ImageView crop(const int top_pix, const int left_pix, const int height_pix, const int width_pix) const;
+	ImageView selectFrames(const int firstFrameIndex, const int nFrames) const;
+	ImageView splitFrames(const int nFrames) const;
+	ImageView mergeFrames() const;
+	ImageView mirrorRows() const;
+	ImageView mirrorColumns() const;
+	ImageView mirrorOddFrames() const;
+	ImageView reverseFrames() const;
+	void copyRow(const int frameIndex, const int row_pix, U8 *output) const;
+	U32 computeCRC32() const;
+	TiffU8 copyToTiff() const;
+	void saveToFile(const std::string folderPath, std::string filename, const TIFFSTRUCT tiffStruct, const OVERRIDE override) const;
+private:
+	U8 *mOrigin;							//Pixel (0, 0, 0)
+	int mHeightPerFrame_pix;
+	int mWidthPerFrame_pix;
+	int mNframes;
+	std::ptrdiff_t mRowStride;
+	std::ptrdiff_t mColStride;
+	std::ptrdiff_t mFrameStride;
+	int mMirroredParity{ -1 };				//The frames with index % 2 == mMirroredParity are mirrored vertically. -1 for none
+};
+
 //For manipulating and saving U8 Tiff images
 class TiffU8
 {
 public:
 	TiffU8(const std::string folderPath, const std::string filename);
 	TiffU8(const TiffU8& tiff);
+	TiffU8(TiffU8&& tiff) noexcept;
 	TiffU8(const U8* inputArray, const int heightPerFrame_pix, const int widthPerFrame_pix, int nFrames = 1);
 	TiffU8(const std::vector<U8> &inputImage, const int heightPerFrame_pix, const int widthPerFrame_pix, const int nFrames = 1);
 	TiffU8(const int height_pix, const int width_pix, const int nFrames = 1);
 	~TiffU8();
+	TiffU8& operator=(const TiffU8& tiff);
+	TiffU8& operator=(TiffU8&& tiff) noexcept;
 	U8* const data() const;
+	ImageView view() const;
 	int readHeightPerFrame_pix() const;
 	int readWidthPerFrame_pix() const;
 	int readNpixPerFrame_pix() const;
@@ -74,6 +282,7 @@ public:
 	void mergePMT16Xchan(const int heightPerChannelPerFrame, const U8* inputArrayA, const U8* inputArrayB) const;
 	void saveToFile(const std::string folderPath, std::string filename, const TIFFSTRUCT tiffStruct, const OVERRIDE override, const SCANDIR scanDirZ = SCANDIR::UPWARD) const;
 	void saveToTxt(const std::string folderPath, const std::string fileName) const;
+	U32 computeCRC32(const SCANDIR scanDirZ = SCANDIR::UPWARD) const;
 
 	void mirrorOddFrames();
 	void mirrorSingleFrame();
@@ -99,4 +308,49 @@ private:
 	int mNpixPerFrame;	//Total number of pixels in a frame
 	int mNpixAllFrames;	//Total number of pixels in all the frames
 	//int mStripSize;	//I think this was implemented to allow different channels (e.g., RGB) on each pixel
+};
+
+//Large single-frame image stored on disk in square chunks. Only the most recently used chunks are kept in memory, within the memory budget
+//The chunks that have never been written read as zeros. The backing file is deleted when the canvas is destroyed
+class ChunkedCanvas final
+{
+public:
+	ChunkedCanvas(const int height_pix, const int width_pix, const std::string folderPath, const U64 memoryBudget_byte = 256000000, const int chunkSize_pix = 256);
+	ChunkedCanvas(const ChunkedCanvas&) = delete;				//Disable copy-constructor
+	ChunkedCanvas& operator=(const ChunkedCanvas&) = delete;	//Disable assignment-constructor
+	~ChunkedCanvas();
+	int readHeight_pix() const;
+	int readWidth_pix() const;
+	int readChunkSize_pix() const;
+	void writeRect(const U8 *input, const int inputBytesPerRow, const int top_pix, const int left_pix, const int height_pix, const int width_pix);
+	void readRect(U8 *output, const int outputBytesPerRow, const int top_pix, const int left_pix, const int height_pix, const int width_pix) const;
+	TiffU8 readTiff(const int top_pix, const int left_pix, const int height_pix, const int width_pix) const;
+	void saveToFile(const std::string folderPath, std::string filename, const OVERRIDE override) const;
+	U64 readResident_byte() const;
+	U64 readPeakResident_byte() const;
+private:
+	struct Chunk
+	{
+		std::vector<U8> mPixels;
+		bool mDirty;								//The chunk has been modified since it was loaded
+		std::list<int>::iterator mLruPosition;
+	};
+	const int mHeight_pix;
+	const int mWidth_pix;
+	const int mChunkSize_pix;						//Pixel height and width of a chunk
+	const int mNchunksII;							//Number of chunks along the image height
+	const int mNchunksJJ;							//Number of chunks along the image width
+	const int mMaxResidentChunks;
+	const std::string mFilePath;
+	mutable std::fstream mFileHandle;
+	mutable std::unordered_map<int, Chunk> mResidentChunks;
+	mutable std::list<int> mLru;					//Indices of the resident chunks. The most recently used is at the front
+	mutable std::vector<bool> mOnDisk;				//The chunk has been written to the backing file at least once
+	mutable U64 mPeakResident_byte{ 0 };
+	mutable std::mutex mMutex;
+
+	void checkRect_(const int top_pix, const int left_pix, const int height_pix, const int width_pix) const;
+	Chunk& acquireChunk_(const int chunkIndex) const;
+	void evictChunk_() const;
+	template<class Function> void forEachChunkInRect_(const int top_pix, const int left_pix, const int height_pix, const int width_pix, Function function) const;
 };
\ No newline at end of file
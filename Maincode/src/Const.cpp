@@ -7,6 +7,7 @@ namespace Constants
 	//extern const std::string g_imagingFolderPath{ "Z:\\_output_remote\\" };
 	extern const std::string g_bitfilePath{ "D:\\OwnCloud\\Codes\\MESOscope\\LabView\\FPGA Bitfiles\\" };	//Define the full path of the bitfile (compiled LV code that runs on the FPGA)
 	extern const std::string g_openclFilePath{ "D:\\OwnCloud\\Codes\\MESOscope\\Maincode\\src\\" };			//OpenCL kernel code
+	extern const std::string g_stackRingName{ "MesoscopeStacks" };												//Shared memory between the acquisition and the processing processes of the stacks
 
 	//GENERAL CONSTANTS
 	extern const double PI{ 3.1415926535897 };
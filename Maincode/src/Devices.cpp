@@ -4,7 +4,8 @@
 //When multiplexing, create a mTiff to store 16 strips of height mRTseq.mHeightPerFrame_pix each
 Image::Image(const RTseq &realtimeSeq) :
 	mRTseq{ realtimeSeq },
-	mTiff{ (static_cast<int>(realtimeSeq.mMultibeam) * (g_nChanPMT - 1) + 1) *  mRTseq.mHeightPerBeamletPerFrame_pix, mRTseq.mWidthPerFrame_pix, mRTseq.mNframes }
+	mTiff{ (static_cast<int>(realtimeSeq.mMultibeam) * (g_nChanPMT - 1) + 1) *  mRTseq.mHeightPerBeamletPerFrame_pix, mRTseq.mWidthPerFrame_pix, mRTseq.mNframes },
+	mScanDir{ realtimeSeq.mScanDir }
 {}
 
 Image::~Image()
@@ -18,29 +19,39 @@ U8* const Image::data() const
 	return mTiff.data();
 }
 
+SCANDIR Image::readScanDir() const
+{
+	return mScanDir;
+}
+
 //Demultiplex the image
 void Image::acquire(const bool saveAllPMT)
 {
-	demultiplex_(saveAllPMT);	//Copy the chuncks of data to mTiff
-	mTiff.mirrorOddFrames();	//The galvos (vectical axis of the image) performs bi-directional scanning frame after frame. Mirror the odd frames vertically
+	DeviceSessions::printFirstAcquisition();
+
+	//The galvos (vectical axis of the image) performs bi-directional scanning frame after frame. The odd frames are mirrored vertically while copying the data to mTiff
+	demultiplex_(saveAllPMT, mTiff.view().mirrorOddFrames());
 }
 
 //To perform continuous scan in X. Different from Image::acquire() because
 //each frame has mHeightPerFrame_pix = 2 (2 swings of the RS) and mNframes = half the pixel height of the final image
 void Image::acquireVerticalStrip(const SCANDIR scanDirX)
 {
-	const bool saveAllPMT{ false };
+	DeviceSessions::printFirstAcquisition();
 
-	demultiplex_(saveAllPMT);	//Copy the chuncks of data to mTiff
-	mTiff.mergeFrames();		//Set mNframes = 1 to treat mArray as a single image	
+	const bool saveAllPMT{ false };
 
-	//Mirror the entire image if a reversed scan was performed
+	//Treat mArray as a single image and mirror it entirely if a reversed scan was performed. The mirroring is done while copying the data to mTiff
+	ImageView strip{ mTiff.view().mergeFrames() };
 	switch (scanDirX)
 	{
 	case SCANDIR::RIGHTWARD:
-		mTiff.mirrorSingleFrame();			
+		strip = strip.mirrorRows();
 		break;
 	}
+
+	demultiplex_(saveAllPMT, strip.splitFrames(mTiff.readNframes()));	//Copy the chuncks of data to mTiff
+	mTiff.mergeFrames();												//Set mNframes = 1 to treat mArray as a single image
 }
 
 //Image post processing
@@ -88,58 +99,81 @@ void Image::binFrames(const int nFramesPerBin)
 //Save each frame in mTiff in either a single Tiff page or different Tiff pages
 void Image::save(const std::string folderPath, std::string filename, const TIFFSTRUCT pageStructure, const OVERRIDE override) const
 {
-	mTiff.saveToFile(folderPath, filename, pageStructure, override, mRTseq.mScanDir);
+	mTiff.saveToFile(folderPath, filename, pageStructure, override, mScanDir);
 }
 
-//Demultiplex the image
-void Image::demultiplex_(const bool saveAllPMT)
+//Checksum of the stack saved by save() as MULTIPAGE, computed from memory
+U32 Image::computeCRC32() const
+{
+	return mTiff.computeCRC32(mScanDir);
+}
+
+//Demultiplex the image. destination is a view of mTiff with the frame layout of the concatenated data
+void Image::demultiplex_(const bool saveAllPMT, const ImageView &destination)
 {	
-	if (mRTseq.mMultibeam || saveAllPMT)
-		demuxAllChannels_(saveAllPMT);
+	mScanDir = mRTseq.mScanDir;
+
+	const RawStackLayout layout{ mRTseq.mHeightPerBeamletPerFrame_pix, mRTseq.mWidthPerFrame_pix, mRTseq.mNframes, mRTseq.mMultibeam, mRTseq.mPMT16Xchan };
+	demultiplex(layout, mRTseq.dataBufferA(), mRTseq.dataBufferB(), saveAllPMT, destination);
+}
+
+//Demultiplex raw data that does not come from a RTseq, e.g. the stacks published to a StackRing by another process
+void Image::demultiplex(const RawStackLayout &layout, const U32 *bufferA, const U32 *bufferB, const bool saveAllPMT, const ImageView &destination)
+{
+	if (layout.mMultibeam || saveAllPMT)
+		demuxAllChannels_(layout, bufferA, bufferB, saveAllPMT, destination);
 	else
-		demuxSingleChannel_();
+		demuxSingleChannel_(layout, bufferA, bufferB, destination);
 }
 
 //Singlebeam. Only readn and process the data from a single channel for speed
-void Image::demuxSingleChannel_()
+void Image::demuxSingleChannel_(const RawStackLayout &layout, const U32 *bufferA, const U32 *bufferB, const ImageView &destination)
 {
 	//Shift mBufferA and  mBufferB to the right a number of bits depending on the PMT channel to be read
 	//For mBufferA, shift 0 bits for CH00, 4 bits for CH01, 8 bits for CH02, etc...
 	//For mMultiplexedArrayAB, shift 0 bits for CH08, 4 bits for CH09, 8 bits for CH10, etc...
-	const unsigned int nBitsToShift{ 4 * static_cast<unsigned int>(mRTseq.mPMT16Xchan) };
+	const unsigned int nBitsToShift{ 4 * static_cast<unsigned int>(layout.mPMT16Xchan) };
 
 	//Demultiplex mBufferA (CH00-CH07). Each U32 element in mBufferA has the multiplexed structure | CH07 (MSB) | CH06 | CH05 | CH04 | CH03 | CH02 | CH01 | CH00 (LSB) |
-	if (mRTseq.mPMT16Xchan >= RTseq::PMT16XCHAN::CH00 && mRTseq.mPMT16Xchan <= RTseq::PMT16XCHAN::CH07)
-	{
-		for (int pixIndex = 0; pixIndex < mRTseq.mNpixPerBeamletAllFrames; pixIndex++)
-		{
-			const int upscaled{ g_upscalingFactor * (((mRTseq.dataBufferA())[pixIndex] >> nBitsToShift) & 0x0000000F) };			//Extract the count from the last 4 bits and upscale it to have a 8-bit pixel
-			(mTiff.data())[pixIndex] = Util::clipU8top(upscaled);																	//Clip if overflow
-		}
-	}
 	//Demultiplex mBufferB (CH08-CH15). Each U32 element in mBufferB has the multiplexed structure | CH15 (MSB) | CH14 | CH13 | CH12 | CH11 | CH10 | CH09 | CH08 (LSB) |
-	else if (mRTseq.mPMT16Xchan >= RTseq::PMT16XCHAN::CH08 && mRTseq.mPMT16Xchan <= RTseq::PMT16XCHAN::CH15)
+	const U32 *buffer;
+	if (layout.mPMT16Xchan >= RTseq::PMT16XCHAN::CH00 && layout.mPMT16Xchan <= RTseq::PMT16XCHAN::CH07)
+		buffer = bufferA;
+	else if (layout.mPMT16Xchan >= RTseq::PMT16XCHAN::CH08 && layout.mPMT16Xchan <= RTseq::PMT16XCHAN::CH15)
+		buffer = bufferB;
+	else
+		return;//If PMT16XCHAN::CENTERED, do anything
+
+	//The data of all the frames is concatenated. Write each row to its place in destination. The rows are independent, so they are demultiplexed in parallel
+	const int heightPerFrame_pix{ destination.readHeightPerFrame_pix() };
+	const int width_pix{ destination.readWidthPerFrame_pix() };
+	const int nRowsAllFrames{ destination.readNframes() * heightPerFrame_pix };
+#pragma omp parallel for schedule(static)
+	for (int iterRowAllFrames = 0; iterRowAllFrames < nRowsAllFrames; iterRowAllFrames++)
 	{
-		for (int pixIndex = 0; pixIndex < mRTseq.mNpixPerBeamletAllFrames; pixIndex++)
+		const int iterFrame{ iterRowAllFrames / heightPerFrame_pix };
+		const int iterRow_pix{ iterRowAllFrames % heightPerFrame_pix };
+		const U32* const inputRow{ &buffer[static_cast<std::size_t>(iterRowAllFrames) * width_pix] };
+		for (int iterCol_pix = 0; iterCol_pix < width_pix; iterCol_pix++)
 		{
-			const int upscaled{ g_upscalingFactor * (((mRTseq.dataBufferB())[pixIndex] >> nBitsToShift) & 0x0000000F) };			//Extract the count from the last 4 bits and upscale it to have a 8-bit pixel
-			(mTiff.data())[pixIndex] = Util::clipU8top(upscaled);																	//Clip if overflow
+			const int upscaled{ g_upscalingFactor * ((inputRow[iterCol_pix] >> nBitsToShift) & 0x0000000F) };			//Extract the count from the last 4 bits and upscale it to have a 8-bit pixel
+			destination.pixel(iterFrame, iterRow_pix, iterCol_pix) = Util::clipU8top(upscaled);						//Clip if overflow
 		}
 	}
-	else
-		;//If PMT16XCHAN::CENTERED, do anything
 }
 
 //Each U32 element in mBufferA and mBufferB has the multiplexed structure:
 //mBufferA[i] =  | CH07 (MSB) | CH06 | CH05 | CH04 | CH03 | CH02 | CH01 | CH00 (LSB) |
 //mBufferB[i] =  | CH15 (MSB) | CH14 | CH13 | CH12 | CH11 | CH10 | CH09 | CH08 (LSB) |
-void Image::demuxAllChannels_(const bool saveAllPMT)
+//When multibeam, the channels are written directly to their place in destination, with the same layout as TiffU8::mergePMT16Xchan(). No intermediate copy of the channels is made
+void Image::demuxAllChannels_(const RawStackLayout &layout, const U32 *bufferA, const U32 *bufferB, const bool saveAllPMT, const ImageView &destination)
 {
-	//Use 2 separate arrays to allow parallelization in the future
-	TiffU8 CountA{ g_nChanPMT / 2 * mRTseq.mHeightPerBeamletPerFrame_pix, mRTseq.mWidthPerFrame_pix, mRTseq.mNframes };		//Tiff for storing the photocounts in CH00-CH07
-	TiffU8 CountB{ g_nChanPMT / 2 * mRTseq.mHeightPerBeamletPerFrame_pix, mRTseq.mWidthPerFrame_pix, mRTseq.mNframes };		//Tiff for storing the photocounts in CH08-CH15
+	const int nChanPMThalf{ g_nChanPMT / 2 };
+	const int heightPerChannel_pix{ layout.mHeightPerBeamletPerFrame_pix };
+	const int width_pix{ layout.mWidthPerFrame_pix };
+	const int nPixPerBeamletAllFrames{ heightPerChannel_pix * width_pix * layout.mNframes };
 
-	/*Iterate over all the pixels and frames (all the frames are concatenated in a single-long image), demultiplex the counts, and store them in CountA and CountB
+	/*For debugging, also store the photocounts of each channel in CountA (CH00-CH07) and CountB (CH08-CH15)
 	CountA = |CH00 f1|
 			 |  .	 |
 			 |CH00 fN|
@@ -160,34 +194,52 @@ void Image::demuxAllChannels_(const bool saveAllPMT)
 			 |  .	 |
 			 |CH15 fN|
 	*/
+	std::vector<U8> CountA(saveAllPMT ? nChanPMThalf * nPixPerBeamletAllFrames : 0);
+	std::vector<U8> CountB(saveAllPMT ? nChanPMThalf * nPixPerBeamletAllFrames : 0);
 
-	for (int pixIndex = 0; pixIndex < mRTseq.mNpixPerBeamletAllFrames; pixIndex++)
-		for (int chanIndex = 0; chanIndex < g_nChanPMT / 2; chanIndex++)
+	//The frames are independent, so they are demultiplexed in parallel
+#pragma omp parallel for schedule(static)
+	for (int iterFrame = 0; iterFrame < layout.mNframes; iterFrame++)
+		for (int chanIndex = 0; chanIndex < nChanPMThalf; chanIndex++)
 		{
-			//Buffer A (CH00-CH07)
-			const int upscaledA{ g_upscalingFactor * ((mRTseq.dataBufferA())[pixIndex] & 0x0000000F) };					//Extract the count from the first 4 bits and upscale it to have a 8-bit pixel
-			(CountA.data())[chanIndex * mRTseq.mNpixPerBeamletAllFrames + pixIndex] = Util::clipU8top(upscaledA);		//Clip if overflow
-			(mRTseq.dataBufferA())[pixIndex] = (mRTseq.dataBufferA())[pixIndex] >> 4;									//Shift 4 places to the right for the next iteration
-
-			//Buffer B (CH08-CH15)
-			const int upscaledB{ g_upscalingFactor * ((mRTseq.dataBufferB())[pixIndex] & 0x0000000F) };					//Extract the count from the first 4 bits and upscale it to have a 8-bit pixel
-			(CountB.data())[chanIndex * mRTseq.mNpixPerBeamletAllFrames + pixIndex] = Util::clipU8top(upscaledB);		//Clip if overflow
-			(mRTseq.dataBufferB())[pixIndex] = (mRTseq.dataBufferB())[pixIndex] >> 4;									//Shift 4 places to the right for the next iteration
-		}
+			//Position of the channel within the frame. The channel ordering within each frame is reversed wrt the next frame because of the bidirectionality of the scan galvo
+			const int blockA{ iterFrame % 2 ? chanIndex : g_nChanPMT - 1 - chanIndex };							//CH00-CH07
+			const int blockB{ iterFrame % 2 ? chanIndex + nChanPMThalf : nChanPMThalf - 1 - chanIndex };		//CH08-CH15
+			const unsigned int nBitsToShift{ 4 * static_cast<unsigned int>(chanIndex) };
 
-	//Merge all the PMT16X channels into a single image. The strip ordering depends on the scan direction of the galvos (forward or backwards)
-	if (mRTseq.mMultibeam)
-		mTiff.mergePMT16Xchan(mRTseq.mHeightPerBeamletPerFrame_pix, CountA.data(), CountB.data());						//mHeightPerBeamletPerFrame_pix is the height for a single PMT16X channel
+			for (int iterRow_pix = 0; iterRow_pix < heightPerChannel_pix; iterRow_pix++)
+				for (int iterCol_pix = 0; iterCol_pix < width_pix; iterCol_pix++)
+				{
+					const int pixIndex{ (iterFrame * heightPerChannel_pix + iterRow_pix) * width_pix + iterCol_pix };
+					const int upscaledA{ g_upscalingFactor * ((bufferA[pixIndex] >> nBitsToShift) & 0x0000000F) };		//Extract the count from 4 bits and upscale it to have a 8-bit pixel
+					const int upscaledB{ g_upscalingFactor * ((bufferB[pixIndex] >> nBitsToShift) & 0x0000000F) };
+					const U8 countA{ Util::clipU8top(upscaledA) };																		//Clip if overflow
+					const U8 countB{ Util::clipU8top(upscaledB) };
+
+					//Merge all the PMT16X channels into a single image. The strip ordering depends on the scan direction of the galvos (forward or backwards)
+					if (layout.mMultibeam)
+					{
+						destination.pixel(iterFrame, blockA * heightPerChannel_pix + iterRow_pix, iterCol_pix) = countA;
+						destination.pixel(iterFrame, blockB * heightPerChannel_pix + iterRow_pix, iterCol_pix) = countB;
+					}
+
+					if (saveAllPMT)
+					{
+						CountA[chanIndex * nPixPerBeamletAllFrames + pixIndex] = countA;
+						CountB[chanIndex * nPixPerBeamletAllFrames + pixIndex] = countB;
+					}
+				}
+		}
 
 	//For debugging
 	if (saveAllPMT)
 	{
 		//Save all PMT16X channels in separate pages in a Tiff
-		TiffU8 stack{ mRTseq.mHeightPerBeamletPerFrame_pix, mRTseq.mWidthPerFrame_pix, g_nChanPMT * mRTseq.mNframes };
+		TiffU8 stack{ layout.mHeightPerBeamletPerFrame_pix, layout.mWidthPerFrame_pix, g_nChanPMT * layout.mNframes };
 		stack.pushImage(CountA.data(), static_cast<int>(RTseq::PMT16XCHAN::CH00), static_cast<int>(RTseq::PMT16XCHAN::CH07));
 		stack.pushImage(CountB.data(), static_cast<int>(RTseq::PMT16XCHAN::CH08), static_cast<int>(RTseq::PMT16XCHAN::CH15));
 
-		std::string PMT16Xchan_s{ std::to_string(static_cast<int>(mRTseq.mPMT16Xchan)) };
+		std::string PMT16Xchan_s{ std::to_string(static_cast<int>(layout.mPMT16Xchan)) };
 		stack.saveToFile(g_imagingFolderPath, "PMT16Xchan=" + PMT16Xchan_s, TIFFSTRUCT::MULTIPAGE, OVERRIDE::DIS);		//I will leave the global variable g_imagingFolderPath here for now to avoid using too many args when calling the functions
 	}
 }
@@ -330,11 +382,19 @@ void ResonantScanner::setVoltage_(const double controlVoltage)
 #pragma endregion "Resonant scanner"
 
 #pragma region "PMT16X"
+const COM PMT16X::mPort{ COM::PMT16X };
+const int PMT16X::mBaud{ 9600 };
+const int PMT16X::mTimeout{ 300 * ms };
+
 PMT16X::PMT16X()	
 {
 	try
 	{
-		mSerial = std::unique_ptr<serial::Serial>(new serial::Serial("COM" + std::to_string(static_cast<int>(mPort)), mBaud, serial::Timeout::simpleTimeout(mTimeout / ms)));
+		//Take the port opened by DeviceSessions, or open it now
+		mSerial = DeviceSessions::takeSerial(mPort);
+		if (!mSerial)
+			mSerial = openSerial();
+		mTransport = std::unique_ptr<SerialTransport>(new SerialTransport("PMT16X", SerialTransport::makePort(*mSerial), &PMT16X::frameReply, mTimeout));
 	}
 	catch (const serial::IOException)
 	{
@@ -348,6 +408,11 @@ PMT16X::~PMT16X()
 	mSerial->close();
 }
 
+std::unique_ptr<serial::Serial> PMT16X::openSerial()
+{
+	return std::unique_ptr<serial::Serial>(new serial::Serial("COM" + std::to_string(static_cast<int>(mPort)), mBaud, serial::Timeout::simpleTimeout(mTimeout / ms)));
+}
+
 void PMT16X::readAllGains() const
 {
 	std::vector<uint8_t> parameters{ sendCommand_({'I'}) };
@@ -493,19 +558,14 @@ std::vector<uint8_t> PMT16X::sendCommand_(std::vector<uint8_t> command_array) co
 	TxBuffer += "\r";	//End the command line with CR
 	//printHex(TxBuffer); //For debugging
 
-	std::vector<uint8_t> RxBuffer;
-	mSerial->write("\r");						//Wake up the PMT16X
-	mSerial->read(RxBuffer, mRxBufferSize);		//Read the state: 0x0D(0d13) for ready, or 0x45(0d69) for error
+	//Wake up the PMT16X. The state is a single char: 0x0D(0d13) for ready, or 0x45(0d69) for error
+	const std::string state{ mTransport->query("\r", "wake up") };
 
-	//Throw an error if RxBuffer is empty or CR is NOT returned
-	if ( RxBuffer.empty() || RxBuffer.at(0) != 0x0D )
+	//Throw an error if the state is empty or CR is NOT returned
+	if (state.empty() || state.at(0) != 0x0D)
 		throw std::runtime_error((std::string)__FUNCTION__ + ": Failure waking up the PMT16X microcontroller");
-	
-	//printHex(RxBuffer); //For debugging
 
-	RxBuffer.clear(); //Flush the buffer
-	mSerial->write(TxBuffer);
-	mSerial->read(RxBuffer, mRxBufferSize);
+	const std::string RxBuffer{ mTransport->query(TxBuffer, std::string(1, static_cast<char>(command_array.front()))) };
 	
 	//Throw an error if RxBuffer is empty
 	if (RxBuffer.empty())
@@ -513,7 +573,43 @@ std::vector<uint8_t> PMT16X::sendCommand_(std::vector<uint8_t> command_array) co
 
 	//printHex(RxBuffer); //For debugging
 
-	return RxBuffer;
+	return std::vector<uint8_t>{ RxBuffer.begin(), RxBuffer.end() };
+}
+
+//The state after waking up the PMT16X is a single CR. The reply to a command echoes the command char, followed by the data chars of the command, the sumcheck and CR
+//The data chars and the sumcheck can be CR, so the reply is framed by its length, which is set by the command char
+//The error state 0x45 and the replies to other commands are not framed and are read until the timeout
+std::size_t PMT16X::frameReply(const std::string &buffer)
+{
+	if (buffer.empty())
+		return 0;
+
+	std::size_t replyLength;
+	switch (buffer.front())
+	{
+	case '\r':
+		replyLength = 1;
+		break;
+	case 'R':
+		replyLength = 3;		//'R', the sumcheck and CR
+		break;
+	case 'S':
+		replyLength = 4;		//'S', the gain, the sumcheck and CR
+		break;
+	case 'g':
+		replyLength = 5;		//'g', the channel, the gain, the sumcheck and CR
+		break;
+	case 'T':
+		replyLength = 6;		//'T', TEMPH, TEMPL, the alert temperature, the sumcheck and CR
+		break;
+	case 'I':
+	case 'G':
+		replyLength = 3 + g_nChanPMT;	//The command char, the gains, the sumcheck and CR
+		break;
+	default:
+		return 0;
+	}
+	return buffer.size() >= replyLength ? replyLength : 0;
 }
 
 int PMT16X::PMT16XCHANtoInt_(const RTseq::PMT16XCHAN chan) const
@@ -571,6 +667,316 @@ uint8_t PMT16X::sumCheck_(const std::vector<uint8_t> charArray, const int nEleme
 }
 #pragma endregion "PMT16X"
 
+#pragma region "DeviceExecutor"
+const double DeviceExecutor::mFirstPollFraction{ 0.8 };
+const double DeviceExecutor::mMinPollSpacing{ 20. * ms };
+const double DeviceExecutor::mMaxPollSpacing{ 500. * ms };
+const double DeviceExecutor::mCancelCheckSpacing{ 50. * ms };
+thread_local std::shared_ptr<std::atomic<bool>> DeviceExecutor::mCurrentCancelled{ nullptr };
+
+//The workers are started by submit
+DeviceExecutor::DeviceExecutor()
+{}
+
+//The commands already submitted are run before the workers stop
+DeviceExecutor::~DeviceExecutor()
+{
+	{
+		std::lock_guard<std::mutex> lock{ mMutex };
+		mStop = true;
+	}
+	mCondition.notify_all();
+
+	for (std::thread &thread : mThreads)
+		if (thread.joinable())
+			thread.join();
+}
+
+//The future throws the exception thrown by the command, if any
+std::future<void> DeviceExecutor::submit(const DEVICE device, std::function<void()> command)
+{
+	if (device == DEVICE::NDEVICES)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Invalid device");
+
+	//A command submitted by a running command is cancelled together with it
+	Command newCommand{ command, std::promise<void>{}, mCurrentCancelled != nullptr ? mCurrentCancelled : std::make_shared<std::atomic<bool>>(false) };
+	std::future<void> future{ newCommand.mPromise.get_future() };
+	{
+		std::lock_guard<std::mutex> lock{ mMutex };
+		mQueues.at(static_cast<int>(device)).push_back(std::move(newCommand));
+		if (!mThreads.at(static_cast<int>(device)).joinable())
+			mThreads.at(static_cast<int>(device)) = std::thread{ &DeviceExecutor::workerLoop_, this, device };
+	}
+	mCondition.notify_all();
+
+	return future;
+}
+
+//Drop the commands waiting for the device and interrupt the running command at its next status query. The futures of the cancelled commands throw
+//The running command is interrupted only if it waits through pollUntilDone
+void DeviceExecutor::cancel(const DEVICE device)
+{
+	std::deque<Command> cancelledCommands;
+	{
+		std::lock_guard<std::mutex> lock{ mMutex };
+		std::swap(cancelledCommands, mQueues.at(static_cast<int>(device)));
+		if (mRunningCancelled.at(static_cast<int>(device)) != nullptr)
+			*mRunningCancelled.at(static_cast<int>(device)) = true;
+	}
+
+	for (Command &cancelledCommand : cancelledCommands)
+		cancelledCommand.mPromise.set_exception(std::make_exception_ptr(std::runtime_error((std::string)__FUNCTION__ + ": The command was cancelled before running")));
+}
+
+void DeviceExecutor::cancelAll()
+{
+	for (int iterDevice = 0; iterDevice < mNdevices; iterDevice++)
+		cancel(static_cast<DEVICE>(iterDevice));
+}
+
+//Return true if the calling thread runs a command of DeviceExecutor that was cancelled
+bool DeviceExecutor::isCancelled()
+{
+	return mCurrentCancelled != nullptr && *mCurrentCancelled;
+}
+
+//Wait for a device to complete a command. Sleep for most of the expected duration, then query 'isDone' at a spacing that doubles from mMinPollSpacing up to mMaxPollSpacing
+//Return false if the command did not complete within 'timeout'. Throw if the command is cancelled through DeviceExecutor
+bool DeviceExecutor::pollUntilDone(std::function<bool()> isDone, const double expectedDuration, const double timeout)
+{
+	const auto startTime{ std::chrono::high_resolution_clock::now() };
+	auto elapsedTime = [&startTime]() { return std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - startTime).count() * us; };
+	auto sleep = [](const double duration) { std::this_thread::sleep_for(std::chrono::microseconds(static_cast<long long>((std::max)(0., duration) / us))); };
+
+	const double firstPollTime{ (std::min)(mFirstPollFraction * expectedDuration, timeout) };
+	while (elapsedTime() < firstPollTime)
+	{
+		throwIfCancelled_();
+		sleep((std::min)(mCancelCheckSpacing, firstPollTime - elapsedTime()));
+	}
+
+	double pollSpacing{ mMinPollSpacing };
+	while (true)
+	{
+		throwIfCancelled_();
+		if (isDone())
+			return true;
+		if (elapsedTime() >= timeout)
+			return false;
+
+		sleep((std::min)(pollSpacing, timeout - elapsedTime()));
+		pollSpacing = (std::min)(2 * pollSpacing, mMaxPollSpacing);
+	}
+}
+
+void DeviceExecutor::workerLoop_(const DEVICE device)
+{
+	std::deque<Command> &queue{ mQueues.at(static_cast<int>(device)) };
+	while (true)
+	{
+		Command command;
+		{
+			std::unique_lock<std::mutex> lock{ mMutex };
+			mCondition.wait(lock, [&] { return mStop || !queue.empty(); });
+			if (queue.empty())
+				return;			//mStop is set and the queue is drained
+
+			command = std::move(queue.front());
+			queue.pop_front();
+			mRunningCancelled.at(static_cast<int>(device)) = command.mCancelled;
+		}
+
+		mCurrentCancelled = command.mCancelled;
+		try
+		{
+			command.mCommand();
+			command.mPromise.set_value();
+		}
+		catch (...)
+		{
+			command.mPromise.set_exception(std::current_exception());
+		}
+		mCurrentCancelled = nullptr;
+
+		std::lock_guard<std::mutex> lock{ mMutex };
+		mRunningCancelled.at(static_cast<int>(device)) = nullptr;
+	}
+}
+
+void DeviceExecutor::throwIfCancelled_()
+{
+	if (isCancelled())
+		throw std::runtime_error((std::string)__FUNCTION__ + ": The command was cancelled");
+}
+#pragma endregion "DeviceExecutor"
+
+#pragma region "StageMotion"
+StageMotion::StageMotion(const std::array<AxisKinematics, 3> kinematicsXYZ) :
+	mKinematicsXYZ{ kinematicsXYZ }
+{
+	for (const AxisKinematics &kinematics : mKinematicsXYZ)
+		if (kinematics.mAcc <= 0 || kinematics.mSettlingTime < 0)
+			throw std::invalid_argument((std::string)__FUNCTION__ + ": The stage accelerations must be > 0 and the settling times >= 0");
+}
+
+//Trapezoidal velocity profile. If the distance is too short for reaching 'vel', the profile is triangular
+double StageMotion::predictMotionTime(const AXIS axis, const double distance, const double vel) const
+{
+	if (vel <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The velocity must be > 0");
+
+	if (distance <= 0)
+		return 0;
+
+	const double acc{ mKinematicsXYZ.at(axis).mAcc };
+	double motionTime;
+	if (distance < vel * vel / acc)
+		motionTime = 2 * std::sqrt(distance / acc);
+	else
+		motionTime = distance / vel + vel / acc;
+
+	return motionTime + mKinematicsXYZ.at(axis).mSettlingTime;
+}
+
+//Call right after the move command returns, which is when the stage starts moving
+void StageMotion::startMove(const AXIS axis, const double distance, const double vel)
+{
+	if (distance <= 0)
+		return;
+
+	const double motionTime{ (std::max)(0., predictMotionTime(axis, distance, vel) + mArrivalCorrectionXYZ.at(axis)) };
+	const TIMEPOINT now{ std::chrono::high_resolution_clock::now() };
+	mPredictedArrivalXYZ.at(axis) = now + std::chrono::microseconds(static_cast<long long>(motionTime / us));
+	mDeadlineXYZ.at(axis) = now + std::chrono::microseconds(static_cast<long long>((2 * motionTime + mTimeoutMargin) / us));
+	mIsPendingXYZ.at(axis) = true;
+}
+
+//Wait for the stages in the order of their predicted arrival. The stages without a pending move are not polled
+void StageMotion::waitForMotionToStop(const std::vector<AXIS> axes, std::function<bool(const AXIS)> isMoving)
+{
+	std::vector<AXIS> pendingAxes;
+	for (const AXIS axis : axes)
+		if (mIsPendingXYZ.at(axis))
+			pendingAxes.push_back(axis);
+
+	std::sort(pendingAxes.begin(), pendingAxes.end(), [this](const AXIS axis1, const AXIS axis2) { return mPredictedArrivalXYZ.at(axis1) < mPredictedArrivalXYZ.at(axis2); });
+
+	for (const AXIS axis : pendingAxes)
+		waitForMotionToStopSingle_(axis, isMoving);
+}
+
+//Send a command to the controllers of 'axes' at the same time. Each stage has its own controller, so the commands do not wait for each other
+void StageMotion::issueConcurrently(const std::vector<AXIS> axes, std::function<void(const AXIS)> command) const
+{
+	const std::array<DeviceExecutor::DEVICE, 3> deviceXYZ{ DeviceExecutor::DEVICE::STAGEX, DeviceExecutor::DEVICE::STAGEY, DeviceExecutor::DEVICE::STAGEZ };
+
+	std::vector<std::future<void>> futures;
+	for (const AXIS axis : axes)
+		futures.push_back(mExecutor.submit(deviceXYZ.at(axis), [command, axis] { command(axis); }));
+
+	//Wait for all the controllers before throwing, so that none of them is left running
+	for (std::future<void> &future : futures)
+		future.wait();
+	for (std::future<void> &future : futures)
+		future.get();
+}
+
+//Interrupt the wait for the stages. The thread waiting in waitForMotionToStop() throws within mCancelCheckSpacing, or after the poll in progress
+//If no thread is waiting, the next wait throws
+void StageMotion::cancel()
+{
+	mCancelled = true;
+}
+
+int StageMotion::readNpolls() const
+{
+	return mNpolls;
+}
+
+double StageMotion::readArrivalCorrection(const AXIS axis) const
+{
+	return mArrivalCorrectionXYZ.at(axis);
+}
+
+//PI_IsMoving reports the state of the stage approx in the middle of the call. The first poll is timed so that its middle falls at the predicted arrival
+void StageMotion::waitForMotionToStopSingle_(const AXIS axis, std::function<bool(const AXIS)> isMoving)
+{
+	const TIMEPOINT predictedArrival{ mPredictedArrivalXYZ.at(axis) };
+	sleep_(elapsedTime_(std::chrono::high_resolution_clock::now(), predictedArrival) - mPollLatency / 2);
+
+	double pollSpacing{ mMinPollSpacing };
+	TIMEPOINT lastMovingTime;				//Middle of the last poll that reported the stage moving
+	bool wasMovingOnce{ false };
+	while (true)
+	{
+		const TIMEPOINT pollStartTime{ std::chrono::high_resolution_clock::now() };
+		const bool moving{ isMoving(axis) };
+		const TIMEPOINT pollEndTime{ std::chrono::high_resolution_clock::now() };
+		mNpolls++;
+
+		const double pollDuration{ elapsedTime_(pollStartTime, pollEndTime) };
+		mPollLatency = (1 - mLearningRate) * mPollLatency + mLearningRate * pollDuration;
+		const TIMEPOINT pollMiddleTime{ pollStartTime + (pollEndTime - pollStartTime) / 2 };
+
+		if (!moving)
+		{
+			//If the first poll sees the stage stopped, the stage may have arrived well before. Probe the arrival slightly earlier next time
+			//Otherwise, the stage arrived between the last 2 polls
+			double arrivalError;
+			if (wasMovingOnce)
+				arrivalError = elapsedTime_(predictedArrival, lastMovingTime + (pollMiddleTime - lastMovingTime) / 2);
+			else
+				arrivalError = -mMinPollSpacing;
+
+			mArrivalCorrectionXYZ.at(axis) += mLearningRate * arrivalError;
+			break;
+		}
+
+		if (pollEndTime >= mDeadlineXYZ.at(axis))
+		{
+			mIsPendingXYZ.at(axis) = false;
+			const std::array<std::string, 3> axisName{ "X", "Y", "Z" };
+			throw std::runtime_error((std::string)__FUNCTION__ + ": The stage " + axisName.at(axis) + " did not stop within the timeout");
+		}
+
+		wasMovingOnce = true;
+		lastMovingTime = pollMiddleTime;
+		sleep_(pollSpacing);
+		pollSpacing = (std::min)(2 * pollSpacing, mMaxPollSpacing);
+	}
+	mIsPendingXYZ.at(axis) = false;
+}
+
+double StageMotion::elapsedTime_(const TIMEPOINT from, const TIMEPOINT to) const
+{
+	return std::chrono::duration<double, std::micro>(to - from).count() * us;
+}
+
+//Sleep in steps of mCancelCheckSpacing, so that a cancellation is not delayed by the sleep before the first poll
+void StageMotion::sleep_(const double duration)
+{
+	const TIMEPOINT wakeTime{ std::chrono::high_resolution_clock::now() + std::chrono::microseconds(static_cast<long long>((std::max)(0., duration) / us)) };
+	while (true)
+	{
+		throwIfCancelled_();
+		const double remainingTime{ elapsedTime_(std::chrono::high_resolution_clock::now(), wakeTime) };
+		if (remainingTime <= 0)
+			return;
+		std::this_thread::sleep_for(std::chrono::microseconds(static_cast<long long>((std::min)(remainingTime, mCancelCheckSpacing) / us)));
+	}
+}
+
+//The pending moves are dropped, so that the next wait does not poll for them
+void StageMotion::throwIfCancelled_()
+{
+	if (mCancelled.exchange(false) || DeviceExecutor::isCancelled())
+	{
+		mIsPendingXYZ = { false, false, false };
+		throw std::runtime_error((std::string)__FUNCTION__ + ": The wait for the stages was cancelled");
+	}
+}
+#pragma endregion "StageMotion"
+
 #pragma region "Stages"
 Stage::Stage(const double velX, const double velY, const double velZ, const std::vector<LIMIT2> stageSoftPosLimXYZ) :
 	mSoftPosLimXYZ{ stageSoftPosLimXYZ }
@@ -578,16 +984,9 @@ Stage::Stage(const double velX, const double velY, const double velZ, const std:
 	if (velX <= 0 || velY <= 0 || velZ <= 0)
 		throw std::runtime_error((std::string)__FUNCTION__ + ": The stage velocities must be > 0");
 
-	const std::string stageIDx{ "116049107" };	//X-stage (V-551.4B)
-	const std::string stageIDy{ "116049105" };	//Y-stage (V-551.2B)
-	const std::string stageIDz{ "0165500631" };	//Z-stage (ES-100)
-
-	//Open the connections to the stage controllers and assign the IDs
+	//Open the connections to the stage controllers and assign the IDs. Take the connections opened by DeviceSessions, or open them concurrently
 	std::cout << "Establishing connection with the stages\n";
-	mHandleXYZ.at(XX) = PI_ConnectUSB(stageIDx.c_str());
-	mHandleXYZ.at(YY) = PI_ConnectUSB(stageIDy.c_str());
-	mHandleXYZ.at(ZZ) = PI_ConnectRS232(mPort_z, mBaud_z); // nPortNr = 4 for "COM4" (CGS manual p12). For some reason 'PI_ConnectRS232' connects faster than 'PI_ConnectUSB'. More comments in [1]
-	//mHandleXYZ.at(Z) = PI_ConnectUSB(stageIDz.c_str());
+	mMotion.issueConcurrently({ XX, YY, ZZ }, [this](const AXIS axis) { mHandleXYZ.at(axis) = DeviceSessions::takeStageHandle(axis); });
 
 	if (mHandleXYZ.at(XX) < 0)
 		throw std::runtime_error((std::string)__FUNCTION__ + ": Could not connect to the stage X");
@@ -600,20 +999,26 @@ Stage::Stage(const double velX, const double velY, const double velZ, const std:
 
 	std::cout << "Connection with the stages successfully established\n";
 
-	//Download the current position
-	mPosXYZ.XX = downloadPositionSingle_(XX);
-	mPosXYZ.YY = downloadPositionSingle_(YY);
-	mPosXYZ.ZZ = downloadPositionSingle_(ZZ);
+	//Download the current positions and velocities. Each controller is queried on its own thread
+	std::array<double, 3> positionXYZ, velXYZ;
+	mMotion.issueConcurrently({ XX, YY, ZZ }, [this, &positionXYZ, &velXYZ](const AXIS axis) {
+		positionXYZ.at(axis) = downloadPositionSingle_(axis);
+		velXYZ.at(axis) = downloadVelSingle_(axis); });
 
-	//Download the current velocities
-	mVelXYZ.XX = downloadVelSingle_(XX);
-	mVelXYZ.YY = downloadVelSingle_(YY);
-	mVelXYZ.ZZ = downloadVelSingle_(ZZ);
+	mPosXYZ.XX = positionXYZ.at(XX);
+	mPosXYZ.YY = positionXYZ.at(YY);
+	mPosXYZ.ZZ = positionXYZ.at(ZZ);
+	mVelXYZ.XX = velXYZ.at(XX);
+	mVelXYZ.YY = velXYZ.at(YY);
+	mVelXYZ.ZZ = velXYZ.at(ZZ);
 
 	configDOtriggers_();				//Configure the stage velocities and DO triggers
 	setVelXYZ({ velX, velY, velZ });	//Set the stage velocities
 }
 
+const int Stage::mPort_z{ 4 };
+const int Stage::mBaud_z{ 38400 };
+
 Stage::~Stage()
 {
 	//Close the Connections
@@ -623,6 +1028,27 @@ Stage::~Stage()
 	//std::cout << "Connection with the stages successfully closed\n";
 }
 
+//Open the connection to the controller of a stage. Return the ID of the controller, or a negative value if the connection failed
+int Stage::connectController(const AXIS axis)
+{
+	const std::string stageIDx{ "116049107" };	//X-stage (V-551.4B)
+	const std::string stageIDy{ "116049105" };	//Y-stage (V-551.2B)
+	const std::string stageIDz{ "0165500631" };	//Z-stage (ES-100)
+
+	switch (axis)
+	{
+	case XX:
+		return PI_ConnectUSB(stageIDx.c_str());
+	case YY:
+		return PI_ConnectUSB(stageIDy.c_str());
+	case ZZ:
+		return PI_ConnectRS232(mPort_z, mBaud_z); // nPortNr = 4 for "COM4" (CGS manual p12). For some reason 'PI_ConnectRS232' connects faster than 'PI_ConnectUSB'. More comments in [1]
+		//return PI_ConnectUSB(stageIDz.c_str());
+	default:
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Invalid stage");
+	}
+}
+
 //Recall the current position for the 3 stages
 POSITION3 Stage::readPosXYZ() const
 {
@@ -657,10 +1083,13 @@ void Stage::setCurrentPosition_(const AXIS axis, const double position)
 	{
 	case XX:
 		mPosXYZ.XX = position;
+		break;
 	case YY:
 		mPosXYZ.YY = position;
+		break;
 	case ZZ:
 		mPosXYZ.ZZ = position;
+		break;
 	}
 }
 
@@ -688,10 +1117,13 @@ void Stage::setCurrentVelocity_(const AXIS axis, const double velocity)
 	{
 	case XX:
 		mVelXYZ.XX = velocity;
+		break;
 	case YY:
 		mVelXYZ.YY = velocity;
+		break;
 	case ZZ:
 		mVelXYZ.ZZ = velocity;
+		break;
 	}
 }
 
@@ -705,39 +1137,67 @@ double Stage::downloadPositionSingle_(const AXIS axis)
 	return position_mm * mm;	//Multiply by mm to convert from explicit to implicit units
 }
 
-//Move the stage to the requested position
-void Stage::moveSingle(const AXIS axis, const double position)
+void Stage::checkPositionLimits_(const AXIS axis, const double position) const
 {
-	//Check if the requested position is within range
 	if (position < mSoftPosLimXYZ.at(axis).MIN || position > mSoftPosLimXYZ.at(axis).MAX)
 		throw std::invalid_argument((std::string)__FUNCTION__ + ": The requested position is out of the soft limits of the stage " + convertAxisToString_(axis));
 	if (position < mTravelRangeXYZ.at(axis).MIN || position > mTravelRangeXYZ.at(axis).MAX)
 		throw std::invalid_argument((std::string)__FUNCTION__ + ": The requested position is out of the physical limits of the stage " + convertAxisToString_(axis));
+}
 
-	//Move the stage
-	if (readCurrentPosition_(axis) != position)										//Move only if the requested position is different from the current position
+//Send the move command and predict the arrival of the stage. Only the members of 'axis' are modified, so that the 3 stages can be commanded from different threads
+void Stage::issueMove_(const AXIS axis, const double position)
+{
+	const double currentPosition{ readCurrentPosition_(axis) };
+	if (currentPosition != position)												//Move only if the requested position is different from the current position
 	{
 		const double position_mm{ position / mm };									//Divide by mm to convert from implicit to explicit units
 		if (!PI_MOV(mHandleXYZ.at(axis), mNstagesPerController, &position_mm))		//~14 ms to execute this function
 			throw std::runtime_error((std::string)__FUNCTION__ + ": Unable to move stage " + convertAxisToString_(axis) + " to the target position (maybe hardware limits?)");
 
+		mMotion.startMove(axis, std::abs(position - currentPosition), readCurrentVelocity_(axis));
 		setCurrentPosition_(axis, position);
 	}
 }
 
-//Move the 2 stages to the requested position
+//Move the stage to the requested position
+void Stage::moveSingle(const AXIS axis, const double position)
+{
+	checkPositionLimits_(axis, position);
+	issueMove_(axis, position);
+}
+
+//Move the 2 stages to the requested position. The move commands are sent to the controllers concurrently
 void Stage::moveXY(const POSITION2 posXY)
 {
-	moveSingle(XX, posXY.XX);
-	moveSingle(YY, posXY.YY);
+	checkPositionLimits_(XX, posXY.XX);
+	checkPositionLimits_(YY, posXY.YY);
+
+	mMotion.issueConcurrently({ XX, YY }, [this, &posXY](const AXIS axis) { issueMove_(axis, axis == XX ? posXY.XX : posXY.YY); });
 }
 
-//Move the 3 stages to the requested position
+//Move the 3 stages to the requested position. The move commands are sent to the controllers concurrently
 void Stage::moveXYZ(const POSITION3 posXYZ)
 {
-	moveSingle(XX, posXYZ.XX);
-	moveSingle(YY, posXYZ.YY);
-	moveSingle(ZZ, posXYZ.ZZ);
+	checkPositionLimits_(XX, posXYZ.XX);
+	checkPositionLimits_(YY, posXYZ.YY);
+	checkPositionLimits_(ZZ, posXYZ.ZZ);
+
+	mMotion.issueConcurrently({ XX, YY, ZZ }, [this, &posXYZ](const AXIS axis)
+		{
+			switch (axis)
+			{
+			case XX:
+				issueMove_(XX, posXYZ.XX);
+				break;
+			case YY:
+				issueMove_(YY, posXYZ.YY);
+				break;
+			case ZZ:
+				issueMove_(ZZ, posXYZ.ZZ);
+				break;
+			}
+		});
 }
 
 bool Stage::isMoving(const AXIS axis) const
@@ -750,18 +1210,20 @@ bool Stage::isMoving(const AXIS axis) const
 	return isMoving;
 }
 
+//The stage is polled only near its predicted arrival. See StageMotion. If the wait times out or is cancelled, the stages are stopped
 void Stage::waitForMotionToStopSingle(const AXIS axis) const
 {
 	std::cout << "Stage " + convertAxisToString_(axis) + " moving to the new position: ";
 
-	BOOL isMoving;
-	do {
-		if (!PI_IsMoving(mHandleXYZ.at(axis), mNstagesPerController, &isMoving))
-			throw std::runtime_error((std::string)__FUNCTION__ + ": Unable to query movement status for stage" + convertAxisToString_(axis));
-
-		std::cout << ".";
-		Sleep(300);
-	} while (isMoving);
+	try
+	{
+		mMotion.waitForMotionToStop({ axis }, [this](const AXIS axis) { std::cout << "."; return isMoving(axis); });
+	}
+	catch (...)
+	{
+		stopAll();
+		throw;
+	}
 
 	std::cout << "\n";
 }
@@ -770,19 +1232,15 @@ void Stage::waitForMotionToStopAll() const
 {
 	std::cout << "Stages moving to the new position: ";
 
-	BOOL isMovingX, isMovingY, isMovingZ;
-	do {
-		if (!PI_IsMoving(mHandleXYZ.at(XX), mNstagesPerController, &isMovingX))
-			throw std::runtime_error((std::string)__FUNCTION__ + ": Unable to query movement status for stage X");
-
-		if (!PI_IsMoving(mHandleXYZ.at(YY), mNstagesPerController, &isMovingY))
-			throw std::runtime_error((std::string)__FUNCTION__ + ": Unable to query movement status for stage Y");
-
-		if (!PI_IsMoving(mHandleXYZ.at(ZZ), mNstagesPerController, &isMovingZ))
-			throw std::runtime_error((std::string)__FUNCTION__ + ": Unable to query movement status for stage Z");
-
-		std::cout << ".";
-	} while (isMovingX || isMovingY || isMovingZ);
+	try
+	{
+		mMotion.waitForMotionToStop({ XX, YY, ZZ }, [this](const AXIS axis) { std::cout << "."; return isMoving(axis); });
+	}
+	catch (...)
+	{
+		stopAll();
+		throw;
+	}
 
 	std::cout << "\n";
 }
@@ -998,6 +1456,11 @@ std::string Stage::convertAxisToString_(const AXIS axis) const
 #pragma endregion "Stages"
 
 #pragma region "Vibratome"
+const POSITION2 Vibratome::mStageInitialBladePosXY{ -54. * mm, 5. * mm };
+const double Vibratome::mStageFinalBladePosY{ 28. * mm };
+const double Vibratome::mSlicingVel{ 0.1 * mmps };
+const VELOCITY3 Vibratome::mStageConveyingVelXYZ{ 10. * mmps, 10. * mmps, 0.5 * mmps };
+
 Vibratome::Vibratome(const FPGA &fpga, Stage &stage) :
 	mFpga{ fpga },
 	mStage{ stage }
@@ -1089,6 +1552,12 @@ void Vibratome::retractDistance(const double distance) const
 #pragma endregion "Vibratome"
 
 #pragma region "Filterwheel"
+const std::vector<Filterwheel::COLOR> Filterwheel::mExcConfig{ COLOR::BLUE, COLOR::OPEN, COLOR::GREEN, COLOR::OPEN, COLOR::RED, COLOR::OPEN };
+const std::vector<Filterwheel::COLOR> Filterwheel::mDetConfig{ COLOR::BLUE, COLOR::OPEN, COLOR::RED, COLOR::CLOSED, COLOR::GREEN, COLOR::OPEN };
+const double Filterwheel::mTurningSpeed{ 0.8 / seconds };
+const int Filterwheel::mBaud{ 115200 };
+const int Filterwheel::mTimeout{ 150 * ms };
+
 Filterwheel::Filterwheel(const ID whichFilterwheel) :
 	mWhichFilterwheel{ whichFilterwheel }
 {
@@ -1110,7 +1579,11 @@ Filterwheel::Filterwheel(const ID whichFilterwheel) :
 
 	try
 	{
-		mSerial = std::unique_ptr<serial::Serial>(new serial::Serial("COM" + std::to_string(static_cast<int>(mPort)), mBaud, serial::Timeout::simpleTimeout(mTimeout / ms)));
+		//Take the port opened by DeviceSessions, or open it now
+		mSerial = DeviceSessions::takeSerial(mPort);
+		if (!mSerial)
+			mSerial = openSerial(mWhichFilterwheel);
+		mTransport = std::unique_ptr<SerialTransport>(new SerialTransport(mFilterwheelName, SerialTransport::makePort(*mSerial), SerialTransport::terminatorFramer(">"), mTimeout));
 		mPosition = downloadPosition_();					//Download the current filter position
 		mColor = convertPositionToColor_(mPosition);
 	}
@@ -1125,6 +1598,12 @@ Filterwheel::~Filterwheel()
 	mSerial->close();
 }
 
+std::unique_ptr<serial::Serial> Filterwheel::openSerial(const ID whichFilterwheel)
+{
+	const COM port{ whichFilterwheel == ID::EXC ? COM::FWEXC : COM::FWDET };
+	return std::unique_ptr<serial::Serial>(new serial::Serial("COM" + std::to_string(static_cast<int>(port)), mBaud, serial::Timeout::simpleTimeout(mTimeout / ms)));
+}
+
 //Set the color of the filterwheel
 void Filterwheel::setColor(const COLOR color)
 {
@@ -1133,27 +1612,24 @@ void Filterwheel::setColor(const COLOR color)
 	if (position != mPosition)
 	{
 		std::string TxBuffer("pos=" + std::to_string(position) + "\r");
-		std::string RxBuffer;
 
 		try
 		{
-			mSerial->write(TxBuffer);
+			mTransport->query(TxBuffer, "pos=");		//The reply ends with the prompt '>'
 
-			//Find the shortest way to reach the targeted position
-			const int minPos{ (std::min)(position, mPosition) };
-			const int maxPos{ (std::max)(position, mPosition) };
-			const int diffPos{ maxPos - minPos };
-			const int minSteps{ (std::min)(diffPos, mNpos - diffPos) };
+			//If the position is unknown, the turret turns at most half a revolution
+			const int minSteps{ mPosition == mUnknownPosition ? mNpos / 2 : determineNumberOfSteps_(mPosition, position) };
 
 			//Thread-safe message
 			std::stringstream msg;
 			msg << "Setting the " << mFilterwheelName << " to " + convertColorToString_(color) << "...\n";
 			std::cout << msg.str();
 
-			Sleep(static_cast<DWORD>(1. * minSteps / mTurningSpeed / ms));	//Wait until the filterwheel stops turning the turret
-
-			mSerial->read(RxBuffer, mRxBufSize);							//Read RxBuffer to flush it. Serial::flush() doesn't work
-			//std::cout << "setColor full RxBuffer: " << RxBuffer << "\n"; //For debugging
+			//Query the position until the turret stops turning, instead of waiting for the worst-case turning time
+			//The position is unknown until then, so that the command is sent again if this one is cancelled
+			mPosition = mUnknownPosition;
+			if (!DeviceExecutor::pollUntilDone([this, position] { return isAtPosition_(position); }, 1. * minSteps / mTurningSpeed, 1. * mNpos / 2 / mTurningSpeed + mTurningTimeoutMargin))
+				throw std::runtime_error((std::string)__FUNCTION__ + ": The " + mFilterwheelName + " did not reach the position " + std::to_string(position));
 
 			//Update the configuration of the filterwheel
 			mPosition = downloadPosition_();  //Download the current filter position to check that the operation was successful
@@ -1185,18 +1661,40 @@ void Filterwheel::setColor(const COLOR color)
 //Set the filter color by specifying the laser wavelength
 void Filterwheel::setWavelength(const int wavelength_nm)
 {
-	COLOR color;
-	//Wavelength intervals chosen based on the 2p-excitation spectrum of the fluorescent markers (DAPI, GFP, and tdTomato)
+	setColor(convertWavelengthToColor(wavelength_nm));
+}
+
+//Wavelength intervals chosen based on the 2p-excitation spectrum of the fluorescent markers (DAPI, GFP, and tdTomato)
+Filterwheel::COLOR Filterwheel::convertWavelengthToColor(const int wavelength_nm)
+{
 	if (wavelength_nm > 940 && wavelength_nm <= 1080)
-		color = COLOR::RED;
+		return COLOR::RED;
 	else if (wavelength_nm > 790)
-		color = COLOR::GREEN;
+		return COLOR::GREEN;
 	else if (wavelength_nm >= 680)
-		color = COLOR::BLUE;
+		return COLOR::BLUE;
 	else
 		throw std::invalid_argument((std::string)__FUNCTION__ + ": The filterwheel wavelength must be in the range [680-1080] nm");
+}
+
+//Time that setColor waits for the turret to turn from initialColor to finalColor
+double Filterwheel::determineTurningTime(const ID whichFilterwheel, const COLOR initialColor, const COLOR finalColor)
+{
+	const std::vector<COLOR> &config{ whichFilterwheel == ID::EXC ? mExcConfig : mDetConfig };
+	const auto initialIter{ std::find(config.begin(), config.end(), initialColor) };
+	const auto finalIter{ std::find(config.begin(), config.end(), finalColor) };
+	if (initialIter == config.end() || finalIter == config.end())
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The color is not available in the filterwheel");
+
+	//The index for config starts from 0. The index for the filterwheel position start from 1
+	return 1. * determineNumberOfSteps_(static_cast<int>(initialIter - config.begin()) + 1, static_cast<int>(finalIter - config.begin()) + 1) / mTurningSpeed;
+}
 
-	setColor(color);
+//Find the shortest way to reach the targeted position. The turret turns either way
+int Filterwheel::determineNumberOfSteps_(const int initialPosition, const int finalPosition)
+{
+	const int diffPos{ std::abs(finalPosition - initialPosition) };
+	return (std::min)(diffPos, mNpos - diffPos);
 }
 
 //Download the current filter position
@@ -1205,10 +1703,7 @@ int Filterwheel::downloadPosition_() const
 	try
 	{
 		const std::string TxBuffer{ "pos?\r" };	//Command to the filterwheel
-		std::string RxBuffer;					//Reply from the filterwheel
-
-		mSerial->write(TxBuffer);
-		mSerial->read(RxBuffer, mRxBufSize);
+		std::string RxBuffer{ mTransport->query(TxBuffer, "pos?") };	//Reply from the filterwheel
 		//std::cout << "Full RxBuffer: " << RxBuffer << "\n"; //For debugging
 
 		//Delete echoed command
@@ -1230,15 +1725,28 @@ int Filterwheel::downloadPosition_() const
 	}
 }
 
-//Convert the color of the filter to the wheel position
-int Filterwheel::convertColorToPosition_(const COLOR color) const
+//The filterwheel may not reply while turning the turret
+bool Filterwheel::isAtPosition_(const int position) const
 {
-	for (std::vector<int>::size_type iter = 0; iter < mFWconfig.size(); iter++)
+	try
 	{
-		if (color == mFWconfig.at(iter))
-			return iter + 1;			//The index for mFWconfig starts from 0. The index for the filterwheel position start from 1
+		return downloadPosition_() == position;
 	}
-	
+	catch (const std::logic_error&)		//The reply could not be converted to a position
+	{
+		return false;
+	}
+}
+
+//Convert the color of the filter to the wheel position
+int Filterwheel::convertColorToPosition_(const COLOR color) const
+{
+	for (std::vector<int>::size_type iter = 0; iter < mFWconfig.size(); iter++)
+	{
+		if (color == mFWconfig.at(iter))
+			return iter + 1;			//The index for mFWconfig starts from 0. The index for the filterwheel position start from 1
+	}
+	
 	throw std::runtime_error((std::string)__FUNCTION__ + ": Failure converting color to position");
 }
 
@@ -1288,40 +1796,25 @@ CombinedFilterwheel::CombinedFilterwheel(const RTseq &realtimeSeq) :
 
 void CombinedFilterwheel::turnFilterwheels(const int wavelength_nm)
 {
+	std::future<void> th1;
 	if (mRTseq.mMultibeam) //Multiplex. Turn both filterwheels concurrently
-	{
-		std::future<void> th1{ std::async(&Filterwheel::setWavelength, &mFWexcitation, wavelength_nm) };
-		std::future<void> th2{ std::async(&Filterwheel::setWavelength, &mFWdetection, wavelength_nm) };
+		th1 = mExecutor.submit(DeviceExecutor::DEVICE::EXCFILTERWHEEL, [this, wavelength_nm] { mFWexcitation.setWavelength(wavelength_nm); });
+	else //Single beam. Leave the excitation filterwheel open
+		th1 = mExecutor.submit(DeviceExecutor::DEVICE::EXCFILTERWHEEL, [this] { mFWexcitation.setColor(Filterwheel::COLOR::OPEN); });
+	std::future<void> th2{ mExecutor.submit(DeviceExecutor::DEVICE::DETFILTERWHEEL, [this, wavelength_nm] { mFWdetection.setWavelength(wavelength_nm); }) };
 
-		try
-		{
-			th1.get();
-			th2.get();
-		}
-		catch (...)
-		{
-			throw;
-		}
-	}
-	else //Single beam. Turn both filterwheels concurrently
-	{
-		std::future<void> th1{ std::async(&Filterwheel::setColor, &mFWexcitation, Filterwheel::COLOR::OPEN) };
-		std::future<void> th2{ std::async(&Filterwheel::setWavelength, &mFWdetection, wavelength_nm) };
-
-		try
-		{
-			th1.get();
-			th2.get();
-		}
-		catch (...)
-		{
-			throw;
-		}
-	}
+	//Wait for both filterwheels before throwing, so that none of them is left turning
+	th1.wait();
+	th2.wait();
+	th1.get();
+	th2.get();
 }
 #pragma endregion "CombinedFilterwheel"
 
 #pragma region "Laser"
+const double Laser::mTuningSpeed{ 35. / seconds };
+const int Laser::mTimeout{ 100 * ms };
+
 Laser::Laser(const ID whichLaser) :
 	mWhichLaser{ whichLaser }
 {
@@ -1330,12 +1823,10 @@ Laser::Laser(const ID whichLaser) :
 	case ID::VISION:
 		laserName = "VISION";
 		mPort = COM::VISION;
-		mBaud = 19200;
 		break;
 	case ID::FIDELITY:
 		laserName = "FIDELITY";
 		mPort = COM::FIDELITY;
-		mBaud = 115200;
 		break;
 	default:
 		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected laser unavailable");
@@ -1343,7 +1834,14 @@ Laser::Laser(const ID whichLaser) :
 
 	try //Establish serial communication with the chosen laser
 	{
-		mSerial = std::unique_ptr<serial::Serial>(new serial::Serial("COM" + std::to_string(static_cast<int>(mPort)), mBaud, serial::Timeout::simpleTimeout(mTimeout / ms)));
+		//Take the port opened by DeviceSessions, or open it now
+		mSerial = DeviceSessions::takeSerial(mPort);
+		if (!mSerial)
+			mSerial = openSerial(mWhichLaser);
+
+		//The replies of VISION end with the prompt "CHAMELEON>". The replies of FIDELITY are read until the timeout
+		const SerialTransport::FRAMER framer{ mWhichLaser == ID::VISION ? SerialTransport::terminatorFramer("CHAMELEON>") : nullptr };
+		mTransport = std::unique_ptr<SerialTransport>(new SerialTransport(laserName, SerialTransport::makePort(*mSerial), framer, mTimeout));
 	}
 	catch (const serial::IOException)
 	{
@@ -1359,6 +1857,19 @@ Laser::~Laser()
 	mSerial->close();
 }
 
+std::unique_ptr<serial::Serial> Laser::openSerial(const ID whichLaser)
+{
+	switch (whichLaser)
+	{
+	case ID::VISION:
+		return std::unique_ptr<serial::Serial>(new serial::Serial("COM" + std::to_string(static_cast<int>(COM::VISION)), 19200, serial::Timeout::simpleTimeout(mTimeout / ms)));
+	case ID::FIDELITY:
+		return std::unique_ptr<serial::Serial>(new serial::Serial("COM" + std::to_string(static_cast<int>(COM::FIDELITY)), 115200, serial::Timeout::simpleTimeout(mTimeout / ms)));
+	default:
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected laser unavailable");
+	}
+}
+
 void Laser::printWavelength_nm() const
 {
 	std::cout << laserName + " wavelength is " << mWavelength_nm << " nm\n";
@@ -1376,28 +1887,27 @@ void Laser::setWavelength(const int wavelength_nm)
 		if (wavelength_nm != mWavelength_nm)	//Change the wavelength only if the new value is different from the current one
 		{
 			const std::string TxBuffer{ "VW=" + std::to_string(wavelength_nm) };	//Command to the laser
-			std::string RxBuffer;													//Reply from the laser
 
 			try
 			{
-				mSerial->write(TxBuffer + "\r");
-				//std::cout << "Sleep time in ms: " << static_cast<int>( std::abs( 1.*(mWavelength_nm - wavelength_nm) / mTuningSpeed / ms ) ) << "\n";	//For debugging
+				mTransport->query(TxBuffer + "\r", "VW=");		//The reply reads "CHAMELEON>"
 
 				//Thread-safe message
 				std::stringstream msg;
 				msg << "Tuning VISION to " << wavelength_nm << " nm...\n";
 				std::cout << msg.str();
 
-				//Wait till the laser stops tuning
-				Sleep(static_cast<DWORD>(std::abs(1.*(mWavelength_nm - wavelength_nm) / mTuningSpeed / ms)));
-
-				//Read RxBuffer to flush it. Serial::flush() doesn't work. The message reads "CHAMELEON>"
-				mSerial->read(RxBuffer, mRxBufSize);	
+				//Query the tuning status until the laser stops tuning, instead of waiting for the worst-case tuning time. If the wavelength is unknown, query right away
+				//The wavelength is unknown until then, so that the command is sent again if this one is cancelled
+				const double expectedTuningTime{ mWavelength_nm == mUnknownWavelength_nm ? 0 : determineTuningTime(mWavelength_nm, wavelength_nm) };
+				mWavelength_nm = mUnknownWavelength_nm;
+				int polledWavelength_nm{ mUnknownWavelength_nm };
+				const bool isTuned{ DeviceExecutor::pollUntilDone([this, &polledWavelength_nm] { return !isTuning_(polledWavelength_nm); }, expectedTuningTime, determineTuningTime(680, 1080) + mTuningTimeoutMargin) };
 
-				//Check if the laser was set successfully 
-				mWavelength_nm = downloadWavelength_nm_();
+				//Check if the laser was set successfully. The wavelength is read together with the last tuning status
+				mWavelength_nm = polledWavelength_nm;
 
-				if (mWavelength_nm != wavelength_nm)
+				if (!isTuned || mWavelength_nm != wavelength_nm)
 				{
 					//Thread-safe message
 					std::stringstream msg;
@@ -1424,7 +1934,6 @@ void Laser::setWavelength(const int wavelength_nm)
 void Laser::setShutter(const bool state) const
 {
 	std::string TxBuffer;		//Command to the laser
-	std::string RxBuffer;		//Reply from the laser
 
 	switch (mWhichLaser)
 	{
@@ -1440,8 +1949,7 @@ void Laser::setShutter(const bool state) const
 
 	try
 	{
-		mSerial->write(TxBuffer + "\r");
-		mSerial->read(RxBuffer, mRxBufSize);	//Read RxBuffer to flush it. Serial::flush() doesn't work.
+		mTransport->query(TxBuffer + "\r", TxBuffer.substr(0, TxBuffer.find('=') + 1));		//Flush the reply
 
 		if (state)
 			std::cout << laserName + " shutter successfully opened\n";
@@ -1457,7 +1965,6 @@ void Laser::setShutter(const bool state) const
 bool Laser::isShutterOpen() const
 {
 	std::string TxBuffer;		//Command to the laser
-	std::string RxBuffer;		//Reply from the laser
 	std::string keyword;		//To delete the echo from the laser. Echoing could be disabled on the laser side but deleting it is safer and more general
 
 	switch (mWhichLaser)
@@ -1476,8 +1983,7 @@ bool Laser::isShutterOpen() const
 
 	try
 	{
-		mSerial->write(TxBuffer + "\r");
-		mSerial->read(RxBuffer, mRxBufSize);	//Read RxBuffer to flush it. Serial::flush() doesn't work
+		std::string RxBuffer{ mTransport->query(TxBuffer + "\r", TxBuffer) };	//Reply from the laser
 
 		//Remove echoed command in the returned message
 		std::string::size_type i{ RxBuffer.find(keyword) };
@@ -1503,49 +2009,95 @@ int Laser::readCurrentWavelength_nm() const
 	return mWavelength_nm;
 }
 
+//Time that setWavelength waits for VISION to tune
+double Laser::determineTuningTime(const int initialWavelength_nm, const int finalWavelength_nm)
+{
+	return std::abs(1. * (finalWavelength_nm - initialWavelength_nm) / mTuningSpeed);
+}
+
 //Download the current wavelength of the laser (Vision only)
 int Laser::downloadWavelength_nm_() const
 {
 	switch (mWhichLaser)
 	{
 	case ID::VISION:
-		try
-		{
-			const std::string TxBuffer{ "?VW" };	//Command to the laser
-			std::string RxBuffer;					//Reply from the laser
-			mSerial->write(TxBuffer + "\r");
-			mSerial->read(RxBuffer, mRxBufSize);
-
-			//Delete echoed command. Echoing could be disabled on the laser side but deleting it is safer and more general
-			std::string keyword{ "?VW " };
-			std::string::size_type i{ RxBuffer.find(keyword) };
-			if (i != std::string::npos)
-				RxBuffer.erase(i, keyword.length());
-
-			//Delete "CHAMELEON>". This frase could be disabled on the laser side, but deleting it is safer and more general
-			keyword = "CHAMELEON>";
-			i = RxBuffer.find(keyword);
-			if (i != std::string::npos)
-				RxBuffer.erase(i, keyword.length());
-
-			//Delete '\r' and '\n'
-			RxBuffer.erase(std::remove(RxBuffer.begin(), RxBuffer.end(), '\r'), RxBuffer.end());
-			RxBuffer.erase(std::remove(RxBuffer.begin(), RxBuffer.end(), '\n'), RxBuffer.end());
-			//std::cout << RxBuffer << "\n";	//For debugging
-
-			return std::stoi(RxBuffer);	//Convert string to int
-
-		}
-		catch (const serial::IOException)
-		{
-			throw std::runtime_error((std::string)__FUNCTION__ + ": Failure communicating with VISION");
-		}
+		return std::stoi(queryVision_("?VW"));	//Convert string to int
 	case ID::FIDELITY:
 		return 1040;
 	default:
 		throw std::runtime_error((std::string)__FUNCTION__ + ": Selected laser unavailable");
 	}	
 }
+
+//Tuning status of VISION: 0 = ready, 1 = tuning, 2 = searching for modelock, 3 = recovery in progress
+//The wavelength is queried in the same batch, so that it is known as soon as the tuning is over without another round trip
+bool Laser::isTuning_(int &wavelength_nm) const
+{
+	if (mWhichLaser != ID::VISION)
+	{
+		wavelength_nm = downloadWavelength_nm_();
+		return false;
+	}
+
+	const std::vector<std::string> RxBuffers{ queryVision_(std::vector<std::string>{ "?TS", "?VW" }) };
+	wavelength_nm = std::stoi(RxBuffers.at(1));
+	return std::stoi(RxBuffers.at(0)) != 0;
+}
+
+//Send a query to VISION and return the reply without the echo and the prompt
+std::string Laser::queryVision_(const std::string command) const
+{
+	try
+	{
+		return trimVisionReply_(command, mTransport->query(command + "\r", command));	//Reply from the laser
+	}
+	catch (const serial::IOException)
+	{
+		throw std::runtime_error((std::string)__FUNCTION__ + ": Failure communicating with VISION");
+	}
+}
+
+//Send the queries to VISION in one batch and return the replies without the echo and the prompt. VISION processes the queries in order
+std::vector<std::string> Laser::queryVision_(const std::vector<std::string> commands) const
+{
+	std::vector<std::string> TxBuffers;
+	for (const std::string &command : commands)
+		TxBuffers.push_back(command + "\r");
+
+	try
+	{
+		std::vector<std::string> RxBuffers{ mTransport->queryPipelined(TxBuffers, commands) };	//Replies from the laser
+		for (std::vector<std::string>::size_type iterCommand = 0; iterCommand < commands.size(); iterCommand++)
+			RxBuffers.at(iterCommand) = trimVisionReply_(commands.at(iterCommand), RxBuffers.at(iterCommand));
+		return RxBuffers;
+	}
+	catch (const serial::IOException)
+	{
+		throw std::runtime_error((std::string)__FUNCTION__ + ": Failure communicating with VISION");
+	}
+}
+
+std::string Laser::trimVisionReply_(const std::string command, std::string RxBuffer)
+{
+	//Delete echoed command. Echoing could be disabled on the laser side but deleting it is safer and more general
+	std::string keyword{ command + " " };
+	std::string::size_type i{ RxBuffer.find(keyword) };
+	if (i != std::string::npos)
+		RxBuffer.erase(i, keyword.length());
+
+	//Delete "CHAMELEON>". This frase could be disabled on the laser side, but deleting it is safer and more general
+	keyword = "CHAMELEON>";
+	i = RxBuffer.find(keyword);
+	if (i != std::string::npos)
+		RxBuffer.erase(i, keyword.length());
+
+	//Delete '\r' and '\n'
+	RxBuffer.erase(std::remove(RxBuffer.begin(), RxBuffer.end(), '\r'), RxBuffer.end());
+	RxBuffer.erase(std::remove(RxBuffer.begin(), RxBuffer.end(), '\n'), RxBuffer.end());
+	//std::cout << RxBuffer << "\n";	//For debugging
+
+	return RxBuffer;
+}
 #pragma endregion "Laser"
 
 #pragma region "Shutters"
@@ -1844,6 +2396,11 @@ int VirtualLaser::readCurrentWavelength_nm() const
 	}
 }
 
+int VirtualLaser::readVisionWavelength_nm() const
+{
+	return mVision.readCurrentWavelength_nm();
+}
+
 void VirtualLaser::isLaserInternalShutterOpen() const
 {
 	//Check which laser is being used
@@ -1938,7 +2495,13 @@ std::string VirtualLaser::convertLaserNameToString_(const Laser::ID whichLaser)
 	//If = 1040 nm, use VISION for 1X and FIDELITY for 16X
 Laser::ID VirtualLaser::autoSelectLaser_(const int wavelength_nm) const
 {
-	if (mWhichLaser == Laser::ID::AUTO)
+	return selectLaser(mWhichLaser, wavelength_nm);
+}
+
+//Laser used for wavelength_nm when the laser selector is whichLaser
+Laser::ID VirtualLaser::selectLaser(const Laser::ID whichLaser, const int wavelength_nm)
+{
+	if (whichLaser == Laser::ID::AUTO)
 	{
 		if (wavelength_nm < 1040)
 			return Laser::ID::VISION;
@@ -1953,59 +2516,20 @@ Laser::ID VirtualLaser::autoSelectLaser_(const int wavelength_nm) const
 		else
 			throw std::invalid_argument((std::string)__FUNCTION__ + ": Wavelengths > 1040 nm is not implemented in the VirtualLaser class");
 	}
-	else //If mWhichLaser != ID::AUTO, the mWhichLaser is either ID::VISION or ID::FIDELITY
-		return mWhichLaser;
+	else //If whichLaser != ID::AUTO, the whichLaser is either ID::VISION or ID::FIDELITY
+		return whichLaser;
 }
 #pragma endregion "VirtualLaser"
 
 #pragma region "StepperActuator"
 StepperActuator::StepperActuator(const char* serialNumber) :
 	mSerialNumber{ serialNumber }
-{	
-	//Build list of connected device
-	if (TLI_BuildDeviceList() == 0)
-	{/*
-		//Get device list size 
-		short n = TLI_GetDeviceListSize();
-		//std::cout << "Device list size: " << n << "\n";
-
-		//Get BBD serial numbers
-		char serialNos[100];
-		//TLI_GetDeviceListByTypeExt(serialNos, 100, 80);
-
-		//Output list of matching devices
-		{
-			char *searchContext = nullptr;
-			char *p = strtok_s(serialNos, ",", &searchContext);
-			
-			while (p != nullptr)
-			{
-				TLI_DeviceInfo deviceInfo;
-				//Get device info from device
-				TLI_GetDeviceInfo(p, &deviceInfo);
-				//Get strings from device info structure
-				char desc[65];
-				strncpy_s(desc, deviceInfo.description, 64);
-				desc[64] = '\0';
-				char serialNo[9];
-				strncpy_s(serialNo, deviceInfo.serialNo, 8);
-				serialNo[8] = '\0';
-				//Output
-				printf("Found Device %s=%s : %s\r\n", p, serialNo, desc);
-				p = strtok_s(nullptr, ",", &searchContext);
-			}
-		}*/
-	}
-
-	//Open device
-	if (SCC_Open(mSerialNumber))
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": Unable to establish connection with stepper " + mSerialNumber);
+{
+	//Take the connection opened by DeviceSessions, or open it now
+	if (!DeviceSessions::takeStepper(mSerialNumber))
+		open(mSerialNumber);
 
-	//Start the device polling at 200ms intervals
-	SCC_StartPolling(mSerialNumber, 200);
-	
 	//Set the actuator velocity
-	Sleep(100);
 	SCC_SetVelParams(mSerialNumber, mAcc_iu, mVel_iu);
 
 	//download the current position
@@ -2037,14 +2561,12 @@ void StepperActuator::move(const double position)
 		msg << "Positioning the collector lens at " << position / mm << " mm...\n";
 		std::cout << msg.str();
 
-		//Wait for completion
-		WORD messageType, messageId;
-		DWORD messageData;
-		SCC_WaitForMessage(mSerialNumber, &messageType, &messageId, &messageData);
-		while (messageType != 2 || messageId != 1)
-		{
-			SCC_WaitForMessage(mSerialNumber, &messageType, &messageId, &messageData);
-		}
+		//Query the status of the actuator until it reaches the position, instead of blocking on the message queue without a timeout. If the position is unknown, query right away
+		//The position is unknown until then, so that the command is sent again if this one is cancelled
+		const double expectedMotionTime{ mPosition == mUnknownPosition ? 0 : determineMotionTime_(std::abs(position - mPosition)) };
+		mPosition = mUnknownPosition;
+		if (!DeviceExecutor::pollUntilDone([this, position] { return !isMoving_() && std::abs(SCC_GetPosition(mSerialNumber) / mCalib - position) <= 0.001 * mm; }, expectedMotionTime, mMotionTimeout))
+			throw std::runtime_error((std::string)__FUNCTION__ + ": The collector lens did not reach the position " + Util::toString(position / mm, 3) + " mm");
 		//For debugging. Get current position
 		//std::cout << "Collector lens current position: " << SCC_GetPosition(mSerialNumber) / mCalib /mm << " mm\n";
 
@@ -2070,22 +2592,84 @@ void StepperActuator::moveHome()
 	SCC_Home(mSerialNumber);
 	std::cout << "Homing the collector lens\n";
 
-	//Wait for completion
-	WORD messageType, messageId;
-	DWORD messageData;
-	SCC_WaitForMessage(mSerialNumber, &messageType, &messageId, &messageData);
-	while (messageType != 2 || messageId != 0)
-	{
-		SCC_WaitForMessage(mSerialNumber, &messageType, &messageId, &messageData);
-	}
+	//Query the status of the actuator until it is homed. The homing velocity is not modeled, so query right away
+	mPosition = mUnknownPosition;
+	if (!DeviceExecutor::pollUntilDone([this] { return !isMoving_() && (SCC_GetStatusBits(mSerialNumber) & mHomedBit); }, 0, mMotionTimeout))
+		throw std::runtime_error((std::string)__FUNCTION__ + ": The collector lens could not be homed");
+
 	//Update the current position
 	mPosition = 0;
 }
+
+//Open the connection to the actuator and start polling its status
+void StepperActuator::open(const std::string serialNumber)
+{
+	//Build list of connected device
+	if (TLI_BuildDeviceList() == 0)
+	{/*
+		//Get device list size 
+		short n = TLI_GetDeviceListSize();
+		//std::cout << "Device list size: " << n << "\n";
+
+		//Get BBD serial numbers
+		char serialNos[100];
+		//TLI_GetDeviceListByTypeExt(serialNos, 100, 80);
+
+		//Output list of matching devices
+		{
+			char *searchContext = nullptr;
+			char *p = strtok_s(serialNos, ",", &searchContext);
+			
+			while (p != nullptr)
+			{
+				TLI_DeviceInfo deviceInfo;
+				//Get device info from device
+				TLI_GetDeviceInfo(p, &deviceInfo);
+				//Get strings from device info structure
+				char desc[65];
+				strncpy_s(desc, deviceInfo.description, 64);
+				desc[64] = '\0';
+				char serialNo[9];
+				strncpy_s(serialNo, deviceInfo.serialNo, 8);
+				serialNo[8] = '\0';
+				//Output
+				printf("Found Device %s=%s : %s\r\n", p, serialNo, desc);
+				p = strtok_s(nullptr, ",", &searchContext);
+			}
+		}*/
+	}
+
+	//Open device
+	if (SCC_Open(serialNumber.c_str()))
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Unable to establish connection with stepper " + serialNumber);
+
+	//Start the device polling at 200ms intervals
+	SCC_StartPolling(serialNumber.c_str(), 200);
+
+	//Let the polling download the status before the first command
+	Sleep(100);
+}
+
+//The status bits are refreshed by the polling started in open()
+bool StepperActuator::isMoving_() const
+{
+	return SCC_GetStatusBits(mSerialNumber) & mMovingBits;
+}
+
+//The travel range is too short for reaching the velocity, so the velocity profile is triangular. Keep the trapezoidal profile in case the velocity is lowered
+double StepperActuator::determineMotionTime_(const double distance) const
+{
+	if (distance < mVel * mVel / mAcc)
+		return 2 * std::sqrt(distance / mAcc);
+	return distance / mVel + mVel / mAcc;
+}
 #pragma endregion "StepperActuator"
 
 #pragma region "CollectorLens"
+const std::string CollectorLens::mSerialNumber{ "26000299" };
+
 CollectorLens::CollectorLens() :
-	StepperActuator{ "26000299" }
+	StepperActuator{ mSerialNumber.c_str() }
 {}
 
 void CollectorLens::set(const int wavelength_nm)
@@ -2107,6 +2691,162 @@ void CollectorLens::set(const int wavelength_nm)
 }
 #pragma endregion "CollectorLens"
 
+#pragma region "DeviceSessions"
+std::mutex DeviceSessions::mMutex;
+std::array<std::future<int>, 3> DeviceSessions::mStageHandleXYZ;
+std::future<void> DeviceSessions::mStepper;
+std::map<COM, std::future<std::unique_ptr<serial::Serial>>> DeviceSessions::mSerialPorts;
+const std::chrono::time_point<std::chrono::high_resolution_clock> DeviceSessions::mStartTime{ std::chrono::high_resolution_clock::now() };
+std::once_flag DeviceSessions::mFirstAcquisitionFlag;
+
+DeviceSessions::DeviceSessions(const std::vector<SESSION> sessions)
+{
+	std::lock_guard<std::mutex> lock{ mMutex };
+
+	//Open a serial port unless it is already pending
+	const auto openSerialInBackground{ [](const COM port, std::function<std::unique_ptr<serial::Serial>()> open) {
+		if (!mSerialPorts[port].valid())
+			mSerialPorts[port] = std::async(std::launch::async, open); } };
+
+	for (const SESSION session : sessions)
+		switch (session)
+		{
+		case SESSION::STAGES:
+			for (int iterAxis = XX; iterAxis <= ZZ; iterAxis++)
+				if (!mStageHandleXYZ.at(iterAxis).valid())
+					mStageHandleXYZ.at(iterAxis) = std::async(std::launch::async, &Stage::connectController, static_cast<AXIS>(iterAxis));
+			break;
+		case SESSION::COLLECTORLENS:
+			if (!mStepper.valid())
+				mStepper = std::async(std::launch::async, &StepperActuator::open, CollectorLens::mSerialNumber);
+			break;
+		case SESSION::LASERS:
+			openSerialInBackground(COM::VISION, [] { return Laser::openSerial(Laser::ID::VISION); });
+			openSerialInBackground(COM::FIDELITY, [] { return Laser::openSerial(Laser::ID::FIDELITY); });
+			break;
+		case SESSION::FILTERWHEELS:
+			openSerialInBackground(COM::FWEXC, [] { return Filterwheel::openSerial(Filterwheel::ID::EXC); });
+			openSerialInBackground(COM::FWDET, [] { return Filterwheel::openSerial(Filterwheel::ID::DET); });
+			break;
+		case SESSION::PMT16X:
+			openSerialInBackground(COM::PMT16X, &PMT16X::openSerial);
+			break;
+		default:
+			throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected session unavailable");
+		}
+}
+
+//Close the connections that were not taken by the devices
+DeviceSessions::~DeviceSessions()
+{
+	std::lock_guard<std::mutex> lock{ mMutex };
+	for (std::future<int> &handle : mStageHandleXYZ)
+		if (handle.valid())
+		{
+			const int ID{ handle.get() };
+			if (ID >= 0)
+				PI_CloseConnection(ID);
+		}
+
+	if (mStepper.valid())
+	{
+		try
+		{
+			mStepper.get();
+			SCC_StopPolling(CollectorLens::mSerialNumber.c_str());
+			SCC_Close(CollectorLens::mSerialNumber.c_str());
+		}
+		catch (...) {}		//The stepper could not be opened, so there is nothing to close
+	}
+
+	//The serial ports are closed by the destructor of serial::Serial
+	for (auto &port : mSerialPorts)
+		if (port.second.valid())
+		{
+			try
+			{
+				port.second.get();
+			}
+			catch (...) {}		//The port could not be opened, so there is nothing to close
+		}
+	mSerialPorts.clear();
+}
+
+//Return the connection opened in the background, or open it now if none is pending
+int DeviceSessions::takeStageHandle(const AXIS axis)
+{
+	std::future<int> handle;
+	{
+		std::lock_guard<std::mutex> lock{ mMutex };
+		handle = std::move(mStageHandleXYZ.at(axis));
+	}
+
+	if (handle.valid())
+		return handle.get();
+
+	return Stage::connectController(axis);
+}
+
+//Return true if the stepper was opened in the background. Rethrow the exception if opening it failed
+bool DeviceSessions::takeStepper(const std::string serialNumber)
+{
+	if (serialNumber != CollectorLens::mSerialNumber)
+		return false;
+
+	std::future<void> stepper;
+	{
+		std::lock_guard<std::mutex> lock{ mMutex };
+		stepper = std::move(mStepper);
+	}
+
+	if (!stepper.valid())
+		return false;
+
+	stepper.get();
+	return true;
+}
+
+//Return the serial port opened in the background, or nullptr if none is pending. Rethrow the exception if opening it failed
+std::unique_ptr<serial::Serial> DeviceSessions::takeSerial(const COM port)
+{
+	std::future<std::unique_ptr<serial::Serial>> serial;
+	{
+		std::lock_guard<std::mutex> lock{ mMutex };
+		const auto pending{ mSerialPorts.find(port) };
+		if (pending != mSerialPorts.end())
+		{
+			serial = std::move(pending->second);
+			mSerialPorts.erase(pending);
+		}
+	}
+
+	if (!serial.valid())
+		return nullptr;
+
+	return serial.get();
+}
+
+//Time since the start of the process, to measure the start-up of the instrument
+double DeviceSessions::readTimeSinceStart()
+{
+	return std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - mStartTime).count() * us;
+}
+
+void DeviceSessions::printTimeSinceStart(const std::string milestone)
+{
+	//Thread-safe message
+	std::stringstream msg;
+	msg << milestone << " " << Util::toString(readTimeSinceStart() / ms, 0) << " ms after the start\n";
+	std::cout << msg.str();
+}
+
+//Print the time to the first acquisition only once
+void DeviceSessions::printFirstAcquisition()
+{
+	std::call_once(mFirstAcquisitionFlag, [] { printTimeSinceStart("First acquisition"); });
+}
+#pragma endregion "DeviceSessions"
+
 #pragma region "Galvo"
 //constructor for the scanner
 Galvo::Galvo(RTseq &realtimeSeq, const double posMax) :
@@ -2281,25 +3021,30 @@ Mesoscope::Mesoscope(RTseq &realtimeSeq, const Laser::ID whichLaser) :
 	VirtualLaser{ whichLaser },
 	Vibratome{ realtimeSeq.mFpga, mStage },
 	ResonantScanner{ realtimeSeq }
-{}
+{
+	DeviceSessions::printTimeSinceStart("Mesoscope ready");
+}
 
 //Tune the laser wavelength, set the exc and emission filterwheels, and position the collector lens
 void Mesoscope::configure(const int wavelength_nm)
 {
-	std::future<void> th1{ std::async(&VirtualLaser::setWavelength, this, std::ref(mRTseq), std::ref(wavelength_nm)) };	//Tune the laser wavelength
-	std::future<void> th2{ std::async(&CombinedFilterwheel::turnFilterwheels, &mVirtualFilterWheel, wavelength_nm) };	//Set the filterwheels
-	std::future<void> th3{ std::async(&CollectorLens::set, this, wavelength_nm) };										//Set the collector lens position
+	std::future<void> th1{ mExecutor.submit(DeviceExecutor::DEVICE::LASER, [this, wavelength_nm] { VirtualLaser::setWavelength(mRTseq, wavelength_nm); }) };		//Tune the laser wavelength
+	std::future<void> th2{ mExecutor.submit(DeviceExecutor::DEVICE::FILTERWHEELS, [this, wavelength_nm] { mVirtualFilterWheel.turnFilterwheels(wavelength_nm); }) };	//Set the filterwheels
+	std::future<void> th3{ mExecutor.submit(DeviceExecutor::DEVICE::COLLECTORLENS, [this, wavelength_nm] { CollectorLens::set(wavelength_nm); }) };					//Set the collector lens position
 
-	try
-	{
-		th1.get();
-		th2.get();
-		th3.get();
-	}
-	catch (...)
-	{
-		throw;
-	}
+	//Wait for the 3 devices before throwing, so that none of them is left running
+	th1.wait();
+	th2.wait();
+	th3.wait();
+	th1.get();
+	th2.get();
+	th3.get();
+}
+
+//Run a command on one of the devices in the background, e.g. mesoscope.submit(DeviceExecutor::DEVICE::STAGES, [&] { mesoscope.cutTissue(planeZtoCut); })
+std::future<void> Mesoscope::submit(const DeviceExecutor::DEVICE device, std::function<void()> command)
+{
+	return mExecutor.submit(device, command);
 }
 
 void Mesoscope::setPower(const double laserPower) const
@@ -2351,6 +3096,14 @@ void Mesoscope::moveXY(const POSITION2 posXY)
 					posXY.YY + chromaticShiftXYZ.YY });
 }
 
+//Use the chromatic shift of wavelength_nm instead of the current wavelength, so that the stages can move while the laser is tuned to wavelength_nm
+void Mesoscope::moveXY(const POSITION2 posXY, const int wavelength_nm)
+{
+	const POSITION3 chromaticShiftXYZ{ determineChromaticShiftXYZ_(autoSelectLaser_(wavelength_nm), wavelength_nm) };
+	mStage.moveXY({ posXY.XX + chromaticShiftXYZ.XX,
+					posXY.YY + chromaticShiftXYZ.YY });
+}
+
 void Mesoscope::moveXYZ(const POSITION3 posXYZ)
 {
 	const POSITION3 chromaticShiftXYZ{ determineChromaticShiftXYZ_() };
@@ -2363,10 +3116,15 @@ void Mesoscope::moveXYZ(const POSITION3 posXYZ)
 //The lateral offset between Vision and Fidelity is because the 2 lasers do not perfectly overlap
 POSITION3 Mesoscope::determineChromaticShiftXYZ_()
 {
-	switch (this->readCurrentLaser())
+	return determineChromaticShiftXYZ_(this->readCurrentLaser(), this->readCurrentWavelength_nm());
+}
+
+POSITION3 Mesoscope::determineChromaticShiftXYZ_(const Laser::ID laser, const int wavelength_nm) const
+{
+	switch (laser)
 	{
 	case Laser::ID::VISION:
-		switch (this->readCurrentWavelength_nm())
+		switch (wavelength_nm)
 		{
 		case 750:
 			return g_chromaticShiftVision750nm;
@@ -2375,11 +3133,11 @@ POSITION3 Mesoscope::determineChromaticShiftXYZ_()
 		case 1040:
 			return g_chromaticShiftVision1040nm;
 		default:
-			throw std::invalid_argument((std::string)__FUNCTION__ + ": The chromatic shift has not been calibrated for the wavelength " + std::to_string(this->readCurrentWavelength_nm()) + " nm");
+			throw std::invalid_argument((std::string)__FUNCTION__ + ": The chromatic shift has not been calibrated for the wavelength " + std::to_string(wavelength_nm) + " nm");
 		}
 		break;
 	case Laser::ID::FIDELITY:
-		switch (this->readCurrentWavelength_nm())
+		switch (wavelength_nm)
 		{
 		case 1040:
 			return g_chromaticShiftFidelity1040nm;
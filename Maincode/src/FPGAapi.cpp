@@ -157,25 +157,20 @@ namespace FPGAfunc
 }//namespace
 
 #pragma region "FPGA"
-FPGA::FPGA()
-{
-	//Must be called before any other FPGA calls
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_Initialize());
-
-	//Opens a session, uploads the bitfile to the FPGA. 1=no run, 0=run
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_Open(mBitfile.c_str(), NiFpga_FPGAvi_Signature, "RIO0", 0, &mHandle));
-
-	//Set up the FPGA parameters
-	initializeFpga_();
-}
+//Open the session in the background, so that uploading the bitfile overlaps with opening the devices (see DeviceSessions)
+FPGA::FPGA() :
+	mOpened{ std::async(std::launch::async, &FPGA::open_, this).share() }
+{}
 
 FPGA::~FPGA()
 {
 	//std::cout << "FPGA destructor was called\n";
 };
 
+//Wait for the session to be opened. Rethrow the exception if opening it failed
 NiFpga_Session FPGA::handle() const
 {
+	mOpened.get();
 	return mHandle;
 }
 
@@ -193,7 +188,7 @@ void FPGA::close(const FPGARESET reset) const
 	case FPGARESET::DIS:
 		resetFlag = 1;
 	}
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_Close(mHandle, resetFlag));	//Arg of NiFpga_Close(): 0 to resets, 1 does not reset
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_Close(handle(), resetFlag));	//Arg of NiFpga_Close(): 0 to resets, 1 does not reset
 
 	if (reset == FPGARESET::EN)
 		std::cout << "The FPGA has been successfully reset\n";
@@ -205,13 +200,13 @@ void FPGA::close(const FPGARESET reset) const
 //Lineclock: resonant scanner (RS) or function generator (FG)
 void FPGA::setLineclock(const LINECLOCK lineclockInput) const
 {
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(mHandle, NiFpga_FPGAvi_ControlBool_LineclockInputSelector, static_cast<bool>(lineclockInput)));
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(handle(), NiFpga_FPGAvi_ControlBool_LineclockInputSelector, static_cast<bool>(lineclockInput)));
 }
 
 //Select the main trigger for ctl&acq sequence (pc, stage X or stage Z)
 void FPGA::setMainTrig(const MAINTRIG mainTrigger) const
 {
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteU8(mHandle, NiFpga_FPGAvi_ControlU8_MainTriggerSelector, static_cast<U8>(mainTrigger)));
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteU8(handle(), NiFpga_FPGAvi_ControlU8_MainTriggerSelector, static_cast<U8>(mainTrigger)));
 }
 
 //Set the delay for the stages triggering the ctl&acq sequence
@@ -253,14 +248,14 @@ void FPGA::setStageTrigDelay(const MAINTRIG mainTrigger, const int heightPerBeam
 		double stageTrigAcqDelay = 0;
 	}
 
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteU32(mHandle, NiFpga_FPGAvi_ControlU32_StageTrigAcqDelay_tick, static_cast<U32>(stageTrigAcqDelay / us * g_tickPerUs)));
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteU32(handle(), NiFpga_FPGAvi_ControlU32_StageTrigAcqDelay_tick, static_cast<U32>(stageTrigAcqDelay / us * g_tickPerUs)));
 }
 
 //Enable the FPGA to push the photocounts to FIFOOUTfpga. Disabled when debugging
 void FPGA::enableFIFOOUTfpga(const FIFOOUTfpga enableFIFOOUTfpga) const
 {
 	if (enableFIFOOUTfpga == FIFOOUTfpga::EN)
-		FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(mHandle, NiFpga_FPGAvi_ControlBool_FIFOOUTgateEnable, true));
+		FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(handle(), NiFpga_FPGAvi_ControlBool_FIFOOUTgateEnable, true));
 }
 
 /*
@@ -268,9 +263,9 @@ void FPGA::enableFIFOOUTfpga(const FIFOOUTfpga enableFIFOOUTfpga) const
 //Flush the internal FIFOs on the FPGA as precaution. 
 void FPGA::flushRAM() const
 {
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(mHandle, NiFpga_FPGAvi_ControlBool_FlushFIFOs, false));
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(mHandle, NiFpga_FPGAvi_ControlBool_FlushFIFOs, true));
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(mHandle, NiFpga_FPGAvi_ControlBool_FlushFIFOs, false));
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(handle(), NiFpga_FPGAvi_ControlBool_FlushFIFOs, false));
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(handle(), NiFpga_FPGAvi_ControlBool_FlushFIFOs, true));
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(handle(), NiFpga_FPGAvi_ControlBool_FlushFIFOs, false));
 	//std::cout << "flushBRAMs called\n";	//For debugging
 }
 */
@@ -278,14 +273,14 @@ void FPGA::flushRAM() const
 I16 FPGA::readScannerVoltageMon() const
 {
 	I16 value;
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_ReadI16(mHandle, NiFpga_FPGAvi_IndicatorU16_ScanGalvoMon, &value));
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_ReadI16(handle(), NiFpga_FPGAvi_IndicatorU16_ScanGalvoMon, &value));
 	return value;
 }
 
 I16 FPGA::readRescannerVoltageMon() const
 {
 	I16 value;
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_ReadI16(mHandle, NiFpga_FPGAvi_IndicatorU16_RescanGalvoMon, &value));
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_ReadI16(handle(), NiFpga_FPGAvi_IndicatorU16_RescanGalvoMon, &value));
 	return value;
 }
 
@@ -298,37 +293,37 @@ void FPGA::uploadImagingParameters(const int heightPerBeamletPerFrame_pix, const
 		throw std::invalid_argument((std::string)__FUNCTION__ + ": The number of frames must be >= 1");
 
 	//IMAGING PARAMETERS
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteI32(mHandle, NiFpga_FPGAvi_ControlI32_NlinesAll, static_cast<I32>(heightPerBeamletPerFrame_pix * nFrames)));	//Total number of lines per beamlet in all the frames
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteU16(mHandle, NiFpga_FPGAvi_ControlI16_NlinesPerFrame, static_cast<I16>(heightPerBeamletPerFrame_pix)));			//Number of lines per beamlet in a frame
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteI16(mHandle, NiFpga_FPGAvi_ControlI16_Nframes, static_cast<I16>(nFrames)));										//Number of frames to acquire
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteI32(handle(), NiFpga_FPGAvi_ControlI32_NlinesAll, static_cast<I32>(heightPerBeamletPerFrame_pix * nFrames)));	//Total number of lines per beamlet in all the frames
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteU16(handle(), NiFpga_FPGAvi_ControlI16_NlinesPerFrame, static_cast<I16>(heightPerBeamletPerFrame_pix)));			//Number of lines per beamlet in a frame
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteI16(handle(), NiFpga_FPGAvi_ControlI16_Nframes, static_cast<I16>(nFrames)));										//Number of frames to acquire
 }
 
 //Trigger the AOs of the FPGA externally instead of using the lineclock and frameclock (see the LV implementation)
 void FPGA::asyncTriggerAO() const
 {
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(mHandle, NiFpga_FPGAvi_ControlBool_AsyncTrigger, true));
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(mHandle, NiFpga_FPGAvi_ControlBool_AsyncTrigger, false));
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(handle(), NiFpga_FPGAvi_ControlBool_AsyncTrigger, true));
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(handle(), NiFpga_FPGAvi_ControlBool_AsyncTrigger, false));
 }
 
 //Trigger the ctl&acq sequence
 void FPGA::triggerControlSequence() const
 {
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(mHandle, NiFpga_FPGAvi_ControlBool_PcTrigger, true));
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(mHandle, NiFpga_FPGAvi_ControlBool_PcTrigger, false));
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(handle(), NiFpga_FPGAvi_ControlBool_PcTrigger, true));
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(handle(), NiFpga_FPGAvi_ControlBool_PcTrigger, false));
 }
 
 //Establish a connection between FIFOOUTpc and FIFOOUTfpga and. Optional according to NI
 void FPGA::startFIFOOUTpc() const
 {
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_StartFifo(mHandle, NiFpga_FPGAvi_TargetToHostFifoU32_FIFOOUTa));
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_StartFifo(mHandle, NiFpga_FPGAvi_TargetToHostFifoU32_FIFOOUTb));
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_StartFifo(handle(), NiFpga_FPGAvi_TargetToHostFifoU32_FIFOOUTa));
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_StartFifo(handle(), NiFpga_FPGAvi_TargetToHostFifoU32_FIFOOUTb));
 }
 
 //Stop the connection between FIFOOUTpc and FIFOOUTfpga. Optional according to NI
 void FPGA::stopFIFOOUTpc() const
 {
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_StopFifo(mHandle, NiFpga_FPGAvi_TargetToHostFifoU32_FIFOOUTa));
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_StopFifo(mHandle, NiFpga_FPGAvi_TargetToHostFifoU32_FIFOOUTb));
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_StopFifo(handle(), NiFpga_FPGAvi_TargetToHostFifoU32_FIFOOUTa));
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_StopFifo(handle(), NiFpga_FPGAvi_TargetToHostFifoU32_FIFOOUTb));
 	//std::cout << "stopFIFO called\n";
 }
 
@@ -336,8 +331,8 @@ void FPGA::stopFIFOOUTpc() const
 void FPGA::configureFIFOOUTpc(const U32 depth) const
 {
 	U32 actualDepth;
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_ConfigureFifo2(mHandle, NiFpga_FPGAvi_TargetToHostFifoU32_FIFOOUTa, depth, &actualDepth));
-	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_ConfigureFifo2(mHandle, NiFpga_FPGAvi_TargetToHostFifoU32_FIFOOUTb, depth, &actualDepth));
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_ConfigureFifo2(handle(), NiFpga_FPGAvi_TargetToHostFifoU32_FIFOOUTa, depth, &actualDepth));
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_ConfigureFifo2(handle(), NiFpga_FPGAvi_TargetToHostFifoU32_FIFOOUTb, depth, &actualDepth));
 	std::cout << "ActualDepth a: " << actualDepth << "\t" << "ActualDepth b: " << actualDepth << "\n";
 }
 
@@ -354,8 +349,8 @@ void FPGA::collectFIFOOUTpcGarbage() const
 	while (true)
 	{
 		//Check if there are elements in FIFOOUTpc
-		FPGAfunc::checkStatus(__FUNCTION__, NiFpga_ReadFifoU32(mHandle, NiFpga_FPGAvi_TargetToHostFifoU32_FIFOOUTa, garbage, 0, timeout_ms, &nElemToReadA));
-		FPGAfunc::checkStatus(__FUNCTION__, NiFpga_ReadFifoU32(mHandle, NiFpga_FPGAvi_TargetToHostFifoU32_FIFOOUTb, garbage, 0, timeout_ms, &nElemToReadB));
+		FPGAfunc::checkStatus(__FUNCTION__, NiFpga_ReadFifoU32(handle(), NiFpga_FPGAvi_TargetToHostFifoU32_FIFOOUTa, garbage, 0, timeout_ms, &nElemToReadA));
+		FPGAfunc::checkStatus(__FUNCTION__, NiFpga_ReadFifoU32(handle(), NiFpga_FPGAvi_TargetToHostFifoU32_FIFOOUTb, garbage, 0, timeout_ms, &nElemToReadB));
 		//std::cout << "FIFOOUTpc cleanup A/B: " << nElemToReadA << "/" << nElemToReadB << "\n";
 		//getchar();
 
@@ -365,13 +360,13 @@ void FPGA::collectFIFOOUTpcGarbage() const
 		if (nElemToReadA > 0)
 		{
 			nElemToReadA = (std::min)(bufSize, nElemToReadA);				//Min between bufSize and nElemToReadA
-			FPGAfunc::checkStatus(__FUNCTION__, NiFpga_ReadFifoU32(mHandle, NiFpga_FPGAvi_TargetToHostFifoU32_FIFOOUTa, garbage, nElemToReadA, timeout_ms, &dummy));	//Retrieve the elements in FIFOOUTpc
+			FPGAfunc::checkStatus(__FUNCTION__, NiFpga_ReadFifoU32(handle(), NiFpga_FPGAvi_TargetToHostFifoU32_FIFOOUTa, garbage, nElemToReadA, timeout_ms, &dummy));	//Retrieve the elements in FIFOOUTpc
 			nElemTotalA += nElemToReadA;
 		}
 		if (nElemToReadB > 0)
 		{
 			nElemToReadB = (std::min)(bufSize, nElemToReadB);				//Min between bufSize and nElemToReadB
-			FPGAfunc::checkStatus(__FUNCTION__, NiFpga_ReadFifoU32(mHandle, NiFpga_FPGAvi_TargetToHostFifoU32_FIFOOUTb, garbage, nElemToReadB, timeout_ms, &dummy));	//Retrieve the elements in FIFOOUTpc
+			FPGAfunc::checkStatus(__FUNCTION__, NiFpga_ReadFifoU32(handle(), NiFpga_FPGAvi_TargetToHostFifoU32_FIFOOUTb, garbage, nElemToReadB, timeout_ms, &dummy));	//Retrieve the elements in FIFOOUTpc
 			nElemTotalB += nElemToReadB;
 		}
 	}
@@ -414,12 +409,12 @@ void FPGA::uploadFIFOIN(VQU32 &vecOfqueues, const U8 nChan) const
 
 		//Send the data to the FPGA through FIFOIN. I measured a minimum time of 10 ms to execute
 		U32 r; //Elements remaining
-		FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteFifoU32(mHandle, NiFpga_FPGAvi_HostToTargetFifoU32_FIFOIN, &FIFOIN[0], sizeFIFOINqueue, NiFpga_InfiniteTimeout, &r));
+		FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteFifoU32(handle(), NiFpga_FPGAvi_HostToTargetFifoU32_FIFOIN, &FIFOIN[0], sizeFIFOINqueue, NiFpga_InfiniteTimeout, &r));
 
 		//On the FPGA, transfer the commands from FIFOIN to the sub-channel buffers. 
 		//This boolean serves as the master trigger for the entire control sequence
-		FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(mHandle, NiFpga_FPGAvi_ControlBool_FIFOINtrigger, true));
-		FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(mHandle, NiFpga_FPGAvi_ControlBool_FIFOINtrigger, false));
+		FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(handle(), NiFpga_FPGAvi_ControlBool_FIFOINtrigger, true));
+		FPGAfunc::checkStatus(__FUNCTION__, NiFpga_WriteBool(handle(), NiFpga_FPGAvi_ControlBool_FIFOINtrigger, false));
 	}
 }
 
@@ -470,6 +465,18 @@ void FPGA::readFIFOOUTpc(const int &nPixPerBeamletAllFrames, U32 *mBufferA, U32
 		throw DataDownloadException((std::string)__FUNCTION__ + ": Received less FIFO elements than expected");
 }
 
+void FPGA::open_()
+{
+	//Must be called before any other FPGA calls
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_Initialize());
+
+	//Opens a session, uploads the bitfile to the FPGA. 1=no run, 0=run
+	FPGAfunc::checkStatus(__FUNCTION__, NiFpga_Open(mBitfile.c_str(), NiFpga_FPGAvi_Signature, "RIO0", 0, &mHandle));
+
+	//Set up the FPGA parameters
+	initializeFpga_();
+}
+
 //Load the imaging parameters onto the FPGA. See Const.cpp for the definition of each variable
 void FPGA::initializeFpga_() const
 {
@@ -537,7 +544,7 @@ void FPGA::readChunk_(const int &nPixPerBeamletAllFrames, int &nElemRead, const
 	if (nElemRead < nPixPerBeamletAllFrames)		//Skip if all the data have already been transferred
 	{
 		//By requesting 0 elements from FIFOOUTpc, the function returns the number of elements available. If no data is available, nElemToRead = 0 is returned
-		FPGAfunc::checkStatus(__FUNCTION__, NiFpga_ReadFifoU32(mHandle, FIFOOUTpc, buffer, 0, timeout_ms, &nElemToRead));
+		FPGAfunc::checkStatus(__FUNCTION__, NiFpga_ReadFifoU32(handle(), FIFOOUTpc, buffer, 0, timeout_ms, &nElemToRead));
 		//std::cout << "Number of elements remaining in FIFOOUT: " << nElemToRead << "\n";	//For debugging
 
 		//If data available in FIFOOUTpc, retrieve it
@@ -548,7 +555,7 @@ void FPGA::readChunk_(const int &nPixPerBeamletAllFrames, int &nElemRead, const
 				throw std::runtime_error((std::string)__FUNCTION__ + ": Received more FIFO elements than expected");
 
 			//Retrieve the elements in FIFOOUTpc
-			FPGAfunc::checkStatus(__FUNCTION__, NiFpga_ReadFifoU32(mHandle, FIFOOUTpc, buffer + nElemRead, nElemToRead, timeout_ms, &dummy));
+			FPGAfunc::checkStatus(__FUNCTION__, NiFpga_ReadFifoU32(handle(), FIFOOUTpc, buffer + nElemRead, nElemToRead, timeout_ms, &dummy));
 
 			//Keep track of the total number of elements read
 			nElemRead += nElemToRead;
@@ -627,6 +634,7 @@ void RTseq::reconfigure(const int heightPerBeamletPerFrame_pix, const int widthP
 	if (nFrames <= 0)
 		throw std::invalid_argument((std::string)__FUNCTION__ + ": The number of frames must be > 0");
 
+	mIsArmed = false;						//The imaging parameters of an armed sequence are overwritten
 	mPMT16Xchan = determineRescannerSetpoint_(multibeam);
 	mHeightPerBeamletPerFrame_pix = heightPerBeamletPerFrame_pix;
 	mWidthPerFrame_pix = widthPerFrame_pix;
@@ -722,6 +730,14 @@ void RTseq::run()
 //Preset the parameters for the acquisition sequence
 void RTseq::initialize(const MAINTRIG mainTrigger, const int wavelength_nm, const SCANDIR stackScanDir)
 {
+	arm(mainTrigger, wavelength_nm, stackScanDir);
+	enableTrigger();
+}
+
+//Preset the parameters for the acquisition sequence, except for enabling the main trigger. The main trigger is left on the PC, so the stages can move to the next stack while the sequence is armed
+void RTseq::arm(const MAINTRIG mainTrigger, const int wavelength_nm, const SCANDIR stackScanDir)
+{
+	mFpga.setMainTrig(MAINTRIG::PC);								//Keep the stages from triggering the ctl&acq sequence
 	mFpga.enableFIFOOUTfpga(mEnableFIFOOUTfpga);					//Push data from the FPGA to FIFOOUTfpga. It is disabled when debugging
 	initializeStages_(mainTrigger, stackScanDir, wavelength_nm);	//Set the delay of the stage triggering the ctl&acq and specify the stack-saving order
 	presetAOs_();													//Preset the scanner positions
@@ -733,8 +749,20 @@ void RTseq::initialize(const MAINTRIG mainTrigger, const int wavelength_nm, cons
 
 	mFpga.startFIFOOUTpc();											//Establish connection between FIFOOUTpc and FIFOOUTfpga to send the control sequence to the FGPA. Optional according to NI, but if not called, sometimes garbage is generated
 	mFpga.collectFIFOOUTpcGarbage();								//Clean up any residual data from the previous run
-	mFpga.setMainTrig(mainTrigger);									//Enable the stage triggering the ctl&acq sequence
 	//Sleep(20);													//When continuous scanning, collectFIFOOUTpcGarbage() is being called late. Maybe this will fix it
+
+	mArmedMainTrigger = mainTrigger;
+	mIsArmed = true;
+}
+
+//Enable the main trigger of an armed sequence
+void RTseq::enableTrigger()
+{
+	if (!mIsArmed)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": The control sequence has not been armed");
+
+	mFpga.setMainTrig(mArmedMainTrigger);							//Enable the stage triggering the ctl&acq sequence
+	mIsArmed = false;
 }
 	
 //Retrieve the data from the FPGA
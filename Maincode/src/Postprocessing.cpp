@@ -0,0 +1,1217 @@
+#include "Postprocessing.h"
+#ifndef _WIN32
+#include <sys/mman.h>											//For the shared memory of StackRing
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#pragma region "CorrectionJournal"
+CorrectionJournal::CorrectionJournal(const std::string folderPath, const std::string filename) :
+	mFilePath{ folderPath + filename + ".txt" }
+{
+	//Load the records of a previous run
+	std::ifstream inputFileHandle{ mFilePath };
+	std::string line;
+	while (std::getline(inputFileHandle, line))
+	{
+		const std::string::size_type tabPos{ line.find('\t') };
+		if (tabPos != 16 || line.size() <= tabPos + 1)
+			continue;
+		try
+		{
+			std::size_t nChars;
+			const U64 key{ std::stoull(line.substr(0, tabPos), &nChars, 16) };
+			if (nChars == tabPos)
+				mKeyByOutput[line.substr(tabPos + 1)] = key;
+		}
+		catch (const std::logic_error&) {}		//Skip a torn line
+	}
+
+	//Check if the last line was torn by a crash
+	bool tornTail{ false };
+	if (std::filesystem::exists(mFilePath) && std::filesystem::file_size(mFilePath) > 0)
+	{
+		inputFileHandle.clear();
+		inputFileHandle.seekg(-1, std::ios::end);
+		tornTail = inputFileHandle.get() != '\n';
+	}
+	inputFileHandle.close();
+
+	mFileHandle.open(mFilePath, std::ios::app);
+	if (!mFileHandle)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": The file " + mFilePath + " failed to open");
+	if (tornTail)
+		mFileHandle << "\n" << std::flush;		//Start the new records on a new line
+}
+
+//Identify a job by the size and modification time of its input file and by the correction parameters. The input file is not read, so a stack is only read once per run
+U64 CorrectionJournal::computeKey(const CorrectionJob &job)
+{
+	const CorrectionParam &param{ job.mParam };
+	std::ostringstream param_ss;
+	param_ss << std::setprecision(17) << param.mFFOVfast << " " << param.mSuppressCrosstalk << " " << param.mCrosstalkRatio << " " << param.mFineTuningTop << " " << param.mFineTuningBottom << " " <<
+		param.mFlattenField << " " << param.mExpFactor;
+	const std::string param_s{ param_ss.str() };
+
+	const std::string inputFilePath{ job.mInputFolderPath + job.mInputFilename + ".tif" };
+	const std::string input_s{ std::to_string(std::filesystem::file_size(inputFilePath)) + " " + std::to_string(std::filesystem::last_write_time(inputFilePath).time_since_epoch().count()) };
+
+	const U32 inputCRC{ Util::computeCRC32(reinterpret_cast<const U8*>(input_s.data()), input_s.size()) };
+	const U32 paramCRC{ Util::computeCRC32(reinterpret_cast<const U8*>(param_s.data()), param_s.size()) };
+	return (static_cast<U64>(inputCRC) << 32) | paramCRC;
+}
+
+//A job is done if its output was recorded with the same key and the output file still exists
+bool CorrectionJournal::isDone(const CorrectionJob &job, const U64 key) const
+{
+	const std::string outputFilePath{ job.mOutputFolderPath + job.mOutputFilename + ".tif" };
+	{
+		std::lock_guard<std::mutex> lock{ mMutex };
+		const auto iter{ mKeyByOutput.find(outputFilePath) };
+		if (iter == mKeyByOutput.end() || iter->second != key)
+			return false;
+	}
+	return std::filesystem::exists(outputFilePath);
+}
+
+//Call after the output file has been fully written
+void CorrectionJournal::record(const CorrectionJob &job, const U64 key)
+{
+	const std::string outputFilePath{ job.mOutputFolderPath + job.mOutputFilename + ".tif" };
+	std::ostringstream key_ss;
+	key_ss << std::hex << std::setw(16) << std::setfill('0') << key;
+
+	std::lock_guard<std::mutex> lock{ mMutex };
+	mFileHandle << key_ss.str() << "\t" << outputFilePath << "\n" << std::flush;
+	if (!mFileHandle)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": Failed writing to " + mFilePath);
+	mKeyByOutput[outputFilePath] = key;
+}
+
+int CorrectionJournal::readNrecords() const
+{
+	std::lock_guard<std::mutex> lock{ mMutex };
+	return static_cast<int>(mKeyByOutput.size());
+}
+#pragma endregion "CorrectionJournal"
+
+#pragma region "CorrectionJobRunner"
+CorrectionJobRunner::CorrectionJobRunner(const int nThreads) :
+	mNthreads{ nThreads }
+{
+	if (nThreads <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The number of threads must be > 0");
+}
+
+//Deal the jobs in contiguous blocks, one per thread, so each thread works on neighboring files
+void CorrectionJobRunner::run(const std::vector<CorrectionJob> &vec_job, CorrectionJournal &journal)
+{
+	mJobs = &vec_job;
+	mJournal = &journal;
+	mNcorrected = 0;
+	mNskipped = 0;
+	mNstolen = 0;
+	mAbort = false;
+	mException = nullptr;
+	mStartTime = std::chrono::high_resolution_clock::now();
+
+	const int nJobs{ static_cast<int>(vec_job.size()) };
+	mQueues.clear();
+	for (int iterThread = 0; iterThread < mNthreads; iterThread++)
+	{
+		mQueues.push_back(std::unique_ptr<WorkQueue>{ new WorkQueue });
+		for (int iterJob = nJobs * iterThread / mNthreads; iterJob < nJobs * (iterThread + 1) / mNthreads; iterJob++)
+			mQueues.back()->mJobIndices.push_back(iterJob);
+	}
+
+	std::vector<std::thread> vec_thread;
+	for (int iterThread = 0; iterThread < mNthreads; iterThread++)
+		vec_thread.push_back(std::thread{ &CorrectionJobRunner::workerLoop_, this, iterThread });
+	for (auto &thread : vec_thread)
+		thread.join();
+
+	mQueues.clear();
+	mJournal = nullptr;
+	mJobs = nullptr;
+
+	if (mException)
+		std::rethrow_exception(mException);
+
+	const double duration_s{ std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - mStartTime).count() };
+	std::cout << "Corrected " << mNcorrected << " stacks and skipped " << mNskipped << " already done in " << Util::toString(duration_s, 1) << " s (" << mNstolen << " jobs stolen)\n";
+}
+
+//Take from the front of the own deque. Otherwise, steal from the back of the others
+bool CorrectionJobRunner::takeJob_(const int threadIndex, int &jobIndex)
+{
+	for (int iterQueue = 0; iterQueue < mNthreads; iterQueue++)
+	{
+		WorkQueue &queue{ *mQueues.at((threadIndex + iterQueue) % mNthreads) };
+		std::lock_guard<std::mutex> lock{ queue.mMutex };
+		if (queue.mJobIndices.empty())
+			continue;
+
+		if (iterQueue == 0)
+		{
+			jobIndex = queue.mJobIndices.front();
+			queue.mJobIndices.pop_front();
+		}
+		else
+		{
+			jobIndex = queue.mJobIndices.back();
+			queue.mJobIndices.pop_back();
+			std::lock_guard<std::mutex> lockState{ mMutex };
+			mNstolen++;
+		}
+		return true;
+	}
+	return false;
+}
+
+void CorrectionJobRunner::workerLoop_(const int threadIndex)
+{
+	try
+	{
+		int jobIndex;
+		while (takeJob_(threadIndex, jobIndex))
+		{
+			{
+				std::lock_guard<std::mutex> lock{ mMutex };
+				if (mAbort)
+					return;
+			}
+
+			const CorrectionJob &job{ mJobs->at(jobIndex) };
+			const U64 key{ CorrectionJournal::computeKey(job) };
+			if (mJournal->isDone(job, key))
+			{
+				std::lock_guard<std::mutex> lock{ mMutex };
+				mNskipped++;
+				continue;
+			}
+
+			TiffU8 image{ job.mInputFolderPath, job.mInputFilename };
+			BatchCorrector::applyCorrectionOnWorker(image, job.mParam, mGpuMutex);
+			image.saveToFile(job.mOutputFolderPath, job.mOutputFilename, TIFFSTRUCT::MULTIPAGE, OVERRIDE::EN);
+			mJournal->record(job, key);		//Checkpoint
+			{
+				std::lock_guard<std::mutex> lock{ mMutex };
+				mNcorrected++;
+				const double duration_s{ std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - mStartTime).count() };
+				std::cout << "Progress: " << mNcorrected + mNskipped << "/" << mJobs->size() << "\t" << Util::toString(mNcorrected / duration_s, 2) << " stacks/s\n";
+			}
+			Util::pressESCforEarlyTermination();
+		}
+	}
+	catch (...)
+	{
+		std::lock_guard<std::mutex> lock{ mMutex };
+		if (!mException)
+			mException = std::current_exception();
+		mAbort = true;
+	}
+}
+#pragma endregion "CorrectionJobRunner"
+
+#pragma region "LeasedCorrector"
+LeasedCorrector::LeasedCorrector(const std::string leaseFolderPath, const std::string workerName, const int nThreads, const double leaseExpiry_s, const double heartbeatPeriod_s) :
+	mLeaseFolderPath{ leaseFolderPath },
+	mWorkerName{ workerName },
+	mNthreads{ nThreads },
+	mLeaseExpiry_s{ leaseExpiry_s },
+	mHeartbeatPeriod_s{ heartbeatPeriod_s }
+{
+	if (workerName.empty())
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The worker name must be unique and not empty");
+	if (nThreads <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The number of threads must be > 0");
+	if (heartbeatPeriod_s <= 0 || 2 * heartbeatPeriod_s >= leaseExpiry_s)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The heartbeat period must be > 0 and shorter than half the lease expiry");
+
+	std::filesystem::create_directories(mLeaseFolderPath);
+}
+
+//Process the jobs until all of them are published by this or by other workers. The workers may be started and stopped at any time
+void LeasedCorrector::run(const std::vector<CorrectionJob> &vec_job)
+{
+	if (vec_job.empty())
+		return;
+
+	mJobs = &vec_job;
+	mHeldLeases.clear();
+	mIsShareTimeRead = false;
+	mNcorrected = 0;
+	mNreclaimed = 0;
+	mStop = false;
+	mException = nullptr;
+	auto t_start{ std::chrono::high_resolution_clock::now() };
+	refreshShareTime_();
+
+	std::thread heartbeatThread{ &LeasedCorrector::heartbeatLoop_, this };
+	std::vector<std::thread> vec_thread;
+	for (int iterThread = 0; iterThread < mNthreads; iterThread++)
+		vec_thread.push_back(std::thread{ &LeasedCorrector::workerLoop_, this, iterThread });
+	for (auto &thread : vec_thread)
+		thread.join();
+
+	{
+		std::lock_guard<std::mutex> lock{ mMutex };
+		mStop = true;
+	}
+	mCondition.notify_all();
+	heartbeatThread.join();
+
+	//Hand back the leases left after an error, so the other workers do not have to wait for them to expire
+	for (const auto &heldLease : std::map<std::string, std::string>{ mHeldLeases })
+		releaseLease_(heldLease.first, heldLease.second);
+	std::error_code error;
+	std::filesystem::remove(mLeaseFolderPath + mWorkerName + ".clock", error);
+	mJobs = nullptr;
+
+	if (mException)
+		std::rethrow_exception(mException);
+
+	const double duration_s{ std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t_start).count() };
+	std::cout << mWorkerName << " corrected " << mNcorrected << "/" << vec_job.size() << " stacks in " << Util::toString(duration_s, 1) << " s (" <<
+		Util::toString(mNcorrected / duration_s, 2) << " stacks/s). " << mNreclaimed << " expired leases reclaimed\n";
+}
+
+//Name the lease after the output file so that all the workers agree on it
+std::string LeasedCorrector::determineLeaseFilePath_(const int jobIndex) const
+{
+	const CorrectionJob &job{ mJobs->at(jobIndex) };
+	const std::string outputFilePath{ job.mOutputFolderPath + job.mOutputFilename + ".tif" };
+	std::ostringstream lease_ss;
+	lease_ss << std::hex << std::setw(8) << std::setfill('0') << Util::computeCRC32(reinterpret_cast<const U8*>(outputFilePath.data()), outputFilePath.size());
+	return mLeaseFolderPath + job.mOutputFilename + "_" + lease_ss.str() + ".lease";
+}
+
+bool LeasedCorrector::isPublished_(const int jobIndex) const
+{
+	const CorrectionJob &job{ mJobs->at(jobIndex) };
+	return std::filesystem::exists(job.mOutputFolderPath + job.mOutputFilename + ".tif");
+}
+
+//The timestamps of the leases are set by the filesystem of the shared folder. Read the time of that filesystem from a file just written, so that the clock skew between the PCs does not matter
+//Called at each heartbeat. In between, the time of the share is extrapolated with the local clock
+void LeasedCorrector::refreshShareTime_()
+{
+	const std::string clockFilePath{ mLeaseFolderPath + mWorkerName + ".clock" };
+	std::ofstream{ clockFilePath } << mWorkerName << "\n";
+	std::error_code error;
+	const std::filesystem::file_time_type shareTime{ std::filesystem::last_write_time(clockFilePath, error) };
+	if (error)
+		return;
+
+	std::lock_guard<std::mutex> lock{ mMutex };
+	mShareTime = shareTime;
+	mShareTimeReadTime = std::chrono::steady_clock::now();
+	mIsShareTimeRead = true;
+}
+
+bool LeasedCorrector::isExpired_(const std::string leaseFilePath)
+{
+	std::error_code error;
+	const std::filesystem::file_time_type lastHeartbeat{ std::filesystem::last_write_time(leaseFilePath, error) };
+	if (error)
+		return false;	//The lease is gone
+
+	std::lock_guard<std::mutex> lock{ mMutex };
+	if (!mIsShareTimeRead)
+		return false;
+	const double leaseAge_s{ std::chrono::duration<double>(mShareTime - lastHeartbeat).count() + std::chrono::duration<double>(std::chrono::steady_clock::now() - mShareTimeReadTime).count() };
+	return leaseAge_s > mLeaseExpiry_s;
+}
+
+//Rewrite the first byte of a file, so that its timestamp is set by the filesystem that holds it and not by the local clock. Return false if the file does not exist
+bool LeasedCorrector::touch_(const std::string filePath)
+{
+	FILE *fileHandle{ std::fopen(filePath.c_str(), "r+b") };
+	if (fileHandle == nullptr)
+		return false;
+
+	const int firstByte{ std::fgetc(fileHandle) };
+	std::fseek(fileHandle, 0, SEEK_SET);
+	std::fputc(firstByte == EOF ? '\n' : firstByte, fileHandle);
+	std::fclose(fileHandle);
+	return true;
+}
+
+//Create the lease file exclusively, which is atomic on local and network filesystems
+//An expired lease is first renamed, so only one of the workers racing for it wins
+bool LeasedCorrector::tryAcquireLease_(const std::string leaseFilePath, const std::string ownerTag)
+{
+	FILE *fileHandle{ std::fopen(leaseFilePath.c_str(), "wx") };
+	if (fileHandle == nullptr)
+	{
+		if (!isExpired_(leaseFilePath))
+			return false;
+
+		const std::string staleFilePath{ leaseFilePath + "." + ownerTag + ".stale" };
+		std::error_code error;
+		std::filesystem::rename(leaseFilePath, staleFilePath, error);
+		if (error)
+			return false;
+
+		//The owner could have renewed the lease in between. If so, give it back with an exclusive create, so that a lease taken in the meantime by another worker is not overwritten
+		if (!isExpired_(staleFilePath))
+		{
+			std::string staleOwnerTag;
+			std::getline(std::ifstream{ staleFilePath }, staleOwnerTag);
+			std::filesystem::remove(staleFilePath, error);
+			FILE *restoredHandle{ std::fopen(leaseFilePath.c_str(), "wx") };
+			if (restoredHandle != nullptr)
+			{
+				std::fprintf(restoredHandle, "%s\n", staleOwnerTag.c_str());
+				std::fclose(restoredHandle);
+			}
+			return false;
+		}
+		std::filesystem::remove(staleFilePath, error);
+
+		fileHandle = std::fopen(leaseFilePath.c_str(), "wx");
+		if (fileHandle == nullptr)
+			return false;
+
+		std::lock_guard<std::mutex> lock{ mMutex };
+		mNreclaimed++;
+	}
+	std::fprintf(fileHandle, "%s\n", ownerTag.c_str());
+	std::fclose(fileHandle);
+
+	std::lock_guard<std::mutex> lock{ mMutex };
+	mHeldLeases[leaseFilePath] = ownerTag;
+	return true;
+}
+
+//The lease could have expired and been reclaimed by another worker, e.g. if this process stalled. Take it under a private name first and delete it only if this worker still owns it
+//Otherwise, give it back with an exclusive create, like in tryAcquireLease_()
+void LeasedCorrector::releaseLease_(const std::string leaseFilePath, const std::string ownerTag)
+{
+	{
+		std::lock_guard<std::mutex> lock{ mMutex };
+		mHeldLeases.erase(leaseFilePath);
+	}
+
+	const std::string releasedFilePath{ leaseFilePath + "." + ownerTag + ".released" };
+	std::error_code error;
+	std::filesystem::rename(leaseFilePath, releasedFilePath, error);
+	if (error)
+		return;			//The lease is gone
+
+	std::string leaseOwnerTag;
+	std::getline(std::ifstream{ releasedFilePath }, leaseOwnerTag);
+	std::filesystem::remove(releasedFilePath, error);
+	if (leaseOwnerTag != ownerTag)
+	{
+		std::cerr << "WARNING in " << __FUNCTION__ << ": The lease " << leaseFilePath << " had been reclaimed by " << leaseOwnerTag << "\n";
+		FILE *restoredHandle{ std::fopen(leaseFilePath.c_str(), "wx") };
+		if (restoredHandle != nullptr)
+		{
+			std::fprintf(restoredHandle, "%s\n", leaseOwnerTag.c_str());
+			std::fclose(restoredHandle);
+		}
+	}
+}
+
+//Refresh the timestamp of the leases held. If this process crashes, its leases expire and the other workers take over
+//The leases are touched without holding mMutex, so that the workers are not blocked by a slow share
+void LeasedCorrector::heartbeatLoop_()
+{
+	std::unique_lock<std::mutex> lock{ mMutex };
+	while (!mCondition.wait_for(lock, std::chrono::duration<double>(mHeartbeatPeriod_s), [&] { return mStop; }))
+	{
+		const std::map<std::string, std::string> heldLeases{ mHeldLeases };
+		lock.unlock();
+		for (const auto &heldLease : heldLeases)
+			touch_(heldLease.first);
+		refreshShareTime_();
+		lock.lock();
+	}
+}
+
+//Each thread starts at a different job to reduce the contention on the leases. Sweep the jobs until all of them are published
+//A job held by another worker is retried in the next sweep, in case that worker died
+void LeasedCorrector::workerLoop_(const int threadIndex)
+{
+	const std::string ownerTag{ mWorkerName + "_" + std::to_string(threadIndex) };
+	const int nJobs{ static_cast<int>(mJobs->size()) };
+	const int firstJobIndex{ static_cast<int>((Util::computeCRC32(reinterpret_cast<const U8*>(ownerTag.data()), ownerTag.size()) + static_cast<U32>(threadIndex) * nJobs / mNthreads) % nJobs) };
+
+	try
+	{
+		while (true)
+		{
+			bool pending{ false };
+			for (int iterJob = 0; iterJob < nJobs; iterJob++)
+			{
+				{
+					std::lock_guard<std::mutex> lock{ mMutex };
+					if (mStop)
+						return;
+				}
+
+				const int jobIndex{ (firstJobIndex + iterJob) % nJobs };
+				if (isPublished_(jobIndex))
+					continue;
+
+				const std::string leaseFilePath{ determineLeaseFilePath_(jobIndex) };
+				if (!tryAcquireLease_(leaseFilePath, ownerTag))
+				{
+					pending = true;
+					continue;
+				}
+
+				//The job could have been published between the check and acquiring the lease
+				if (!isPublished_(jobIndex))
+				{
+					const CorrectionJob &job{ mJobs->at(jobIndex) };
+					const std::string partialFilename{ job.mOutputFilename + ".partial_" + ownerTag };
+					TiffU8 image{ job.mInputFolderPath, job.mInputFilename };
+					BatchCorrector::applyCorrectionOnWorker(image, job.mParam, mGpuMutex);
+					image.saveToFile(job.mOutputFolderPath, partialFilename, TIFFSTRUCT::MULTIPAGE, OVERRIDE::EN);
+					std::filesystem::rename(job.mOutputFolderPath + partialFilename + ".tif", job.mOutputFolderPath + job.mOutputFilename + ".tif");	//Publish
+
+					std::lock_guard<std::mutex> lock{ mMutex };
+					mNcorrected++;
+					std::cout << ownerTag << " published " << job.mOutputFilename << ".tif\n";
+				}
+				releaseLease_(leaseFilePath, ownerTag);
+				Util::pressESCforEarlyTermination();
+			}
+
+			if (!pending)
+				return;
+
+			//Wait for the other workers to publish or for their leases to expire
+			std::unique_lock<std::mutex> lock{ mMutex };
+			if (mCondition.wait_for(lock, std::chrono::duration<double>(mHeartbeatPeriod_s), [&] { return mStop; }))
+				return;
+		}
+	}
+	catch (...)
+	{
+		{
+			std::lock_guard<std::mutex> lock{ mMutex };
+			if (!mException)
+				mException = std::current_exception();
+			mStop = true;
+		}
+		mCondition.notify_all();
+	}
+}
+#pragma endregion "LeasedCorrector"
+
+#pragma region "BatchCorrector"
+BatchCorrector::BatchCorrector(const int nReaders, const int nWorkers, const int nWriters, const U64 memoryBudget_byte) :
+	mNreaders{ nReaders },
+	mNworkers{ nWorkers },
+	mNwriters{ nWriters },
+	mMemoryBudget_byte{ memoryBudget_byte }
+{
+	if (nReaders <= 0 || nWorkers <= 0 || nWriters <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The number of readers, workers, and writers must be > 0");
+	if (memoryBudget_byte == 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The memory budget must be > 0");
+}
+
+//Correct and save the stacks in vec_job. onSaved is called once per job in the order of vec_job (not in the order the files are written), so it can be used for appending to a manifest
+//The checksum passed to onSaved is the one recorded in a TileManifest. It is computed from memory, except for the jobs skipped because they were already done
+//If a journal is passed, the jobs already recorded in it are not redone (onSaved is still called for them) and the completed jobs are recorded
+//The jobs must have distinct output files
+void BatchCorrector::run(const std::vector<CorrectionJob> &vec_job, const std::function<void(const int jobIndex, const U32 checksum)> onSaved, CorrectionJournal *journal)
+{
+	if (vec_job.empty())
+		return;
+
+	mJobs = &vec_job;
+	mOnSaved = onSaved;
+	mJournal = journal;
+	mReadQueue.reset(new BoundedQueue<Item>{ mNworkers });	//Read ahead by one stack per worker
+	mReorderBuffer.clear();
+	mSaved.assign(vec_job.size(), false);
+	mChecksums.assign(vec_job.size(), 0);
+	mNextReadIndex = 0;
+	mNextWriteIndex = 0;
+	mNextCommitIndex = 0;
+	mNactiveReaders = mNreaders;
+	mInFlight_byte = 0;
+	mPeakInFlight_byte = 0;
+	mProcessed_byte = 0;
+	mNskipped = 0;
+	mAbort = false;
+	mException = nullptr;
+	mStartTime = std::chrono::high_resolution_clock::now();
+
+	std::vector<std::thread> vec_thread;
+	for (int iterReader = 0; iterReader < mNreaders; iterReader++)
+		vec_thread.push_back(std::thread{ &BatchCorrector::readerLoop_, this });
+	for (int iterWorker = 0; iterWorker < mNworkers; iterWorker++)
+		vec_thread.push_back(std::thread{ &BatchCorrector::workerLoop_, this });
+	for (int iterWriter = 0; iterWriter < mNwriters; iterWriter++)
+		vec_thread.push_back(std::thread{ &BatchCorrector::writerLoop_, this });
+
+	for (auto &thread : vec_thread)
+		thread.join();
+
+	mReadQueue.reset();
+	mReorderBuffer.clear();
+	mOnSaved = nullptr;
+	mJournal = nullptr;
+	mJobs = nullptr;
+
+	if (mException)
+		std::rethrow_exception(mException);
+
+	const double duration_s{ std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - mStartTime).count() };
+	if (mNskipped > 0)
+		std::cout << mNskipped << " stacks skipped because they were already done\n";
+	std::cout << "Batch correction of " << vec_job.size() << " stacks completed in " << Util::toString(duration_s, 1) << " s (" << Util::toString(vec_job.size() / duration_s, 2) << " stacks/s, " <<
+		Util::toString(mProcessed_byte / duration_s / 1000000, 1) << " MB/s). Peak memory in flight = " << Util::toString(mPeakInFlight_byte / 1000000., 1) << " MB\n";
+}
+
+//Apply the corrections in the same order as the sequential routines
+//Pass gpuMutex when calling from multiple threads. The CPU corrections are thread safe
+void BatchCorrector::applyCorrection(TiffU8 &image, const CorrectionParam &param, std::mutex *gpuMutex)
+{
+	if (gpuMutex != nullptr)
+	{
+		std::lock_guard<std::mutex> lock{ *gpuMutex };
+		image.correctRSdistortionGPU(param.mFFOVfast);
+	}
+	else
+		image.correctRSdistortionGPU(param.mFFOVfast);
+
+	if (param.mSuppressCrosstalk)
+		image.suppressCrosstalk(param.mCrosstalkRatio, param.mFineTuningTop, param.mFineTuningBottom);
+	if (param.mFlattenField)
+		image.flattenFieldGaussian(param.mExpFactor);
+}
+
+//Same as applyCorrection(), for the worker threads of the batch correctors, which live for the whole batch
+//The scratch blocks are not in any budget (or only in the reservation of the current stack), so do not keep them for the life of the worker
+void BatchCorrector::applyCorrectionOnWorker(TiffU8 &image, const CorrectionParam &param, std::mutex &gpuMutex)
+{
+	applyCorrection(image, param, &gpuMutex);
+	ScratchArena::local().release();
+}
+
+//Memory held by a stack from reading to writing. Count twice the file size to account for the scratch blocks of the corrections, which the worker frees before the stack is written
+U64 BatchCorrector::estimateMemory_byte_(const int jobIndex) const
+{
+	const CorrectionJob &job{ mJobs->at(jobIndex) };
+	return 2 * static_cast<U64>(std::filesystem::file_size(job.mInputFolderPath + job.mInputFilename + ".tif"));
+}
+
+//Keep the first exception and unblock all the stages
+void BatchCorrector::abort_(const std::exception_ptr exception)
+{
+	{
+		std::lock_guard<std::mutex> lock{ mMutex };
+		if (!mException)
+			mException = exception;
+		mAbort = true;
+	}
+	mCondition.notify_all();
+	mReadQueue->close();
+}
+
+//The jobs are claimed and their memory reserved in order. Otherwise, a later stack could take up the budget needed by the stack the writers are waiting for
+void BatchCorrector::readerLoop_()
+{
+	try
+	{
+		while (true)
+		{
+			Item item;
+			{
+				std::unique_lock<std::mutex> lock{ mMutex };
+				bool claimed{ false };
+				while (!mAbort && mNextReadIndex < static_cast<int>(mJobs->size()))
+				{
+					const U64 reserved_byte{ estimateMemory_byte_(mNextReadIndex) };
+
+					//A stack larger than the budget is let through only when nothing else is in flight
+					if (mInFlight_byte == 0 || mInFlight_byte + reserved_byte <= mMemoryBudget_byte)
+					{
+						item.mJobIndex = mNextReadIndex++;
+						item.mReserved_byte = reserved_byte;
+						mInFlight_byte += reserved_byte;
+						mPeakInFlight_byte = (std::max)(mPeakInFlight_byte, mInFlight_byte);
+						claimed = true;
+						break;
+					}
+					mCondition.wait(lock);
+				}
+				if (!claimed)
+					break;
+			}
+
+			const CorrectionJob &job{ mJobs->at(item.mJobIndex) };
+			item.mKey = 0;
+			if (mJournal != nullptr)
+				item.mKey = CorrectionJournal::computeKey(job);
+
+			//Pass the skipped jobs down the pipeline without an image to keep the order of onSaved
+			if (mJournal != nullptr && mJournal->isDone(job, item.mKey))
+			{
+				{
+					std::lock_guard<std::mutex> lock{ mMutex };
+					mInFlight_byte -= item.mReserved_byte;
+					item.mReserved_byte = 0;
+				}
+				mCondition.notify_all();
+			}
+			else
+				item.mImage.reset(new TiffU8{ job.mInputFolderPath, job.mInputFilename });
+
+			if (!mReadQueue->push(std::move(item)))
+				break;
+		}
+	}
+	catch (...)
+	{
+		abort_(std::current_exception());
+	}
+
+	//The last reader to finish tells the workers that no more stacks are coming
+	std::lock_guard<std::mutex> lock{ mMutex };
+	if (--mNactiveReaders == 0)
+		mReadQueue->close();
+}
+
+void BatchCorrector::workerLoop_()
+{
+	try
+	{
+		Item item;
+		while (mReadQueue->pop(item))
+		{
+			if (item.mImage)
+			{
+				applyCorrectionOnWorker(*item.mImage, mJobs->at(item.mJobIndex).mParam, mGpuMutex);		//Frees the scratch blocks before the reservation of the stack is returned
+			}
+			{
+				std::lock_guard<std::mutex> lock{ mMutex };
+				const int jobIndex{ item.mJobIndex };
+				mReorderBuffer.emplace(jobIndex, std::move(item));
+			}
+			mCondition.notify_all();
+		}
+	}
+	catch (...)
+	{
+		abort_(std::current_exception());
+	}
+}
+
+//The writers claim the jobs in order, so the files are written in roughly the same order as the sequential routines
+void BatchCorrector::writerLoop_()
+{
+	try
+	{
+		while (true)
+		{
+			Item item;
+			{
+				std::unique_lock<std::mutex> lock{ mMutex };
+				if (mAbort || mNextWriteIndex >= static_cast<int>(mJobs->size()))
+					break;
+				const int jobIndex{ mNextWriteIndex++ };
+				mCondition.wait(lock, [&] { return mAbort || mReorderBuffer.count(jobIndex); });
+				if (mAbort)
+					break;
+				item = std::move(mReorderBuffer.at(jobIndex));
+				mReorderBuffer.erase(jobIndex);
+			}
+
+			const CorrectionJob &job{ mJobs->at(item.mJobIndex) };
+			if (item.mImage)
+			{
+				item.mImage->saveToFile(job.mOutputFolderPath, job.mOutputFilename, TIFFSTRUCT::MULTIPAGE, OVERRIDE::EN);
+				const U32 checksum{ mOnSaved ? item.mImage->computeCRC32() : 0 };
+				item.mImage.reset();
+				if (mJournal != nullptr)
+					mJournal->record(job, item.mKey);
+				{
+					std::lock_guard<std::mutex> lock{ mMutex };
+					mInFlight_byte -= item.mReserved_byte;
+					mProcessed_byte += item.mReserved_byte / 2;
+					mChecksums.at(item.mJobIndex) = checksum;
+				}
+				mCondition.notify_all();
+			}
+			else
+			{
+				const U32 checksum{ mOnSaved ? TileManifest::computeChecksum(job.mOutputFolderPath, job.mOutputFilename + ".tif") : 0 };
+				std::lock_guard<std::mutex> lock{ mMutex };
+				mNskipped++;
+				mChecksums.at(item.mJobIndex) = checksum;
+			}
+
+			commitSaved_(item.mJobIndex);
+			Util::pressESCforEarlyTermination();
+		}
+	}
+	catch (...)
+	{
+		abort_(std::current_exception());
+	}
+}
+
+//Call onSaved for the saved stacks in job order and report the progress
+void BatchCorrector::commitSaved_(const int jobIndex)
+{
+	std::lock_guard<std::mutex> lock{ mMutex };
+	mSaved.at(jobIndex) = true;
+	while (mNextCommitIndex < static_cast<int>(mJobs->size()) && mSaved.at(mNextCommitIndex))
+	{
+		if (mOnSaved)
+			mOnSaved(mNextCommitIndex, mChecksums.at(mNextCommitIndex));
+		mNextCommitIndex++;
+
+		const double duration_s{ std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - mStartTime).count() };
+		std::cout << "Progress: " << mNextCommitIndex << "/" << mJobs->size() << "\t" << Util::toString(mNextCommitIndex / duration_s, 2) << " stacks/s\t" <<
+			Util::toString(mProcessed_byte / duration_s / 1000000, 1) << " MB/s\tmemory in flight = " << Util::toString(mInFlight_byte / 1000000., 1) << " MB\n";
+	}
+}
+#pragma endregion "BatchCorrector"
+
+
+#pragma region "StackRing"
+//Create the ring. The slot capacity must fit the raw buffers of the largest stack
+StackRing::StackRing(const std::string name, const int nSlots, const U64 slotCapacity_byte) :
+	mName{ name },
+	mRole{ ROLE::PRODUCER }
+{
+	if (nSlots <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The number of slots must be > 0");
+	if (slotCapacity_byte == 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The slot capacity must be > 0");
+
+	//Align the slots to 64 bytes (cache line)
+	const U64 slotHeaderSize_byte{ (sizeof(SlotHeader_) + 63) / 64 * 64 };
+	const U64 slotSize_byte{ slotHeaderSize_byte + (slotCapacity_byte + 63) / 64 * 64 };
+	const U64 ringHeaderSize_byte{ (sizeof(RingHeader_) + 63) / 64 * 64 };
+	map_(ringHeaderSize_byte + nSlots * slotSize_byte, true);
+
+	mHeader = new (mBase) RingHeader_();
+	mHeader->mNslots = nSlots;
+	mHeader->mSlotCapacity_byte = slotCapacity_byte;
+	mHeader->mTotalSize_byte = mMappedSize_byte;
+	for (int iterSlot = 0; iterSlot < nSlots; iterSlot++)
+		new (&slot_(iterSlot)) SlotHeader_();
+
+	mHeader->mProducer.mLastBeat_ms.store(now_ms_());
+	mHeader->mProducer.mIsAttached.store(1);
+	mHeartbeatThread = std::thread{ &StackRing::heartbeatLoop_, this, std::ref(mHeader->mProducer) };
+
+	//Write the magic number last, so that a processing process never opens a ring that is not initialized
+	std::atomic_thread_fence(std::memory_order_release);
+	mHeader->mMagic = mMagic;
+}
+
+//Open the ring created by the acquisition process and register as a consumer
+StackRing::StackRing(const std::string name) :
+	mName{ name },
+	mRole{ ROLE::CONSUMER }
+{
+	map_(0, false);
+	mHeader = reinterpret_cast<RingHeader_*>(mBase);
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (mHeader->mMagic != mMagic)
+	{
+		unmap_();
+		throw std::runtime_error((std::string)__FUNCTION__ + ": The stack ring " + name + " is not initialized");
+	}
+
+	//Release the stacks of the dead consumers before reusing their entries
+	reclaimAbandoned_();
+	for (int iterConsumer = 0; iterConsumer < mMaxConsumers && mConsumerIndex == mNoConsumer; iterConsumer++)
+	{
+		Heartbeat_ &heartbeat{ mHeader->mConsumers[iterConsumer] };
+		int isAttached{ 0 };
+		if (heartbeat.mIsAttached.compare_exchange_strong(isAttached, 1))
+		{
+			heartbeat.mLastBeat_ms.store(now_ms_());
+			mConsumerIndex = iterConsumer;
+		}
+		else if (!isAlive_(heartbeat))
+		{
+			//Take over the entry of a dead consumer. The compare-exchange makes sure that only one process takes it
+			long long lastBeat_ms{ heartbeat.mLastBeat_ms.load() };
+			if (now_ms_() - lastBeat_ms > mHeartbeatTimeout / ms && heartbeat.mLastBeat_ms.compare_exchange_strong(lastBeat_ms, now_ms_()))
+				mConsumerIndex = iterConsumer;
+		}
+	}
+
+	if (mConsumerIndex == mNoConsumer)
+	{
+		unmap_();
+		throw std::runtime_error((std::string)__FUNCTION__ + ": Too many processes are attached to the stack ring " + name);
+	}
+	mHeartbeatThread = std::thread{ &StackRing::heartbeatLoop_, this, std::ref(mHeader->mConsumers[mConsumerIndex]) };
+}
+
+StackRing::~StackRing()
+{
+	mStopHeartbeat = true;
+	if (mHeartbeatThread.joinable())
+		mHeartbeatThread.join();
+
+	if (mRole == ROLE::PRODUCER)
+		mHeader->mProducer.mIsAttached.store(0);
+	else
+		mHeader->mConsumers[mConsumerIndex].mIsAttached.store(0);
+
+	unmap_();
+}
+
+//Copy the raw buffers of a stack to the next slot. Block while the slot is not free, i.e., while the processing processes are behind
+//If no processing process is alive, the fallback (if any) processes the oldest stack in this process, so that the acquisition does not wait for a dead process forever
+//Return the sequence number of the stack
+U64 StackRing::publish(StackHeader header, const U32 *bufferA, const U32 *bufferB, PROCESSOR fallback)
+{
+	if (mRole != ROLE::PRODUCER)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": Only the process that created the stack ring can publish");
+	if ((static_cast<U64>(header.mNpixA) + header.mNpixB) * sizeof(U32) > mHeader->mSlotCapacity_byte)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The stack does not fit in a slot of the stack ring");
+
+	const int slotIndex{ static_cast<int>(mNextSequence % mHeader->mNslots) };
+	SlotHeader_ &slot{ slot_(slotIndex) };
+
+	const auto startTime{ std::chrono::high_resolution_clock::now() };
+	waitUntil_([&] { collect_(); return decodeState_(slot.mState.load()) == FREE; }, fallback);
+	mStallTime += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count() * seconds;
+
+	header.mSequence = mNextSequence;
+	slot.mStack = header;
+	U32 *data{ slotData_(slotIndex) };
+	if (header.mNpixA > 0)
+		std::memcpy(data, bufferA, header.mNpixA * sizeof(U32));
+	if (header.mNpixB > 0)
+		std::memcpy(data + header.mNpixA, bufferB, header.mNpixB * sizeof(U32));
+	slot.mState.store(encode_(WRITTEN, mNoConsumer));			//Publish the stack after its data
+
+	return mNextSequence++;
+}
+
+//Return the sequence numbers and checksums of the stacks saved since the last call, in the order of publication, and free their slots
+//The stacks that failed to be processed are returned in 'failed'
+std::vector<StackRing::SavedStack> StackRing::collectSaved(std::vector<U64> *failed)
+{
+	collect_();
+
+	std::vector<SavedStack> saved;
+	saved.swap(mSaved);
+	if (failed != nullptr)
+		failed->swap(mFailed);
+	mFailed.clear();
+
+	return saved;
+}
+
+//Wait until all the published stacks are processed. They are still returned by collectSaved()
+void StackRing::waitForAll(PROCESSOR fallback)
+{
+	waitUntil_([&] { collect_(); return mNextCollected == mNextSequence; }, fallback);
+}
+
+//No more stacks will be published. The processing processes finish once they have processed the last stack
+void StackRing::close()
+{
+	mHeader->mIsClosed.store(1);
+}
+
+//Number of stacks published but not collected yet
+int StackRing::readNpending() const
+{
+	return static_cast<int>(mNextSequence - mNextCollected);
+}
+
+double StackRing::readStallTime() const
+{
+	return mStallTime;
+}
+
+//Claim the oldest published stack and process it. Return false if no stack is published within the timeout
+bool StackRing::processNext(PROCESSOR processor, const double timeout)
+{
+	const auto startTime{ std::chrono::high_resolution_clock::now() };
+	while (std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count() * seconds < timeout)
+	{
+		reclaimAbandoned_();
+		const int slotIndex{ claimOldest_() };
+		if (slotIndex >= 0)
+		{
+			processSlot_(slotIndex, processor);
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::microseconds(static_cast<long long>(mPollPeriod / us)));
+	}
+	return false;
+}
+
+//The acquisition process has closed the ring or died, and there is no stack left to process
+bool StackRing::isFinished() const
+{
+	if (!mHeader->mIsClosed.load() && isAlive_(mHeader->mProducer))
+		return false;
+
+	for (int iterSlot = 0; iterSlot < mHeader->mNslots; iterSlot++)
+	{
+		const int code{ slot_(iterSlot).mState.load() };
+		if (decodeState_(code) == WRITTEN)
+			return false;
+		//A stack claimed by a dead consumer is going to be released
+		if (decodeState_(code) == CLAIMED && decodeConsumer_(code) != mNoConsumer && !isAlive_(mHeader->mConsumers[decodeConsumer_(code)]))
+			return false;
+	}
+	return true;
+}
+
+bool StackRing::isAnyConsumerAlive() const
+{
+	for (int iterConsumer = 0; iterConsumer < mMaxConsumers; iterConsumer++)
+		if (isAlive_(mHeader->mConsumers[iterConsumer]))
+			return true;
+	return false;
+}
+
+//Number of stacks released because the process that claimed them died
+int StackRing::readNreclaimed() const
+{
+	return mHeader->mNreclaimed.load();
+}
+
+//Map the shared memory. When opening an existing ring, its size is read from the shared-memory object
+void StackRing::map_(const U64 size_byte, const bool create)
+{
+#ifdef _WIN32
+	const std::string mappingName{ "Local\\" + mName };
+	if (create)
+	{
+		mMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, static_cast<DWORD>(size_byte >> 32), static_cast<DWORD>(size_byte & 0xFFFFFFFF), mappingName.c_str());
+		if (mMapping != nullptr && GetLastError() == ERROR_ALREADY_EXISTS)
+		{
+			CloseHandle(mMapping);
+			throw std::runtime_error((std::string)__FUNCTION__ + ": The stack ring " + mName + " is still open by another process");
+		}
+	}
+	else
+		mMapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, mappingName.c_str());
+
+	if (mMapping == nullptr)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": Failure opening the shared memory of the stack ring " + mName);
+
+	mBase = static_cast<U8*>(MapViewOfFile(mMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+	if (mBase == nullptr)
+	{
+		CloseHandle(mMapping);
+		throw std::runtime_error((std::string)__FUNCTION__ + ": Failure mapping the stack ring " + mName + ". The ring might not fit in the address space");
+	}
+	MEMORY_BASIC_INFORMATION memoryInfo;
+	VirtualQuery(mBase, &memoryInfo, sizeof(memoryInfo));
+	mMappedSize_byte = create ? size_byte : memoryInfo.RegionSize;
+#else
+	const std::string objectName{ "/" + mName };
+	if (create)
+	{
+		shm_unlink(objectName.c_str());					//The processes attached to a previous ring keep their mapping
+		mFileDescriptor = shm_open(objectName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (mFileDescriptor >= 0 && ftruncate(mFileDescriptor, static_cast<off_t>(size_byte)) != 0)
+		{
+			::close(mFileDescriptor);
+			shm_unlink(objectName.c_str());
+			throw std::runtime_error((std::string)__FUNCTION__ + ": Failure allocating the shared memory of the stack ring " + mName);
+		}
+		mMappedSize_byte = size_byte;
+	}
+	else
+	{
+		mFileDescriptor = shm_open(objectName.c_str(), O_RDWR, 0600);
+		struct stat fileStatus;
+		if (mFileDescriptor >= 0 && fstat(mFileDescriptor, &fileStatus) == 0)
+			mMappedSize_byte = static_cast<U64>(fileStatus.st_size);
+	}
+
+	if (mFileDescriptor < 0 || mMappedSize_byte == 0)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": Failure opening the shared memory of the stack ring " + mName);
+
+	void *base{ mmap(nullptr, mMappedSize_byte, PROT_READ | PROT_WRITE, MAP_SHARED, mFileDescriptor, 0) };
+	if (base == MAP_FAILED)
+	{
+		::close(mFileDescriptor);
+		throw std::runtime_error((std::string)__FUNCTION__ + ": Failure mapping the stack ring " + mName);
+	}
+	mBase = static_cast<U8*>(base);
+#endif
+	mHeader = reinterpret_cast<RingHeader_*>(mBase);
+}
+
+void StackRing::unmap_()
+{
+#ifdef _WIN32
+	UnmapViewOfFile(mBase);
+	CloseHandle(mMapping);
+#else
+	munmap(mBase, mMappedSize_byte);
+	::close(mFileDescriptor);
+	if (mRole == ROLE::PRODUCER)
+		shm_unlink(("/" + mName).c_str());				//The processing processes keep their mapping until they detach
+#endif
+	mBase = nullptr;
+	mHeader = nullptr;
+}
+
+StackRing::SlotHeader_ &StackRing::slot_(const int slotIndex) const
+{
+	const U64 slotHeaderSize_byte{ (sizeof(SlotHeader_) + 63) / 64 * 64 };
+	const U64 slotSize_byte{ slotHeaderSize_byte + (mHeader->mSlotCapacity_byte + 63) / 64 * 64 };
+	const U64 ringHeaderSize_byte{ (sizeof(RingHeader_) + 63) / 64 * 64 };
+	return *reinterpret_cast<SlotHeader_*>(mBase + ringHeaderSize_byte + slotIndex * slotSize_byte);
+}
+
+U32 *StackRing::slotData_(const int slotIndex) const
+{
+	const U64 slotHeaderSize_byte{ (sizeof(SlotHeader_) + 63) / 64 * 64 };
+	return reinterpret_cast<U32*>(reinterpret_cast<U8*>(&slot_(slotIndex)) + slotHeaderSize_byte);
+}
+
+//The consumer is stored as consumer + 1, so that mNoConsumer is stored as 0
+int StackRing::encode_(const SLOTSTATE state, const int consumer)
+{
+	return static_cast<int>(state) | ((consumer + 1) << 8);
+}
+
+StackRing::SLOTSTATE StackRing::decodeState_(const int code)
+{
+	return static_cast<SLOTSTATE>(code & 0xFF);
+}
+
+int StackRing::decodeConsumer_(const int code)
+{
+	return (code >> 8) - 1;
+}
+
+//Steady clock in ms. It is shared by all the processes of the machine
+long long StackRing::now_ms_()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool StackRing::isAlive_(const Heartbeat_ &heartbeat) const
+{
+	return heartbeat.mIsAttached.load() && now_ms_() - heartbeat.mLastBeat_ms.load() <= mHeartbeatTimeout / ms;
+}
+
+void StackRing::heartbeatLoop_(Heartbeat_ &heartbeat)
+{
+	while (!mStopHeartbeat)
+	{
+		heartbeat.mLastBeat_ms.store(now_ms_());
+		std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<long long>(mHeartbeatPeriod / ms)));
+	}
+}
+
+//Free the slots of the processed stacks in the order of publication. A stack that is not processed yet holds back the ones published after it
+void StackRing::collect_()
+{
+	while (mNextCollected < mNextSequence)
+	{
+		SlotHeader_ &slot{ slot_(static_cast<int>(mNextCollected % mHeader->mNslots)) };
+		const SLOTSTATE state{ decodeState_(slot.mState.load()) };
+		if (state == SAVED)
+			mSaved.push_back({ mNextCollected, slot.mStack.mChecksum });
+		else if (state == FAILED)
+			mFailed.push_back(mNextCollected);
+		else
+			break;
+
+		slot.mState.store(encode_(FREE, mNoConsumer));
+		mNextCollected++;
+	}
+}
+
+void StackRing::waitUntil_(std::function<bool()> isDone, PROCESSOR fallback)
+{
+	while (!isDone())
+	{
+		reclaimAbandoned_();
+		if (fallback && !isAnyConsumerAlive())
+		{
+			const int slotIndex{ claimOldest_() };
+			if (slotIndex >= 0)
+			{
+				processSlot_(slotIndex, fallback);
+				continue;
+			}
+		}
+		std::this_thread::sleep_for(std::chrono::microseconds(static_cast<long long>(mPollPeriod / us)));
+	}
+}
+
+//Release the stacks claimed by the consumers that stopped sending heartbeats
+void StackRing::reclaimAbandoned_()
+{
+	for (int iterSlot = 0; iterSlot < mHeader->mNslots; iterSlot++)
+	{
+		SlotHeader_ &slot{ slot_(iterSlot) };
+		int code{ slot.mState.load() };
+		const int consumer{ decodeConsumer_(code) };
+		if (decodeState_(code) == CLAIMED && consumer != mNoConsumer && !isAlive_(mHeader->mConsumers[consumer]) &&
+			slot.mState.compare_exchange_strong(code, encode_(WRITTEN, mNoConsumer)))
+		{
+			mHeader->mNreclaimed++;
+			std::cout << "The stack " << slot.mStack.mFilename << " was abandoned by a processing process and is released\n";
+		}
+	}
+}
+
+//Claim the oldest published stack. Return its slot, or -1 if there is none
+int StackRing::claimOldest_()
+{
+	while (true)
+	{
+		int oldestSlot{ -1 };
+		int oldestCode{ 0 };
+		for (int iterSlot = 0; iterSlot < mHeader->mNslots; iterSlot++)
+		{
+			const int code{ slot_(iterSlot).mState.load() };
+			if (decodeState_(code) == WRITTEN && (oldestSlot < 0 || slot_(iterSlot).mStack.mSequence < slot_(oldestSlot).mStack.mSequence))
+			{
+				oldestSlot = iterSlot;
+				oldestCode = code;
+			}
+		}
+
+		if (oldestSlot < 0)
+			return -1;
+		if (slot_(oldestSlot).mState.compare_exchange_strong(oldestCode, encode_(CLAIMED, mConsumerIndex)))
+			return oldestSlot;
+		//Another process claimed it first. Look again
+	}
+}
+
+void StackRing::processSlot_(const int slotIndex, PROCESSOR processor)
+{
+	SlotHeader_ &slot{ slot_(slotIndex) };
+	const U32 *data{ slotData_(slotIndex) };
+
+	SLOTSTATE result{ SAVED };
+	try
+	{
+		slot.mStack.mChecksum = processor(slot.mStack, slot.mStack.mNpixA > 0 ? data : nullptr, slot.mStack.mNpixB > 0 ? data + slot.mStack.mNpixA : nullptr);
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << "Failure processing the stack " << slot.mStack.mFilename << ": " << e.what() << "\n";
+		result = FAILED;
+	}
+
+	//If this process was considered dead and the stack was released, leave it to the process that claimed it again
+	int code{ encode_(CLAIMED, mConsumerIndex) };
+	slot.mState.compare_exchange_strong(code, encode_(result, mConsumerIndex));
+}
+#pragma endregion "StackRing"
\ No newline at end of file
@@ -1,4 +1,10 @@
 #include "Routines.h"
+#include <psapi.h>					//For GetProcessMemoryInfo
+#ifdef __linux__
+#include <fcntl.h>					//For the pseudo-terminals of TestRoutines::serialTransport
+#include <unistd.h>
+#include <termios.h>
+#endif
 
 namespace Routines
 {
@@ -114,6 +120,7 @@ namespace Routines
 		}
 
 		//CREATE THE CONTROL SEQUENCE
+		DeviceSessions sessions;		//Open the devices of the Mesoscope in the background, while the FPGA session is opened
 		RTseq realtimeSeq{ fpga, LINECLOCK::RS, FIFOOUTfpga::EN, heightPerBeamletPerFrame_pix, widthPerFrame_pix, nFramesCont, g_multibeam };
 		Mesoscope mesoscope{ realtimeSeq, whichLaser };
 		mesoscope.configure(fluorMarker.mWavelength_nm);
@@ -294,6 +301,7 @@ namespace Routines
 		}
 
 		//CONTROL SEQUENCE
+		DeviceSessions sessions;		//Open the devices of the Mesoscope in the background, while the FPGA session is opened
 		RTseq realtimeSeq{ fpga, LINECLOCK::RS, FIFOOUTfpga::EN, heightPerBeamletPerFrame_pix, widthPerFrame_pix, nFrames, g_multibeam };	//Note the STAGEZ flag
 		Mesoscope mesoscope{ realtimeSeq, whichLaser };
 		mesoscope.configure(fluorMarker.mWavelength_nm);
@@ -359,6 +367,7 @@ namespace Routines
 		PanoramicScan panoramicScan{ { stackCenterXYZ.XX, stackCenterXYZ.YY }, { tileHeight, tileWidth }, { pixelSizeX, pixelSizeY }, { fullHeight, fullWidth } };
 
 		//CONTROL SEQUENCE. The Image height is 2 (two galvo swings) and nFrames is stitchedHeight_pix/2. The total height of the final image is therefore stitchedHeight_pix. Note the STAGEX flag
+		DeviceSessions sessions;		//Open the devices of the Mesoscope in the background, while the FPGA session is opened
 		RTseq realtimeSeq{ fpga, LINECLOCK::RS, FIFOOUTfpga::EN, 2, panoramicScan.readTileWidth_pix(), panoramicScan.readTileHeight_pix() / 2, 0 };
 		Mesoscope mesoscope{ realtimeSeq, Laser::ID::VISION };
 		mesoscope.configure(fluorMarker.mWavelength_nm);
@@ -407,7 +416,7 @@ namespace Routines
 			Image image{ realtimeSeq };
 			image.acquireVerticalStrip(iterScanDirX);
 			image.correctRSdistortion(tileWidth);						//Correct the image distortion induced by the nonlinear scanning of the RS
-			panoramicScan.push(image.data(), { 0, iterLocation });		//for now, only allow to stack up strips to the right
+			panoramicScan.pushStrip(image.data(), { 0, iterLocation });		//for now, only allow to stack up strips to the right
 
 			reverseSCANDIR(iterScanDirX);
 			Util::pressESCforEarlyTermination();
@@ -420,7 +429,7 @@ namespace Routines
 			"_yi=" + Util::toString(panoramicScan.readStageYposFront() / mm, 3) + "_yf=" + Util::toString(panoramicScan.readStageYposBack() / mm, 3) +
 			"_z=" + Util::toString(stackCenterXYZ.ZZ / mm, 4) };
 		std::cout << "Saving the stack...\n";
-		panoramicScan.saveToFile(g_imagingFolderPath, filename, OVERRIDE::DIS);
+		panoramicScan.savePyramidToFile(g_imagingFolderPath, filename, OVERRIDE::DIS);
 
 		//Tile size for the slow scan. Do not call the tile size from panoramicScan because the tiles are long strips. 
 		const PIXDIM2 overlayTileSize_pix{ Util::intceil(tileHeight / pixelSizeX), Util::intceil(tileWidth / pixelSizeY) };
@@ -432,9 +441,437 @@ namespace Routines
 		//boolmap.saveTiffWithBoolmapTileOverlay("TileArrayMap_" + filename);
 	}
 
+	//Publish the raw buffers of the stack acquired by realtimeSeq to the stack ring. Singlebeam only publishes the buffer that contains the selected PMT channel
+	//If no processing process is running, the oldest stack is processed here when the ring is full
+	U64 publishRawStack(StackRing &stackRing, const RTseq &realtimeSeq, const int nFramesBinning, const std::string folderPath, const std::string filename)
+	{
+		StackRing::StackHeader header{};
+		if (folderPath.size() >= sizeof(header.mFolderPath) || filename.size() >= sizeof(header.mFilename))
+			throw std::invalid_argument((std::string)__FUNCTION__ + ": The path of the stack " + filename + " is too long");
+
+		header.mHeightPerBeamletPerFrame_pix = realtimeSeq.mHeightPerBeamletPerFrame_pix;
+		header.mWidthPerFrame_pix = realtimeSeq.mWidthPerFrame_pix;
+		header.mNframes = realtimeSeq.mNframes;
+		header.mMultibeam = realtimeSeq.mMultibeam;
+		header.mPMT16Xchan = static_cast<int>(realtimeSeq.mPMT16Xchan);
+		header.mScanDir = static_cast<int>(realtimeSeq.mScanDir);
+		header.mNframesBinning = nFramesBinning;
+		const bool isChanInBufferA{ realtimeSeq.mPMT16Xchan >= RTseq::PMT16XCHAN::CH00 && realtimeSeq.mPMT16Xchan <= RTseq::PMT16XCHAN::CH07 };
+		const bool isChanInBufferB{ realtimeSeq.mPMT16Xchan >= RTseq::PMT16XCHAN::CH08 && realtimeSeq.mPMT16Xchan <= RTseq::PMT16XCHAN::CH15 };
+		header.mNpixA = (realtimeSeq.mMultibeam || isChanInBufferA) ? realtimeSeq.mNpixPerBeamletAllFrames : 0;
+		header.mNpixB = (realtimeSeq.mMultibeam || isChanInBufferB) ? realtimeSeq.mNpixPerBeamletAllFrames : 0;
+		folderPath.copy(header.mFolderPath, sizeof(header.mFolderPath) - 1);
+		filename.copy(header.mFilename, sizeof(header.mFilename) - 1);
+
+		return stackRing.publish(header, realtimeSeq.dataBufferA(), realtimeSeq.dataBufferB(), &processRawStack);
+	}
+
+	//Keep the entries of the stacks in savedFilenames in the configuration file for the stitchers, so that the stacks redone when resuming a sequence are not listed twice
+	//Each entry is a line "filename.tif;;\t(...)" followed by the comment "#(II,JJ)\tlongName"
+	void trimTileConfiguration(const std::string folderPath, const std::string filename, const std::vector<std::string> &savedFilenames)
+	{
+		const std::set<std::string> savedFilenameSet(savedFilenames.begin(), savedFilenames.end());
+		std::vector<std::string> lines{ "dim=3" };	//Needed for GridStitcher on Fiji
+		std::ifstream inputFile{ folderPath + filename + ".txt" };
+		std::string line;
+		bool isEntryKept{ false };
+		while (std::getline(inputFile, line))
+		{
+			if (line.empty() || line == "dim=3")
+				continue;
+			if (line.front() != '#')
+				isEntryKept = savedFilenameSet.count(line.substr(0, line.find(";;"))) > 0;
+			if (isEntryKept)
+				lines.push_back(line);
+		}
+		inputFile.close();
+
+		std::ofstream outputFile{ folderPath + filename + ".txt" };
+		if (!outputFile)
+			throw std::runtime_error((std::string)__FUNCTION__ + ": The file " + filename + ".txt failed to open");
+		for (const std::string &keptLine : lines)
+			outputFile << keptLine << "\n";
+	}
+
+	//Settings of the panoramic scans of the sequencer
+	struct PanoramicSettings
+	{
+		double mWidth;					//Total width of the panoramic scan
+		double mHeight;					//Total height of the panoramic scan = height of the strip (long vertical tile)
+		double mTileHeight;
+		double mTileWidth;				//Width of a strip of the panoramic scan
+		double mPixelSizeX;
+		double mPixelSizeY;
+		double mLaserPower;
+		int mWavelength_nm;
+		bool mAdaptive;					//Scan a coarse panoramic first and only rescan the tissue and its border at full resolution
+		int mCoarseFactor;				//Pixel size in X of the coarse panoramic = mCoarseFactor * mPixelSizeX
+		int mCoarseBinning;				//Number of lines averaged into each row of the coarse panoramic
+		int mBoolmapLevel;				//Level of the panoramic pyramid used for generating the boolmap (0 = full resolution)
+		PIXDIM2 mOverlayTileSize_pix;	//Tile size of the boolmap on the panoramic
+		TILEOVERLAP3 mOverlapIJK_frac;
+		double mThreshold;
+	};
+
+	//Stack acquired by the sequencer. The stack is demultiplexed and saved on separate threads while the stages move to and acquire the next stack
+	struct SequencerStack
+	{
+		int mCutNumber;
+		int mWavelength_nm;
+		TILEIJ mTileIJ;
+		POSITION2 mTileCenterXY;
+		double mScanZi;
+		double mScanZf;
+		double mScanPmin;
+		double mScanPLexp;
+		SCANDIR mScanDirZ;
+		int mNframesBinning;
+		int mNframesBeforeBinning;
+		double mPixelSizeZbeforeBinning;
+		std::string mLaser_s;					//Laser used for the acquisition
+		std::unique_ptr<Image> mImage;			//Demultiplexed stack
+	};
+
+	//Dead time of the tiles = from the end of the download of a stack to the start of the scan of the next stack. The cuts and panoramic scans are not counted
+	struct DeadTime
+	{
+		std::chrono::time_point<std::chrono::high_resolution_clock> mLastDownloadEndTime;
+		bool mIsMeasured{ false };
+		double mTotal{ 0 };
+		int mNtiles{ 0 };
+	};
+
+	//Plan the order of the bright tiles and the wavelengths of the cut that starts at the MOV commandIndex, once the boolmap of the cut is final. Pass nullptr to skip a planner
+	//The plan is recorded in the journal, so that a resumed sequence replays it. The tile path is traveled once per fluorescent marker
+	void planCut(Sequencer &sequence, const int commandIndex, const int cutNumber, const TileBitmap &tileBitmap, const int nFluorMarkers, const TilePathPlanner *tilePathPlanner, const WavelengthScheduler *wavelengthScheduler,
+		const Mesoscope &mesoscope, SequenceJournal &journal, double &travelTimeSaved, double &switchingTimeSaved)
+	{
+		std::vector<TILEIJ> plannedTilePath;
+		std::vector<int> scheduledOrder_nm;
+		bool isWavelengthScheduled{ false };
+		if (tilePathPlanner != nullptr)
+		{
+			std::vector<TILEIJ> brightTilePath;
+			for (const TILEIJ &tileIJ : sequence.readTilePath(commandIndex))
+				if (tileBitmap.test(tileIJ))
+					brightTilePath.push_back(tileIJ);
+
+			plannedTilePath = tilePathPlanner->planPath(brightTilePath);
+			const double predictedTime{ tilePathPlanner->predictPathTime(brightTilePath) };
+			const double plannedPredictedTime{ tilePathPlanner->predictPathTime(plannedTilePath) };
+			std::cout << "Stage travel time per wavelength (predicted/simulated): current path = " << predictedTime / seconds << "/" << tilePathPlanner->simulatePathTime(brightTilePath) / seconds <<
+				" s\tplanned path = " << plannedPredictedTime / seconds << "/" << tilePathPlanner->simulatePathTime(plannedTilePath) / seconds << " s\n";
+			travelTimeSaved += nFluorMarkers * (predictedTime - plannedPredictedTime);
+
+			sequence.reorderTilePath(commandIndex, plannedTilePath);
+		}
+
+		//The cut has no tile commands left if all its tiles are dark
+		if (wavelengthScheduler != nullptr && commandIndex < sequence.readNtotalCommands() && sequence.readCommandline(commandIndex).mActionID == Action::ID::MOV)
+		{
+			const WavelengthScheduler::LaserState laserState{ mesoscope.readCurrentWavelength_nm(), mesoscope.readVisionWavelength_nm() };
+			const std::vector<int> wavelengthOrder_nm{ sequence.readWavelengthOrder(commandIndex) };
+			scheduledOrder_nm = wavelengthScheduler->planOrder(laserState, wavelengthOrder_nm);
+			const double switchingTime{ wavelengthScheduler->determineSwitchingTime(laserState, wavelengthOrder_nm) };
+			const double scheduledSwitchingTime{ wavelengthScheduler->determineSwitchingTime(laserState, scheduledOrder_nm) };
+
+			std::cout << "Wavelength order:";
+			for (const int wavelength_nm : scheduledOrder_nm)
+				std::cout << " " << wavelength_nm << " nm";
+			std::cout << "\tSwitching time (predicted): " << scheduledSwitchingTime / seconds << " s (" << switchingTime / seconds << " s in the order of the sample)\n";
+			switchingTimeSaved += switchingTime - scheduledSwitchingTime;
+
+			sequence.reorderWavelengths(commandIndex, scheduledOrder_nm);
+			isWavelengthScheduled = true;
+		}
+		journal.recordPlan(commandIndex, cutNumber, tileBitmap, tilePathPlanner != nullptr, plannedTilePath, isWavelengthScheduled, scheduledOrder_nm);
+	}
+
+	//Submit the acquisition of the stack to the pipeline: configure, move, arm (build and upload the control sequence), and trigger
+	//The move uses the chromatic shift of the new wavelength, so it does not wait for the laser
+	void submitStackAcquisition(StackPipeline<ActionExecutor> &pipeline, ActionTimeLog &actionTimeLog, RTseq &realtimeSeq, Mesoscope &mesoscope, const Stack &stack,
+		const std::shared_ptr<SequencerStack> stackInFlight, const std::vector<double> &modeledTime, const std::string scanningMessage, DeadTime &deadTime)
+	{
+		const int heightPerBeamletPerFrame_pix{ g_multibeam ? stack.readTileHeight_pix() / g_nChanPMT : stack.readTileHeight_pix() };
+		const double FFOVslowPerBeamlet{ g_multibeam ? stack.readFFOV(AXIS::XX) / g_nChanPMT : stack.readFFOV(AXIS::XX) };
+		const int widthPerFrame_pix{ stack.readTileWidth_pix() };
+		const int wavelength_nm{ stackInFlight->mWavelength_nm };
+		const POSITION2 tileCenterXY{ stackInFlight->mTileCenterXY };
+
+		pipeline.submitAcquisition("(" + std::to_string(stackInFlight->mTileIJ.II) + "," + std::to_string(stackInFlight->mTileIJ.JJ) + ") " + std::to_string(wavelength_nm) + " nm",
+			actionTimeLog.timeAction(SequenceTimeModel::COST::SWITCH, modeledTime, [&mesoscope, wavelength_nm]
+		{
+			mesoscope.configure(wavelength_nm);									//The uniblitz shutter is closed by the pockels destructor when switching wavelengths
+		}),
+			actionTimeLog.timeAction(SequenceTimeModel::COST::MOV, modeledTime, [&mesoscope, tileCenterXY, wavelength_nm]
+		{
+			mesoscope.moveXY(tileCenterXY, wavelength_nm);
+			mesoscope.waitForMotionToStopAll();
+		}),
+			[=, &realtimeSeq, &mesoscope]
+		{
+			{
+				realtimeSeq.reconfigure(heightPerBeamletPerFrame_pix, widthPerFrame_pix, stackInFlight->mNframesBeforeBinning, g_multibeam);
+				mesoscope.setPowerExponentialScaling(stackInFlight->mScanPmin, stackInFlight->mPixelSizeZbeforeBinning, Util::convertScandirToInt(stackInFlight->mScanDirZ) * stackInFlight->mScanPLexp);
+
+				//SCANNERS
+				const Galvo scanner{ realtimeSeq, FFOVslowPerBeamlet / 2. };
+				Galvo rescanner{ realtimeSeq, FFOVslowPerBeamlet / 2., mesoscope.readCurrentLaser(), mesoscope.readCurrentWavelength_nm() };
+			}
+			realtimeSeq.arm(MAINTRIG::STAGEZ, wavelength_nm, stackInFlight->mScanDirZ);		//Use the scan direction determined dynamically
+		},
+			actionTimeLog.timeAction(SequenceTimeModel::COST::ACQ, modeledTime, [=, &realtimeSeq, &mesoscope, &deadTime]
+		{
+			//Set the vel for imaging. Frame duration (i.e., a galvo swing) = halfPeriodLineclock * heightPerBeamletPerFrame_pix	
+			mesoscope.setVelSingle(AXIS::ZZ, stackInFlight->mPixelSizeZbeforeBinning / (g_lineclockHalfPeriod * heightPerBeamletPerFrame_pix));
+
+			//Move the stage to the initial Z position
+			mesoscope.moveSingle(AXIS::ZZ, stackInFlight->mScanZi);
+			mesoscope.waitForMotionToStopAll();
+
+			realtimeSeq.enableTrigger();
+			mesoscope.openShutter();											//Re-open the Uniblitz shutter if closed by the pockels destructor
+
+			//Dead time of the tile = from the end of the download of the previous stack to the start of this scan
+			std::string message{ scanningMessage };
+			if (deadTime.mIsMeasured)
+			{
+				const double tileDeadTime{ std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - deadTime.mLastDownloadEndTime).count() * seconds };
+				deadTime.mTotal += tileDeadTime;
+				deadTime.mNtiles++;
+				message += "\tDead time = " + Util::toString(tileDeadTime / ms, 0) + " ms";
+			}
+			std::cout << message + "\n";
+
+			mesoscope.moveSingle(AXIS::ZZ, stackInFlight->mScanZf);				//Move the stage to trigger the ctl&acq sequence
+			realtimeSeq.downloadData();
+			deadTime.mLastDownloadEndTime = std::chrono::high_resolution_clock::now();
+			deadTime.mIsMeasured = true;
+			stackInFlight->mLaser_s = mesoscope.readCurrentLaser_s(true);
+		}));
+	}
+
+	//Name the stack. A file that is already on disk, e.g. from a crash between saving a stack and recording it or from a previous run, is not overwritten
+	void nameSequencerStack(const SequencerStack &stackInFlight, const double pixelSizeZafterBinning, std::string &shortName, std::string &longName)
+	{
+		shortName = Util::zeroPadding(stackInFlight.mCutNumber, 3) + "_" + Util::convertWavelengthToFluorMarker_s(stackInFlight.mWavelength_nm) + "_" +
+			Util::zeroPadding(stackInFlight.mTileIJ.II, 2) + "_" + Util::zeroPadding(stackInFlight.mTileIJ.JJ, 2);		//cutNumber_stackIndex_wavelengthIndex
+		longName = stackInFlight.mLaser_s + Util::toString(stackInFlight.mWavelength_nm, 0) + "nm_Pmin=" + Util::toString(stackInFlight.mScanPmin / mW, 1) + "mW_PLexp=" + Util::toString(stackInFlight.mScanPLexp / um, 0) + "um" +
+			"_x=" + Util::toString(stackInFlight.mTileCenterXY.XX / mm, 3) +
+			"_y=" + Util::toString(stackInFlight.mTileCenterXY.YY / mm, 3) +
+			"_zi=" + Util::toString(stackInFlight.mScanZi / mm, 4) + "_zf=" + Util::toString(stackInFlight.mScanZf / mm, 4) +
+			"_Step=" + Util::toString(pixelSizeZafterBinning / mm, 4) + "_bin=" + Util::toString(stackInFlight.mNframesBinning, 0);
+
+		shortName = Util::doesFileExist(g_imagingFolderPath, shortName, ".tif");
+	}
+
+	//Submit the demultiplexing, binning, and saving of the stack to the pipeline. recordStack(shortName, longName, checksum) records the saved stack
+	//The binned stack feeds the boolmap predictor, if any
+	void submitStackSave(StackPipeline<ActionExecutor> &pipeline, ActionTimeLog &actionTimeLog, RTseq &realtimeSeq, const std::shared_ptr<SequencerStack> stackInFlight, const double pixelSizeZafterBinning,
+		const std::vector<double> &modeledTime, BoolmapPredictor *boolmapPredictor, const std::function<void(const std::string, const std::string, const U32)> recordStack)
+	{
+		const std::string label{ "(" + std::to_string(stackInFlight->mTileIJ.II) + "," + std::to_string(stackInFlight->mTileIJ.JJ) + ")" };
+		pipeline.submitReadout(label, actionTimeLog.timeAction(SequenceTimeModel::COST::DEMUX, modeledTime, [&realtimeSeq, stackInFlight]
+		{
+			stackInFlight->mImage.reset(new Image{ realtimeSeq });
+			stackInFlight->mImage->acquire();
+		}));
+		pipeline.submitSave(label, actionTimeLog.timeAction(SequenceTimeModel::COST::SAV, modeledTime, [=]
+		{
+			std::string shortName, longName;
+			nameSequencerStack(*stackInFlight, pixelSizeZafterBinning, shortName, longName);
+
+			Image &image{ *stackInFlight->mImage };
+			image.binFrames(stackInFlight->mNframesBinning);
+			if (boolmapPredictor != nullptr)
+				boolmapPredictor->addStack(image.data(), image.readScanDir(), stackInFlight->mTileIJ);
+			image.save(g_imagingFolderPath, shortName, TIFFSTRUCT::MULTIPAGE, OVERRIDE::EN);
+			recordStack(shortName, longName, image.computeCRC32());
+		}));
+	}
+
+	//Publish the raw buffers as soon as the stack is acquired. A stack processor demultiplexes, bins, and saves the stack while the stages move to and acquire the next stack
+	//The recording of the stack is kept in stackRecords under the sequence number of the published stack, until recordSavedStacks() collects it from the ring
+	//The binned stack is not available in this process. The boolmap predictor, if any, reads it back from the saved file, which is still in the file cache
+	void submitStackPublish(StackPipeline<ActionExecutor> &pipeline, RTseq &realtimeSeq, const std::shared_ptr<SequencerStack> stackInFlight, const double pixelSizeZafterBinning, StackRing &stackRing,
+		BoolmapPredictor *boolmapPredictor, std::map<U64, std::function<void(const U32 checksum)>> &stackRecords, const std::function<void()> recordSavedStacks,
+		const std::function<void(const std::string, const std::string, const U32)> recordStack)
+	{
+		pipeline.submitReadout("(" + std::to_string(stackInFlight->mTileIJ.II) + "," + std::to_string(stackInFlight->mTileIJ.JJ) + ")", [=, &realtimeSeq, &stackRing, &stackRecords]
+		{
+			std::string shortName, longName;
+			nameSequencerStack(*stackInFlight, pixelSizeZafterBinning, shortName, longName);
+			const U64 sequence{ publishRawStack(stackRing, realtimeSeq, stackInFlight->mNframesBinning, g_imagingFolderPath, shortName) };
+			const TILEIJ tileIJ{ stackInFlight->mTileIJ };
+			stackRecords[sequence] = [=](const U32 checksum)
+			{
+				//The saved file starts at the top of the stack, whatever the scan direction
+				if (boolmapPredictor != nullptr)
+					boolmapPredictor->addStack(TiffU8{ g_imagingFolderPath, shortName }.data(), SCANDIR::UPWARD, tileIJ);
+				recordStack(shortName, longName, checksum);
+			};
+			recordSavedStacks();
+		});
+	}
+
+	//Scan the strips of the panoramic at the plane planeZ. The laser must be configured to the wavelength of the panoramic. At full resolution, the boolmap is updated strip by strip
+	//Return the time scanning the strips. stageXi and stageXf return the X-stage positions of the last strip
+	double scanPanoramic(RTseq &realtimeSeq, Mesoscope &mesoscope, const PanoramicSettings &settings, const double planeZ, const int cutNumber, const TILEDIM2 tileArraySizeIJ,
+		PanoramicScan &panoramicScan, StreamingBoolmap &streamingBoolmap, double &stageXi, double &stageXf)
+	{
+		SCANDIR iterScanDirX{ SCANDIR::RIGHTWARD };												//Initial scan direction of stage 
+
+		//SCANNERS. Keep them fixed with amplitude 0
+		const Galvo scanner{ realtimeSeq, 0 };
+		const Galvo rescanner{ realtimeSeq, 0, mesoscope.readCurrentLaser(), mesoscope.readCurrentWavelength_nm() };
+
+		//STAGES
+		mesoscope.moveXYZ({ g_stackCenterXYZ.XX, g_stackCenterXYZ.YY, planeZ });				//Move the stage to the center of the panoramic view
+		mesoscope.waitForMotionToStopAll();
+		Sleep(500);																				//Give the stages enough time to settle at the initial position
+		mesoscope.setVelSingle(AXIS::XX, settings.mPixelSizeX / g_lineclockHalfPeriod);		//Set the vel for imaging
+		mesoscope.openShutter();																//Open the shutter
+
+		//LOCATIONS of the sample to image
+		const auto startTime{ std::chrono::high_resolution_clock::now() };
+		const int nLocations{ panoramicScan.readNumberStageYpos() };
+		if (!settings.mAdaptive)
+		{
+			for (int iterLocation = 0; iterLocation < nLocations; iterLocation++)
+			{
+				//Reload the imaging parameters because they are deleted after each individual sequence
+				realtimeSeq.reconfigure(2, panoramicScan.readTileWidth_pix(), panoramicScan.readTileHeight_pix() / 2, 0);
+				mesoscope.setPower(settings.mLaserPower);
+
+				const double travelOverhead{ 1.0 * mm };
+				stageXi = panoramicScan.determineInitialScanPosX(travelOverhead, iterScanDirX);
+				stageXf = panoramicScan.determineFinalScanPosX(travelOverhead, iterScanDirX);
+
+				std::cout << "Frame: " << iterLocation + 1 << "/" << nLocations << "\n";
+				mesoscope.moveXY({ stageXi, panoramicScan.readStageYposAt(iterLocation) });			//Move the stage to the start of the "ribbon" scan
+				mesoscope.waitForMotionToStopAll();
+				Sleep(300);																			//Avoid iterations too close to each other, otherwise the X-stage will fail to trigger the ctl&acq sequence.
+																									//This might be because of g_postSequenceTimer
+				realtimeSeq.initialize(MAINTRIG::STAGEX);
+				std::cout << "Scanning the stack...\n";
+				mesoscope.moveSingle(AXIS::XX, stageXf);											//Move the stage to trigger the ctl&acq sequence
+				realtimeSeq.downloadData();
+
+				Image image{ realtimeSeq };
+				image.acquireVerticalStrip(iterScanDirX);
+				image.correctRSdistortion(settings.mTileWidth);										//Correct the image distortion induced by the nonlinear scanning of the RS
+				panoramicScan.pushStrip(image.data(), { 0, iterLocation });							//for now, only allow to stack up strips to the right
+				if (settings.mBoolmapLevel == 0)
+					streamingBoolmap.update(iterLocation);
+
+				reverseSCANDIR(iterScanDirX);
+				Util::pressESCforEarlyTermination();
+			}
+		}
+		else
+		{
+			//Acquire the rows [top_pix, top_pix + height_pix) of a strip and stitch them to the panoramic. Each row is the average of nLinesPerRow lines spread over the pixel size in X
+			auto acquireStrip = [&](PanoramicScan &scan, const int iterLocation, const int top_pix, const int height_pix, const double pixelSizeX, const int nLinesPerRow)
+			{
+				realtimeSeq.reconfigure(2, scan.readTileWidth_pix(), height_pix * nLinesPerRow / 2, 0);
+				mesoscope.setPower(settings.mLaserPower);
+				mesoscope.setVelSingle(AXIS::XX, pixelSizeX / nLinesPerRow / g_lineclockHalfPeriod);
+
+				const double travelOverhead{ 1.0 * mm };
+				stageXi = scan.determineInitialScanPosX(travelOverhead, iterScanDirX, top_pix, height_pix);
+				stageXf = scan.determineFinalScanPosX(travelOverhead, iterScanDirX, top_pix, height_pix);
+
+				mesoscope.moveXY({ stageXi, scan.readStageYposAt(iterLocation) });				//Move the stage to the start of the "ribbon" scan
+				mesoscope.waitForMotionToStopAll();
+				Sleep(300);																		//Avoid iterations too close to each other, otherwise the X-stage will fail to trigger the ctl&acq sequence
+				realtimeSeq.initialize(MAINTRIG::STAGEX);
+				mesoscope.moveSingle(AXIS::XX, stageXf);										//Move the stage to trigger the ctl&acq sequence
+				realtimeSeq.downloadData();
+
+				Image image{ realtimeSeq };
+				image.acquireVerticalStrip(iterScanDirX);
+				image.correctRSdistortion(settings.mTileWidth);									//Correct the image distortion induced by the nonlinear scanning of the RS
+				if (nLinesPerRow > 1)
+					scan.pushStrip(AdaptivePanoramic::binLines(image.data(), height_pix * nLinesPerRow, scan.readTileWidth_pix(), nLinesPerRow).data(), { 0, iterLocation }, top_pix, height_pix);
+				else
+					scan.pushStrip(image.data(), { 0, iterLocation }, top_pix, height_pix);
+				reverseSCANDIR(iterScanDirX);
+				Util::pressESCforEarlyTermination();
+			};
+
+			//COARSE PASS. Scan all the strips with the X-stage mCoarseFactor / mCoarseBinning times faster and bin the lines, so that each row covers its pixel size in X
+			PanoramicScan coarseScan{ { g_stackCenterXYZ.XX, g_stackCenterXYZ.YY }, { settings.mTileHeight, settings.mTileWidth }, { settings.mCoarseFactor * settings.mPixelSizeX, settings.mPixelSizeY }, { settings.mHeight, settings.mWidth } };
+			const int coarseHeight_pix{ 2 * (coarseScan.readTileHeight_pix() / 2) };
+			for (int iterLocation = 0; iterLocation < nLocations; iterLocation++)
+			{
+				std::cout << "Coarse frame: " << iterLocation + 1 << "/" << nLocations << "\n";
+				acquireStrip(coarseScan, iterLocation, 0, coarseHeight_pix, settings.mCoarseFactor * settings.mPixelSizeX, settings.mCoarseBinning);
+			}
+
+			//Classify the tiles and plan which rows of each strip to rescan
+			AdaptivePanoramic adaptivePanoramic{ panoramicScan, coarseScan, tileArraySizeIJ, settings.mOverlayTileSize_pix, settings.mOverlapIJK_frac, settings.mThreshold };
+			std::cout << "Tiles empty/border/tissue: " << adaptivePanoramic.readNumberOfRegions(AdaptivePanoramic::REGION::EMPTY) << "/" <<
+				adaptivePanoramic.readNumberOfRegions(AdaptivePanoramic::REGION::BORDER) << "/" <<
+				adaptivePanoramic.readNumberOfRegions(AdaptivePanoramic::REGION::TISSUE) <<
+				"\tRescanned fraction: " << adaptivePanoramic.readRescannedFraction() << "\n";
+
+			//FINE PASS. Fill each strip with the upsampled coarse strip and rescan the rows covering the tissue and its border
+			for (int iterLocation = 0; iterLocation < nLocations; iterLocation++)
+			{
+				adaptivePanoramic.fillStripFromCoarse(iterLocation);
+				const int segmentIndex{ adaptivePanoramic.findSegment(iterLocation) };
+				if (segmentIndex >= 0)
+				{
+					const AdaptivePanoramic::Segment &segment{ adaptivePanoramic.readSegments().at(segmentIndex) };
+					std::cout << "Frame: " << iterLocation + 1 << "/" << nLocations << "\trows " << segment.mTop_pix << "-" << segment.mTop_pix + segment.mHeight_pix << "\n";
+					acquireStrip(panoramicScan, iterLocation, segment.mTop_pix, segment.mHeight_pix, settings.mPixelSizeX, 1);
+				}
+				if (settings.mBoolmapLevel == 0)
+					streamingBoolmap.update(iterLocation);
+			}
+			adaptivePanoramic.saveRegionsToText(g_imagingFolderPath, "Regions_" + Util::zeroPadding(cutNumber, 3), OVERRIDE::DIS);
+		}
+		mesoscope.closeShutter();
+		if (settings.mBoolmapLevel == 0)
+			std::cout << "Boolmap tiles final: " << streamingBoolmap.readNumberOfFinalTiles() << "/" << tileArraySizeIJ.II * tileArraySizeIJ.JJ << "\n";
+		return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+	}
+
+	//Save the panoramic and determine its boolmap. The bright tiles are added to tileBitmap
+	//If predictedBoolmap is not nullptr, the prediction is verified against the boolmap of the panoramic
+	void savePanoramicAndBoolmap(const PanoramicSettings &settings, const PanoramicScan &panoramicScan, const StreamingBoolmap &streamingBoolmap, const TILEDIM2 tileArraySizeIJ, const std::string laser_s,
+		const double planeZ, const int cutNumber, const double stageXi, const double stageXf, Logger &datalogPanoramic, TileBitmap &tileBitmap, const TileBitmap *predictedBoolmap)
+	{
+		//SAVE THE FILES
+		const std::string PANlongName{ laser_s + Util::toString(settings.mWavelength_nm, 0) +
+			"nm_P=" + Util::toString(settings.mLaserPower / mW, 1) +
+			"mW_xi=" + Util::toString(stageXi / mm, 3) + "_xf=" + Util::toString(stageXf / mm, 3) +
+			"_yi=" + Util::toString(panoramicScan.readStageYposFront() / mm, 3) + "_yf=" + Util::toString(panoramicScan.readStageYposBack() / mm, 3) +
+			"_z=" + Util::toString(planeZ / mm, 4) };
+
+		const std::string PANcutNumberPadded{ Util::zeroPadding(cutNumber, 3) };
+		panoramicScan.savePyramidToFile(g_imagingFolderPath, "Panoramic_" + PANcutNumberPadded, OVERRIDE::DIS);	//Tiled pyramid. The downsampled levels can be opened without reading the full-resolution image
+		datalogPanoramic.record(PANcutNumberPadded + "\t" + PANlongName);
+
+		//DETERMINE THE BOOLMAP
+		Boolmap boolmap{ settings.mBoolmapLevel == 0 ? Boolmap{ panoramicScan, streamingBoolmap } :
+			Boolmap{ panoramicScan.readPyramid(), settings.mBoolmapLevel, tileArraySizeIJ, settings.mOverlayTileSize_pix, settings.mOverlapIJK_frac, settings.mThreshold } };		//NOTE THE FACTOR OF 2 IN X
+		boolmap.fillBoolmapHoles();
+		boolmap.saveBoolmapToText(g_imagingFolderPath, "Boolmap_" + PANcutNumberPadded, OVERRIDE::DIS);
+		boolmap.replaceInputBoolmapByUnion(tileBitmap);															//Save the boolmap for the next iterations
+
+		//Verify the prediction against the panoramic scan
+		if (predictedBoolmap != nullptr)
+			std::cout << "Boolmap prediction: missed tiles = " << boolmap.readBoolmap().countAndNot(*predictedBoolmap) <<
+				"\textra tiles = " << predictedBoolmap->countAndNot(boolmap.readBoolmap()) << "\n";
+
+		//boolmap.saveTiffWithBoolmapGridOverlay("GridOverlay", OVERRIDE::EN);//For debugging
+	}
+
 	//Full sequence to image and cut an entire sample automatically. Note that the stack starts at stackCenterXYZ.at(Z) (i.e., the stack is not centered at stackCenterXYZ.at(Z))
 	//When forceScanAllStacks = true, the full boolmap is set to 1 (i.e., the boolmap does not have any effect on the scanning)
-	void sequencer(const FPGA &fpga, const int firstCommandIndex, const bool forceScanAllStacks, const RUN runSeq)
+	//When resumeSeq = RESUME::EN, an interrupted sequence is resumed from the journal in the output folder. Otherwise, the sequence starts at firstCommandIndex and the journal is restarted
+	void sequencer(const FPGA &fpga, const int firstCommandIndex, const bool forceScanAllStacks, const RUN runSeq, const RESUME resumeSeq)
 	{
 		//for beads, center the stack around g_stackCenterXYZ.at(Z) -----> //const double sampleSurfaceZ{ g_stackCenterXYZ.ZZ - nFramesCont * pixelSizeZ / 2 };
 
@@ -463,20 +900,35 @@ namespace Routines
 		const double PANpixelSizeY{ pixelSizeXY };
 		const double PANlaserPower{ 30. * mW };
 		const int PANwavelength_nm{ 1040 };
+		const bool PANadaptive{ false };																//Scan a coarse panoramic first and only rescan the tissue and its border at full resolution
+		const int PANcoarseFactor{ 4 };																	//Pixel size in X of the coarse panoramic = PANcoarseFactor * PANpixelSizeX
+		const int PANcoarseBinning{ 2 };																//Number of lines averaged into each row of the coarse panoramic. The X-stage moves PANcoarseFactor / PANcoarseBinning times faster than in the full-resolution scan
+		const int PANboolmapLevel{ 0 };																	//Level of the panoramic pyramid used for generating the boolmap (0 = full resolution). Level 0 is computed strip by strip while the panoramic is acquired
 		const double threshold{ 0.02 };
 
-		int heightPerBeamletPerFrame_pix;
-		double FFOVslowPerBeamlet;
-		if (g_multibeam)
-		{
-			heightPerBeamletPerFrame_pix = static_cast<int>(heightPerFrame_pix / g_nChanPMT);
-			FFOVslowPerBeamlet = static_cast<double>(FFOV.XX / g_nChanPMT);
-		}
-		else //Singlebeam
-		{
-			heightPerBeamletPerFrame_pix = heightPerFrame_pix;
-			FFOVslowPerBeamlet = FFOV.XX;
-		}
+		//TILE PATH
+		const bool planTilePath{ true };																//Reorder the bright tiles of each cut to shorten the travel of the stages. The dark tiles are dropped
+
+		//WAVELENGTH SCHEDULE
+		const bool scheduleWavelengths{ true };															//Order the wavelengths of each cut to spend less time tuning the laser and turning the filterwheels.
+																										//The laser is tuned for the next panoramic scan while the vibratome cuts
+
+		//CONCURRENT EXECUTION
+		const bool runConcurrently{ true };																//Overlap the demultiplexing, binning, and saving of a stack with the acquisition of the next stack. If false, run the actions one after another
+		const bool preArm{ true };																		//Build and upload the control sequence of the next stack while the stages move to it
+
+		//SEPARATE PROCESSING PROCESS
+		const bool processInSeparateProcess{ false };													//Publish the raw stacks to a StackRing in shared memory. "Maincode stackProcessor" in one or more other processes demultiplexes, bins, and saves them
+																										//The boolmap prediction reads the binned stacks back from their files once they are saved
+		const int nRingSlots{ 3 };																		//Number of raw stacks buffered in shared memory
+
+		//TIME MODEL
+		const std::string actionLogName{ "_ActionTimes" };												//Modeled and measured time of every action. Read back for calibrating the time model of the next sequences
+
+		//CRASH RECOVERY
+		const std::string journalName{ "_SequenceJournal" };											//Binary journal of the completed actions
+
+		const int heightPerBeamletPerFrame_pix{ g_multibeam ? heightPerFrame_pix / g_nChanPMT : heightPerFrame_pix };
 
 		//Create a sequence
 		const Sample sample{ g_currentSample, {g_stackCenterXYZ.XX, g_stackCenterXYZ.YY}, LOIxyz, sampleSurfaceZ, cutAboveBottomOfStack };
@@ -487,9 +939,43 @@ namespace Routines
 		sequence.generateCommandList();
 		sequence.printToFile(g_imagingFolderPath, "_Commandlist", OVERRIDE::EN);
 
+		//RESUME. Rebuild the state of an interrupted sequence from the journal of its completed actions and continue at the first action not completed
+		const bool isResumed{ resumeSeq == RESUME::EN };
+		if (isResumed && firstCommandIndex != 0)
+			throw std::invalid_argument((std::string)__FUNCTION__ + ": The first command index is read from the journal when resuming a sequence");
+		SequenceJournal journal{ g_imagingFolderPath, journalName };
+		if (isResumed && journal.readNrecords() == 0)
+			throw std::runtime_error((std::string)__FUNCTION__ + ": No journal to resume in " + g_imagingFolderPath);
+		if (!isResumed && journal.readNrecords() > 0 && !journal.isComplete())
+			std::cerr << "WARNING in " << __FUNCTION__ << ": The journal of an interrupted sequence is restarted. Use RESUME::EN to resume it instead\n";
+		const SequenceJournal::ResumeState resumeState{ isResumed ? journal.resume(sequence, ScanDirZini, forceScanAllStacks) :
+			SequenceJournal::createInitialState(sequence, firstCommandIndex, ScanDirZini, forceScanAllStacks) };
+		const int startCommandIndex{ resumeState.mNextCommandIndex };
+		if (isResumed)
+			std::cout << "Resuming the sequence at the command " << startCommandIndex << "/" << sequence.readNtotalCommands() << "\tcut = " << resumeState.mCutNumber + 1 <<
+				"\tstacks already saved = " << resumeState.mSavedFilenames.size() << "\n";
+
+		//DRY RUN. Predict the duration of the sequence with all the tiles bright. The model is calibrated with the action logs of the previous sequences in the output folder
+		SequenceTimeParams timeParams;
+		timeParams.mScanDirZini = ScanDirZini;
+		timeParams.mPANwidth = PANwidth;
+		timeParams.mPANheight = PANheight;
+		timeParams.mPANpixelSizeX = PANpixelSizeX;
+		timeParams.mPANwavelength_nm = PANwavelength_nm;
+		timeParams.mPANadaptive = PANadaptive;
+		timeParams.mPANcoarseFactor = PANcoarseFactor;
+		timeParams.mPANcoarseBinning = PANcoarseBinning;
+		timeParams.mConfigureDuringCut = scheduleWavelengths;
+		SequenceTimeModel timeModel{ stack, g_multibeam, timeParams };
+		for (const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator(g_imagingFolderPath))
+			if (entry.path().extension() == ".txt" && entry.path().stem().string().rfind(actionLogName, 0) == 0)
+				timeModel.calibrate(g_imagingFolderPath, entry.path().stem().string());
+		timeModel.printPrediction(timeModel.predict(sequence, startCommandIndex));
+
 		if (runSeq == RUN::EN)
 		{
 			//CONTROL SEQUENCE
+			DeviceSessions sessions;		//Open the devices of the Mesoscope in the background, while the FPGA session is opened
 			RTseq realtimeSeq{ fpga, LINECLOCK::RS, FIFOOUTfpga::EN, heightPerBeamletPerFrame_pix, widthPerFrame_pix, 100, 0 };
 			Mesoscope mesoscope{ realtimeSeq, Laser::ID::AUTO };
 			mesoscope.configure(1040);								//Initialize the laser wavelength for determining the initial chromatic shift correction of the stages
@@ -499,22 +985,118 @@ namespace Routines
 
 			//Read the commands line by line
 			POSITION2 tileCenterXY;
-			std::string shortName, longName;
-			SCANDIR iterScanDirZ{ ScanDirZini };
+			SCANDIR iterScanDirZ{ resumeState.mScanDirZ };
 			Logger datalogPanoramic(g_imagingFolderPath, "_Panoramic", OVERRIDE::DIS);
-			Logger datalogStacks(g_imagingFolderPath, "_TileConfiguration", OVERRIDE::DIS);
-			datalogStacks.record("dim=3"); //Needed for GridStitcher on Fiji
+			//The configuration file for the stitchers of a new run does not overwrite the previous ones. When resuming, the file of the interrupted run is continued
+			const std::string tileConfigurationName{ isResumed ? resumeState.mTileConfigurationName : Util::doesFileExist(g_imagingFolderPath, "_TileConfiguration", ".txt") };
+			if (isResumed)
+				trimTileConfiguration(g_imagingFolderPath, tileConfigurationName, resumeState.mSavedFilenames);
+			else
+				journal.restart(sequence, tileConfigurationName);
+			Logger datalogStacks(g_imagingFolderPath, tileConfigurationName, OVERRIDE::EN, isResumed);
+			if (!isResumed)
+				datalogStacks.record("dim=3"); //Needed for GridStitcher on Fiji
+			TileManifest tileManifest{ g_imagingFolderPath, "_TileManifest" };	//Binary index of the saved stacks. It is appended to (not overwritten) when resuming a sequence
+
+			//ACTION LOG. The actions are replayed on the time model as they are run, so that the modeled times follow the planned paths and skip the dark tiles
+			ActionTimeLog actionTimeLog{ g_imagingFolderPath, actionLogName };
+			SequenceTimeModel::State modelState{ timeModel.initializeState() };
 
 			//BOOLMAP. Declare the boolmap here to pass it between different actions
-			std::vector<bool> vec_boolmap(tileArraySizeIJ.II * tileArraySizeIJ.JJ, forceScanAllStacks);
-			int brightStackIndex{ 0 };
-			for (int iterCommandline = firstCommandIndex; iterCommandline < sequence.readNtotalCommands(); iterCommandline++)
+			TileBitmap tileBitmap{ resumeState.mTileBitmap };
+			int brightStackIndex{ resumeState.mBrightStackIndex };
+
+			//BOOLMAP PREDICTION. The frames of the current stacks that lie below the plane to cut predict the boolmap of the next cut, so that the panoramic scans can be skipped
+			const BoolmapPrediction boolmapPrediction{ sample.mBoolmapPrediction };
+			const int nFramesBelowCut{ (std::min)(nFramesAfterBinning, (std::max)(1, static_cast<int>(std::ceil(cutAboveBottomOfStack / pixelSizeZafterBinning)))) };
+			BoolmapPredictor boolmapPredictor{ tileArraySizeIJ, { heightPerFrame_pix, widthPerFrame_pix }, nFramesAfterBinning, nFramesBelowCut, boolmapPrediction.mThreshold, boolmapPrediction.mMargin_tiles };
+			TileBitmap predictedBoolmap{ tileArraySizeIJ };
+			bool isBoolmapPredicted{ false };			//The boolmap of the current cut is predicted
+			bool isPredictorComplete{ startCommandIndex == 0 };	//When resuming a sequence, the stacks acquired before startCommandIndex were not seen by the predictor
+			int nPANinCut{ resumeState.mNPANinCut };	//Number of panoramic scans run or skipped in the current cut
+			int nPANrun{ 0 }, nPANskipped{ 0 };
+			double PANtimeRun{ 0 };						//Total time of the panoramic scans run
+
+			//PANORAMIC SCAN. The tile size of the boolmap is for the slow scan. Do not call the tile size from panoramicScan because the tiles are long strips
+			//Note the factor of 2 because PANpixelSizeX=1.0*um whereas pixelSizeXY=0.5*um
+			const PanoramicSettings PANsettings{ PANwidth, PANheight, PANtileHeight, PANtileWidth, PANpixelSizeX, PANpixelSizeY, PANlaserPower, PANwavelength_nm,
+				PANadaptive, PANcoarseFactor, PANcoarseBinning, PANboolmapLevel, { heightPerFrame_pix / 2, widthPerFrame_pix }, stackOverlap_frac, threshold };
+
+			//TILE PATH AND WAVELENGTH SCHEDULE. Plan the order of the tiles and wavelengths of each cut once its boolmap is final, i.e., at the first MOV after the panoramic scans
+			const TilePathPlanner tilePathPlanner{ FFOV, stackOverlap_frac };
+			const WavelengthScheduler wavelengthScheduler{ g_multibeam };
+			bool isCutPlanned{ resumeState.mIsCutPlanned };	//When resuming a sequence in the middle of a cut, keep the order of the command list
+			double travelTimeSaved{ 0 };				//Predicted travel time saved by the planned paths
+			double switchingTimeSaved{ 0 };				//Predicted time saved by the scheduled wavelengths
+			double configureTime{ 0 };					//Time waiting for the laser and filterwheels (Mesoscope::configure)
+
+			//These parameters must be accessible to all the switch-cases
+			int cutNumber{ resumeState.mCutNumber }, tileIndexII{ 0 }, tileIndexJJ{ 0 };
+
+			//DEAD TIME. The stages do not image between the end of the download of a stack and the start of the scan of the next stack
+			DeadTime deadTime;
+
+			//CONCURRENT EXECUTION. The stacks are demultiplexed, binned, and saved on separate threads while the stages move to and acquire the next stack
+			//Each action waits for the actions it depends on: an ACQ for its MOV and the laser configuration, a SAV for the data of its ACQ
+			std::shared_ptr<SequencerStack> stackInFlight;
+			ActionExecutor executor;					//Declared after the objects used by the actions, so that it is destroyed first
+			StackPipeline<ActionExecutor> pipeline{ executor, preArm };
+			int nStacksSaved{ 0 };
+
+			//SEPARATE PROCESSING PROCESS. The stacks are recorded in the manifest and in the configuration file for the stitchers once a stack processor has saved them
+			//A stack that failed to be processed is not recorded, so that resuming the sequence acquires it again
+			std::unique_ptr<StackRing> stackRing;
+			std::map<U64, std::function<void(const U32 checksum)>> stackRecords;		//Recording of the published stacks, by sequence number
+			int nStacksFailed{ 0 };
+			auto recordSavedStacks = [&stackRing, &stackRecords, &nStacksSaved, &nStacksFailed]
+			{
+				std::vector<U64> failed;
+				for (const StackRing::SavedStack &savedStack : stackRing->collectSaved(&failed))
+				{
+					stackRecords.at(savedStack.mSequence)(savedStack.mChecksum);
+					stackRecords.erase(savedStack.mSequence);
+					nStacksSaved++;
+				}
+				for (const U64 sequence : failed)
+					stackRecords.erase(sequence);
+				nStacksFailed += static_cast<int>(failed.size());
+			};
+			//Wait for the stack processors to save the published stacks. Return the number of stacks that failed so far
+			auto waitForSavedStacks = [&stackRing, &recordSavedStacks, &nStacksFailed]
+			{
+				stackRing->waitForAll(&processRawStack);
+				recordSavedStacks();
+				return nStacksFailed;
+			};
+			if (processInSeparateProcess)
+			{
+				//The slots must fit the raw buffers of the stack with the largest binning
+				int maxNframesBinning{ 1 };
+				for (int iterCommandline = 0; iterCommandline < sequence.readNtotalCommands(); iterCommandline++)
+					if (sequence.readCommandline(iterCommandline).mActionID == Action::ID::ACQ)
+						maxNframesBinning = (std::max)(maxNframesBinning, sequence.readCommandline(iterCommandline).mAction.acqStack.readNframeBinning());
+				const U64 nPixPerBuffer{ static_cast<U64>(heightPerBeamletPerFrame_pix) * widthPerFrame_pix * nFramesAfterBinning * maxNframesBinning };
+				stackRing.reset(new StackRing{ g_stackRingName, nRingSlots, (g_multibeam ? 2 : 1) * nPixPerBuffer * sizeof(U32) });
+				std::cout << "Publishing the raw stacks to the stack ring " << g_stackRingName << ". Start \"Maincode stackProcessor\" in one or more consoles\n";
+			}
+
+			const auto sequenceStartTime{ std::chrono::high_resolution_clock::now() };
+			for (int iterCommandline = startCommandIndex; iterCommandline < sequence.readNtotalCommands(); iterCommandline++)
 			{
 				Sequencer::Commandline commandline{ sequence.readCommandline(iterCommandline) };
 
-				//These parameters must be accessible to all the switch-cases
-				int wavelength_nm, nFramesBinning, cutNumber, tileIndexII, tileIndexJJ;
-				double scanZi, scanZf, scanPmin, scanPLexp;
+				if ((planTilePath || scheduleWavelengths) && !isCutPlanned && commandline.mActionID == Action::ID::MOV)
+				{
+					isCutPlanned = true;
+					planCut(sequence, iterCommandline, cutNumber, tileBitmap, static_cast<int>(sample.readFluorMarkerListSize()), planTilePath ? &tilePathPlanner : nullptr, scheduleWavelengths ? &wavelengthScheduler : nullptr,
+						mesoscope, journal, travelTimeSaved, switchingTimeSaved);
+
+					//The dark tiles have been dropped. Re-read the command, which might not be a MOV anymore if the cut has no bright tiles
+					if (iterCommandline >= sequence.readNtotalCommands())
+						break;
+					commandline = sequence.readCommandline(iterCommandline);
+				}
+
 				switch (commandline.mActionID)
 				{
 				case Action::ID::MOV://Move the X and Y-stages to mStackCenterXY
@@ -522,100 +1104,112 @@ namespace Routines
 					tileIndexII = commandline.mAction.moveStage.readTileIndex(TileArray::Axis::II);
 					tileIndexJJ = commandline.mAction.moveStage.readTileIndex(TileArray::Axis::JJ);
 					tileCenterXY = commandline.mAction.moveStage.readTileCenterXY();
+					timeModel.modelCommandline(commandline, modelState);
 
-					if (Util::isBright(vec_boolmap, tileArraySizeIJ, { tileIndexII, tileIndexJJ }))
-					{
-						mesoscope.moveXY(tileCenterXY);
-						mesoscope.waitForMotionToStopAll();
-					}
+					//The move is submitted with the ACQ, once the wavelength is known
 					break;
 				case Action::ID::ACQ://Acquire a stack
-					//std::cout << "is (" << tileIndexII_s << "," << tileIndexJJ_s << ") bright? = " << Util::isBright(vec_boolmap, tileArraySizeIJ, { tileIndexII_s, tileIndexJJ_s });
+					//std::cout << "is (" << tileIndexII_s << "," << tileIndexJJ_s << ") bright? = " << tileBitmap.test({ tileIndexII_s, tileIndexJJ_s });
 					//Util::pressAnyKeyToCont();
 
-					if (Util::isBright(vec_boolmap, tileArraySizeIJ, { tileIndexII, tileIndexJJ }))
+					if (tileBitmap.test({ tileIndexII, tileIndexJJ }))
 					{
-						Action::AcqStack acqStack{ commandline.mAction.acqStack };
-						{
-							//Set the number of frames considering that binning will be performed
-							nFramesBinning = acqStack.readNframeBinning();
-							const int nFramesBeforeBinning{ nFramesAfterBinning * nFramesBinning };
-							realtimeSeq.reconfigure(heightPerBeamletPerFrame_pix, widthPerFrame_pix, nFramesBeforeBinning, g_multibeam);
-
-							//Set the vel for imaging. Frame duration (i.e., a galvo swing) = halfPeriodLineclock * heightPerBeamletPerFrame_pix	
-							const double pixelSizeZbeforeBinning{ stackDepth / nFramesBeforeBinning };
-							mesoscope.setVelSingle(AXIS::ZZ, pixelSizeZbeforeBinning / (g_lineclockHalfPeriod * heightPerBeamletPerFrame_pix));
-
-							//These parameters must be accessible for saving the tiff
-							//stackIndex = acqStack.readStackIndex();
-							wavelength_nm = acqStack.readWavelength_nm();
-							scanZi = determineInitialScanPos(acqStack.readScanZmin(), stackDepth, 0. * mm, iterScanDirZ);
-							scanZf = determineFinalScanPos(acqStack.readScanZmin(), stackDepth, 0. * mm, iterScanDirZ);
-
-							//Update the laser parameters
-							mesoscope.configure(wavelength_nm);									//The uniblitz shutter is closed by the pockels destructor when switching wavelengths
-							scanPmin = acqStack.readScanPmin();
-							scanPLexp = acqStack.readScanPLexp();
-							mesoscope.setPowerExponentialScaling(scanPmin, pixelSizeZbeforeBinning, Util::convertScandirToInt(iterScanDirZ) * scanPLexp);
-
-							//SCANNERS
-							const Galvo scanner{ realtimeSeq, FFOVslowPerBeamlet / 2. };
-							Galvo rescanner{ realtimeSeq, FFOVslowPerBeamlet / 2., mesoscope.readCurrentLaser(), mesoscope.readCurrentWavelength_nm() };
-						}
-
-						//Move the stage to the initial Z position
-						mesoscope.moveSingle(AXIS::ZZ, scanZi);
-						mesoscope.waitForMotionToStopAll();
-
-						realtimeSeq.initialize(MAINTRIG::STAGEZ, wavelength_nm, iterScanDirZ);	//Use the scan direction determined dynamically
-						mesoscope.openShutter();												//Re-open the Uniblitz shutter if closed by the pockels destructor
+						const Action::AcqStack acqStack{ commandline.mAction.acqStack };
+
+						//These parameters must be accessible for saving the tiff
+						stackInFlight.reset(new SequencerStack);
+						stackInFlight->mCutNumber = cutNumber;
+						stackInFlight->mWavelength_nm = acqStack.readWavelength_nm();
+						stackInFlight->mTileIJ = { tileIndexII, tileIndexJJ };
+						stackInFlight->mTileCenterXY = tileCenterXY;
+						stackInFlight->mScanZi = determineInitialScanPos(acqStack.readScanZmin(), stackDepth, 0. * mm, iterScanDirZ);
+						stackInFlight->mScanZf = determineFinalScanPos(acqStack.readScanZmin(), stackDepth, 0. * mm, iterScanDirZ);
+						stackInFlight->mScanPmin = acqStack.readScanPmin();
+						stackInFlight->mScanPLexp = acqStack.readScanPLexp();
+						stackInFlight->mScanDirZ = iterScanDirZ;
+
+						//Set the number of frames considering that binning will be performed
+						stackInFlight->mNframesBinning = acqStack.readNframeBinning();
+						stackInFlight->mNframesBeforeBinning = nFramesAfterBinning * stackInFlight->mNframesBinning;
+						stackInFlight->mPixelSizeZbeforeBinning = stackDepth / stackInFlight->mNframesBeforeBinning;
+						const std::vector<double> modeledTime{ timeModel.modelCommandline(commandline, modelState) };
 
 						//Print out the stackIndex starting from 1 (stackIndex indexes from 0, so add a 1) and the cutNumber_s starting from 1 (cutNumber_s indexes from 0, so add a 1)
-						std::cout << "Scanning cut = " << std::to_string(cutNumber + 1) << "/" << sequence.readTotalNumberOfCuts() <<
-							"\tstack = " << std::to_string(brightStackIndex + 1) << "/" << Util::determineNumberOf1s(vec_boolmap) <<
-							"\tStack index = (" << tileIndexII << "," << tileIndexJJ << ")\n";
+						const std::string scanningMessage{ "Scanning cut = " + std::to_string(cutNumber + 1) + "/" + std::to_string(sequence.readTotalNumberOfCuts()) +
+							"\tstack = " + std::to_string(brightStackIndex + 1) + "/" + std::to_string(tileBitmap.count()) +
+							"\tStack index = (" + std::to_string(tileIndexII) + "," + std::to_string(tileIndexJJ) + ")" };
 
-						mesoscope.moveSingle(AXIS::ZZ, scanZf);	//Move the stage to trigger the ctl&acq sequence
-						realtimeSeq.downloadData();
+						submitStackAcquisition(pipeline, actionTimeLog, realtimeSeq, mesoscope, stack, stackInFlight, modeledTime, scanningMessage, deadTime);
 						reverseSCANDIR(iterScanDirZ);
 						brightStackIndex++;
 					}//if
 					break;
 				case Action::ID::SAV:
-					if (Util::isBright(vec_boolmap, tileArraySizeIJ, { tileIndexII, tileIndexJJ }))
+					if (tileBitmap.test({ tileIndexII, tileIndexJJ }))
 					{
-						const std::string tileIndexIIpadded{ Util::zeroPadding(tileIndexII, 2) };
-						const std::string tileIndexJJpadded{ Util::zeroPadding(tileIndexJJ, 2) };
-
-						shortName = Util::zeroPadding(cutNumber, 3) + "_" + Util::convertWavelengthToFluorMarker_s(wavelength_nm) + "_" + tileIndexIIpadded + "_" + tileIndexJJpadded;		//cutNumber_stackIndex_wavelengthIndex
-						longName = mesoscope.readCurrentLaser_s(true) + Util::toString(wavelength_nm, 0) + "nm_Pmin=" + Util::toString(scanPmin / mW, 1) + "mW_PLexp=" + Util::toString(scanPLexp / um, 0) + "um" +
-							"_x=" + Util::toString(tileCenterXY.XX / mm, 3) +
-							"_y=" + Util::toString(tileCenterXY.YY / mm, 3) +
-							"_zi=" + Util::toString(scanZi / mm, 4) + "_zf=" + Util::toString(scanZf / mm, 4) +
-							"_Step=" + Util::toString(pixelSizeZafterBinning / mm, 4) + "_bin=" + Util::toString(nFramesBinning, 0);
-
-						Image image{ realtimeSeq };
-						image.acquire();
-						image.binFrames(nFramesBinning);
-						image.save(g_imagingFolderPath, shortName, TIFFSTRUCT::MULTIPAGE, OVERRIDE::DIS);
-
-						//Convert the absolute tile position to pixels to be called by 'Grid/collection stitcher' in Fiji.
-						//The format for 'Grid/collection stitcher' is filename;;(-JJ,-II,KK) in pixels
-						//Note that in Fiji the position of II and JJ are interchanged. Also note the minus sign because of the opposite sign convention wrt the stages
-						datalogStacks.record(shortName + ".tif;;\t(" + Util::toString(-tileCenterXY.YY / pixelSizeXY, 0) + "," +
-							Util::toString(-tileCenterXY.XX / pixelSizeXY, 0) + "," +
-							Util::toString((std::min)(scanZi, scanZf) / pixelSizeZafterBinning, 0) + ")");
-						datalogStacks.record("#(" + tileIndexIIpadded + "," + tileIndexJJpadded + ")\t" + longName);
-						std::cout << "\n";
+						const std::vector<double> modeledTime{ timeModel.modelCommandline(commandline, modelState) };
+
+						//Record the saved stack in the manifest and in the configuration file for the stitchers
+						const int wavelength_nm{ stackInFlight->mWavelength_nm };
+						const POSITION2 stackCenterXY{ stackInFlight->mTileCenterXY };
+						const double scanZmin{ (std::min)(stackInFlight->mScanZi, stackInFlight->mScanZf) };
+						const auto recordStack = [=, &tileManifest, &datalogStacks, &journal](const std::string shortName, const std::string longName, const U32 checksum)
+						{
+							tileManifest.append(cutNumber, wavelength_nm, { tileIndexII, tileIndexJJ }, { stackCenterXY.XX, stackCenterXY.YY, scanZmin }, shortName + ".tif", checksum);
+
+							//Convert the absolute tile position to pixels to be called by 'Grid/collection stitcher' in Fiji.
+							//The format for 'Grid/collection stitcher' is filename;;(-JJ,-II,KK) in pixels
+							//Note that in Fiji the position of II and JJ are interchanged. Also note the minus sign because of the opposite sign convention wrt the stages
+							datalogStacks.record(shortName + ".tif;;\t(" + Util::toString(-stackCenterXY.YY / pixelSizeXY, 0) + "," +
+								Util::toString(-stackCenterXY.XX / pixelSizeXY, 0) + "," +
+								Util::toString(scanZmin / pixelSizeZafterBinning, 0) + ")");
+							datalogStacks.record("#(" + Util::zeroPadding(tileIndexII, 2) + "," + Util::zeroPadding(tileIndexJJ, 2) + ")\t" + longName);
+							journal.recordStack(iterCommandline, cutNumber, wavelength_nm, { tileIndexII, tileIndexJJ }, iterScanDirZ, tileManifest.findTile(cutNumber, wavelength_nm, { tileIndexII, tileIndexJJ }));
+						};
+
+						if (stackRing)
+						{
+							submitStackPublish(pipeline, realtimeSeq, stackInFlight, pixelSizeZafterBinning, *stackRing, boolmapPrediction.mEnable ? &boolmapPredictor : nullptr, stackRecords, recordSavedStacks, recordStack);
+							break;
+						}
+						submitStackSave(pipeline, actionTimeLog, realtimeSeq, stackInFlight, pixelSizeZafterBinning, modeledTime, boolmapPrediction.mEnable ? &boolmapPredictor : nullptr, recordStack);
+						nStacksSaved++;
 					}
 					break;
 				case Action::ID::CUT://Move the stage to the vibratome and then cut off the surface
 				{
+					executor.waitAll();		//The stacks of the cut must be saved and seen by the boolmap predictor
+					if (stackRing && waitForSavedStacks() > 0)
+						throw std::runtime_error((std::string)__FUNCTION__ + ": " + std::to_string(nStacksFailed) + " stacks failed to be processed. Resume the sequence to acquire them again");
+					deadTime.mIsMeasured = false;
 					mesoscope.closeShutter();
 
 					std::cout << "Cut number = " << std::to_string(cutNumber + 1) << "/" << sequence.readTotalNumberOfCuts() << "\n";
 					const double planeZtoCut{ commandline.mAction.cutTissue.readStageZheightForFacingTheBlade() };
-					mesoscope.cutTissue(planeZtoCut);
+
+					//Cut on the stage worker of the mesoscope. Meanwhile, tune the laser and turn the filterwheels for the panoramic scan of the next cut
+					isBoolmapPredicted = boolmapPrediction.mEnable && isPredictorComplete && boolmapPredictor.readNumberOfObservedStacks() > 0;
+					const bool isNextPANrun{ iterCommandline + 1 < sequence.readNtotalCommands() && sequence.readCommandline(iterCommandline + 1).mActionID == Action::ID::PAN &&
+											 (!isBoolmapPredicted || boolmapPrediction.mNverificationPAN > 0) };
+
+					const std::vector<double> modeledTime{ timeModel.modelCommandline(commandline, modelState) };
+					const auto cutStartTime{ std::chrono::high_resolution_clock::now() };
+					auto cutEndTime{ cutStartTime };
+					std::future<void> cut{ mesoscope.submit(DeviceExecutor::DEVICE::STAGES, [&mesoscope, &cutEndTime, planeZtoCut]
+					{
+						mesoscope.cutTissue(planeZtoCut);
+						cutEndTime = std::chrono::high_resolution_clock::now();
+					}) };
+
+					auto configureEndTime{ cutStartTime };
+					if (scheduleWavelengths && isNextPANrun)
+					{
+						mesoscope.configure(PANwavelength_nm);
+						configureEndTime = std::chrono::high_resolution_clock::now();
+					}
+					cut.get();
+					actionTimeLog.record(SequenceTimeModel::COST::CUT, modeledTime, cutStartTime, cutEndTime);
+					configureTime += (std::max)(0., std::chrono::duration<double>(configureEndTime - cutEndTime).count());		//Time waiting for the configuration after the cut
 
 					//Reset the scan direction
 					iterScanDirZ = ScanDirZini;
@@ -623,93 +1217,104 @@ namespace Routines
 					brightStackIndex = 0;
 
 					//Reset the boolmap
-					vec_boolmap.assign(tileArraySizeIJ.II * tileArraySizeIJ.JJ, forceScanAllStacks);
+					tileBitmap.assign(forceScanAllStacks);
+
+					//Predict the boolmap of the next cut. The panoramic scans only add to it
+					if (isBoolmapPredicted)
+					{
+						predictedBoolmap = boolmapPredictor.readPrediction();
+						tileBitmap |= predictedBoolmap;
+						std::cout << "Predicted bright tiles: " << predictedBoolmap.count() << "/" << tileArraySizeIJ.II * tileArraySizeIJ.JJ << "\n";
+					}
+					boolmapPredictor.reset();
+					isPredictorComplete = true;
+					nPANinCut = 0;
+					isCutPlanned = false;
+					journal.recordCut(iterCommandline, cutNumber);
 				}
 				break;
 				case Action::ID::PAN:
 				{
+					//Skip the panoramic scan if the boolmap is predicted and enough panoramic scans have been run to verify the prediction
+					if (isBoolmapPredicted && nPANinCut == 0)
+						predictedBoolmap.saveToText(g_imagingFolderPath, "BoolmapPredicted_" + Util::zeroPadding(commandline.mAction.panoramicScan.readCutNumber(), 3), OVERRIDE::DIS);
+					nPANinCut++;
+					if (isBoolmapPredicted && nPANinCut > boolmapPrediction.mNverificationPAN)
+					{
+						nPANskipped++;
+						if (nPANrun > 0)
+							std::cout << "Panoramic scan skipped. PAN time saved so far: " << nPANskipped * PANtimeRun / nPANrun << " s\n";
+						else
+							std::cout << "Panoramic scan skipped\n";
+						journal.recordPAN(iterCommandline, commandline.mAction.panoramicScan.readCutNumber(), tileBitmap);
+						break;
+					}
+
 					const double PANplaneZ{ commandline.mAction.panoramicScan.readPlaneZ() };
-					SCANDIR iterScanDirX{ SCANDIR::RIGHTWARD };												//Initial scan direction of stage 
+					const int PANcutNumber{ commandline.mAction.panoramicScan.readCutNumber() };
+					const bool isConfiguredDuringCut{ modelState.mIsAfterCut && scheduleWavelengths };
+					const std::vector<double> modeledTime{ timeModel.modelCommandline(commandline, modelState) };
 
 					//CONTROL SEQUENCE. The Image height is 2 (two galvo swings) and nFrames is stitchedHeight_pix/2. The total height of the final image is therefore stitchedHeight_pix
 					PanoramicScan panoramicScan{ { g_stackCenterXYZ.XX, g_stackCenterXYZ.YY }, { PANtileHeight, PANtileWidth }, { PANpixelSizeX, PANpixelSizeY }, { PANheight, PANwidth } };
 					realtimeSeq.reconfigure(2, panoramicScan.readTileWidth_pix(), panoramicScan.readTileHeight_pix() / 2, 0);
+					const auto configureStartTime{ std::chrono::high_resolution_clock::now() };
 					mesoscope.configure(PANwavelength_nm);
-
-					//SCANNERS. Keep them fixed with amplitude 0
-					const Galvo scanner{ realtimeSeq, 0 };
-					const Galvo rescanner{ realtimeSeq, 0, mesoscope.readCurrentLaser(), mesoscope.readCurrentWavelength_nm() };
-
-					//STAGES
-					mesoscope.moveXYZ({ g_stackCenterXYZ.XX, g_stackCenterXYZ.YY, PANplaneZ });				//Move the stage to the center of the panoramic view
-					mesoscope.waitForMotionToStopAll();
-					Sleep(500);																				//Give the stages enough time to settle at the initial position
-					mesoscope.setVelSingle(AXIS::XX, PANpixelSizeX / g_lineclockHalfPeriod);				//Set the vel for imaging
-					mesoscope.openShutter();																//Open the shutter
-
-					//LOCATIONS of the sample to image
-					const int nLocations{ panoramicScan.readNumberStageYpos() };
-					double stageXi, stageXf;		//Stage final position
-					for (int iterLocation = 0; iterLocation < nLocations; iterLocation++)
-					{
-						//Reload the imaging parameters because they are deleted after each individual sequence
-						realtimeSeq.reconfigure(2, panoramicScan.readTileWidth_pix(), panoramicScan.readTileHeight_pix() / 2, 0);
-						mesoscope.setPower(PANlaserPower);
-
-						const double travelOverhead{ 1.0 * mm };
-						stageXi = panoramicScan.determineInitialScanPosX(travelOverhead, iterScanDirX);
-						stageXf = panoramicScan.determineFinalScanPosX(travelOverhead, iterScanDirX);
-
-						std::cout << "Frame: " << iterLocation + 1 << "/" << nLocations << "\n";
-						mesoscope.moveXY({ stageXi, panoramicScan.readStageYposAt(iterLocation) });			//Move the stage to the start of the "ribbon" scan
-						mesoscope.waitForMotionToStopAll();
-						Sleep(300);																			//Avoid iterations too close to each other, otherwise the X-stage will fail to trigger the ctl&acq sequence.
-																											//This might be because of g_postSequenceTimer
-						realtimeSeq.initialize(MAINTRIG::STAGEX);
-						std::cout << "Scanning the stack...\n";
-						mesoscope.moveSingle(AXIS::XX, stageXf);											//Move the stage to trigger the ctl&acq sequence
-						realtimeSeq.downloadData();
-
-						Image image{ realtimeSeq };
-						image.acquireVerticalStrip(iterScanDirX);
-						image.correctRSdistortion(PANtileWidth);											//Correct the image distortion induced by the nonlinear scanning of the RS
-						panoramicScan.push(image.data(), { 0, iterLocation });								//for now, only allow to stack up strips to the right
-
-						reverseSCANDIR(iterScanDirX);
-						Util::pressESCforEarlyTermination();
-					}
-					mesoscope.closeShutter();
-
-					//SAVE THE FILES
-					const std::string PANlongName{ mesoscope.readCurrentLaser_s(true) + Util::toString(PANwavelength_nm, 0) +
-						"nm_P=" + Util::toString(PANlaserPower / mW, 1) +
-						"mW_xi=" + Util::toString(stageXi / mm, 3) + "_xf=" + Util::toString(stageXf / mm, 3) +
-						"_yi=" + Util::toString(panoramicScan.readStageYposFront() / mm, 3) + "_yf=" + Util::toString(panoramicScan.readStageYposBack() / mm, 3) +
-						"_z=" + Util::toString(PANplaneZ / mm, 4) };
-
-					const std::string PANcutNumberPadded{ Util::zeroPadding(commandline.mAction.panoramicScan.readCutNumber(), 3) };
-					panoramicScan.saveToFile(g_imagingFolderPath, "Panoramic_" + PANcutNumberPadded, OVERRIDE::DIS);//For large tiffs, tifflib sometimes returns "no space for output buffer" error
-					datalogPanoramic.record(PANcutNumberPadded + "\t" + PANlongName);
-
-					//DETERMINE THE BOOLMAP
-					const LENGTH2 LOIxy_pix{ LOIxyz.XX / (2 * pixelSizeXY), LOIxyz.YY / pixelSizeXY };
-					const PIXDIM2 overlayTileSize_pix{ heightPerFrame_pix / 2, widthPerFrame_pix };								//Tile size for the slow scan. Do not call the tile size from panoramicScan because the tiles are long strips
-																																//Note the factor of 2 because PANpixelSizeX=1.0*um whereas pixelSizeXY=0.5*um
-					Boolmap boolmap{ panoramicScan, tileArraySizeIJ, overlayTileSize_pix, stackOverlap_frac, threshold };		//NOTE THE FACTOR OF 2 IN X
-					boolmap.fillBoolmapHoles();
-					boolmap.saveBoolmapToText(g_imagingFolderPath, "Boolmap_" + PANcutNumberPadded, OVERRIDE::DIS);
-					boolmap.replaceInputBoolmapByUnion(vec_boolmap);															//Save the boolmap for the next iterations
-
-					//boolmap.saveTiffWithBoolmapGridOverlay("GridOverlay", OVERRIDE::EN);//For debugging
+					const auto PANactionStartTime{ std::chrono::high_resolution_clock::now() };
+					configureTime += std::chrono::duration<double>(PANactionStartTime - configureStartTime).count();
+					if (!isConfiguredDuringCut)		//Otherwise, the laser was tuned while cutting
+						actionTimeLog.record(SequenceTimeModel::COST::SWITCH, modeledTime, configureStartTime, PANactionStartTime);
+
+					//BOOLMAP. At full resolution, update it strip by strip, so that it is ready when the last strip arrives
+					StreamingBoolmap streamingBoolmap{ panoramicScan, tileArraySizeIJ, PANsettings.mOverlayTileSize_pix, PANsettings.mOverlapIJK_frac, PANsettings.mThreshold };
+
+					double stageXi, stageXf;
+					const double PANtime{ scanPanoramic(realtimeSeq, mesoscope, PANsettings, PANplaneZ, PANcutNumber, tileArraySizeIJ, panoramicScan, streamingBoolmap, stageXi, stageXf) };
+					actionTimeLog.record(SequenceTimeModel::COST::PAN, modeledTime, PANactionStartTime, std::chrono::high_resolution_clock::now());
+					std::cout << "Panoramic scan time: " << PANtime << " s\n";
+					PANtimeRun += PANtime;
+					nPANrun++;
+
+					savePanoramicAndBoolmap(PANsettings, panoramicScan, streamingBoolmap, tileArraySizeIJ, mesoscope.readCurrentLaser_s(true), PANplaneZ, PANcutNumber, stageXi, stageXf,
+						datalogPanoramic, tileBitmap, isBoolmapPredicted ? &predictedBoolmap : nullptr);
+					journal.recordPAN(iterCommandline, PANcutNumber, tileBitmap);
 				}
 				break;
 				default:
 					throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected action invalid");
 				}//switch(mAction)
+				if (!runConcurrently)
+					executor.waitAll();
 				Util::pressESCforEarlyTermination();
 			}//for(iterCommandline)
+			executor.waitAll();
 			mesoscope.closeShutter();
-			//Util::saveBoolmapToText("Union", vec_boolmap, tileArraySizeIJ, OVERRIDE::EN);//For debugging
+
+			//Wait for the stack processors to save the last stacks. They finish once the ring is closed and empty
+			if (stackRing)
+			{
+				stackRing->close();
+				if (waitForSavedStacks() > 0)
+					throw std::runtime_error((std::string)__FUNCTION__ + ": " + std::to_string(nStacksFailed) + " stacks failed to be processed. Resume the sequence to acquire them again");
+				std::cout << "Time the acquisition waited for the stack processors: " << stackRing->readStallTime() / seconds << " s\n";
+			}
+			journal.recordEnd(sequence.readNtotalCommands());		//The next run in the output folder does not resume a completed sequence
+
+			const double sequenceTime{ std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - sequenceStartTime).count() };
+			configureTime += executor.readBusyTime(ActionExecutor::RESOURCE::LASER) / seconds;
+			std::cout << "Stacks saved: " << nStacksSaved << "\tStacks per hour: " << 3600. * nStacksSaved / sequenceTime << "\n";
+			if (deadTime.mNtiles > 0)
+				std::cout << "Dead time per stack: " << deadTime.mTotal / deadTime.mNtiles / ms << " ms\n";
+			std::cout << "Busy time of the stages/arming/demultiplexing/disk: " << executor.readBusyTime(ActionExecutor::RESOURCE::STAGES) / seconds << "/" <<
+				executor.readBusyTime(ActionExecutor::RESOURCE::FPGA) / seconds << "/" << executor.readBusyTime(ActionExecutor::RESOURCE::DEMUX) / seconds << "/" << executor.readBusyTime(ActionExecutor::RESOURCE::DISK) / seconds << " s of " << sequenceTime << " s\n";
+			if (boolmapPrediction.mEnable && nPANrun > 0)
+				std::cout << "Panoramic scans skipped: " << nPANskipped << "/" << nPANrun + nPANskipped << "\tPAN time saved: " << nPANskipped * PANtimeRun / nPANrun << " s\n";
+			if (planTilePath)
+				std::cout << "Predicted stage travel time saved by the planned tile paths: " << travelTimeSaved / seconds << " s\n";
+			if (scheduleWavelengths)
+				std::cout << "Predicted switching time saved by the wavelength schedule: " << switchingTimeSaved / seconds << " s\n";
+			std::cout << "Time waiting for the laser and filterwheels: " << configureTime << " s\n";
+			//tileBitmap.saveToText(g_imagingFolderPath, "Union", OVERRIDE::EN);//For debugging
 		}//if (run)
 		Util::pressAnyKeyToCont();
 	}
@@ -727,6 +1332,7 @@ namespace Routines
 		const double FFOVslow{ heightPerFrame_pix * pixelSizeXY };									//Full FOV in the slow axis
 
 		//CREATE THE CONTROL SEQUENCE
+		DeviceSessions sessions;		//Open the devices of the Mesoscope in the background, while the FPGA session is opened
 		RTseq realtimeSeq{ fpga, LINECLOCK::RS, FIFOOUTfpga::EN, heightPerFrame_pix, widthPerFrame_pix, nFramesCont, g_multibeam };
 		Mesoscope mesoscope{ realtimeSeq, Laser::ID::VISION };
 		mesoscope.configure(fluorMarker.mWavelength_nm);
@@ -757,14 +1363,49 @@ namespace Routines
 		}
 	}
 
+	//Processing process of Routines::sequencer with processInSeparateProcess. Demultiplex, bin, and save the raw stacks published to the stack ring until the sequence finishes
+	//Several processes can run at once. If one dies, the stack that it was processing is taken over by another process or by the acquisition process
+	void stackProcessor()
+	{
+		StackRing stackRing{ g_stackRingName };
+		std::cout << "Processing the stacks published to " << g_stackRingName << "\n";
+
+		int nStacks{ 0 };
+		const auto startTime{ std::chrono::high_resolution_clock::now() };
+		while (!stackRing.isFinished())
+			if (stackRing.processNext(&processRawStack, 1. * seconds))
+				std::cout << "Stacks processed: " << ++nStacks << "\r";
+		const double duration{ std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count() * seconds };
+
+		std::cout << "\nStacks processed: " << nStacks << "\tstacks per minute: " << Util::toString(nStacks / (duration / seconds) * 60., 1) << "\n";
+		std::cout << "Stacks taken over from dead processes: " << stackRing.readNreclaimed() << "\n";
+	}
+
+	//Demultiplex, bin, and save a raw stack published to the stack ring
+	U32 processRawStack(const StackRing::StackHeader &header, const U32 *bufferA, const U32 *bufferB)
+	{
+		const RawStackLayout layout{ header.mHeightPerBeamletPerFrame_pix, header.mWidthPerFrame_pix, header.mNframes, static_cast<bool>(header.mMultibeam), static_cast<RTseq::PMT16XCHAN>(header.mPMT16Xchan) };
+		TiffU8 stack{ (header.mMultibeam * (g_nChanPMT - 1) + 1) * header.mHeightPerBeamletPerFrame_pix, header.mWidthPerFrame_pix, header.mNframes };
+
+		//The odd frames are mirrored vertically while demultiplexing, as in Image::acquire()
+		Image::demultiplex(layout, bufferA, bufferB, false, stack.view().mirrorOddFrames());
+		stack.binFrames(header.mNframesBinning);
+		stack.saveToFile(header.mFolderPath, header.mFilename, TIFFSTRUCT::MULTIPAGE, OVERRIDE::EN, static_cast<SCANDIR>(header.mScanDir));
+		return stack.computeCRC32(static_cast<SCANDIR>(header.mScanDir));
+	}
+
 	//Post-process the tiff stacks: correct for nonlinear resonant scanning, uneven illumination, and crosstalk
 	//Read the filenames from the single configuration file "_TileConfiguration.txt"
 	//Then create a configuration textfile for each vibratome slice and laser wavelength for 'Grid/collection stitcher' in Fiji
+	//Correct the stacks listed in the tile manifest of the input folder. The configuration files for GridStitcher and BigStitcher are generated from the manifest of the corrected stacks
+	//If the input folder only has a _TileConfiguration.txt (e.g. older datasets), it is converted to a manifest the first time
 	void correctTiffReadFromTileConfiguration(const int firstCutNumber, const int lastCutNumber, std::vector<int> vec_wavelengthIndex)
 	{
 		const bool flag_gridStitcher{ false };
 		const std::string inputPath{ "Z:\\David\\20191129_Liver20190812_03_SeeDB-DAPI-TDT_lobe_sorted\\" };
 		const std::string outputPath{ "Z:\\David\\20200916_Liver20190812_03_SeeDB-DAPI-TDT_lobe_extended_volume\\TDT\\" };
+		const std::string inputManifestFilename{ "_TileManifest" };
+		const std::string outputManifestFilename{ "_TileManifestCorrected" };
 
 		//Constrain the min and max tiles on each axis
 		const std::vector<int> tileIndexIIminMax{ 7, 36 };		//{ IImin, IImax }
@@ -775,233 +1416,148 @@ namespace Routines
 		const int nFrames{ 100 };
 		const TILEOVERLAP3 stackOverlapXY_pix{ 270, 476, 50 };
 
+		//Pipeline for the post-processing
+		const int nReaders{ 2 };
+		const int nWorkers{ 4 };
+		const int nWriters{ 2 };
+		const U64 memoryBudget_byte{ Util::readAvailableMemory_byte() / 2 };		//Leave the other half of the free address space to the GPU correction and the libraries
+
 		if (firstCutNumber > lastCutNumber)
 			throw std::invalid_argument((std::string)__FUNCTION__ + ": The first cut number must be <= last cut number");
 		if (vec_wavelengthIndex.size() == 0)
 			throw std::invalid_argument((std::string)__FUNCTION__ + ": At least one wavelength must be input as argument");
 
-		//Generate an output configuration textfile for each vibratome slice and each laser wavelength for both BigStitcher and GridStitcher in Fiji
-		//Store the file handlers in a vector
-		std::vector<std::ofstream> vec_configTxtGridStitcher((lastCutNumber - firstCutNumber + 1) * vec_wavelengthIndex.size());
-		std::vector<std::ofstream> vec_configTxtBigStitcher((lastCutNumber - firstCutNumber + 1) * vec_wavelengthIndex.size());
+		if (!std::filesystem::exists(inputPath + inputManifestFilename + ".bin"))
+			TileManifest::importTileConfiguration(inputPath, "_TileConfiguration", inputManifestFilename);
+		const TileManifest inputManifest{ inputPath, inputManifestFilename };
+		TileManifest outputManifest{ outputPath, outputManifestFilename };
+		CorrectionJournal journal{ outputPath };	//For resuming an interrupted batch
+
+		//Each group of stacks (cut number, wavelength) is numbered from 0. The real stacks are numbered first, then the dummy corner stacks
+		struct Group
+		{
+			int mCutNumber;
+			int mWavelengthIndex;
+			int mJobIndexEnd;		//One past the index of the last job of the group
+			int mStackCounter;
+		};
+		std::vector<Group> vec_group;
+		std::vector<CorrectionJob> vec_job;
+		std::vector<int> vec_recordIndex;	//Input record of each job
 		for (int iterCutNumber = firstCutNumber; iterCutNumber <= lastCutNumber; iterCutNumber++)
+		{
+			const std::string subFolderName{ Util::zeroPadding(iterCutNumber, 3) + "\\" };
 			for (std::vector<int>::size_type iterWavelengthIndex = 0; iterWavelengthIndex != vec_wavelengthIndex.size(); iterWavelengthIndex++)
 			{
-				const unsigned int whichVectorPosition{ (iterCutNumber - firstCutNumber) * vec_wavelengthIndex.size() + iterWavelengthIndex };
-				const std::string subFolderName{ Util::zeroPadding(iterCutNumber, 3) + "\\" };
-
-				//The filename format is "_TileConfigurationCorrected_cutNumber_wavelengthIndex"
-				vec_configTxtGridStitcher.at(whichVectorPosition).open(outputPath + subFolderName + "_TileConfigurationGridStitcher_" + Util::zeroPadding(iterCutNumber, 3) + "_" + Util::toString(vec_wavelengthIndex.at(iterWavelengthIndex), 0) + ".txt");
-				vec_configTxtGridStitcher.at(whichVectorPosition) << "dim=3\n";	//Needed at the start of the txt for the stitcher
-				vec_configTxtBigStitcher.at(whichVectorPosition).open(outputPath + subFolderName + "_TileConfigurationBigStitcher_" + Util::zeroPadding(iterCutNumber, 3) + "_" + Util::toString(vec_wavelengthIndex.at(iterWavelengthIndex), 0) + ".txt");
-				vec_configTxtBigStitcher.at(whichVectorPosition) << "dim=3\n";	//Needed at the start of the txt for the stitcher
-			}
-
-		//Open the input configuration textfile containing the Tiff parameters
-		//This is a single file. Read it line by line
-		std::ifstream inputConfigTxt{ inputPath + "_TileConfiguration.txt" };
-		std::string line;
-		if (!inputConfigTxt)
-			throw std::runtime_error((std::string)__FUNCTION__ + ": The file _TileConfiguration.txt failed to open");
-
-		//Count the total number of stacks in a ROI in every vibratome section/cut and wavelength
-		//Needed for indexing all the tiles sequentially in the config txt file for BigStitcher (e.g., the numbering for the second channel has to start after the last number of the first channel)
-		//The first index is the cutNumber, the second is the wavelength
-		std::vector<std::vector<int>> vec_nStack(lastCutNumber - firstCutNumber + 1, std::vector<int>(vec_wavelengthIndex.size()));
-		{
-			getline(inputConfigTxt, line);													//Skip the first line that contains "dim=3"
-			while (getline(inputConfigTxt, line))
-				if (line.front() != '#')													//Skip all the lines that are commented out with #
+				const int wavelengthIndex{ vec_wavelengthIndex.at(iterWavelengthIndex) };
+				const int wavelength_nm{ Util::convertFluorMarkerToWavelength_nm(wavelengthIndex) };
+				int stackCounter{ 0 };
+
+				CorrectionParam param;
+				param.mFFOVfast = 150. * um;
+				const std::string inputPathFSlide{ "D:\\20191129_Liver20190812_03_lobe_raw_sorted\\Fslide_16X_fieldIllumination\\" };
+				if (wavelengthIndex == 0)
 				{
-					//Get the Tiff parameters at the beginning of each text line. Tokenize with respect to '_'. Convert the parameters to int
-					//The format is "cutNumber_wavelengthIndex_tileIndexII_tileIndexJJ", e.g. "000_0_17_31"
-					std::stringstream tiffFilenameDoubleIndices_ss(line.substr(0, line.find(".tif")));
-					std::string isolatedParameter;
-					getline(tiffFilenameDoubleIndices_ss, isolatedParameter, '_');		//cutNumber	
-					const int cutNumber{ std::stoi(isolatedParameter) };
-					getline(tiffFilenameDoubleIndices_ss, isolatedParameter, '_');		//wavelengthIndex
-					const int wavelengthIndex{ std::stoi(isolatedParameter) };
-					getline(tiffFilenameDoubleIndices_ss, isolatedParameter, '_');		//tileIndexII
-					const int tileIndexII{ std::stoi(isolatedParameter) };
-					getline(tiffFilenameDoubleIndices_ss, isolatedParameter, '_');		//tileIndexJJ
-					const int tileIndexJJ{ std::stoi(isolatedParameter) };
-
-					if (cutNumber >= firstCutNumber && cutNumber <= lastCutNumber)
-					{
-						//Constrain the stacks
-						if (tileIndexII >= tileIndexIIminMax.at(0) && tileIndexII <= tileIndexIIminMax.at(1) &&
-							tileIndexJJ >= tileIndexJJminMax.at(0) && tileIndexJJ <= tileIndexJJminMax.at(1))
-						{
-							//Proceed only if vec_wavelengthIndex contains wavelengthIndex
-							const std::vector<int>::iterator it = std::find(vec_wavelengthIndex.begin(), vec_wavelengthIndex.end(), wavelengthIndex);
-							if (it != vec_wavelengthIndex.end())
-							{
-								const int whichVectorPosition = std::distance(vec_wavelengthIndex.begin(), it); //Find the position of wavelengthIndex in vec_wavelengthIndex
-								vec_nStack[cutNumber - firstCutNumber][whichVectorPosition]++;
-							}
-						}
-					}
+					param.mSuppressCrosstalk = true;
+					param.mCrosstalkRatio = 0.28;
+					param.mFlattenField = true;
+					param.mExpFactor = 0.010;
+					//image.flattenFieldFluorescentSlide(inputPathFSlide + "XTcorrected_FSlide16X_V750nm_Pmin=96.0mW_Pexp=16000um_x=56.000_y=0.000_zi=16.6500_zf=16.6500_Step=0.0010_avg=10", scaleupFactor);
+				}
+				else if (wavelengthIndex == 2)
+				{
+					param.mSuppressCrosstalk = true;
+					param.mCrosstalkRatio = 0.33;
+					param.mFlattenField = true;
+					param.mExpFactor = 0.018;
+					//const int scaleupFactor{ 150 };
+					//image.flattenFieldFluorescentSlide(inputPathFSlide + "FSlide16X_F1040nm_Pmin=48.0mW_Pexp=16000um_x=34.000_y=0.000_zi=16.6000_zf=16.6000_Step=0.0010_avg=10", scaleupFactor);
 				}
 
-			//Count the number of blank corner to be created later. It is usually 4, but maybe some corner stacks already exist
-			//The count is needed to name the files sequentially for BigStitcher
-			for (int iterCutNumber = firstCutNumber; iterCutNumber <= lastCutNumber; iterCutNumber++)
-				for (std::vector<int>::size_type iterWavelengthIndex = 0; iterWavelengthIndex != vec_wavelengthIndex.size(); iterWavelengthIndex++)
-					for (int iterJJ = 0; iterJJ < 2; iterJJ++)
-						for (int iterII = 0; iterII < 2; iterII++)
-						{
-							const std::string subFolderName{ Util::zeroPadding(iterCutNumber, 3) + "\\" };
-							const std::string tiffFilenameDoubleIndices{ "corrected_" + Util::zeroPadding(iterCutNumber, 3) + "_" + Util::toString(vec_wavelengthIndex.at(iterWavelengthIndex), 0) + "_" +
-								Util::zeroPadding(iterII, 2) + "_" + Util::zeroPadding(iterJJ, 2) };
-
-							//Create the dummy stack only if it does not already exist
-							if (!std::filesystem::exists(inputPath + subFolderName + tiffFilenameDoubleIndices + ".tif"))
-								vec_nStack[iterCutNumber - firstCutNumber][iterWavelengthIndex]++;
-						}
+				//Queue the stacks in the same order as they were saved
+				for (const int recordIndex : inputManifest.findRecords(iterCutNumber, wavelength_nm))
+				{
+					const TileManifest::Record &record{ inputManifest.readRecord(recordIndex) };
+					const TILEIJ tileIndicesIJ{ record.mTileIndicesIJ };
+
+					//Constrain the stacks
+					if (tileIndicesIJ.II < tileIndexIIminMax.at(0) || tileIndicesIJ.II > tileIndexIIminMax.at(1) ||
+						tileIndicesIJ.JJ < tileIndexJJminMax.at(0) || tileIndicesIJ.JJ > tileIndexJJminMax.at(1))
+						continue;
+
+					//The filename format is "corrected_cutNumber_wavelengthIndex_stackCounter"
+					const std::string tiffFilenameSingleIndex{ "corrected_" + Util::zeroPadding(iterCutNumber, 3) + "_" + Util::toString(wavelengthIndex, 0) + "_" + Util::zeroPadding(stackCounter, 4) };
+					vec_job.push_back({ inputPath, record.mFilename.substr(0, record.mFilename.rfind(".tif")), outputPath + subFolderName, tiffFilenameSingleIndex, param });
+					vec_recordIndex.push_back(recordIndex);
+					stackCounter++;
+				}
+				vec_group.push_back({ iterCutNumber, wavelengthIndex, static_cast<int>(vec_job.size()), stackCounter });
+			}
 		}
 
-		//Apply the post-processing
+		//Create blank corner stacks to regularize the final size of the fused images because the vibratome sections have different numbers of tiles
+		//The corners of a group are created as soon as its last stack is saved, so the manifest records are in the same order as with a sequential loop
+		std::vector<Group>::size_type nextGroupIndex{ 0 };
+		int nSavedJobs{ 0 };
+		const auto createCornerStacks = [&]()
 		{
-			//stack counter for each cut and wavelength. The first index is the cutNumber, the second is the wavelength
-			std::vector<std::vector<int>> vec_stackCounter(lastCutNumber - firstCutNumber + 1, std::vector<int>(vec_wavelengthIndex.size()));
-
-			//Read the textfile containing the stack parameters line by line
-			inputConfigTxt.clear();														//Go back to the beginning of the text
-			inputConfigTxt.seekg(0, std::ios::beg);										//Go back to the beginning of the text
-			getline(inputConfigTxt, line);												//Skip the first line that contains "dim=3"
-			while (getline(inputConfigTxt, line))
-				if (line.front() != '#')												//Skip all the lines that are commented out with #
-				{
-					//Get the Tiff parameters at the beginning of each text line. Tokenize with respect to '_'. Convert the parameters to int
-					//The format is "cutNumber_wavelengthIndex_tileIndexII_tileIndexJJ", e.g. "000_0_17_31"
-					std::stringstream tiffFilenameDoubleIndices_ss(line.substr(0, line.find(".tif")));
-					std::string isolatedParameter;
-					getline(tiffFilenameDoubleIndices_ss, isolatedParameter, '_');		//cutNumber	
-					const int cutNumber{ std::stoi(isolatedParameter) };
-					getline(tiffFilenameDoubleIndices_ss, isolatedParameter, '_');		//wavelengthIndex
-					const int wavelengthIndex{ std::stoi(isolatedParameter) };
-					getline(tiffFilenameDoubleIndices_ss, isolatedParameter, '_');		//tileIndexII
-					const int tileIndexII{ std::stoi(isolatedParameter) };
-					getline(tiffFilenameDoubleIndices_ss, isolatedParameter, '_');		//tileIndexJJ
-					const int tileIndexJJ{ std::stoi(isolatedParameter) };
-
-					if (cutNumber >= firstCutNumber && cutNumber <= lastCutNumber)
+			for (; nextGroupIndex != vec_group.size() && vec_group.at(nextGroupIndex).mJobIndexEnd <= nSavedJobs; nextGroupIndex++)
+			{
+				Group &group{ vec_group.at(nextGroupIndex) };
+				const int wavelength_nm{ Util::convertFluorMarkerToWavelength_nm(group.mWavelengthIndex) };
+				const std::string subFolderName{ Util::zeroPadding(group.mCutNumber, 3) + "\\" };
+				for (int iterJJ = 0; iterJJ < 2; iterJJ++)
+					for (int iterII = 0; iterII < 2; iterII++)
 					{
-						//Constrain the stacks
-						if (tileIndexII >= tileIndexIIminMax.at(0) && tileIndexII <= tileIndexIIminMax.at(1) &&
-							tileIndexJJ >= tileIndexJJminMax.at(0) && tileIndexJJ <= tileIndexJJminMax.at(1))
-						{
-							//Proceed only if vec_wavelengthIndex contains wavelengthIndex
-							const std::vector<int>::iterator it = std::find(vec_wavelengthIndex.begin(), vec_wavelengthIndex.end(), wavelengthIndex);
-							if (it != vec_wavelengthIndex.end())
-							{
-								TiffU8 image{ heightPerFrame_pix, widthPerFrame_pix, nFrames };
-								image.loadTiffU8(inputPath + Util::zeroPadding(cutNumber, 3) + "\\", tiffFilenameDoubleIndices_ss.str());
-								image.correctRSdistortionGPU(150. * um);
-				
-								const std::string inputPathFSlide{ "D:\\20191129_Liver20190812_03_lobe_raw_sorted\\Fslide_16X_fieldIllumination\\" };
-								if (wavelengthIndex == 0)
-								{
-									image.suppressCrosstalk(0.28);
-									image.flattenFieldGaussian(0.010);
-									//image.flattenFieldFluorescentSlide(inputPathFSlide + "XTcorrected_FSlide16X_V750nm_Pmin=96.0mW_Pexp=16000um_x=56.000_y=0.000_zi=16.6500_zf=16.6500_Step=0.0010_avg=10", scaleupFactor);
-								}
-								else if (wavelengthIndex == 2)
-								{
-									image.suppressCrosstalk(0.33);
-									image.flattenFieldGaussian(0.018);	
-									//const int scaleupFactor{ 150 };
-									//image.flattenFieldFluorescentSlide(inputPathFSlide + "FSlide16X_F1040nm_Pmin=48.0mW_Pexp=16000um_x=34.000_y=0.000_zi=16.6000_zf=16.6000_Step=0.0010_avg=10", scaleupFactor);
-								}
+						const TILEIJ cornerIndicesIJ{ tileIndexIIminMax.at(iterII), tileIndexJJminMax.at(iterJJ) };
 
-								//stack
-								const std::string subFolderName{ Util::zeroPadding(cutNumber, 3) + "\\" };
-								const int whichVectorPosition = std::distance(vec_wavelengthIndex.begin(), it); //Find the position of wavelengthIndex in vec_wavelengthIndex
-								const std::string tiffFilenameSingleIndex{ "corrected_" + Util::zeroPadding(cutNumber, 3) + "_" + Util::toString(wavelengthIndex, 0) + "_" +
-									Util::zeroPadding(vec_stackCounter[cutNumber - firstCutNumber][whichVectorPosition], 4) };
-								image.saveToFile(outputPath + subFolderName, tiffFilenameSingleIndex, TIFFSTRUCT::MULTIPAGE, OVERRIDE::EN);
-
-								//tileConfiguration textfile
-								std::string commonEntry{ ";;\t(" +
-									Util::toString(stackOverlapXY_pix.II * tileIndexJJ, 0) + "," +		//Note that in Fiji, the roles of II and JJ are reversed 
-									Util::toString(stackOverlapXY_pix.JJ * tileIndexII, 0) + "," +
-									Util::toString(stackOverlapXY_pix.KK * cutNumber, 0) + ")\n" +
-									"#corrected_" + tiffFilenameDoubleIndices_ss.str() + ".tif\n" };
-
-								//For BigStitcher, index the tiles sequentially
-								int stackCounterWithOffset{ vec_stackCounter[cutNumber - firstCutNumber][whichVectorPosition] };
-								if (whichVectorPosition == 1)
-									stackCounterWithOffset += vec_nStack[cutNumber - firstCutNumber][0];
-
-								std::string gridStitcherEntry{ tiffFilenameSingleIndex + ".tif" + commonEntry };
-								std::string bigStitcherEntry{ Util::zeroPadding(stackCounterWithOffset, 4) + commonEntry };
-								vec_configTxtGridStitcher.at((cutNumber - firstCutNumber) * vec_wavelengthIndex.size() + whichVectorPosition) << gridStitcherEntry;
-								vec_configTxtBigStitcher.at((cutNumber - firstCutNumber) * vec_wavelengthIndex.size() + whichVectorPosition) << bigStitcherEntry;
-
-								vec_stackCounter[cutNumber - firstCutNumber][whichVectorPosition]++;
-
-								//std::cout << "Cut number = " << cutNumber << "\twavelengthIndex = " << wavelengthIndex << "\t(II,JJ) = (" << tileIndexII << "," << tileIndexJJ << ")\n";//For debugging
-								Util::pressESCforEarlyTermination();
-							}
-						}//if(select tiles)
-					}//if(select cut and wavelength)
-				}//if(line.front() != '#')	
-
-			//Create blank corner stacks to regularize the final size of the fused images because the vibratome sections have different numbers of tiles
-			for (int iterCutNumber = firstCutNumber; iterCutNumber <= lastCutNumber; iterCutNumber++)
-				for (std::vector<int>::size_type iterWavelengthIndex = 0; iterWavelengthIndex != vec_wavelengthIndex.size(); iterWavelengthIndex++)
-					for (int iterJJ = 0; iterJJ < 2; iterJJ++)
-						for (int iterII = 0; iterII < 2; iterII++)
+						//Create the dummy stack only if the corner stack does not already exist
+						if (outputManifest.contains(group.mCutNumber, wavelength_nm, cornerIndicesIJ))
+							std::cout << "WARNING: the corner stack (" << cornerIndicesIJ.II << "," << cornerIndicesIJ.JJ << ") already exists. Dummy stack creation skipped\n";
+						else
 						{
-							const std::string subFolderName{ Util::zeroPadding(iterCutNumber, 3) + "\\" };
-							const std::string tiffFilenameDoubleIndices{ "corrected_" + Util::zeroPadding(iterCutNumber, 3) + "_" + Util::toString(vec_wavelengthIndex.at(iterWavelengthIndex), 0) + "_" + Util::zeroPadding(iterII, 2) + "_" + Util::zeroPadding(iterJJ, 2) };
-							const std::string tiffFilenameSingleIndex{ "corrected_" + Util::zeroPadding(iterCutNumber, 3) + "_" + Util::toString(vec_wavelengthIndex.at(iterWavelengthIndex), 0) + "_" + Util::zeroPadding(vec_stackCounter[iterCutNumber - firstCutNumber][iterWavelengthIndex], 4) };
-
-							//Create the dummy stack only if it does not already exist
-							if (std::filesystem::exists(inputPath + subFolderName + tiffFilenameDoubleIndices + ".tif"))
-								std::cout << "WARNING: the file " << tiffFilenameSingleIndex << " already exists. Dummy stack creation skipped\n";
-							else
-							{
-								//Stack				
-								TiffU8 image{ heightPerFrame_pix, widthPerFrame_pix, nFrames };
-								image.saveToFile(outputPath + subFolderName, tiffFilenameSingleIndex, TIFFSTRUCT::MULTIPAGE, OVERRIDE::EN);
-
-								//tileConfiguration textfile
-								const std::string dummyTiffFilenameDoubleIndices{ Util::zeroPadding(iterCutNumber, 3) + "_" + Util::toString(vec_wavelengthIndex.at(iterWavelengthIndex), 0) + "_" +
-									Util::zeroPadding(tileIndexIIminMax.at(iterII),2) + "_" +
-									Util::zeroPadding(tileIndexJJminMax.at(iterJJ),2) };
-
-								std::string commonEntry{ ";;\t(" +
-									Util::toString(stackOverlapXY_pix.II * tileIndexJJminMax.at(iterJJ), 0) + "," +		//Note that in Fiji, the roles of II and JJ are reversed 
-									Util::toString(stackOverlapXY_pix.JJ * tileIndexIIminMax.at(iterII), 0) + "," +
-									Util::toString(stackOverlapXY_pix.KK * iterCutNumber, 0) + ")\n" +
-									"#corrected_" + dummyTiffFilenameDoubleIndices + ".tif\n" };
-
-								//For BigStitcher, index the tiles sequentially
-								int stackCounterWithOffset{ vec_stackCounter[iterCutNumber - firstCutNumber][iterWavelengthIndex] };
-								if (iterWavelengthIndex == 1)
-									stackCounterWithOffset += vec_nStack[iterCutNumber - firstCutNumber][iterWavelengthIndex];
-
-								std::string gridStitcherEntry{ tiffFilenameSingleIndex + ".tif" + commonEntry };
-								std::string bigStitcherEntry{ Util::zeroPadding(stackCounterWithOffset, 4) + commonEntry };
-								vec_configTxtGridStitcher.at((iterCutNumber - firstCutNumber) * vec_wavelengthIndex.size() + iterWavelengthIndex) << gridStitcherEntry;
-								vec_configTxtBigStitcher.at((iterCutNumber - firstCutNumber) * vec_wavelengthIndex.size() + iterWavelengthIndex) << bigStitcherEntry;
-
-								vec_stackCounter[iterCutNumber - firstCutNumber][iterWavelengthIndex]++;
-							}//if(file already exists)
-						}//for(corner stacks)
-		}
+							const std::string tiffFilenameSingleIndex{ "corrected_" + Util::zeroPadding(group.mCutNumber, 3) + "_" + Util::toString(group.mWavelengthIndex, 0) + "_" + Util::zeroPadding(group.mStackCounter, 4) };
+							TiffU8 image{ heightPerFrame_pix, widthPerFrame_pix, nFrames };
+							image.saveToFile(outputPath + subFolderName, tiffFilenameSingleIndex, TIFFSTRUCT::MULTIPAGE, OVERRIDE::EN);
+							outputManifest.append(group.mCutNumber, wavelength_nm, cornerIndicesIJ, { 0, 0, 0 }, subFolderName + tiffFilenameSingleIndex + ".tif", image.computeCRC32());
+							group.mStackCounter++;
+						}
+					}
+			}
+		};
 
-		//Close the input configuration textfile
-		inputConfigTxt.close();
+		//Read, correct, and save the stacks in a pipeline. The records are appended to the output manifest in job order
+		createCornerStacks();
+		BatchCorrector batchCorrector{ nReaders, nWorkers, nWriters, memoryBudget_byte };
+		batchCorrector.run(vec_job, [&](const int jobIndex, const U32 checksum)
+		{
+			const CorrectionJob &job{ vec_job.at(jobIndex) };
+			const TileManifest::Record &record{ inputManifest.readRecord(vec_recordIndex.at(jobIndex)) };
+			const std::string subFolderName{ Util::zeroPadding(record.mCutNumber, 3) + "\\" };
+			outputManifest.append(record.mCutNumber, record.mWavelength_nm, record.mTileIndicesIJ, record.mStagePosXYZ, subFolderName + job.mOutputFilename + ".tif", checksum);
+			nSavedJobs++;
+			createCornerStacks();
+		}, &journal);
+		createCornerStacks();
 
-		//Close the output configuration textfiles
 		for (int iterCutNumber = firstCutNumber; iterCutNumber <= lastCutNumber; iterCutNumber++)
+		{
+			const std::string subFolderName{ Util::zeroPadding(iterCutNumber, 3) + "\\" };
+
+			//Generate an output configuration textfile for each vibratome slice and each laser wavelength for both BigStitcher and GridStitcher in Fiji
+			//For BigStitcher, index the tiles sequentially (e.g., the numbering for the second channel has to start after the last number of the first channel)
+			int firstTileNumber{ 0 };
 			for (std::vector<int>::size_type iterWavelengthIndex = 0; iterWavelengthIndex != vec_wavelengthIndex.size(); iterWavelengthIndex++)
 			{
-				vec_configTxtGridStitcher.at((iterCutNumber - firstCutNumber) * vec_wavelengthIndex.size() + iterWavelengthIndex).close();
-				vec_configTxtBigStitcher.at((iterCutNumber - firstCutNumber) * vec_wavelengthIndex.size() + iterWavelengthIndex).close();
+				const int wavelengthIndex{ vec_wavelengthIndex.at(iterWavelengthIndex) };
+				const int wavelength_nm{ Util::convertFluorMarkerToWavelength_nm(wavelengthIndex) };
+				const std::string suffix{ Util::zeroPadding(iterCutNumber, 3) + "_" + Util::toString(wavelengthIndex, 0) };
+
+				outputManifest.saveGridStitcherConfig(outputPath + subFolderName, "_TileConfigurationGridStitcher_" + suffix, iterCutNumber, wavelength_nm, stackOverlapXY_pix, OVERRIDE::EN);
+				outputManifest.saveBigStitcherConfig(outputPath + subFolderName, "_TileConfigurationBigStitcher_" + suffix, iterCutNumber, wavelength_nm, firstTileNumber, stackOverlapXY_pix, OVERRIDE::EN);
+				firstTileNumber += static_cast<int>(outputManifest.findRecords(iterCutNumber, wavelength_nm).size());
 			}
+		}
 		//Util::pressAnyKeyToCont();
 	}
 
@@ -1111,6 +1667,7 @@ namespace TestRoutines
 		//CREATE THE CONTROL SEQUENCE
 		const int wavelength_nm{ 1040 };
 		const double laserPower{ 25. * mW };		//Laser power
+		DeviceSessions sessions;		//Open the devices of the Mesoscope in the background, while the FPGA session is opened
 		RTseq realtimeSeq{ fpga, LINECLOCK::RS, FIFOOUTfpga::EN, heightPerFrame_pix, widthPerFrame_pix, nFramesCont, g_multibeam };
 		Mesoscope mesoscope{ realtimeSeq, Laser::ID::FIDELITY };
 		mesoscope.configure(wavelength_nm);
@@ -1202,6 +1759,7 @@ namespace TestRoutines
 
 		//CREATE THE CONTROL SEQUENCE
 		const int wavelength_nm{ 1040 };
+		DeviceSessions sessions;		//Open the devices of the Mesoscope in the background, while the FPGA session is opened
 		RTseq realtimeSeq{ fpga, LINECLOCK::FG, FIFOOUTfpga::EN, heightPerBeamletPerFrame_pix, widthPerFrame_pix, nFramesCont, g_multibeam };
 		Mesoscope mesoscope{ realtimeSeq, Laser::ID::AUTO };
 		mesoscope.configure(wavelength_nm);
@@ -1278,41 +1836,226 @@ namespace TestRoutines
 		//stage.printStageConfig(Z, DOchan);
 	}
 
-	void shutter(const FPGA &fpga)
+	//Benchmark the settle-to-trigger overhead of a tile move against a simulation of the PI controllers. The overhead is the time from the arrival of the stages
+	//until the stages are confirmed stopped and the next stack can be triggered. Compare the former motion code (sequential PI_MOV and continuous polling)
+	//with StageMotion (concurrent PI_MOV and polling near the predicted arrival). Then check that StageMotion gives up on a stage that never stops and on a cancelled wait
+	void stageMotionBenchmark()
 	{
-		//CREATE THE CONTROL SEQUENCE
-		RTseq realtimeSeq{ fpga, LINECLOCK::FG , FIFOOUTfpga::DIS, 560, 300, 1, g_multibeam };
+		const double commandLatency{ 14. * ms };				//Duration of PI_MOV
+		const double pollLatency{ 55. * ms };					//Duration of PI_IsMoving
+		const VELOCITY3 velXYZ{ 5. * mmps, 5. * mmps, 0.5 * mmps };
+		const LENGTH2 tilePitchXY{ 0.266 * mm, 0.142 * mm };
+		const int nMoves{ 40 };
+
+		//Each controller serves one request at a time. The stages are modeled with a slightly different acceleration than StageMotion and with a variable settling time
+		class SimulatedPIcontroller
+		{
+		public:
+			SimulatedPIcontroller(const double commandLatency, const double pollLatency, const VELOCITY3 velXYZ) :
+				mCommandLatency{ commandLatency }, mPollLatency{ pollLatency }, mVelXYZ{ velXYZ } {}
 
-		Pockels fidelity{ realtimeSeq, 1040, Laser::ID::FIDELITY };
-		fidelity.setShutter(true);
-		Sleep(5000);
-		fidelity.setShutter(false);
+			void move(const AXIS axis, const double distance, const double settlingTime)
+			{
+				std::lock_guard<std::mutex> lock{ mMutexXYZ.at(axis) };
+				sleep_(mCommandLatency);
+				const double vel{ axis == XX ? mVelXYZ.XX : axis == YY ? mVelXYZ.YY : mVelXYZ.ZZ };
+				const double acc{ mAccXYZ.at(axis) };
+				const double motionTime{ distance < vel * vel / acc ? 2 * std::sqrt(distance / acc) : distance / vel + vel / acc };
+				mArrivalXYZ.at(axis) = std::chrono::high_resolution_clock::now() + std::chrono::microseconds(static_cast<long long>((motionTime + settlingTime) / us));
+			}
 
-		//Shutter shutterFidelity(fpga, FIDELITY);
-		//shutterFidelity.open();
-		//Sleep(5000);
-		//shutterFidelity.close();
-	}
+			//The state of the stage is sampled in the middle of the call
+			bool isMoving(const AXIS axis)
+			{
+				std::lock_guard<std::mutex> lock{ mMutexXYZ.at(axis) };
+				const auto sampleTime{ std::chrono::high_resolution_clock::now() + std::chrono::microseconds(static_cast<long long>(mPollLatency / 2 / us)) };
+				sleep_(mPollLatency);
+				return sampleTime < mArrivalXYZ.at(axis);
+			}
 
-	//For keeping the pockels on to check the the laser power
-	//0. Make sure that the function generator feeds the lineclock
-	//1. Manually open the Vision shutter and Uniblitz shutter. The latter because the class destructor closes the shutter automatically
-	//2. Set g_pockelsAutoOff to 0 for holding on the last value
-	//3. Tune Vision's wavelength manually
-	void pockels(const FPGA &fpga)
-	{
-		//CREATE THE CONTROL SEQUENCE
-		RTseq realtimeSeq{ fpga, LINECLOCK::FG , FIFOOUTfpga::DIS, 350, 300, 1, g_multibeam };
+			std::chrono::time_point<std::chrono::high_resolution_clock> readArrival(const AXIS axis) const
+			{
+				return mArrivalXYZ.at(axis);
+			}
+		private:
+			const double mCommandLatency;
+			const double mPollLatency;
+			const VELOCITY3 mVelXYZ;
+			const std::array<double, 3> mAccXYZ{ 90. * mmps / seconds, 22. * mmps / seconds, 10. * mmps / seconds };
+			std::array<std::mutex, 3> mMutexXYZ;
+			std::array<std::chrono::time_point<std::chrono::high_resolution_clock>, 3> mArrivalXYZ;
+
+			void sleep_(const double duration) const
+			{
+				std::this_thread::sleep_for(std::chrono::microseconds(static_cast<long long>(duration / us)));
+			}
+		};
 
-		//DEFINE THE POCKELS
-		//Pockels pockelsVision{ realtimeSeq, 750, Laser::ID::VISION };
-		//Pockels pockels{ pockelsVision };
+		//Raster of tiles: mostly 1 tile in X, 1 tile in Y at the end of each row, and a long move back every 10 moves
+		std::vector<LENGTH2> distanceXY;
+		for (int iterMove = 0; iterMove < nMoves; iterMove++)
+		{
+			if (iterMove % 10 == 9)
+				distanceXY.push_back({ 9 * tilePitchXY.XX, tilePitchXY.YY });
+			else if (iterMove % 5 == 4)
+				distanceXY.push_back({ 0, tilePitchXY.YY });
+			else
+				distanceXY.push_back({ tilePitchXY.XX, 0 });
+		}
 
-		Pockels pockelsFidelity{ realtimeSeq, 1040, Laser::ID::FIDELITY };
-		Pockels pockels{ pockelsFidelity };
+		auto elapsedTime = [](const std::chrono::time_point<std::chrono::high_resolution_clock> from, const std::chrono::time_point<std::chrono::high_resolution_clock> to)
+		{
+			return std::chrono::duration<double, std::micro>(to - from).count() * us;
+		};
 
-		//pockels.pushVoltageSinglet(3.0 * V);
-		pockels.pushPowerSinglet(0. * mW);
+		//Run the moves and return the settle-to-trigger overhead and the move duration (from the first command until the stages are confirmed stopped), averaged over the moves
+		auto runMoves = [&](const bool useStageMotion, int &nPolls, double &maxOverhead)
+		{
+			SimulatedPIcontroller controller{ commandLatency, pollLatency, velXYZ };
+			StageMotion motion;
+			double totalOverhead{ 0 }, totalMoveTime{ 0 };
+			nPolls = 0;
+			maxOverhead = 0;
+			for (int iterMove = 0; iterMove < nMoves; iterMove++)
+			{
+				const std::array<double, 3> distanceXYZ{ distanceXY.at(iterMove).XX, distanceXY.at(iterMove).YY, 0 };
+				const double settlingTime{ (10. + (iterMove * 7) % 20) * ms };
+				const auto startTime{ std::chrono::high_resolution_clock::now() };
+
+				if (useStageMotion)
+				{
+					motion.issueConcurrently({ XX, YY }, [&](const AXIS axis)
+						{
+							if (distanceXYZ.at(axis) > 0)
+							{
+								controller.move(axis, distanceXYZ.at(axis), settlingTime);
+								motion.startMove(axis, distanceXYZ.at(axis), axis == XX ? velXYZ.XX : velXYZ.YY);
+							}
+						});
+					motion.waitForMotionToStop({ XX, YY, ZZ }, [&](const AXIS axis) { nPolls++; return controller.isMoving(axis); });
+				}
+				else
+				{
+					//Replay the former Stage::moveXY and Stage::waitForMotionToStopAll
+					for (const AXIS axis : { XX, YY })
+						if (distanceXYZ.at(axis) > 0)
+							controller.move(axis, distanceXYZ.at(axis), settlingTime);
+
+					bool isMovingX, isMovingY, isMovingZ;
+					do {
+						isMovingX = controller.isMoving(XX);
+						isMovingY = controller.isMoving(YY);
+						isMovingZ = controller.isMoving(ZZ);
+						nPolls += 3;
+					} while (isMovingX || isMovingY || isMovingZ);
+				}
+				const auto readyTime{ std::chrono::high_resolution_clock::now() };
+
+				//The arrival of the stages that did not move is in the past
+				const auto arrivalTime{ (std::max)({ startTime, distanceXYZ.at(XX) > 0 ? controller.readArrival(XX) : startTime, distanceXYZ.at(YY) > 0 ? controller.readArrival(YY) : startTime }) };
+				const double overhead{ elapsedTime(arrivalTime, readyTime) };
+				totalOverhead += overhead;
+				maxOverhead = (std::max)(maxOverhead, overhead);
+				totalMoveTime += elapsedTime(startTime, readyTime);
+			}
+			if (useStageMotion)
+				std::cout << "Learned arrival correction X = " << motion.readArrivalCorrection(XX) / ms << " ms\tY = " << motion.readArrivalCorrection(YY) / ms << " ms\n";
+			return std::array<double, 2>{ totalOverhead / nMoves, totalMoveTime / nMoves };
+		};
+
+		for (const bool useStageMotion : { false, true })
+		{
+			int nPolls;
+			double maxOverhead;
+			const std::array<double, 2> result{ runMoves(useStageMotion, nPolls, maxOverhead) };
+			std::cout << (useStageMotion ? "StageMotion" : "Continuous polling") << ":\tsettle-to-trigger overhead = " << result.at(0) / ms << " ms (max " << maxOverhead / ms << " ms)"
+				<< "\tmove duration = " << result.at(1) / ms << " ms\tpolls per move = " << 1. * nPolls / nMoves << "\n";
+		}
+
+		//Timeout: the X stage never settles, e.g. because of a fault of the controller. The wait must throw at the deadline of the move instead of polling forever
+		{
+			SimulatedPIcontroller controller{ commandLatency, pollLatency, velXYZ };
+			StageMotion motion;
+			const double distance{ tilePitchXY.XX };
+			controller.move(XX, distance, 3600. * seconds);
+			motion.startMove(XX, distance, velXYZ.XX);
+			const auto startTime{ std::chrono::high_resolution_clock::now() };
+			try
+			{
+				motion.waitForMotionToStop({ XX }, [&controller](const AXIS axis) { return controller.isMoving(axis); });
+				std::cout << "Timeout: FAILED, the wait returned although the stage is still moving\n";
+			}
+			catch (const std::runtime_error &e)
+			{
+				std::cout << "Timeout: the wait threw after " << elapsedTime(startTime, std::chrono::high_resolution_clock::now()) / ms << " ms (predicted move = " <<
+					motion.predictMotionTime(XX, distance, velXYZ.XX) / ms << " ms)\t" << e.what() << "\n";
+			}
+		}
+
+		//Cancellation: a long move in Y is waited for on this thread and cancelled from another thread
+		{
+			SimulatedPIcontroller controller{ commandLatency, pollLatency, velXYZ };
+			StageMotion motion;
+			const double distance{ 20. * mm };
+			controller.move(YY, distance, 20. * ms);
+			motion.startMove(YY, distance, velXYZ.YY);
+			std::chrono::time_point<std::chrono::high_resolution_clock> cancelTime;
+			std::thread canceller{ [&motion, &cancelTime]
+				{
+					std::this_thread::sleep_for(std::chrono::milliseconds(200));
+					cancelTime = std::chrono::high_resolution_clock::now();
+					motion.cancel();
+				} };
+			try
+			{
+				motion.waitForMotionToStop({ YY }, [&controller](const AXIS axis) { return controller.isMoving(axis); });
+				canceller.join();
+				std::cout << "Cancellation: FAILED, the wait was not interrupted\n";
+			}
+			catch (const std::runtime_error &e)
+			{
+				canceller.join();
+				std::cout << "Cancellation: the wait threw " << elapsedTime(cancelTime, std::chrono::high_resolution_clock::now()) / ms << " ms after cancel() (predicted move = " <<
+					motion.predictMotionTime(YY, distance, velXYZ.YY) / ms << " ms)\t" << e.what() << "\n";
+			}
+		}
+	}
+
+	void shutter(const FPGA &fpga)
+	{
+		//CREATE THE CONTROL SEQUENCE
+		RTseq realtimeSeq{ fpga, LINECLOCK::FG , FIFOOUTfpga::DIS, 560, 300, 1, g_multibeam };
+
+		Pockels fidelity{ realtimeSeq, 1040, Laser::ID::FIDELITY };
+		fidelity.setShutter(true);
+		Sleep(5000);
+		fidelity.setShutter(false);
+
+		//Shutter shutterFidelity(fpga, FIDELITY);
+		//shutterFidelity.open();
+		//Sleep(5000);
+		//shutterFidelity.close();
+	}
+
+	//For keeping the pockels on to check the the laser power
+	//0. Make sure that the function generator feeds the lineclock
+	//1. Manually open the Vision shutter and Uniblitz shutter. The latter because the class destructor closes the shutter automatically
+	//2. Set g_pockelsAutoOff to 0 for holding on the last value
+	//3. Tune Vision's wavelength manually
+	void pockels(const FPGA &fpga)
+	{
+		//CREATE THE CONTROL SEQUENCE
+		RTseq realtimeSeq{ fpga, LINECLOCK::FG , FIFOOUTfpga::DIS, 350, 300, 1, g_multibeam };
+
+		//DEFINE THE POCKELS
+		//Pockels pockelsVision{ realtimeSeq, 750, Laser::ID::VISION };
+		//Pockels pockels{ pockelsVision };
+
+		Pockels pockelsFidelity{ realtimeSeq, 1040, Laser::ID::FIDELITY };
+		Pockels pockels{ pockelsFidelity };
+
+		//pockels.pushVoltageSinglet(3.0 * V);
+		pockels.pushPowerSinglet(0. * mW);
 
 		//LOAD AND EXECUTE THE CONTROL SEQUENCE ON THE FPGA
 		realtimeSeq.run();
@@ -1403,6 +2146,7 @@ namespace TestRoutines
 	void virtualLasers(const FPGA &fpga)
 	{
 		//CREATE THE CONTROL SEQUENCE
+		DeviceSessions sessions;		//Open the devices of the Mesoscope in the background, while the FPGA session is opened
 		RTseq realtimeSeq{ fpga, LINECLOCK::FG , FIFOOUTfpga::DIS, 560, 300, 1, g_multibeam };
 
 		const int wavelength_nm{ 1040 };
@@ -1692,13 +2436,25 @@ namespace TestRoutines
 	}
 
 	//Process all the tifs in a folder
-	void correctImageBatch()
+	//Pass a unique workerName on each PC (or process) to share the batch over the common folder. Otherwise, the batch is corrected locally
+	void correctImageBatch(const std::string workerName)
 	{
 		const std::string commonFolderPath{ "D:\\OwnCloud\\Data\\20200907_for_Hernan\\Denoised\\" };
 
 		const std::string inputSubFolderPath{ "Input\\" };
 		const std::string outputSubFolderPath{ "Output\\" };
-
+		const int nThreads{ 4 };
+
+		CorrectionParam param;
+		param.mFFOVfast = 150. * um;
+		param.mSuppressCrosstalk = true;
+		param.mCrosstalkRatio = 0.34;
+		param.mFineTuningTop = 0.9;
+		param.mFineTuningBottom = 0.7;
+		param.mFlattenField = true;
+		param.mExpFactor = 0.017;
+
+		std::vector<CorrectionJob> vec_job;
 		for (const auto & entry : std::filesystem::directory_iterator(commonFolderPath + inputSubFolderPath))
 		{
 			std::string filename_s{ entry.path().filename().string() };
@@ -1710,13 +2466,84 @@ namespace TestRoutines
 				std::stringstream filename_ss(filename_s.substr(0, filename_s.find(".tif")));
 				//std::cout << filename_ss.str() << std::endl;//For debugging
 
-				TiffU8 image{ commonFolderPath + inputSubFolderPath, filename_ss.str() };
-				image.correctRSdistortionGPU(150. * um);
-				image.suppressCrosstalk(0.34, 0.9, 0.7);
-				image.flattenFieldGaussian(0.017);
-				image.saveToFile(commonFolderPath + outputSubFolderPath, "corrected_" + filename_ss.str(), TIFFSTRUCT::MULTIPAGE, OVERRIDE::DIS);
+				vec_job.push_back({ commonFolderPath + inputSubFolderPath, filename_ss.str(), commonFolderPath + outputSubFolderPath, "corrected_" + filename_ss.str(), param });
+			}
+		}
+
+		if (workerName.empty())
+		{
+			//The journal lives in the output folder. A restarted batch skips the stacks already corrected with the same input and parameters
+			CorrectionJournal journal{ commonFolderPath + outputSubFolderPath };
+			CorrectionJobRunner runner{ nThreads };
+			runner.run(vec_job, journal);
+		}
+		else
+		{
+			LeasedCorrector leasedCorrector{ commonFolderPath + "_Leases\\", workerName, nThreads };
+			leasedCorrector.run(vec_job);
+		}
+
+		Util::pressAnyKeyToCont();
+	}
+
+	//Run the correction operators on a synthetic stack many times and print the working set of the process. Because the operators draw from the scratch arena, the working set should stay flat after the first iterations
+	//Throw if the high-water mark of the arena grows after the first report
+	void scratchArenaSoak()
+	{
+		const int heightPerFrame_pix{ 560 };
+		const int widthPerFrame_pix{ 300 };
+		const int nFrames{ 20 };
+		const int nIterations{ 5000 };
+		const int reportPeriod{ 250 };
+
+		//Synthetic stack with some structure
+		std::vector<U8> vec_input(heightPerFrame_pix * widthPerFrame_pix * nFrames);
+		for (int iterPix = 0; iterPix < static_cast<int>(vec_input.size()); iterPix++)
+			vec_input.at(iterPix) = static_cast<U8>((iterPix * 7 + iterPix / widthPerFrame_pix) % 251);
+		const TiffU8 source{ vec_input, heightPerFrame_pix, widthPerFrame_pix, nFrames };
+		TiffU8 image{ source };
+
+		PROCESS_MEMORY_COUNTERS memoryCounters;
+		U64 firstWorkingSet_byte{ 0 };
+		U64 firstHighWater_byte{ 0 };
+		auto t_start{ std::chrono::high_resolution_clock::now() };
+		for (int iterIteration = 0; iterIteration < nIterations; iterIteration++)
+		{
+			image = source;		//Reuses the array of the image
+			image.correctRSdistortionCPU(150. * um);
+			image.suppressCrosstalk(0.34, 0.9, 0.7);
+			image.flattenFieldGaussian(0.017);
+			image.flattenFieldLinear(1.5, 3, 12);
+			image.mirrorOddFrames();
+			image.binFrames(2);
+			image.averageFrames();
+			image.mirrorSingleFrame();
+
+			if ((iterIteration + 1) % reportPeriod == 0)
+			{
+				GetProcessMemoryInfo(GetCurrentProcess(), &memoryCounters, sizeof(memoryCounters));
+				const U64 workingSet_byte{ memoryCounters.WorkingSetSize };
+				const U64 highWater_byte{ ScratchArena::readHighWater_byte() };
+				if (firstWorkingSet_byte == 0)
+				{
+					firstWorkingSet_byte = workingSet_byte;
+					firstHighWater_byte = highWater_byte;
+				}
+
+				std::cout << "Iteration " << iterIteration + 1 << "\tWorking set (MB) = " << workingSet_byte / 1000000. <<
+					"\tDrift (MB) = " << (1. * workingSet_byte - firstWorkingSet_byte) / 1000000. <<
+					"\tArena (MB) = " << ScratchArena::readResident_byte() / 1000000. <<
+					"\tHigh-water (MB) = " << highWater_byte / 1000000. <<
+					"\tAllocations = " << ScratchArena::readNallocations() <<
+					"\tReuses = " << ScratchArena::readNreuses() << "\n";
+
+				if (highWater_byte > firstHighWater_byte)
+					throw std::runtime_error((std::string)__FUNCTION__ + ": The high-water mark of the scratch arena grew from " + std::to_string(firstHighWater_byte) + " to " + std::to_string(highWater_byte) + " bytes");
 			}
 		}
+		const double duration{ std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t_start).count() };
+		std::cout << "Elapsed time per iteration: " << duration / nIterations << " ms\n";
+		std::cout << "Peak working set (MB) = " << memoryCounters.PeakWorkingSetSize / 1000000. << "\n";
 
 		Util::pressAnyKeyToCont();
 	}
@@ -1787,6 +2614,112 @@ namespace TestRoutines
 		Util::pressAnyKeyToCont();
 	}
 
+	//Build the pyramid of a panoramic, save it as a tiled Tiff, and time how long it takes to open each level
+	void panoramicPyramid()
+	{
+		const std::string inputFilename{ "Panoramic_000" };
+		const std::string outputFilename{ "Pyramid" };
+		const TiffU8 image{ g_imagingFolderPath, inputFilename };
+
+		PanoramicPyramid pyramid{ image };
+		pyramid.update();
+		pyramid.saveToFile(g_imagingFolderPath, outputFilename, OVERRIDE::EN);
+
+		for (int iterLevel = pyramid.readNlevels() - 1; iterLevel >= 0; iterLevel--)
+		{
+			auto t_start{ std::chrono::high_resolution_clock::now() };
+			const TiffU8 level{ PanoramicPyramid::loadLevel(g_imagingFolderPath, outputFilename, iterLevel) };
+			const double duration{ std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t_start).count() };
+			std::cout << "Level " << iterLevel << " (" << level.readHeightPerFrame_pix() << "x" << level.readWidthPerFrame_pix() << " pix) opened in " << duration << " ms\n";
+		}
+
+		//Generate the boolmap at a downsampled level and render the overlay at that level
+		const PIXDIM2 overlayTileSize_pix{ 280, 300 };
+		const TILEDIM2 overlayTileArraySizeIJ{ 40, 70 };
+		const TILEOVERLAP3 overlayOverlapIJK_frac{ 0.15, 0.10, 0.5 };
+		const double threshold{ 0.02 };
+		const int level{ 2 };
+
+		Boolmap boolmap{ pyramid, level, overlayTileArraySizeIJ, overlayTileSize_pix, overlayOverlapIJK_frac, threshold };
+		boolmap.saveBoolmapToText(g_imagingFolderPath, "Boolmap_level" + std::to_string(level), OVERRIDE::EN);
+		boolmap.saveTiffWithBoolmapTileOverlay(g_imagingFolderPath, "TileMap_level" + std::to_string(level), OVERRIDE::EN);
+		Util::pressAnyKeyToCont();
+	}
+
+	//Validate the boolmap prediction offline on a recorded dataset: predict the boolmap of each cut from the stacks of the previous cut and compare it with the boolmap
+	//recorded by the panoramic scans of that cut. The stacks on disk are ordered from the top of the stack (see TiffU8::saveToFile)
+	void boolmapPrediction(const int firstCutNumber, const int lastCutNumber)
+	{
+		const std::string manifestFilename{ "_TileManifest" };
+		const TILEDIM2 tileArraySizeIJ{ 40, 70 };
+		const PIXDIM2 tileSize_pix{ 560, 300 };
+		const int nFrames{ 100 };
+		const double pixelSizeZ{ 1.0 * um };
+		const double cutAboveBottomOfStack{ 30. * um };
+		const double PANtime{ 120. };						//Typical time of a panoramic scan in s. Read it from the console output of the sequencer
+		const int nPANperCut{ 2 };							//Number of panoramic scans per cut in Sequencer::generateCommandList
+		const BoolmapPrediction boolmapPrediction{ g_currentSample.mBoolmapPrediction };
+
+		if (firstCutNumber >= lastCutNumber)
+			throw std::invalid_argument((std::string)__FUNCTION__ + ": The first cut number must be < last cut number");
+
+		if (!std::filesystem::exists(g_imagingFolderPath + manifestFilename + ".bin"))
+			TileManifest::importTileConfiguration(g_imagingFolderPath, "_TileConfiguration", manifestFilename);
+		const TileManifest manifest{ g_imagingFolderPath, manifestFilename };
+
+		const int nFramesBelowCut{ (std::min)(nFrames, (std::max)(1, static_cast<int>(std::ceil(cutAboveBottomOfStack / pixelSizeZ)))) };
+		BoolmapPredictor boolmapPredictor{ tileArraySizeIJ, tileSize_pix, nFrames, nFramesBelowCut, boolmapPrediction.mThreshold, boolmapPrediction.mMargin_tiles };
+
+		int nMissedTotal{ 0 }, nExtraTotal{ 0 }, nMeasuredTotal{ 0 }, nCutsPredicted{ 0 };
+		for (int iterCut = firstCutNumber; iterCut < lastCutNumber; iterCut++)
+		{
+			boolmapPredictor.reset();
+			for (const int recordIndex : manifest.findRecordsInCut(iterCut))
+			{
+				const TileManifest::Record &record{ manifest.readRecord(recordIndex) };
+				const TiffU8 stack{ g_imagingFolderPath, std::filesystem::path{ record.mFilename }.replace_extension().string() };
+				if (stack.readNframes() != nFrames || stack.readHeightPerFrame_pix() != tileSize_pix.ii || stack.readWidthPerFrame_pix() != tileSize_pix.jj)
+					throw std::runtime_error((std::string)__FUNCTION__ + ": The size of the stack " + record.mFilename + " does not match the parameters");
+				boolmapPredictor.addStack(stack.data(), SCANDIR::UPWARD, record.mTileIndicesIJ);
+			}
+			if (boolmapPredictor.readNumberOfObservedStacks() == 0)
+				continue;
+
+			//The boolmap of the next cut is the union of the boolmaps of its panoramic scans, saved as "Boolmap_XXX", "Boolmap_XXX (1)", ...
+			const std::string nextCutNumberPadded{ Util::zeroPadding(iterCut + 1, 3) };
+			TileBitmap measuredBoolmap{ tileArraySizeIJ };
+			std::string filename{ "Boolmap_" + nextCutNumberPadded };
+			for (int iterFile = 1; std::filesystem::exists(g_imagingFolderPath + filename + ".txt"); iterFile++)
+			{
+				measuredBoolmap |= TileBitmap::loadFromText(g_imagingFolderPath, filename, tileArraySizeIJ);
+				filename = "Boolmap_" + nextCutNumberPadded + " (" + std::to_string(iterFile) + ")";
+			}
+			if (filename == "Boolmap_" + nextCutNumberPadded)
+			{
+				std::cout << "Cut " << iterCut + 1 << ": no recorded boolmap\n";
+				continue;
+			}
+
+			const TileBitmap prediction{ boolmapPredictor.readPrediction() };
+			const int nMissed{ measuredBoolmap.countAndNot(prediction) };
+			const int nExtra{ prediction.countAndNot(measuredBoolmap) };
+			std::cout << "Cut " << iterCut + 1 << ":\tstacks = " << boolmapPredictor.readNumberOfObservedStacks() <<
+				"\tpredicted = " << prediction.count() << "\tmeasured = " << measuredBoolmap.count() <<
+				"\tmissed = " << nMissed << "\textra = " << nExtra << "\n";
+			boolmapPredictor.savePredictionToText(g_imagingFolderPath, "BoolmapPredicted_" + nextCutNumberPadded, OVERRIDE::EN);
+
+			nMissedTotal += nMissed;
+			nExtraTotal += nExtra;
+			nMeasuredTotal += measuredBoolmap.count();
+			nCutsPredicted++;
+		}
+
+		const int nPANskipped{ nCutsPredicted * (nPANperCut - (std::min)(nPANperCut, boolmapPrediction.mNverificationPAN)) };
+		std::cout << "Cuts predicted: " << nCutsPredicted << "\tmissed tiles: " << nMissedTotal << "/" << nMeasuredTotal << "\textra tiles: " << nExtraTotal << "\n";
+		std::cout << "Panoramic scans skipped: " << nPANskipped << "\tPAN time saved (estimated): " << nPANskipped * PANtime << " s\n";
+		Util::pressAnyKeyToCont();
+	}
+
 	void sequencerConcurrentTest()
 	{
 		class FUNC
@@ -1885,113 +2818,1032 @@ namespace TestRoutines
 		}//if
 	}
 
-	void PMT16Xconfig()
+	//Run the command list on mock devices, first one action after another, then concurrently with ActionExecutor, and then also pre-arming the control sequence during the moves. Compare the stacks per hour and the dead time per stack
+	//The mock devices count the conflicts between actions: moving, tuning, or arming during a scan, scanning at the wrong wavelength or without arming, and overwriting the RTseq buffer before it is demultiplexed
+	//Then make the acquisition of a stack fail, which must stop the sequence, cancel the demultiplexing and saving of that stack, and still save the previous stacks
+	void sequencerMockDevices()
 	{
-		PMT16X PMT;
-
-		//pmt.setSingleGain(PMT16XCHAN::CH00, 170);
-		//PMT.setAllGains(255);
-		//PMT.readTemp();
-		PMT.readAllGains();
-
-		//PMT.suppressGainsLinearly(0.4, RTseq::PMT16XCHAN::CH05, RTseq::PMT16XCHAN::CH10);
-
-		/*
-		//To make the count from all the channels similar,
-		//rescan with frequency = 100 Hz and amplitude = 1.5V (which is larger than the size of the PMT16X
-		//to use the linear part of the ramp). Set the refresh rate to 10 or 20 ms
-		PMT.setAllGain({
-			255,	//CH00
-			255,	//CH01
-			255,	//CH02
-			255,	//CH03
-			255,	//CH04
-			255,	//CH05
-			255,	//CH06
-			255,	//CH07
-			255,	//CH08
-			255,	//CH09
-			255,	//CH10
-			255,	//CH11
-			255,	//CH12
-			255,	//CH13
-			255,	//CH14
-			255		//CH15
-			});
-			*/
+		//Duration of the actions on the mock devices
+		const int moveDuration_ms{ 30 };			//Move the X and Y-stages and poll them
+		const int tuningDuration_ms{ 200 };			//Tune the laser and turn the filterwheels when switching wavelengths
+		const int armDuration_ms{ 50 };				//Build and upload the control sequence and preset the AOs
+		const int scanDuration_ms{ 150 };			//Scan the Z-stage and download the data
+		const int demuxDuration_ms{ 40 };			//Demultiplex the RTseq buffer
+		const int saveDuration_ms{ 100 };			//Bin the frames and write the tiff
+		const int cutDuration_ms{ 300 };
 
-		Util::pressAnyKeyToCont();
-	}
-
-	//Test reading different channels of the PMT16X
-	//Must manually open the laser and Uniblitz shutter
-	void PMT16Xdemultiplex(const FPGA &fpga)
-	{
+		//ACQUISITION SETTINGS
 		const double pixelSizeXY{ 0.5 * um };
 		const int heightPerFrame_pix{ 560 };
 		const int widthPerFrame_pix{ 300 };
-		const int nFramesCont{ 1 };										//Number of frames for continuous acquisition
-		const double FFOVslow{ heightPerFrame_pix * pixelSizeXY };		//Scan duration in the slow axis
-		const int wavelength_nm{ 750 };
-		const double laserPower{ 30. * mW };
-
-		//CREATE THE CONTROL SEQUENCE
-		RTseq realtimeSeq{ fpga, LINECLOCK::FG, FIFOOUTfpga::EN, heightPerFrame_pix, widthPerFrame_pix, nFramesCont, g_multibeam };
-		Mesoscope mesoscope{ realtimeSeq, Laser::ID::VISION };
-		mesoscope.configure(wavelength_nm);
-		mesoscope.setPower(laserPower);
-
-		//SCANNERS
-		Galvo scanner{ realtimeSeq, FFOVslow / 2. };
-		Galvo rescanner{ realtimeSeq, FFOVslow / 2., mesoscope.readCurrentLaser(), mesoscope.readCurrentWavelength_nm() };
-		//Galvo scanner{ realtimeSeq, 0 };				//Keep the scanner fixed to see the emitted light swing across the PMT16X channels. The rescanner must be centered
-
-		//EXECUTE THE CONTROL SEQUENCE
-		realtimeSeq.run();
-		Image image{ realtimeSeq };
-		image.acquire();
-		image.save(g_imagingFolderPath, "SingleChannel", TIFFSTRUCT::MULTIPAGE, OVERRIDE::EN);
-	}
+		const FFOV2 FFOV{ heightPerFrame_pix * pixelSizeXY, widthPerFrame_pix * pixelSizeXY };
+		const int nFramesCont{ 100 };											//Number of frames for continuous acquisition. If too big, the FPGA FIFO will overflow and the data transfer will fail
+		const double pixelSizeZ{ 0.5 * um };									//Step size in the Z-stage axis
+		const TILEOVERLAP3 stackOverlap_frac{ 0.05, 0.05, 0.05 };				//Stack overlap
+		const double cutAboveBottomOfStack{ 15. * um };							//height to cut above the bottom of the stack
+		const double sampleLengthZ{ 0.01 * mm };								//Sample thickness
+		const double sampleSurfaceZ{ 18.471 * mm };
 
-	void vibratome(const FPGA &fpga)
-	{
-		const double cutPlaneZ{ (20.160) * mm };
+		//Small LOI to run the 3 modes on the mock devices in about a minute
+		Sample sample{ g_currentSample,  {g_stackCenterXYZ.XX, g_stackCenterXYZ.YY}, {1. * mm, 0.6 * mm, sampleLengthZ}, sampleSurfaceZ, cutAboveBottomOfStack };
+		Stack stack{ FFOV, heightPerFrame_pix, widthPerFrame_pix, pixelSizeZ, nFramesCont, stackOverlap_frac };
 
-		Stage stage{ 5. * mmps, 5. * mmps, 0.5 * mmps , ContainerPosLimit };
-		Vibratome vibratome{ fpga, stage };
-		vibratome.cutTissue(cutPlaneZ);
+		//Create a sequence
+		Sequencer sequence{ sample, stack };
+		sequence.generateCommandList();
+		sequence.printToFile(g_imagingFolderPath, "_CommandlistMock", OVERRIDE::EN);
 
-		const POSITION3 samplePosXYZ{ -54. * mm, 5. * mm, cutPlaneZ };
-		stage.moveXYZ(samplePosXYZ);
-	}
+		struct MockDevices
+		{
+			std::atomic<int> mWavelength_nm{ 0 };
+			std::atomic<bool> mScanning{ false };
+			std::atomic<bool> mBufferPending{ false };		//The RTseq buffer holds data not demultiplexed yet
+			std::atomic<int> mBufferStackIndex{ -1 };		//Stack whose data is in the RTseq buffer
+			std::atomic<int> mArmedStackIndex{ -1 };		//Stack whose control sequence is armed
+			std::atomic<int> mNconflicts{ 0 };
+			std::atomic<int> mNsaved{ 0 };
+			std::atomic<int> mLastSavedStackIndex{ -1 };
+			std::chrono::time_point<std::chrono::high_resolution_clock> mLastScanEndTime;
+			bool mIsDeadTimeMeasured{ false };
+			double mDeadTime{ 0 };
+			int mNdeadTimes{ 0 };
+		};
 
-	void filterwheel()
-	{
-		Filterwheel FWexcitation{ Filterwheel::ID::EXC };
-		Filterwheel FWdetection{ Filterwheel::ID::DET };
+		//Run the command list. Return the duration in seconds
+		auto runSequence = [&](MockDevices &devices, const bool runConcurrently, const bool preArm, const int failingStackIndex)
+		{
+			const auto startTime{ std::chrono::high_resolution_clock::now() };
+			ActionExecutor executor;
+			StackPipeline<ActionExecutor> pipeline{ executor, preArm };			//Same dependencies as in Routines::sequencer
+			int stackIndex{ -1 };
+			for (int iterCommandline = 0; iterCommandline < sequence.readNtotalCommands(); iterCommandline++)
+			{
+				const Sequencer::Commandline commandline{ sequence.readCommandline(iterCommandline) };
+				switch (commandline.mActionID)
+				{
+				case Action::ID::PAN:
+					break;
+				case Action::ID::MOV:
+					break;
+				case Action::ID::ACQ:
+				{
+					stackIndex++;
+					const int wavelength_nm{ commandline.mAction.acqStack.readWavelength_nm() };
+					pipeline.submitAcquisition(std::to_string(stackIndex), [&devices, tuningDuration_ms, wavelength_nm]
+					{
+						if (devices.mScanning)
+							devices.mNconflicts++;
+						if (devices.mWavelength_nm != wavelength_nm)
+							Sleep(tuningDuration_ms);
+						devices.mWavelength_nm = wavelength_nm;
+					},
+						[&devices, moveDuration_ms]
+					{
+						if (devices.mScanning)
+							devices.mNconflicts++;
+						Sleep(moveDuration_ms);
+					},
+						[&devices, armDuration_ms, stackIndex]
+					{
+						if (devices.mScanning || devices.mBufferPending)
+							devices.mNconflicts++;
+						Sleep(armDuration_ms);
+						devices.mArmedStackIndex = stackIndex;
+					},
+						[&devices, scanDuration_ms, wavelength_nm, stackIndex, failingStackIndex]
+					{
+						if (stackIndex == failingStackIndex)
+							throw std::runtime_error("Mock failure of the stack " + std::to_string(stackIndex));
+						if (devices.mWavelength_nm != wavelength_nm || devices.mArmedStackIndex != stackIndex || devices.mBufferPending)
+							devices.mNconflicts++;
+						if (devices.mIsDeadTimeMeasured)
+						{
+							devices.mDeadTime += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - devices.mLastScanEndTime).count();
+							devices.mNdeadTimes++;
+						}
+						devices.mScanning = true;
+						Sleep(scanDuration_ms);
+						devices.mScanning = false;
+						devices.mBufferStackIndex = stackIndex;
+						devices.mBufferPending = true;
+						devices.mLastScanEndTime = std::chrono::high_resolution_clock::now();
+						devices.mIsDeadTimeMeasured = true;
+					});
+				}
+				break;
+				case Action::ID::SAV:
+					pipeline.submitReadout(std::to_string(stackIndex), [&devices, demuxDuration_ms, stackIndex]
+					{
+						if (devices.mBufferStackIndex != stackIndex)
+							devices.mNconflicts++;
+						Sleep(demuxDuration_ms);
+						devices.mBufferPending = false;
+					});
 
-		int wavelength_nm;
-		if (1)
-			wavelength_nm = 920;
-		else
-			wavelength_nm = 750;
+					pipeline.submitSave(std::to_string(stackIndex), [&devices, saveDuration_ms, stackIndex]
+					{
+						Sleep(saveDuration_ms);
+						if (devices.mLastSavedStackIndex != stackIndex - 1)
+							devices.mNconflicts++;
+						devices.mLastSavedStackIndex = stackIndex;
+						devices.mNsaved++;
+					});
+					break;
+				case Action::ID::CUT:
+					executor.waitAll();
+					devices.mIsDeadTimeMeasured = false;
+					Sleep(cutDuration_ms);
+					break;
+				default:
+					throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected action invalid");
+				}//switch
+				if (!runConcurrently)
+					executor.waitAll();
+			}//for
+			executor.waitAll();
+			return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+		};
 
-		//FWexcitation.setWavelength(wavelengthIndex_s);
-		//FWdetection.setWavelength(wavelengthIndex_s);
+		const int nStacks{ sequence.readTotalNumberOfStacks() };
+		double serialTime{ 0 };
+		for (const int iterMode : { 0, 1, 2 })
+		{
+			const bool runConcurrently{ iterMode > 0 };
+			const bool preArm{ iterMode > 1 };
+			MockDevices devices;
+			const double time{ runSequence(devices, runConcurrently, preArm, -1) };
+			if (iterMode == 0)
+				serialTime = time;
+			std::cout << (runConcurrently ? (preArm ? "Concurrent and pre-armed:" : "Concurrent:\t\t") : "Serial:\t\t\t") << "\tstacks saved = " << devices.mNsaved << "/" << nStacks <<
+				"\tstacks per hour = " << 3600. * devices.mNsaved / time << "\tdead time per stack = " << 1000. * devices.mDeadTime / (std::max)(1, devices.mNdeadTimes) << " ms" <<
+				"\tspeedup = " << serialTime / time << "\tconflicts = " << devices.mNconflicts << "\n";
+		}
 
-		if (1)//Multibeam. Turn both filterwheels concurrently
+		//Failure of an acquisition in the middle of the sequence
+		const int failingStackIndex{ nStacks / 2 };
+		MockDevices failingDevices;
+		try
 		{
-			std::future<void> th1{ std::async(&Filterwheel::setWavelength, &FWexcitation, wavelength_nm) };
-			std::future<void> th2{ std::async(&Filterwheel::setWavelength, &FWdetection, wavelength_nm) };
-			th1.get();
-			th2.get();
+			runSequence(failingDevices, true, true, failingStackIndex);
+			std::cout << "FAILED: the failure was not propagated\n";
 		}
-		else//Singlebeam. Turn both filterwheels concurrently
+		catch (const std::runtime_error &e)
 		{
-			std::future<void> th1{ std::async(&Filterwheel::setWavelength, &FWexcitation, wavelength_nm) };	//Leave the excitation filterwheel open
-			std::future<void> th2{ std::async(&Filterwheel::setWavelength, &FWdetection, wavelength_nm) };
-			th1.get();
-			th2.get();
+			std::cout << "Failure propagated: " << e.what() << "\n";
+		}
+		std::cout << "Stacks saved before the failure = " << failingDevices.mNsaved << "/" << failingStackIndex << "\tlast stack saved = " << failingDevices.mLastSavedStackIndex << "\tconflicts = " << failingDevices.mNconflicts << "\n";
+	}
+
+	//Time the generation of the command list for a sample the size of the oil container, and the boolmap queries done while reading the commands
+	//The queries on a TileBitmap are compared with the previous std::vector<bool> passed by value
+	void commandListBenchmark()
+	{
+		const double pixelSizeXY{ 0.5 * um };
+		const int heightPerFrame_pix{ 560 };
+		const int widthPerFrame_pix{ 300 };
+		const FFOV2 FFOV{ heightPerFrame_pix * pixelSizeXY, widthPerFrame_pix * pixelSizeXY };
+		const int nFrames{ 100 };
+		const double pixelSizeZ{ 1.0 * um };
+		const TILEOVERLAP3 stackOverlap_frac{ 0.15, 0.10, 0.50 };
+		const double cutAboveBottomOfStack{ 30. * um };
+		const POSITION2 centerXY{ 0. * mm, 16. * mm };					//Center of the oil container
+		const LENGTH3 LOIxyz{ 60. * mm, 25. * mm, 10. * mm };			//Large sample in the oil container
+
+		const Sample containerSample{ g_currentSample.readName(), g_currentSample.readImmersionMedium(), g_currentSample.readObjectiveCollar(), ContainerPosLimit, g_currentSample.readFluorMarkerList() };
+		const Sample sample{ containerSample, centerXY, LOIxyz, g_stackCenterXYZ.ZZ, cutAboveBottomOfStack };
+		const Stack stack{ FFOV, heightPerFrame_pix, widthPerFrame_pix, pixelSizeZ, nFrames, stackOverlap_frac };
+
+		auto t_start{ std::chrono::high_resolution_clock::now() };
+		Sequencer sequence{ sample, stack };
+		sequence.generateCommandList();
+		const double generationTime{ std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t_start).count() };
+		const TILEDIM2 tileArraySizeIJ{ sequence.readTileArraySizeIJ() };
+		std::cout << "Tile array = " << tileArraySizeIJ.II << "x" << tileArraySizeIJ.JJ << "\tcuts = " << sequence.readTotalNumberOfCuts() <<
+			"\tcommands = " << sequence.readNtotalCommands() << "\tgenerated in " << generationTime << " ms\n";
+
+		//Elliptical sample with a hole in the middle
+		TileBitmap tileBitmap{ tileArraySizeIJ };
+		for (int II = 0; II < tileArraySizeIJ.II; II++)
+			for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
+			{
+				const double radius2{ std::pow(2. * II / tileArraySizeIJ.II - 1, 2) + std::pow(2. * JJ / tileArraySizeIJ.JJ - 1, 2) };
+				tileBitmap.set({ II, JJ }, radius2 < 0.8 && radius2 > 0.05);
+			}
+		std::vector<bool> vec_boolmap(tileArraySizeIJ.II * tileArraySizeIJ.JJ);
+		for (int II = 0; II < tileArraySizeIJ.II; II++)
+			for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
+				vec_boolmap.at(II * tileArraySizeIJ.JJ + JJ) = tileBitmap.test({ II, JJ });
+
+		//Same queries as in Routines::sequencer: test the tile on each MOV, ACQ, and SAV, and count the bright tiles on each ACQ
+		auto isBrightByValue = [](const std::vector<bool> vec_boolmap, const TILEDIM2 tileArraySizeIJ, const TILEIJ tileIndicesIJ) { return vec_boolmap.at(tileIndicesIJ.II * tileArraySizeIJ.JJ + tileIndicesIJ.JJ); };
+		auto countByValue = [](const std::vector<bool> vec_boolmap) { return static_cast<int>(std::count(vec_boolmap.begin(), vec_boolmap.end(), true)); };
+
+		int nBright{ 0 };
+		t_start = std::chrono::high_resolution_clock::now();
+		for (int iterCommandline = 0; iterCommandline < sequence.readNtotalCommands(); iterCommandline++)
+		{
+			const Sequencer::Commandline commandline{ sequence.readCommandline(iterCommandline) };
+			if (commandline.mActionID == Action::ID::MOV)
+			{
+				const TILEIJ tileIndicesIJ{ commandline.mAction.moveStage.readTileIndex(TileArray::Axis::II), commandline.mAction.moveStage.readTileIndex(TileArray::Axis::JJ) };
+				for (int iterQuery = 0; iterQuery < 3; iterQuery++)
+					nBright += isBrightByValue(vec_boolmap, tileArraySizeIJ, tileIndicesIJ);
+				nBright += countByValue(vec_boolmap) > 0;
+			}
+		}
+		const double vectorTime{ std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t_start).count() };
+
+		int nBrightBitmap{ 0 };
+		t_start = std::chrono::high_resolution_clock::now();
+		for (int iterCommandline = 0; iterCommandline < sequence.readNtotalCommands(); iterCommandline++)
+		{
+			const Sequencer::Commandline commandline{ sequence.readCommandline(iterCommandline) };
+			if (commandline.mActionID == Action::ID::MOV)
+			{
+				const TILEIJ tileIndicesIJ{ commandline.mAction.moveStage.readTileIndex(TileArray::Axis::II), commandline.mAction.moveStage.readTileIndex(TileArray::Axis::JJ) };
+				for (int iterQuery = 0; iterQuery < 3; iterQuery++)
+					nBrightBitmap += tileBitmap.test(tileIndicesIJ);
+				nBrightBitmap += tileBitmap.count() > 0;
+			}
+		}
+		const double bitmapTime{ std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t_start).count() };
+		std::cout << "Boolmap queries: std::vector<bool> by value = " << vectorTime << " ms\tTileBitmap = " << bitmapTime << " ms" << (nBright == nBrightBitmap ? "" : "\tMISMATCH") << "\n";
+
+		//Morphology
+		t_start = std::chrono::high_resolution_clock::now();
+		TileBitmap filled{ tileBitmap };
+		filled.fillHoles();
+		TileBitmap dilated{ filled };
+		dilated.dilate(2);
+		dilated.erode(2);
+		const double morphologyTime{ std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - t_start).count() };
+		std::cout << "Bright tiles = " << tileBitmap.count() << "\tafter filling the holes = " << filled.count() << "\tafter closing = " << dilated.count() <<
+			"\tmorphology in " << morphologyTime << " us\n";
+
+		Util::pressAnyKeyToCont();
+	}
+
+	//Check the TileBitmap operators against a brute-force reference on pseudo-random maps of several sizes and densities. Throw on the first mismatch
+	void tileBitmapBruteForce()
+	{
+		U32 seed{ 12345 };
+		auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return seed >> 8; };		//Linear congruential generator, so that the maps are the same in every run
+
+		const std::vector<TILEDIM2> arraySizes{ { 1, 1 }, { 1, 70 }, { 70, 1 }, { 5, 63 }, { 7, 64 }, { 9, 65 }, { 33, 130 }, { 64, 200 } };
+		const std::vector<int> densities_percent{ 2, 20, 60, 95 };
+		const std::vector<int> margins_tiles{ 0, 1, 3 };
+		int nChecks{ 0 };
+		for (const TILEDIM2 &tileArraySizeIJ : arraySizes)
+			for (const int density_percent : densities_percent)
+				for (int iterMap = 0; iterMap < 5; iterMap++)
+				{
+					const int nII{ tileArraySizeIJ.II };
+					const int nJJ{ tileArraySizeIJ.JJ };
+					TileBitmap tileBitmap{ tileArraySizeIJ };
+					TileBitmap other{ tileArraySizeIJ };
+					std::vector<bool> reference(nII * nJJ), otherReference(nII * nJJ);
+					for (int iterTile = 0; iterTile < nII * nJJ; iterTile++)
+					{
+						reference.at(iterTile) = static_cast<int>(random() % 100) < density_percent;
+						otherReference.at(iterTile) = static_cast<int>(random() % 100) < density_percent;
+						tileBitmap.set({ iterTile / nJJ, iterTile % nJJ }, reference.at(iterTile));
+						other.set({ iterTile / nJJ, iterTile % nJJ }, otherReference.at(iterTile));
+					}
+
+					const std::string mapName{ std::to_string(nII) + "x" + std::to_string(nJJ) + " map with density " + std::to_string(density_percent) + "%" };
+					auto isEqual = [&](const TileBitmap &result, const std::vector<bool> &expected)
+					{
+						nChecks++;
+						for (int iterTile = 0; iterTile < nII * nJJ; iterTile++)
+							if (result.test({ iterTile / nJJ, iterTile % nJJ }) != expected.at(iterTile))
+								return false;
+						return result.count() == static_cast<int>(std::count(expected.begin(), expected.end(), true));
+					};
+
+					//Union, intersection, and countAndNot
+					std::vector<bool> expected(nII * nJJ);
+					int nAndNot{ 0 };
+					for (int iterTile = 0; iterTile < nII * nJJ; iterTile++)
+					{
+						expected.at(iterTile) = reference.at(iterTile) || otherReference.at(iterTile);
+						nAndNot += reference.at(iterTile) && !otherReference.at(iterTile);
+					}
+					TileBitmap result{ tileBitmap };
+					result |= other;
+					if (!isEqual(result, expected))
+						throw std::runtime_error((std::string)__FUNCTION__ + ": The union differs from the brute force on a " + mapName);
+
+					for (int iterTile = 0; iterTile < nII * nJJ; iterTile++)
+						expected.at(iterTile) = reference.at(iterTile) && otherReference.at(iterTile);
+					result = tileBitmap;
+					result &= other;
+					if (!isEqual(result, expected))
+						throw std::runtime_error((std::string)__FUNCTION__ + ": The intersection differs from the brute force on a " + mapName);
+
+					if (tileBitmap.countAndNot(other) != nAndNot)
+						throw std::runtime_error((std::string)__FUNCTION__ + ": countAndNot differs from the brute force on a " + mapName);
+
+					//Dilation and erosion with a square structuring element. The tiles outside the array count as dark
+					for (const int margin_tiles : margins_tiles)
+						for (const bool isDilation : { true, false })
+						{
+							for (int II = 0; II < nII; II++)
+								for (int JJ = 0; JJ < nJJ; JJ++)
+								{
+									bool isBright{ !isDilation };
+									for (int iterII = II - margin_tiles; iterII <= II + margin_tiles; iterII++)
+										for (int iterJJ = JJ - margin_tiles; iterJJ <= JJ + margin_tiles; iterJJ++)
+										{
+											const bool isInside{ iterII >= 0 && iterII < nII && iterJJ >= 0 && iterJJ < nJJ };
+											const bool neighbor{ isInside && reference.at(iterII * nJJ + iterJJ) };
+											isBright = isDilation ? isBright || neighbor : isBright && neighbor;
+										}
+									expected.at(II * nJJ + JJ) = isBright;
+								}
+							result = tileBitmap;
+							if (isDilation)
+								result.dilate(margin_tiles);
+							else
+								result.erode(margin_tiles);
+							if (!isEqual(result, expected))
+								throw std::runtime_error((std::string)__FUNCTION__ + ": The " + (isDilation ? "dilation" : "erosion") + " by " + std::to_string(margin_tiles) + " tiles differs from the brute force on a " + mapName);
+						}
+
+					//Hole filling: a tile is bright if it lies within the span of the bright tiles of its row and of its column. An array of a single row (column) only has row (column) spans
+					for (int II = 0; II < nII; II++)
+						for (int JJ = 0; JJ < nJJ; JJ++)
+						{
+							int rowFirst{ nJJ }, rowLast{ -1 }, colFirst{ nII }, colLast{ -1 };
+							for (int iterJJ = 0; iterJJ < nJJ; iterJJ++)
+								if (reference.at(II * nJJ + iterJJ))
+								{
+									rowFirst = (std::min)(rowFirst, iterJJ);
+									rowLast = iterJJ;
+								}
+							for (int iterII = 0; iterII < nII; iterII++)
+								if (reference.at(iterII * nJJ + JJ))
+								{
+									colFirst = (std::min)(colFirst, iterII);
+									colLast = iterII;
+								}
+							const bool isInRowSpan{ JJ >= rowFirst && JJ <= rowLast };
+							const bool isInColumnSpan{ II >= colFirst && II <= colLast };
+							if (nII == 1)
+								expected.at(II * nJJ + JJ) = isInRowSpan;
+							else if (nJJ == 1)
+								expected.at(II * nJJ + JJ) = isInColumnSpan;
+							else
+								expected.at(II * nJJ + JJ) = isInRowSpan && isInColumnSpan;
+						}
+					result = tileBitmap;
+					result.fillHoles();
+					if (!isEqual(result, expected))
+						throw std::runtime_error((std::string)__FUNCTION__ + ": The hole filling differs from the brute force on a " + mapName);
+				}
+		std::cout << "TileBitmap matches the brute force in " << nChecks << " checks\n";
+
+		Util::pressAnyKeyToCont();
+	}
+
+	//Compare the stage travel time of the current (snake) path and the planned path on synthetic boolmaps
+	void tilePathPlanner()
+	{
+		const double pixelSizeXY{ 0.5 * um };
+		const int heightPerFrame_pix{ 560 };
+		const int widthPerFrame_pix{ 300 };
+		const FFOV2 FFOV{ heightPerFrame_pix * pixelSizeXY, widthPerFrame_pix * pixelSizeXY };
+		const int nFrames{ 100 };
+		const double pixelSizeZ{ 1.0 * um };
+		const TILEOVERLAP3 stackOverlap_frac{ 0.15, 0.10, 0.50 };
+		const LENGTH3 LOIxyz{ 10.000 * mm, 8.000 * mm, 0.100 * mm };	//Same as in Routines::sequencer, but a single cut
+		const double cutAboveBottomOfStack{ 30. * um };
+
+		const Sample sample{ g_currentSample, {g_stackCenterXYZ.XX, g_stackCenterXYZ.YY}, LOIxyz, g_stackCenterXYZ.ZZ, cutAboveBottomOfStack };
+		const Stack stack{ FFOV, heightPerFrame_pix, widthPerFrame_pix, pixelSizeZ, nFrames, stackOverlap_frac };
+		const TilePathPlanner tilePathPlanner{ FFOV, stackOverlap_frac };
+
+		const std::vector<std::string> shapes{ "Full", "Ellipse with a hole", "Two lobes" };
+		for (const std::string &shape : shapes)
+		{
+			Sequencer sequence{ sample, stack };
+			sequence.generateCommandList();
+			const TILEDIM2 tileArraySizeIJ{ sequence.readTileArraySizeIJ() };
+
+			TileBitmap tileBitmap{ tileArraySizeIJ };
+			for (int II = 0; II < tileArraySizeIJ.II; II++)
+				for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
+				{
+					const double x{ 2. * II / tileArraySizeIJ.II - 1 };
+					const double y{ 2. * JJ / tileArraySizeIJ.JJ - 1 };
+					const double radius2{ x * x + y * y };
+					if (shape == "Full")
+						tileBitmap.set({ II, JJ });
+					else if (shape == "Ellipse with a hole")
+						tileBitmap.set({ II, JJ }, radius2 < 0.8 && radius2 > 0.05);
+					else
+						tileBitmap.set({ II, JJ }, std::pow(x + 0.5, 2) + std::pow(y + 0.4, 2) < 0.15 || std::pow(x - 0.4, 2) + std::pow(y - 0.5, 2) < 0.2);
+				}
+
+			//The tile commands of the cut start at its first MOV, after the panoramic scans
+			const int firstCommandIndex{ sequence.findCommand(Action::ID::MOV) };
+			std::vector<TILEIJ> brightTilePath;
+			for (const TILEIJ &tileIJ : sequence.readTilePath(firstCommandIndex))
+				if (tileBitmap.test(tileIJ))
+					brightTilePath.push_back(tileIJ);
+
+			const auto t_start{ std::chrono::high_resolution_clock::now() };
+			const std::vector<TILEIJ> plannedTilePath{ tilePathPlanner.planPath(brightTilePath) };
+			const double planningTime{ std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t_start).count() };
+
+			sequence.reorderTilePath(firstCommandIndex, plannedTilePath);
+			const std::vector<TILEIJ> reorderedTilePath{ sequence.readTilePath(firstCommandIndex) };
+			const bool isReordered{ std::equal(reorderedTilePath.begin(), reorderedTilePath.end(), plannedTilePath.begin(), plannedTilePath.end(),
+				[](const TILEIJ &a, const TILEIJ &b) { return a.II == b.II && a.JJ == b.JJ; }) };
+
+			std::cout << shape << ": tile array = " << tileArraySizeIJ.II << "x" << tileArraySizeIJ.JJ << "\tbright tiles = " << brightTilePath.size() <<
+				"\tcommands = " << sequence.readNtotalCommands() << "\tplanned in " << planningTime << " ms" << (isReordered ? "" : "\tREORDERING FAILED") << "\n";
+			std::cout << "\tTravel time (predicted/simulated): current path = " << tilePathPlanner.predictPathTime(brightTilePath) / seconds << "/" << tilePathPlanner.simulatePathTime(brightTilePath) / seconds <<
+				" s\tplanned path = " << tilePathPlanner.predictPathTime(plannedTilePath) / seconds << "/" << tilePathPlanner.simulatePathTime(plannedTilePath) / seconds << " s\n";
+		}
+		Util::pressAnyKeyToCont();
+	}
+
+	//Compare the planned tile path with the optimal path found by trying all the orders of small sets of tiles. The first tile is kept in place, as in TilePathPlanner::planPath
+	//Throw if the planned path is not a reordering of the input, if it is predicted to be slower than the input, or if it is more than maxAllowedRatio times slower than the optimal path
+	void tilePathPlannerBruteForce()
+	{
+		const double pixelSizeXY{ 0.5 * um };
+		const FFOV2 FFOV{ 560 * pixelSizeXY, 300 * pixelSizeXY };
+		const TILEOVERLAP3 stackOverlap_frac{ 0.15, 0.10, 0.50 };
+		const TilePathPlanner tilePathPlanner{ FFOV, stackOverlap_frac };
+		const int nSets{ 50 };
+		const int nTiles{ 8 };
+		const TILEDIM2 tileArraySizeIJ{ 12, 12 };
+		const double maxAllowedRatio{ 1.10 };
+
+		U32 seed{ 6789 };
+		auto random = [&seed]() { seed = seed * 1664525u + 1013904223u; return seed >> 8; };		//Linear congruential generator, so that the sets are the same in every run
+		auto isSameTile = [](const TILEIJ &a, const TILEIJ &b) { return a.II == b.II && a.JJ == b.JJ; };
+		auto isLess = [](const TILEIJ &a, const TILEIJ &b) { return a.II < b.II || (a.II == b.II && a.JJ < b.JJ); };
+
+		double sumRatio{ 0 }, maxRatio{ 0 };
+		int nOptimal{ 0 };
+		for (int iterSet = 0; iterSet < nSets; iterSet++)
+		{
+			//Distinct random tiles
+			std::vector<TILEIJ> tilePath;
+			while (static_cast<int>(tilePath.size()) < nTiles)
+			{
+				const TILEIJ tileIJ{ static_cast<int>(random() % tileArraySizeIJ.II), static_cast<int>(random() % tileArraySizeIJ.JJ) };
+				if (std::none_of(tilePath.begin(), tilePath.end(), [&](const TILEIJ &other) { return isSameTile(tileIJ, other); }))
+					tilePath.push_back(tileIJ);
+			}
+
+			const std::vector<TILEIJ> plannedPath{ tilePathPlanner.planPath(tilePath) };
+
+			//The planned path must start at the same tile and visit every tile once
+			std::vector<TILEIJ> sortedInput{ tilePath }, sortedPlanned{ plannedPath };
+			std::sort(sortedInput.begin(), sortedInput.end(), isLess);
+			std::sort(sortedPlanned.begin(), sortedPlanned.end(), isLess);
+			if (plannedPath.empty() || !isSameTile(plannedPath.front(), tilePath.front()) ||
+				!std::equal(sortedInput.begin(), sortedInput.end(), sortedPlanned.begin(), sortedPlanned.end(), isSameTile))
+				throw std::runtime_error((std::string)__FUNCTION__ + ": The planned path is not a reordering of the input path that starts at the same tile");
+
+			const double plannedTime{ tilePathPlanner.predictPathTime(plannedPath) };
+			if (plannedTime > tilePathPlanner.predictPathTime(tilePath))
+				throw std::runtime_error((std::string)__FUNCTION__ + ": The planned path is slower than the input path");
+
+			//Brute force over the orders of the tiles after the first one
+			std::vector<TILEIJ> permutation{ tilePath };
+			std::sort(permutation.begin() + 1, permutation.end(), isLess);
+			double optimalTime{ plannedTime };
+			do
+				optimalTime = (std::min)(optimalTime, tilePathPlanner.predictPathTime(permutation));
+			while (std::next_permutation(permutation.begin() + 1, permutation.end(), isLess));
+
+			const double ratio{ plannedTime / optimalTime };
+			if (ratio > maxAllowedRatio)
+				throw std::runtime_error((std::string)__FUNCTION__ + ": The planned path is " + Util::toString(ratio, 3) + " times slower than the optimal path");
+			sumRatio += ratio;
+			maxRatio = (std::max)(maxRatio, ratio);
+			nOptimal += ratio < 1. + 1e-9;
+		}
+		std::cout << "Planned/optimal travel time over " << nSets << " sets of " << nTiles << " tiles: mean = " << sumRatio / nSets << "\tmax = " << maxRatio << "\toptimal in " << nOptimal << "/" << nSets << " sets\n";
+
+		Util::pressAnyKeyToCont();
+	}
+
+	//Compare the idle time for switching wavelengths with the order of the sample and with the scheduled order, with and without the panoramic scans at 1040 nm before each cut
+	void wavelengthScheduler()
+	{
+		const int nCuts{ 20 };
+		const int PANwavelength_nm{ 1040 };
+		const WavelengthScheduler wavelengthScheduler{ g_multibeam };
+
+		std::vector<int> sampleOrder_nm;
+		for (std::vector<int>::size_type iterFluorMarker = 0; iterFluorMarker < g_currentSample.readFluorMarkerListSize(); iterFluorMarker++)
+			sampleOrder_nm.push_back(g_currentSample.readFluorMarker(static_cast<int>(iterFluorMarker)).mWavelength_nm);
+
+		for (const bool isPANrun : { true, false })
+		{
+			WavelengthScheduler::LaserState fixedState{ PANwavelength_nm, PANwavelength_nm };
+			WavelengthScheduler::LaserState scheduledState{ fixedState };
+			double fixedIdleTime{ 0 }, scheduledIdleTime{ 0 };
+			std::cout << (isPANrun ? "With" : "Without") << " the panoramic scans. Scheduled orders:";
+			for (int iterCut = 0; iterCut < nCuts; iterCut++)
+			{
+				//Tuning for the panoramic scan overlaps with the vibratome cut in the schedule
+				if (isPANrun)
+				{
+					fixedIdleTime += wavelengthScheduler.determineSwitchingTime(fixedState, PANwavelength_nm);
+					wavelengthScheduler.determineSwitchingTime(scheduledState, PANwavelength_nm);
+				}
+				for (const int wavelength_nm : sampleOrder_nm)
+					fixedIdleTime += wavelengthScheduler.determineSwitchingTime(fixedState, wavelength_nm);
+
+				const std::vector<int> scheduledOrder_nm{ wavelengthScheduler.planOrder(scheduledState, sampleOrder_nm) };
+				for (const int wavelength_nm : scheduledOrder_nm)
+					scheduledIdleTime += wavelengthScheduler.determineSwitchingTime(scheduledState, wavelength_nm);
+
+				if (iterCut < 4)
+				{
+					std::cout << " (";
+					for (std::vector<int>::size_type iter = 0; iter < scheduledOrder_nm.size(); iter++)
+						std::cout << (iter ? "," : "") << scheduledOrder_nm.at(iter);
+					std::cout << ")";
+				}
+			}
+			std::cout << "...\n\tIdle time over " << nCuts << " cuts: order of the sample = " << fixedIdleTime / seconds << " s\tscheduled = " << scheduledIdleTime / seconds <<
+				" s\tsaved = " << (fixedIdleTime - scheduledIdleTime) / seconds << " s\n";
+		}
+
+		//Reorder the wavelengths of the first cut in a command list
+		const Sample sample{ g_currentSample, {g_stackCenterXYZ.XX, g_stackCenterXYZ.YY}, { 1. * mm, 1. * mm, 0.1 * mm }, g_stackCenterXYZ.ZZ, 30. * um };
+		const Stack stack{ { 280. * um, 150. * um }, 560, 300, 1.0 * um, 100, { 0.15, 0.10, 0.50 } };
+		Sequencer sequence{ sample, stack };
+		sequence.generateCommandList();
+		const int firstCommandIndex{ sequence.findCommand(Action::ID::MOV) };		//The tile commands of the cut start at its first MOV, after the panoramic scans
+		std::vector<int> reversedOrder_nm{ sequence.readWavelengthOrder(firstCommandIndex) };
+		std::reverse(reversedOrder_nm.begin(), reversedOrder_nm.end());
+		sequence.reorderWavelengths(firstCommandIndex, reversedOrder_nm);
+		std::cout << "Command list reordered: " << (sequence.readWavelengthOrder(firstCommandIndex) == reversedOrder_nm ? "OK" : "FAILED") << "\n";
+
+		Util::pressAnyKeyToCont();
+	}
+
+	//Predict the duration of a sequence for different stack overlaps, binnings, and wavelength orders. Only the model is run, no device is touched
+	void sequenceTimeModel()
+	{
+		const FFOV2 FFOV{ 280. * um, 150. * um };
+		const LENGTH3 LOIxyz{ 5.000 * mm, 5.000 * mm, 0.300 * mm };
+		const double cutAboveBottomOfStack{ 30. * um };
+
+		std::vector<FluorMarkerList::FluorMarker> fluorMarkers;
+		for (std::vector<int>::size_type iterFluorMarker = 0; iterFluorMarker < g_currentSample.readFluorMarkerListSize(); iterFluorMarker++)
+			fluorMarkers.push_back(g_currentSample.readFluorMarker(static_cast<int>(iterFluorMarker)));
+
+		//Create a sample like the current one but with the binning of all the fluorescent markers set to nFramesBinning
+		auto createSample = [&](const int nFramesBinning)
+		{
+			std::vector<FluorMarkerList::FluorMarker> binnedFluorMarkers{ fluorMarkers };
+			for (FluorMarkerList::FluorMarker &fluorMarker : binnedFluorMarkers)
+				fluorMarker.nFramesBinning = nFramesBinning;
+			const Sample sample{ g_currentSample.readName(), g_currentSample.readImmersionMedium(), g_currentSample.readObjectiveCollar(), g_currentSample.readStageSoftPosLimXYZ(), FluorMarkerList{ binnedFluorMarkers } };
+			return Sample{ sample, {g_stackCenterXYZ.XX, g_stackCenterXYZ.YY}, LOIxyz, g_stackCenterXYZ.ZZ, cutAboveBottomOfStack };
+		};
+
+		std::cout << "Overlap (I,J,K)\tBinning\tOrder\t\tStacks\tSerial (h)\tPredicted (h)\n";
+		for (const TILEOVERLAP3 stackOverlap_frac : { TILEOVERLAP3{ 0.15, 0.10, 0.50 }, TILEOVERLAP3{ 0.05, 0.05, 0.20 } })
+			for (const int nFramesBinning : { 1, 2 })
+				for (const bool isReversed : { false, true })
+				{
+					const Sample sample{ createSample(nFramesBinning) };
+					const Stack stack{ FFOV, 560, 300, 1.0 * um, 100, stackOverlap_frac };
+					Sequencer sequence{ sample, stack };
+					sequence.generateCommandList();
+
+					//Reverse the wavelengths of the first cut
+					if (isReversed)
+					{
+						const int firstCommandIndex{ sequence.findCommand(Action::ID::MOV) };		//The tile commands of the cut start at its first MOV, after the panoramic scans
+						std::vector<int> reversedOrder_nm{ sequence.readWavelengthOrder(firstCommandIndex) };
+						std::reverse(reversedOrder_nm.begin(), reversedOrder_nm.end());
+						sequence.reorderWavelengths(firstCommandIndex, reversedOrder_nm);
+					}
+
+					const SequenceTimeModel timeModel{ stack, g_multibeam };
+					const SequenceTimeModel::Prediction prediction{ timeModel.predict(sequence) };
+					std::cout << "(" << stackOverlap_frac.II << "," << stackOverlap_frac.JJ << "," << stackOverlap_frac.KK << ")\t" << nFramesBinning << "\t" << (isReversed ? "Reversed" : "Sample") << "\t\t" <<
+						prediction.mNstacks << "\t" << Util::toString(prediction.readSerialTime() / (3600. * seconds), 2) << "\t\t" << Util::toString(prediction.readWallTime() / (3600. * seconds), 2) << "\n";
+				}
+
+		//Calibrate the model with a synthetic action log where the stack acquisition lasts 20% longer than modeled. The log is written to a temporary folder, so that the action logs of the sequences are not touched
+		const std::string folderPath{ g_imagingFolderPath + "TimeModelTest\\" };
+		const std::string logFilename{ "TimeModelCalibrationTest" };
+		std::filesystem::create_directories(folderPath);
+		{
+			Logger datalog(folderPath, logFilename, OVERRIDE::EN);
+			datalog.record("#Action\tModeled (ms)\tMeasured (ms)");
+			for (int iterStack = 0; iterStack < 10; iterStack++)
+			{
+				datalog.record("ACQ\t1000.0\t1200.0");
+				datalog.record("MOV\t300.0\t300.0");
+			}
+		}
+		SequenceTimeModel timeModel{ Stack{ FFOV, 560, 300, 1.0 * um, 100, { 0.15, 0.10, 0.50 } }, g_multibeam };
+		timeModel.calibrate(folderPath, logFilename);
+		std::filesystem::remove_all(folderPath);
+		std::cout << "Calibration: ACQ = " << timeModel.readCalibrationFactor(SequenceTimeModel::COST::ACQ) << " (expected 1.2)\tMOV = " << timeModel.readCalibrationFactor(SequenceTimeModel::COST::MOV) <<
+			" (expected 1)\tCUT = " << timeModel.readCalibrationFactor(SequenceTimeModel::COST::CUT) << " (expected 1)\n";
+
+		Util::pressAnyKeyToCont();
+	}
+
+	//Compare the policies of Routines::sequencer on the same synthetic sample, in virtual time. No device is touched
+	void sequenceSimulator()
+	{
+		const FFOV2 FFOV{ 280. * um, 150. * um };
+		const LENGTH3 LOIxyz{ 5.000 * mm, 5.000 * mm, 0.300 * mm };
+		const Sample sample{ g_currentSample, {g_stackCenterXYZ.XX, g_stackCenterXYZ.YY}, LOIxyz, g_stackCenterXYZ.ZZ, 30. * um };
+		const Stack stack{ FFOV, 560, 300, 1.0 * um, 100, { 0.15, 0.10, 0.50 } };
+
+		std::vector<SimulationPolicy> policies(5);
+		policies.at(0) = { "Serial", false, false, false, false };
+		policies.at(1) = { "Concurrent", true, false, false, false };
+		policies.at(2) = { "Concurrent and pre-armed", true, true, false, false };
+		policies.at(3) = { "+ planned tile path", true, true, true, false };
+		policies.at(4) = { "+ scheduled wavelengths", true, true, true, true };
+
+		std::cout << std::left << std::setw(32) << "Policy" << "Duration (h)\tStacks per hour\tStages busy\tStages on the critical path\tSimulated in (s)\n";
+		for (const SimulationPolicy &policy : policies)
+		{
+			Sequencer sequence{ sample, stack };
+			sequence.generateCommandList();
+
+			//Synthetic sample: an ellipse with a hole. The same in all the cuts
+			const TILEDIM2 tileArraySizeIJ{ sequence.readTileArraySizeIJ() };
+			TileBitmap tileBitmap{ tileArraySizeIJ };
+			for (int II = 0; II < tileArraySizeIJ.II; II++)
+				for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
+				{
+					const double x{ 2. * II / tileArraySizeIJ.II - 1 };
+					const double y{ 2. * JJ / tileArraySizeIJ.JJ - 1 };
+					tileBitmap.set({ II, JJ }, x * x + y * y < 0.8 && x * x + y * y > 0.05);
+				}
+
+			SequenceSimulator simulator{ stack, g_multibeam, policy };
+			const SequenceSimulator::Report report{ simulator.simulate(sequence, tileBitmap) };
+			const double hour{ 3600. * seconds };
+			std::cout << std::left << std::setw(32) << policy.mName << Util::toString(report.mMakespan / hour, 2) << "\t\t" <<
+				Util::toString(report.mNstacks / (report.mMakespan / hour), 0) << "\t\t" << Util::toString(100. * report.readUtilization(SequenceSimulator::DEVICE::STAGES), 1) << " %\t\t" <<
+				Util::toString(100. * report.mCriticalPathTime.at(static_cast<int>(SequenceSimulator::DEVICE::STAGES)) / report.mMakespan, 1) << " %\t\t\t\t" << Util::toString(report.mSimulationTime / seconds, 2) << "\n";
+			if (&policy == &policies.back())
+				simulator.printReport(report);
+		}
+
+		Util::pressAnyKeyToCont();
+	}
+
+	//Run a command list without devices, journaling the actions like Routines::sequencer, and interrupt it. Resume from the journal after tearing its last record
+	//and after cutting the last stack short, and check that the resumed runs end like an uninterrupted one. Check that a completed run and the journal of another sample are not resumed
+	void sequenceJournal()
+	{
+		const std::string folderPath{ g_imagingFolderPath + "JournalTest\\" };
+		const std::string journalName{ "_SequenceJournal" };
+		const SCANDIR scanDirZini{ SCANDIR::UPWARD };
+		const Sample sample{ g_currentSample, {g_stackCenterXYZ.XX, g_stackCenterXYZ.YY}, { 1.5 * mm, 1.5 * mm, 0.2 * mm }, g_stackCenterXYZ.ZZ, 30. * um };
+		const Stack stack{ { 280. * um, 150. * um }, 560, 300, 1.0 * um, 100, { 0.15, 0.10, 0.50 } };
+		const TilePathPlanner tilePathPlanner{ { 280. * um, 150. * um }, { 0.15, 0.10, 0.50 } };
+		const WavelengthScheduler wavelengthScheduler{ g_multibeam };
+
+		//Synthetic sample: the panoramic scans find a disk
+		auto setBrightTiles = [](TileBitmap &tileBitmap)
+		{
+			const TILEDIM2 tileArraySizeIJ{ tileBitmap.readTileArraySizeIJ() };
+			for (int II = 0; II < tileArraySizeIJ.II; II++)
+				for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
+					if (std::pow(2. * II / tileArraySizeIJ.II - 1, 2) + std::pow(2. * JJ / tileArraySizeIJ.JJ - 1, 2) < 0.7)
+						tileBitmap.set({ II, JJ });
+		};
+
+		//Same bookkeeping and dependencies as Routines::sequencer. The stacks are small Tiffs saved on the disk worker. Stop after the first stack saved from the command stopCommandIndex on, the last point the journal knows of, and return the state at that point
+		auto runSequence = [&](Sequencer &sequence, SequenceJournal &journal, TileManifest &tileManifest, const SequenceJournal::ResumeState &initialState, const int stopCommandIndex)
+		{
+			SequenceJournal::ResumeState state{ initialState };
+			ActionExecutor executor;
+			StackPipeline<ActionExecutor> pipeline{ executor, true };
+			WavelengthScheduler::LaserState laserState{ 1040, 1040 };
+			int wavelength_nm{ 0 };
+			TILEIJ tileIJ{ 0, 0 };
+			for (state.mNextCommandIndex = initialState.mNextCommandIndex; state.mNextCommandIndex < sequence.readNtotalCommands(); state.mNextCommandIndex++)
+			{
+				const int iterCommandline{ state.mNextCommandIndex };
+				Sequencer::Commandline commandline{ sequence.readCommandline(iterCommandline) };
+				if (!state.mIsCutPlanned && commandline.mActionID == Action::ID::MOV)
+				{
+					state.mIsCutPlanned = true;
+					std::vector<TILEIJ> brightTilePath;
+					for (const TILEIJ &pathTileIJ : sequence.readTilePath(iterCommandline))
+						if (state.mTileBitmap.test(pathTileIJ))
+							brightTilePath.push_back(pathTileIJ);
+					const std::vector<TILEIJ> plannedTilePath{ tilePathPlanner.planPath(brightTilePath) };
+					sequence.reorderTilePath(iterCommandline, plannedTilePath);
+					const bool isWavelengthScheduled{ iterCommandline < sequence.readNtotalCommands() && sequence.readCommandline(iterCommandline).mActionID == Action::ID::MOV };
+					std::vector<int> scheduledOrder_nm;
+					if (isWavelengthScheduled)
+					{
+						scheduledOrder_nm = wavelengthScheduler.planOrder(laserState, sequence.readWavelengthOrder(iterCommandline));
+						sequence.reorderWavelengths(iterCommandline, scheduledOrder_nm);
+					}
+					journal.recordPlan(iterCommandline, state.mCutNumber, state.mTileBitmap, true, plannedTilePath, isWavelengthScheduled, scheduledOrder_nm);
+					if (iterCommandline >= sequence.readNtotalCommands())
+						break;
+					commandline = sequence.readCommandline(iterCommandline);
+				}
+
+				switch (commandline.mActionID)
+				{
+				case Action::ID::MOV:
+					state.mCutNumber = commandline.mAction.moveStage.readCutNumber();
+					tileIJ = { commandline.mAction.moveStage.readTileIndex(TileArray::Axis::II), commandline.mAction.moveStage.readTileIndex(TileArray::Axis::JJ) };
+					break;
+				case Action::ID::ACQ:
+					wavelength_nm = commandline.mAction.acqStack.readWavelength_nm();
+					laserState.mWavelength_nm = wavelength_nm;
+					reverseSCANDIR(state.mScanDirZ);
+					pipeline.submitAcquisition(std::to_string(iterCommandline), [] {}, [] {}, [] {}, [] {});
+					break;
+				case Action::ID::SAV:
+				{
+					const std::string shortName{ Util::zeroPadding(state.mCutNumber, 3) + "_" + std::to_string(wavelength_nm) + "_" + Util::zeroPadding(tileIJ.II, 2) + "_" + Util::zeroPadding(tileIJ.JJ, 2) };
+					const std::string filename{ shortName + ".tif" };
+					const int cutNumber{ state.mCutNumber };
+					const SCANDIR scanDirZ{ state.mScanDirZ };
+					pipeline.submitReadout(std::to_string(iterCommandline), [] {});
+					pipeline.submitSave(std::to_string(iterCommandline), [=, &tileManifest, &journal]
+					{
+						TiffU8 mockStack{ 8, 8, 2 };
+						std::fill(mockStack.data(), mockStack.data() + 8 * 8 * 2, static_cast<U8>(iterCommandline));
+						mockStack.saveToFile(folderPath, shortName, TIFFSTRUCT::MULTIPAGE, OVERRIDE::EN, scanDirZ);
+						tileManifest.append(cutNumber, wavelength_nm, tileIJ, { 0, 0, 0 }, filename, mockStack.computeCRC32(scanDirZ));
+						journal.recordStack(iterCommandline, cutNumber, wavelength_nm, tileIJ, scanDirZ, tileManifest.findTile(cutNumber, wavelength_nm, tileIJ));
+					});
+					state.mBrightStackIndex++;
+					state.mSavedFilenames.push_back(filename);
+				}
+				break;
+				case Action::ID::CUT:
+					executor.waitAll();
+					state.mScanDirZ = scanDirZini;
+					state.mTileBitmap.assign(false);
+					state.mIsCutPlanned = false;
+					state.mNPANinCut = 0;
+					state.mBrightStackIndex = 0;
+					journal.recordCut(iterCommandline, state.mCutNumber);
+					break;
+				case Action::ID::PAN:
+					laserState.mWavelength_nm = 1040;
+					setBrightTiles(state.mTileBitmap);
+					state.mNPANinCut++;
+					journal.recordPAN(iterCommandline, commandline.mAction.panoramicScan.readCutNumber(), state.mTileBitmap);
+					break;
+				default:
+					throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected action invalid");
+				}
+				if (iterCommandline >= stopCommandIndex && commandline.mActionID == Action::ID::SAV)
+				{
+					state.mNextCommandIndex++;
+					break;
+				}
+			}
+			executor.waitAll();
+			return state;
+		};
+		auto describeCommandList = [](const Sequencer &sequence)
+		{
+			std::string description;
+			for (int iterCommandline = 0; iterCommandline < sequence.readNtotalCommands(); iterCommandline++)
+			{
+				const Sequencer::Commandline commandline{ sequence.readCommandline(iterCommandline) };
+				description += std::to_string(static_cast<int>(commandline.mActionID));
+				if (commandline.mActionID == Action::ID::MOV)
+					description += "(" + std::to_string(commandline.mAction.moveStage.readTileIndex(TileArray::Axis::II)) + "," + std::to_string(commandline.mAction.moveStage.readTileIndex(TileArray::Axis::JJ)) + ")";
+				if (commandline.mActionID == Action::ID::ACQ)
+					description += std::to_string(commandline.mAction.acqStack.readWavelength_nm());
+			}
+			return description;
+		};
+
+		//Uninterrupted run
+		std::filesystem::remove_all(folderPath);
+		std::filesystem::create_directories(folderPath);
+		std::string referenceCommandList;
+		int nReferenceStacks;
+		{
+			Sequencer sequence{ sample, stack };
+			sequence.generateCommandList();
+			SequenceJournal journal{ folderPath, journalName };
+			TileManifest tileManifest{ folderPath, "_TileManifest" };
+			journal.restart(sequence, "_TileConfiguration");
+			const SequenceJournal::ResumeState state{ runSequence(sequence, journal, tileManifest, SequenceJournal::createInitialState(sequence, 0, scanDirZini, false), (std::numeric_limits<int>::max)()) };
+			journal.recordEnd(sequence.readNtotalCommands());
+			referenceCommandList = describeCommandList(sequence);
+			nReferenceStacks = static_cast<int>(state.mSavedFilenames.size());
+		}
+
+		//A completed run is not resumed. A command list of another sample with the same number of commands does not match the journal
+		{
+			Sequencer sequence{ sample, stack };
+			sequence.generateCommandList();
+			SequenceJournal journal{ folderPath, journalName };
+			bool isCompletedRejected{ false };
+			try
+			{
+				journal.resume(sequence, scanDirZini, false);
+			}
+			catch (const std::runtime_error&)
+			{
+				isCompletedRejected = journal.isComplete();
+			}
+
+			const Sample otherSample{ g_currentSample, {g_stackCenterXYZ.XX + 1. * mm, g_stackCenterXYZ.YY}, { 1.5 * mm, 1.5 * mm, 0.2 * mm }, g_stackCenterXYZ.ZZ, 30. * um };
+			Sequencer otherSequence{ otherSample, stack };
+			otherSequence.generateCommandList();
+			journal.restart(otherSequence, "_TileConfiguration");
+			bool isOtherSampleRejected{ false };
+			try
+			{
+				journal.resume(sequence, scanDirZini, false);
+			}
+			catch (const std::runtime_error&)
+			{
+				isOtherSampleRejected = true;
+			}
+			std::cout << "Completed run rejected: " << (isCompletedRejected ? "OK" : "FAILED") << "\tOther sample with " << otherSequence.readNtotalCommands() << "/" << sequence.readNtotalCommands() <<
+				" commands rejected: " << (isOtherSampleRejected ? "OK" : "FAILED") << "\n";
+		}
+
+		//Interrupted run. The crash tears the last record of the journal
+		auto runInterruptedSequence = [&]
+		{
+			std::filesystem::remove_all(folderPath);
+			std::filesystem::create_directories(folderPath);
+			Sequencer sequence{ sample, stack };
+			sequence.generateCommandList();
+			SequenceJournal journal{ folderPath, journalName };
+			TileManifest tileManifest{ folderPath, "_TileManifest" };
+			journal.restart(sequence, "_TileConfiguration");
+			const SequenceJournal::ResumeState liveState{ runSequence(sequence, journal, tileManifest, SequenceJournal::createInitialState(sequence, 0, scanDirZini, false), sequence.readNtotalCommands() / 2 + 7) };
+			std::ofstream{ folderPath + journalName + ".bin", std::ios::binary | std::ios::app } << "torn";
+			return liveState;
+		};
+
+		for (const bool isLastStackCutShort : { false, true })
+		{
+			//Cut the last stack short. It must be acquired again
+			const SequenceJournal::ResumeState liveState{ runInterruptedSequence() };
+			if (isLastStackCutShort)
+				std::filesystem::resize_file(folderPath + liveState.mSavedFilenames.back(), 10);
+
+			Sequencer sequence{ sample, stack };
+			sequence.generateCommandList();
+			const auto startTime{ std::chrono::high_resolution_clock::now() };
+			SequenceJournal journal{ folderPath, journalName };
+			const SequenceJournal::ResumeState resumedState{ journal.resume(sequence, scanDirZini, false) };
+			const double resumeTime{ std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count() };
+
+			const bool isStateOK{ isLastStackCutShort ?
+				resumedState.mNextCommandIndex < liveState.mNextCommandIndex && resumedState.mSavedFilenames.size() + 1 == liveState.mSavedFilenames.size() :
+				resumedState.mNextCommandIndex == liveState.mNextCommandIndex && resumedState.mSavedFilenames == liveState.mSavedFilenames && resumedState.mScanDirZ == liveState.mScanDirZ &&
+				resumedState.mTileBitmap == liveState.mTileBitmap && resumedState.mIsCutPlanned == liveState.mIsCutPlanned && resumedState.mCutNumber == liveState.mCutNumber &&
+				resumedState.mBrightStackIndex == liveState.mBrightStackIndex && resumedState.mNPANinCut == liveState.mNPANinCut };
+
+			//Finish the sequence from the resumed state
+			TileManifest tileManifest{ folderPath, "_TileManifest" };
+			const SequenceJournal::ResumeState finalState{ runSequence(sequence, journal, tileManifest, resumedState, (std::numeric_limits<int>::max)()) };
+			journal.recordEnd(sequence.readNtotalCommands());
+			const bool isFinalOK{ describeCommandList(sequence) == referenceCommandList && static_cast<int>(finalState.mSavedFilenames.size()) == nReferenceStacks &&
+				resumedState.mTileConfigurationName == "_TileConfiguration" && journal.isComplete() };
+
+			std::cout << (isLastStackCutShort ? "Last stack cut short:\t" : "Last record torn:\t") << "resumed at the command " << resumedState.mNextCommandIndex << "/" << sequence.readNtotalCommands() <<
+				" (interrupted at " << liveState.mNextCommandIndex << ") in " << Util::toString(resumeTime, 1) << " ms\tstate: " << (isStateOK ? "OK" : "FAILED") <<
+				"\tstacks saved at the end = " << finalState.mSavedFilenames.size() << "/" << nReferenceStacks << "\tcommand list: " << (isFinalOK ? "OK" : "FAILED") << "\n";
+		}
+
+		Util::pressAnyKeyToCont();
+	}
+
+	void PMT16Xconfig()
+	{
+		DeviceSessions sessions{ { DeviceSessions::SESSION::PMT16X } };		//Open the PMT16X in the background, while the FPGA session is opened
+		PMT16X PMT;
+		DeviceExecutor executor;
+
+		//pmt.setSingleGain(PMT16XCHAN::CH00, 170);
+		//PMT.setAllGains(255);
+		//PMT.readTemp();
+		executor.submit(DeviceExecutor::DEVICE::PMT16X, [&PMT] { PMT.readAllGains(); }).get();
+
+		//PMT.suppressGainsLinearly(0.4, RTseq::PMT16XCHAN::CH05, RTseq::PMT16XCHAN::CH10);
+
+		/*
+		//To make the count from all the channels similar,
+		//rescan with frequency = 100 Hz and amplitude = 1.5V (which is larger than the size of the PMT16X
+		//to use the linear part of the ramp). Set the refresh rate to 10 or 20 ms
+		PMT.setAllGain({
+			255,	//CH00
+			255,	//CH01
+			255,	//CH02
+			255,	//CH03
+			255,	//CH04
+			255,	//CH05
+			255,	//CH06
+			255,	//CH07
+			255,	//CH08
+			255,	//CH09
+			255,	//CH10
+			255,	//CH11
+			255,	//CH12
+			255,	//CH13
+			255,	//CH14
+			255		//CH15
+			});
+			*/
+
+		Util::pressAnyKeyToCont();
+	}
+
+	//Test reading different channels of the PMT16X
+	//Must manually open the laser and Uniblitz shutter
+	void PMT16Xdemultiplex(const FPGA &fpga)
+	{
+		const double pixelSizeXY{ 0.5 * um };
+		const int heightPerFrame_pix{ 560 };
+		const int widthPerFrame_pix{ 300 };
+		const int nFramesCont{ 1 };										//Number of frames for continuous acquisition
+		const double FFOVslow{ heightPerFrame_pix * pixelSizeXY };		//Scan duration in the slow axis
+		const int wavelength_nm{ 750 };
+		const double laserPower{ 30. * mW };
+
+		//CREATE THE CONTROL SEQUENCE
+		DeviceSessions sessions;		//Open the devices of the Mesoscope in the background, while the FPGA session is opened
+		RTseq realtimeSeq{ fpga, LINECLOCK::FG, FIFOOUTfpga::EN, heightPerFrame_pix, widthPerFrame_pix, nFramesCont, g_multibeam };
+		Mesoscope mesoscope{ realtimeSeq, Laser::ID::VISION };
+		mesoscope.configure(wavelength_nm);
+		mesoscope.setPower(laserPower);
+
+		//SCANNERS
+		Galvo scanner{ realtimeSeq, FFOVslow / 2. };
+		Galvo rescanner{ realtimeSeq, FFOVslow / 2., mesoscope.readCurrentLaser(), mesoscope.readCurrentWavelength_nm() };
+		//Galvo scanner{ realtimeSeq, 0 };				//Keep the scanner fixed to see the emitted light swing across the PMT16X channels. The rescanner must be centered
+
+		//EXECUTE THE CONTROL SEQUENCE
+		realtimeSeq.run();
+		Image image{ realtimeSeq };
+		image.acquire();
+		image.save(g_imagingFolderPath, "SingleChannel", TIFFSTRUCT::MULTIPAGE, OVERRIDE::EN);
+	}
+
+	void vibratome(const FPGA &fpga)
+	{
+		const double cutPlaneZ{ (20.160) * mm };
+
+		Stage stage{ 5. * mmps, 5. * mmps, 0.5 * mmps , ContainerPosLimit };
+		Vibratome vibratome{ fpga, stage };
+		vibratome.cutTissue(cutPlaneZ);
+
+		const POSITION3 samplePosXYZ{ -54. * mm, 5. * mm, cutPlaneZ };
+		stage.moveXYZ(samplePosXYZ);
+	}
+
+	void filterwheel()
+	{
+		Filterwheel FWexcitation{ Filterwheel::ID::EXC };
+		Filterwheel FWdetection{ Filterwheel::ID::DET };
+
+		int wavelength_nm;
+		if (1)
+			wavelength_nm = 920;
+		else
+			wavelength_nm = 750;
+
+		//FWexcitation.setWavelength(wavelengthIndex_s);
+		//FWdetection.setWavelength(wavelengthIndex_s);
+
+		DeviceExecutor executor;
+		if (1)//Multibeam. Turn both filterwheels concurrently
+		{
+			std::future<void> th1{ executor.submit(DeviceExecutor::DEVICE::EXCFILTERWHEEL, [&] { FWexcitation.setWavelength(wavelength_nm); }) };
+			std::future<void> th2{ executor.submit(DeviceExecutor::DEVICE::DETFILTERWHEEL, [&] { FWdetection.setWavelength(wavelength_nm); }) };
+			th1.get();
+			th2.get();
+		}
+		else//Singlebeam. Turn both filterwheels concurrently
+		{
+			std::future<void> th1{ executor.submit(DeviceExecutor::DEVICE::EXCFILTERWHEEL, [&] { FWexcitation.setWavelength(wavelength_nm); }) };	//Leave the excitation filterwheel open
+			std::future<void> th2{ executor.submit(DeviceExecutor::DEVICE::DETFILTERWHEEL, [&] { FWdetection.setWavelength(wavelength_nm); }) };
+			th1.get();
+			th2.get();
 		}
 	}
 
@@ -2004,6 +3856,585 @@ namespace TestRoutines
 		Util::pressAnyKeyToCont();
 	}
 
+	//Time to open the FPGA session and the devices of the Mesoscope, plus the PMT16X. Call it first in main(), while the FPGA session is still being opened
+	//The devices are first opened as in the routines: through DeviceSessions, concurrently with the FPGA session. Then they are opened again without DeviceSessions
+	//after the FPGA session is open. The start-up without concurrency is the time to open the FPGA session plus the time of the second opening
+	void deviceSessions(const FPGA &fpga)
+	{
+		//Record when the FPGA session is open
+		std::future<double> FPGAopenTime{ std::async(std::launch::async, [&fpga] { fpga.handle(); return DeviceSessions::readTimeSinceStart(); }) };
+
+		double concurrentStartup;
+		{
+			DeviceSessions sessions{ { DeviceSessions::SESSION::STAGES, DeviceSessions::SESSION::COLLECTORLENS, DeviceSessions::SESSION::LASERS, DeviceSessions::SESSION::FILTERWHEELS, DeviceSessions::SESSION::PMT16X } };
+			RTseq realtimeSeq{ fpga, LINECLOCK::FG, FIFOOUTfpga::DIS, 560, 300, 1, g_multibeam };
+			Mesoscope mesoscope{ realtimeSeq, Laser::ID::AUTO };
+			PMT16X PMT;
+			concurrentStartup = DeviceSessions::readTimeSinceStart();
+		}
+		const double FPGAopening{ FPGAopenTime.get() };
+
+		const auto startTime{ std::chrono::high_resolution_clock::now() };
+		{
+			RTseq realtimeSeq{ fpga, LINECLOCK::FG, FIFOOUTfpga::DIS, 560, 300, 1, g_multibeam };
+			Mesoscope mesoscope{ realtimeSeq, Laser::ID::AUTO };
+			PMT16X PMT;
+		}
+		const double serialDeviceOpening{ std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - startTime).count() * us };
+
+		std::cout << "FPGA session opened " << Util::toString(FPGAopening / ms, 0) << " ms after the start\n";
+		std::cout << "Devices opened without DeviceSessions: " << Util::toString(serialDeviceOpening / ms, 0) << " ms\n";
+		std::cout << "Start-up without concurrency (FPGA session, then the devices) = " << Util::toString((FPGAopening + serialDeviceOpening) / ms, 0) << " ms\n";
+		std::cout << "Start-up with DeviceSessions = " << Util::toString(concurrentStartup / ms, 0) << " ms\n";
+		Util::pressAnyKeyToCont();
+	}
+
+	//Switch the wavelength of mock devices that model the laser, filterwheels, and collector lens, with their serial latencies. Compare sleeping for the
+	//worst-case durations (former Laser::setWavelength and Filterwheel::setColor) with DeviceExecutor and pollUntilDone. Then test the timeout and the cancellation
+	void deviceExecutorMock()
+	{
+		const double queryLatency{ 100. * ms };				//A query pays the timeout of the serial read
+		const double laserTuningSpeed{ 40. / seconds };		//Actual speed of the mock laser. Laser::determineTuningTime assumes a slower speed
+		const double modelockTime{ 200. * ms };				//The mock laser searches for modelock after tuning
+		const double FWturningTimeRatio{ 0.8 };				//Actual turning time of the mock filterwheels relative to Filterwheel::determineTurningTime
+		const std::vector<int> wavelengthOrder_nm{ 750, 920, 1040, 920, 750, 1040 };
+
+		auto sleep = [](const double duration) { std::this_thread::sleep_for(std::chrono::microseconds(static_cast<long long>((std::max)(0., duration) / us))); };
+		auto now = []() { return std::chrono::high_resolution_clock::now(); };
+		auto elapsedTime = [](const std::chrono::time_point<std::chrono::high_resolution_clock> from, const std::chrono::time_point<std::chrono::high_resolution_clock> to)
+		{
+			return std::chrono::duration<double, std::micro>(to - from).count() * us;
+		};
+
+		//A mock device completes a command after 'duration'. A status query lasts 'queryLatency'
+		struct MockDevice
+		{
+			std::chrono::time_point<std::chrono::high_resolution_clock> mDoneTime{ std::chrono::high_resolution_clock::now() };
+			double mOverhead{ 0 };			//Accumulated time from the completion of the commands until the caller notices
+		};
+		auto start = [&](MockDevice &device, const double duration)
+		{
+			device.mDoneTime = now() + std::chrono::microseconds(static_cast<long long>(duration / us));
+		};
+		auto isDone = [&](const MockDevice &device)
+		{
+			sleep(queryLatency);
+			return now() >= device.mDoneTime;
+		};
+		auto finish = [&](MockDevice &device, const bool usePolling, const double expectedDuration)
+		{
+			if (usePolling)
+				DeviceExecutor::pollUntilDone([&] { return isDone(device); }, expectedDuration, expectedDuration + 5. * seconds);
+			else
+			{
+				sleep(expectedDuration);
+				sleep(queryLatency);						//Flush the reply
+			}
+			sleep(queryLatency);							//Download the state to check it
+			device.mOverhead += elapsedTime(device.mDoneTime, now());
+		};
+
+		for (const bool usePolling : { false, true })
+		{
+			MockDevice laser, filterwheel;
+			DeviceExecutor executor;
+			int currentWavelength_nm{ 1040 };
+			const auto startTime{ now() };
+			for (const int wavelength_nm : wavelengthOrder_nm)
+			{
+				const int initialWavelength_nm{ currentWavelength_nm };
+				std::future<void> laserFuture{ executor.submit(DeviceExecutor::DEVICE::LASER, [&, initialWavelength_nm, wavelength_nm]
+					{
+						start(laser, std::abs(wavelength_nm - initialWavelength_nm) / laserTuningSpeed + modelockTime);
+						finish(laser, usePolling, Laser::determineTuningTime(initialWavelength_nm, wavelength_nm));
+					}) };
+				std::future<void> filterwheelFuture{ executor.submit(DeviceExecutor::DEVICE::FILTERWHEELS, [&, initialWavelength_nm, wavelength_nm]
+					{
+						const Filterwheel::COLOR initialColor{ Filterwheel::convertWavelengthToColor(initialWavelength_nm) };
+						const Filterwheel::COLOR finalColor{ Filterwheel::convertWavelengthToColor(wavelength_nm) };
+						const double expectedTurningTime{ Filterwheel::determineTurningTime(Filterwheel::ID::DET, initialColor, finalColor) };
+						start(filterwheel, FWturningTimeRatio * expectedTurningTime);
+						finish(filterwheel, usePolling, expectedTurningTime);
+					}) };
+				laserFuture.get();
+				filterwheelFuture.get();
+				currentWavelength_nm = wavelength_nm;
+			}
+			std::cout << (usePolling ? "Polling:\t" : "Worst-case sleeps:") << "\ttotal = " << elapsedTime(startTime, now()) / seconds << " s\tlaser overhead per switch = "
+				<< laser.mOverhead / wavelengthOrder_nm.size() / ms << " ms\tfilterwheel overhead per switch = " << filterwheel.mOverhead / wavelengthOrder_nm.size() / ms << " ms\n";
+		}
+
+		//Timeout: the device never completes
+		{
+			const auto startTime{ now() };
+			const bool isCompleted{ DeviceExecutor::pollUntilDone([&] { sleep(queryLatency); return false; }, 500. * ms, 1. * seconds) };
+			std::cout << "Timeout test: completed = " << isCompleted << " after " << elapsedTime(startTime, now()) / ms << " ms (timeout = 1000 ms)\n";
+		}
+
+		//Cancellation: cancel a long tuning while it runs and the commands queued after it. The next command must run normally
+		{
+			DeviceExecutor executor;
+			MockDevice laser;
+			std::vector<std::future<void>> futures;
+			for (int iterCommand = 0; iterCommand < 3; iterCommand++)
+				futures.push_back(executor.submit(DeviceExecutor::DEVICE::LASER, [&] { start(laser, 10. * seconds); finish(laser, true, 10. * seconds); }));
+
+			sleep(300. * ms);
+			const auto cancelTime{ now() };
+			executor.cancel(DeviceExecutor::DEVICE::LASER);
+			int nCancelled{ 0 };
+			for (std::future<void> &future : futures)
+			{
+				try
+				{
+					future.get();
+				}
+				catch (const std::runtime_error &e)
+				{
+					std::cout << e.what() << "\n";
+					nCancelled++;
+				}
+			}
+			std::cout << "Cancellation test: " << nCancelled << "/3 commands cancelled in " << elapsedTime(cancelTime, now()) / ms << " ms\n";
+
+			executor.submit(DeviceExecutor::DEVICE::LASER, [&] { start(laser, 200. * ms); finish(laser, true, 200. * ms); }).get();
+			std::cout << "The command submitted after the cancellation completed\n";
+		}
+
+		//Nested cancellation: the filterwheels are turned by a second executor, as in CombinedFilterwheel. Cancelling the outer command must interrupt both turrets
+		{
+			DeviceExecutor executor, filterwheelExecutor;
+			MockDevice excitation, detection;
+			std::future<void> future{ executor.submit(DeviceExecutor::DEVICE::FILTERWHEELS, [&]
+			{
+				std::future<void> th1{ filterwheelExecutor.submit(DeviceExecutor::DEVICE::EXCFILTERWHEEL, [&] { start(excitation, 10. * seconds); finish(excitation, true, 10. * seconds); }) };
+				std::future<void> th2{ filterwheelExecutor.submit(DeviceExecutor::DEVICE::DETFILTERWHEEL, [&] { start(detection, 10. * seconds); finish(detection, true, 10. * seconds); }) };
+				th1.wait();
+				th2.wait();
+				th1.get();
+				th2.get();
+			}) };
+
+			sleep(300. * ms);
+			const auto cancelTime{ now() };
+			executor.cancel(DeviceExecutor::DEVICE::FILTERWHEELS);
+			bool isCancelled{ false };
+			try
+			{
+				future.get();
+			}
+			catch (const std::runtime_error &e)
+			{
+				std::cout << e.what() << "\n";
+				isCancelled = true;
+			}
+			std::cout << "Nested cancellation test: cancelled = " << isCancelled << " in " << elapsedTime(cancelTime, now()) / ms << " ms\n";
+		}
+	}
+
+	//Query emulators of the serial devices with their processing times and baud rates. Compare reading until the timeout (former serial::Serial::read) with reading
+	//until the framer recognizes the reply, one command at a time and pipelined. The replies of the PMT16X contain a data char equal to the sum of the chars before it, followed by CR, and a CR as sumcheck
+	//On Linux, the emulators are queried through a pseudo-terminal in raw mode as well, so that the bytes go through a tty as with the devices
+	void serialTransport()
+	{
+		struct DeviceModel
+		{
+			std::string mName;
+			std::function<std::string(const std::string &command)> mRespond;
+			double mProcessingTime;
+			int mBaud;
+			double mTimeout;								//Timeout of serial::Serial in the device class
+			SerialTransport::FRAMER mFramer;
+			std::vector<std::string> mCommands;				//The commands are pipelined in this order
+			bool mIsPipelined;								//The PMT16X must be woken up before each command, so its commands are not pipelined
+		};
+
+		auto respondVision = [](const std::string &command) -> std::string
+		{
+			const std::string keyword{ command.substr(0, command.size() - 1) };
+			if (keyword == "?VW")
+				return "?VW 920\r\nCHAMELEON>";
+			if (keyword == "?TS")
+				return "?TS 0\r\nCHAMELEON>";
+			if (keyword == "?S")
+				return "?S 1\r\nCHAMELEON>";
+			return "\r\nCHAMELEON>";
+		};
+		auto respondFilterwheel = [](const std::string &command) -> std::string
+		{
+			if (command == "pos?\r")
+				return "pos?\r3\r>";
+			return command + ">";
+		};
+		//The first gain is the sum of 'I' and the second gain is CR, so a reply framed at the first CR after a matching sum is cut short
+		auto respondPMT16X = [](const std::string &command) -> std::string
+		{
+			if (command == "\r")
+				return "\r";
+
+			std::string reply{ command.front() };
+			if (command.front() == 'I')
+			{
+				reply += 'I';
+				reply += '\r';
+				for (int iterChan = 2; iterChan < g_nChanPMT; iterChan++)
+					reply += static_cast<char>(200);
+			}
+			else	//'T'. The temperature is chosen so that the sumcheck is CR
+			{
+				reply += static_cast<char>(30);
+				reply += static_cast<char>(0);
+				reply += static_cast<char>(static_cast<uint8_t>('\r' - 'T' - 30));
+			}
+			uint8_t sum{ 0 };
+			for (const char character : reply)
+				sum += static_cast<uint8_t>(character);
+			return reply + static_cast<char>(sum) + "\r";
+		};
+
+		const std::vector<DeviceModel> deviceModels{
+			{ "VISION", respondVision, 2. * ms, 19200, 100. * ms, SerialTransport::terminatorFramer("CHAMELEON>"), { "?TS\r", "?VW\r", "?S\r" }, true },		//Laser::setWavelength polls ?TS and ?VW in one batch
+			{ "Filterwheel", respondFilterwheel, 2. * ms, 115200, 150. * ms, SerialTransport::terminatorFramer(">"), { "pos?\r" }, false },
+			{ "PMT16X", respondPMT16X, 5. * ms, 9600, 300. * ms, &PMT16X::frameReply, { "\r", "II\r", "\r", "TT\r" }, false } };
+		const int nRepetitions{ 20 };
+
+#ifdef __linux__
+		//Bridge the emulator to the master side of a pseudo-terminal. The transport reads and writes the slave side
+		class PtyBridge
+		{
+		public:
+			PtyBridge(const SerialTransport::Port devicePort) :
+				mDevicePort{ devicePort }
+			{
+				mMaster = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+				if (mMaster < 0 || grantpt(mMaster) != 0 || unlockpt(mMaster) != 0)
+					throw std::runtime_error((std::string)__FUNCTION__ + ": Failure creating the pseudo-terminal");
+				mSlave = open(ptsname(mMaster), O_RDWR | O_NOCTTY | O_NONBLOCK);
+				if (mSlave < 0)
+					throw std::runtime_error((std::string)__FUNCTION__ + ": Failure opening the slave side of the pseudo-terminal");
+
+				//Raw mode, so that the CRs and the binary replies go through unchanged
+				termios settings;
+				tcgetattr(mSlave, &settings);
+				cfmakeraw(&settings);
+				tcsetattr(mSlave, TCSANOW, &settings);
+
+				mThread = std::thread{ &PtyBridge::run_, this };
+			}
+			~PtyBridge()
+			{
+				mStop = true;
+				mThread.join();
+				close(mSlave);
+				close(mMaster);
+			}
+			PtyBridge(const PtyBridge&) = delete;				//Disable copy-constructor
+			PtyBridge& operator=(const PtyBridge&) = delete;	//Disable assignment-constructor
+
+			SerialTransport::Port makePort() const
+			{
+				const int slave{ mSlave };
+				return SerialTransport::Port{ [slave](const std::string &data)
+					{
+						if (write(slave, data.data(), data.size()) != static_cast<ssize_t>(data.size()))
+							throw std::runtime_error("Failure writing to the pseudo-terminal");
+					},
+					[slave]()
+					{
+						return readAll_(slave);
+					} };
+			}
+		private:
+			const SerialTransport::Port mDevicePort;
+			int mMaster;
+			int mSlave;
+			std::atomic<bool> mStop{ false };
+			std::thread mThread;
+
+			static std::string readAll_(const int fileDescriptor)
+			{
+				std::string received;
+				char buffer[256];
+				ssize_t nBytes;
+				while ((nBytes = read(fileDescriptor, buffer, sizeof(buffer))) > 0)
+					received.append(buffer, nBytes);
+				return received;
+			}
+			void run_()
+			{
+				while (!mStop)
+				{
+					const std::string command{ readAll_(mMaster) };
+					if (!command.empty())
+						mDevicePort.mWrite(command);
+					const std::string reply{ mDevicePort.mReadAvailable() };
+					if (!reply.empty() && write(mMaster, reply.data(), reply.size()) != static_cast<ssize_t>(reply.size()))
+						throw std::runtime_error("Failure writing to the pseudo-terminal");
+					std::this_thread::sleep_for(std::chrono::microseconds(100));
+				}
+			}
+		};
+		const std::vector<std::string> portNames{ "emulator", "pty" };
+#else
+		const std::vector<std::string> portNames{ "emulator" };
+#endif
+
+		int nTotalWrongReplies{ 0 };
+		for (const std::string &portName : portNames)
+			for (const DeviceModel &model : deviceModels)
+			{
+				std::vector<std::string> keys;
+				for (const std::string &command : model.mCommands)
+					keys.push_back(command == "\r" ? "wake up" : command.substr(0, command.size() - 1));
+
+				//Former blocking read: no framer, so the reply is read until the timeout. Then the framed reads, one command at a time and pipelined
+				for (const std::string mode : { "blocking", "framed", "pipelined" })
+				{
+					const bool isPipelined{ mode == std::string{ "pipelined" } };
+					if (isPipelined && !model.mIsPipelined)
+						continue;
+
+					SerialEmulator emulator{ model.mRespond, model.mProcessingTime, model.mBaud };
+#ifdef __linux__
+					std::unique_ptr<PtyBridge> ptyBridge;
+					if (portName == "pty")
+						ptyBridge.reset(new PtyBridge{ emulator.makePort() });
+					const SerialTransport::Port port{ ptyBridge ? ptyBridge->makePort() : emulator.makePort() };
+#else
+					const SerialTransport::Port port{ emulator.makePort() };
+#endif
+					SerialTransport transport{ model.mName, port, mode == std::string{ "blocking" } ? nullptr : model.mFramer, model.mTimeout };
+
+					int nWrongReplies{ 0 };
+					const auto startTime{ std::chrono::high_resolution_clock::now() };
+					for (int iterRepetition = 0; iterRepetition < nRepetitions; iterRepetition++)
+					{
+						std::vector<std::string> replies;
+						if (isPipelined)
+							replies = transport.queryPipelined(model.mCommands, keys);
+						else
+							for (std::vector<std::string>::size_type iterCommand = 0; iterCommand < model.mCommands.size(); iterCommand++)
+								replies.push_back(transport.query(model.mCommands.at(iterCommand), keys.at(iterCommand)));
+
+						for (std::vector<std::string>::size_type iterCommand = 0; iterCommand < model.mCommands.size(); iterCommand++)
+							if (replies.at(iterCommand) != model.mRespond(model.mCommands.at(iterCommand)))
+								nWrongReplies++;
+					}
+					const double duration{ std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - startTime).count() * us };
+
+					std::cout << model.mName << " (" << portName << ", " << mode << "):\t" << duration / (nRepetitions * model.mCommands.size()) / ms << " ms per command\twrong replies = " << nWrongReplies << "\n";
+					transport.printLatencyHistograms();
+					nTotalWrongReplies += nWrongReplies;
+				}
+			}
+
+		if (nTotalWrongReplies > 0)
+			throw std::runtime_error((std::string)__FUNCTION__ + ": " + std::to_string(nTotalWrongReplies) + " replies differ from those of the emulators");
+	}
+
+	//Compare the pipeline of Routines::sequencer, which demultiplexes and saves a stack while the next one is acquired, with publishing the raw stacks to a StackRing
+	//processed by 1, 2, or 4 other processes. The FPGA is simulated: it streams the multiplexed counts of the 16 channels of a multibeam stack frame by frame, at the line rate of
+	//the resonant scanner. The demultiplexing and the binning are the real ones. The disk is modeled as a network share with a fixed throughput per connection and occasional stalls,
+	//so that the writes of different processes overlap. The processing processes are emulated by threads that open the ring as a process does. One of them crashes while it holds
+	//a stack, to check that the stack is taken over
+	//The processing of a stack (demultiplexing + binning + saving) takes longer than its acquisition. The sequencer pipeline is limited by the slowest of them, a single processing
+	//process by their sum, and N processing processes by the acquisition once the processing is shared out. There is no gain when the acquisition is the slowest step
+	void stackRingBenchmark()
+	{
+		const int nStacks{ 24 };
+		const int heightPerBeamletPerFrame_pix{ 560 / g_nChanPMT };
+		const int widthPerFrame_pix{ 300 };
+		const int nFrames{ 200 };
+		const int nFramesBinning{ 2 };
+		const double frameDuration{ heightPerBeamletPerFrame_pix * g_lineclockHalfPeriod };
+		const double acquisitionTime{ nFrames * frameDuration };
+		const double diskThroughput_Bps{ 25.e6 };						//Per connection to the network share
+		const double diskLatency{ 20. * ms };
+		const double diskStallTime{ 900. * ms };						//Every 'diskStallPeriod' stacks
+		const int diskStallPeriod{ 6 };
+		const int nSlots{ 4 };
+		const std::string ringName{ g_stackRingName + "Benchmark" };
+
+		//SIMULATED FPGA. Each U32 of the raw buffers holds the 4-bit counts of 8 channels: CH00-CH07 in bufferA and CH08-CH15 in bufferB
+		//Each stack has a different count, so that a stack that is mixed up with another or cut is detected
+		const int nPixPerFrame{ heightPerBeamletPerFrame_pix * widthPerFrame_pix };
+		const int nPix{ nPixPerFrame * nFrames };
+		std::vector<U32> bufferA(nPix), bufferB(nPix);
+		auto acquire = [&](const int stackIndex, StackRing::StackHeader &header)
+		{
+			const U32 counts{ static_cast<U32>(stackIndex % 15 + 1) * 0x11111111 };
+			const auto startTime{ std::chrono::high_resolution_clock::now() };
+			for (int iterFrame = 0; iterFrame < nFrames; iterFrame++)
+			{
+				std::fill(bufferA.begin() + iterFrame * nPixPerFrame, bufferA.begin() + (iterFrame + 1) * nPixPerFrame, counts);
+				std::fill(bufferB.begin() + iterFrame * nPixPerFrame, bufferB.begin() + (iterFrame + 1) * nPixPerFrame, counts);
+				std::this_thread::sleep_until(startTime + std::chrono::microseconds(static_cast<long long>((iterFrame + 1) * frameDuration / us)));
+			}
+
+			header = StackRing::StackHeader{};
+			header.mHeightPerBeamletPerFrame_pix = heightPerBeamletPerFrame_pix;
+			header.mWidthPerFrame_pix = widthPerFrame_pix;
+			header.mNframes = nFrames;
+			header.mMultibeam = true;
+			header.mPMT16Xchan = static_cast<int>(RTseq::PMT16XCHAN::CH00);
+			header.mScanDir = static_cast<int>(SCANDIR::UPWARD);
+			header.mNframesBinning = nFramesBinning;
+			header.mNpixA = nPix;
+			header.mNpixB = nPix;
+			const std::string filename{ "stack_" + Util::zeroPadding(stackIndex, 3) };
+			filename.copy(header.mFilename, sizeof(header.mFilename) - 1);
+		};
+
+		//Same as processRawStack, in 2 steps as in Routines::sequencer. The saving is modeled
+		auto demultiplex = [&](const StackRing::StackHeader &header, const U32 *A, const U32 *B)
+		{
+			const RawStackLayout layout{ header.mHeightPerBeamletPerFrame_pix, header.mWidthPerFrame_pix, header.mNframes, static_cast<bool>(header.mMultibeam), static_cast<RTseq::PMT16XCHAN>(header.mPMT16Xchan) };
+			std::unique_ptr<TiffU8> stack{ new TiffU8{ g_nChanPMT * header.mHeightPerBeamletPerFrame_pix, header.mWidthPerFrame_pix, header.mNframes } };
+			Image::demultiplex(layout, A, B, false, stack->view().mirrorOddFrames());
+			return stack;
+		};
+		auto save = [&](TiffU8 &stack, const StackRing::StackHeader &header)
+		{
+			stack.binFrames(header.mNframesBinning);
+
+			const U8 *data{ stack.data() };
+			const int nPixBinned{ stack.readHeightPerFrame_pix() * stack.readWidthPerFrame_pix() * stack.readNframes() };
+			if (data[0] == 0 || std::any_of(data, data + nPixBinned, [&](const U8 pixel) { return pixel != data[0]; }))
+				throw std::runtime_error("The stack " + std::string{ header.mFilename } + " is corrupted");
+
+			const int stackIndex{ std::stoi(std::string{ header.mFilename }.substr(6)) };
+			const double duration{ diskLatency + nPixBinned / diskThroughput_Bps * seconds + ((stackIndex % diskStallPeriod == diskStallPeriod - 1) ? diskStallTime : 0) };
+			std::this_thread::sleep_for(std::chrono::microseconds(static_cast<long long>(duration / us)));
+			return stack.computeCRC32(static_cast<SCANDIR>(header.mScanDir));
+		};
+		auto process = [&](const StackRing::StackHeader &header, const U32 *A, const U32 *B)
+		{
+			return save(*demultiplex(header, A, B), header);
+		};
+
+		//Time the steps of a stack on their own
+		{
+			StackRing::StackHeader header;
+			const auto acquisitionStartTime{ std::chrono::high_resolution_clock::now() };
+			acquire(0, header);
+			const auto demultiplexStartTime{ std::chrono::high_resolution_clock::now() };
+			std::unique_ptr<TiffU8> stack{ demultiplex(header, bufferA.data(), bufferB.data()) };
+			const auto saveStartTime{ std::chrono::high_resolution_clock::now() };
+			save(*stack, header);
+			const auto endTime{ std::chrono::high_resolution_clock::now() };
+			std::cout << "Per stack:\tacquisition = " << Util::toString(std::chrono::duration<double, std::milli>(demultiplexStartTime - acquisitionStartTime).count(), 0) <<
+				" ms\tdemultiplexing = " << Util::toString(std::chrono::duration<double, std::milli>(saveStartTime - demultiplexStartTime).count(), 0) <<
+				" ms\tbinning + saving = " << Util::toString(std::chrono::duration<double, std::milli>(endTime - saveStartTime).count(), 0) << " ms (without stall)\n";
+		}
+
+		double pipelineStacksPerMinute{ 0 };
+		auto printResult = [&](const std::string mode, const double duration, const int nSaved, const int nFailed, const double stallTime, const int nReclaimed)
+		{
+			const double stacksPerMinute{ nStacks / (duration / seconds) * 60. };
+			if (pipelineStacksPerMinute == 0)
+				pipelineStacksPerMinute = stacksPerMinute;
+			std::cout << mode << ":\t" << Util::toString(stacksPerMinute, 1) << " stacks per minute (x" << Util::toString(stacksPerMinute / pipelineStacksPerMinute, 2) << ")\tsaved = " << nSaved << "/" << nStacks <<
+				"\tfailed = " << nFailed << "\tacquisition stalled " << Util::toString(stallTime / seconds, 2) << " s\ttaken over = " << nReclaimed << "\n";
+		};
+
+		//Pipeline of Routines::sequencer: ACQ, then DEMUX out of the raw buffers, then SAV while the next stack is acquired. The next acquisition reuses the raw buffers once they are demultiplexed
+		{
+			struct StackInFlight
+			{
+				StackRing::StackHeader mHeader;
+				std::unique_ptr<TiffU8> mStack;
+			};
+			std::atomic<int> nSaved{ 0 };
+			const auto startTime{ std::chrono::high_resolution_clock::now() };
+			{
+				ActionExecutor executor;
+				int lastACQ{ ActionExecutor::NONE }, lastDEMUX{ ActionExecutor::NONE };
+				for (int iterStack = 0; iterStack < nStacks; iterStack++)
+				{
+					std::shared_ptr<StackInFlight> stackInFlight{ std::make_shared<StackInFlight>() };
+					lastACQ = executor.submit(ActionExecutor::RESOURCE::STAGES, "ACQ", [&, iterStack, stackInFlight] { acquire(iterStack, stackInFlight->mHeader); }, { lastDEMUX });
+					lastDEMUX = executor.submit(ActionExecutor::RESOURCE::DEMUX, "DEMUX", [&, stackInFlight] { stackInFlight->mStack = demultiplex(stackInFlight->mHeader, bufferA.data(), bufferB.data()); }, { lastACQ });
+					executor.submit(ActionExecutor::RESOURCE::DISK, "SAV", [&, stackInFlight] { save(*stackInFlight->mStack, stackInFlight->mHeader); nSaved++; }, { lastDEMUX });
+				}
+				executor.waitAll();
+			}
+			const double duration{ std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count() * seconds };
+			printResult("Sequencer pipeline", duration, nSaved, 0, duration - nStacks * acquisitionTime, 0);
+		}
+
+		//Publish the stacks to the processing processes as Routines::sequencer does, right after their acquisition. The crashing processor dies while holding its 'crashAtStack'-th stack
+		struct SplitMode
+		{
+			std::string mName;
+			int mNprocessors;
+			int mCrashAtStack;								//-1 for no crash
+		};
+		struct ProcessorCrash {};							//Not derived from std::exception, so that StackRing leaves the stack claimed, as when a process dies
+		const std::vector<SplitMode> splitModes{ { "Split, no processing process", 0, -1 }, { "Split, 1 processing process", 1, -1 }, { "Split, 2 processing processes", 2, -1 },
+			{ "Split, 4 processing processes", 4, -1 }, { "Split, 2 processes, 1 crashed", 2, 3 } };
+		for (const SplitMode &mode : splitModes)
+		{
+			StackRing stackRing{ ringName, nSlots, 2 * nPix * sizeof(U32) };
+
+			//Processing processes. A crashed processor detaches from the ring without releasing its stack
+			std::vector<std::thread> processors;
+			for (int iterProcessor = 0; iterProcessor < mode.mNprocessors; iterProcessor++)
+				processors.push_back(std::thread{ [&, iterProcessor]
+				{
+					try
+					{
+						StackRing consumerRing{ ringName };
+						int nProcessed{ 0 };
+						while (!consumerRing.isFinished())
+							consumerRing.processNext([&](const StackRing::StackHeader &header, const U32 *A, const U32 *B)
+							{
+								if (iterProcessor == 0 && nProcessed++ == mode.mCrashAtStack)
+									throw ProcessorCrash{};
+								return process(header, A, B);
+							}, 100. * ms);
+					}
+					catch (const ProcessorCrash&) {}
+					catch (const std::exception &e)
+					{
+						std::cerr << e.what() << "\n";
+					}
+				} });
+
+			//Acquisition process. The processing processes must attach before the first stack is published, otherwise this process processes it
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+			const auto startTime{ std::chrono::high_resolution_clock::now() };
+			std::vector<U64> saved, failed;
+			auto collect = [&]
+			{
+				for (const StackRing::SavedStack &savedStack : stackRing.collectSaved(&failed))
+					saved.push_back(savedStack.mSequence);
+			};
+			{
+				ActionExecutor executor;
+				int lastACQ{ ActionExecutor::NONE }, lastPUB{ ActionExecutor::NONE };
+				for (int iterStack = 0; iterStack < nStacks; iterStack++)
+				{
+					std::shared_ptr<StackRing::StackHeader> header{ std::make_shared<StackRing::StackHeader>() };
+					lastACQ = executor.submit(ActionExecutor::RESOURCE::STAGES, "ACQ", [&, iterStack, header] { acquire(iterStack, *header); }, { lastPUB });
+					lastPUB = executor.submit(ActionExecutor::RESOURCE::DEMUX, "PUB", [&, header] { stackRing.publish(*header, bufferA.data(), bufferB.data(), process); collect(); }, { lastACQ });
+				}
+				executor.waitAll();
+			}
+			stackRing.close();
+			stackRing.waitForAll(process);
+			collect();
+			const double duration{ std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count() * seconds };
+
+			for (std::thread &processor : processors)
+				processor.join();
+
+			//The stacks must be collected in the order of publication
+			if (!std::is_sorted(saved.begin(), saved.end()))
+				throw std::runtime_error((std::string)__FUNCTION__ + ": The stacks were not collected in order");
+			printResult(mode.mName, duration, static_cast<int>(saved.size()), static_cast<int>(failed.size()), stackRing.readStallTime(), stackRing.readNreclaimed());
+		}
+	}
+
 	void openCV()
 	{
 		//cv::Mat image;
@@ -54,13 +54,21 @@ FluorMarkerList FluorMarkerList::readFluorMarkerList() const
 #pragma endregion "FluorMarkerList"
 
 #pragma region "Sample"
-Sample::Sample(const std::string sampleName, const std::string immersionMedium, const std::string objectiveCollar, const std::vector<LIMIT2> stageSoftPosLimXYZ, const FluorMarkerList fluorMarkerList) :
+Sample::Sample(const std::string sampleName, const std::string immersionMedium, const std::string objectiveCollar, const std::vector<LIMIT2> stageSoftPosLimXYZ, const FluorMarkerList fluorMarkerList, const BoolmapPrediction boolmapPrediction) :
 	mName{ sampleName },
 	mImmersionMedium{ immersionMedium },
 	mObjectiveCollar{ objectiveCollar },
 	mStageSoftPosLimXYZ{ stageSoftPosLimXYZ },
-	FluorMarkerList{ fluorMarkerList }
-{}
+	FluorMarkerList{ fluorMarkerList },
+	mBoolmapPrediction{ boolmapPrediction }
+{
+	if (mBoolmapPrediction.mMargin_tiles < 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The margin of the boolmap prediction must be >= 0");
+	if (mBoolmapPrediction.mThreshold < 0 || mBoolmapPrediction.mThreshold > 1)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The threshold of the boolmap prediction must be in the range [0-1]");
+	if (mBoolmapPrediction.mNverificationPAN < 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The number of verification panoramic scans must be >= 0");
+}
 
 Sample::Sample(const Sample& sample, const POSITION2 centerXY, const LENGTH3 LOIxyz, const double sampleSurfaceZ, const double cutOffset) :
 	mName{ sample.mName },
@@ -71,7 +79,8 @@ Sample::Sample(const Sample& sample, const POSITION2 centerXY, const LENGTH3 LOI
 	mCenterXY{ centerXY },
 	mLOIxyz_req{ LOIxyz },
 	mSurfaceZ{ sampleSurfaceZ },
-	mCutAboveBottomOfStack{ cutOffset }
+	mCutAboveBottomOfStack{ cutOffset },
+	mBoolmapPrediction{ sample.mBoolmapPrediction }
 {
 	if (mLOIxyz_req.XX <= 0)
 		throw std::invalid_argument((std::string)__FUNCTION__ + ": The sample length X must be > 0");
@@ -96,6 +105,17 @@ void Sample::printSampleParams(std::ofstream *fileHandle) const
 	*fileHandle << "Blade-focal plane vertical offset = " << mBladeFocalplaneOffsetZ / um << " um\n";
 	*fileHandle << "Cut above the bottom of the stack = " << mCutAboveBottomOfStack / um << " um\n";
 	*fileHandle << "\n";
+
+	*fileHandle << "BOOLMAP PREDICTION ************************************************************\n";
+	*fileHandle << "Enabled = " << mBoolmapPrediction.mEnable << "\n";
+	if (mBoolmapPrediction.mEnable)
+	{
+		*fileHandle << "Margin = " << mBoolmapPrediction.mMargin_tiles << " tiles\n";
+		*fileHandle << std::setprecision(3);
+		*fileHandle << "Threshold = " << mBoolmapPrediction.mThreshold << "\n";
+		*fileHandle << "Verification panoramic scans per cut = " << mBoolmapPrediction.mNverificationPAN << "\n";
+	}
+	*fileHandle << "\n";
 }
 
 std::string Sample::readName() const
@@ -165,7 +185,7 @@ const extern Sample g_currentSample{ "FSlide16X", "SiliconeOil", "1.51", Petridi
 //																							          { "DAPI", 750, Util::multiply16X(13. * mW), 500. * um, 2 } }} };
 
 const extern Sample g_currentSample{ "Liver", "SiliconeMineralOil5050", "1.49", ContainerPosLimit, {{ { "TDT", 1040, Util::multiply16X(60. * mW), 300. * um, 2 },
-																							          { "DAPI", 750, Util::multiply16X(13. * mW), 150. * um, 2 } }} };
+																							          { "DAPI", 750, Util::multiply16X(13. * mW), 150. * um, 2 } }}, { true, 1, 0.02, 1 } };
 
 //const extern Sample g_currentSample{ "Planarian16X", "MineralOil", "1.465", ContainerPosLimit, {{{ "DAPI", 750, Util::multiply16X(20. * mW), 2000. * um, 2 } }} };
 
@@ -202,14 +202,15 @@ PIXELij TileArray::determineTilePosWrtCenterTileArray_pix(const TILEIJ tileIndic
 #pragma region "QuickStitcher"
 //tileHeight_pix = tile height, tileWidth_pix = tile width, tileArraySizeIJ = { number of tiles as rows, number of tiles as columns}
 //II is the row index (along the image height) and JJ is the column index (along the image width) wrt the tile array. II and JJ start from 0
-QuickStitcher::QuickStitcher(const int tileHeight_pix, const int tileWidth_pix, const TILEDIM2 tileArraySizeIJ, const TILEOVERLAP3 overlapIJK_frac) :
-	TiffU8{ tileHeight_pix * tileArraySizeIJ.II, tileWidth_pix * tileArraySizeIJ.JJ, 1 },
+//The backing file of the canvas is created in canvasFolderPath and deleted when the stitcher is destroyed
+QuickStitcher::QuickStitcher(const int tileHeight_pix, const int tileWidth_pix, const TILEDIM2 tileArraySizeIJ, const TILEOVERLAP3 overlapIJK_frac, const std::string canvasFolderPath, const U64 memoryBudget_byte) :
 	TileArray{ tileHeight_pix,
 				tileWidth_pix,
 				tileArraySizeIJ,
 				overlapIJK_frac },
 	mFullHeight{ tileHeight_pix * tileArraySizeIJ.II},
-	mFullWidth{ tileWidth_pix * tileArraySizeIJ.JJ }
+	mFullWidth{ tileWidth_pix * tileArraySizeIJ.JJ },
+	mCanvas{ tileHeight_pix * tileArraySizeIJ.II, tileWidth_pix * tileArraySizeIJ.JJ, canvasFolderPath, memoryBudget_byte }
 {
 	if (tileHeight_pix <= 0 || tileWidth_pix <= 0)
 		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile height and width must be > 0");
@@ -229,10 +230,9 @@ void QuickStitcher::push(const U8 *tile, const TILEIJ tileIndicesIJ)
 
 	//const int tileHeight_pix{ tile.heightPerFrame_pix() };													//Height of the tile
 	//const int tileWidth_pix{ tile.widthPerFrame_pix() };														//Width of the tile
-	const int rowShift_pix{ tileIndicesIJ.II *  TileArray::readTileHeight_pix() };								//In the mTiff image, shift the tile down by this many pixels
-	const int colShift_pix{ tileIndicesIJ.JJ *  TileArray::readTileWidth_pix() };								//In the mTiff image, shift the tile to the right by this many pixels
+	const int rowShift_pix{ tileIndicesIJ.II *  TileArray::readTileHeight_pix() };								//In the stitched image, shift the tile down by this many pixels
+	const int colShift_pix{ tileIndicesIJ.JJ *  TileArray::readTileWidth_pix() };								//In the stitched image, shift the tile to the right by this many pixels
 	const int tileBytesPerRow{ TileArray::readTileWidth_pix() * static_cast<int>(sizeof(U8)) };					//Bytes per row of the input tile
-	const int stitchedTiffBytesPerRow{ TiffU8::readWidthPerFrame_pix() * static_cast<int>(sizeof(U8)) };		//Bytes per row of the tiled image
 
 	/*
 	//Transfer the data from the input tile to mStitchedTiff. Old way: copy pixel by pixel
@@ -240,14 +240,29 @@ void QuickStitcher::push(const U8 *tile, const TILEIJ tileIndicesIJ)
 		for (int iterRow_pix = 0; iterRow_pix < tileHeight_pix; iterRow_pix++)
 			mStitchedTiff.data()[(rowShift_pix + iterRow_pix) * mStitchedTiff.widthPerFrame_pix() + colShift_pix + iterCol_pix] = tile.data()[iterRow_pix * tileWidth_pix + iterCol_pix];*/
 
-			//Transfer the data from the input tile to mStitchedTiff. New way: copy row by row
-	for (int iterRow_pix = 0; iterRow_pix < TileArray::readTileHeight_pix(); iterRow_pix++)
-		std::memcpy(&TiffU8::data()[(rowShift_pix + iterRow_pix) * stitchedTiffBytesPerRow + colShift_pix * sizeof(U8)], &tile[iterRow_pix * tileBytesPerRow], tileBytesPerRow);
+	//Transfer the data from the input tile to the canvas. The rows are copied chunk by chunk
+	mCanvas.writeRect(tile, tileBytesPerRow, rowShift_pix, colShift_pix, TileArray::readTileHeight_pix(), TileArray::readTileWidth_pix());
+}
+
+//Stitch the rows [top_pix, top_pix + height_pix) of a tile. The input holds only those rows
+void QuickStitcher::push(const U8 *rows, const TILEIJ tileIndicesIJ, const int top_pix, const int height_pix)
+{
+	if (tileIndicesIJ.II < 0 || tileIndicesIJ.II >= TileArray::readTileArraySizeIJ(TileArray::Axis::II))
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile row index II must be in the range [0-" + std::to_string(TileArray::readTileArraySizeIJ(TileArray::Axis::II) - 1) + "]");
+	if (tileIndicesIJ.JJ < 0 || tileIndicesIJ.JJ >= TileArray::readTileArraySizeIJ(TileArray::Axis::JJ))
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile column index JJ must be in the range [0-" + std::to_string(TileArray::readTileArraySizeIJ(TileArray::Axis::JJ) - 1) + "]");
+	if (top_pix < 0 || height_pix <= 0 || top_pix + height_pix > TileArray::readTileHeight_pix())
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The rows must be within the tile");
+
+	const int rowShift_pix{ tileIndicesIJ.II *  TileArray::readTileHeight_pix() + top_pix };
+	const int colShift_pix{ tileIndicesIJ.JJ *  TileArray::readTileWidth_pix() };
+	const int tileBytesPerRow{ TileArray::readTileWidth_pix() * static_cast<int>(sizeof(U8)) };
+	mCanvas.writeRect(rows, tileBytesPerRow, rowShift_pix, colShift_pix, height_pix, TileArray::readTileWidth_pix());
 }
 
 void QuickStitcher::saveToFile(const std::string folderPath, std::string filename, const OVERRIDE override) const
 {
-	TiffU8::saveToFile(folderPath, filename, TIFFSTRUCT::SINGLEPAGE, override, SCANDIR::UPWARD);
+	mCanvas.saveToFile(folderPath, filename, override);
 }
 
 int QuickStitcher::readFullHeight_pix() const
@@ -259,10 +274,336 @@ int QuickStitcher::readFullWidth_pix() const
 {
 	return mFullWidth;
 }
+
+const ChunkedCanvas& QuickStitcher::readCanvas() const
+{
+	return mCanvas;
+}
 #pragma endregion "QuickStitcher"
 
+#pragma region "PanoramicPyramid"
+//Level 0 is already in memory, so are the downsampled levels, which take a third of it at most
+PanoramicPyramid::PanoramicPyramid(const TiffU8 &level0, const int tileSize_pix) :
+	PanoramicPyramid{ &level0, nullptr, level0.readHeightPerFrame_pix(), level0.readWidthPerFrame_pix(), tileSize_pix, (std::numeric_limits<U64>::max)(), "" } {}
+
+//Level 0 is read from an out-of-core canvas. Use a tile size that is a multiple of the chunk size so that each tile of level 0 is read from a single chunk
+//The downsampled levels take at most memoryBudget_byte. The backing files of the out-of-core levels are created in canvasFolderPath
+PanoramicPyramid::PanoramicPyramid(const ChunkedCanvas &level0, const int tileSize_pix, const U64 memoryBudget_byte, const std::string canvasFolderPath) :
+	PanoramicPyramid{ nullptr, &level0, level0.readHeight_pix(), level0.readWidth_pix(), tileSize_pix, memoryBudget_byte, canvasFolderPath } {}
+
+//Lay out the levels of the pyramid. Keep adding levels until the image fits in a single tile
+//The level k is given memoryBudget_byte / 2^k: it is stored in memory if it fits, otherwise in a canvas with that budget for its resident chunks. The levels take less than memoryBudget_byte altogether
+PanoramicPyramid::PanoramicPyramid(const TiffU8 *level0Tiff, const ChunkedCanvas *level0Canvas, int height_pix, int width_pix, const int tileSize_pix, const U64 memoryBudget_byte, const std::string canvasFolderPath) :
+	mLevel0Tiff{ level0Tiff },
+	mLevel0Canvas{ level0Canvas },
+	mTileSize_pix{ tileSize_pix }
+{
+	if (tileSize_pix <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile size must be > 0");
+
+	mLevels.push_back({ height_pix, width_pix, Util::intceil(1. * height_pix / tileSize_pix), Util::intceil(1. * width_pix / tileSize_pix), {}, nullptr });	//Level 0 is read from mLevel0Tiff or mLevel0Canvas
+
+	while (height_pix > tileSize_pix || width_pix > tileSize_pix)
+	{
+		height_pix = (height_pix + 1) / 2;
+		width_pix = (width_pix + 1) / 2;
+		const int nTilesII{ Util::intceil(1. * height_pix / tileSize_pix) };
+		const int nTilesJJ{ Util::intceil(1. * width_pix / tileSize_pix) };
+		const U64 levelSize_byte{ static_cast<U64>(nTilesII) * nTilesJJ * tileSize_pix * tileSize_pix };
+		const U64 levelBudget_byte{ memoryBudget_byte >> readNlevels() };
+
+		if (levelSize_byte <= levelBudget_byte)
+			mLevels.push_back({ height_pix, width_pix, nTilesII, nTilesJJ, std::vector<U8>(static_cast<std::size_t>(levelSize_byte), 0), nullptr });
+		else
+			mLevels.push_back({ height_pix, width_pix, nTilesII, nTilesJJ, {}, std::unique_ptr<ChunkedCanvas>{ new ChunkedCanvas{ height_pix, width_pix, canvasFolderPath, levelBudget_byte, tileSize_pix } } });
+	}
+}
+
+//Propagate a change of the full-resolution image to the downsampled levels. The region is [rowMin_pix, rowMax_pix) x [colMin_pix, colMax_pix) wrt level 0
+//Only the pixels affected by the region are recomputed, so the strips can be pushed in any order
+void PanoramicPyramid::update(const int rowMin_pix, const int rowMax_pix, const int colMin_pix, const int colMax_pix)
+{
+	if (rowMin_pix < 0 || rowMax_pix > mLevels.front().mHeight_pix || rowMin_pix >= rowMax_pix)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The row range must be inside [0-" + std::to_string(mLevels.front().mHeight_pix) + "]");
+	if (colMin_pix < 0 || colMax_pix > mLevels.front().mWidth_pix || colMin_pix >= colMax_pix)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The column range must be inside [0-" + std::to_string(mLevels.front().mWidth_pix) + "]");
+
+	int iterRowMin_pix{ rowMin_pix }, iterRowMax_pix{ rowMax_pix }, iterColMin_pix{ colMin_pix }, iterColMax_pix{ colMax_pix };
+	for (int iterLevel = 1; iterLevel < readNlevels(); iterLevel++)
+	{
+		//Region of the current level covered by the region of the previous level
+		iterRowMin_pix /= 2;
+		iterRowMax_pix = (iterRowMax_pix + 1) / 2;
+		iterColMin_pix /= 2;
+		iterColMax_pix = (iterColMax_pix + 1) / 2;
+		downsampleLevel_(iterLevel, iterRowMin_pix, iterRowMax_pix, iterColMin_pix, iterColMax_pix);
+	}
+}
+
+//Recompute all the downsampled levels
+void PanoramicPyramid::update()
+{
+	update(0, mLevels.front().mHeight_pix, 0, mLevels.front().mWidth_pix);
+}
+
+int PanoramicPyramid::readNlevels() const
+{
+	return static_cast<int>(mLevels.size());
+}
+
+int PanoramicPyramid::readTileSize_pix() const
+{
+	return mTileSize_pix;
+}
+
+int PanoramicPyramid::readHeightAtLevel_pix(const int level) const
+{
+	checkLevel_(level);
+	return mLevels.at(level).mHeight_pix;
+}
+
+int PanoramicPyramid::readWidthAtLevel_pix(const int level) const
+{
+	checkLevel_(level);
+	return mLevels.at(level).mWidth_pix;
+}
+
+//Return a level of the pyramid as a single-frame tiff
+TiffU8 PanoramicPyramid::readLevel(const int level) const
+{
+	checkLevel_(level);
+
+	const Level &currentLevel{ mLevels.at(level) };
+	TiffU8 tiff{ currentLevel.mHeight_pix, currentLevel.mWidth_pix, 1 };
+	readRect(level, tiff.data(), currentLevel.mWidth_pix, 0, 0, currentLevel.mHeight_pix, currentLevel.mWidth_pix);
+	return tiff;
+}
+
+//Copy the rectangle [top_pix, top_pix + height_pix) x [left_pix, left_pix + width_pix) of a level to the output
+void PanoramicPyramid::readRect(const int level, U8 *output, const int outputBytesPerRow, const int top_pix, const int left_pix, const int height_pix, const int width_pix) const
+{
+	checkLevel_(level);
+
+	const Level &currentLevel{ mLevels.at(level) };
+	if (top_pix < 0 || height_pix < 0 || top_pix + height_pix > currentLevel.mHeight_pix)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The row range must be inside [0-" + std::to_string(currentLevel.mHeight_pix) + "]");
+	if (left_pix < 0 || width_pix < 0 || left_pix + width_pix > currentLevel.mWidth_pix)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The column range must be inside [0-" + std::to_string(currentLevel.mWidth_pix) + "]");
+
+	if (level == 0)
+		readLevel0Rect_(output, outputBytesPerRow, top_pix, left_pix, height_pix, width_pix);
+	else if (currentLevel.mCanvas)
+		currentLevel.mCanvas->readRect(output, outputBytesPerRow, top_pix, left_pix, height_pix, width_pix);
+	else	//Copy the tiles row by row
+		for (int iterRow_pix = top_pix; iterRow_pix < top_pix + height_pix; iterRow_pix++)
+			for (int iterCol_pix = left_pix; iterCol_pix < left_pix + width_pix; iterCol_pix = (iterCol_pix / mTileSize_pix + 1) * mTileSize_pix)
+			{
+				const int nPixToCopy{ (std::min)((iterCol_pix / mTileSize_pix + 1) * mTileSize_pix, left_pix + width_pix) - iterCol_pix };
+				std::memcpy(&output[static_cast<std::size_t>(iterRow_pix - top_pix) * outputBytesPerRow + iterCol_pix - left_pix], &currentLevel.mTiles[determinePixelIndex_(currentLevel, iterRow_pix, iterCol_pix)], nPixToCopy * sizeof(U8));
+			}
+}
+
+//Save all the levels as a tiled Tiff, one page per level. The pages of the downsampled levels are tagged as reduced-resolution images
+void PanoramicPyramid::saveToFile(const std::string folderPath, std::string filename, const OVERRIDE override) const
+{
+	if (override == OVERRIDE::DIS)
+		filename = Util::doesFileExist(folderPath, filename, ".tif");	//Check if the file exits. It gives some overhead
+
+	TIFF *tiffHandle{ TIFFOpen((folderPath + filename + ".tif").c_str(), "w") };
+
+	if (tiffHandle == nullptr)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": Saving " + filename + ".tif failed");
+
+	std::vector<U8> buffer(mTileSize_pix * mTileSize_pix);	//Buffer used to store a single tile for writing to file
+
+	for (int iterLevel = 0; iterLevel < readNlevels(); iterLevel++)
+	{
+		const Level &currentLevel{ mLevels.at(iterLevel) };
+
+		//TAGS
+		TIFFSetField(tiffHandle, TIFFTAG_SUBFILETYPE, iterLevel == 0 ? 0 : FILETYPE_REDUCEDIMAGE);		//Specify that the page is a downsampled version of the first page
+		TIFFSetField(tiffHandle, TIFFTAG_IMAGELENGTH, currentLevel.mHeight_pix);						//Set the pixel height of the image
+		TIFFSetField(tiffHandle, TIFFTAG_IMAGEWIDTH, currentLevel.mWidth_pix);							//Set the pixel width of the image
+		TIFFSetField(tiffHandle, TIFFTAG_TILELENGTH, mTileSize_pix);									//Set the pixel height of the tiles. It must be a multiple of 16
+		TIFFSetField(tiffHandle, TIFFTAG_TILEWIDTH, mTileSize_pix);										//Set the pixel width of the tiles. It must be a multiple of 16
+		TIFFSetField(tiffHandle, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+		TIFFSetField(tiffHandle, TIFFTAG_SAMPLESPERPIXEL, 1);											//Set number of channels per pixel
+		TIFFSetField(tiffHandle, TIFFTAG_BITSPERSAMPLE, 8);												//Set the size of the channels
+		TIFFSetField(tiffHandle, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);								//Set the origin of the image
+		TIFFSetField(tiffHandle, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);							//Single channel with min as black
+
+		//Write the level to the file one tile at a time
+		for (int iterTileII = 0; iterTileII < currentLevel.mNtilesII; iterTileII++)
+			for (int iterTileJJ = 0; iterTileJJ < currentLevel.mNtilesJJ; iterTileJJ++)
+			{
+				const int tileTopPos_pix{ iterTileII * mTileSize_pix };
+				const int tileLeftPos_pix{ iterTileJJ * mTileSize_pix };
+
+				if (currentLevel.mTiles.empty())	//Copy the tile from level 0 or from a canvas. Pad the tiles at the edges with zeros
+				{
+					std::fill(buffer.begin(), buffer.end(), 0);
+					const int nRows{ (std::min)(mTileSize_pix, currentLevel.mHeight_pix - tileTopPos_pix) };
+					const int nCols{ (std::min)(mTileSize_pix, currentLevel.mWidth_pix - tileLeftPos_pix) };
+					readRect(iterLevel, buffer.data(), mTileSize_pix, tileTopPos_pix, tileLeftPos_pix, nRows, nCols);
+				}
+				else								//The tile is already stored contiguously
+					std::memcpy(buffer.data(), &currentLevel.mTiles[determinePixelIndex_(currentLevel, tileTopPos_pix, tileLeftPos_pix)], buffer.size() * sizeof(U8));
+
+				if (TIFFWriteTile(tiffHandle, buffer.data(), tileLeftPos_pix, tileTopPos_pix, 0, 0) < 0)
+				{
+					TIFFClose(tiffHandle);
+					throw std::runtime_error((std::string)__FUNCTION__ + ": Writing a tile to " + filename + ".tif failed");
+				}
+			}
+		TIFFWriteDirectory(tiffHandle);
+	}
+	TIFFClose(tiffHandle);
+
+	std::cout << "Successfully saved: " << filename << ".tif\n";
+}
+
+//Load a single level from a pyramid saved by PanoramicPyramid::saveToFile(). Only the page of the requested level is read
+TiffU8 PanoramicPyramid::loadLevel(const std::string folderPath, const std::string filename, const int level)
+{
+	if (level < 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pyramid level must be >= 0");
+
+	TIFF *tiffHandle{ TIFFOpen((folderPath + filename + ".tif").c_str(), "r") };
+
+	if (tiffHandle == nullptr)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": Failed opening the Tiff file");
+
+	if (!TIFFSetDirectory(tiffHandle, static_cast<tdir_t>(level)))
+	{
+		TIFFClose(tiffHandle);
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pyramid level " + std::to_string(level) + " does not exist in " + filename + ".tif");
+	}
+
+	int height_pix{ 0 }, width_pix{ 0 }, tileHeight_pix{ 0 }, tileWidth_pix{ 0 }, bitsPerSample{ 0 };
+	if (!TIFFIsTiled(tiffHandle) ||
+		!TIFFGetField(tiffHandle, TIFFTAG_IMAGELENGTH, &height_pix) ||
+		!TIFFGetField(tiffHandle, TIFFTAG_IMAGEWIDTH, &width_pix) ||
+		!TIFFGetField(tiffHandle, TIFFTAG_TILELENGTH, &tileHeight_pix) ||
+		!TIFFGetField(tiffHandle, TIFFTAG_TILEWIDTH, &tileWidth_pix) ||
+		!TIFFGetField(tiffHandle, TIFFTAG_BITSPERSAMPLE, &bitsPerSample) ||
+		bitsPerSample != 8)
+	{
+		TIFFClose(tiffHandle);
+		throw std::runtime_error((std::string)__FUNCTION__ + ": Only 8-bit grayscale tiled Tiff supported");
+	}
+
+	TiffU8 tiff{ height_pix, width_pix, 1 };
+	std::vector<U8> buffer(TIFFTileSize(tiffHandle));	//Buffer used to store a single tile read from the file
+
+	//Read the level one tile at a time
+	for (int tileTopPos_pix = 0; tileTopPos_pix < height_pix; tileTopPos_pix += tileHeight_pix)
+		for (int tileLeftPos_pix = 0; tileLeftPos_pix < width_pix; tileLeftPos_pix += tileWidth_pix)
+		{
+			if (TIFFReadTile(tiffHandle, buffer.data(), tileLeftPos_pix, tileTopPos_pix, 0, 0) < 0)
+			{
+				TIFFClose(tiffHandle);
+				throw std::runtime_error((std::string)__FUNCTION__ + ": Reading a tile from " + filename + ".tif failed");
+			}
+
+			const int nRows{ (std::min)(tileHeight_pix, height_pix - tileTopPos_pix) };
+			const int nCols{ (std::min)(tileWidth_pix, width_pix - tileLeftPos_pix) };
+			for (int iterRow_pix = 0; iterRow_pix < nRows; iterRow_pix++)
+				std::memcpy(&tiff.data()[(tileTopPos_pix + iterRow_pix) * width_pix + tileLeftPos_pix], &buffer[iterRow_pix * tileWidth_pix], nCols * sizeof(U8));
+		}
+	TIFFClose(tiffHandle);
+
+	return tiff;
+}
+
+//Copy a rectangle of the full-resolution image to the output
+void PanoramicPyramid::readLevel0Rect_(U8 *output, const int outputBytesPerRow, const int top_pix, const int left_pix, const int height_pix, const int width_pix) const
+{
+	if (mLevel0Canvas != nullptr)
+		mLevel0Canvas->readRect(output, outputBytesPerRow, top_pix, left_pix, height_pix, width_pix);
+	else
+		for (int iterRow_pix = 0; iterRow_pix < height_pix; iterRow_pix++)
+			std::memcpy(&output[static_cast<std::size_t>(iterRow_pix) * outputBytesPerRow], &mLevel0Tiff->data()[static_cast<std::size_t>(top_pix + iterRow_pix) * mLevels.front().mWidth_pix + left_pix], width_pix * sizeof(U8));
+}
+
+void PanoramicPyramid::checkLevel_(const int level) const
+{
+	if (level < 0 || level >= readNlevels())
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pyramid level must be in the range [0-" + std::to_string(readNlevels() - 1) + "]");
+}
+
+//Index of a pixel in the tile storage of a level
+int PanoramicPyramid::determinePixelIndex_(const Level &level, const int row_pix, const int col_pix) const
+{
+	const int tileIndex{ (row_pix / mTileSize_pix) * level.mNtilesJJ + col_pix / mTileSize_pix };
+	return (tileIndex * mTileSize_pix + row_pix % mTileSize_pix) * mTileSize_pix + col_pix % mTileSize_pix;
+}
+
+//Copy the input to the rectangle [top_pix, top_pix + height_pix) x [left_pix, left_pix + width_pix) of a downsampled level
+void PanoramicPyramid::writeRect_(const int level, const U8 *input, const int inputBytesPerRow, const int top_pix, const int left_pix, const int height_pix, const int width_pix)
+{
+	Level &currentLevel{ mLevels.at(level) };
+	if (currentLevel.mCanvas)
+		currentLevel.mCanvas->writeRect(input, inputBytesPerRow, top_pix, left_pix, height_pix, width_pix);
+	else	//Copy the tiles row by row
+		for (int iterRow_pix = top_pix; iterRow_pix < top_pix + height_pix; iterRow_pix++)
+			for (int iterCol_pix = left_pix; iterCol_pix < left_pix + width_pix; iterCol_pix = (iterCol_pix / mTileSize_pix + 1) * mTileSize_pix)
+			{
+				const int nPixToCopy{ (std::min)((iterCol_pix / mTileSize_pix + 1) * mTileSize_pix, left_pix + width_pix) - iterCol_pix };
+				std::memcpy(&currentLevel.mTiles[determinePixelIndex_(currentLevel, iterRow_pix, iterCol_pix)], &input[static_cast<std::size_t>(iterRow_pix - top_pix) * inputBytesPerRow + iterCol_pix - left_pix], nPixToCopy * sizeof(U8));
+			}
+}
+
+//Recompute the region [rowMin_pix, rowMax_pix) x [colMin_pix, colMax_pix) of a level by averaging 2x2 pixel blocks of the previous level
+//At the bottom and right edges of an odd-sized level, only the pixels that exist are averaged
+//The region is computed one band of rows at a time, so that only a band of the previous level and of the current level is needed in memory when they are out-of-core
+void PanoramicPyramid::downsampleLevel_(const int level, const int rowMin_pix, const int rowMax_pix, const int colMin_pix, const int colMax_pix)
+{
+	const Level &currentLevel{ mLevels.at(level) };
+	const int previousHeight_pix{ mLevels.at(level - 1).mHeight_pix };
+	const int previousWidth_pix{ mLevels.at(level - 1).mWidth_pix };
+	const int rowEnd_pix{ (std::min)(rowMax_pix, currentLevel.mHeight_pix) };
+	const int colEnd_pix{ (std::min)(colMax_pix, currentLevel.mWidth_pix) };
+	if (rowMin_pix >= rowEnd_pix || colMin_pix >= colEnd_pix)
+		return;
+
+	const int bandHeight_pix{ mTileSize_pix };												//Rows of the current level computed per band
+	const int bandLeft_pix{ 2 * colMin_pix };												//Region of the previous level read per band
+	const int bandWidth_pix{ (std::min)(2 * colEnd_pix, previousWidth_pix) - bandLeft_pix };
+	const int outputWidth_pix{ colEnd_pix - colMin_pix };
+	std::vector<U8> band;																	//Pixels of the previous level read for the current band
+	std::vector<U8> output;																	//Pixels of the current level computed for the current band
+
+	for (int bandTopRow_pix = rowMin_pix; bandTopRow_pix < rowEnd_pix; bandTopRow_pix += bandHeight_pix)
+	{
+		const int bandBottomRow_pix{ (std::min)(bandTopRow_pix + bandHeight_pix, rowEnd_pix) };
+		const int bandTop_pix{ 2 * bandTopRow_pix };
+		const int bandRows_pix{ (std::min)(2 * bandBottomRow_pix, previousHeight_pix) - bandTop_pix };
+		band.resize(static_cast<std::size_t>(bandRows_pix) * bandWidth_pix);
+		readRect(level - 1, band.data(), bandWidth_pix, bandTop_pix, bandLeft_pix, bandRows_pix, bandWidth_pix);
+		output.resize(static_cast<std::size_t>(bandBottomRow_pix - bandTopRow_pix) * outputWidth_pix);
+
+#pragma omp parallel for schedule(dynamic)
+		for (int iterRow_pix = bandTopRow_pix; iterRow_pix < bandBottomRow_pix; iterRow_pix++)
+			for (int iterCol_pix = colMin_pix; iterCol_pix < colEnd_pix; iterCol_pix++)
+			{
+				int sum{ 0 }, nPix{ 0 };
+				for (int iterRowBlock_pix = 2 * iterRow_pix; iterRowBlock_pix < (std::min)(2 * iterRow_pix + 2, previousHeight_pix); iterRowBlock_pix++)
+					for (int iterColBlock_pix = 2 * iterCol_pix; iterColBlock_pix < (std::min)(2 * iterCol_pix + 2, previousWidth_pix); iterColBlock_pix++)
+					{
+						sum += band[static_cast<std::size_t>(iterRowBlock_pix - bandTop_pix) * bandWidth_pix + iterColBlock_pix - bandLeft_pix];
+						nPix++;
+					}
+				output[static_cast<std::size_t>(iterRow_pix - bandTopRow_pix) * outputWidth_pix + iterCol_pix - colMin_pix] = static_cast<U8>((sum + nPix / 2) / nPix);	//Round to the nearest integer
+			}
+		writeRect_(level, output.data(), outputWidth_pix, bandTopRow_pix, colMin_pix, bandBottomRow_pix - bandTopRow_pix, outputWidth_pix);
+	}
+}
+#pragma endregion "PanoramicPyramid"
+
 #pragma region "PanoramicScan"
-PanoramicScan::PanoramicScan(const POSITION2 ROIcenterXY, const FFOV2 FFOV, const LENGTH2 pixelSizeXY, const LENGTH2 LOIxy) :
+//The panoramic is stitched into an out-of-core canvas. Its resident chunks take at most half of memoryBudget_byte and the downsampled levels of the pyramid a quarter
+//The last quarter is left for the bands of rows read by the boolmaps and the overlays, a few MB each
+PanoramicScan::PanoramicScan(const POSITION2 ROIcenterXY, const FFOV2 FFOV, const LENGTH2 pixelSizeXY, const LENGTH2 LOIxy, const U64 memoryBudget_byte) :
 	mROIcenterXY{ ROIcenterXY },
 	mFFOV{ FFOV },
 	mPixelSizeXY{ pixelSizeXY },													//Pixel resolution (unit of length per pixel)
@@ -271,7 +612,10 @@ PanoramicScan::PanoramicScan(const POSITION2 ROIcenterXY, const FFOV2 FFOV, cons
 	QuickStitcher{ Util::intceil(castLOIxy_(FFOV, LOIxy).XX / pixelSizeXY.XX),		//tileHeight_pix. The tile height is the same as the full height (because a tile is a long vertical strip). Note that the cast mLOIxy is being used
 				   Util::intceil(FFOV.YY / pixelSizeXY.YY),							//tileWidth_pix
 				   { 1, Util::intceil(castLOIxy_(FFOV, LOIxy).YY / FFOV.YY) },		//tile array size = { 1, JJ }. Only 1 row and many columns. Note that the cast mLOIxy is being used
-				   { 0, 0, 0} }														//No overlap	
+				   { 0, 0, 0},														//No overlap
+				   g_imagingFolderPath,												//Folder of the backing file of the canvas
+				   memoryBudget_byte / 2 },
+	mPyramid{ QuickStitcher::readCanvas(), 256, memoryBudget_byte / 4, g_imagingFolderPath }	//The full-resolution level is the stitched image itself
 {
 	if (FFOV.XX <= 0 || FFOV.YY <= 0)
 		throw std::invalid_argument((std::string)__FUNCTION__ + ": The FFOV must be > 0");
@@ -288,6 +632,36 @@ PanoramicScan::PanoramicScan(const POSITION2 ROIcenterXY, const FFOV2 FFOV, cons
 	}
 }
 
+//Stitch a strip and update the downsampled levels of the pyramid over the area covered by the strip
+void PanoramicScan::pushStrip(const U8 *tile, const TILEIJ tileIndicesIJ)
+{
+	QuickStitcher::push(tile, tileIndicesIJ);
+
+	const int rowShift_pix{ tileIndicesIJ.II * TileArray::readTileHeight_pix() };
+	const int colShift_pix{ tileIndicesIJ.JJ * TileArray::readTileWidth_pix() };
+	mPyramid.update(rowShift_pix, rowShift_pix + TileArray::readTileHeight_pix(), colShift_pix, colShift_pix + TileArray::readTileWidth_pix());
+}
+
+//Stitch the rows [top_pix, top_pix + height_pix) of a strip, e.g. a segment rescanned by an adaptive panoramic
+void PanoramicScan::pushStrip(const U8 *rows, const TILEIJ tileIndicesIJ, const int top_pix, const int height_pix)
+{
+	QuickStitcher::push(rows, tileIndicesIJ, top_pix, height_pix);
+
+	const int rowShift_pix{ tileIndicesIJ.II * TileArray::readTileHeight_pix() + top_pix };
+	const int colShift_pix{ tileIndicesIJ.JJ * TileArray::readTileWidth_pix() };
+	mPyramid.update(rowShift_pix, rowShift_pix + height_pix, colShift_pix, colShift_pix + TileArray::readTileWidth_pix());
+}
+
+void PanoramicScan::savePyramidToFile(const std::string folderPath, std::string filename, const OVERRIDE override) const
+{
+	mPyramid.saveToFile(folderPath, filename, override);
+}
+
+const PanoramicPyramid& PanoramicScan::readPyramid() const
+{
+	return mPyramid;
+}
+
 double PanoramicScan::determineInitialScanPosX(const double travelOverhead, const SCANDIR scanDir) const
 {
 	if (travelOverhead < 0)
@@ -312,6 +686,42 @@ double PanoramicScan::determineFinalScanPosX(const double travelOverhead, const
 	return determineFinalScanPos(tilePosXmin, travelX, travelOverhead, scanDir);
 }
 
+//Scan only the rows [top_pix, top_pix + height_pix) of a strip. The row 0 of the strip is at the start of a LEFTWARD scan and at the end of a RIGHTWARD scan (the strip is mirrored)
+//Over the full strip, the initial position is the same as the one of a full scan
+double PanoramicScan::determineInitialScanPosX(const double travelOverhead, const SCANDIR scanDir, const int top_pix, const int height_pix) const
+{
+	checkRows_(top_pix, height_pix);
+
+	switch (scanDir)
+	{
+	case SCANDIR::LEFTWARD:
+		return determineInitialScanPosX(travelOverhead, scanDir) - top_pix * mPixelSizeXY.XX;
+	case SCANDIR::RIGHTWARD:
+		return determineInitialScanPosX(travelOverhead, scanDir) + (readTileHeight_pix() - top_pix - height_pix) * mPixelSizeXY.XX;
+	default:
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Invalid scan direction");
+	}
+}
+
+//The stage travels the rows of the segment plus the same extra distance as in a full scan
+double PanoramicScan::determineFinalScanPosX(const double travelOverhead, const SCANDIR scanDir, const int top_pix, const int height_pix) const
+{
+	const double travelX{ height_pix * mPixelSizeXY.XX + 2 * travelOverhead - mFFOV.XX };
+	if (travelX <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The travel range must be > 0");
+
+	const double initialScanPosX{ determineInitialScanPosX(travelOverhead, scanDir, top_pix, height_pix) };
+	switch (scanDir)
+	{
+	case SCANDIR::LEFTWARD:
+		return initialScanPosX - travelX;
+	case SCANDIR::RIGHTWARD:
+		return initialScanPosX + travelX;
+	default:
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Invalid scan direction");
+	}
+}
+
 int PanoramicScan::readNumberStageYpos() const
 {
 	return static_cast<int>(mStageYpos.size());
@@ -358,1106 +768,3429 @@ LENGTH2 PanoramicScan::castLOIxy_(const FFOV2 FFOV, const LENGTH2 LOIxy) const
 
 	return { numberOfTilesII * FFOV.XX , numberOfTilesJJ * FFOV.YY };
 }
-#pragma endregion "PanoramicScan"
 
-#pragma region "Boolmap"
-//Lay a tile array over the center of the tiff. LOI is the length of interest
-Boolmap::Boolmap(const TiffU8 &tiff, const TILEDIM2 tileArraySizeIJ, const PIXDIM2 tileSizeij_pix, const TILEOVERLAP3 overlapIJK_frac, const double threshold) :
-	mTiff{ tiff },
-	mTileArray{ tileSizeij_pix,
-				{ tileArraySizeIJ.II, tileArraySizeIJ.JJ },
-				overlapIJK_frac },
-	mThreshold{ threshold },
-	mPanoramicHeight_pix{ tiff.readHeightPerFrame_pix() },
-	mPanoramicWidth_pix{ tiff.readWidthPerFrame_pix() },
-	mNpixPanoramic{ tiff.readHeightPerFrame_pix() * tiff.readWidthPerFrame_pix() },
-	mAnchorPixel_pix{ tiff.readHeightPerFrame_pix() / 2,
-					  tiff.readWidthPerFrame_pix() / 2}				//Set the anchor pixels to the center of the image
+void PanoramicScan::checkRows_(const int top_pix, const int height_pix) const
 {
-	if (tileSizeij_pix.ii <= 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pixel tile height must be > 0");
-	if (tileSizeij_pix.jj <= 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pixel tile width must be > 0");
-	if (overlapIJK_frac.II < 0 || overlapIJK_frac.JJ < 0 || overlapIJK_frac.KK < 0 || overlapIJK_frac.II > 1 || overlapIJK_frac.JJ > 1 || overlapIJK_frac.KK > 1)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The stack overlap must be in the range [0-1]");
-	if (threshold < 0 || threshold > 1)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The threshold must be in the range [0-1]");
-
-	generateBoolmap_();
+	if (top_pix < 0 || height_pix <= 0 || top_pix + height_pix > readTileHeight_pix())
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The rows must be in the range [0-" + std::to_string(readTileHeight_pix() - 1) + "]");
 }
+#pragma endregion "PanoramicScan"
 
-Boolmap::Boolmap(const PanoramicScan &panoramicScan, const TILEDIM2 tileArraySizeIJ, const PIXDIM2 tileSizeij_pix, const TILEOVERLAP3 overlapIJK_frac, const double threshold):
-	mTiff{ panoramicScan.data(),
-		   panoramicScan.readFullHeight_pix(),
-		   panoramicScan.readFullWidth_pix(),
-		   1 },
+#pragma region "StreamingBoolmap"
+//Lay the tile array over the center of the panoramic, as in Boolmap. The tiles that do not lie entirely inside the panoramic are dark and final from the start
+StreamingBoolmap::StreamingBoolmap(const PanoramicScan &panoramicScan, const TILEDIM2 tileArraySizeIJ, const PIXDIM2 tileSizeij_pix, const TILEOVERLAP3 overlapIJK_frac, const double threshold) :
+	mPanoramicScan{ panoramicScan },
 	mTileArray{ tileSizeij_pix,
 				{ tileArraySizeIJ.II, tileArraySizeIJ.JJ },
 				overlapIJK_frac },
 	mThreshold{ threshold },
 	mPanoramicHeight_pix{ panoramicScan.readFullHeight_pix() },
 	mPanoramicWidth_pix{ panoramicScan.readFullWidth_pix() },
-	mNpixPanoramic{ panoramicScan.readFullHeight_pix() * panoramicScan.readFullWidth_pix() },
-	mAnchorPixel_pix{ panoramicScan.readFullHeight_pix() / 2,
-					  panoramicScan.readFullWidth_pix() / 2 }		//Set the anchor pixels to the center of the image
+	mStripWidth_pix{ panoramicScan.readTileWidth_pix() },
+	mHalfHeight_pix{ tileSizeij_pix.ii / 2 },
+	mHalfWidth_pix{ tileSizeij_pix.jj / 2 },
+	mStripArrived(panoramicScan.readTileArraySizeIJ(TileArray::Axis::JJ), false)
 {
-	if (tileSizeij_pix.ii <= 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pixel tile height must be > 0");
-	if (tileSizeij_pix.jj <= 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pixel tile width must be > 0");
+	if (tileSizeij_pix.ii < 2)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pixel tile height must be >= 2");
+	if (tileSizeij_pix.jj < 2)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pixel tile width must be >= 2");
 	if (overlapIJK_frac.II < 0 || overlapIJK_frac.JJ < 0 || overlapIJK_frac.KK < 0 || overlapIJK_frac.II > 1 || overlapIJK_frac.JJ > 1 || overlapIJK_frac.KK > 1)
 		throw std::invalid_argument((std::string)__FUNCTION__ + ": The stack overlap must be in the range [0-1]");
 	if (threshold < 0 || threshold > 1)
 		throw std::invalid_argument((std::string)__FUNCTION__ + ": The threshold must be in the range [0-1]");
 
-	generateBoolmap_();
-}
-
-//Indicate if a specific tile in the array is bright. The tile indices start form 0
-//II is the row index (along the image height) and JJ is the column index (along the image width) wrt the tile array
-bool Boolmap::isTileBright(const TILEIJ tileIndicesIJ) const
-{
-	if (tileIndicesIJ.II < 0 || tileIndicesIJ.II >= mTileArray.readTileArraySizeIJ(TileArray::Axis::II))
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The row index II must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::II) - 1) + "]");
-	if (tileIndicesIJ.JJ < 0 || tileIndicesIJ.JJ >= mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ))
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The column index JJ must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) - 1) + "]");
-
-	try
-	{
-		return mBoolmap.at(tileIndicesIJ.II * mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) + tileIndicesIJ.JJ);
-	}
-	catch (...) {
-		throw std::out_of_range((std::string)__FUNCTION__);
-	}	
-}
-
-//Save the boolmap as a text file
-void Boolmap::saveBoolmapToText(const std::string folderPath, std::string filename, const OVERRIDE override)
-{
-	std::ofstream fileHandle;
-
-	if (override == OVERRIDE::DIS)
-		filename = Util::doesFileExist(folderPath, filename, ".txt");
-
-	fileHandle.open(folderPath + filename + ".txt");
-
-	try
-	{
-		for (int II = 0; II < mTileArray.readTileArraySizeIJ(TileArray::Axis::II); II++)
+	const PIXELij anchorPixel_pix{ mPanoramicHeight_pix / 2, mPanoramicWidth_pix / 2 };		//Set the anchor pixels to the center of the image
+	for (int II = 0; II < tileArraySizeIJ.II; II++)
+		for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
 		{
-			for (int JJ = 0; JJ < mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ); JJ++)
-				fileHandle << static_cast<int>(mBoolmap.at(II * mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) + JJ));
-			fileHandle << "\n";	//End the row
+			const PIXELij tilePosWrtCenter_pix{ mTileArray.determineTilePosWrtCenterTileArray_pix({ II, JJ }) };
+			const int tileCenterRow_pix{ anchorPixel_pix.ii + tilePosWrtCenter_pix.ii };
+			const int tileCenterCol_pix{ anchorPixel_pix.jj + tilePosWrtCenter_pix.jj };
+
+			TileState tileState{ tileCenterRow_pix - mHalfHeight_pix, tileCenterCol_pix - mHalfWidth_pix, 0, { 0, 0, 0, 0 }, false, false };
+			const bool isInside{ tileState.mTop_pix >= 0 && tileCenterRow_pix + mHalfHeight_pix < mPanoramicHeight_pix &&
+								 tileState.mLeft_pix >= 0 && tileCenterCol_pix + mHalfWidth_pix < mPanoramicWidth_pix };
+			if (isInside)
+				for (int iterStrip = 0; iterStrip < static_cast<int>(mStripArrived.size()); iterStrip++)
+					if (iterStrip * mStripWidth_pix < tileState.mLeft_pix + 2 * mHalfWidth_pix && (iterStrip + 1) * mStripWidth_pix > tileState.mLeft_pix)
+						tileState.mNpendingStrips++;
+
+			mTileState.push_back(tileState);
+			if (!isInside)
+				finalizeTile_(static_cast<int>(mTileState.size()) - 1, false);
 		}
-	}
-	catch (...) {
-		throw std::out_of_range((std::string)__FUNCTION__);
-	}
-
-	fileHandle.close();
 }
 
-//Overlay a grid with the tiles on the stitched image
-void Boolmap::saveTiffWithBoolmapGridOverlay(const std::string folderPath, std::string filename, const OVERRIDE override) const
+//Add the contribution of a newly pushed strip to the quadrant sums of the tiles overlapping it
+//For each half of a row of tiles, the rows of the strip are added up into a line of column sums, one band of rows at a time, and the running sum along that line gives each partial quadrant sum as a difference
+void StreamingBoolmap::update(const int stripIndex)
 {
-	const U8 lineColor{ 200 };
-	const int lineThickness{ 6 };
-	//const double lineThicknessFactor{ 0.1 };//If too small (<0.7), the grid will not show properly on ImageJ
-	//const int lineThicknessVertical{ static_cast<int>(lineThicknessFactor * mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ)) };
-	//const int lineThicknessHorizontal{ static_cast<int>(lineThicknessFactor * mTileArray.readTileArraySizeIJ(TileArray::Axis::II)) };
+	if (stripIndex < 0 || stripIndex >= static_cast<int>(mStripArrived.size()))
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The strip index must be in the range [0-" + std::to_string(mStripArrived.size() - 1) + "]");
+	if (mStripArrived.at(stripIndex))
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The strip " + std::to_string(stripIndex) + " has already been added");
+	mStripArrived.at(stripIndex) = true;
+
+	const int stripLeft_pix{ stripIndex * mStripWidth_pix };
+	const int stripRight_pix{ (std::min)(stripLeft_pix + mStripWidth_pix, mPanoramicWidth_pix) };
+	const int stripWidth_pix{ stripRight_pix - stripLeft_pix };
+	const int bandHeight_pix{ (std::min)(256, mHalfHeight_pix) };
+	std::vector<U8> band(static_cast<std::size_t>(bandHeight_pix) * stripWidth_pix);
+	std::vector<U32> runningSum(stripWidth_pix + 1);		//runningSum[jj + 1] is the sum of the columns of the strip up to jj, included
+
+	const int threshold_255{ static_cast<int>(mThreshold * 255) };		//Threshold in the range [0-255]
+	const U64 nPixQuad{ static_cast<U64>(mHalfHeight_pix) * mHalfWidth_pix };
+	const TILEDIM2 tileArraySizeIJ{ mTileArray.readTileArraySizeIJ() };
+	auto isTileInStrip = [&](const TileState &tileState) { return tileState.mNpendingStrips > 0 && tileState.mLeft_pix < stripRight_pix && tileState.mLeft_pix + 2 * mHalfWidth_pix > stripLeft_pix; };
 
-	//Horizontal lines. II is the row index (along the image height) wrt the tile array
-# pragma omp parallel for schedule(dynamic)
-	for (int II = 0; II < mTileArray.readTileArraySizeIJ(TileArray::Axis::II); II++)
+	for (int II = 0; II < tileArraySizeIJ.II; II++)
 	{
-		const PIXELij tileCenterPos_pix{ determineTilePosWrtPanoramic_pix_({ II, 0 }) };					//Tile center position wrt the Tiff		
-		const int tileTopPos_pix{ tileCenterPos_pix.ii - mTileArray.readTileHeight_pix() / 2 };				//Top pixels of the tile wrt the Tiff
-		const int tileBottomPos_pix{ tileCenterPos_pix.ii + mTileArray.readTileHeight_pix() / 2 };			//Bottom pixels of the tile wrt the Tiff
-	
-		if (tileTopPos_pix >= 0 && tileBottomPos_pix < mPanoramicHeight_pix)								//Make sure that the pixels lie inside the panoramic tiff
-			for (int iterCol_pix = 0; iterCol_pix < mPanoramicWidth_pix; iterCol_pix++)
-				for (int iterThickness = -lineThickness / 2; iterThickness < lineThickness / 2; iterThickness++)
-				{
-					const int iterTopRow_pix{ (tileTopPos_pix + iterThickness) * mPanoramicWidth_pix + iterCol_pix };
-					const int iterBottomRow_pix{ (tileBottomPos_pix + iterThickness) * mPanoramicWidth_pix + iterCol_pix };
+		const int firstTile{ II * tileArraySizeIJ.JJ };
+		if (std::none_of(&mTileState[firstTile], &mTileState[firstTile] + tileArraySizeIJ.JJ, isTileInStrip))
+			continue;
 
-					if (iterTopRow_pix >= 0 && iterTopRow_pix < mNpixPanoramic)								//Make sure that the pixel is inside the Tiff
-						(mTiff.data())[iterTopRow_pix] = lineColor;
+		std::vector<bool> vec_isTileInStrip(tileArraySizeIJ.JJ);
+		for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
+			vec_isTileInStrip.at(JJ) = isTileInStrip(mTileState.at(firstTile + JJ));
 
-					if (iterBottomRow_pix >= 0 && iterBottomRow_pix < mNpixPanoramic)						//Make sure that the pixel is inside the Tiff
-						(mTiff.data())[(tileBottomPos_pix + iterThickness) * mPanoramicWidth_pix + iterCol_pix] = lineColor;
+		for (int iterQuadRow = 0; iterQuadRow < 2; iterQuadRow++)
+		{
+			std::fill(runningSum.begin(), runningSum.end(), 0);
+			const int quadTop_pix{ mTileState.at(firstTile).mTop_pix + iterQuadRow * mHalfHeight_pix };
+			for (int bandTop_pix = quadTop_pix; bandTop_pix < quadTop_pix + mHalfHeight_pix; bandTop_pix += bandHeight_pix)
+			{
+				const int nRows{ (std::min)(bandHeight_pix, quadTop_pix + mHalfHeight_pix - bandTop_pix) };
+				mPanoramicScan.readCanvas().readRect(band.data(), stripWidth_pix, bandTop_pix, stripLeft_pix, nRows, stripWidth_pix);
+				for (int iterRow_pix = 0; iterRow_pix < nRows; iterRow_pix++)
+				{
+					const U8* const inputRow{ &band[static_cast<std::size_t>(iterRow_pix) * stripWidth_pix] };
+					for (int iterCol_pix = 0; iterCol_pix < stripWidth_pix; iterCol_pix++)
+						runningSum[iterCol_pix + 1] += inputRow[iterCol_pix];
 				}
-	}
+			}
+			for (int iterCol_pix = 0; iterCol_pix < stripWidth_pix; iterCol_pix++)
+				runningSum[iterCol_pix + 1] += runningSum[iterCol_pix];
 
-	//Vertical lines. JJ is the column index (along the image width) wrt the tile array
-# pragma omp parallel for schedule(dynamic)
-	for (int JJ = 0; JJ < mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ); JJ++)
-	{
-		const PIXELij tileCenterPos_pix{ determineTilePosWrtPanoramic_pix_({ 0, JJ }) };					//Tile center position wrt the Tiff
-		const int tileLeftPos_pix{ tileCenterPos_pix.jj - mTileArray.readTileWidth_pix() / 2 };				//Left pixels of the tile wrt the Tiff
-		const int tileRightPos_pix{ tileCenterPos_pix.jj + mTileArray.readTileWidth_pix() / 2 };			//Right pixels of the tile wrt the Tiff
-		
-		if (tileLeftPos_pix >= 0 && tileRightPos_pix < mPanoramicWidth_pix)									//Make sure that the pixels lie inside the panoramic tiff
-			for (int iterRow_pix = 0; iterRow_pix < mPanoramicHeight_pix; iterRow_pix++)
-				for (int iterThickness = -lineThickness / 2; iterThickness < lineThickness / 2; iterThickness++)
+			//Intersect the quadrants with the strip
+			for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
+				if (vec_isTileInStrip.at(JJ))
 				{
-					const int iterLeftColumn_pix{ iterRow_pix * mPanoramicWidth_pix + tileLeftPos_pix + iterThickness };
-					const int iterRightColumn_pix{ iterRow_pix * mPanoramicWidth_pix + tileRightPos_pix + iterThickness };
-
-					if (iterLeftColumn_pix >= 0 && iterLeftColumn_pix < mNpixPanoramic)						//Make sure that the pixel is inside the Tiff
-						(mTiff.data())[iterLeftColumn_pix] = lineColor;
-
-					if (iterRightColumn_pix >= 0 && iterRightColumn_pix < mNpixPanoramic)					//Make sure that the pixel is inside the Tiff
-						(mTiff.data())[iterRightColumn_pix] = lineColor;
+					TileState &tileState{ mTileState.at(firstTile + JJ) };
+					for (int iterQuadCol = 0; iterQuadCol < 2; iterQuadCol++)
+					{
+						const int quadLeft_pix{ tileState.mLeft_pix + iterQuadCol * mHalfWidth_pix };
+						const int left_pix{ (std::max)(quadLeft_pix, stripLeft_pix) - stripLeft_pix };
+						const int right_pix{ (std::min)(quadLeft_pix + mHalfWidth_pix, stripRight_pix) - stripLeft_pix };
+						if (right_pix > left_pix)
+							tileState.mQuadrantSum[2 * iterQuadRow + iterQuadCol] += runningSum[right_pix] - runningSum[left_pix];
+					}
 				}
+		}
+
+		for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
+			if (vec_isTileInStrip.at(JJ))
+			{
+				TileState &tileState{ mTileState.at(firstTile + JJ) };
+				bool isBright{ false };
+				for (int iterQuad = 0; iterQuad < 4; iterQuad++)
+					if (tileState.mQuadrantSum[iterQuad] > threshold_255 * nPixQuad)	//Same as comparing the average count of the quadrant with the threshold
+						isBright = true;
+
+				tileState.mNpendingStrips--;
+				if (isBright || tileState.mNpendingStrips == 0)
+					finalizeTile_(firstTile + JJ, isBright);
+			}
 	}
-	mTiff.saveToFile(folderPath, filename, TIFFSTRUCT::SINGLEPAGE, override);
 }
 
-//Save a copy of the input Tiff with the dark tiles shaded
-void Boolmap::saveTiffWithBoolmapTileOverlay(const std::string folderPath, std::string filename, const OVERRIDE override) const
+bool StreamingBoolmap::isComplete() const
 {
-	TiffU8 outputTiff{ mPanoramicHeight_pix, mPanoramicWidth_pix, 1 };	//Create an empty Tiff
+	return mNfinalTiles == static_cast<int>(mTileState.size());
+}
 
-	//Shade the Tiff with a chosen grey level
-	const U8 pixelColor{ 200 };	
-	for (int iterPixel = 0; iterPixel < mNpixPanoramic; iterPixel++)
-		(outputTiff.data())[iterPixel] = pixelColor;
-
-	//II is the row index (along the image height) and JJ is the column index (along the image width) wrt the tile array
-	for (int II = 0; II < mTileArray.readTileArraySizeIJ(TileArray::Axis::II); II++)
-		for (int JJ = 0; JJ < mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ); JJ++)
-			if (isTileBright({ II, JJ }))	//If the tile is bright, copy the pixel from mTiff.data()
-			{
-				const PIXELij tileCenterPos_pix{ determineTilePosWrtPanoramic_pix_({ II, JJ }) };	//Tile center position wrt the Tiff anchor pixel
-				const int tileTopPos_pix{ tileCenterPos_pix.ii - mTileArray.readTileHeight_pix() / 2 };
-				const int tileBottomPos_pix{ tileTopPos_pix + mTileArray.readTileHeight_pix() };
-				const int tileLeftPos_pix{ tileCenterPos_pix.jj - mTileArray.readTileWidth_pix() / 2 };
-				const int tileRightPos_pix{ tileLeftPos_pix + mTileArray.readTileWidth_pix() };
-
-				for (int iterRow_pix = tileTopPos_pix; iterRow_pix < tileBottomPos_pix; iterRow_pix++)
-					for (int iterCol_pix = tileLeftPos_pix; iterCol_pix < tileRightPos_pix; iterCol_pix++)
-						if (iterRow_pix >= 0 && iterRow_pix < mPanoramicHeight_pix && iterCol_pix >= 0 && iterCol_pix < mPanoramicWidth_pix)//Check that the tile is inside the Tiff
-							(outputTiff.data())[iterRow_pix * mPanoramicWidth_pix + iterCol_pix] = (mTiff.data())[iterRow_pix * mPanoramicWidth_pix + iterCol_pix];
-			}
-	outputTiff.saveToFile(folderPath, filename, TIFFSTRUCT::SINGLEPAGE, override);
+bool StreamingBoolmap::isTileFinal(const TILEIJ tileIndicesIJ) const
+{
+	return readTileState_(tileIndicesIJ).mFinal;
 }
 
-//Overlay the tile array on top of the panoramic
-//The center of the tile array is fixed to the anchor pixel of the panoramic
-//The pixels are wrt the origin of the panoramix, i.e., the top-left corner of the tiff
-PIXELij Boolmap::determineTilePosWrtPanoramic_pix_(const TILEIJ tileIndicesIJ) const
+//A tile that is not final yet is reported as dark
+bool StreamingBoolmap::isTileBright(const TILEIJ tileIndicesIJ) const
 {
-	if (tileIndicesIJ.II < 0 || tileIndicesIJ.II >= mTileArray.readTileArraySizeIJ(TileArray::Axis::II))
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The row index II must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::II) - 1) + "]");
-	if (tileIndicesIJ.JJ < 0 || tileIndicesIJ.JJ >= mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ))
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The column index JJ must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) - 1) + "]");
-
-	return { mAnchorPixel_pix.ii + mTileArray.determineTilePosWrtCenterTileArray_pix(tileIndicesIJ).ii,
-			 mAnchorPixel_pix.jj + mTileArray.determineTilePosWrtCenterTileArray_pix(tileIndicesIJ).jj };
+	return readTileState_(tileIndicesIJ).mBright;
 }
 
-//Take the first frame of the stack and return true if it's bright. Divide the image in quadrants for a better sensitivity
-//II is the row index (along the image height) and JJ is the column index (along the image width) wrt the tile array. II and JJ start from 0
-bool Boolmap::isQuadrantBright_(const double threshold, const TILEIJ tileIndicesIJ) const
+int StreamingBoolmap::readNumberOfFinalTiles() const
 {
-	if (threshold < 0 || threshold > 1)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The threshold must be in the range [0-1]");
-	if (tileIndicesIJ.II < 0 || tileIndicesIJ.II >= mTileArray.readTileArraySizeIJ(TileArray::Axis::II))
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile row index II must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::II) - 1) + "]");
-	if (tileIndicesIJ.JJ < 0 || tileIndicesIJ.JJ >= mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ))
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile column index JJ must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) - 1) + "]");
-
-	const int threshold_255{ static_cast<int>(threshold * 255) };		//Threshold in the range [0-255]
-
-	//Divide the image in 4 quadrants
-	const PIXELij tileCenterPos_pix{ determineTilePosWrtPanoramic_pix_(tileIndicesIJ) };	//Tile center position wrt the Tiff anchor pixel
-	const int halfHeight{ mTileArray.readTileHeight_pix() / 2 };
-	const int halfwidth{ mTileArray.readTileWidth_pix() / 2 };
-	const int tileTopPos_pix{ tileCenterPos_pix.ii - halfHeight };
-	const int tileBottomPos_pix{ tileCenterPos_pix.ii + halfHeight };
-	const int tileLeftPos_pix{ tileCenterPos_pix.jj - halfwidth };
-	const int tileRightPos_pix{ tileCenterPos_pix.jj + halfwidth };
+	return mNfinalTiles;
+}
 
-	//Make sure that the pixels lie inside the panoramic tiff
-	if (tileTopPos_pix >= 0 && tileBottomPos_pix < mPanoramicHeight_pix && tileLeftPos_pix >= 0 && tileRightPos_pix < mPanoramicWidth_pix)
-	{
-		//Iterate over the 4 quadrants. Start scanning the quadrant from the top-left corner of the image. Scan from left to right, then go back and scan the second row from left to right
-		std::vector<double> vec_sum;	//Vector of the sum for each quadrant
-		for (int iterQuadRow = 0; iterQuadRow < 2; iterQuadRow++)
-			for (int iterQuadCol = 0; iterQuadCol < 2; iterQuadCol++)
-			{
-				int sum{ 0 };
-				int nPixQuad{ 0 };		//Calculate the number of pixels in a quadrant dynamically to take into account the fractional tiles at the tiff edges
+//Return the boolmap in the same layout as Boolmap: II is the row index and JJ is the column index wrt the tile array
+TileBitmap StreamingBoolmap::readBoolmap() const
+{
+	if (!isComplete())
+		throw std::runtime_error((std::string)__FUNCTION__ + ": Not all the strips of the panoramic have arrived");
 
-				//Iterate over all the pixels inside a quadrant
-				for (int iterQuadRow_pix = tileTopPos_pix + (iterQuadRow * halfHeight); iterQuadRow_pix < tileTopPos_pix + ((iterQuadRow + 1) * halfHeight); iterQuadRow_pix++)
-					for (int iterQuadCol_pix = tileLeftPos_pix + (iterQuadCol * halfwidth); iterQuadCol_pix < tileLeftPos_pix + ((iterQuadCol + 1)* halfwidth); iterQuadCol_pix++)
-					{
-						const int pixelIndex{ iterQuadRow_pix * mPanoramicWidth_pix + iterQuadCol_pix };
-						if (pixelIndex >= 0 && pixelIndex < mPanoramicHeight_pix * mPanoramicWidth_pix)//I think this is redundant, but it does not hurt
-						{
-							sum += (mTiff.data())[pixelIndex];
-							nPixQuad++;
-						}
-					}
-				vec_sum.push_back(1. * sum / nPixQuad);
-			}
+	const TILEDIM2 tileArraySizeIJ{ mTileArray.readTileArraySizeIJ() };
+	TileBitmap boolmap{ tileArraySizeIJ };
+	for (int iterTile = 0; iterTile < static_cast<int>(mTileState.size()); iterTile++)
+		if (mTileState.at(iterTile).mBright)
+			boolmap.set({ iterTile / tileArraySizeIJ.JJ, iterTile % tileArraySizeIJ.JJ });
+	return boolmap;
+}
 
-		const double sumTL{ 1. * vec_sum.at(0) };	//Average count top-left
-		const double sumTR{ 1. * vec_sum.at(1) };	//Average count top-right
-		const double sumBL{ 1. * vec_sum.at(2) };	//Average count bottom-left
-		const double sumBR{ 1. * vec_sum.at(3) };	//Average count bottom-right
+PIXDIM2 StreamingBoolmap::readTileSize_pix() const
+{
+	return { mTileArray.readTileHeight_pix(), mTileArray.readTileWidth_pix() };
+}
 
-		/*
-		//For debuging
-		std::cout << "Average count TL = " << sumTL << "\n";
-		std::cout << "Average count TR = " << sumTR << "\n";
-		std::cout << "Average count BL = " << sumBL << "\n";
-		std::cout << "Average count BR = " << sumBR << "\n";
-		*/
-		return (sumTL > threshold_255 || sumTR > threshold_255 || sumBL > threshold_255 || sumBR > threshold_255);
-	}
-	else
-		return false;
+TILEDIM2 StreamingBoolmap::readTileArraySizeIJ() const
+{
+	return mTileArray.readTileArraySizeIJ();
 }
 
-void Boolmap::generateBoolmap_()
+TILEOVERLAP3 StreamingBoolmap::readOverlapIJK_frac() const
 {
-	//Divide the image into tiles of size tileHeight_pix * tileWidth_pix and return an array of tiles indicating if the tile is bright (TRUE) or dark (FALSE)
-	//Start scanning the tiles from the top-left corner of the image. Scan the first row from left to right. Go back and scan the second row from left to right. Etc...
-	mNbrightStacks = 0;
-	const TILEDIM2 tileArraySizeIJ{ mTileArray.readTileArraySizeIJ() };
-	for (int II = 0; II < tileArraySizeIJ.II; II++)
-		for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
-		{
-			mBoolmap.push_back(isQuadrantBright_(mThreshold, { II, JJ }));
-			mNbrightStacks++;
-		}
+	return mTileArray.readTileOverlapIJK_frac();
 }
 
-void Boolmap::fillBoolmapHoles()
+double StreamingBoolmap::readThreshold() const
 {
-	const TILEDIM2 tileArraySizeIJ{ mTileArray.readTileArraySizeIJ() };
+	return mThreshold;
+}
 
-	std::vector<int> minII(tileArraySizeIJ.JJ, tileArraySizeIJ.II-1);	//min II for each JJ. Vector of length tileArraySizeIJ.JJ initialized with the max II = tileArraySizeIJ.II - 1
-	std::vector<int> maxII(tileArraySizeIJ.JJ, 0);						//max II for each JJ. Vector of length tileArraySizeIJ.JJ initialized with the min II = 0
-	std::vector<int> minJJ(tileArraySizeIJ.II, tileArraySizeIJ.JJ-1);	//min JJ for each II. Vector of length tileArraySizeIJ.II initialized with the max JJ = tileArraySizeIJ.JJ - 1
-	std::vector<int> maxJJ(tileArraySizeIJ.II, 0);						//max JJ for each II. Vector of length tileArraySizeIJ.II initialized with the min JJ = 0
+const StreamingBoolmap::TileState& StreamingBoolmap::readTileState_(const TILEIJ tileIndicesIJ) const
+{
+	if (tileIndicesIJ.II < 0 || tileIndicesIJ.II >= mTileArray.readTileArraySizeIJ(TileArray::Axis::II))
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The row index II must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::II) - 1) + "]");
+	if (tileIndicesIJ.JJ < 0 || tileIndicesIJ.JJ >= mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ))
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The column index JJ must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) - 1) + "]");
 
-	//Find the min and max IIs and JJs
-	for (int II = 0; II < tileArraySizeIJ.II; II++)
-		for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
-			if (mBoolmap.at(II * tileArraySizeIJ.JJ + JJ) == 1)
-			{
-				if (II < minII.at(JJ))
-					minII.at(JJ) = II;
-				if (II > maxII.at(JJ))
-					maxII.at(JJ) = II;
-				if (JJ < minJJ.at(II))
-					minJJ.at(II) = JJ;
-				if (JJ > maxJJ.at(II))
-					maxJJ.at(II) = JJ;
-			}
+	return mTileState.at(tileIndicesIJ.II * mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) + tileIndicesIJ.JJ);
+}
 
-	//For debugging
-	//for (int II = 0; II < mTileArray.readTileArraySizeIJ(TileArray::Axis::II); II++)
-	//	std::cout << minJJ.at(II) << "\t" << maxJJ.at(II) << "\n";
+void StreamingBoolmap::finalizeTile_(const int tileIndex, const bool isBright)
+{
+	TileState &tileState{ mTileState.at(tileIndex) };
+	tileState.mBright = isBright;
+	tileState.mFinal = true;
+	tileState.mNpendingStrips = 0;
+	mNfinalTiles++;
+}
+#pragma endregion "StreamingBoolmap"
+
+#pragma region "AdaptivePanoramic"
+//coarseScan must have the same geometry as panoramicScan but a larger pixel size in X, and all its strips must have been pushed
+//emptyFactor and tissueFactor scale the threshold of the boolmap: a tile is empty if the average count of all its quadrants in the coarse panoramic is <= emptyFactor * threshold
+//and it is tissue if one of its quadrants is > tissueFactor * threshold. Otherwise, it is border. The empty tiles next to a tissue tile are relabeled as border
+AdaptivePanoramic::AdaptivePanoramic(PanoramicScan &panoramicScan, const PanoramicScan &coarseScan, const TILEDIM2 tileArraySizeIJ, const PIXDIM2 tileSizeij_pix, const TILEOVERLAP3 overlapIJK_frac, const double threshold, const double emptyFactor, const double tissueFactor) :
+	mPanoramicScan{ panoramicScan },
+	mCoarseScan{ coarseScan },
+	mTileArray{ tileSizeij_pix,
+				{ tileArraySizeIJ.II, tileArraySizeIJ.JJ },
+				overlapIJK_frac },
+	mPanoramicHeight_pix{ panoramicScan.readFullHeight_pix() },
+	mCoarseHeight_pix{ coarseScan.readFullHeight_pix() },
+	mStripWidth_pix{ panoramicScan.readTileWidth_pix() },
+	mNstrips{ panoramicScan.readTileArraySizeIJ(TileArray::Axis::JJ) },
+	mSegmentIndexByStrip(panoramicScan.readTileArraySizeIJ(TileArray::Axis::JJ), -1)
+{
+	if (coarseScan.readFullWidth_pix() != panoramicScan.readFullWidth_pix() || coarseScan.readTileWidth_pix() != mStripWidth_pix)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The coarse panoramic must have the same strips as the full-resolution panoramic");
+	if (mCoarseHeight_pix > mPanoramicHeight_pix)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The coarse panoramic must not be taller than the full-resolution panoramic");
+	if (tileSizeij_pix.ii < 2)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pixel tile height must be >= 2");
+	if (tileSizeij_pix.jj < 2)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pixel tile width must be >= 2");
+	if (threshold < 0 || threshold > 1)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The threshold must be in the range [0-1]");
+	if (emptyFactor < 0 || emptyFactor > 1)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The empty factor must be in the range [0-1]");
+	if (tissueFactor < 1)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tissue factor must be >= 1");
 
-	//Fill the holes in mBoolmap
-	mNbrightStacks = 0;
 	for (int II = 0; II < tileArraySizeIJ.II; II++)
 		for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
-			if (II >= minII.at(JJ) && II <= maxII.at(JJ) && JJ >= minJJ.at(II) && JJ <= maxJJ.at(II))
-			{
-				mBoolmap.at(II * tileArraySizeIJ.JJ + JJ) = 1;
-				mNbrightStacks++;
-			}
-
-	/*
-	//Enlarge the boolmap by 1 place in the vertical direction of the tiff
-	std::vector<bool> mBoolmapAugmentedV{ mBoolmap };
-	for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
-	{
-		//
-		if (mBoolmapAugmentedV.at(minII.at(JJ) * tileArraySizeIJ.JJ + JJ) == 1)
-		{
-			const int minIIminus1{ (minII.at(JJ) - 1) * tileArraySizeIJ.JJ + JJ };
-			if (minIIminus1 >= 0)
-				mBoolmapAugmentedV.at(minIIminus1) = 1;
-		}	
+			mRegions.push_back(classifyTile_({ II, JJ }, emptyFactor, tissueFactor, threshold));
 
-		if (mBoolmapAugmentedV.at(maxII.at(JJ) * tileArraySizeIJ.JJ + JJ) == 1)
-		{
-			const int maxIIplus1{ (maxII.at(JJ) + 1) * tileArraySizeIJ.JJ + JJ };
-			if (maxIIplus1 < tileArraySizeIJ.II * tileArraySizeIJ.JJ)
-				mBoolmapAugmentedV.at(maxIIplus1) = 1;
-		}
-	}
+	dilateTissue_();
+	planSegments_();
+}
 
-	//Enlarge the boolmap by 1 place in the horizontal direction of the tiff
-	std::vector<bool> mBoolmapAugmentedH{ mBoolmap };
-	for (int II = 0; II < tileArraySizeIJ.II; II++)
-	{
-		if (mBoolmapAugmentedH.at(II * tileArraySizeIJ.JJ + minJJ.at(II)) == 1)
-		{
-			const int minJJminus1{ II * tileArraySizeIJ.JJ + (minJJ.at(II)-1) };
-			if (minJJminus1 >= 0)
-				mBoolmapAugmentedH.at(minJJminus1) = 1;
-		}
-		if (mBoolmapAugmentedH.at(II * tileArraySizeIJ.JJ + maxJJ.at(II)) == 1)
-		{
-			const int maxJJplus1{ II * tileArraySizeIJ.JJ + (maxJJ.at(II)+1) };
-			if (maxJJplus1 < tileArraySizeIJ.II * tileArraySizeIJ.JJ)
-				mBoolmapAugmentedH.at(maxJJplus1) = 1;
-		}
-	}
+//II is the row index (along the image height) and JJ is the column index (along the image width) wrt the tile array
+AdaptivePanoramic::REGION AdaptivePanoramic::readRegion(const TILEIJ tileIndicesIJ) const
+{
+	if (tileIndicesIJ.II < 0 || tileIndicesIJ.II >= mTileArray.readTileArraySizeIJ(TileArray::Axis::II))
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The row index II must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::II) - 1) + "]");
+	if (tileIndicesIJ.JJ < 0 || tileIndicesIJ.JJ >= mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ))
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The column index JJ must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) - 1) + "]");
 
-	//Combine the horizontal and vertical maps
-	for (std::vector<int>::size_type iter = 0; iter != mBoolmapAugmentedV.size(); iter++)
-		mBoolmap.at(iter) = mBoolmapAugmentedV.at(iter) || mBoolmapAugmentedH.at(iter);
-	*/
+	return mRegions.at(tileIndicesIJ.II * mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) + tileIndicesIJ.JJ);
 }
 
-void Boolmap::replaceInputBoolmapByUnion(std::vector<bool> &vec_input) const
+int AdaptivePanoramic::readNumberOfRegions(const REGION region) const
 {
-	for (std::vector<int>::size_type iter = 0; iter != mBoolmap.size(); iter++)
-	{
-		const bool aux{ mBoolmap.at(iter) || vec_input.at(iter) };
-		vec_input.at(iter) = aux;
-	}
+	return static_cast<int>(std::count(mRegions.begin(), mRegions.end(), region));
 }
 
-int Boolmap::readNumberOfBrightStacks() const
+const std::vector<AdaptivePanoramic::Segment>& AdaptivePanoramic::readSegments() const
 {
-	return mNbrightStacks;
+	return mSegments;
 }
-#pragma endregion "Boolmap"
-
 
-
-#pragma region "Stack"
-Stack::Stack(const FFOV2 FFOV, const int tileHeight_pix, int const tileWidth_pix, const double pixelSizeZ, const int nFrames, const TILEOVERLAP3 overlapIJK_frac) :
-	mFFOV{ FFOV },
-	mTileHeight_pix{ tileHeight_pix },
-	mTileWidth_pix{ tileWidth_pix },
-	mPixelSizeZ{ pixelSizeZ },
-	mDepthZ{ pixelSizeZ *  nFrames },
-	mOverlapIJK_frac{ overlapIJK_frac }
+//Return the index of the segment of the strip in readSegments(), or -1 if the strip is not rescanned
+int AdaptivePanoramic::findSegment(const int stripIndex) const
 {
-	if (FFOV.XX <= 0 || FFOV.YY <= 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The FOV must be > 0");
-	if (tileHeight_pix <= 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pixel tile height must be > 0");
-	if (tileWidth_pix <= 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pixel tile width must be > 0");
-	if (pixelSizeZ <= 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pixel size Z must be > 0");
-	if (nFrames <= 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The number of frames must be >= 1");
-	if (overlapIJK_frac.II < 0 || overlapIJK_frac.JJ < 0 || overlapIJK_frac.II > 0.2 || overlapIJK_frac.JJ > 0.2 )
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The stack overlap in XY must be in the range [0-0.2]");
-	if (overlapIJK_frac.KK < 0 || overlapIJK_frac.KK > 0.5)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The stack overlap in Z must be in the range [0-0.5]");
+	if (stripIndex < 0 || stripIndex >= mNstrips)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The strip index must be in the range [0-" + std::to_string(mNstrips - 1) + "]");
+
+	return mSegmentIndexByStrip.at(stripIndex);
 }
 
-void Stack::printParams(std::ofstream *fileHandle) const
+//Fraction of the full-resolution panoramic that is rescanned
+double AdaptivePanoramic::readRescannedFraction() const
 {
-	*fileHandle << "STACK ************************************************************\n";
-	*fileHandle << std::setprecision(1);
-	*fileHandle << "FOV (stageX, stageY) = (" << mFFOV.XX / um << " um, " << mFFOV.YY / um << " um)\n";
-	*fileHandle << "Pixel size Z = " << mPixelSizeZ / um << " um\n";
-	*fileHandle << "Stack depth Z = " << mDepthZ / um << " um\n";
-	*fileHandle << std::setprecision(2);
-	*fileHandle << "Stack overlap = (" << mOverlapIJK_frac.II << ", " << mOverlapIJK_frac.JJ << ", " << mOverlapIJK_frac.KK << ") (frac)\n";
-	*fileHandle << std::setprecision(1);
-	*fileHandle << "Stack overlap = (" << mOverlapIJK_frac.II * mFFOV.XX / um << " um, " << mOverlapIJK_frac.JJ * mFFOV.YY / um << " um, " << mOverlapIJK_frac.KK * mDepthZ << " um)\n";
-	*fileHandle << "\n";
+	U64 nRescannedRows{ 0 };
+	for (const auto &segment : mSegments)
+		nRescannedRows += segment.mHeight_pix;
+
+	return 1. * nRescannedRows / (static_cast<U64>(mNstrips) * mPanoramicHeight_pix);
 }
 
-double Stack::readFFOV(const AXIS axis) const
+//Average each group of nLinesPerRow consecutive rows of the strip, so that a row of the coarse panoramic covers its pixel size in X instead of sampling a single line
+//height_pix is the number of rows of the input strip and must be a multiple of nLinesPerRow
+std::vector<U8> AdaptivePanoramic::binLines(const U8 *strip, const int height_pix, const int width_pix, const int nLinesPerRow)
 {
-	switch (axis)
+	if (nLinesPerRow < 1)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The number of lines per row must be >= 1");
+	if (height_pix <= 0 || height_pix % nLinesPerRow != 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The strip height must be a multiple of the number of lines per row");
+	if (width_pix <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The strip width must be > 0");
+
+	const int nRows{ height_pix / nLinesPerRow };
+	std::vector<U8> binned(static_cast<std::size_t>(nRows) * width_pix);
+	std::vector<int> sum(width_pix);
+	for (int iterRow_pix = 0; iterRow_pix < nRows; iterRow_pix++)
 	{
-	case AXIS::XX:
-		return mFFOV.XX;
-	case AXIS::YY:
-		return mFFOV.YY;
-	default:
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected stage axis unavailable");
+		std::fill(sum.begin(), sum.end(), 0);
+		for (int iterLine = 0; iterLine < nLinesPerRow; iterLine++)
+		{
+			const U8 *line{ &strip[(static_cast<std::size_t>(iterRow_pix) * nLinesPerRow + iterLine) * width_pix] };
+			for (int iterCol_pix = 0; iterCol_pix < width_pix; iterCol_pix++)
+				sum[iterCol_pix] += line[iterCol_pix];
+		}
+		for (int iterCol_pix = 0; iterCol_pix < width_pix; iterCol_pix++)
+			binned[static_cast<std::size_t>(iterRow_pix) * width_pix + iterCol_pix] = static_cast<U8>((sum[iterCol_pix] + nLinesPerRow / 2) / nLinesPerRow);
 	}
+	return binned;
 }
 
-int Stack::readTileHeight_pix() const
+//Push the strip of the coarse panoramic to the full-resolution panoramic. Each row is repeated to match the pixel size in X
+//Call it before pushing the rescanned segment of the strip, which overwrites the upsampled rows
+void AdaptivePanoramic::fillStripFromCoarse(const int stripIndex)
 {
-	return mTileHeight_pix;
-}
+	if (stripIndex < 0 || stripIndex >= mNstrips)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The strip index must be in the range [0-" + std::to_string(mNstrips - 1) + "]");
 
-int Stack::readTileWidth_pix() const
-{
-	return mTileWidth_pix;
-}
+	std::vector<U8> coarseStrip(static_cast<std::size_t>(mCoarseHeight_pix) * mStripWidth_pix);
+	mCoarseScan.readCanvas().readRect(coarseStrip.data(), mStripWidth_pix, 0, stripIndex * mStripWidth_pix, mCoarseHeight_pix, mStripWidth_pix);
 
-double Stack::readPixelSizeZ() const
-{
-	return mPixelSizeZ;
-}
+	std::vector<U8> strip(static_cast<std::size_t>(mPanoramicHeight_pix) * mStripWidth_pix);
+	for (int iterRow_pix = 0; iterRow_pix < mPanoramicHeight_pix; iterRow_pix++)
+		std::memcpy(&strip[static_cast<std::size_t>(iterRow_pix) * mStripWidth_pix], &coarseStrip[static_cast<std::size_t>(convertToCoarseRow_(iterRow_pix)) * mStripWidth_pix], mStripWidth_pix);
 
-double Stack::readDepthZ() const
-{
-	return mDepthZ;
+	mPanoramicScan.pushStrip(strip.data(), { 0, stripIndex });
 }
 
-TILEOVERLAP3 Stack::readOverlapIJK_frac() const
+//Save the regions with the same layout as the boolmap: 0 = empty, 1 = border, 2 = tissue
+void AdaptivePanoramic::saveRegionsToText(const std::string folderPath, std::string filename, const OVERRIDE override) const
 {
-	return mOverlapIJK_frac;
-}
+	std::ofstream fileHandle;
 
-double Stack::readOverlap_frac(const TileArray::Axis axis) const
-{
-	switch (axis)
+	if (override == OVERRIDE::DIS)
+		filename = Util::doesFileExist(folderPath, filename, ".txt");
+
+	fileHandle.open(folderPath + filename + ".txt");
+
+	for (int II = 0; II < mTileArray.readTileArraySizeIJ(TileArray::Axis::II); II++)
 	{
-	case TileArray::Axis::II:
-		return mOverlapIJK_frac.II;
-	case TileArray::Axis::JJ:
-		return mOverlapIJK_frac.JJ;
-	case TileArray::Axis::KK:
-		return mOverlapIJK_frac.KK;
-	default:
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected tile array axis unavailable");
+		for (int JJ = 0; JJ < mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ); JJ++)
+			fileHandle << static_cast<int>(readRegion({ II, JJ }));
+		fileHandle << "\n";	//End the row
 	}
+
+	fileHandle.close();
 }
-#pragma endregion "Stack"
 
-#pragma region "Action"
-void Action::MoveStage::setParam(const int cutNumber, const TILEIJ tileIndicesIJ, const POSITION2 tileCenterXY)
+//Row of the coarse panoramic that covers the row of the full-resolution panoramic
+int AdaptivePanoramic::convertToCoarseRow_(const int row_pix) const
 {
-	if (cutNumber < 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The cut number must be >= 0");
-	if (tileIndicesIJ.II < 0 || tileIndicesIJ.JJ < 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile indices must be >= 0");
-
-	mCutNumber = cutNumber;
-	mTileIndicesIJ = tileIndicesIJ;
-	mTileCenterXY = tileCenterXY;
+	return (std::min)(static_cast<int>(static_cast<U64>(row_pix) * mCoarseHeight_pix / mPanoramicHeight_pix), mCoarseHeight_pix - 1);
 }
 
-int Action::MoveStage::readCutNumber() const
+//Lay the tile array over the center of the panoramic, as in Boolmap
+PIXELij AdaptivePanoramic::determineTileTopLeft_pix_(const TILEIJ tileIndicesIJ) const
 {
-	return mCutNumber;
+	const PIXELij tilePosWrtCenter_pix{ mTileArray.determineTilePosWrtCenterTileArray_pix(tileIndicesIJ) };
+	return { mPanoramicHeight_pix / 2 + tilePosWrtCenter_pix.ii - mTileArray.readTileHeight_pix() / 2,
+			 mPanoramicScan.readFullWidth_pix() / 2 + tilePosWrtCenter_pix.jj - mTileArray.readTileWidth_pix() / 2 };
 }
 
-int Action::MoveStage::readTileIndex(const TileArray::Axis axis) const
+//Compare the average count of the quadrants of the tile in the coarse panoramic with the scaled thresholds
+//The tiles that do not lie entirely inside the panoramic are dark in the boolmap, so they are empty
+AdaptivePanoramic::REGION AdaptivePanoramic::classifyTile_(const TILEIJ tileIndicesIJ, const double emptyFactor, const double tissueFactor, const double threshold) const
 {
-	switch (axis)
+	const int halfHeight_pix{ mTileArray.readTileHeight_pix() / 2 };
+	const int halfWidth_pix{ mTileArray.readTileWidth_pix() / 2 };
+	const PIXELij topLeft_pix{ determineTileTopLeft_pix_(tileIndicesIJ) };
+	if (topLeft_pix.ii < 0 || topLeft_pix.ii + 2 * halfHeight_pix >= mPanoramicHeight_pix || topLeft_pix.jj < 0 || topLeft_pix.jj + 2 * halfWidth_pix >= mPanoramicScan.readFullWidth_pix())
+		return REGION::EMPTY;
+
+	//Read the rows of the coarse panoramic covering the tile
+	const int coarseTop_pix{ convertToCoarseRow_(topLeft_pix.ii) };
+	const int coarseBottom_pix{ convertToCoarseRow_(topLeft_pix.ii + 2 * halfHeight_pix - 1) + 1 };
+	const int width_pix{ 2 * halfWidth_pix };
+	std::vector<U8> tile(static_cast<std::size_t>(coarseBottom_pix - coarseTop_pix) * width_pix);
+	mCoarseScan.readCanvas().readRect(tile.data(), width_pix, coarseTop_pix, topLeft_pix.jj, coarseBottom_pix - coarseTop_pix, width_pix);
+
+	const int threshold_255{ static_cast<int>(threshold * 255) };		//Threshold in the range [0-255], as in Boolmap
+	double maxAverage{ 0 };
+	for (int iterQuadRow = 0; iterQuadRow < 2; iterQuadRow++)
 	{
-	case TileArray::Axis::II:
-		return mTileIndicesIJ.II;
-	case TileArray::Axis::JJ:
-		return mTileIndicesIJ.JJ;
-	default:
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected tile array axis unavailable");
+		//Rows of the coarse tile covering the quadrant
+		const int rowMin_pix{ convertToCoarseRow_(topLeft_pix.ii + iterQuadRow * halfHeight_pix) - coarseTop_pix };
+		const int rowMax_pix{ convertToCoarseRow_(topLeft_pix.ii + (iterQuadRow + 1) * halfHeight_pix - 1) - coarseTop_pix };
+		for (int iterQuadCol = 0; iterQuadCol < 2; iterQuadCol++)
+		{
+			U64 sum{ 0 };
+			for (int iterRow_pix = rowMin_pix; iterRow_pix <= rowMax_pix; iterRow_pix++)
+				for (int iterCol_pix = iterQuadCol * halfWidth_pix; iterCol_pix < (iterQuadCol + 1) * halfWidth_pix; iterCol_pix++)
+					sum += tile[static_cast<std::size_t>(iterRow_pix) * width_pix + iterCol_pix];
+			maxAverage = (std::max)(maxAverage, 1. * sum / ((rowMax_pix - rowMin_pix + 1) * halfWidth_pix));
+		}
 	}
+
+	if (maxAverage > tissueFactor * threshold_255)
+		return REGION::TISSUE;
+	else if (maxAverage <= emptyFactor * threshold_255)
+		return REGION::EMPTY;
+	else
+		return REGION::BORDER;
 }
 
-POSITION2 Action::MoveStage::readTileCenterXY() const
+//The coarse sampling in X can miss the edge of the tissue. Relabel the empty tiles next to a tissue tile (including the diagonals) as border
+//Only the tiles inside the panoramic are relabeled
+void AdaptivePanoramic::dilateTissue_()
 {
-	return mTileCenterXY;
+	const TILEDIM2 tileArraySizeIJ{ mTileArray.readTileArraySizeIJ() };
+	const std::vector<REGION> regions{ mRegions };
+	for (int II = 0; II < tileArraySizeIJ.II; II++)
+		for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
+		{
+			if (regions.at(II * tileArraySizeIJ.JJ + JJ) != REGION::TISSUE)
+				continue;
+
+			for (int iterII = (std::max)(II - 1, 0); iterII <= (std::min)(II + 1, tileArraySizeIJ.II - 1); iterII++)
+				for (int iterJJ = (std::max)(JJ - 1, 0); iterJJ <= (std::min)(JJ + 1, tileArraySizeIJ.JJ - 1); iterJJ++)
+				{
+					REGION &region{ mRegions.at(iterII * tileArraySizeIJ.JJ + iterJJ) };
+					const PIXELij topLeft_pix{ determineTileTopLeft_pix_({ iterII, iterJJ }) };
+					const bool isInside{ topLeft_pix.ii >= 0 && topLeft_pix.ii + mTileArray.readTileHeight_pix() < mPanoramicHeight_pix &&
+										 topLeft_pix.jj >= 0 && topLeft_pix.jj + mTileArray.readTileWidth_pix() < mPanoramicScan.readFullWidth_pix() };
+					if (region == REGION::EMPTY && isInside)
+						region = REGION::BORDER;
+				}
+		}
 }
 
-double Action::MoveStage::readTileCenter(AXIS axis) const
+//For each strip, rescan the rows spanned by the non-empty tiles overlapping it. The segment is extended to even rows
+void AdaptivePanoramic::planSegments_()
 {
-	switch (axis)
+	const TILEDIM2 tileArraySizeIJ{ mTileArray.readTileArraySizeIJ() };
+	const int tileHeight_pix{ 2 * (mTileArray.readTileHeight_pix() / 2) };
+	const int tileWidth_pix{ 2 * (mTileArray.readTileWidth_pix() / 2) };
+	for (int iterStrip = 0; iterStrip < mNstrips; iterStrip++)
 	{
-	case AXIS::XX:
-		return mTileCenterXY.XX;
-	case AXIS::YY:
-		return mTileCenterXY.YY;
-	default:
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected stage axis unavailable");
+		const int stripLeft_pix{ iterStrip * mStripWidth_pix };
+		int top_pix{ mPanoramicHeight_pix };
+		int bottom_pix{ 0 };
+		for (int II = 0; II < tileArraySizeIJ.II; II++)
+			for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
+			{
+				if (mRegions.at(II * tileArraySizeIJ.JJ + JJ) == REGION::EMPTY)
+					continue;
+
+				const PIXELij topLeft_pix{ determineTileTopLeft_pix_({ II, JJ }) };
+				if (topLeft_pix.jj < stripLeft_pix + mStripWidth_pix && topLeft_pix.jj + tileWidth_pix > stripLeft_pix)
+				{
+					top_pix = (std::min)(top_pix, topLeft_pix.ii);
+					bottom_pix = (std::max)(bottom_pix, topLeft_pix.ii + tileHeight_pix);
+				}
+			}
+
+		if (bottom_pix > top_pix)
+		{
+			top_pix -= top_pix % 2;
+			bottom_pix = (std::min)(bottom_pix + bottom_pix % 2, mPanoramicHeight_pix);
+			if ((bottom_pix - top_pix) % 2)
+			{
+				if (top_pix > 0)
+					top_pix--;
+				else
+					bottom_pix--;
+			}
+
+			mSegmentIndexByStrip.at(iterStrip) = static_cast<int>(mSegments.size());
+			mSegments.push_back({ iterStrip, top_pix, bottom_pix - top_pix });
+		}
+	}
+}
+#pragma endregion "AdaptivePanoramic"
+
+#pragma region "Boolmap"
+//Lay a tile array over the center of the tiff. LOI is the length of interest
+//The tiff is copied, so the boolmap does not depend on its lifetime
+Boolmap::Boolmap(const TiffU8 &tiff, const TILEDIM2 tileArraySizeIJ, const PIXDIM2 tileSizeij_pix, const TILEOVERLAP3 overlapIJK_frac, const double threshold) :
+	mTiff{ new TiffU8{ tiff } },
+	mCanvas{ nullptr },
+	mPyramid{ nullptr },
+	mPyramidLevel{ 0 },
+	mTileArray{ tileSizeij_pix,
+				{ tileArraySizeIJ.II, tileArraySizeIJ.JJ },
+				overlapIJK_frac },
+	mThreshold{ threshold },
+	mPanoramicHeight_pix{ tiff.readHeightPerFrame_pix() },
+	mPanoramicWidth_pix{ tiff.readWidthPerFrame_pix() },
+	mNpixPanoramic{ tiff.readHeightPerFrame_pix() * tiff.readWidthPerFrame_pix() },
+	mAnchorPixel_pix{ tiff.readHeightPerFrame_pix() / 2,
+					  tiff.readWidthPerFrame_pix() / 2},				//Set the anchor pixels to the center of the image
+	mBoolmap{ tileArraySizeIJ }
+{
+	if (tileSizeij_pix.ii <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pixel tile height must be > 0");
+	if (tileSizeij_pix.jj <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pixel tile width must be > 0");
+	if (overlapIJK_frac.II < 0 || overlapIJK_frac.JJ < 0 || overlapIJK_frac.KK < 0 || overlapIJK_frac.II > 1 || overlapIJK_frac.JJ > 1 || overlapIJK_frac.KK > 1)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The stack overlap must be in the range [0-1]");
+	if (threshold < 0 || threshold > 1)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The threshold must be in the range [0-1]");
+
+	computeQuadrantSums_();
+	generateBoolmap_();
+}
+
+//The panoramic is not copied: it is read from the canvas of panoramicScan, which must outlive the boolmap
+Boolmap::Boolmap(const PanoramicScan &panoramicScan, const TILEDIM2 tileArraySizeIJ, const PIXDIM2 tileSizeij_pix, const TILEOVERLAP3 overlapIJK_frac, const double threshold):
+	mTiff{ nullptr },
+	mCanvas{ &panoramicScan.readCanvas() },
+	mPyramid{ nullptr },
+	mPyramidLevel{ 0 },
+	mTileArray{ tileSizeij_pix,
+				{ tileArraySizeIJ.II, tileArraySizeIJ.JJ },
+				overlapIJK_frac },
+	mThreshold{ threshold },
+	mPanoramicHeight_pix{ panoramicScan.readFullHeight_pix() },
+	mPanoramicWidth_pix{ panoramicScan.readFullWidth_pix() },
+	mNpixPanoramic{ panoramicScan.readFullHeight_pix() * panoramicScan.readFullWidth_pix() },
+	mAnchorPixel_pix{ panoramicScan.readFullHeight_pix() / 2,
+					  panoramicScan.readFullWidth_pix() / 2 },		//Set the anchor pixels to the center of the image
+	mBoolmap{ tileArraySizeIJ }
+{
+	if (tileSizeij_pix.ii <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pixel tile height must be > 0");
+	if (tileSizeij_pix.jj <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pixel tile width must be > 0");
+	if (overlapIJK_frac.II < 0 || overlapIJK_frac.JJ < 0 || overlapIJK_frac.KK < 0 || overlapIJK_frac.II > 1 || overlapIJK_frac.JJ > 1 || overlapIJK_frac.KK > 1)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The stack overlap must be in the range [0-1]");
+	if (threshold < 0 || threshold > 1)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The threshold must be in the range [0-1]");
+
+	computeQuadrantSums_();
+	generateBoolmap_();
+}
+
+//Generate the boolmap from a downsampled level of the panoramic. tileSize_pix is the tile size at full resolution and is scaled down to the chosen level
+//The level is not copied: it is read from the pyramid, which must outlive the boolmap
+Boolmap::Boolmap(const PanoramicPyramid &pyramid, const int level, const TILEDIM2 tileArraySizeIJ, const PIXDIM2 tileSizeij_pix, const TILEOVERLAP3 overlapIJK_frac, const double threshold) :
+	mTiff{ nullptr },
+	mCanvas{ nullptr },
+	mPyramid{ &pyramid },
+	mPyramidLevel{ level },
+	mTileArray{ { determineSizeAtLevel_pix_(tileSizeij_pix.ii, level), determineSizeAtLevel_pix_(tileSizeij_pix.jj, level) },
+				{ tileArraySizeIJ.II, tileArraySizeIJ.JJ },
+				overlapIJK_frac },
+	mThreshold{ threshold },
+	mPanoramicHeight_pix{ pyramid.readHeightAtLevel_pix(level) },
+	mPanoramicWidth_pix{ pyramid.readWidthAtLevel_pix(level) },
+	mNpixPanoramic{ pyramid.readHeightAtLevel_pix(level) * pyramid.readWidthAtLevel_pix(level) },
+	mAnchorPixel_pix{ pyramid.readHeightAtLevel_pix(level) / 2,
+					  pyramid.readWidthAtLevel_pix(level) / 2 },		//Set the anchor pixels to the center of the image
+	mBoolmap{ tileArraySizeIJ }
+{
+	if (determineSizeAtLevel_pix_(tileSizeij_pix.ii, level) < 2)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pixel tile height at the pyramid level must be >= 2");
+	if (determineSizeAtLevel_pix_(tileSizeij_pix.jj, level) < 2)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pixel tile width at the pyramid level must be >= 2");
+	if (overlapIJK_frac.II < 0 || overlapIJK_frac.JJ < 0 || overlapIJK_frac.KK < 0 || overlapIJK_frac.II > 1 || overlapIJK_frac.JJ > 1 || overlapIJK_frac.KK > 1)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The stack overlap must be in the range [0-1]");
+	if (threshold < 0 || threshold > 1)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The threshold must be in the range [0-1]");
+
+	computeQuadrantSums_();
+	generateBoolmap_();
+}
+
+//Take the boolmap computed while the panoramic was being acquired. The quadrant sums are only computed if the threshold is updated
+//The panoramic is not copied: it is read from the canvas of panoramicScan, which must outlive the boolmap
+Boolmap::Boolmap(const PanoramicScan &panoramicScan, const StreamingBoolmap &streamingBoolmap) :
+	mTiff{ nullptr },
+	mCanvas{ &panoramicScan.readCanvas() },
+	mPyramid{ nullptr },
+	mPyramidLevel{ 0 },
+	mTileArray{ streamingBoolmap.readTileSize_pix(),
+				streamingBoolmap.readTileArraySizeIJ(),
+				streamingBoolmap.readOverlapIJK_frac() },
+	mThreshold{ streamingBoolmap.readThreshold() },
+	mPanoramicHeight_pix{ panoramicScan.readFullHeight_pix() },
+	mPanoramicWidth_pix{ panoramicScan.readFullWidth_pix() },
+	mNpixPanoramic{ panoramicScan.readFullHeight_pix() * panoramicScan.readFullWidth_pix() },
+	mAnchorPixel_pix{ panoramicScan.readFullHeight_pix() / 2,
+					  panoramicScan.readFullWidth_pix() / 2 },		//Set the anchor pixels to the center of the image
+	mBoolmap{ streamingBoolmap.readBoolmap() }
+{
+	mNbrightStacks = mBoolmap.count();
+}
+
+//Indicate if a specific tile in the array is bright. The tile indices start form 0
+//II is the row index (along the image height) and JJ is the column index (along the image width) wrt the tile array
+bool Boolmap::isTileBright(const TILEIJ tileIndicesIJ) const
+{
+	if (tileIndicesIJ.II < 0 || tileIndicesIJ.II >= mTileArray.readTileArraySizeIJ(TileArray::Axis::II))
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The row index II must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::II) - 1) + "]");
+	if (tileIndicesIJ.JJ < 0 || tileIndicesIJ.JJ >= mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ))
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The column index JJ must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) - 1) + "]");
+
+	return mBoolmap.test(tileIndicesIJ);
+}
+
+//Save the boolmap as a text file
+void Boolmap::saveBoolmapToText(const std::string folderPath, std::string filename, const OVERRIDE override)
+{
+	mBoolmap.saveToText(folderPath, filename, override);
+}
+
+//Overlay a grid with the tiles on the stitched image
+//The image is drawn and saved one band of rows at a time, so that the overlay does not take a full copy of the panoramic
+void Boolmap::saveTiffWithBoolmapGridOverlay(const std::string folderPath, std::string filename, const OVERRIDE override) const
+{
+	const U8 lineColor{ 200 };
+	const int lineThickness{ 6 };
+	//const double lineThicknessFactor{ 0.1 };//If too small (<0.7), the grid will not show properly on ImageJ
+	//const int lineThicknessVertical{ static_cast<int>(lineThicknessFactor * mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ)) };
+	//const int lineThicknessHorizontal{ static_cast<int>(lineThicknessFactor * mTileArray.readTileArraySizeIJ(TileArray::Axis::II)) };
+
+	//Rows of the horizontal lines. II is the row index (along the image height) wrt the tile array
+	std::vector<int> vec_lineRow_pix;
+	for (int II = 0; II < mTileArray.readTileArraySizeIJ(TileArray::Axis::II); II++)
+	{
+		const PIXELij tileCenterPos_pix{ determineTilePosWrtPanoramic_pix_({ II, 0 }) };					//Tile center position wrt the Tiff		
+		const int tileTopPos_pix{ tileCenterPos_pix.ii - mTileArray.readTileHeight_pix() / 2 };				//Top pixels of the tile wrt the Tiff
+		const int tileBottomPos_pix{ tileCenterPos_pix.ii + mTileArray.readTileHeight_pix() / 2 };			//Bottom pixels of the tile wrt the Tiff
+
+		if (tileTopPos_pix >= 0 && tileBottomPos_pix < mPanoramicHeight_pix)								//Make sure that the pixels lie inside the panoramic tiff
+			for (int iterThickness = -lineThickness / 2; iterThickness < lineThickness / 2; iterThickness++)
+			{
+				vec_lineRow_pix.push_back(tileTopPos_pix + iterThickness);
+				vec_lineRow_pix.push_back(tileBottomPos_pix + iterThickness);
+			}
+	}
+
+	//Columns of the vertical lines. JJ is the column index (along the image width) wrt the tile array
+	std::vector<int> vec_lineCol_pix;
+	for (int JJ = 0; JJ < mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ); JJ++)
+	{
+		const PIXELij tileCenterPos_pix{ determineTilePosWrtPanoramic_pix_({ 0, JJ }) };					//Tile center position wrt the Tiff
+		const int tileLeftPos_pix{ tileCenterPos_pix.jj - mTileArray.readTileWidth_pix() / 2 };				//Left pixels of the tile wrt the Tiff
+		const int tileRightPos_pix{ tileCenterPos_pix.jj + mTileArray.readTileWidth_pix() / 2 };			//Right pixels of the tile wrt the Tiff
+
+		if (tileLeftPos_pix >= 0 && tileRightPos_pix < mPanoramicWidth_pix)									//Make sure that the pixels lie inside the panoramic tiff
+			for (int iterThickness = -lineThickness / 2; iterThickness < lineThickness / 2; iterThickness++)
+			{
+				vec_lineCol_pix.push_back(tileLeftPos_pix + iterThickness);
+				vec_lineCol_pix.push_back(tileRightPos_pix + iterThickness);
+			}
+	}
+
+	saveTiffByBands_(folderPath, filename, override, [&](U8 *band, const int bandTop_pix, const int nRows)
+	{
+		readRect_(band, mPanoramicWidth_pix, bandTop_pix, 0, nRows, mPanoramicWidth_pix);	//Draw the grid on a copy of the image
+
+		for (const auto &lineRow_pix : vec_lineRow_pix)
+			if (lineRow_pix >= bandTop_pix && lineRow_pix < bandTop_pix + nRows)
+				std::fill_n(&band[static_cast<std::size_t>(lineRow_pix - bandTop_pix) * mPanoramicWidth_pix], mPanoramicWidth_pix, lineColor);
+
+		for (int iterRow_pix = 0; iterRow_pix < nRows; iterRow_pix++)
+			for (const auto &lineCol_pix : vec_lineCol_pix)
+				if (lineCol_pix >= 0 && lineCol_pix < mPanoramicWidth_pix)								//Make sure that the pixel is inside the Tiff
+					band[static_cast<std::size_t>(iterRow_pix) * mPanoramicWidth_pix + lineCol_pix] = lineColor;
+	});
+}
+
+//Save a copy of the input Tiff with the dark tiles shaded
+//The image is drawn and saved one band of rows at a time, so that the overlay does not take a full copy of the panoramic
+void Boolmap::saveTiffWithBoolmapTileOverlay(const std::string folderPath, std::string filename, const OVERRIDE override) const
+{
+	const U8 pixelColor{ 200 };	//Shade the Tiff with a chosen grey level
+
+	saveTiffByBands_(folderPath, filename, override, [&](U8 *band, const int bandTop_pix, const int nRows)
+	{
+		std::fill_n(band, static_cast<std::size_t>(nRows) * mPanoramicWidth_pix, pixelColor);
+
+		//II is the row index (along the image height) and JJ is the column index (along the image width) wrt the tile array
+		for (int II = 0; II < mTileArray.readTileArraySizeIJ(TileArray::Axis::II); II++)
+			for (int JJ = 0; JJ < mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ); JJ++)
+				if (isTileBright({ II, JJ }))	//If the tile is bright, copy the pixels from the image
+				{
+					const PIXELij tileCenterPos_pix{ determineTilePosWrtPanoramic_pix_({ II, JJ }) };	//Tile center position wrt the Tiff anchor pixel
+					const int tileTopPos_pix{ (std::max)(tileCenterPos_pix.ii - mTileArray.readTileHeight_pix() / 2, bandTop_pix) };	//Clip the tile to the band
+					const int tileBottomPos_pix{ (std::min)(tileCenterPos_pix.ii - mTileArray.readTileHeight_pix() / 2 + mTileArray.readTileHeight_pix(), bandTop_pix + nRows) };
+					const int tileLeftPos_pix{ (std::max)(tileCenterPos_pix.jj - mTileArray.readTileWidth_pix() / 2, 0) };
+					const int tileRightPos_pix{ (std::min)(tileCenterPos_pix.jj - mTileArray.readTileWidth_pix() / 2 + mTileArray.readTileWidth_pix(), mPanoramicWidth_pix) };
+
+					if (tileBottomPos_pix > tileTopPos_pix && tileRightPos_pix > tileLeftPos_pix)
+						readRect_(&band[static_cast<std::size_t>(tileTopPos_pix - bandTop_pix) * mPanoramicWidth_pix + tileLeftPos_pix], mPanoramicWidth_pix, tileTopPos_pix, tileLeftPos_pix, tileBottomPos_pix - tileTopPos_pix, tileRightPos_pix - tileLeftPos_pix);
+				}
+	});
+}
+
+//Save an image of the size of the panoramic as a single-page Tiff, as TiffU8::saveToFile() does. drawBand(band, bandTop_pix, nRows) fills the rows [bandTop_pix, bandTop_pix + nRows)
+void Boolmap::saveTiffByBands_(const std::string folderPath, std::string filename, const OVERRIDE override, const std::function<void(U8 *band, const int bandTop_pix, const int nRows)> drawBand) const
+{
+	if (override == OVERRIDE::DIS)
+		filename = Util::doesFileExist(folderPath, filename, ".tif");	//Check if the file exits. It gives some overhead
+
+	TIFF *tiffHandle{ TIFFOpen((folderPath + filename + ".tif").c_str(), "w") };
+
+	if (tiffHandle == nullptr)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": Saving " + filename + ".tif failed");
+
+	//TAGS
+	TIFFSetField(tiffHandle, TIFFTAG_IMAGELENGTH, mPanoramicHeight_pix);									//Set the pixel height of the image
+	TIFFSetField(tiffHandle, TIFFTAG_IMAGEWIDTH, mPanoramicWidth_pix);										//Set the pixel width of the image
+	TIFFSetField(tiffHandle, TIFFTAG_SAMPLESPERPIXEL, 1);													//Set number of channels per pixel
+	TIFFSetField(tiffHandle, TIFFTAG_BITSPERSAMPLE, 8);														//Set the size of the channels
+	TIFFSetField(tiffHandle, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);										//Set the origin of the image
+	TIFFSetField(tiffHandle, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);									//Single channel with min as black
+	TIFFSetField(tiffHandle, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tiffHandle, mPanoramicWidth_pix));	//Set the strip size of the file to be size of one row of pixels
+
+	const int bandHeight_pix{ 256 };
+	std::vector<U8> band(static_cast<std::size_t>(bandHeight_pix) * mPanoramicWidth_pix);
+	for (int bandTop_pix = 0; bandTop_pix < mPanoramicHeight_pix; bandTop_pix += bandHeight_pix)
+	{
+		const int nRows{ (std::min)(bandHeight_pix, mPanoramicHeight_pix - bandTop_pix) };
+		drawBand(band.data(), bandTop_pix, nRows);
+		for (int iterRow_pix = 0; iterRow_pix < nRows; iterRow_pix++)
+			if (TIFFWriteScanline(tiffHandle, &band[static_cast<std::size_t>(iterRow_pix) * mPanoramicWidth_pix], bandTop_pix + iterRow_pix, 0) < 0)
+			{
+				TIFFClose(tiffHandle);
+				throw std::runtime_error((std::string)__FUNCTION__ + ": Writing a row to " + filename + ".tif failed");
+			}
+	}
+	TIFFClose(tiffHandle);
+
+	std::cout << "Successfully saved: " << filename << ".tif\n";
+}
+
+//Size of a full-resolution length at a pyramid level. Rounded up like the sizes of the levels, so that odd sizes are not truncated
+int Boolmap::determineSizeAtLevel_pix_(const int size_pix, const int level)
+{
+	return (size_pix + (1 << level) - 1) >> level;
+}
+
+//Overlay the tile array on top of the panoramic
+//The center of the tile array is fixed to the anchor pixel of the panoramic
+//The pixels are wrt the origin of the panoramix, i.e., the top-left corner of the tiff
+PIXELij Boolmap::determineTilePosWrtPanoramic_pix_(const TILEIJ tileIndicesIJ) const
+{
+	if (tileIndicesIJ.II < 0 || tileIndicesIJ.II >= mTileArray.readTileArraySizeIJ(TileArray::Axis::II))
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The row index II must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::II) - 1) + "]");
+	if (tileIndicesIJ.JJ < 0 || tileIndicesIJ.JJ >= mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ))
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The column index JJ must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) - 1) + "]");
+
+	return { mAnchorPixel_pix.ii + mTileArray.determineTilePosWrtCenterTileArray_pix(tileIndicesIJ).ii,
+			 mAnchorPixel_pix.jj + mTileArray.determineTilePosWrtCenterTileArray_pix(tileIndicesIJ).jj };
+}
+
+//Take the first frame of the stack and return true if it's bright. Divide the image in quadrants for a better sensitivity
+//II is the row index (along the image height) and JJ is the column index (along the image width) wrt the tile array. II and JJ start from 0
+bool Boolmap::isQuadrantBright_(const double threshold, const TILEIJ tileIndicesIJ) const
+{
+	if (threshold < 0 || threshold > 1)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The threshold must be in the range [0-1]");
+	if (tileIndicesIJ.II < 0 || tileIndicesIJ.II >= mTileArray.readTileArraySizeIJ(TileArray::Axis::II))
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile row index II must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::II) - 1) + "]");
+	if (tileIndicesIJ.JJ < 0 || tileIndicesIJ.JJ >= mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ))
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile column index JJ must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) - 1) + "]");
+
+	const int threshold_255{ static_cast<int>(threshold * 255) };		//Threshold in the range [0-255]
+
+	//Divide the image in 4 quadrants
+	const PIXELij tileCenterPos_pix{ determineTilePosWrtPanoramic_pix_(tileIndicesIJ) };	//Tile center position wrt the Tiff anchor pixel
+	const int halfHeight{ mTileArray.readTileHeight_pix() / 2 };
+	const int halfwidth{ mTileArray.readTileWidth_pix() / 2 };
+	const int tileTopPos_pix{ tileCenterPos_pix.ii - halfHeight };
+	const int tileBottomPos_pix{ tileCenterPos_pix.ii + halfHeight };
+	const int tileLeftPos_pix{ tileCenterPos_pix.jj - halfwidth };
+	const int tileRightPos_pix{ tileCenterPos_pix.jj + halfwidth };
+
+	//Make sure that the pixels lie inside the panoramic tiff
+	if (tileTopPos_pix >= 0 && tileBottomPos_pix < mPanoramicHeight_pix && tileLeftPos_pix >= 0 && tileRightPos_pix < mPanoramicWidth_pix)
+	{
+		//Iterate over the 4 quadrants. Start from the top-left quadrant. Scan from left to right, then go back and scan the second row from left to right
+		//The quadrant sums are precomputed, so the cost does not depend on the tile size or on the tile overlap
+		std::vector<double> vec_sum;	//Vector of the average count for each quadrant
+		const int nPixQuad{ halfHeight * halfwidth };
+		const std::size_t tileIndex{ static_cast<std::size_t>(tileIndicesIJ.II) * mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) + tileIndicesIJ.JJ };
+		for (int iterQuad = 0; iterQuad < 4; iterQuad++)
+			vec_sum.push_back(1. * mQuadrantSums.at(4 * tileIndex + iterQuad) / nPixQuad);
+
+		const double sumTL{ 1. * vec_sum.at(0) };	//Average count top-left
+		const double sumTR{ 1. * vec_sum.at(1) };	//Average count top-right
+		const double sumBL{ 1. * vec_sum.at(2) };	//Average count bottom-left
+		const double sumBR{ 1. * vec_sum.at(3) };	//Average count bottom-right
+
+		/*
+		//For debuging
+		std::cout << "Average count TL = " << sumTL << "\n";
+		std::cout << "Average count TR = " << sumTR << "\n";
+		std::cout << "Average count BL = " << sumBL << "\n";
+		std::cout << "Average count BR = " << sumBR << "\n";
+		*/
+		return (sumTL > threshold_255 || sumTR > threshold_255 || sumBL > threshold_255 || sumBR > threshold_255);
+	}
+	else
+		return false;
+}
+
+//Copy a rectangle of the image to the output
+void Boolmap::readRect_(U8 *output, const int outputBytesPerRow, const int top_pix, const int left_pix, const int height_pix, const int width_pix) const
+{
+	if (mCanvas != nullptr)
+		mCanvas->readRect(output, outputBytesPerRow, top_pix, left_pix, height_pix, width_pix);
+	else if (mPyramid != nullptr)
+		mPyramid->readRect(mPyramidLevel, output, outputBytesPerRow, top_pix, left_pix, height_pix, width_pix);
+	else
+		for (int iterRow_pix = 0; iterRow_pix < height_pix; iterRow_pix++)
+			std::memcpy(&output[static_cast<std::size_t>(iterRow_pix) * outputBytesPerRow], &mTiff->data()[static_cast<std::size_t>(top_pix + iterRow_pix) * mPanoramicWidth_pix + left_pix], width_pix * sizeof(U8));
+}
+
+//Sum the quadrants of the tiles that lie inside the panoramic, one row of tiles at a time
+//For each half of a row of tiles, the rows of pixels are added up into a line of column sums, and the running sum along that line gives each quadrant sum as a difference
+//Only a band of rows and a line of the panoramic width are held in memory. U32 arithmetic wraps around, but the sum of a quadrant smaller than 2^32/255 pixels comes out exact
+void Boolmap::computeQuadrantSums_()
+{
+	const TILEDIM2 tileArraySizeIJ{ mTileArray.readTileArraySizeIJ() };
+	const int halfHeight{ mTileArray.readTileHeight_pix() / 2 };
+	const int halfWidth{ mTileArray.readTileWidth_pix() / 2 };
+	mQuadrantSums.assign(4 * static_cast<std::size_t>(tileArraySizeIJ.II) * tileArraySizeIJ.JJ, 0);
+
+	const int bandHeight_pix{ (std::max)((std::min)(256, halfHeight), 1) };
+	std::vector<U8> band(static_cast<std::size_t>(bandHeight_pix) * mPanoramicWidth_pix);
+	std::vector<U32> runningSum(mPanoramicWidth_pix + 1);		//runningSum[jj + 1] is the sum of the columns up to jj, included
+	const int blockWidth_pix{ 256 };
+	const int nBlocks{ (mPanoramicWidth_pix + blockWidth_pix - 1) / blockWidth_pix };
+
+	for (int II = 0; II < tileArraySizeIJ.II; II++)
+	{
+		const int tileTopPos_pix{ determineTilePosWrtPanoramic_pix_({ II, 0 }).ii - halfHeight };
+		if (tileTopPos_pix < 0 || tileTopPos_pix + 2 * halfHeight >= mPanoramicHeight_pix)	//Same bounds as in isQuadrantBright_()
+			continue;
+
+		for (int iterQuadRow = 0; iterQuadRow < 2; iterQuadRow++)
+		{
+			std::fill(runningSum.begin(), runningSum.end(), 0);
+			const int quadTop_pix{ tileTopPos_pix + iterQuadRow * halfHeight };
+			for (int bandTop_pix = quadTop_pix; bandTop_pix < quadTop_pix + halfHeight; bandTop_pix += bandHeight_pix)
+			{
+				const int nRows{ (std::min)(bandHeight_pix, quadTop_pix + halfHeight - bandTop_pix) };
+				readRect_(band.data(), mPanoramicWidth_pix, bandTop_pix, 0, nRows, mPanoramicWidth_pix);
+
+				//Add up the rows in parallel over blocks of columns. The inner loop is contiguous for vectorization
+#pragma omp parallel for schedule(static)
+				for (int iterBlock = 0; iterBlock < nBlocks; iterBlock++)
+				{
+					const int firstCol_pix{ iterBlock * blockWidth_pix };
+					const int lastCol_pix{ (std::min)(firstCol_pix + blockWidth_pix, mPanoramicWidth_pix) };
+					for (int iterRow_pix = 0; iterRow_pix < nRows; iterRow_pix++)
+					{
+						const U8* const inputRow{ &band[static_cast<std::size_t>(iterRow_pix) * mPanoramicWidth_pix] };
+						for (int iterCol_pix = firstCol_pix; iterCol_pix < lastCol_pix; iterCol_pix++)
+							runningSum[iterCol_pix + 1] += inputRow[iterCol_pix];
+					}
+				}
+			}
+			for (int iterCol_pix = 0; iterCol_pix < mPanoramicWidth_pix; iterCol_pix++)
+				runningSum[iterCol_pix + 1] += runningSum[iterCol_pix];
+
+			for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
+			{
+				const int tileLeftPos_pix{ determineTilePosWrtPanoramic_pix_({ II, JJ }).jj - halfWidth };
+				if (tileLeftPos_pix < 0 || tileLeftPos_pix + 2 * halfWidth >= mPanoramicWidth_pix)
+					continue;
+
+				const std::size_t tileIndex{ static_cast<std::size_t>(II) * tileArraySizeIJ.JJ + JJ };
+				for (int iterQuadCol = 0; iterQuadCol < 2; iterQuadCol++)
+				{
+					const int quadLeft_pix{ tileLeftPos_pix + iterQuadCol * halfWidth };
+					mQuadrantSums.at(4 * tileIndex + 2 * iterQuadRow + iterQuadCol) = runningSum[quadLeft_pix + halfWidth] - runningSum[quadLeft_pix];
+				}
+			}
+		}
+	}
+}
+
+void Boolmap::generateBoolmap_()
+{
+	//Divide the image into tiles of size tileHeight_pix * tileWidth_pix and return an array of tiles indicating if the tile is bright (TRUE) or dark (FALSE)
+	//Start scanning the tiles from the top-left corner of the image. Scan the first row from left to right. Go back and scan the second row from left to right. Etc...
+	mBoolmap.assign(false);
+	const TILEDIM2 tileArraySizeIJ{ mTileArray.readTileArraySizeIJ() };
+	for (int II = 0; II < tileArraySizeIJ.II; II++)
+		for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
+			if (isQuadrantBright_(mThreshold, { II, JJ }))
+				mBoolmap.set({ II, JJ });
+	mNbrightStacks = mBoolmap.count();
+}
+
+//Regenerate the boolmap with a new threshold. The quadrant sums are reused, so sweeping the threshold is cheap. The holes filled before are discarded
+void Boolmap::updateThreshold(const double threshold)
+{
+	if (threshold < 0 || threshold > 1)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The threshold must be in the range [0-1]");
+
+	mThreshold = threshold;
+	if (mQuadrantSums.empty())
+		computeQuadrantSums_();
+	generateBoolmap_();
+}
+
+//Fill the tiles that lie between bright tiles in both the same row and the same column
+void Boolmap::fillBoolmapHoles()
+{
+	mBoolmap.fillHoles();
+	mNbrightStacks = mBoolmap.count();
+}
+
+void Boolmap::replaceInputBoolmapByUnion(TileBitmap &input) const
+{
+	input |= mBoolmap;
+}
+
+const TileBitmap& Boolmap::readBoolmap() const
+{
+	return mBoolmap;
+}
+
+int Boolmap::readNumberOfBrightStacks() const
+{
+	return mNbrightStacks;
+}
+#pragma endregion "Boolmap"
+
+#pragma region "BoolmapPredictor"
+BoolmapPredictor::BoolmapPredictor(const TILEDIM2 tileArraySizeIJ, const PIXDIM2 tileSize_pix, const int nFrames, const int nFramesBelowCut, const double threshold, const int margin_tiles) :
+	mTileArraySizeIJ{ tileArraySizeIJ },
+	mTileSize_pix{ tileSize_pix },
+	mNframes{ nFrames },
+	mNframesBelowCut{ nFramesBelowCut },
+	mThreshold_255{ static_cast<int>(threshold * 255) },
+	mMargin_tiles{ margin_tiles },
+	mBright{ tileArraySizeIJ }
+{
+	if (mTileArraySizeIJ.II <= 0 || mTileArraySizeIJ.JJ <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile array size must be > 0");
+	if (mTileSize_pix.ii < 2 || mTileSize_pix.jj < 2)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile size must be >= 2 pixels");
+	if (mNframes <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The number of frames must be > 0");
+	if (mNframesBelowCut <= 0 || mNframesBelowCut > mNframes)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The number of frames below the cut must be in the range [1-" + std::to_string(mNframes) + "]");
+	if (threshold < 0 || threshold > 1)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The threshold must be in the range [0-1]");
+	if (mMargin_tiles < 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The margin must be >= 0");
+}
+
+//The frames of 'stack' are in the order of acquisition. For an UPWARD scan, the first frame is at the top of the stack; for a DOWNWARD scan, it is at the bottom
+//A stack read from disk is always ordered from the top (see TiffU8::saveToFile), so pass SCANDIR::UPWARD
+void BoolmapPredictor::addStack(const U8 *stack, const SCANDIR scanDirZ, const TILEIJ tileIndicesIJ)
+{
+	if (stack == nullptr)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The stack is null");
+	if (tileIndicesIJ.II < 0 || tileIndicesIJ.II >= mTileArraySizeIJ.II)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile row index II must be in the range [0-" + std::to_string(mTileArraySizeIJ.II - 1) + "]");
+	if (tileIndicesIJ.JJ < 0 || tileIndicesIJ.JJ >= mTileArraySizeIJ.JJ)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile column index JJ must be in the range [0-" + std::to_string(mTileArraySizeIJ.JJ - 1) + "]");
+
+	int firstFrame;
+	switch (scanDirZ)
+	{
+	case SCANDIR::UPWARD:
+		firstFrame = mNframes - mNframesBelowCut;
+		break;
+	case SCANDIR::DOWNWARD:
+		firstFrame = 0;
+		break;
+	default:
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Invalid scan direction");
+	}
+
+	const std::size_t nPixPerFrame{ static_cast<std::size_t>(mTileSize_pix.ii) * mTileSize_pix.jj };
+	bool isBright{ false };
+	for (int iterFrame = firstFrame; iterFrame < firstFrame + mNframesBelowCut && !isBright; iterFrame++)
+		isBright = isFrameBright_(&stack[iterFrame * nPixPerFrame]);
+
+	//Several wavelengths may be acquired at the same tile. The tile is bright if any of them is
+	if (isBright)
+		mBright.set(tileIndicesIJ);
+	mNobservedStacks++;
+}
+
+//Dilate the bright tiles by mMargin_tiles in II and JJ
+TileBitmap BoolmapPredictor::readPrediction() const
+{
+	TileBitmap prediction{ mBright };
+	prediction.dilate(mMargin_tiles);
+	return prediction;
+}
+
+int BoolmapPredictor::readNumberOfObservedStacks() const
+{
+	return mNobservedStacks;
+}
+
+void BoolmapPredictor::savePredictionToText(const std::string folderPath, std::string filename, const OVERRIDE override) const
+{
+	readPrediction().saveToText(folderPath, filename, override);
+}
+
+//Start over for the next cut
+void BoolmapPredictor::reset()
+{
+	mBright.assign(false);
+	mNobservedStacks = 0;
+}
+
+//Same criterion as in Boolmap: the frame is bright if the average count of any of its 4 quadrants is above the threshold
+bool BoolmapPredictor::isFrameBright_(const U8 *frame) const
+{
+	const int halfHeight{ mTileSize_pix.ii / 2 };
+	const int halfWidth{ mTileSize_pix.jj / 2 };
+	const int nPixQuad{ halfHeight * halfWidth };
+
+	U32 sumQuad[2][2]{ { 0, 0 }, { 0, 0 } };
+	for (int iterRow_pix = 0; iterRow_pix < 2 * halfHeight; iterRow_pix++)
+	{
+		const U8 *row{ &frame[static_cast<std::size_t>(iterRow_pix) * mTileSize_pix.jj] };
+		U32 sumLeft{ 0 }, sumRight{ 0 };
+		for (int iterCol_pix = 0; iterCol_pix < halfWidth; iterCol_pix++)
+			sumLeft += row[iterCol_pix];
+		for (int iterCol_pix = halfWidth; iterCol_pix < 2 * halfWidth; iterCol_pix++)
+			sumRight += row[iterCol_pix];
+		sumQuad[iterRow_pix / halfHeight][0] += sumLeft;
+		sumQuad[iterRow_pix / halfHeight][1] += sumRight;
+	}
+
+	for (int iterQuadRow = 0; iterQuadRow < 2; iterQuadRow++)
+		for (int iterQuadCol = 0; iterQuadCol < 2; iterQuadCol++)
+			if (1. * sumQuad[iterQuadRow][iterQuadCol] / nPixQuad > mThreshold_255)
+				return true;
+	return false;
+}
+#pragma endregion "BoolmapPredictor"
+
+#pragma region "TilePathPlanner"
+//The tile centers are (1-a)*FFOV away from each other, where a*L is the tile overlap
+TilePathPlanner::TilePathPlanner(const FFOV2 FFOV, const TILEOVERLAP3 overlapIJK_frac, const StageKinematics kinematics) :
+	mTilePitchXY{ (1. - overlapIJK_frac.II) * FFOV.XX, (1. - overlapIJK_frac.JJ) * FFOV.YY },
+	mKinematics{ kinematics },
+	mPollLoopDuration{ 3 * kinematics.mPollDuration }
+{
+	if (FFOV.XX <= 0 || FFOV.YY <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The FFOV must be > 0");
+	if (overlapIJK_frac.II < 0 || overlapIJK_frac.JJ < 0 || overlapIJK_frac.II >= 1 || overlapIJK_frac.JJ >= 1)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The stack overlap must be in the range [0-1)");
+	if (mKinematics.mVelX <= 0 || mKinematics.mVelY <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The stage velocity must be > 0");
+	if (mKinematics.mAccX <= 0 || mKinematics.mAccY <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The stage acceleration must be > 0");
+	if (mKinematics.mCommandLatency < 0 || mKinematics.mPollDuration <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The command latency must be >= 0 and the poll duration > 0");
+}
+
+//Both stages move at the same time. The move ends when the slowest stage stops and waitForMotionToStopAll notices it
+double TilePathPlanner::predictMoveTime(const TILEIJ fromTileIJ, const TILEIJ toTileIJ) const
+{
+	const double motionTimeX{ determineMotionTime_(std::abs(toTileIJ.II - fromTileIJ.II) * mTilePitchXY.XX, mKinematics.mVelX, mKinematics.mAccX) };
+	const double motionTimeY{ determineMotionTime_(std::abs(toTileIJ.JJ - fromTileIJ.JJ) * mTilePitchXY.YY, mKinematics.mVelY, mKinematics.mAccY) };
+
+	return determineCost_(motionTimeX, motionTimeY);
+}
+
+//Replay Stage::waitForMotionToStopAll: the X, Y, and Z-stages are polled in turn until none of them reports moving. The Z-stage does not move between tiles
+double TilePathPlanner::simulateMoveTime(const TILEIJ fromTileIJ, const TILEIJ toTileIJ) const
+{
+	const double motionTimeX{ determineMotionTime_(std::abs(toTileIJ.II - fromTileIJ.II) * mTilePitchXY.XX, mKinematics.mVelX, mKinematics.mAccX) };
+	const double motionTimeY{ determineMotionTime_(std::abs(toTileIJ.JJ - fromTileIJ.JJ) * mTilePitchXY.YY, mKinematics.mVelY, mKinematics.mAccY) };
+
+	double time{ mKinematics.mCommandLatency };				//The stages start moving when the move command returns
+	bool isMovingX, isMovingY;
+	do {
+		time += mKinematics.mPollDuration;
+		isMovingX = time < mKinematics.mCommandLatency + motionTimeX;
+		time += mKinematics.mPollDuration;
+		isMovingY = time < mKinematics.mCommandLatency + motionTimeY;
+		time += mKinematics.mPollDuration;					//Stage Z
+	} while (isMovingX || isMovingY);
+
+	return time;
+}
+
+//The time for moving to the first tile of the path is not included
+double TilePathPlanner::predictPathTime(const std::vector<TILEIJ> &tilePath) const
+{
+	double time{ 0 };
+	for (std::vector<TILEIJ>::size_type iterTile = 1; iterTile < tilePath.size(); iterTile++)
+		time += predictMoveTime(tilePath.at(iterTile - 1), tilePath.at(iterTile));
+	return time;
+}
+
+double TilePathPlanner::simulatePathTime(const std::vector<TILEIJ> &tilePath) const
+{
+	double time{ 0 };
+	for (std::vector<TILEIJ>::size_type iterTile = 1; iterTile < tilePath.size(); iterTile++)
+		time += simulateMoveTime(tilePath.at(iterTile - 1), tilePath.at(iterTile));
+	return time;
+}
+
+//Same as predictMoveTime() between any two positions, e.g. from the panoramic scan to the first tile of a cut
+double TilePathPlanner::predictTravelTime(const POSITION2 fromXY, const POSITION2 toXY) const
+{
+	const double motionTimeX{ determineMotionTime_(std::abs(toXY.XX - fromXY.XX), mKinematics.mVelX, mKinematics.mAccX) };
+	const double motionTimeY{ determineMotionTime_(std::abs(toXY.YY - fromXY.YY), mKinematics.mVelY, mKinematics.mAccY) };
+
+	return determineCost_(motionTimeX, motionTimeY);
+}
+
+//Reorder the tiles of tilePath. The first tile is kept in place, so that the planned path can be compared against the current one
+//2-opt only considers reversing the segments of the path that are at most window2opt tiles long
+//Return the current path if the planned path is not predicted to be faster
+std::vector<TILEIJ> TilePathPlanner::planPath(const std::vector<TILEIJ> &tilePath, const int window2opt, const int maxPasses2opt) const
+{
+	if (window2opt < 2)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The 2-opt window must be >= 2");
+	if (maxPasses2opt < 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The number of 2-opt passes must be >= 0");
+
+	if (tilePath.size() < 3)
+		return tilePath;
+
+	std::vector<TILEIJ> plannedPath{ planNearestNeighbor_(tilePath) };
+	improve2opt_(plannedPath, window2opt, maxPasses2opt);
+
+	if (predictPathTime(plannedPath) < predictPathTime(tilePath))
+		return plannedPath;
+	return tilePath;
+}
+
+//Trapezoidal velocity profile. The profile is triangular if the stage does not reach the velocity vel
+double TilePathPlanner::determineMotionTime_(const double distance, const double vel, const double acc) const
+{
+	if (distance <= 0)
+		return 0;
+	if (distance < vel * vel / acc)
+		return 2 * std::sqrt(distance / acc);
+	return distance / vel + vel / acc;
+}
+
+//Smooth version of simulateMoveTime for planning. waitForMotionToStopAll runs at least once. The X-stage is polled 1 poll into each loop and the Y-stage 2 polls into it,
+//and on average a stage is seen stopped half a loop after it stops
+double TilePathPlanner::determineCost_(const double motionTimeX, const double motionTimeY) const
+{
+	const double delayX{ motionTimeX - mKinematics.mPollDuration + mPollLoopDuration / 2 };
+	const double delayY{ motionTimeY - 2 * mKinematics.mPollDuration + mPollLoopDuration / 2 };
+	return mKinematics.mCommandLatency + mPollLoopDuration + (std::max)({ 0., delayX, delayY });
+}
+
+//Search the nearest pending tile ring by ring around the current tile. A tile in the ring 'ring' is at least 'ring' tiles away in II or in JJ,
+//which bounds the cost from below and stops the search
+std::vector<TILEIJ> TilePathPlanner::planNearestNeighbor_(const std::vector<TILEIJ> &tilePath) const
+{
+	int nRows{ 0 }, nCols{ 0 };
+	for (const TILEIJ &tileIJ : tilePath)
+	{
+		if (tileIJ.II < 0 || tileIJ.JJ < 0)
+			throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile indices must be >= 0");
+		nRows = (std::max)(nRows, tileIJ.II + 1);
+		nCols = (std::max)(nCols, tileIJ.JJ + 1);
+	}
+
+	std::vector<bool> isPending(static_cast<std::size_t>(nRows) * nCols, false);
+	for (const TILEIJ &tileIJ : tilePath)
+	{
+		if (isPending.at(static_cast<std::size_t>(tileIJ.II) * nCols + tileIJ.JJ))
+			throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile (" + std::to_string(tileIJ.II) + "," + std::to_string(tileIJ.JJ) + ") is repeated");
+		isPending.at(static_cast<std::size_t>(tileIJ.II) * nCols + tileIJ.JJ) = true;
+	}
+
+	std::vector<TILEIJ> plannedPath;
+	plannedPath.reserve(tilePath.size());
+	TILEIJ currentTileIJ{ tilePath.front() };
+	isPending.at(static_cast<std::size_t>(currentTileIJ.II) * nCols + currentTileIJ.JJ) = false;
+	plannedPath.push_back(currentTileIJ);
+
+	const int maxRing{ (std::max)(nRows, nCols) };
+	while (plannedPath.size() < tilePath.size())
+	{
+		double minCost{ (std::numeric_limits<double>::max)() };
+		TILEIJ nearestTileIJ{ -1, -1 };
+		for (int iterRing = 1; iterRing < maxRing; iterRing++)
+		{
+			const double ringCost{ (std::min)(determineCost_(determineMotionTime_(iterRing * mTilePitchXY.XX, mKinematics.mVelX, mKinematics.mAccX), 0),
+											  determineCost_(0, determineMotionTime_(iterRing * mTilePitchXY.YY, mKinematics.mVelY, mKinematics.mAccY))) };
+			if (ringCost >= minCost)
+				break;
+
+			for (int iterII = (std::max)(0, currentTileIJ.II - iterRing); iterII <= (std::min)(nRows - 1, currentTileIJ.II + iterRing); iterII++)
+			{
+				//Only visit the perimeter of the ring
+				const int stepJJ{ std::abs(iterII - currentTileIJ.II) == iterRing ? 1 : 2 * iterRing };
+				for (int iterJJ = currentTileIJ.JJ - iterRing; iterJJ <= currentTileIJ.JJ + iterRing; iterJJ += stepJJ)
+				{
+					if (iterJJ < 0 || iterJJ >= nCols || !isPending.at(static_cast<std::size_t>(iterII) * nCols + iterJJ))
+						continue;
+
+					const double cost{ predictMoveTime(currentTileIJ, { iterII, iterJJ }) };
+					if (cost < minCost)
+					{
+						minCost = cost;
+						nearestTileIJ = { iterII, iterJJ };
+					}
+				}
+			}
+		}
+		currentTileIJ = nearestTileIJ;
+		isPending.at(static_cast<std::size_t>(currentTileIJ.II) * nCols + currentTileIJ.JJ) = false;
+		plannedPath.push_back(currentTileIJ);
+	}
+	return plannedPath;
+}
+
+//Replace the moves (i,i+1) and (j,j+1) by (i,j) and (i+1,j+1) by reversing the tiles i+1 to j. The path is open, so the last tile has no outgoing move
+void TilePathPlanner::improve2opt_(std::vector<TILEIJ> &tilePath, const int window, const int maxPasses) const
+{
+	const int nTiles{ static_cast<int>(tilePath.size()) };
+	bool isImproved{ true };
+	for (int iterPass = 0; iterPass < maxPasses && isImproved; iterPass++)
+	{
+		isImproved = false;
+		for (int ii = 0; ii < nTiles - 2; ii++)
+			for (int jj = ii + 2; jj <= (std::min)(nTiles - 1, ii + window); jj++)
+			{
+				const bool isLast{ jj == nTiles - 1 };
+				const double currentCost{ predictMoveTime(tilePath.at(ii), tilePath.at(ii + 1)) + (isLast ? 0 : predictMoveTime(tilePath.at(jj), tilePath.at(jj + 1))) };
+				const double newCost{ predictMoveTime(tilePath.at(ii), tilePath.at(jj)) + (isLast ? 0 : predictMoveTime(tilePath.at(ii + 1), tilePath.at(jj + 1))) };
+				if (newCost + 1. * us < currentCost)
+				{
+					std::reverse(tilePath.begin() + ii + 1, tilePath.begin() + jj + 1);
+					isImproved = true;
+				}
+			}
+	}
+}
+#pragma endregion "TilePathPlanner"
+
+#pragma region "WavelengthScheduler"
+WavelengthScheduler::WavelengthScheduler(const bool multibeam, const Laser::ID whichLaser) :
+	mMultibeam{ multibeam },
+	mWhichLaser{ whichLaser }
+{}
+
+//Time for switching from laserState to wavelength_nm. laserState is updated to wavelength_nm
+double WavelengthScheduler::determineSwitchingTime(LaserState &laserState, const int wavelength_nm) const
+{
+	const bool isVision{ VirtualLaser::selectLaser(mWhichLaser, wavelength_nm) == Laser::ID::VISION };
+	const Filterwheel::COLOR initialColor{ Filterwheel::convertWavelengthToColor(laserState.mWavelength_nm) };
+	const Filterwheel::COLOR finalColor{ Filterwheel::convertWavelengthToColor(wavelength_nm) };
+
+	const double tuningTime{ isVision ? Laser::determineTuningTime(laserState.mVisionWavelength_nm, wavelength_nm) : 0 };
+	const double detTurningTime{ Filterwheel::determineTurningTime(Filterwheel::ID::DET, initialColor, finalColor) };
+	const double excTurningTime{ mMultibeam ? Filterwheel::determineTurningTime(Filterwheel::ID::EXC, initialColor, finalColor) : 0 };
+
+	laserState.mWavelength_nm = wavelength_nm;
+	if (isVision)
+		laserState.mVisionWavelength_nm = wavelength_nm;
+
+	return (std::max)({ tuningTime, detTurningTime, excTurningTime });
+}
+
+//Total time for switching to the wavelengths in wavelengthOrder_nm one after the other, starting from laserState
+double WavelengthScheduler::determineSwitchingTime(LaserState laserState, const std::vector<int> &wavelengthOrder_nm) const
+{
+	double switchingTime{ 0 };
+	for (const int wavelength_nm : wavelengthOrder_nm)
+		switchingTime += determineSwitchingTime(laserState, wavelength_nm);
+	return switchingTime;
+}
+
+//Try all the orders of the wavelengths and keep the fastest one starting from laserState. Ties keep the order of wavelengthOrder_nm
+//For example, with 2 wavelengths and the panoramic scans skipped, the order alternates from cut to cut because each cut starts with the last wavelength of the previous cut
+std::vector<int> WavelengthScheduler::planOrder(const LaserState laserState, const std::vector<int> &wavelengthOrder_nm) const
+{
+	if (static_cast<int>(wavelengthOrder_nm.size()) > mMaxWavelengthsToPermute)
+		return wavelengthOrder_nm;
+
+	std::vector<int> permutation(wavelengthOrder_nm.size());
+	for (std::vector<int>::size_type iter = 0; iter < permutation.size(); iter++)
+		permutation.at(iter) = static_cast<int>(iter);
+
+	std::vector<int> bestOrder_nm{ wavelengthOrder_nm };
+	double minSwitchingTime{ determineSwitchingTime(laserState, wavelengthOrder_nm) };
+	std::vector<int> order_nm(wavelengthOrder_nm.size());
+	while (std::next_permutation(permutation.begin(), permutation.end()))
+	{
+		for (std::vector<int>::size_type iter = 0; iter < permutation.size(); iter++)
+			order_nm.at(iter) = wavelengthOrder_nm.at(permutation.at(iter));
+
+		const double switchingTime{ determineSwitchingTime(laserState, order_nm) };
+		if (switchingTime < minSwitchingTime)
+		{
+			minSwitchingTime = switchingTime;
+			bestOrder_nm = order_nm;
+		}
+	}
+	return bestOrder_nm;
+}
+#pragma endregion "WavelengthScheduler"
+
+
+
+#pragma region "Stack"
+Stack::Stack(const FFOV2 FFOV, const int tileHeight_pix, int const tileWidth_pix, const double pixelSizeZ, const int nFrames, const TILEOVERLAP3 overlapIJK_frac) :
+	mFFOV{ FFOV },
+	mTileHeight_pix{ tileHeight_pix },
+	mTileWidth_pix{ tileWidth_pix },
+	mPixelSizeZ{ pixelSizeZ },
+	mDepthZ{ pixelSizeZ *  nFrames },
+	mOverlapIJK_frac{ overlapIJK_frac }
+{
+	if (FFOV.XX <= 0 || FFOV.YY <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The FOV must be > 0");
+	if (tileHeight_pix <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pixel tile height must be > 0");
+	if (tileWidth_pix <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pixel tile width must be > 0");
+	if (pixelSizeZ <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The pixel size Z must be > 0");
+	if (nFrames <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The number of frames must be >= 1");
+	if (overlapIJK_frac.II < 0 || overlapIJK_frac.JJ < 0 || overlapIJK_frac.II > 0.2 || overlapIJK_frac.JJ > 0.2 )
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The stack overlap in XY must be in the range [0-0.2]");
+	if (overlapIJK_frac.KK < 0 || overlapIJK_frac.KK > 0.5)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The stack overlap in Z must be in the range [0-0.5]");
+}
+
+void Stack::printParams(std::ofstream *fileHandle) const
+{
+	*fileHandle << "STACK ************************************************************\n";
+	*fileHandle << std::setprecision(1);
+	*fileHandle << "FOV (stageX, stageY) = (" << mFFOV.XX / um << " um, " << mFFOV.YY / um << " um)\n";
+	*fileHandle << "Pixel size Z = " << mPixelSizeZ / um << " um\n";
+	*fileHandle << "Stack depth Z = " << mDepthZ / um << " um\n";
+	*fileHandle << std::setprecision(2);
+	*fileHandle << "Stack overlap = (" << mOverlapIJK_frac.II << ", " << mOverlapIJK_frac.JJ << ", " << mOverlapIJK_frac.KK << ") (frac)\n";
+	*fileHandle << std::setprecision(1);
+	*fileHandle << "Stack overlap = (" << mOverlapIJK_frac.II * mFFOV.XX / um << " um, " << mOverlapIJK_frac.JJ * mFFOV.YY / um << " um, " << mOverlapIJK_frac.KK * mDepthZ << " um)\n";
+	*fileHandle << "\n";
+}
+
+double Stack::readFFOV(const AXIS axis) const
+{
+	switch (axis)
+	{
+	case AXIS::XX:
+		return mFFOV.XX;
+	case AXIS::YY:
+		return mFFOV.YY;
+	default:
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected stage axis unavailable");
+	}
+}
+
+int Stack::readTileHeight_pix() const
+{
+	return mTileHeight_pix;
+}
+
+int Stack::readTileWidth_pix() const
+{
+	return mTileWidth_pix;
+}
+
+double Stack::readPixelSizeZ() const
+{
+	return mPixelSizeZ;
+}
+
+double Stack::readDepthZ() const
+{
+	return mDepthZ;
+}
+
+TILEOVERLAP3 Stack::readOverlapIJK_frac() const
+{
+	return mOverlapIJK_frac;
+}
+
+double Stack::readOverlap_frac(const TileArray::Axis axis) const
+{
+	switch (axis)
+	{
+	case TileArray::Axis::II:
+		return mOverlapIJK_frac.II;
+	case TileArray::Axis::JJ:
+		return mOverlapIJK_frac.JJ;
+	case TileArray::Axis::KK:
+		return mOverlapIJK_frac.KK;
+	default:
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected tile array axis unavailable");
+	}
+}
+#pragma endregion "Stack"
+
+#pragma region "Action"
+void Action::MoveStage::setParam(const int cutNumber, const TILEIJ tileIndicesIJ, const POSITION2 tileCenterXY)
+{
+	if (cutNumber < 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The cut number must be >= 0");
+	if (tileIndicesIJ.II < 0 || tileIndicesIJ.JJ < 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile indices must be >= 0");
+
+	mCutNumber = cutNumber;
+	mTileIndicesIJ = tileIndicesIJ;
+	mTileCenterXY = tileCenterXY;
+}
+
+int Action::MoveStage::readCutNumber() const
+{
+	return mCutNumber;
+}
+
+int Action::MoveStage::readTileIndex(const TileArray::Axis axis) const
+{
+	switch (axis)
+	{
+	case TileArray::Axis::II:
+		return mTileIndicesIJ.II;
+	case TileArray::Axis::JJ:
+		return mTileIndicesIJ.JJ;
+	default:
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected tile array axis unavailable");
+	}
+}
+
+POSITION2 Action::MoveStage::readTileCenterXY() const
+{
+	return mTileCenterXY;
+}
+
+double Action::MoveStage::readTileCenter(AXIS axis) const
+{
+	switch (axis)
+	{
+	case AXIS::XX:
+		return mTileCenterXY.XX;
+	case AXIS::YY:
+		return mTileCenterXY.YY;
+	default:
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected stage axis unavailable");
+	}
+}
+
+//stackNumber is the number of the stack on the scan pattern (e.g. snake, column-by-column, etc). stackIndex is the number of the stack column-by-column from top to bottom and left to right (used for saving the tiff)
+void Action::AcqStack::setParam(const int stackNumber, const int stackIndex, const int wavelength_nm, const SCANDIR scanDirZ, const double scanZmin, const double depthZ, const double scanPmin, const double scanPLexp, const int nFrameBinning)
+{
+	if (stackIndex < 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The stack number must be >= 0");
+	if (wavelength_nm <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The wavelength must be > 0");
+	if (scanZmin < 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The Z stage height wavelength must be >= 0");
+	if (depthZ <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The scan depth must be > 0");
+	if (scanPmin < 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The laser power be >= 0");
+	if (scanPLexp <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The power exponential constant must be > 0");
+	if (nFrameBinning <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The binning number must be >= 1");
+
+	mStackNumber = stackNumber;
+	mStackIndex = stackIndex;
+	mWavelength_nm = wavelength_nm;
+	mScanDirZ = scanDirZ;
+	mScanZmin = scanZmin;
+	mDepthZ = depthZ;
+	mScanPmin = scanPmin;
+	mScanPLexp = scanPLexp;
+	mNframeBinning = nFrameBinning;
+}
+
+int Action::AcqStack::readStackNumber() const
+{
+	return mStackNumber;
+}
+
+int Action::AcqStack::readStackIndex() const
+{
+	return mStackIndex;
+}
+
+int Action::AcqStack::readWavelength_nm() const
+{
+	return mWavelength_nm;
+}
+
+SCANDIR Action::AcqStack::readScanDirZ() const
+{
+	return mScanDirZ;
+}
+
+double Action::AcqStack::readScanZmin() const
+{
+	return mScanZmin;
+}
+
+double Action::AcqStack::readDepthZ() const
+{
+	return mDepthZ;
+}
+
+double Action::AcqStack::readScanPmin() const
+{
+	return mScanPmin;
+}
+
+double Action::AcqStack::readScanPLexp() const
+{
+	return mScanPLexp;
+}
+
+int Action::AcqStack::readNframeBinning() const
+{
+	return mNframeBinning;
+}
+
+void Action::CutTissue::setParam(const double planeZtoCut, const double stageZheightForFacingTheBlade)
+{
+	if (planeZtoCut < 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The Z stage height must be >= 0");
+	if (stageZheightForFacingTheBlade < 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The Z stage height must be >= 0");
+
+	mPlaneZtoCut = planeZtoCut;
+	mStageZheightForFacingTheBlade = stageZheightForFacingTheBlade;
+}
+
+double Action::CutTissue::readPlaneZtoCut() const
+{
+	return mPlaneZtoCut;
+}
+
+double Action::CutTissue::readStageZheightForFacingTheBlade() const 
+{
+	return mStageZheightForFacingTheBlade;
+}
+
+void Action::PanoramicScan::setParam(const int cutNumber, const double distanceUnderTheSurface, const double stageZpos)
+{
+	if (cutNumber < 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The cut number must be >= 0");
+	if (stageZpos < 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The Z stage height must be >= 0");
+
+	mCutNumber = cutNumber;
+	mPlaneZ = stageZpos + distanceUnderTheSurface;
+}
+
+double Action::PanoramicScan::readPlaneZ() const
+{
+	return mPlaneZ;
+}
+
+int Action::PanoramicScan::readCutNumber() const
+{
+	return mCutNumber;
+}
+#pragma endregion "Action"
+
+#pragma region "Commandline"
+Sequencer::Commandline::Commandline(const Action::ID actionID) :
+	mActionID{ actionID }
+{}
+
+void Sequencer::Commandline::printToFile(std::ofstream *fileHandle) const
+{
+	switch (mActionID)
+	{
+	case Action::ID::MOV:
+		*fileHandle << convertActionIDtoString_(mActionID) << "\t" << mAction.moveStage.readCutNumber();
+		*fileHandle << "\t(" << mAction.moveStage.readTileIndex(TileArray::Axis::II) << "," << mAction.moveStage.readTileIndex(TileArray::Axis::JJ) << ")\t";
+		*fileHandle << std::setprecision(4);
+		*fileHandle << "(" << mAction.moveStage.readTileCenter(AXIS::XX) / mm << "," << mAction.moveStage.readTileCenter(AXIS::YY) / mm << ")\n";
+		break;
+	case Action::ID::ACQ:
+		*fileHandle << convertActionIDtoString_(mActionID) << "\t\t\t\t\t";
+		*fileHandle << mAction.acqStack.readStackIndex() << "\t";
+		*fileHandle << mAction.acqStack.readWavelength_nm() << "\t";
+		*fileHandle << std::setprecision(3);
+		*fileHandle << mAction.acqStack.readScanZmin() / mm << "\t";
+		*fileHandle << (mAction.acqStack.readScanZmin() + mAction.acqStack.readDepthZ()) / mm << "\t";
+		*fileHandle << std::setprecision(0);
+		*fileHandle << mAction.acqStack.readScanPmin() << "\t" << mAction.acqStack.readScanPLexp() << "\n";
+		break;
+	case Action::ID::SAV:
+		*fileHandle << convertActionIDtoString_(mActionID) + "\n";
+		break;
+	case Action::ID::CUT:
+		*fileHandle << convertActionIDtoString_(mActionID);
+		*fileHandle << std::setprecision(3);
+		*fileHandle << "******Stage height for facing the VT = " << mAction.cutTissue.readStageZheightForFacingTheBlade() / mm << " mm";
+		*fileHandle << "******Equivalent sample plane Z = " << mAction.cutTissue.readPlaneZtoCut() / mm << " mm";
+		*fileHandle << "********\n";
+		break;
+	case Action::ID::PAN:
+		*fileHandle << convertActionIDtoString_(mActionID);
+		*fileHandle << std::setprecision(3);
+		*fileHandle << "******************************Panoramic scan at plane z = " << mAction.panoramicScan.readPlaneZ() / mm << " mm";
+		*fileHandle << "********************************\n";
+		break;
+	default:
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected action invalid");
+	}
+}
+/*
+void Sequencer::Commandline::printParameters() const
+{
+	switch (mActionID)
+	{
+	case Action::ID::MOV:
+		std::cout << "The command is " << convertActionIDtoString_(mActionID) << " with parameters: \n";
+		std::cout << "vibratome slice number = " << mAction.moveStage.readCutNumber() << "\n";
+		std::cout << "Tile ij = (" << mAction.moveStage.readTileIndex(TileArray::Axis::II) << "," << mAction.moveStage.readTileIndex(TileArray::Axis::JJ) << ")\n";
+		std::cout << "Tile center (stageX, stageY) = (" << mAction.moveStage.readTileCenter(AXIS::XX) / mm << "," << mAction.moveStage.readTileCenter(AXIS::YY) / mm << ") mm\n\n";
+		break;
+	case Action::ID::ACQ:
+		std::cout << "The command is " << convertActionIDtoString_(mActionID) << " with parameters: \n";
+		std::cout << "wavelength = " << mAction.acqStack.readWavelength_nm() << " nm\n";
+		std::cout << "scanDirZ = " << Util::convertScandirToInt(mAction.acqStack.readScanDirZ()) << "\n";
+		std::cout << "scanZmin / depthZ = " << mAction.acqStack.readScanZmin() / mm << " mm/" << mAction.acqStack.readDepthZ() << " mm\n";
+		std::cout << "scanPmin / ScanPLexp = " << mAction.acqStack.readScanPmin() / mW << " mW/" << mAction.acqStack.readScanPLexp() / um << " (um)\n\n";
+		break;
+	case Action::ID::SAV:
+		std::cout << "The command is " << convertActionIDtoString_(mActionID) << "\n";
+		break;
+	case Action::ID::CUT:
+		std::cout << "The command is " << convertActionIDtoString_(mActionID) << "\n";
+		break;
+	default:
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected action invalid");
+	}
+}
+*/
+
+std::string Sequencer::Commandline::convertActionIDtoString_(const Action::ID actionID) const
+{
+	switch (actionID)
+	{
+	case Action::ID::CUT:
+		return "CUT";
+	case Action::ID::SAV:
+		return "SAV";
+	case Action::ID::ACQ:
+		return "ACQ";
+	case Action::ID::MOV:
+		return "MOV";
+	case Action::ID::PAN:
+		return "PAN";
+	default:
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected action invalid");
+	}
+}
+#pragma endregion "Commandline"
+
+#pragma region "Sequencer"
+//Constructor using the sample's LOI. The number of stacks is calculated automatically based on the FFOV
+Sequencer::Sequencer(const Sample sample, const Stack stack) :
+	mSample{ sample },
+	mStack{ stack },
+	mTileArray{ stack.readTileHeight_pix(), stack.readTileWidth_pix(), determineTileArraySizeIJ_(), stack.readOverlapIJK_frac() }
+{
+	initializeVibratome_();
+	initializeEffectiveROI_();		//Calculate the effective ROI covered by all the tiles, which might be slightly larger than the requested ROI
+	reserveMemoryBlock_();			//Reserve memory for speed
+}
+
+//Generate a scan pattern including slicing the sample with the vibratome
+//II is the row index (along the image height and X-stage) and JJ is the column index (along the image width and Y-stage) of the tile. II and JJ start from 0
+//For some reason, a snake-pattern results in alternating columns of brighter and darker tiles
+//Use the same scan order for all the wavelengths because the stages may drift over time
+//Currently performing column-by-column scan
+//The Z-scan scan direction is set dynamically during runtime
+void Sequencer::generateCommandList()
+{
+	generateCommandList(TileBitmap{ mTileArray.readTileArraySizeIJ(), true });
+}
+
+//Only generate the commands for the tiles in tileMask (e.g., the tiles known to contain tissue). The scan order is the same as for the full tile array
+void Sequencer::generateCommandList(const TileBitmap &tileMask)
+{
+	const TILEDIM2 tileArraySizeIJ{ mTileArray.readTileArraySizeIJ() };
+	if (tileMask.readTileArraySizeIJ().II != tileArraySizeIJ.II || tileMask.readTileArraySizeIJ().JJ != tileArraySizeIJ.JJ)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile mask must have the size of the tile array");
+
+	std::cout << "Generating the command list..." << "\n";
+	for (int iterCut = 0; iterCut < mNtotalCuts; iterCut++)
+	{
+		panoramicScan_(30. * um);																//Panoramic scan 30 um below the surface
+		panoramicScan_(100. * um);																//Panoramic scan 100 um below the surface
+
+		for (std::vector<int>::size_type iterFluorMarker = 0;
+			iterFluorMarker != mSample.readFluorMarkerListSize();
+			iterFluorMarker++)
+		{
+			initializeScanDirIJ_();																//Reset the X-stage and Y-stage scan directions for every wavelength
+
+			//The Y-stage is the slowest to react because it sits under the 2 other stages.
+			//For better performance, iterate over II often and over JJ less often
+			while (mJJ >= 0 &&
+				   mJJ < mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ))					//Y-stage iteration
+			{
+				while (mII >= 0 &&
+					   mII < mTileArray.readTileArraySizeIJ(TileArray::Axis::II))				//X-stage iteration
+				{
+					if (tileMask.test({ mII, mJJ }))
+					{
+						moveStage_({ mII, mJJ });
+						acqStack_(iterFluorMarker);
+						saveStack_();
+					}
+					mII -= Util::convertScandirToInt(mIterScanDirXYZ.XX);						//Increase/decrease the iterator in the X-stage axis
+				}
+				initializeScanDirII_();															//Reset the X-stage scan direction
+				mJJ -= Util::convertScandirToInt(mIterScanDirXYZ.YY);							//Increase/decrease the iterator in the Y-stage axis
+			}
+		}
+		if (iterCut < mNtotalCuts - 1)														//Only need to cut the sample 'nVibratomeCuts -1' times
+			cutTissue_();
+	}
+}
+
+//Index of the first command of type actionID at or after startCommandIndex, e.g. the first MOV of a cut. Return -1 if there is none
+int Sequencer::findCommand(const Action::ID actionID, const int startCommandIndex) const
+{
+	if (startCommandIndex < 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The command index must be >= 0");
+
+	for (int iterCommandline = startCommandIndex; iterCommandline < mCommandCounter; iterCommandline++)
+		if (mCommandList.at(iterCommandline).mActionID == actionID)
+			return iterCommandline;
+	return -1;
+}
+
+//Tiles of the cut whose MOV, ACQ, and SAV commands start at firstCommandIndex, in the order visited by each wavelength
+std::vector<TILEIJ> Sequencer::readTilePath(const int firstCommandIndex) const
+{
+	const int endCommandIndex{ findEndOfTileBlock_(firstCommandIndex) };
+	const int nStacksPerFluorMarker{ (endCommandIndex - firstCommandIndex) / 3 / static_cast<int>(mSample.readFluorMarkerListSize()) };
+
+	std::vector<TILEIJ> tilePath;
+	tilePath.reserve(nStacksPerFluorMarker);
+	for (int iterStack = 0; iterStack < nStacksPerFluorMarker; iterStack++)
+	{
+		const Action::MoveStage &moveStage{ mCommandList.at(firstCommandIndex + 3 * iterStack).mAction.moveStage };
+		tilePath.push_back({ moveStage.readTileIndex(TileArray::Axis::II), moveStage.readTileIndex(TileArray::Axis::JJ) });
+	}
+	return tilePath;
+}
+
+//Visit the tiles of the cut whose commands start at firstCommandIndex in the order of tilePath, for every wavelength. Drop the commands of the tiles not in tilePath
+//The commands after the cut are shifted, so call it when the boolmap of the cut is final and re-read the command list from firstCommandIndex
+void Sequencer::reorderTilePath(const int firstCommandIndex, const std::vector<TILEIJ> &tilePath)
+{
+	const int endCommandIndex{ findEndOfTileBlock_(firstCommandIndex) };
+	const int nFluorMarkers{ static_cast<int>(mSample.readFluorMarkerListSize()) };
+	const int nStacksPerFluorMarker{ (endCommandIndex - firstCommandIndex) / 3 / nFluorMarkers };
+	const int nTilesJJ{ mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) };
+
+	//Position of each tile in the current path. -1 if the tile is not in the current path
+	std::vector<int> currentPosition(static_cast<std::size_t>(mTileArray.readTileArraySizeIJ(TileArray::Axis::II)) * nTilesJJ, -1);
+	for (int iterStack = 0; iterStack < nStacksPerFluorMarker; iterStack++)
+	{
+		const Action::MoveStage &moveStage{ mCommandList.at(firstCommandIndex + 3 * iterStack).mAction.moveStage };
+		for (int iterFluorMarker = 1; iterFluorMarker < nFluorMarkers; iterFluorMarker++)
+		{
+			const Action::MoveStage &otherMoveStage{ mCommandList.at(firstCommandIndex + 3 * (iterFluorMarker * nStacksPerFluorMarker + iterStack)).mAction.moveStage };
+			if (otherMoveStage.readTileIndex(TileArray::Axis::II) != moveStage.readTileIndex(TileArray::Axis::II) ||
+				otherMoveStage.readTileIndex(TileArray::Axis::JJ) != moveStage.readTileIndex(TileArray::Axis::JJ))
+				throw std::runtime_error((std::string)__FUNCTION__ + ": All the wavelengths must visit the tiles in the same order");
+		}
+		currentPosition.at(moveStage.readTileIndex(TileArray::Axis::II) * nTilesJJ + moveStage.readTileIndex(TileArray::Axis::JJ)) = iterStack;
+	}
+
+	std::vector<int> newPosition;
+	newPosition.reserve(tilePath.size());
+	for (const TILEIJ &tileIJ : tilePath)
+	{
+		if (tileIJ.II < 0 || tileIJ.II >= mTileArray.readTileArraySizeIJ(TileArray::Axis::II) || tileIJ.JJ < 0 || tileIJ.JJ >= nTilesJJ)
+			throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile indices are out of the tile array");
+
+		int &position{ currentPosition.at(tileIJ.II * nTilesJJ + tileIJ.JJ) };
+		if (position < 0)
+			throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile (" + std::to_string(tileIJ.II) + "," + std::to_string(tileIJ.JJ) + ") is not in the cut or is repeated");
+		newPosition.push_back(position);
+		position = -1;
+	}
+
+	std::vector<Commandline> reorderedCommands;
+	reorderedCommands.reserve(3 * nFluorMarkers * newPosition.size());
+	for (int iterFluorMarker = 0; iterFluorMarker < nFluorMarkers; iterFluorMarker++)
+		for (const int position : newPosition)
+			for (int iterAction = 0; iterAction < 3; iterAction++)	//MOV, ACQ, and SAV
+				reorderedCommands.push_back(mCommandList.at(firstCommandIndex + 3 * (iterFluorMarker * nStacksPerFluorMarker + position) + iterAction));
+
+	std::copy(reorderedCommands.begin(), reorderedCommands.end(), mCommandList.begin() + firstCommandIndex);
+	mCommandList.erase(mCommandList.begin() + firstCommandIndex + reorderedCommands.size(), mCommandList.begin() + endCommandIndex);
+
+	const int nDroppedStacks{ nFluorMarkers * (nStacksPerFluorMarker - static_cast<int>(newPosition.size())) };
+	mStackCounter -= nDroppedStacks;
+	mCommandCounter -= 3 * nDroppedStacks;
+}
+
+//Wavelength of each group of tile commands of the cut whose commands start at firstCommandIndex, in the order of the command list
+std::vector<int> Sequencer::readWavelengthOrder(const int firstCommandIndex) const
+{
+	const int endCommandIndex{ findEndOfTileBlock_(firstCommandIndex) };
+	const int nFluorMarkers{ static_cast<int>(mSample.readFluorMarkerListSize()) };
+	const int nStacksPerFluorMarker{ (endCommandIndex - firstCommandIndex) / 3 / nFluorMarkers };
+
+	std::vector<int> wavelengthOrder_nm;
+	if (nStacksPerFluorMarker == 0)
+		return wavelengthOrder_nm;
+
+	for (int iterFluorMarker = 0; iterFluorMarker < nFluorMarkers; iterFluorMarker++)
+		wavelengthOrder_nm.push_back(mCommandList.at(firstCommandIndex + 3 * iterFluorMarker * nStacksPerFluorMarker + 1).mAction.acqStack.readWavelength_nm());
+	return wavelengthOrder_nm;
+}
+
+//Reorder the groups of tile commands of the cut whose commands start at firstCommandIndex to follow wavelengthOrder_nm, which must be a permutation of readWavelengthOrder(firstCommandIndex)
+void Sequencer::reorderWavelengths(const int firstCommandIndex, const std::vector<int> &wavelengthOrder_nm)
+{
+	const int endCommandIndex{ findEndOfTileBlock_(firstCommandIndex) };
+	const std::vector<int> currentOrder_nm{ readWavelengthOrder(firstCommandIndex) };
+	if (wavelengthOrder_nm.size() != currentOrder_nm.size())
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The number of wavelengths must be " + std::to_string(currentOrder_nm.size()));
+	if (currentOrder_nm.empty())
+		return;
+
+	//Use the first group with the wavelength that has not been used yet (several fluorescent markers might share a wavelength)
+	std::vector<int> groupOrder;
+	std::vector<bool> isUsed(currentOrder_nm.size(), false);
+	for (const int wavelength_nm : wavelengthOrder_nm)
+	{
+		int group{ 0 };
+		while (group < static_cast<int>(currentOrder_nm.size()) && (isUsed.at(group) || currentOrder_nm.at(group) != wavelength_nm))
+			group++;
+		if (group == static_cast<int>(currentOrder_nm.size()))
+			throw std::invalid_argument((std::string)__FUNCTION__ + ": The wavelength " + std::to_string(wavelength_nm) + " nm is not in the cut or is repeated");
+		isUsed.at(group) = true;
+		groupOrder.push_back(group);
+	}
+
+	const int nCommandsPerFluorMarker{ (endCommandIndex - firstCommandIndex) / static_cast<int>(currentOrder_nm.size()) };
+	const std::vector<Commandline> currentCommands(mCommandList.begin() + firstCommandIndex, mCommandList.begin() + endCommandIndex);
+	auto iterCommand{ mCommandList.begin() + firstCommandIndex };
+	for (const int group : groupOrder)
+		iterCommand = std::copy(currentCommands.begin() + group * nCommandsPerFluorMarker, currentCommands.begin() + (group + 1) * nCommandsPerFluorMarker, iterCommand);
+}
+
+//II is the row index (along the image height and X-stage) and JJ is the column index (along the image width and Y-stage) of the tile. II and JJ start from 0
+//The center the tile array is at the sample center (exact center for an odd number of tiles or slightly off center for an even number of tiles)
+POSITION2 Sequencer::convertTileIndicesIJToStagePosXY(const TILEIJ tileIndicesIJ) const
+{
+	if (tileIndicesIJ.II < 0 || tileIndicesIJ.II >= mTileArray.readTileArraySizeIJ(TileArray::Axis::II))
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile index II must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::II) - 1) + "]");
+	if (tileIndicesIJ.JJ < 0 || tileIndicesIJ.JJ >= mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ))
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile index JJ must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) - 1) + "]");
+
+	//The tile centers are (1-a)*FFOV away from each other, where a*L is the tile overlap
+	POSITION2 centeredIJ{ determineRelativeTileIndicesIJ(mStack.readOverlapIJK_frac(), mTileArray.readTileArraySizeIJ(), tileIndicesIJ) };
+	POSITION2 stagePosXY;
+	stagePosXY.XX = mSample.mCenterXY.XX - mStack.readFFOV(AXIS::XX)  * centeredIJ.XX;
+	stagePosXY.YY = mSample.mCenterXY.YY - mStack.readFFOV(AXIS::YY)  * centeredIJ.YY;
+
+	return stagePosXY;
+}
+
+std::string Sequencer::printHeader() const
+{
+	return 	"Action\tCut#\tTileIJ\t(stageX,stageY)\tStackID\tWavlen\tstageZ<\tstageZ>\tPmin\tPLexp";
+}
+
+std::string Sequencer::printHeaderUnits() const
+{
+	return "\t\t(mm,mm)\t\t\tnm\tmm\tmm\tmW\tum";
+}
+
+void Sequencer::printSequenceParams(std::ofstream *fileHandle) const
+{
+	*fileHandle << "SEQUENCER ************************************************************\n";
+	*fileHandle << "Stages initial scan direction {stageX, stageY, stageZ} = {" << Util::convertScandirToInt(g_initialStageScanDirXYZ.XX) << ", " <<
+																				   Util::convertScandirToInt(g_initialStageScanDirXYZ.YY) << ", " <<
+																				   Util::convertScandirToInt(g_initialStageScanDirXYZ.ZZ) << "}\n";
+	*fileHandle << std::setprecision(4);
+	*fileHandle << "Effective LOI (stageX, stageY, stageZ) = (" << determineEffectiveLOIxyz().XX / mm << " mm, " <<
+																   determineEffectiveLOIxyz().YY / mm << " mm, " <<
+																   determineEffectiveLOIxyz().ZZ / mm << " mm)\n";
+
+	*fileHandle << "Effective ROI boundaries [YMIN, XMIN, YMAX, XMAX] = [" << mROI.YMIN / mm << " mm, " <<
+																			  mROI.XMIN / mm << " mm, " <<
+																			  mROI.YMAX / mm << " mm, " <<
+																			  mROI.XMAX / mm << " mm]\n";
+	*fileHandle << "Z position of the surface of the sample = " << mSample.mSurfaceZ / mm << " mm\n";
+	*fileHandle << std::setprecision(0);
+	*fileHandle << "Total # tissue cuts = " << mNtotalCuts << "\n";
+	*fileHandle << "Tile array size (stageX, stageY) = (" << mTileArray.readTileArraySizeIJ(TileArray::Axis::II) << ", " <<
+															 mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) << ")\n";
+
+	*fileHandle << "Total # stacks entire sample = " << mStackCounter << "\n";
+	*fileHandle << "Total # commandlines = " << mCommandCounter << "\n";
+
+	//const double imagingTimePerStack{ g_lineclockHalfPeriod *  mStack.readTileHeight_pix() * (mStack.readDepthZ() / mStack.readPixelSizeZ()) / 16 };
+	//const double totalImagingTime_hours{ (mStackCounter + 1) * imagingTimePerStack / seconds / 3600. };
+
+	//*fileHandle << "Runtime per stack = " << imagingTimePerStack / ms << " ms (times nBinning)\n";
+	//*fileHandle << std::setprecision(6);
+	//*fileHandle << "Estimated total runtime (multibeam + pipelining) = " << totalImagingTime_hours << " hrs (times nBinning)\n\n";
+}
+
+//Print the commandlist to file
+void Sequencer::printToFile(const std::string folderPath, std::string filename, const OVERRIDE override) const
+{
+	if (override == OVERRIDE::DIS)
+		filename = Util::doesFileExist(folderPath, filename, ".txt");
+
+	std::ofstream *fileHandle{ new std::ofstream(folderPath + filename + ".txt") };
+
+	*fileHandle << std::fixed;	//Show a fixed number of digits
+
+	mSample.printSampleParams(fileHandle);
+	mSample.printFluorParams(fileHandle);
+	printSequenceParams(fileHandle);
+	mStack.printParams(fileHandle);
+
+	//Print out the header
+	if (!mCommandList.empty())
+	{
+		*fileHandle << "Act#\t" + printHeader() + "\n";
+		*fileHandle << "\t\t" + printHeaderUnits() + "\n";
+	}
+
+	for (std::vector<int>::size_type iterCommandline = 0; iterCommandline != mCommandList.size(); iterCommandline++)
+		//for (std::vector<int>::size_type iterCommandline = 0; iterCommandline != 3*(3 * 3 * mTileArraySizeIJ.at(X) * mTileArraySizeIJ.at(Y)+1) + 2 ; iterCommandline++) //For debugging
+	{
+		*fileHandle << iterCommandline << "\t";		//Print out the iteration number
+		mCommandList.at(iterCommandline).printToFile(fileHandle);
+	}
+
+	*fileHandle << std::defaultfloat;
+	fileHandle->close();
+}
+
+int Sequencer::readNumberOfStacksPerCut() const
+{
+	return mTileArray.readTileArraySizeIJ(TileArray::Axis::II) * mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ);
+}
+
+int Sequencer::readTotalNumberOfCuts() const
+{
+	return mNtotalCuts;
+}
+
+int Sequencer::readTotalNumberOfStacks() const
+{
+	return mStackCounter;
+}
+
+int Sequencer::readNtotalCommands() const
+{
+	return mCommandCounter;
+}
+
+Sequencer::Commandline Sequencer::readCommandline(const int iterCommandLine) const
+{
+	return mCommandList.at(iterCommandLine);
+}
+
+int Sequencer::readTileArraySizeIJ(const TileArray::Axis axis) const
+{
+	return mTileArray.readTileArraySizeIJ(axis);
+}
+
+TILEDIM2 Sequencer::readTileArraySizeIJ() const
+{
+	return mTileArray.readTileArraySizeIJ();
+}
+
+void Sequencer::initializeVibratome_()
+{
+	mIterScanZi = mSample.mSurfaceZ; 	//Initialize the Z-stage with the position of the surface of the sample
+
+	mIterSamplePlaneZtoCut = mIterScanZi + mStack.readDepthZ() - mSample.mCutAboveBottomOfStack;
+	mIterStageZheightForFacingTheBlade = mIterSamplePlaneZtoCut + mSample.mBladeFocalplaneOffsetZ;
+
+	const int numberOfVibratomeCuts{ static_cast<int>(1 + std::ceil(1. / (1 - mStack.readOverlap_frac(TileArray::Axis::KK)) * (mSample.mLOIxyz_req.ZZ / mStack.readDepthZ() - 1))) };	//Total number of vibratome slices in the entire sample
+	if (numberOfVibratomeCuts > 1)
+		mNtotalCuts = numberOfVibratomeCuts;		
+	else
+		mNtotalCuts = 1;
+}
+
+//Calculate the number of tiles in the X-stage and Y-stage axes based on the length of interest (LOI) and the FFOV
+//If the overlap between consecutive tiles is a*FOV, then N tiles cover the distance L = FOV * ( (1-a)*(N-1) + 1 ), thus N = 1/(1-a) * ( L/FOV - 1 ) + 1
+TILEDIM2 Sequencer::determineTileArraySizeIJ_()
+{
+	const int numberOfTilesII{ Util::intceil(1 + 1. / (1 - mStack.readOverlap_frac(TileArray::Axis::II)) * (mSample.mLOIxyz_req.XX / mStack.readFFOV(AXIS::XX) - 1)) };
+	const int numberOfTilesJJ{ Util::intceil(1 + 1. / (1 - mStack.readOverlap_frac(TileArray::Axis::JJ)) * (mSample.mLOIxyz_req.YY / mStack.readFFOV(AXIS::YY) - 1)) };
+
+	TILEDIM2 output;
+	if (numberOfTilesII > 1)
+		output.II = numberOfTilesII;		//Number of tiles in the X-stage axis
+	else
+		output.II = 1;
+
+	if (numberOfTilesJJ > 1)
+		output.JJ = numberOfTilesJJ;		//Number of tiles in the Y-stage axis	
+	else
+		output.JJ = 1;
+
+	//For debugging
+	//std::cout << "Number of row tiles = " << numberOfTilesII << "\tNumber of column tiles = " << numberOfTilesJJ << "\n";
+
+	return output;
+}
+
+//Calculate the effective ROI =  { YMIN, XMIN, YMAX, XMAX } covered by all the tiles
+void Sequencer::initializeEffectiveROI_()
+{
+	//II is the row index (along the image height and X-stage) and JJ is the column index (along the image width and Y-stage) of the tile. II and JJ start from 0
+	const POSITION2 tilePosXYmin = convertTileIndicesIJToStagePosXY({ 0, 0 });																												//Absolute position of the CENTER of the tile
+	const POSITION2 tilePosXYmax = convertTileIndicesIJToStagePosXY({ mTileArray.readTileArraySizeIJ(TileArray::Axis::II) - 1, mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) - 1 });	//Absolute position of the CENTER of the tile
+
+	//The ROI is measured from the border of the tiles. Therefore, add half of the FFOV
+	mROI.XMAX = tilePosXYmin.XX + mStack.readFFOV(AXIS::XX) / 2.;
+	mROI.YMAX = tilePosXYmin.YY + mStack.readFFOV(AXIS::YY) / 2.;
+	mROI.XMIN = tilePosXYmax.XX - mStack.readFFOV(AXIS::XX) / 2.;
+	mROI.YMIN = tilePosXYmax.YY - mStack.readFFOV(AXIS::YY) / 2.;
+
+	if (mROI.XMIN < mSample.readStageSoftPosLimXMIN() || mROI.XMAX > mSample.readStageSoftPosLimXMAX())
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The ROI goes beyond the soft limits of the stage X");
+	if (mROI.YMIN < mSample.readStageSoftPosLimYMIN() || mROI.YMAX >  mSample.readStageSoftPosLimYMAX())
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The ROI goes beyond the soft limits of the stage Y");
+}
+
+//Reserve a memory block assuming 3 actions for every stack in each vibratome slice: MOV, ACQ, and SAV. Then CUT
+void Sequencer::reserveMemoryBlock_()
+{
+	const int nTotalTilesPerVibratomeCut{ mTileArray.readTileArraySizeIJ(TileArray::Axis::II) * mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) };	//Total number of tiles in a vibratome slice
+	const int nTotalTilesEntireSample{ mNtotalCuts * static_cast<int>(mSample.readFluorMarkerListSize()) * nTotalTilesPerVibratomeCut };				//Total number of tiles in the entire sample. mNtotalCuts is fixed at 1
+	mCommandList.reserve(3 * nTotalTilesEntireSample + 2 * mNtotalCuts + mNtotalCuts - 1);	//MOV, ACQ, and SAV for each tile, 2 PAN for each cut, and a CUT between cuts
+}
+
+//Reset the X-stage and Y-stage scan directions to the initial values
+//II is the row index (along the image height and X-stage) and JJ is the column index (along the image width and Y-stage) of the tile. II and JJ start from 0
+void Sequencer::initializeScanDirIJ_()
+{
+	mIterScanDirXYZ = g_initialStageScanDirXYZ;	//Reset the scan directions
+
+	switch (mIterScanDirXYZ.XX)
+	{
+	case SCANDIR::RIGHTWARD:	//The X-stage moves to the right, therefore, the sample is imaged from right to left
+		mII = mTileArray.readTileArraySizeIJ(TileArray::Axis::II) - 1;
+		break;
+	case SCANDIR::LEFTWARD:		//The X-stage moves to the left, therefore, the sample is imaged from left to right
+		mII = 0;
+		break;
+	}
+
+	switch (mIterScanDirXYZ.YY)
+	{
+	case SCANDIR::INWARD:		//The Y-stage moves inward, therefore, the sample is imaged from "inside" to "outside" of the microscope
+		mJJ = mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) - 1;
+		break;
+	case SCANDIR::OUTWARD:		//The Y-stage moves outward, therefore, the sample is imaged from "outside" to "inside" of the microscope
+		mJJ = 0;
+		break;
 	}
 }
 
-//stackNumber is the number of the stack on the scan pattern (e.g. snake, column-by-column, etc). stackIndex is the number of the stack column-by-column from top to bottom and left to right (used for saving the tiff)
-void Action::AcqStack::setParam(const int stackNumber, const int stackIndex, const int wavelength_nm, const SCANDIR scanDirZ, const double scanZmin, const double depthZ, const double scanPmin, const double scanPLexp, const int nFrameBinning)
+//Reset the X-stage direction to the initial values
+void Sequencer::initializeScanDirII_()
 {
-	if (stackIndex < 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The stack number must be >= 0");
-	if (wavelength_nm <= 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The wavelength must be > 0");
-	if (scanZmin < 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The Z stage height wavelength must be >= 0");
-	if (depthZ <= 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The scan depth must be > 0");
-	if (scanPmin < 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The laser power be >= 0");
-	if (scanPLexp <= 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The power exponential constant must be > 0");
-	if (nFrameBinning <= 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The binning number must be >= 1");
+	mIterScanDirXYZ.XX = g_initialStageScanDirXYZ.XX;	//Reset the scan directions in X
 
-	mStackNumber = stackNumber;
-	mStackIndex = stackIndex;
-	mWavelength_nm = wavelength_nm;
-	mScanDirZ = scanDirZ;
-	mScanZmin = scanZmin;
-	mDepthZ = depthZ;
-	mScanPmin = scanPmin;
-	mScanPLexp = scanPLexp;
-	mNframeBinning = nFrameBinning;
+	switch (mIterScanDirXYZ.XX)
+	{
+	case SCANDIR::RIGHTWARD:	//The X-stage moves to the right, therefore, the sample is imaged from right to left
+		mII = mTileArray.readTileArraySizeIJ(TileArray::Axis::II) - 1;
+		break;
+	case SCANDIR::LEFTWARD:		//The X-stage moves to the left, therefore, the sample is imaged from left to right
+		mII = 0;
+		break;
+	}
+}
+
+//Convert a ROI = {ymin, xmin, ymax, xmax} to the equivalent length of interest (LOI) in the X-stage and Y-stage axes
+LENGTH3 Sequencer::determineEffectiveLOIxyz() const
+{
+	return { mROI.XMAX - mROI.XMIN,
+			 mROI.YMAX - mROI.YMIN,
+			 mStack.readDepthZ() * ((1 - mStack.readOverlap_frac(TileArray::Axis::KK)) * (mNtotalCuts - 1) + 1) };
+}
+
+//The tile commands of a cut are MOV, ACQ, and SAV for each tile, wavelength after wavelength. Return the index of the first command after them (e.g., a CUT)
+int Sequencer::findEndOfTileBlock_(const int firstCommandIndex) const
+{
+	if (firstCommandIndex < 0 || firstCommandIndex >= mCommandCounter)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The command index must be in the range [0-" + std::to_string(mCommandCounter - 1) + "]");
+	if (mCommandList.at(firstCommandIndex).mActionID != Action::ID::MOV)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The first command must be a MOV");
+
+	int endCommandIndex{ firstCommandIndex };
+	while (endCommandIndex + 2 < mCommandCounter &&
+		   mCommandList.at(endCommandIndex).mActionID == Action::ID::MOV &&
+		   mCommandList.at(endCommandIndex + 1).mActionID == Action::ID::ACQ &&
+		   mCommandList.at(endCommandIndex + 2).mActionID == Action::ID::SAV)
+		endCommandIndex += 3;
+
+	if (endCommandIndex < mCommandCounter && mCommandList.at(endCommandIndex).mActionID != Action::ID::CUT && mCommandList.at(endCommandIndex).mActionID != Action::ID::PAN)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": The tile commands must come in groups of MOV, ACQ, and SAV");
+	if ((endCommandIndex - firstCommandIndex) / 3 % mSample.readFluorMarkerListSize() != 0)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": The tile commands must start at the first tile of the first wavelength");
+
+	return endCommandIndex;
+}
+
+//Move the stage to the position corresponding to the tile indices II and JJ 
+//II is the row index (along the image height and X-stage) and JJ is the column index (along the image width and Y-stage) of the tile. II and JJ start from 0
+void Sequencer::moveStage_(const TILEIJ tileIndicesIJ)
+{
+	if (tileIndicesIJ.II < 0 || tileIndicesIJ.II >= mTileArray.readTileArraySizeIJ(TileArray::Axis::II))
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile index II must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::II) - 1) + "]");
+	if (tileIndicesIJ.JJ < 0 || tileIndicesIJ.JJ >= mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ))
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile index JJ must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) - 1) + "]");
+
+	const POSITION2 tileCenterXY = convertTileIndicesIJToStagePosXY(tileIndicesIJ);
+
+	Commandline commandline{ Action::ID::MOV };
+	commandline.mAction.moveStage.setParam(mCutCounter, tileIndicesIJ, tileCenterXY);
+	mCommandList.push_back(commandline);
+	mCommandCounter++;	//Count the number of commands
+}
+
+//indexFluorMarker is the position of the fluorMarker in mFluorMarkerList
+void Sequencer::acqStack_(const int indexFluorMarker)
+{
+	if (indexFluorMarker < 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The wavelength index must be >= 0");
+
+	//Read the corresponding laser configuration
+	const FluorMarkerList::FluorMarker fluorMarker{ mSample.readFluorMarker(indexFluorMarker) };
+
+	//The stack saving is column by column
+	//Stack index for identifying the saved tiff file
+	const int stackIndex{ mJJ * readTileArraySizeIJ(TileArray::Axis::II) + mII };
+
+	Commandline commandline{ Action::ID::ACQ };
+	commandline.mAction.acqStack.setParam(mStackCounter, stackIndex, fluorMarker.mWavelength_nm, mIterScanDirXYZ.ZZ, mIterScanZi, mStack.readDepthZ(), fluorMarker.mScanPmin, fluorMarker.mScanPLexp, fluorMarker.nFramesBinning);
+	mCommandList.push_back(commandline);
+	mStackCounter++;	//Count the number of stacks
+	mCommandCounter++;	//Count the number of commands
+
+	//Update the parameters for the next iteration
+	reverseSCANDIR(mIterScanDirXYZ.ZZ);								//Reverse the scan direction in the Z-stage axis
+}
+
+void Sequencer::saveStack_()
+{
+	Commandline commandline{ Action::ID::SAV };
+	mCommandList.push_back(commandline);
+	mCommandCounter++;	//Count the number of commands
+}
+
+void Sequencer::cutTissue_()
+{
+	//Move the sample to face the vibratome blade. Note the additional offset in the Z-stage axis
+	Commandline commandline{ Action::ID::CUT };
+	commandline.mAction.cutTissue.setParam(mIterSamplePlaneZtoCut, mIterStageZheightForFacingTheBlade);
+	mCommandList.push_back(commandline);
+	mCutCounter++;		//Count the number of vibratome slices
+	mCommandCounter++;	//Count the number of commands
+
+	//Increase the height of the Z-stage and the height of the plane to cut in the next iteration		
+	//Because of the overlap, the effective stack depth is (1-a)*stackDepth, where a*stackDepth is the overlap
+	const double heightIncrease{ (1 - mStack.readOverlap_frac(TileArray::Axis::KK)) * mStack.readDepthZ() };
+
+	mIterScanZi += heightIncrease;
+	mIterSamplePlaneZtoCut += heightIncrease;
+	mIterStageZheightForFacingTheBlade += heightIncrease;
+}
+
+void Sequencer::panoramicScan_(const double distanceUnderTheSurface)
+{
+	Commandline commandline{ Action::ID::PAN };
+	commandline.mAction.panoramicScan.setParam(mCutCounter, distanceUnderTheSurface, mIterScanZi);
+	mCommandList.push_back(commandline);
+	mCommandCounter++;
+}
+#pragma endregion "sequencer"
+
+#pragma region "SequenceTimeModel"
+SequenceTimeModel::SequenceTimeModel(const Stack stack, const bool multibeam, const SequenceTimeParams params) :
+	mStack{ stack },
+	mMultibeam{ multibeam },
+	mParams{ params },
+	mTilePathPlanner{ { stack.readFFOV(XX), stack.readFFOV(YY) }, stack.readOverlapIJK_frac(), params.mStageKinematics },
+	mConveyingPlanner{ { stack.readFFOV(XX), stack.readFFOV(YY) }, stack.readOverlapIJK_frac(), params.mConveyingKinematics },
+	mWavelengthScheduler{ multibeam },
+	mModeledTime(static_cast<int>(COST::NCOSTS), 0),
+	mMeasuredTime(static_cast<int>(COST::NCOSTS), 0)
+{
+	if (params.mConveyingVelZ <= 0 || params.mSlicingVel <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The conveying and slicing velocities must be > 0");
+	if (params.mDemuxThroughput <= 0 || params.mDiskThroughput <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The throughputs must be > 0");
+	if (params.mPANwidth <= 0 || params.mPANheight <= 0 || params.mPANpixelSizeX <= 0 || params.mPANcoarseFactor < 1)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The panoramic scan parameters must be > 0");
+	if (params.mPANcoarseBinning < 1 || params.mPANcoarseBinning > params.mPANcoarseFactor)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The coarse binning must be in the range [1-" + std::to_string(params.mPANcoarseFactor) + "]");
+	if (params.mPANrescannedFraction < 0 || params.mPANrescannedFraction > 1)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The rescanned fraction must be in the range [0-1]");
+}
+
+//The stages start at the center of the sample and the laser at the wavelength set by Routines::sequencer
+SequenceTimeModel::State SequenceTimeModel::initializeState() const
+{
+	State state;
+	state.mStageXYZ = g_stackCenterXYZ;
+	state.mLaserState = { mParams.mInitialWavelength_nm, mParams.mInitialWavelength_nm };
+	state.mScanDirZ = mParams.mScanDirZini;
+	state.mTileCenterXY = { g_stackCenterXYZ.XX, g_stackCenterXYZ.YY };
+	return state;
+}
+
+//Modeled time of each action type of the command, not calibrated. state is updated to the end of the command
+//As in Routines::sequencer, the laser is configured and the stages move to the tile of the last MOV with the ACQ, concurrently
+std::vector<double> SequenceTimeModel::modelCommandline(const Sequencer::Commandline &commandline, State &state) const
+{
+	std::vector<double> time(static_cast<int>(COST::NCOSTS), 0);
+	const int heightPerBeamletPerFrame_pix{ mMultibeam ? mStack.readTileHeight_pix() / g_nChanPMT : mStack.readTileHeight_pix() };
+	const int nFramesAfterBinning{ static_cast<int>(std::round(mStack.readDepthZ() / mStack.readPixelSizeZ())) };
+
+	switch (commandline.mActionID)
+	{
+	case Action::ID::MOV:
+		state.mTileCenterXY = commandline.mAction.moveStage.readTileCenterXY();
+		break;
+	case Action::ID::ACQ:
+	{
+		const Action::AcqStack acqStack{ commandline.mAction.acqStack };
+		time.at(static_cast<int>(COST::SWITCH)) = mWavelengthScheduler.determineSwitchingTime(state.mLaserState, acqStack.readWavelength_nm());
+		time.at(static_cast<int>(COST::MOV)) = mTilePathPlanner.predictTravelTime({ state.mStageXYZ.XX, state.mStageXYZ.YY }, state.mTileCenterXY);
+
+		//A frame (i.e., a galvo swing) lasts halfPeriodLineclock * heightPerBeamletPerFrame_pix. The Z-stage moves to the initial position at the scan velocity
+		state.mNframesBinning = acqStack.readNframeBinning();
+		const int nFramesBeforeBinning{ nFramesAfterBinning * state.mNframesBinning };
+		const double scanVelZ{ acqStack.readDepthZ() / (nFramesBeforeBinning * g_lineclockHalfPeriod * heightPerBeamletPerFrame_pix) };
+		const double scanZi{ determineInitialScanPos(acqStack.readScanZmin(), acqStack.readDepthZ(), 0. * mm, state.mScanDirZ) };
+		const double scanZf{ determineFinalScanPos(acqStack.readScanZmin(), acqStack.readDepthZ(), 0. * mm, state.mScanDirZ) };
+		time.at(static_cast<int>(COST::ACQ)) = (std::abs(scanZi - state.mStageXYZ.ZZ) + acqStack.readDepthZ()) / scanVelZ + mParams.mAcqOverhead;
+
+		state.mStageXYZ = { state.mTileCenterXY.XX, state.mTileCenterXY.YY, scanZf };
+		reverseSCANDIR(state.mScanDirZ);
+		state.mIsAfterCut = false;
+	}
+	break;
+	case Action::ID::SAV:
+	{
+		//Singlebeam only reads the buffer of the selected channel. The saved stack is binned
+		const double nPixPerBeamlet{ 1. * heightPerBeamletPerFrame_pix * mStack.readTileWidth_pix() * nFramesAfterBinning * state.mNframesBinning };
+		const double demuxSize_MB{ (mMultibeam ? 2 : 1) * nPixPerBeamlet * sizeof(U32) / 1000000. };
+		const double saveSize_MB{ 1. * mStack.readTileHeight_pix() * mStack.readTileWidth_pix() * nFramesAfterBinning / 1000000. };
+		time.at(static_cast<int>(COST::DEMUX)) = demuxSize_MB / mParams.mDemuxThroughput * seconds;
+		time.at(static_cast<int>(COST::SAV)) = saveSize_MB / mParams.mDiskThroughput * seconds;
+	}
+	break;
+	case Action::ID::CUT:
+	{
+		//Convey the sample to the blade, then slice it by moving the Y-stage towards the blade
+		const double planeZtoCut{ commandline.mAction.cutTissue.readStageZheightForFacingTheBlade() };
+		const double conveyingTime{ (std::max)(mConveyingPlanner.predictTravelTime({ state.mStageXYZ.XX, state.mStageXYZ.YY }, mParams.mBladePosXY),
+			std::abs(planeZtoCut - state.mStageXYZ.ZZ) / mParams.mConveyingVelZ) };
+		const double slicingTime{ std::abs(mParams.mFinalBladePosY - mParams.mBladePosXY.YY) / mParams.mSlicingVel };
+		time.at(static_cast<int>(COST::CUT)) = conveyingTime + slicingTime + mParams.mCutOverhead;
+
+		state.mStageXYZ = { mParams.mBladePosXY.XX, mParams.mFinalBladePosY, planeZtoCut };
+		state.mScanDirZ = mParams.mScanDirZini;
+		state.mIsAfterCut = true;
+	}
+	break;
+	case Action::ID::PAN:
+	{
+		time.at(static_cast<int>(COST::SWITCH)) = mWavelengthScheduler.determineSwitchingTime(state.mLaserState, mParams.mPANwavelength_nm);
+
+		//Move to the center of the panoramic scan and let the stages settle
+		const double planeZ{ commandline.mAction.panoramicScan.readPlaneZ() };
+		const double conveyingTime{ (std::max)(mConveyingPlanner.predictTravelTime({ state.mStageXYZ.XX, state.mStageXYZ.YY }, { g_stackCenterXYZ.XX, g_stackCenterXYZ.YY }),
+			std::abs(planeZ - state.mStageXYZ.ZZ) / mParams.mConveyingVelZ) };
+		const double settlingTime{ 500. * ms };
+
+		//The strips are as wide as a tile. PanoramicScan casts the number of strips to an odd number
+		int nStrips{ static_cast<int>(std::ceil(mParams.mPANwidth / mStack.readFFOV(YY))) };
+		if (nStrips % 2 == 0)
+			nStrips++;
+
+		double scanTime;
+		if (mParams.mPANadaptive)
+			scanTime = nStrips * (determinePANstripScanTime_(mParams.mPANcoarseFactor * mParams.mPANpixelSizeX / mParams.mPANcoarseBinning, 1.) + determinePANstripScanTime_(mParams.mPANpixelSizeX, mParams.mPANrescannedFraction));
+		else
+			scanTime = nStrips * determinePANstripScanTime_(mParams.mPANpixelSizeX, 1.);
+		time.at(static_cast<int>(COST::PAN)) = conveyingTime + settlingTime + scanTime;
+
+		state.mStageXYZ = { g_stackCenterXYZ.XX, g_stackCenterXYZ.YY - mStack.readFFOV(YY) * (nStrips - 1) / 2, planeZ };
+	}
+	break;
+	default:
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected action invalid");
+	}
+	return time;
+}
+
+//Replay the command list from firstCommandIndex. The wall time of a cut follows Routines::sequencer with runConcurrently and preArm:
+//the stages move to and scan the next stack while the previous stack is saved, and the next scan waits for the previous stack to be demultiplexed. A cut waits for all the stacks to be saved
+SequenceTimeModel::Prediction SequenceTimeModel::predict(const Sequencer &sequence, const int firstCommandIndex) const
+{
+	if (firstCommandIndex < 0 || firstCommandIndex > sequence.readNtotalCommands())
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The command index is out of range");
+
+	State state{ initializeState() };
+	Prediction prediction;
+	prediction.mBusyTimePerCut.push_back(std::vector<double>(static_cast<int>(COST::NCOSTS), 0));
+
+	double acqEndTime{ 0 }, demuxEndTime{ 0 }, saveEndTime{ 0 };		//Since the start of the cut
+	for (int iterCommandline = firstCommandIndex; iterCommandline < sequence.readNtotalCommands(); iterCommandline++)
+	{
+		const Sequencer::Commandline commandline{ sequence.readCommandline(iterCommandline) };
+		const bool isAfterCut{ state.mIsAfterCut };
+		std::vector<double> time{ modelCommandline(commandline, state) };
+		for (int iterCost = 0; iterCost < static_cast<int>(COST::NCOSTS); iterCost++)
+		{
+			time.at(iterCost) = calibrated_(static_cast<COST>(iterCost), time.at(iterCost));
+			prediction.mBusyTimePerCut.back().at(iterCost) += time.at(iterCost);
+		}
+
+		auto readTime = [&time](const COST cost) { return time.at(static_cast<int>(cost)); };
+		switch (commandline.mActionID)
+		{
+		case Action::ID::MOV:
+			break;	//The move cost is accounted in the ACQ term, which overlaps it with the laser tuning
+		case Action::ID::ACQ:
+			acqEndTime = (std::max)(acqEndTime + (std::max)(readTime(COST::SWITCH), readTime(COST::MOV)), demuxEndTime) + readTime(COST::ACQ);	//The laser is tuned while the stages move
+			prediction.mNstacks++;
+			break;
+		case Action::ID::SAV:
+			demuxEndTime = (std::max)(acqEndTime, demuxEndTime) + readTime(COST::DEMUX);
+			saveEndTime = (std::max)(demuxEndTime, saveEndTime) + readTime(COST::SAV);
+			break;
+		case Action::ID::CUT:
+			prediction.mWallTimePerCut.push_back((std::max)(acqEndTime, saveEndTime) + readTime(COST::CUT));
+			prediction.mBusyTimePerCut.push_back(std::vector<double>(static_cast<int>(COST::NCOSTS), 0));
+			acqEndTime = demuxEndTime = saveEndTime = 0;
+			break;
+		case Action::ID::PAN:
+			//The laser is tuned for the panoramic scan while the vibratome cuts, which takes much longer
+			acqEndTime += ((isAfterCut && mParams.mConfigureDuringCut) ? 0 : readTime(COST::SWITCH)) + readTime(COST::PAN);
+			break;
+		}
+	}
+	prediction.mWallTimePerCut.push_back((std::max)(acqEndTime, saveEndTime));
+
+	return prediction;
+}
+
+void SequenceTimeModel::printPrediction(const Prediction &prediction) const
+{
+	const double hour{ 3600. * seconds };
+	std::cout << "Predicted duration: " << Util::toString(prediction.readWallTime() / hour, 2) << " h (" << Util::toString(prediction.readSerialTime() / hour, 2) <<
+		" h if the actions run one after another)\tstacks = " << prediction.mNstacks << "\tcuts = " << prediction.mWallTimePerCut.size() << "\n";
+
+	std::cout << "Action\tTotal (h)\tCalibration\n";
+	for (int iterCost = 0; iterCost < static_cast<int>(COST::NCOSTS); iterCost++)
+		std::cout << convertCostToString(static_cast<COST>(iterCost)) << "\t" << Util::toString(prediction.readBusyTime(static_cast<COST>(iterCost)) / hour, 3) << "\t\t" <<
+			Util::toString(readCalibrationFactor(static_cast<COST>(iterCost)), 2) << "\n";
+
+	std::cout << "Cut";
+	for (int iterCost = 0; iterCost < static_cast<int>(COST::NCOSTS); iterCost++)
+		std::cout << "\t" << convertCostToString(static_cast<COST>(iterCost));
+	std::cout << "\tWall (s)\n";
+	for (std::vector<double>::size_type iterCut = 0; iterCut < prediction.mWallTimePerCut.size(); iterCut++)
+	{
+		std::cout << iterCut;
+		for (const double busyTime : prediction.mBusyTimePerCut.at(iterCut))
+			std::cout << "\t" << Util::toString(busyTime / seconds, 0);
+		std::cout << "\t" << Util::toString(prediction.mWallTimePerCut.at(iterCut) / seconds, 0) << "\n";
+	}
+}
+
+//Accumulate the action log written by Routines::sequencer. Each line is 'COST\tmodeled time (ms)\tmeasured time (ms)'. The lines starting with '#' are comments
+//Several logs can be accumulated by calling calibrate() once per log
+void SequenceTimeModel::calibrate(const std::string folderPath, const std::string filename)
+{
+	std::ifstream inputFile{ folderPath + filename + ".txt" };
+	if (!inputFile)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": The file " + filename + ".txt failed to open");
+
+	std::string line;
+	while (std::getline(inputFile, line))
+	{
+		if (line.empty() || line.front() == '#')
+			continue;
+
+		std::istringstream fields{ line };
+		std::string cost_s;
+		double modeledTime_ms, measuredTime_ms;
+		if (!(fields >> cost_s >> modeledTime_ms >> measuredTime_ms))
+			throw std::runtime_error((std::string)__FUNCTION__ + ": The line '" + line + "' of " + filename + ".txt is invalid");
+
+		const int costIndex{ static_cast<int>(convertStringToCost(cost_s)) };
+		mModeledTime.at(costIndex) += modeledTime_ms * ms;
+		mMeasuredTime.at(costIndex) += measuredTime_ms * ms;
+	}
+}
+
+//Ratio of the total measured time to the total modeled time. 1 if the action type has not been logged
+double SequenceTimeModel::readCalibrationFactor(const COST cost) const
+{
+	if (cost == COST::NCOSTS)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected action type invalid");
+
+	const int costIndex{ static_cast<int>(cost) };
+	if (mModeledTime.at(costIndex) <= 0)
+		return 1.;
+	return mMeasuredTime.at(costIndex) / mModeledTime.at(costIndex);
+}
+
+std::string SequenceTimeModel::convertCostToString(const COST cost)
+{
+	switch (cost)
+	{
+	case COST::SWITCH:
+		return "SWITCH";
+	case COST::MOV:
+		return "MOV";
+	case COST::ACQ:
+		return "ACQ";
+	case COST::DEMUX:
+		return "DEMUX";
+	case COST::SAV:
+		return "SAV";
+	case COST::CUT:
+		return "CUT";
+	case COST::PAN:
+		return "PAN";
+	default:
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected action type invalid");
+	}
 }
 
-int Action::AcqStack::readStackNumber() const
+SequenceTimeModel::COST SequenceTimeModel::convertStringToCost(const std::string cost_s)
 {
-	return mStackNumber;
+	for (int iterCost = 0; iterCost < static_cast<int>(COST::NCOSTS); iterCost++)
+		if (convertCostToString(static_cast<COST>(iterCost)) == cost_s)
+			return static_cast<COST>(iterCost);
+
+	throw std::invalid_argument((std::string)__FUNCTION__ + ": The action type " + cost_s + " is invalid");
 }
 
-int Action::AcqStack::readStackIndex() const
+SequenceTimeParams SequenceTimeModel::readParams() const
 {
-	return mStackIndex;
+	return mParams;
 }
 
-int Action::AcqStack::readWavelength_nm() const
+double SequenceTimeModel::calibrated_(const COST cost, const double modeledTime) const
 {
-	return mWavelength_nm;
+	return readCalibrationFactor(cost) * modeledTime;
 }
 
-SCANDIR Action::AcqStack::readScanDirZ() const
+//Scan a fraction of the height of a strip, plus the travel overhead on each side. The X-stage velocity is set so that the stage moves one pixel per half period of the line clock
+double SequenceTimeModel::determinePANstripScanTime_(const double pixelSizeX, const double heightFraction) const
 {
-	return mScanDirZ;
+	int nTilesII{ static_cast<int>(std::ceil(mParams.mPANheight / mStack.readFFOV(XX))) };
+	if (nTilesII % 2 == 0)
+		nTilesII++;
+	const double travelOverhead{ 1.0 * mm };
+	const double travel{ heightFraction * nTilesII * mStack.readFFOV(XX) + 2 * travelOverhead };
+
+	return travel / (pixelSizeX / g_lineclockHalfPeriod) + mParams.mPANstripOverhead;
 }
 
-double Action::AcqStack::readScanZmin() const
+double SequenceTimeModel::Prediction::readBusyTime(const COST cost) const
 {
-	return mScanZmin;
+	double time{ 0 };
+	for (const std::vector<double> &busyTime : mBusyTimePerCut)
+		time += busyTime.at(static_cast<int>(cost));
+	return time;
 }
 
-double Action::AcqStack::readDepthZ() const
+//The actions run one after another, as in Routines::sequencer without runConcurrently
+double SequenceTimeModel::Prediction::readSerialTime() const
 {
-	return mDepthZ;
+	double time{ 0 };
+	for (int iterCost = 0; iterCost < static_cast<int>(COST::NCOSTS); iterCost++)
+		time += readBusyTime(static_cast<COST>(iterCost));
+	return time;
 }
 
-double Action::AcqStack::readScanPmin() const
+double SequenceTimeModel::Prediction::readWallTime() const
 {
-	return mScanPmin;
+	double time{ 0 };
+	for (const double wallTime : mWallTimePerCut)
+		time += wallTime;
+	return time;
 }
+#pragma endregion "SequenceTimeModel"
 
-double Action::AcqStack::readScanPLexp() const
+#pragma region "ActionTimeLog"
+ActionTimeLog::ActionTimeLog(const std::string folderPath, const std::string filename) :
+	mDatalog{ folderPath, filename, OVERRIDE::DIS }
 {
-	return mScanPLexp;
+	mDatalog.record("#Action\tModeled (ms)\tMeasured (ms)");
 }
 
-int Action::AcqStack::readNframeBinning() const
+void ActionTimeLog::record(const SequenceTimeModel::COST cost, const double modeledTime, const double measuredTime)
 {
-	return mNframeBinning;
+	std::lock_guard<std::mutex> lock{ mMutex };
+	mDatalog.record(SequenceTimeModel::convertCostToString(cost) + "\t" + Util::toString(modeledTime / ms, 1) + "\t" + Util::toString(measuredTime / ms, 1));
 }
 
-void Action::CutTissue::setParam(const double planeZtoCut, const double stageZheightForFacingTheBlade)
+//Record the time measured from startTime to endTime against the modeled time of the action type in modeledTime (as returned by SequenceTimeModel::modelCommandline)
+void ActionTimeLog::record(const SequenceTimeModel::COST cost, const std::vector<double> &modeledTime, const std::chrono::time_point<std::chrono::high_resolution_clock> startTime, const std::chrono::time_point<std::chrono::high_resolution_clock> endTime)
 {
-	if (planeZtoCut < 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The Z stage height must be >= 0");
-	if (stageZheightForFacingTheBlade < 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The Z stage height must be >= 0");
-
-	mPlaneZtoCut = planeZtoCut;
-	mStageZheightForFacingTheBlade = stageZheightForFacingTheBlade;
+	record(cost, modeledTime.at(static_cast<int>(cost)), std::chrono::duration<double>(endTime - startTime).count() * seconds);
 }
 
-double Action::CutTissue::readPlaneZtoCut() const
+//Wrap the action to record its measured time when it runs
+std::function<void()> ActionTimeLog::timeAction(const SequenceTimeModel::COST cost, const std::vector<double> &modeledTime, std::function<void()> action)
 {
-	return mPlaneZtoCut;
+	const double modeledCostTime{ modeledTime.at(static_cast<int>(cost)) };
+	return [=]
+	{
+		const auto startTime{ std::chrono::high_resolution_clock::now() };
+		action();
+		record(cost, modeledCostTime, std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count() * seconds);
+	};
 }
+#pragma endregion "ActionTimeLog"
 
-double Action::CutTissue::readStageZheightForFacingTheBlade() const 
+#pragma region "ActionExecutor"
+ActionExecutor::ActionExecutor(const int maxQueuedPerResource) :
+	mMaxQueuedPerResource{ maxQueuedPerResource },
+	mQueues(static_cast<int>(RESOURCE::NRESOURCES)),
+	mBusyTime(static_cast<int>(RESOURCE::NRESOURCES), 0)
 {
-	return mStageZheightForFacingTheBlade;
+	if (maxQueuedPerResource <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The number of queued actions per resource must be > 0");
+
+	for (int iterResource = 0; iterResource < static_cast<int>(RESOURCE::NRESOURCES); iterResource++)
+		mThreads.push_back(std::thread{ &ActionExecutor::workerLoop_, this, iterResource });
 }
 
-void Action::PanoramicScan::setParam(const int cutNumber, const double distanceUnderTheSurface, const double stageZpos)
+//Let the actions already submitted complete before destroying the objects they refer to
+ActionExecutor::~ActionExecutor()
 {
-	if (cutNumber < 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The cut number must be >= 0");
-	if (stageZpos < 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The Z stage height must be >= 0");
+	{
+		std::lock_guard<std::mutex> lock{ mMutex };
+		mStop = true;
+	}
+	mCondition.notify_all();
 
-	mCutNumber = cutNumber;
-	mPlaneZ = stageZpos + distanceUnderTheSurface;
+	for (std::thread &thread : mThreads)
+		thread.join();
 }
 
-double Action::PanoramicScan::readPlaneZ() const
+//Return the handle of the action, to be used as a dependency of the subsequent actions. Only the actions already submitted can be dependencies
+int ActionExecutor::submit(const RESOURCE resource, const std::string name, std::function<void()> action, const std::vector<int> dependencies)
 {
-	return mPlaneZ;
+	if (resource == RESOURCE::NRESOURCES)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected resource invalid");
+	if (!action)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The action is empty");
+
+	std::unique_lock<std::mutex> lock{ mMutex };
+	for (const int dependency : dependencies)
+		if (dependency < NONE || dependency >= static_cast<int>(mStates.size()))
+			throw std::invalid_argument((std::string)__FUNCTION__ + ": The dependency " + std::to_string(dependency) + " has not been submitted");
+
+	std::deque<Task> &queue{ mQueues.at(static_cast<int>(resource)) };
+	mCondition.wait(lock, [&] { return mException || static_cast<int>(queue.size()) < mMaxQueuedPerResource; });
+
+	//Do not start new actions after a failure
+	if (mException)
+		std::rethrow_exception(mException);
+
+	const int handle{ static_cast<int>(mStates.size()) };
+	mStates.push_back(STATE::QUEUED);
+	queue.push_back({ handle, name, std::move(action), dependencies });
+	mCondition.notify_all();
+
+	return handle;
 }
 
-int Action::PanoramicScan::readCutNumber() const
+//Wait for the action to complete. Rethrow the failure if the action did not complete
+void ActionExecutor::wait(const int handle)
 {
-	return mCutNumber;
+	if (handle == NONE)
+		return;
+
+	std::unique_lock<std::mutex> lock{ mMutex };
+	if (handle < 0 || handle >= static_cast<int>(mStates.size()))
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The action " + std::to_string(handle) + " has not been submitted");
+
+	mCondition.wait(lock, [&] { return isFinished_(handle); });
+	if (mStates.at(handle) != STATE::DONE && mException)
+		std::rethrow_exception(mException);
 }
-#pragma endregion "Action"
 
-#pragma region "Commandline"
-Sequencer::Commandline::Commandline(const Action::ID actionID) :
-	mActionID{ actionID }
-{}
+//Wait for all the actions submitted to complete or be cancelled. Rethrow the first failure
+void ActionExecutor::waitAll()
+{
+	std::unique_lock<std::mutex> lock{ mMutex };
+	mCondition.wait(lock, [&] {
+		if (mNrunning > 0)
+			return false;
+		for (const std::deque<Task> &queue : mQueues)
+			if (!queue.empty())
+				return false;
+		return true;
+	});
+
+	if (mException)
+		std::rethrow_exception(mException);
+}
 
-void Sequencer::Commandline::printToFile(std::ofstream *fileHandle) const
+//Time spent by the resource running its actions
+double ActionExecutor::readBusyTime(const RESOURCE resource) const
 {
-	switch (mActionID)
-	{
-	case Action::ID::MOV:
-		*fileHandle << convertActionIDtoString_(mActionID) << "\t" << mAction.moveStage.readCutNumber();
-		*fileHandle << "\t(" << mAction.moveStage.readTileIndex(TileArray::Axis::II) << "," << mAction.moveStage.readTileIndex(TileArray::Axis::JJ) << ")\t";
-		*fileHandle << std::setprecision(4);
-		*fileHandle << "(" << mAction.moveStage.readTileCenter(AXIS::XX) / mm << "," << mAction.moveStage.readTileCenter(AXIS::YY) / mm << ")\n";
-		break;
-	case Action::ID::ACQ:
-		*fileHandle << convertActionIDtoString_(mActionID) << "\t\t\t\t\t";
-		*fileHandle << mAction.acqStack.readStackIndex() << "\t";
-		*fileHandle << mAction.acqStack.readWavelength_nm() << "\t";
-		*fileHandle << std::setprecision(3);
-		*fileHandle << mAction.acqStack.readScanZmin() / mm << "\t";
-		*fileHandle << (mAction.acqStack.readScanZmin() + mAction.acqStack.readDepthZ()) / mm << "\t";
-		*fileHandle << std::setprecision(0);
-		*fileHandle << mAction.acqStack.readScanPmin() << "\t" << mAction.acqStack.readScanPLexp() << "\n";
-		break;
-	case Action::ID::SAV:
-		*fileHandle << convertActionIDtoString_(mActionID) + "\n";
-		break;
-	case Action::ID::CUT:
-		*fileHandle << convertActionIDtoString_(mActionID);
-		*fileHandle << std::setprecision(3);
-		*fileHandle << "******Stage height for facing the VT = " << mAction.cutTissue.readStageZheightForFacingTheBlade() / mm << " mm";
-		*fileHandle << "******Equivalent sample plane Z = " << mAction.cutTissue.readPlaneZtoCut() / mm << " mm";
-		*fileHandle << "********\n";
-		break;
-	case Action::ID::PAN:
-		*fileHandle << convertActionIDtoString_(mActionID);
-		*fileHandle << std::setprecision(3);
-		*fileHandle << "******************************Panoramic scan at plane z = " << mAction.panoramicScan.readPlaneZ() / mm << " mm";
-		*fileHandle << "********************************\n";
-		break;
-	default:
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected action invalid");
-	}
+	std::lock_guard<std::mutex> lock{ mMutex };
+	return mBusyTime.at(static_cast<int>(resource));
 }
-/*
-void Sequencer::Commandline::printParameters() const
+
+int ActionExecutor::readNcompleted() const
 {
-	switch (mActionID)
-	{
-	case Action::ID::MOV:
-		std::cout << "The command is " << convertActionIDtoString_(mActionID) << " with parameters: \n";
-		std::cout << "vibratome slice number = " << mAction.moveStage.readCutNumber() << "\n";
-		std::cout << "Tile ij = (" << mAction.moveStage.readTileIndex(TileArray::Axis::II) << "," << mAction.moveStage.readTileIndex(TileArray::Axis::JJ) << ")\n";
-		std::cout << "Tile center (stageX, stageY) = (" << mAction.moveStage.readTileCenter(AXIS::XX) / mm << "," << mAction.moveStage.readTileCenter(AXIS::YY) / mm << ") mm\n\n";
-		break;
-	case Action::ID::ACQ:
-		std::cout << "The command is " << convertActionIDtoString_(mActionID) << " with parameters: \n";
-		std::cout << "wavelength = " << mAction.acqStack.readWavelength_nm() << " nm\n";
-		std::cout << "scanDirZ = " << Util::convertScandirToInt(mAction.acqStack.readScanDirZ()) << "\n";
-		std::cout << "scanZmin / depthZ = " << mAction.acqStack.readScanZmin() / mm << " mm/" << mAction.acqStack.readDepthZ() << " mm\n";
-		std::cout << "scanPmin / ScanPLexp = " << mAction.acqStack.readScanPmin() / mW << " mW/" << mAction.acqStack.readScanPLexp() / um << " (um)\n\n";
-		break;
-	case Action::ID::SAV:
-		std::cout << "The command is " << convertActionIDtoString_(mActionID) << "\n";
-		break;
-	case Action::ID::CUT:
-		std::cout << "The command is " << convertActionIDtoString_(mActionID) << "\n";
-		break;
-	default:
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected action invalid");
-	}
+	std::lock_guard<std::mutex> lock{ mMutex };
+	return mNcompleted;
 }
-*/
 
-std::string Sequencer::Commandline::convertActionIDtoString_(const Action::ID actionID) const
+int ActionExecutor::readNcancelled() const
 {
-	switch (actionID)
-	{
-	case Action::ID::CUT:
-		return "CUT";
-	case Action::ID::SAV:
-		return "SAV";
-	case Action::ID::ACQ:
-		return "ACQ";
-	case Action::ID::MOV:
-		return "MOV";
-	case Action::ID::PAN:
-		return "PAN";
-	default:
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected action invalid");
-	}
+	std::lock_guard<std::mutex> lock{ mMutex };
+	return mNcancelled;
 }
-#pragma endregion "Commandline"
 
-#pragma region "Sequencer"
-//Constructor using the sample's LOI. The number of stacks is calculated automatically based on the FFOV
-Sequencer::Sequencer(const Sample sample, const Stack stack) :
-	mSample{ sample },
-	mStack{ stack },
-	mTileArray{ stack.readTileHeight_pix(), stack.readTileWidth_pix(), determineTileArraySizeIJ_(), stack.readOverlapIJK_frac() }
+//Call with mMutex locked
+bool ActionExecutor::isFinished_(const int handle) const
 {
-	initializeVibratome_();
-	initializeEffectiveROI_();		//Calculate the effective ROI covered by all the tiles, which might be slightly larger than the requested ROI
-	reserveMemoryBlock_();			//Reserve memory for speed
+	const STATE state{ mStates.at(handle) };
+	return state == STATE::DONE || state == STATE::FAILED || state == STATE::CANCELLED;
 }
 
-//Generate a scan pattern including slicing the sample with the vibratome
-//II is the row index (along the image height and X-stage) and JJ is the column index (along the image width and Y-stage) of the tile. II and JJ start from 0
-//For some reason, a snake-pattern results in alternating columns of brighter and darker tiles
-//Use the same scan order for all the wavelengths because the stages may drift over time
-//Currently performing column-by-column scan
-//The Z-scan scan direction is set dynamically during runtime
-void Sequencer::generateCommandList()
+void ActionExecutor::workerLoop_(const int resourceIndex)
 {
-	std::cout << "Generating the command list..." << "\n";
-	for (int iterCut = 0; iterCut < mNtotalCuts; iterCut++)
+	std::deque<Task> &queue{ mQueues.at(resourceIndex) };
+	std::unique_lock<std::mutex> lock{ mMutex };
+	while (true)
 	{
-		panoramicScan_(30. * um);																//Panoramic scan 30 um below the surface
-		panoramicScan_(100. * um);																//Panoramic scan 100 um below the surface
+		//The action at the front of the queue starts when all its dependencies have finished. Because the dependencies are submitted earlier, the resources never wait for each other in a cycle
+		mCondition.wait(lock, [&] {
+			if (queue.empty())
+				return mStop;
+			for (const int dependency : queue.front().mDependencies)
+				if (dependency != NONE && !isFinished_(dependency))
+					return false;
+			return true;
+		});
+		if (queue.empty())
+			return;
+
+		Task task{ std::move(queue.front()) };
+		queue.pop_front();
+
+		//Cancel the action if any of its dependencies did not complete
+		bool isCancelled{ false };
+		for (const int dependency : task.mDependencies)
+			if (dependency != NONE && mStates.at(dependency) != STATE::DONE)
+				isCancelled = true;
+
+		if (isCancelled)
+		{
+			mStates.at(task.mHandle) = STATE::CANCELLED;
+			mNcancelled++;
+			mCondition.notify_all();
+			continue;
+		}
 
-		for (std::vector<int>::size_type iterFluorMarker = 0;
-			iterFluorMarker != mSample.readFluorMarkerListSize();
-			iterFluorMarker++)
+		mStates.at(task.mHandle) = STATE::RUNNING;
+		mNrunning++;
+		mCondition.notify_all();	//The queue has room for one more action
+		lock.unlock();
+
+		const auto startTime{ std::chrono::high_resolution_clock::now() };
+		std::exception_ptr exception;
+		try
 		{
-			initializeScanDirIJ_();																//Reset the X-stage and Y-stage scan directions for every wavelength
+			task.mAction();
+		}
+		catch (...)
+		{
+			exception = std::current_exception();
+		}
+		const double duration{ std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count() * seconds };
+		task.mAction = nullptr;		//Release the objects captured by the action before notifying its completion
 
-			//The Y-stage is the slowest to react because it sits under the 2 other stages.
-			//For better performance, iterate over II often and over JJ less often
-			while (mJJ >= 0 &&
-				   mJJ < mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ))					//Y-stage iteration
+		lock.lock();
+		mBusyTime.at(resourceIndex) += duration;
+		mNrunning--;
+		if (exception)
+		{
+			mStates.at(task.mHandle) = STATE::FAILED;
+			if (!mException)
 			{
-				while (mII >= 0 &&
-					   mII < mTileArray.readTileArraySizeIJ(TileArray::Axis::II))				//X-stage iteration
-				{
-					moveStage_({ mII, mJJ });
-					acqStack_(iterFluorMarker);
-					saveStack_();
-					mII -= Util::convertScandirToInt(mIterScanDirXYZ.XX);						//Increase/decrease the iterator in the X-stage axis
-				}
-				initializeScanDirII_();															//Reset the X-stage scan direction
-				mJJ -= Util::convertScandirToInt(mIterScanDirXYZ.YY);							//Increase/decrease the iterator in the Y-stage axis
+				mException = exception;
+				std::cerr << "An exception has occurred in the action " << task.mName << ". The actions that depend on it are cancelled\n";
 			}
 		}
-		if (iterCut < mNtotalCuts - 1)														//Only need to cut the sample 'nVibratomeCuts -1' times
-			cutTissue_();
+		else
+		{
+			mStates.at(task.mHandle) = STATE::DONE;
+			mNcompleted++;
+		}
+		mCondition.notify_all();
 	}
 }
-
-//II is the row index (along the image height and X-stage) and JJ is the column index (along the image width and Y-stage) of the tile. II and JJ start from 0
-//The center the tile array is at the sample center (exact center for an odd number of tiles or slightly off center for an even number of tiles)
-POSITION2 Sequencer::convertTileIndicesIJToStagePosXY(const TILEIJ tileIndicesIJ) const
-{
-	if (tileIndicesIJ.II < 0 || tileIndicesIJ.II >= mTileArray.readTileArraySizeIJ(TileArray::Axis::II))
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile index II must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::II) - 1) + "]");
-	if (tileIndicesIJ.JJ < 0 || tileIndicesIJ.JJ >= mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ))
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile index JJ must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) - 1) + "]");
-
-	//The tile centers are (1-a)*FFOV away from each other, where a*L is the tile overlap
-	POSITION2 centeredIJ{ determineRelativeTileIndicesIJ(mStack.readOverlapIJK_frac(), mTileArray.readTileArraySizeIJ(), tileIndicesIJ) };
-	POSITION2 stagePosXY;
-	stagePosXY.XX = mSample.mCenterXY.XX - mStack.readFFOV(AXIS::XX)  * centeredIJ.XX;
-	stagePosXY.YY = mSample.mCenterXY.YY - mStack.readFFOV(AXIS::YY)  * centeredIJ.YY;
-
-	return stagePosXY;
-}
-
-std::string Sequencer::printHeader() const
+#pragma endregion "ActionExecutor"
+
+#pragma region "SequenceSimulator"
+SequenceSimulator::SequenceSimulator(const Stack stack, const bool multibeam, const SimulationPolicy policy, const SequenceTimeParams params) :
+	mPolicy{ policy },
+	mTilePathPlanner{ { stack.readFFOV(XX), stack.readFFOV(YY) }, stack.readOverlapIJK_frac(), params.mStageKinematics },
+	mWavelengthScheduler{ multibeam },
+	mTimeModel{ stack, multibeam, params },
+	mNow{ 0 },
+	mMainPredecessor{ NONE }
 {
-	return 	"Action\tCut#\tTileIJ\t(stageX,stageY)\tStackID\tWavlen\tstageZ<\tstageZ>\tPmin\tPLexp";
+	if (mPolicy.mMaxQueuedPerResource < 1)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The number of queued actions per resource must be > 0");
 }
 
-std::string Sequencer::printHeaderUnits() const
+//Calibrate the mock devices with the action logs written by Routines::sequencer. See SequenceTimeModel::calibrate()
+void SequenceSimulator::calibrate(const std::string folderPath, const std::string filename)
 {
-	return "\t\t(mm,mm)\t\t\tnm\tmm\tmm\tmW\tum";
+	mTimeModel.calibrate(folderPath, filename);
 }
 
-void Sequencer::printSequenceParams(std::ofstream *fileHandle) const
+//Run the command list from firstCommandIndex on. The tiles not set in tileBitmap are dark in every cut. The tile path and the wavelength order of each cut are planned like in Routines::sequencer,
+//which modifies the command list
+SequenceSimulator::Report SequenceSimulator::simulate(Sequencer &sequence, const TileBitmap &tileBitmap, const int firstCommandIndex)
 {
-	*fileHandle << "SEQUENCER ************************************************************\n";
-	*fileHandle << "Stages initial scan direction {stageX, stageY, stageZ} = {" << Util::convertScandirToInt(g_initialStageScanDirXYZ.XX) << ", " <<
-																				   Util::convertScandirToInt(g_initialStageScanDirXYZ.YY) << ", " <<
-																				   Util::convertScandirToInt(g_initialStageScanDirXYZ.ZZ) << "}\n";
-	*fileHandle << std::setprecision(4);
-	*fileHandle << "Effective LOI (stageX, stageY, stageZ) = (" << determineEffectiveLOIxyz().XX / mm << " mm, " <<
-																   determineEffectiveLOIxyz().YY / mm << " mm, " <<
-																   determineEffectiveLOIxyz().ZZ / mm << " mm)\n";
+	if (firstCommandIndex < 0 || firstCommandIndex > sequence.readNtotalCommands())
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The first command index must be in the range [0-" + std::to_string(sequence.readNtotalCommands()) + "]");
+	if (tileBitmap.readTileArraySizeIJ().II != sequence.readTileArraySizeIJ().II || tileBitmap.readTileArraySizeIJ().JJ != sequence.readTileArraySizeIJ().JJ)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The size of the tile bitmap must match the tile array of the sequence");
+
+	const auto simulationStartTime{ std::chrono::high_resolution_clock::now() };
+	const int nDevices{ static_cast<int>(DEVICE::NDEVICES) };
+	mNow = 0;
+	mTasks.clear();
+	mQueues.assign(nDevices, {});
+	mRunning.assign(nDevices, NONE);
+	mLastOnDevice.assign(nDevices, NONE);
+	mEvents = {};
+	mMainPredecessor = NONE;
+
+	//Calibrated time of the actions of a commandline
+	SequenceTimeModel::State modelState{ mTimeModel.initializeState() };
+	auto modelCommandline = [&](const Sequencer::Commandline &commandline)
+	{
+		std::vector<double> time{ mTimeModel.modelCommandline(commandline, modelState) };
+		for (int iterCost = 0; iterCost < static_cast<int>(SequenceTimeModel::COST::NCOSTS); iterCost++)
+			time.at(iterCost) *= mTimeModel.readCalibrationFactor(static_cast<SequenceTimeModel::COST>(iterCost));
+		return time;
+	};
+	auto readCost = [](const std::vector<double> &time, const SequenceTimeModel::COST cost) { return time.at(static_cast<int>(cost)); };
+
+	StackPipeline<SequenceSimulator> pipeline{ *this, mPolicy.mPreArm };			//Same dependencies as in Routines::sequencer
+	TILEIJ tileIJ{ -1, -1 };
+	bool isCutPlanned{ false };
+	int nStacks{ 0 };
+	double cutStartTime{ 0 };
+	int cutPredecessor{ NONE };
+	for (int iterCommandline = firstCommandIndex; iterCommandline < sequence.readNtotalCommands(); iterCommandline++)
+	{
+		Sequencer::Commandline commandline{ sequence.readCommandline(iterCommandline) };
 
-	*fileHandle << "Effective ROI boundaries [YMIN, XMIN, YMAX, XMAX] = [" << mROI.YMIN / mm << " mm, " <<
-																			  mROI.XMIN / mm << " mm, " <<
-																			  mROI.YMAX / mm << " mm, " <<
-																			  mROI.XMAX / mm << " mm]\n";
-	*fileHandle << "Z position of the surface of the sample = " << mSample.mSurfaceZ / mm << " mm\n";
-	*fileHandle << std::setprecision(0);
-	*fileHandle << "Total # tissue cuts = " << mNtotalCuts << "\n";
-	*fileHandle << "Tile array size (stageX, stageY) = (" << mTileArray.readTileArraySizeIJ(TileArray::Axis::II) << ", " <<
-															 mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) << ")\n";
+		//Plan the cut at its first MOV, like Routines::sequencer
+		if ((mPolicy.mPlanTilePath || mPolicy.mScheduleWavelengths) && !isCutPlanned && commandline.mActionID == Action::ID::MOV)
+		{
+			isCutPlanned = true;
+			if (mPolicy.mPlanTilePath)
+			{
+				std::vector<TILEIJ> brightTilePath;
+				for (const TILEIJ &pathTileIJ : sequence.readTilePath(iterCommandline))
+					if (tileBitmap.test(pathTileIJ))
+						brightTilePath.push_back(pathTileIJ);
+				sequence.reorderTilePath(iterCommandline, mTilePathPlanner.planPath(brightTilePath));
+			}
 
-	*fileHandle << "Total # stacks entire sample = " << mStackCounter << "\n";
-	*fileHandle << "Total # commandlines = " << mCommandCounter << "\n";
+			//The cut has no tile commands left if all its tiles are dark
+			if (mPolicy.mScheduleWavelengths && iterCommandline < sequence.readNtotalCommands() && sequence.readCommandline(iterCommandline).mActionID == Action::ID::MOV)
+				sequence.reorderWavelengths(iterCommandline, mWavelengthScheduler.planOrder(modelState.mLaserState, sequence.readWavelengthOrder(iterCommandline)));
 
-	//const double imagingTimePerStack{ g_lineclockHalfPeriod *  mStack.readTileHeight_pix() * (mStack.readDepthZ() / mStack.readPixelSizeZ()) / 16 };
-	//const double totalImagingTime_hours{ (mStackCounter + 1) * imagingTimePerStack / seconds / 3600. };
+			if (iterCommandline >= sequence.readNtotalCommands())
+				break;
+			commandline = sequence.readCommandline(iterCommandline);
+		}
 
-	//*fileHandle << "Runtime per stack = " << imagingTimePerStack / ms << " ms (times nBinning)\n";
-	//*fileHandle << std::setprecision(6);
-	//*fileHandle << "Estimated total runtime (multibeam + pipelining) = " << totalImagingTime_hours << " hrs (times nBinning)\n\n";
+		switch (commandline.mActionID)
+		{
+		case Action::ID::MOV:
+			tileIJ = { commandline.mAction.moveStage.readTileIndex(TileArray::Axis::II), commandline.mAction.moveStage.readTileIndex(TileArray::Axis::JJ) };
+			modelCommandline(commandline);
+			break;
+		case Action::ID::ACQ:
+			if (tileBitmap.test(tileIJ))
+			{
+				//The arming is part of the modeled ACQ
+				const std::vector<double> time{ modelCommandline(commandline) };
+				const double armTime{ (std::min)(mTimeModel.readParams().mArmTime, readCost(time, SequenceTimeModel::COST::ACQ)) };
+				const std::string label{ "(" + std::to_string(tileIJ.II) + "," + std::to_string(tileIJ.JJ) + ")" };
+				pipeline.submitAcquisition(label + " " + std::to_string(commandline.mAction.acqStack.readWavelength_nm()) + " nm", readCost(time, SequenceTimeModel::COST::SWITCH), readCost(time, SequenceTimeModel::COST::MOV), armTime, readCost(time, SequenceTimeModel::COST::ACQ) - armTime);
+				nStacks++;
+			}
+			break;
+		case Action::ID::SAV:
+			if (tileBitmap.test(tileIJ))
+			{
+				const std::vector<double> time{ modelCommandline(commandline) };
+				const std::string label{ "(" + std::to_string(tileIJ.II) + "," + std::to_string(tileIJ.JJ) + ")" };
+				pipeline.submitReadout(label, readCost(time, SequenceTimeModel::COST::DEMUX));
+				pipeline.submitSave(label, readCost(time, SequenceTimeModel::COST::SAV));
+			}
+			break;
+		case Action::ID::CUT:
+		{
+			waitAll_();
+			const std::vector<double> time{ modelCommandline(commandline) };
+			cutStartTime = mNow;
+			cutPredecessor = mMainPredecessor;
+			runOnMain_(DEVICE::VIBRATOME, "CUT at z = " + Util::toString(commandline.mAction.cutTissue.readPlaneZtoCut() / mm, 3) + " mm", readCost(time, SequenceTimeModel::COST::CUT));
+			isCutPlanned = false;
+		}
+		break;
+		case Action::ID::PAN:
+		{
+			const bool isConfiguredDuringCut{ modelState.mIsAfterCut && mPolicy.mScheduleWavelengths };
+			const std::vector<double> time{ modelCommandline(commandline) };
+			const std::string label{ "PAN at z = " + Util::toString(commandline.mAction.panoramicScan.readPlaneZ() / mm, 3) + " mm" };
+			if (isConfiguredDuringCut)
+			{
+				//The laser was tuned on another thread while the vibratome cut. The panoramic scan waits for the slower of the two
+				mTasks.push_back({ DEVICE::LASER, "Configure " + label, readCost(time, SequenceTimeModel::COST::SWITCH), {}, cutStartTime, cutPredecessor, cutStartTime, cutPredecessor, true });
+				const int switchHandle{ static_cast<int>(mTasks.size()) - 1 };
+				if (readEndTime_(switchHandle) > mNow)
+				{
+					mNow = readEndTime_(switchHandle);
+					mMainPredecessor = switchHandle;
+				}
+			}
+			else
+				runOnMain_(DEVICE::LASER, "Configure " + label, readCost(time, SequenceTimeModel::COST::SWITCH));
+			runOnMain_(DEVICE::STAGES, label, readCost(time, SequenceTimeModel::COST::PAN));
+		}
+		break;
+		default:
+			throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected action invalid");
+		}//switch
+		if (!mPolicy.mRunConcurrently)
+			waitAll_();
+	}//for
+	waitAll_();
+
+	Report report{ createReport_(nStacks) };
+	report.mSimulationTime = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - simulationStartTime).count() * seconds;
+	return report;
 }
 
-//Print the commandlist to file
-void Sequencer::printToFile(const std::string folderPath, std::string filename, const OVERRIDE override) const
+void SequenceSimulator::printReport(const Report &report) const
 {
-	if (override == OVERRIDE::DIS)
-		filename = Util::doesFileExist(folderPath, filename, ".txt");
-
-	std::ofstream *fileHandle{ new std::ofstream(folderPath + filename + ".txt") };
-
-	*fileHandle << std::fixed;	//Show a fixed number of digits
-
-	mSample.printSampleParams(fileHandle);
-	mSample.printFluorParams(fileHandle);
-	printSequenceParams(fileHandle);
-	mStack.printParams(fileHandle);
-
-	//Print out the header
-	if (!mCommandList.empty())
+	const double hour{ 3600. * seconds };
+	std::cout << mPolicy.mName << ": simulated duration = " << Util::toString(report.mMakespan / hour, 2) << " h (simulated in " << Util::toString(report.mSimulationTime / seconds, 2) << " s)\tstacks = " << report.mNstacks <<
+		"\tstacks per hour = " << Util::toString(report.mNstacks / (report.mMakespan / hour), 0) << "\n";
+	std::cout << "Device\t\tBusy (h)\tUtilization\tCritical path (h)\n";
+	for (int iterDevice = 0; iterDevice < static_cast<int>(DEVICE::NDEVICES); iterDevice++)
 	{
-		*fileHandle << "Act#\t" + printHeader() + "\n";
-		*fileHandle << "\t\t" + printHeaderUnits() + "\n";
+		const DEVICE device{ static_cast<DEVICE>(iterDevice) };
+		std::cout << convertDeviceToString(device) << "\t\t" << Util::toString(report.mBusyTime.at(iterDevice) / hour, 3) << "\t\t" <<
+			Util::toString(100. * report.readUtilization(device), 1) << " %\t\t" << Util::toString(report.mCriticalPathTime.at(iterDevice) / hour, 3) << "\n";
 	}
+	std::cout << "Actions on the critical path: " << report.mNcriticalActions << "/" << mTasks.size() << "\tlongest = " << report.mLongestCriticalAction <<
+		" (" << Util::toString(report.mLongestCriticalDuration / seconds, 2) << " s)\n";
+}
 
-	for (std::vector<int>::size_type iterCommandline = 0; iterCommandline != mCommandList.size(); iterCommandline++)
-		//for (std::vector<int>::size_type iterCommandline = 0; iterCommandline != 3*(3 * 3 * mTileArraySizeIJ.at(X) * mTileArraySizeIJ.at(Y)+1) + 2 ; iterCommandline++) //For debugging
+std::string SequenceSimulator::convertDeviceToString(const DEVICE device)
+{
+	switch (device)
 	{
-		*fileHandle << iterCommandline << "\t";		//Print out the iteration number
-		mCommandList.at(iterCommandline).printToFile(fileHandle);
+	case DEVICE::STAGES:
+		return "Stages";
+	case DEVICE::LASER:
+		return "Laser";
+	case DEVICE::FPGA:
+		return "FPGA";
+	case DEVICE::DEMUX:
+		return "Demux";
+	case DEVICE::DISK:
+		return "Disk";
+	case DEVICE::VIBRATOME:
+		return "Vibratome";
+	default:
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected device invalid");
 	}
-
-	*fileHandle << std::defaultfloat;
-	fileHandle->close();
 }
 
-int Sequencer::readNumberOfStacksPerCut() const
+double SequenceSimulator::Report::readUtilization(const DEVICE device) const
 {
-	return mTileArray.readTileArraySizeIJ(TileArray::Axis::II) * mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ);
+	if (device == DEVICE::NDEVICES)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Selected device invalid");
+	if (mMakespan <= 0)
+		return 0;
+	return mBusyTime.at(static_cast<int>(device)) / mMakespan;
 }
 
-int Sequencer::readTotalNumberOfCuts() const
+//-1 if the action has not started
+double SequenceSimulator::readEndTime_(const int handle) const
 {
-	return mNtotalCuts;
+	const Task &task{ mTasks.at(handle) };
+	if (task.mStartTime < 0)
+		return -1;
+	return task.mStartTime + task.mDuration;
 }
 
-int Sequencer::readTotalNumberOfStacks() const
+//Queue an action on a device. Like ActionExecutor::submit(), block the submitting thread (i.e., advance the virtual time) while the queue of the device is full.
+//The name of the action is reported if it lies on the critical path
+int SequenceSimulator::submit(const DEVICE device, const std::string name, const double duration, const std::vector<int> dependencies)
 {
-	return mStackCounter;
-}
+	const int deviceIndex{ static_cast<int>(device) };
+	while (static_cast<int>(mQueues.at(deviceIndex).size()) >= mPolicy.mMaxQueuedPerResource)
+	{
+		if (mEvents.empty())
+			throw std::runtime_error((std::string)__FUNCTION__ + ": The queue of the device " + convertDeviceToString(device) + " is full but no action is running");
+		mMainPredecessor = processNextEvent_();
+	}
 
-int Sequencer::readNtotalCommands() const
-{
-	return mCommandCounter;
+	mTasks.push_back({ device, name, duration, dependencies, mNow, mMainPredecessor });
+	const int handle{ static_cast<int>(mTasks.size()) - 1 };
+	mQueues.at(deviceIndex).push_back(handle);
+	dispatch_();
+	return handle;
 }
 
-Sequencer::Commandline Sequencer::readCommandline(const int iterCommandLine) const
+//Run an action on the submitting thread, like CUT and PAN in Routines::sequencer. The queued actions keep running meanwhile
+int SequenceSimulator::runOnMain_(const DEVICE device, const std::string name, const double duration)
 {
-	return mCommandList.at(iterCommandLine);
+	const double startTime{ mNow };
+	const double endTime{ startTime + duration };
+	while (!mEvents.empty() && mEvents.top().first <= endTime)
+		processNextEvent_();
+	mNow = endTime;
+
+	mTasks.push_back({ device, name, duration, {}, startTime, mMainPredecessor, startTime, mMainPredecessor, true });
+	mMainPredecessor = static_cast<int>(mTasks.size()) - 1;
+	return mMainPredecessor;
 }
 
-int Sequencer::readTileArraySizeIJ(const TileArray::Axis axis) const
+//Start the first action queued on each idle device once the actions it depends on have completed. The actions of a device run in the order of submission
+void SequenceSimulator::dispatch_()
 {
-	return mTileArray.readTileArraySizeIJ(axis);
+	for (int iterDevice = 0; iterDevice < static_cast<int>(DEVICE::NDEVICES); iterDevice++)
+	{
+		if (mRunning.at(iterDevice) != NONE || mQueues.at(iterDevice).empty())
+			continue;
+
+		const int handle{ mQueues.at(iterDevice).front() };
+		Task &task{ mTasks.at(handle) };
+		bool isReady{ true };
+		for (const int dependency : task.mDependencies)
+			if (dependency != NONE && !mTasks.at(dependency).mIsDone)
+				isReady = false;
+		if (!isReady)
+			continue;
+
+		//The action that started this one is the last one to end among its dependencies, the previous action on the device, and the submitting thread
+		std::vector<int> predecessors{ task.mDependencies };
+		predecessors.push_back(mLastOnDevice.at(iterDevice));
+		predecessors.push_back(task.mSubmitPredecessor);
+		double latestEndTime{ -1 };
+		for (const int predecessor : predecessors)
+			if (predecessor != NONE && readEndTime_(predecessor) > latestEndTime)
+			{
+				latestEndTime = readEndTime_(predecessor);
+				task.mCriticalPredecessor = predecessor;
+			}
+
+		task.mStartTime = mNow;
+		mEvents.push({ mNow + task.mDuration, handle });
+		mRunning.at(iterDevice) = handle;
+		mLastOnDevice.at(iterDevice) = handle;
+		mQueues.at(iterDevice).pop_front();
+	}
 }
 
-TILEDIM2 Sequencer::readTileArraySizeIJ() const
+//Advance the virtual time to the end of the next action. Return its handle
+int SequenceSimulator::processNextEvent_()
 {
-	return mTileArray.readTileArraySizeIJ();
+	const std::pair<double, int> event{ mEvents.top() };
+	mEvents.pop();
+	mNow = (std::max)(mNow, event.first);
+
+	Task &task{ mTasks.at(event.second) };
+	task.mIsDone = true;
+	mRunning.at(static_cast<int>(task.mDevice)) = NONE;
+	dispatch_();
+	return event.second;
 }
 
-void Sequencer::initializeVibratome_()
+void SequenceSimulator::waitAll_()
 {
-	mIterScanZi = mSample.mSurfaceZ; 	//Initialize the Z-stage with the position of the surface of the sample
+	while (!mEvents.empty())
+		mMainPredecessor = processNextEvent_();
 
-	mIterSamplePlaneZtoCut = mIterScanZi + mStack.readDepthZ() - mSample.mCutAboveBottomOfStack;
-	mIterStageZheightForFacingTheBlade = mIterSamplePlaneZtoCut + mSample.mBladeFocalplaneOffsetZ;
-
-	const int numberOfVibratomeCuts{ static_cast<int>(1 + std::ceil(1. / (1 - mStack.readOverlap_frac(TileArray::Axis::KK)) * (mSample.mLOIxyz_req.ZZ / mStack.readDepthZ() - 1))) };	//Total number of vibratome slices in the entire sample
-	if (numberOfVibratomeCuts > 1)
-		mNtotalCuts = numberOfVibratomeCuts;		
-	else
-		mNtotalCuts = 1;
+	for (const std::deque<int> &queue : mQueues)
+		if (!queue.empty())
+			throw std::runtime_error((std::string)__FUNCTION__ + ": Some actions were never started");
 }
 
-//Calculate the number of tiles in the X-stage and Y-stage axes based on the length of interest (LOI) and the FFOV
-//If the overlap between consecutive tiles is a*FOV, then N tiles cover the distance L = FOV * ( (1-a)*(N-1) + 1 ), thus N = 1/(1-a) * ( L/FOV - 1 ) + 1
-TILEDIM2 Sequencer::determineTileArraySizeIJ_()
+//The critical path is followed backwards from the last action to end
+SequenceSimulator::Report SequenceSimulator::createReport_(const int nStacks) const
 {
-	const int numberOfTilesII{ Util::intceil(1 + 1. / (1 - mStack.readOverlap_frac(TileArray::Axis::II)) * (mSample.mLOIxyz_req.XX / mStack.readFFOV(AXIS::XX) - 1)) };
-	const int numberOfTilesJJ{ Util::intceil(1 + 1. / (1 - mStack.readOverlap_frac(TileArray::Axis::JJ)) * (mSample.mLOIxyz_req.YY / mStack.readFFOV(AXIS::YY) - 1)) };
+	const int nDevices{ static_cast<int>(DEVICE::NDEVICES) };
+	Report report;
+	report.mMakespan = mNow;
+	report.mNstacks = nStacks;
+	report.mBusyTime.assign(nDevices, 0);
+	report.mCriticalPathTime.assign(nDevices, 0);
+
+	int lastHandle{ NONE };
+	for (int handle = 0; handle < static_cast<int>(mTasks.size()); handle++)
+	{
+		report.mBusyTime.at(static_cast<int>(mTasks.at(handle).mDevice)) += mTasks.at(handle).mDuration;
+		if (lastHandle == NONE || readEndTime_(handle) >= readEndTime_(lastHandle))
+			lastHandle = handle;
+	}
 
-	TILEDIM2 output;
-	if (numberOfTilesII > 1)
-		output.II = numberOfTilesII;		//Number of tiles in the X-stage axis
-	else
-		output.II = 1;
+	for (int handle = lastHandle; handle != NONE; handle = mTasks.at(handle).mCriticalPredecessor)
+	{
+		const Task &task{ mTasks.at(handle) };
+		report.mCriticalPathTime.at(static_cast<int>(task.mDevice)) += task.mDuration;
+		report.mNcriticalActions++;
+		if (task.mDuration > report.mLongestCriticalDuration)
+		{
+			report.mLongestCriticalDuration = task.mDuration;
+			report.mLongestCriticalAction = task.mName;
+		}
+	}
+	return report;
+}
+#pragma endregion "SequenceSimulator"
 
-	if (numberOfTilesJJ > 1)
-		output.JJ = numberOfTilesJJ;		//Number of tiles in the Y-stage axis	
-	else
-		output.JJ = 1;
+#pragma region "SequenceJournal"
+//Open the journal for appending. If the journal already exists, load its records first
+SequenceJournal::SequenceJournal(const std::string folderPath, const std::string filename) :
+	mFolderPath{ folderPath },
+	mFile{ folderPath, filename, "DSCJOU01" }
+{
+	const std::vector<std::string> &payloads{ mFile.readLoadedPayloads() };
+	for (const std::string &payload : payloads)
+	{
+		Record record;
+		if (!decode_(payload, record))
+			break;
+		mRecords.push_back(record);
+	}
 
-	//For debugging
-	//std::cout << "Number of row tiles = " << numberOfTilesII << "\tNumber of column tiles = " << numberOfTilesJJ << "\n";
+	//Only the stacks after the last cut can be redone. Their sizes are checked, and the pixels of the last one are also checked because it is the one most likely cut short by a crash
+	int firstRecordInCut{ 0 }, lastStackRecord{ -1 };
+	for (int iterRecord = 0; iterRecord < static_cast<int>(mRecords.size()); iterRecord++)
+	{
+		if (mRecords.at(iterRecord).mType == RECORD::CUT)
+			firstRecordInCut = iterRecord + 1;
+		if (mRecords.at(iterRecord).mType == RECORD::STACK)
+			lastStackRecord = iterRecord;
+	}
+	for (int iterRecord = firstRecordInCut; iterRecord < static_cast<int>(mRecords.size()); iterRecord++)
+		if (mRecords.at(iterRecord).mType == RECORD::STACK && !isStackComplete_(mRecords.at(iterRecord), iterRecord == lastStackRecord))
+		{
+			std::cerr << "WARNING in " << __FUNCTION__ << ": The stack " << mRecords.at(iterRecord).mFilename << " is incomplete. It will be acquired again\n";
+			mRecords.resize(iterRecord);
+			break;
+		}
 
-	return output;
+	//Drop the records that do not decode and the records of the incomplete stacks so that the next records are appended after the last valid one
+	if (mRecords.size() != payloads.size())
+	{
+		std::cerr << "WARNING in " << __FUNCTION__ << ": The records of " << filename << ".bin after the last valid one have been dropped\n";
+		mFile.truncate(static_cast<int>(mRecords.size()));
+	}
 }
 
-//Calculate the effective ROI =  { YMIN, XMIN, YMAX, XMAX } covered by all the tiles
-void Sequencer::initializeEffectiveROI_()
+int SequenceJournal::readNrecords() const
 {
-	//II is the row index (along the image height and X-stage) and JJ is the column index (along the image width and Y-stage) of the tile. II and JJ start from 0
-	const POSITION2 tilePosXYmin = convertTileIndicesIJToStagePosXY({ 0, 0 });																												//Absolute position of the CENTER of the tile
-	const POSITION2 tilePosXYmax = convertTileIndicesIJToStagePosXY({ mTileArray.readTileArraySizeIJ(TileArray::Axis::II) - 1, mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) - 1 });	//Absolute position of the CENTER of the tile
-
-	//The ROI is measured from the border of the tiles. Therefore, add half of the FFOV
-	mROI.XMAX = tilePosXYmin.XX + mStack.readFFOV(AXIS::XX) / 2.;
-	mROI.YMAX = tilePosXYmin.YY + mStack.readFFOV(AXIS::YY) / 2.;
-	mROI.XMIN = tilePosXYmax.XX - mStack.readFFOV(AXIS::XX) / 2.;
-	mROI.YMIN = tilePosXYmax.YY - mStack.readFFOV(AXIS::YY) / 2.;
-
-	if (mROI.XMIN < mSample.readStageSoftPosLimXMIN() || mROI.XMAX > mSample.readStageSoftPosLimXMAX())
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The ROI goes beyond the soft limits of the stage X");
-	if (mROI.YMIN < mSample.readStageSoftPosLimYMIN() || mROI.YMAX >  mSample.readStageSoftPosLimYMAX())
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The ROI goes beyond the soft limits of the stage Y");
+	std::lock_guard<std::mutex> lock{ mMutex };
+	return static_cast<int>(mRecords.size());
 }
 
-//Reserve a memory block assuming 3 actions for every stack in each vibratome slice: MOV, ACQ, and SAV. Then CUT
-void Sequencer::reserveMemoryBlock_()
+//The run of the journal has completed
+bool SequenceJournal::isComplete() const
 {
-	const int nTotalTilesPerVibratomeCut{ mTileArray.readTileArraySizeIJ(TileArray::Axis::II) * mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) };	//Total number of tiles in a vibratome slice
-	const int nTotalTilesEntireSample{ mNtotalCuts * static_cast<int>(mSample.readFluorMarkerListSize()) * nTotalTilesPerVibratomeCut };				//Total number of tiles in the entire sample. mNtotalCuts is fixed at 1
-	mCommandList.reserve(3 * nTotalTilesEntireSample + mNtotalCuts - 1);
+	std::lock_guard<std::mutex> lock{ mMutex };
+	return !mRecords.empty() && mRecords.back().mType == RECORD::END;
 }
 
-//Reset the X-stage and Y-stage scan directions to the initial values
-//II is the row index (along the image height and X-stage) and JJ is the column index (along the image width and Y-stage) of the tile. II and JJ start from 0
-void Sequencer::initializeScanDirIJ_()
+//Discard the records and start the journal of a new run of the sequence. tileConfigurationName is the configuration file for the stitchers written by the run
+void SequenceJournal::restart(const Sequencer &sequence, const std::string tileConfigurationName)
 {
-	mIterScanDirXYZ = g_initialStageScanDirXYZ;	//Reset the scan directions
+	std::lock_guard<std::mutex> lock{ mMutex };
+	mFile.truncate(0);
+	mRecords.clear();
+
+	Record record{ RECORD::BEGIN, 0, 0 };
+	record.mValues = determineFingerprint_(sequence);
+	record.mFilename = tileConfigurationName;
+	append_(record);
+}
 
-	switch (mIterScanDirXYZ.XX)
+//Replay the records on the command list generated for the same sample and stack. The planned tile paths and wavelength orders are reapplied to the command list
+SequenceJournal::ResumeState SequenceJournal::resume(Sequencer &sequence, const SCANDIR scanDirZini, const bool forceScanAllStacks) const
+{
+	std::lock_guard<std::mutex> lock{ mMutex };
+	if (mRecords.empty() || mRecords.front().mType != RECORD::BEGIN || mRecords.front().mValues != determineFingerprint_(sequence))
+		throw std::runtime_error((std::string)__FUNCTION__ + ": The journal does not belong to this sequence");
+	if (mRecords.back().mType == RECORD::END)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": The sequence of the journal has already completed");
+
+	ResumeState state{ createInitialState(sequence, 0, scanDirZini, forceScanAllStacks) };
+	state.mTileConfigurationName = mRecords.front().mFilename;
+	for (std::vector<Record>::size_type iterRecord = 1; iterRecord < mRecords.size(); iterRecord++)
 	{
-	case SCANDIR::RIGHTWARD:	//The X-stage moves to the right, therefore, the sample is imaged from right to left
-		mII = mTileArray.readTileArraySizeIJ(TileArray::Axis::II) - 1;
-		break;
-	case SCANDIR::LEFTWARD:		//The X-stage moves to the left, therefore, the sample is imaged from left to right
-		mII = 0;
-		break;
+		const Record &record{ mRecords.at(iterRecord) };
+		state.mCutNumber = record.mCutNumber;
+		switch (record.mType)
+		{
+		case RECORD::PLAN:
+			//Same order as in Routines::sequencer
+			if (record.mIsTilePathPlanned)
+				sequence.reorderTilePath(record.mCommandIndex, record.mTilePath);
+			if (record.mIsWavelengthScheduled)
+				sequence.reorderWavelengths(record.mCommandIndex, record.mWavelengthOrder_nm);
+			state.mTileBitmap = unpackBitmap_(record.mBitmap, sequence.readTileArraySizeIJ());
+			state.mIsCutPlanned = true;
+			state.mNextCommandIndex = (std::max)(state.mNextCommandIndex, record.mCommandIndex);		//The plan is made before running its command
+			break;
+		case RECORD::PAN:
+			state.mTileBitmap = unpackBitmap_(record.mBitmap, sequence.readTileArraySizeIJ());
+			state.mNPANinCut++;
+			state.mNextCommandIndex = (std::max)(state.mNextCommandIndex, record.mCommandIndex + 1);
+			break;
+		case RECORD::STACK:
+			state.mScanDirZ = static_cast<SCANDIR>(record.mValues.at(3));
+			state.mBrightStackIndex++;
+			state.mSavedFilenames.push_back(record.mFilename);
+			state.mNextCommandIndex = (std::max)(state.mNextCommandIndex, record.mCommandIndex + 1);
+			break;
+		case RECORD::CUT:
+			state.mScanDirZ = scanDirZini;
+			state.mTileBitmap.assign(forceScanAllStacks);
+			state.mIsCutPlanned = false;
+			state.mNPANinCut = 0;
+			state.mBrightStackIndex = 0;
+			state.mNextCommandIndex = (std::max)(state.mNextCommandIndex, record.mCommandIndex + 1);
+			break;
+		default:
+			throw std::runtime_error((std::string)__FUNCTION__ + ": The record " + std::to_string(iterRecord) + " of the journal is invalid");
+		}
 	}
+	return state;
+}
 
-	switch (mIterScanDirXYZ.YY)
-	{
-	case SCANDIR::INWARD:		//The Y-stage moves inward, therefore, the sample is imaged from "inside" to "outside" of the microscope
-		mJJ = mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) - 1;
-		break;
-	case SCANDIR::OUTWARD:		//The Y-stage moves outward, therefore, the sample is imaged from "outside" to "inside" of the microscope
-		mJJ = 0;
-		break;
-	}
+//Record the boolmap of the cut and the order of its tiles and wavelengths. Called when the cut is planned, before running its first MOV at commandIndex
+void SequenceJournal::recordPlan(const int commandIndex, const int cutNumber, const TileBitmap &tileBitmap, const bool isTilePathPlanned, const std::vector<TILEIJ> &tilePath, const bool isWavelengthScheduled, const std::vector<int> &wavelengthOrder_nm)
+{
+	Record record{ RECORD::PLAN, commandIndex, cutNumber };
+	record.mIsTilePathPlanned = isTilePathPlanned;
+	if (isTilePathPlanned)
+		record.mTilePath = tilePath;
+	record.mIsWavelengthScheduled = isWavelengthScheduled;
+	if (isWavelengthScheduled)
+		record.mWavelengthOrder_nm = wavelengthOrder_nm;
+	record.mBitmap = packBitmap_(tileBitmap);
+
+	std::lock_guard<std::mutex> lock{ mMutex };
+	append_(record);
 }
 
-//Reset the X-stage direction to the initial values
-void Sequencer::initializeScanDirII_()
+//Record the boolmap after a panoramic scan run or skipped
+void SequenceJournal::recordPAN(const int commandIndex, const int cutNumber, const TileBitmap &tileBitmap)
 {
-	mIterScanDirXYZ.XX = g_initialStageScanDirXYZ.XX;	//Reset the scan directions in X
+	Record record{ RECORD::PAN, commandIndex, cutNumber };
+	record.mBitmap = packBitmap_(tileBitmap);
 
-	switch (mIterScanDirXYZ.XX)
-	{
-	case SCANDIR::RIGHTWARD:	//The X-stage moves to the right, therefore, the sample is imaged from right to left
-		mII = mTileArray.readTileArraySizeIJ(TileArray::Axis::II) - 1;
-		break;
-	case SCANDIR::LEFTWARD:		//The X-stage moves to the left, therefore, the sample is imaged from left to right
-		mII = 0;
-		break;
-	}
+	std::lock_guard<std::mutex> lock{ mMutex };
+	append_(record);
 }
 
-//Convert a ROI = {ymin, xmin, ymax, xmax} to the equivalent length of interest (LOI) in the X-stage and Y-stage axes
-LENGTH3 Sequencer::determineEffectiveLOIxyz() const
+//Record a stack once it has been saved and added to the manifest. commandIndex is the index of its SAV
+void SequenceJournal::recordStack(const int commandIndex, const int cutNumber, const int wavelength_nm, const TILEIJ tileIndicesIJ, const SCANDIR nextScanDirZ, const TileManifest::Record &manifestRecord)
 {
-	return { mROI.XMAX - mROI.XMIN,
-			 mROI.YMAX - mROI.YMIN,
-			 mStack.readDepthZ() * ((1 - mStack.readOverlap_frac(TileArray::Axis::KK)) * (mNtotalCuts - 1) + 1) };
+	Record record{ RECORD::STACK, commandIndex, cutNumber };
+	record.mValues = { wavelength_nm, tileIndicesIJ.II, tileIndicesIJ.JJ, static_cast<I32>(nextScanDirZ) };
+	record.mFileSize_byte = manifestRecord.mFileSize_byte;
+	record.mChecksum = manifestRecord.mChecksum;
+	record.mFilename = manifestRecord.mFilename;
+
+	std::lock_guard<std::mutex> lock{ mMutex };
+	append_(record);
 }
 
-//Move the stage to the position corresponding to the tile indices II and JJ 
-//II is the row index (along the image height and X-stage) and JJ is the column index (along the image width and Y-stage) of the tile. II and JJ start from 0
-void Sequencer::moveStage_(const TILEIJ tileIndicesIJ)
+void SequenceJournal::recordCut(const int commandIndex, const int cutNumber)
 {
-	if (tileIndicesIJ.II < 0 || tileIndicesIJ.II >= mTileArray.readTileArraySizeIJ(TileArray::Axis::II))
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile index II must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::II) - 1) + "]");
-	if (tileIndicesIJ.JJ < 0 || tileIndicesIJ.JJ >= mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ))
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile index JJ must be in the range [0-" + std::to_string(mTileArray.readTileArraySizeIJ(TileArray::Axis::JJ) - 1) + "]");
-
-	const POSITION2 tileCenterXY = convertTileIndicesIJToStagePosXY(tileIndicesIJ);
+	std::lock_guard<std::mutex> lock{ mMutex };
+	append_(Record{ RECORD::CUT, commandIndex, cutNumber });
+}
 
-	Commandline commandline{ Action::ID::MOV };
-	commandline.mAction.moveStage.setParam(mCutCounter, tileIndicesIJ, tileCenterXY);
-	mCommandList.push_back(commandline);
-	mCommandCounter++;	//Count the number of commands
+//Record the completion of the run, after its last stack has been recorded. commandIndex is the number of commands run
+void SequenceJournal::recordEnd(const int commandIndex)
+{
+	std::lock_guard<std::mutex> lock{ mMutex };
+	append_(Record{ RECORD::END, commandIndex, 0 });
 }
 
-//indexFluorMarker is the position of the fluorMarker in mFluorMarkerList
-void Sequencer::acqStack_(const int indexFluorMarker)
+//State of a sequence that is not resumed from a journal. When starting in the middle of a cut, the order of the command list is kept
+SequenceJournal::ResumeState SequenceJournal::createInitialState(const Sequencer &sequence, const int firstCommandIndex, const SCANDIR scanDirZini, const bool forceScanAllStacks)
 {
-	if (indexFluorMarker < 0)
-		throw std::invalid_argument((std::string)__FUNCTION__ + ": The wavelength index must be >= 0");
+	if (firstCommandIndex < 0 || firstCommandIndex > sequence.readNtotalCommands())
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The first command index must be in the range [0-" + std::to_string(sequence.readNtotalCommands()) + "]");
 
-	//Read the corresponding laser configuration
-	const FluorMarkerList::FluorMarker fluorMarker{ mSample.readFluorMarker(indexFluorMarker) };
+	const bool isCutPlanned{ firstCommandIndex > 0 && firstCommandIndex < sequence.readNtotalCommands() && sequence.readCommandline(firstCommandIndex).mActionID != Action::ID::PAN };
+	return { firstCommandIndex, 0, scanDirZini, TileBitmap{ sequence.readTileArraySizeIJ(), forceScanAllStacks }, isCutPlanned, 0, 0, {}, "" };
+}
 
-	//The stack saving is column by column
-	//Stack index for identifying the saved tiff file
-	const int stackIndex{ mJJ * readTileArraySizeIJ(TileArray::Axis::II) + mII };
+//Append the record to the file and flush it immediately. The caller holds mMutex
+void SequenceJournal::append_(const Record &record)
+{
+	mFile.append(encode_(record));
+	mRecords.push_back(record);
+}
 
-	Commandline commandline{ Action::ID::ACQ };
-	commandline.mAction.acqStack.setParam(mStackCounter, stackIndex, fluorMarker.mWavelength_nm, mIterScanDirXYZ.ZZ, mIterScanZi, mStack.readDepthZ(), fluorMarker.mScanPmin, fluorMarker.mScanPLexp, fluorMarker.nFramesBinning);
-	mCommandList.push_back(commandline);
-	mStackCounter++;	//Count the number of stacks
-	mCommandCounter++;	//Count the number of commands
+bool SequenceJournal::isStackComplete_(const Record &record, const bool verifyChecksum) const
+{
+	const std::string fullPath{ mFolderPath + record.mFilename };
 
-	//Update the parameters for the next iteration
-	reverseSCANDIR(mIterScanDirXYZ.ZZ);								//Reverse the scan direction in the Z-stage axis
+	if (!std::filesystem::exists(fullPath) || std::filesystem::file_size(fullPath) != record.mFileSize_byte)
+		return false;
+	try
+	{
+		return !verifyChecksum || TileManifest::computeChecksum(mFolderPath, record.mFilename) == record.mChecksum;
+	}
+	catch (const std::runtime_error&)		//The file is not a readable Tiff
+	{
+		return false;
+	}
 }
 
-void Sequencer::saveStack_()
+//The journal is only replayed on the same command list, before its tile paths and wavelengths are reordered. The fingerprint is the number of commands and a CRC-32 of their actions, positions, and wavelengths
+std::vector<I32> SequenceJournal::determineFingerprint_(const Sequencer &sequence)
 {
-	Commandline commandline{ Action::ID::SAV };
-	mCommandList.push_back(commandline);
-	mCommandCounter++;	//Count the number of commands
+	std::string content;
+	FramedRecordFile::writeField<I32>(content, sequence.readTileArraySizeIJ().II);
+	FramedRecordFile::writeField<I32>(content, sequence.readTileArraySizeIJ().JJ);
+	for (int iterCommandline = 0; iterCommandline < sequence.readNtotalCommands(); iterCommandline++)
+	{
+		const Sequencer::Commandline commandline{ sequence.readCommandline(iterCommandline) };
+		FramedRecordFile::writeField<U8>(content, static_cast<U8>(commandline.mActionID));
+		switch (commandline.mActionID)
+		{
+		case Action::ID::MOV:
+			FramedRecordFile::writeField<I32>(content, commandline.mAction.moveStage.readCutNumber());
+			FramedRecordFile::writeField<I32>(content, commandline.mAction.moveStage.readTileIndex(TileArray::Axis::II));
+			FramedRecordFile::writeField<I32>(content, commandline.mAction.moveStage.readTileIndex(TileArray::Axis::JJ));
+			FramedRecordFile::writeField<double>(content, commandline.mAction.moveStage.readTileCenterXY().XX);
+			FramedRecordFile::writeField<double>(content, commandline.mAction.moveStage.readTileCenterXY().YY);
+			break;
+		case Action::ID::ACQ:
+			FramedRecordFile::writeField<I32>(content, commandline.mAction.acqStack.readWavelength_nm());
+			FramedRecordFile::writeField<double>(content, commandline.mAction.acqStack.readScanZmin());
+			FramedRecordFile::writeField<double>(content, commandline.mAction.acqStack.readDepthZ());
+			FramedRecordFile::writeField<double>(content, commandline.mAction.acqStack.readScanPmin());
+			FramedRecordFile::writeField<double>(content, commandline.mAction.acqStack.readScanPLexp());
+			FramedRecordFile::writeField<I32>(content, commandline.mAction.acqStack.readNframeBinning());
+			break;
+		case Action::ID::CUT:
+			FramedRecordFile::writeField<double>(content, commandline.mAction.cutTissue.readPlaneZtoCut());
+			FramedRecordFile::writeField<double>(content, commandline.mAction.cutTissue.readStageZheightForFacingTheBlade());
+			break;
+		case Action::ID::PAN:
+			FramedRecordFile::writeField<I32>(content, commandline.mAction.panoramicScan.readCutNumber());
+			FramedRecordFile::writeField<double>(content, commandline.mAction.panoramicScan.readPlaneZ());
+			break;
+		default:
+			break;
+		}
+	}
+	return { sequence.readNtotalCommands(), static_cast<I32>(Util::computeCRC32(reinterpret_cast<const U8*>(content.data()), content.size())) };
 }
 
-void Sequencer::cutTissue_()
+std::vector<U8> SequenceJournal::packBitmap_(const TileBitmap &tileBitmap)
 {
-	//Move the sample to face the vibratome blade. Note the additional offset in the Z-stage axis
-	Commandline commandline{ Action::ID::CUT };
-	commandline.mAction.cutTissue.setParam(mIterSamplePlaneZtoCut, mIterStageZheightForFacingTheBlade);
-	mCommandList.push_back(commandline);
-	mCutCounter++;		//Count the number of vibratome slices
-	mCommandCounter++;	//Count the number of commands
+	const TILEDIM2 tileArraySizeIJ{ tileBitmap.readTileArraySizeIJ() };
+	std::vector<U8> bitmap((tileArraySizeIJ.II * tileArraySizeIJ.JJ + 7) / 8, 0);
+	for (int II = 0; II < tileArraySizeIJ.II; II++)
+		for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
+			if (tileBitmap.test({ II, JJ }))
+			{
+				const int bitIndex{ II * tileArraySizeIJ.JJ + JJ };
+				bitmap.at(bitIndex / 8) |= static_cast<U8>(1 << (bitIndex % 8));
+			}
+	return bitmap;
+}
 
-	//Increase the height of the Z-stage and the height of the plane to cut in the next iteration		
-	//Because of the overlap, the effective stack depth is (1-a)*stackDepth, where a*stackDepth is the overlap
-	const double heightIncrease{ (1 - mStack.readOverlap_frac(TileArray::Axis::KK)) * mStack.readDepthZ() };
+TileBitmap SequenceJournal::unpackBitmap_(const std::vector<U8> &bitmap, const TILEDIM2 tileArraySizeIJ)
+{
+	if (static_cast<int>(bitmap.size()) != (tileArraySizeIJ.II * tileArraySizeIJ.JJ + 7) / 8)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": The size of the recorded boolmap does not match the tile array");
 
-	mIterScanZi += heightIncrease;
-	mIterSamplePlaneZtoCut += heightIncrease;
-	mIterStageZheightForFacingTheBlade += heightIncrease;
+	TileBitmap tileBitmap{ tileArraySizeIJ };
+	for (int II = 0; II < tileArraySizeIJ.II; II++)
+		for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
+		{
+			const int bitIndex{ II * tileArraySizeIJ.JJ + JJ };
+			tileBitmap.set({ II, JJ }, (bitmap.at(bitIndex / 8) >> (bitIndex % 8)) & 1);
+		}
+	return tileBitmap;
 }
 
-void Sequencer::panoramicScan_(const double distanceUnderTheSurface)
+//All the fields are written for every type of record. The unused ones are empty, so that the records stay small
+std::string SequenceJournal::encode_(const Record &record)
 {
-	Commandline commandline{ Action::ID::PAN };
-	commandline.mAction.panoramicScan.setParam(mCutCounter, distanceUnderTheSurface, mIterScanZi);
-	mCommandList.push_back(commandline);
-	mCommandCounter++;
+	if (record.mFilename.size() > (std::numeric_limits<U16>::max)())
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The filename is too long");
+
+	std::string payload;
+	FramedRecordFile::writeField<U8>(payload, static_cast<U8>(record.mType));
+	FramedRecordFile::writeField<I32>(payload, record.mCommandIndex);
+	FramedRecordFile::writeField<I32>(payload, record.mCutNumber);
+	FramedRecordFile::writeField<U32>(payload, static_cast<U32>(record.mValues.size()));
+	for (const I32 value : record.mValues)
+		FramedRecordFile::writeField<I32>(payload, value);
+	FramedRecordFile::writeField<U8>(payload, record.mIsTilePathPlanned);
+	FramedRecordFile::writeField<U32>(payload, static_cast<U32>(record.mTilePath.size()));
+	for (const TILEIJ &tileIJ : record.mTilePath)
+	{
+		FramedRecordFile::writeField<I32>(payload, tileIJ.II);
+		FramedRecordFile::writeField<I32>(payload, tileIJ.JJ);
+	}
+	FramedRecordFile::writeField<U8>(payload, record.mIsWavelengthScheduled);
+	FramedRecordFile::writeField<U32>(payload, static_cast<U32>(record.mWavelengthOrder_nm.size()));
+	for (const int wavelength_nm : record.mWavelengthOrder_nm)
+		FramedRecordFile::writeField<I32>(payload, wavelength_nm);
+	FramedRecordFile::writeField<U32>(payload, static_cast<U32>(record.mBitmap.size()));
+	payload.append(reinterpret_cast<const char*>(record.mBitmap.data()), record.mBitmap.size());
+	FramedRecordFile::writeField<U64>(payload, record.mFileSize_byte);
+	FramedRecordFile::writeField<U32>(payload, record.mChecksum);
+	FramedRecordFile::writeField<U16>(payload, static_cast<U16>(record.mFilename.size()));
+	payload.append(record.mFilename);
+	return payload;
+}
+
+//Return false if the payload does not hold a whole record, e.g. when it was written by another version of the journal
+bool SequenceJournal::decode_(const std::string &payload, Record &record)
+{
+	try
+	{
+		std::size_t pos{ 0 };
+		//A count larger than the rest of the payload would allocate a huge vector before the record is found truncated
+		auto readCount = [&payload, &pos](const std::size_t elementSize)
+		{
+			const U32 count{ FramedRecordFile::readField<U32>(payload, pos) };
+			if (count * elementSize > payload.size() - pos)
+				throw std::runtime_error((std::string)__FUNCTION__ + ": Truncated record");
+			return count;
+		};
+
+		const U8 type{ FramedRecordFile::readField<U8>(payload, pos) };
+		if (type > static_cast<U8>(RECORD::END))
+			return false;
+		record.mType = static_cast<RECORD>(type);
+		record.mCommandIndex = FramedRecordFile::readField<I32>(payload, pos);
+		record.mCutNumber = FramedRecordFile::readField<I32>(payload, pos);
+		record.mValues.resize(readCount(sizeof(I32)));
+		for (I32 &value : record.mValues)
+			value = FramedRecordFile::readField<I32>(payload, pos);
+		record.mIsTilePathPlanned = FramedRecordFile::readField<U8>(payload, pos) != 0;
+		record.mTilePath.resize(readCount(2 * sizeof(I32)));
+		for (TILEIJ &tileIJ : record.mTilePath)
+		{
+			tileIJ.II = FramedRecordFile::readField<I32>(payload, pos);
+			tileIJ.JJ = FramedRecordFile::readField<I32>(payload, pos);
+		}
+		record.mIsWavelengthScheduled = FramedRecordFile::readField<U8>(payload, pos) != 0;
+		record.mWavelengthOrder_nm.resize(readCount(sizeof(I32)));
+		for (int &wavelength_nm : record.mWavelengthOrder_nm)
+			wavelength_nm = FramedRecordFile::readField<I32>(payload, pos);
+		record.mBitmap.resize(readCount(sizeof(U8)));
+		for (U8 &byte : record.mBitmap)
+			byte = FramedRecordFile::readField<U8>(payload, pos);
+		record.mFileSize_byte = FramedRecordFile::readField<U64>(payload, pos);
+		record.mChecksum = FramedRecordFile::readField<U32>(payload, pos);
+		const U16 filenameLength{ FramedRecordFile::readField<U16>(payload, pos) };
+		if (pos + filenameLength != payload.size())
+			return false;
+		record.mFilename = payload.substr(pos, filenameLength);
+		return true;
+	}
+	catch (const std::runtime_error &)		//Truncated record
+	{
+		return false;
+	}
 }
-#pragma endregion "sequencer"
\ No newline at end of file
+#pragma endregion "SequenceJournal"
@@ -0,0 +1,240 @@
+#include "SerialTransport.h"
+#include <iostream>
+#include <thread>										//For std::this_thread::sleep_for
+#include <algorithm>									//std::max and std::upper_bound
+
+#pragma region "SerialTransport"
+const std::vector<double> SerialTransport::LatencyHistogram::mBinEdges{ 1. * ms, 2. * ms, 5. * ms, 10. * ms, 20. * ms, 50. * ms, 100. * ms, 200. * ms, 500. * ms, 1000. * ms };
+
+void SerialTransport::LatencyHistogram::add(const double latency, const bool timedOut)
+{
+	const std::vector<double>::size_type binIndex{ static_cast<std::vector<double>::size_type>(std::upper_bound(mBinEdges.begin(), mBinEdges.end(), latency) - mBinEdges.begin()) };
+	mCounts.at(binIndex)++;
+	mCount++;
+	mSum += latency;
+	mMax = (std::max)(mMax, latency);
+	if (timedOut)
+		mNtimeouts++;
+}
+
+void SerialTransport::LatencyHistogram::print(const std::string name) const
+{
+	std::cout << name << ": n = " << mCount << "\tmean = " << readMean() / ms << " ms\tmax = " << mMax / ms << " ms\ttimeouts = " << mNtimeouts << "\n\t";
+	for (std::vector<int>::size_type iterBin = 0; iterBin < mCounts.size(); iterBin++)
+	{
+		if (iterBin < mBinEdges.size())
+			std::cout << "<" << mBinEdges.at(iterBin) / ms << " ms: " << mCounts.at(iterBin) << "  ";
+		else
+			std::cout << ">=" << mBinEdges.back() / ms << " ms: " << mCounts.at(iterBin) << "\n";
+	}
+}
+
+int SerialTransport::LatencyHistogram::readCount() const
+{
+	return mCount;
+}
+
+double SerialTransport::LatencyHistogram::readMean() const
+{
+	return mCount > 0 ? mSum / mCount : 0;
+}
+
+double SerialTransport::LatencyHistogram::readMax() const
+{
+	return mMax;
+}
+
+int SerialTransport::LatencyHistogram::readNtimeouts() const
+{
+	return mNtimeouts;
+}
+
+SerialTransport::SerialTransport(const std::string deviceName, const Port port, const FRAMER framer, const double timeout) :
+	mDeviceName{ deviceName },
+	mPort{ port },
+	mFramer{ framer },
+	mTimeout{ timeout }
+{
+	if (!mPort.mWrite || !mPort.mReadAvailable)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The port of the " + mDeviceName + " is incomplete");
+	if (mTimeout <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The timeout must be > 0");
+}
+
+//Port to a device through serial::Serial. The bytes already received are read without waiting for the read timeout
+SerialTransport::Port SerialTransport::makePort(serial::Serial &serial)
+{
+	return Port{ [&serial](const std::string &data) { serial.write(data); },
+		[&serial]() -> std::string
+		{
+			const std::size_t nBytes{ serial.available() };
+			return nBytes > 0 ? serial.read(nBytes) : "";
+		} };
+}
+
+//The reply ends with 'terminator', e.g. the prompt of the device
+SerialTransport::FRAMER SerialTransport::terminatorFramer(const std::string terminator)
+{
+	return [terminator](const std::string &buffer) -> std::size_t
+	{
+		const std::string::size_type position{ buffer.find(terminator) };
+		return position == std::string::npos ? 0 : position + terminator.length();
+	};
+}
+
+//Send 'command' and return its reply. 'key' identifies the latency histogram of the command
+//If the reply does not complete within the timeout, return what was received, as serial::Serial::read does
+std::string SerialTransport::query(const std::string command, const std::string key)
+{
+	std::lock_guard<std::mutex> lock{ mMutex };
+	mPending.clear();						//Discard the stray bytes, e.g. the late reply of a previous command
+	mPort.mReadAvailable();
+
+	const auto startTime{ std::chrono::high_resolution_clock::now() };
+	mPort.mWrite(command);
+
+	bool timedOut;
+	const std::string reply{ readReply_(mFramer, startTime + std::chrono::microseconds(static_cast<long long>(mTimeout / us)), timedOut) };
+	mHistograms[key].add(std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - startTime).count() * us, timedOut);
+
+	return reply;
+}
+
+//Send all the commands before reading their replies, so that the device receives a command while the reply to the previous one is in transit, without waiting for the round trip
+//The latency of a command is counted from the moment the commands are sent. Each reply must complete within the timeout after the previous one
+std::vector<std::string> SerialTransport::queryPipelined(const std::vector<std::string> commands, const std::vector<std::string> keys)
+{
+	if (commands.size() != keys.size())
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Each command requires a key");
+	if (!mFramer)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The replies of the " + mDeviceName + " cannot be told apart without a framer");
+
+	std::lock_guard<std::mutex> lock{ mMutex };
+	mPending.clear();						//Discard the stray bytes, e.g. the late reply of a previous command
+	mPort.mReadAvailable();
+
+	const auto startTime{ std::chrono::high_resolution_clock::now() };
+	std::string batch;
+	for (const std::string &command : commands)
+		batch += command;
+	mPort.mWrite(batch);
+
+	std::vector<std::string> replies;
+	auto lastReplyTime{ startTime };
+	for (std::vector<std::string>::size_type iterCommand = 0; iterCommand < commands.size(); iterCommand++)
+	{
+		bool timedOut;
+		replies.push_back(readReply_(mFramer, lastReplyTime + std::chrono::microseconds(static_cast<long long>(mTimeout / us)), timedOut));
+		lastReplyTime = std::chrono::high_resolution_clock::now();
+		mHistograms[keys.at(iterCommand)].add(std::chrono::duration<double, std::micro>(lastReplyTime - startTime).count() * us, timedOut);
+		if (timedOut)
+			throw std::runtime_error((std::string)__FUNCTION__ + ": The " + mDeviceName + " did not reply to " + keys.at(iterCommand));
+	}
+
+	return replies;
+}
+
+SerialTransport::LatencyHistogram SerialTransport::readLatencyHistogram(const std::string key) const
+{
+	std::lock_guard<std::mutex> lock{ mMutex };
+	const auto iter{ mHistograms.find(key) };
+	return iter == mHistograms.end() ? LatencyHistogram{} : iter->second;
+}
+
+void SerialTransport::printLatencyHistograms() const
+{
+	std::lock_guard<std::mutex> lock{ mMutex };
+	std::cout << "Latency of the commands to the " << mDeviceName << "\n";
+	for (const auto &histogram : mHistograms)
+		histogram.second.print(histogram.first);
+}
+
+//Without a framer, read until the deadline
+std::string SerialTransport::readReply_(const FRAMER &framer, const std::chrono::time_point<std::chrono::high_resolution_clock> deadline, bool &timedOut)
+{
+	while (true)
+	{
+		const std::string received{ mPort.mReadAvailable() };
+		mPending += received;
+
+		if (framer)
+		{
+			const std::size_t replyLength{ framer(mPending) };
+			if (replyLength > 0)
+			{
+				const std::string reply{ mPending.substr(0, replyLength) };
+				mPending.erase(0, replyLength);
+				timedOut = false;
+				return reply;
+			}
+		}
+
+		if (std::chrono::high_resolution_clock::now() >= deadline)
+		{
+			timedOut = static_cast<bool>(framer);
+			std::string reply;
+			std::swap(reply, mPending);
+			return reply;
+		}
+
+		if (received.empty())
+			std::this_thread::sleep_for(std::chrono::microseconds(static_cast<long long>(mReadSpacing / us)));
+	}
+}
+#pragma endregion "SerialTransport"
+
+#pragma region "SerialEmulator"
+SerialEmulator::SerialEmulator(std::function<std::string(const std::string &command)> respond, const double processingTime, const int baud) :
+	mRespond{ respond },
+	mProcessingTime{ processingTime },
+	mBaud{ baud }
+{
+	if (mProcessingTime < 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The processing time must be >= 0");
+	if (mBaud <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The baud rate must be > 0");
+}
+
+SerialTransport::Port SerialEmulator::makePort()
+{
+	return SerialTransport::Port{ [this](const std::string &data) { write_(data); }, [this]() { return readAvailable_(); } };
+}
+
+//Schedule the reply to each complete command. A char takes 10 bits at the baud rate
+void SerialEmulator::write_(const std::string &data)
+{
+	std::lock_guard<std::mutex> lock{ mMutex };
+	mReceived += data;
+
+	std::string::size_type endOfCommand;
+	while ((endOfCommand = mReceived.find('\r')) != std::string::npos)
+	{
+		const std::string reply{ mRespond(mReceived.substr(0, endOfCommand + 1)) };
+		mReceived.erase(0, endOfCommand + 1);
+
+		const auto charTime{ std::chrono::microseconds(static_cast<long long>(10. / mBaud * seconds / us)) };
+		TIMEPOINT arrivalTime{ (std::max)(std::chrono::high_resolution_clock::now(), mBusyUntil) + std::chrono::microseconds(static_cast<long long>(mProcessingTime / us)) };
+		for (const char character : reply)
+		{
+			arrivalTime += charTime;
+			mInTransit.push_back({ arrivalTime, character });
+		}
+		mBusyUntil = arrivalTime;
+	}
+}
+
+//Return the chars arrived so far
+std::string SerialEmulator::readAvailable_()
+{
+	std::lock_guard<std::mutex> lock{ mMutex };
+	const TIMEPOINT now{ std::chrono::high_resolution_clock::now() };
+
+	std::string received;
+	while (!mInTransit.empty() && mInTransit.front().first <= now)
+	{
+		received += mInTransit.front().second;
+		mInTransit.pop_front();
+	}
+	return received;
+}
+#pragma endregion "SerialEmulator"
@@ -177,63 +177,94 @@ namespace Util
 		}
 	}
 
-	bool isBright(const std::vector<bool> vec_boolmap, const TILEDIM2 tileArraySizeIJ, const TILEIJ tileIndicesIJ)
+	//Pad the input interger with zeros and return the string
+	std::string zeroPadding(const int inputNumber, const int digits)
 	{
-		return vec_boolmap.at(tileIndicesIJ.II * tileArraySizeIJ.JJ + tileIndicesIJ.JJ);
+		const std::string number_s{ std::to_string(inputNumber) };
+		
+		return std::string(digits - number_s.length(), '0') + number_s;	
 	}
 
-	//Save the boolmap as a text file
-	void saveBoolmapToText(const std::string folderPath, std::string filename, const std::vector<bool> vec_boolmap, const TILEDIM2 tileArraySizeIJ, const OVERRIDE override)
+	//Inverse of convertWavelengthToFluorMarker_s()
+	int convertFluorMarkerToWavelength_nm(const int fluorMarker)
 	{
-		std::ofstream fileHandle;
-
-		if (override == OVERRIDE::DIS)
-			filename = Util::doesFileExist(folderPath, filename, ".txt");
-
-		fileHandle.open(folderPath + filename + ".txt");
-
-		try
+		switch (fluorMarker)
 		{
-			for (int II = 0; II < tileArraySizeIJ.II; II++)
+		case 0:
+			return 750;
+		case 1:
+			return 920;
+		case 2:
+			return 1040;
+		default:
+			throw std::invalid_argument((std::string)__FUNCTION__ + ": The fluorescent marker " + std::to_string(fluorMarker) + " has not been assigned a wavelength");
+		}
+	}
+
+	//Standard CRC-32 (polynomial 0xEDB88320). Pass the previous CRC to checksum data in chunks
+	U32 computeCRC32(const U8 *data, const std::size_t nBytes, const U32 previousCRC)
+	{
+		static const std::array<U32, 256> table{ [] {
+			std::array<U32, 256> table{};
+			for (U32 iterEntry = 0; iterEntry < 256; iterEntry++)
 			{
-				for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
-					fileHandle << static_cast<int>(vec_boolmap.at(II * tileArraySizeIJ.JJ + JJ));
-				fileHandle << "\n";	//End the row
+				U32 crc{ iterEntry };
+				for (int iterBit = 0; iterBit < 8; iterBit++)
+					crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+				table.at(iterEntry) = crc;
 			}
-		}
-		catch (...) {
-			throw std::out_of_range((std::string)__FUNCTION__);
-		}
+			return table;
+		}() };
 
-		fileHandle.close();
+		U32 crc{ ~previousCRC };
+		for (std::size_t iterByte = 0; iterByte < nBytes; iterByte++)
+			crc = table[(crc ^ data[iterByte]) & 0xFF] ^ (crc >> 8);
+		return ~crc;
 	}
 
-	int determineNumberOf1s(const std::vector<bool> vec_boolmap)
+	//CRC-32 of the full content of a file. Read the file in chunks to keep the memory usage low
+	U32 computeFileCRC32(const std::string filePath)
 	{
-		int nStacksBright{ 0 };
-		for (std::vector<int>::size_type iter = 0; iter != vec_boolmap.size(); iter++)
-			if (vec_boolmap.at(iter) == true)
-				nStacksBright++;
-		
-		return nStacksBright;
+		std::ifstream fileHandle{ filePath, std::ios::binary };
+		if (!fileHandle)
+			throw std::runtime_error((std::string)__FUNCTION__ + ": The file " + filePath + " failed to open");
+
+		std::vector<char> buffer(1 << 20);
+		U32 crc{ 0 };
+		while (fileHandle)
+		{
+			fileHandle.read(buffer.data(), buffer.size());
+			crc = computeCRC32(reinterpret_cast<const U8*>(buffer.data()), static_cast<std::size_t>(fileHandle.gcount()), crc);
+		}
+		return crc;
 	}
 
-	//Pad the input interger with zeros and return the string
-	std::string zeroPadding(const int inputNumber, const int digits)
+	//Memory that the process can still allocate: the smaller of the free address space and the free physical memory
+	//The 32-bit build (LargeAddressAware) has at most 3 GB of address space, part of which is already taken by the DLLs and the heap
+	U64 readAvailableMemory_byte()
 	{
-		const std::string number_s{ std::to_string(inputNumber) };
-		
-		return std::string(digits - number_s.length(), '0') + number_s;	
+		MEMORYSTATUSEX memoryStatus;
+		memoryStatus.dwLength = sizeof(memoryStatus);
+		if (!GlobalMemoryStatusEx(&memoryStatus))
+			throw std::runtime_error((std::string)__FUNCTION__ + ": GlobalMemoryStatusEx failed");
+
+		return (std::min)(static_cast<U64>(memoryStatus.ullAvailVirtual), static_cast<U64>(memoryStatus.ullAvailPhys));
 	}
 }
 
 #pragma region "Logger"
-Logger::Logger(const std::string folderPath, std::string filename, const OVERRIDE override)
+//When append = true, the records are added to the end of an existing file instead
+Logger::Logger(const std::string folderPath, std::string filename, const OVERRIDE override, const bool append)
 {
-	if (override == OVERRIDE::DIS)
-		filename = Util::doesFileExist(folderPath, filename, ".txt");
+	if (append)
+		mFileHandle.open(folderPath + filename + ".txt", std::ios::app);
+	else
+	{
+		if (override == OVERRIDE::DIS)
+			filename = Util::doesFileExist(folderPath, filename, ".txt");
 
-	mFileHandle.open(folderPath + filename + ".txt");
+		mFileHandle.open(folderPath + filename + ".txt");
+	}
 
 	if (!mFileHandle)
 		throw std::runtime_error((std::string)__FUNCTION__ + ": The file " + filename + ".txt failed to open");
@@ -260,6 +291,837 @@ void Logger::record(const std::string description, const std::string input)
 }
 #pragma endregion "Logger"
 
+#pragma region "FramedRecordFile"
+//Open the file for appending. If the file already exists, load its valid records first and drop a record torn by a crash, so that the next records are appended after the last valid one
+FramedRecordFile::FramedRecordFile(const std::string folderPath, const std::string filename, const std::string signature) :
+	mFullPath{ folderPath + filename + ".bin" },
+	mFilename{ filename + ".bin" },
+	mSignature{ signature },
+	mFileSize{ static_cast<std::streamoff>(signature.size()) }
+{
+	//A file shorter than its signature was torn by a crash while being created. Start it again
+	bool isTornAtCreation{ false };
+	if (std::filesystem::exists(mFullPath) && std::filesystem::file_size(mFullPath) < mSignature.size())
+	{
+		std::ifstream inputHandle{ mFullPath, std::ios::binary };
+		std::string magic(mSignature.size(), '\0');
+		inputHandle.read(&magic[0], magic.size());
+		if (mSignature.compare(0, static_cast<std::size_t>(inputHandle.gcount()), magic, 0, static_cast<std::size_t>(inputHandle.gcount())))
+			throw std::runtime_error((std::string)__FUNCTION__ + ": The file " + mFilename + " does not have the signature " + mSignature);
+		std::cerr << "WARNING in " << __FUNCTION__ << ": The file " << mFilename << " was torn while being created and is started again\n";
+		isTornAtCreation = true;
+	}
+
+	if (std::filesystem::exists(mFullPath) && !isTornAtCreation)
+	{
+		std::ifstream inputHandle{ mFullPath, std::ios::binary };
+		std::string magic(mSignature.size(), '\0');
+		if (!inputHandle.read(&magic[0], magic.size()) || magic != mSignature)
+			throw std::runtime_error((std::string)__FUNCTION__ + ": The file " + mFilename + " does not have the signature " + mSignature);
+
+		const std::streamoff fileSize{ static_cast<std::streamoff>(std::filesystem::file_size(mFullPath)) };
+		while (true)
+		{
+			const std::streamoff recordPosition{ inputHandle.tellg() };
+			U32 recordLength{ 0 }, storedCRC{ 0 };
+			//A torn length can be garbage. Do not allocate past the end of the file
+			if (!inputHandle.read(reinterpret_cast<char*>(&recordLength), sizeof(recordLength)) || recordLength > fileSize - inputHandle.tellg())
+				break;
+			std::string payload(recordLength, '\0');
+			if (!inputHandle.read(&payload[0], recordLength) || !inputHandle.read(reinterpret_cast<char*>(&storedCRC), sizeof(storedCRC)))
+				break;
+			if (storedCRC != Util::computeCRC32(reinterpret_cast<const U8*>(payload.data()), payload.size()))
+				break;
+
+			mLoadedPayloads.push_back(payload);
+			mRecordPositions.push_back(recordPosition);
+			mFileSize = inputHandle.tellg();
+		}
+		inputHandle.close();
+
+		if (mFileSize != fileSize)
+		{
+			std::cerr << "WARNING in " << __FUNCTION__ << ": The incomplete last record of " << mFilename << " has been dropped\n";
+			std::filesystem::resize_file(mFullPath, mFileSize);
+		}
+		mFileHandle.open(mFullPath, std::ios::binary | std::ios::app);
+	}
+	else
+	{
+		mFileHandle.open(mFullPath, std::ios::binary);
+		mFileHandle.write(mSignature.data(), mSignature.size());
+		mFileHandle.flush();
+	}
+
+	if (!mFileHandle)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": The file " + mFilename + " failed to open");
+}
+
+FramedRecordFile::~FramedRecordFile()
+{
+	mFileHandle.close();
+}
+
+const std::vector<std::string>& FramedRecordFile::readLoadedPayloads() const
+{
+	return mLoadedPayloads;
+}
+
+//Append the record to the file and flush it immediately
+void FramedRecordFile::append(const std::string &payload)
+{
+	const U32 recordLength{ static_cast<U32>(payload.size()) };
+	const U32 crc{ Util::computeCRC32(reinterpret_cast<const U8*>(payload.data()), payload.size()) };
+	mFileHandle.write(reinterpret_cast<const char*>(&recordLength), sizeof(recordLength));
+	mFileHandle.write(payload.data(), payload.size());
+	mFileHandle.write(reinterpret_cast<const char*>(&crc), sizeof(crc));
+	mFileHandle.flush();
+
+	if (!mFileHandle)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": Writing to the file " + mFilename + " failed");
+
+	mRecordPositions.push_back(mFileSize);
+	mFileSize += sizeof(recordLength) + payload.size() + sizeof(crc);
+}
+
+//Keep the first nRecords records and drop the next ones, e.g. the records that do not decode or that refer to incomplete files. nRecords = 0 keeps only the signature
+void FramedRecordFile::truncate(const int nRecords)
+{
+	if (nRecords < 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The number of records must be >= 0");
+	if (nRecords >= static_cast<int>(mRecordPositions.size()))
+		return;
+
+	mFileHandle.close();
+	mFileSize = mRecordPositions.at(nRecords);
+	mRecordPositions.resize(nRecords);
+	std::filesystem::resize_file(mFullPath, mFileSize);
+	mFileHandle.open(mFullPath, std::ios::binary | std::ios::app);
+	if (!mFileHandle)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": The file " + mFilename + " failed to reopen");
+}
+#pragma endregion "FramedRecordFile"
+
+#pragma region "TileManifest"
+//Open the manifest for appending. If the manifest already exists, load and index its records first
+TileManifest::TileManifest(const std::string folderPath, const std::string filename) :
+	mFolderPath{ folderPath },
+	mFile{ folderPath, filename, "DSCMAN01" }
+{
+	const std::vector<std::string> &payloads{ mFile.readLoadedPayloads() };
+	for (const std::string &payload : payloads)
+	{
+		Record record;
+		if (!decode_(payload, record))
+			break;
+
+		mRecords.push_back(record);
+		addToIndex_(static_cast<int>(mRecords.size()) - 1);
+	}
+
+	//Drop the records after the first one that does not decode
+	if (mRecords.size() != payloads.size())
+	{
+		std::cerr << "WARNING in " << __FUNCTION__ << ": The records of " << filename << ".bin after the last valid one have been dropped\n";
+		mFile.truncate(static_cast<int>(mRecords.size()));
+	}
+}
+
+//Record a tile that has just been saved to disk. The checksum is computed by the caller from the stack in memory (see TiffU8::computeCRC32), so the file is not read back
+void TileManifest::append(const int cutNumber, const int wavelength_nm, const TILEIJ tileIndicesIJ, const POSITION3 stagePosXYZ, const std::string filename, const U32 checksum)
+{
+	const std::string fullPath{ mFolderPath + filename };
+	if (!std::filesystem::exists(fullPath))
+		throw std::runtime_error((std::string)__FUNCTION__ + ": The file " + filename + " does not exist");
+
+	append({ cutNumber, wavelength_nm, tileIndicesIJ, stagePosXYZ, std::filesystem::file_size(fullPath), checksum, filename });
+}
+
+//Record a tile that is no longer in memory, e.g. when importing an older dataset. The checksum is computed by reading the file back
+void TileManifest::append(const int cutNumber, const int wavelength_nm, const TILEIJ tileIndicesIJ, const POSITION3 stagePosXYZ, const std::string filename)
+{
+	append(cutNumber, wavelength_nm, tileIndicesIJ, stagePosXYZ, filename, computeChecksum(mFolderPath, filename));
+}
+
+//Append the record to the file and flush it immediately
+void TileManifest::append(const Record &record)
+{
+	if (record.mFilename.size() > (std::numeric_limits<U16>::max)())
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The filename is too long");
+
+	std::string payload;
+	FramedRecordFile::writeField<I32>(payload, record.mCutNumber);
+	FramedRecordFile::writeField<I32>(payload, record.mWavelength_nm);
+	FramedRecordFile::writeField<I32>(payload, record.mTileIndicesIJ.II);
+	FramedRecordFile::writeField<I32>(payload, record.mTileIndicesIJ.JJ);
+	FramedRecordFile::writeField<double>(payload, record.mStagePosXYZ.XX);
+	FramedRecordFile::writeField<double>(payload, record.mStagePosXYZ.YY);
+	FramedRecordFile::writeField<double>(payload, record.mStagePosXYZ.ZZ);
+	FramedRecordFile::writeField<U64>(payload, record.mFileSize_byte);
+	FramedRecordFile::writeField<U32>(payload, record.mChecksum);
+	FramedRecordFile::writeField<U16>(payload, static_cast<U16>(record.mFilename.size()));
+	payload.append(record.mFilename);
+	mFile.append(payload);
+
+	mRecords.push_back(record);
+	addToIndex_(static_cast<int>(mRecords.size()) - 1);
+}
+
+int TileManifest::readNrecords() const
+{
+	return static_cast<int>(mRecords.size());
+}
+
+const TileManifest::Record& TileManifest::readRecord(const int recordIndex) const
+{
+	if (recordIndex < 0 || recordIndex >= readNrecords())
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The record index must be in the range [0-" + std::to_string(readNrecords() - 1) + "]");
+
+	return mRecords.at(recordIndex);
+}
+
+bool TileManifest::contains(const int cutNumber, const int wavelength_nm, const TILEIJ tileIndicesIJ) const
+{
+	return mIndexByKey.find(determineKey_(cutNumber, wavelength_nm, tileIndicesIJ)) != mIndexByKey.end();
+}
+
+//Return the latest record of a tile
+const TileManifest::Record& TileManifest::findTile(const int cutNumber, const int wavelength_nm, const TILEIJ tileIndicesIJ) const
+{
+	const auto it{ mIndexByKey.find(determineKey_(cutNumber, wavelength_nm, tileIndicesIJ)) };
+	if (it == mIndexByKey.end())
+		throw std::out_of_range((std::string)__FUNCTION__ + ": The tile (" + std::to_string(tileIndicesIJ.II) + "," + std::to_string(tileIndicesIJ.JJ) + ") of cut " + std::to_string(cutNumber) +
+			" at " + std::to_string(wavelength_nm) + " nm is not in the manifest");
+
+	return mRecords.at(it->second);
+}
+
+//Indices of the records in a cut, in the order they were appended. Only the latest record of each tile is returned
+std::vector<int> TileManifest::findRecordsInCut(const int cutNumber) const
+{
+	const auto it{ mIndexByCut.find(cutNumber) };
+	return it == mIndexByCut.end() ? std::vector<int>{} : it->second;
+}
+
+std::vector<int> TileManifest::findRecordsAtWavelength(const int wavelength_nm) const
+{
+	const auto it{ mIndexByWavelength.find(wavelength_nm) };
+	return it == mIndexByWavelength.end() ? std::vector<int>{} : it->second;
+}
+
+std::vector<int> TileManifest::findRecordsAtTile(const TILEIJ tileIndicesIJ) const
+{
+	const auto it{ mIndexByTile.find(static_cast<int>(determineKey_(0, 0, tileIndicesIJ))) };
+	return it == mIndexByTile.end() ? std::vector<int>{} : it->second;
+}
+
+//Indices of the records of a cut at a given wavelength, in the order they were appended
+std::vector<int> TileManifest::findRecords(const int cutNumber, const int wavelength_nm) const
+{
+	std::vector<int> vec_recordIndex;
+	for (const int recordIndex : findRecordsInCut(cutNumber))
+		if (mRecords.at(recordIndex).mWavelength_nm == wavelength_nm)
+			vec_recordIndex.push_back(recordIndex);
+	return vec_recordIndex;
+}
+
+//Check that the file on disk still matches the size and checksum of the record
+bool TileManifest::verifyRecord(const int recordIndex) const
+{
+	const Record &record{ readRecord(recordIndex) };
+	const std::string fullPath{ mFolderPath + record.mFilename };
+
+	if (!std::filesystem::exists(fullPath) || std::filesystem::file_size(fullPath) != record.mFileSize_byte)
+		return false;
+	try
+	{
+		return computeChecksum(mFolderPath, record.mFilename) == record.mChecksum;
+	}
+	catch (const std::runtime_error&)		//The file is not a readable Tiff
+	{
+		return false;
+	}
+}
+
+//Generate the tile configuration for 'Grid/collection stitcher' in Fiji. The tile positions are tileStepIJK_pix times the tile indices
+void TileManifest::saveGridStitcherConfig(const std::string folderPath, std::string filename, const int cutNumber, const int wavelength_nm, const TILEOVERLAP3 tileStepIJK_pix, const OVERRIDE override) const
+{
+	if (override == OVERRIDE::DIS)
+		filename = Util::doesFileExist(folderPath, filename, ".txt");
+
+	std::ofstream fileHandle{ folderPath + filename + ".txt" };
+	if (!fileHandle)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": The file " + filename + ".txt failed to open");
+
+	fileHandle << "dim=3\n";	//Needed at the start of the txt for the stitcher
+	for (const int recordIndex : findRecords(cutNumber, wavelength_nm))
+		fileHandle << std::filesystem::path{ mRecords.at(recordIndex).mFilename }.filename().string() + writeStitcherEntry_(mRecords.at(recordIndex), tileStepIJK_pix);
+}
+
+//Generate the tile configuration for BigStitcher in Fiji. The tiles are numbered sequentially starting from firstTileNumber
+//(e.g., the numbering for the second wavelength has to start after the last number of the first wavelength)
+void TileManifest::saveBigStitcherConfig(const std::string folderPath, std::string filename, const int cutNumber, const int wavelength_nm, const int firstTileNumber, const TILEOVERLAP3 tileStepIJK_pix, const OVERRIDE override) const
+{
+	if (override == OVERRIDE::DIS)
+		filename = Util::doesFileExist(folderPath, filename, ".txt");
+
+	std::ofstream fileHandle{ folderPath + filename + ".txt" };
+	if (!fileHandle)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": The file " + filename + ".txt failed to open");
+
+	fileHandle << "dim=3\n";	//Needed at the start of the txt for the stitcher
+	int tileNumber{ firstTileNumber };
+	for (const int recordIndex : findRecords(cutNumber, wavelength_nm))
+		fileHandle << Util::zeroPadding(tileNumber++, 4) + writeStitcherEntry_(mRecords.at(recordIndex), tileStepIJK_pix);
+}
+
+//Convert a _TileConfiguration.txt written by the sequencer into a manifest. The tiles are looked up in folderPath and in the subfolder of their cut
+//The format of each entry is "cutNumber_wavelengthIndex_tileIndexII_tileIndexJJ.tif;;\t(...)" followed by the comment "#(II,JJ)\tlongName", e.g. "000_0_17_31.tif"
+void TileManifest::importTileConfiguration(const std::string folderPath, const std::string tileConfigurationFilename, const std::string manifestFilename)
+{
+	std::ifstream inputConfigTxt{ folderPath + tileConfigurationFilename + ".txt" };
+	if (!inputConfigTxt)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": The file " + tileConfigurationFilename + ".txt failed to open");
+
+	TileManifest manifest{ folderPath, manifestFilename };
+
+	//Read the stage position "_key=value" from the long name in the comment
+	const auto readPosition{ [](const std::string &longName, const std::string &key) {
+		const std::string::size_type keyPos{ longName.find(key) };
+		return keyPos == std::string::npos ? 0. : std::stod(longName.substr(keyPos + key.length())) * mm;
+	} };
+
+	std::string line, pendingFilename;
+	int cutNumber{ 0 }, wavelength_nm{ 0 };
+	TILEIJ tileIndicesIJ{ 0, 0 };
+	const auto appendPending{ [&](const std::string &longName) {
+		if (!pendingFilename.empty() && !manifest.contains(cutNumber, wavelength_nm, tileIndicesIJ))
+			manifest.append(cutNumber, wavelength_nm, tileIndicesIJ, { readPosition(longName, "_x="), readPosition(longName, "_y="), readPosition(longName, "_zi=") }, pendingFilename);
+		pendingFilename.clear();
+	} };
+
+	getline(inputConfigTxt, line);									//Skip the first line that contains "dim=3"
+	while (getline(inputConfigTxt, line))
+	{
+		if (line.empty())
+			continue;
+		if (line.front() == '#')									//The comment follows the entry of its tile
+		{
+			appendPending(line);
+			continue;
+		}
+		appendPending("");											//Entry without a comment
+
+		//Tokenize the filename with respect to '_'
+		const std::string shortName{ line.substr(0, line.find(".tif")) };
+		std::stringstream shortName_ss(shortName);
+		std::string isolatedParameter;
+		getline(shortName_ss, isolatedParameter, '_');
+		cutNumber = std::stoi(isolatedParameter);
+		getline(shortName_ss, isolatedParameter, '_');
+		wavelength_nm = Util::convertFluorMarkerToWavelength_nm(std::stoi(isolatedParameter));
+		getline(shortName_ss, isolatedParameter, '_');
+		tileIndicesIJ.II = std::stoi(isolatedParameter);
+		getline(shortName_ss, isolatedParameter, '_');
+		tileIndicesIJ.JJ = std::stoi(isolatedParameter);
+
+		const std::string subFolderName{ Util::zeroPadding(cutNumber, 3) + "\\" };
+		if (std::filesystem::exists(folderPath + shortName + ".tif"))
+			pendingFilename = shortName + ".tif";
+		else if (std::filesystem::exists(folderPath + subFolderName + shortName + ".tif"))
+			pendingFilename = subFolderName + shortName + ".tif";
+		else
+			std::cerr << "WARNING in " << __FUNCTION__ << ": The file " << shortName << ".tif does not exist. Skipped\n";
+	}
+	appendPending("");
+	std::cout << "Successfully imported " << manifest.readNrecords() << " tiles into " << manifestFilename << ".bin\n";
+}
+
+//Checksum of a saved stack as recorded in the manifest. filename is relative to folderPath and includes the extension
+U32 TileManifest::computeChecksum(const std::string folderPath, const std::string filename)
+{
+	const std::filesystem::path relativePath{ filename };
+	const std::string subFolderName{ relativePath.has_parent_path() ? relativePath.parent_path().string() + "\\" : "" };
+	return TiffU8{ folderPath + subFolderName, relativePath.stem().string() }.computeCRC32();
+}
+
+//Pack the indices into a single key. Each index is limited to 16 bits, which is plenty for the number of cuts, wavelengths in nm, and tiles
+U64 TileManifest::determineKey_(const int cutNumber, const int wavelength_nm, const TILEIJ tileIndicesIJ)
+{
+	return (static_cast<U64>(static_cast<U16>(cutNumber)) << 48) | (static_cast<U64>(static_cast<U16>(wavelength_nm)) << 32) |
+		(static_cast<U64>(static_cast<U16>(tileIndicesIJ.II)) << 16) | static_cast<U64>(static_cast<U16>(tileIndicesIJ.JJ));
+}
+
+//A newer record of the same tile replaces the older one in all the indices
+void TileManifest::addToIndex_(const int recordIndex)
+{
+	const Record &record{ mRecords.at(recordIndex) };
+	const U64 key{ determineKey_(record.mCutNumber, record.mWavelength_nm, record.mTileIndicesIJ) };
+	const auto it{ mIndexByKey.find(key) };
+	std::vector<int> &vec_byCut{ mIndexByCut[record.mCutNumber] };
+	std::vector<int> &vec_byWavelength{ mIndexByWavelength[record.mWavelength_nm] };
+	std::vector<int> &vec_byTile{ mIndexByTile[static_cast<int>(determineKey_(0, 0, record.mTileIndicesIJ))] };
+
+	if (it != mIndexByKey.end())
+	{
+		std::replace(vec_byCut.begin(), vec_byCut.end(), it->second, recordIndex);
+		std::replace(vec_byWavelength.begin(), vec_byWavelength.end(), it->second, recordIndex);
+		std::replace(vec_byTile.begin(), vec_byTile.end(), it->second, recordIndex);
+		it->second = recordIndex;
+	}
+	else
+	{
+		mIndexByKey[key] = recordIndex;
+		vec_byCut.push_back(recordIndex);
+		vec_byWavelength.push_back(recordIndex);
+		vec_byTile.push_back(recordIndex);
+	}
+}
+
+//Position of the tile in pixels and the original filename as a comment. Note that in Fiji, the roles of II and JJ are reversed
+std::string TileManifest::writeStitcherEntry_(const Record &record, const TILEOVERLAP3 tileStepIJK_pix) const
+{
+	return ";;\t(" +
+		Util::toString(tileStepIJK_pix.II * record.mTileIndicesIJ.JJ, 0) + "," +
+		Util::toString(tileStepIJK_pix.JJ * record.mTileIndicesIJ.II, 0) + "," +
+		Util::toString(tileStepIJK_pix.KK * record.mCutNumber, 0) + ")\n" +
+		"#(" + Util::zeroPadding(record.mTileIndicesIJ.II, 2) + "," + Util::zeroPadding(record.mTileIndicesIJ.JJ, 2) + ")\t" + record.mFilename + "\n";
+}
+
+//Return false if the payload is too short or too long for a record, e.g. when it was written by another version of the manifest
+bool TileManifest::decode_(const std::string &payload, Record &record)
+{
+	try
+	{
+		std::size_t pos{ 0 };
+		record.mCutNumber = FramedRecordFile::readField<I32>(payload, pos);
+		record.mWavelength_nm = FramedRecordFile::readField<I32>(payload, pos);
+		record.mTileIndicesIJ.II = FramedRecordFile::readField<I32>(payload, pos);
+		record.mTileIndicesIJ.JJ = FramedRecordFile::readField<I32>(payload, pos);
+		record.mStagePosXYZ.XX = FramedRecordFile::readField<double>(payload, pos);
+		record.mStagePosXYZ.YY = FramedRecordFile::readField<double>(payload, pos);
+		record.mStagePosXYZ.ZZ = FramedRecordFile::readField<double>(payload, pos);
+		record.mFileSize_byte = FramedRecordFile::readField<U64>(payload, pos);
+		record.mChecksum = FramedRecordFile::readField<U32>(payload, pos);
+		const U16 filenameLength{ FramedRecordFile::readField<U16>(payload, pos) };
+		if (pos + filenameLength != payload.size())
+			return false;
+		record.mFilename = payload.substr(pos, filenameLength);
+		return true;
+	}
+	catch (const std::runtime_error &)		//Truncated record
+	{
+		return false;
+	}
+}
+#pragma endregion "TileManifest"
+
+#pragma region "TileBitmap"
+TileBitmap::TileBitmap(const TILEDIM2 tileArraySizeIJ, const bool value) :
+	mArraySizeIJ{ tileArraySizeIJ },
+	mNwordsPerRow{ (tileArraySizeIJ.JJ + 63) / 64 },
+	mLastWordMask{ tileArraySizeIJ.JJ % 64 == 0 ? ~0ULL : (1ULL << (tileArraySizeIJ.JJ % 64)) - 1 }
+{
+	if (mArraySizeIJ.II <= 0 || mArraySizeIJ.JJ <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile array size must be > 0");
+
+	mWords.resize(static_cast<std::size_t>(mArraySizeIJ.II) * mNwordsPerRow);
+	assign(value);
+}
+
+TILEDIM2 TileBitmap::readTileArraySizeIJ() const
+{
+	return mArraySizeIJ;
+}
+
+bool TileBitmap::test(const TILEIJ tileIndicesIJ) const
+{
+	checkTileIndices_(tileIndicesIJ);
+	return (mWords[static_cast<std::size_t>(tileIndicesIJ.II) * mNwordsPerRow + tileIndicesIJ.JJ / 64] >> (tileIndicesIJ.JJ % 64)) & 1ULL;
+}
+
+void TileBitmap::set(const TILEIJ tileIndicesIJ, const bool value)
+{
+	checkTileIndices_(tileIndicesIJ);
+	U64 &word{ mWords[static_cast<std::size_t>(tileIndicesIJ.II) * mNwordsPerRow + tileIndicesIJ.JJ / 64] };
+	const U64 bit{ 1ULL << (tileIndicesIJ.JJ % 64) };
+	if (value)
+		word |= bit;
+	else
+		word &= ~bit;
+}
+
+void TileBitmap::assign(const bool value)
+{
+	for (int II = 0; II < mArraySizeIJ.II; II++)
+	{
+		U64 *row{ &mWords[static_cast<std::size_t>(II) * mNwordsPerRow] };
+		for (int iterWord = 0; iterWord < mNwordsPerRow; iterWord++)
+			row[iterWord] = value ? ~0ULL : 0;
+		row[mNwordsPerRow - 1] &= mLastWordMask;
+	}
+}
+
+//Number of bright tiles
+int TileBitmap::count() const
+{
+	int nBright{ 0 };
+	for (const U64 word : mWords)
+		nBright += static_cast<int>(std::bitset<64>{ word }.count());
+	return nBright;
+}
+
+//Number of tiles that are bright here but not in 'other'
+int TileBitmap::countAndNot(const TileBitmap &other) const
+{
+	checkSize_(other);
+
+	int nBright{ 0 };
+	for (std::vector<U64>::size_type iterWord = 0; iterWord != mWords.size(); iterWord++)
+		nBright += static_cast<int>(std::bitset<64>{ mWords[iterWord] & ~other.mWords[iterWord] }.count());
+	return nBright;
+}
+
+bool TileBitmap::operator==(const TileBitmap &other) const
+{
+	return mArraySizeIJ.II == other.mArraySizeIJ.II && mArraySizeIJ.JJ == other.mArraySizeIJ.JJ && mWords == other.mWords;
+}
+
+bool TileBitmap::operator!=(const TileBitmap &other) const
+{
+	return !(*this == other);
+}
+
+TileBitmap& TileBitmap::operator|=(const TileBitmap &other)
+{
+	checkSize_(other);
+	for (std::vector<U64>::size_type iterWord = 0; iterWord != mWords.size(); iterWord++)
+		mWords[iterWord] |= other.mWords[iterWord];
+	return *this;
+}
+
+TileBitmap& TileBitmap::operator&=(const TileBitmap &other)
+{
+	checkSize_(other);
+	for (std::vector<U64>::size_type iterWord = 0; iterWord != mWords.size(); iterWord++)
+		mWords[iterWord] &= other.mWords[iterWord];
+	return *this;
+}
+
+//Enlarge the bright region by margin_tiles in II and JJ (square structuring element of side 2 * margin_tiles + 1)
+void TileBitmap::dilate(const int margin_tiles)
+{
+	morphology_(margin_tiles, true);
+}
+
+//Shrink the bright region by margin_tiles in II and JJ. The tiles outside the array count as dark, so the bright tiles at the edges of the array are eroded
+void TileBitmap::erode(const int margin_tiles)
+{
+	morphology_(margin_tiles, false);
+}
+
+//Fill the tiles that lie between the first and last bright tiles of their row and, at the same time, between the first and last bright tiles of their column
+//The row spans are filled word by word. The column spans are the intersection of the union of the rows above (included) and the union of the rows below (included)
+void TileBitmap::fillHoles()
+{
+	if (mArraySizeIJ.II == 1 && mArraySizeIJ.JJ == 1)
+		return;																						//A single tile has no holes
+
+	const std::size_t nWords{ mWords.size() };
+	std::vector<U64> columnSpan(nWords);
+
+	//Union of the rows above
+	std::vector<U64> accumulator(mNwordsPerRow, 0);
+	for (int II = 0; II < mArraySizeIJ.II; II++)
+		for (int iterWord = 0; iterWord < mNwordsPerRow; iterWord++)
+		{
+			const std::size_t index{ static_cast<std::size_t>(II) * mNwordsPerRow + iterWord };
+			accumulator[iterWord] |= mWords[index];
+			columnSpan[index] = accumulator[iterWord];
+		}
+
+	//Intersect with the union of the rows below
+	accumulator.assign(mNwordsPerRow, 0);
+	for (int II = mArraySizeIJ.II - 1; II >= 0; II--)
+		for (int iterWord = 0; iterWord < mNwordsPerRow; iterWord++)
+		{
+			const std::size_t index{ static_cast<std::size_t>(II) * mNwordsPerRow + iterWord };
+			accumulator[iterWord] |= mWords[index];
+			columnSpan[index] &= accumulator[iterWord];
+		}
+
+	//In an array of a single row (column), only the row (column) spans are filled
+	if (mArraySizeIJ.II == 1)
+	{
+		columnSpan.assign(nWords, ~0ULL);
+		columnSpan[mNwordsPerRow - 1] = mLastWordMask;
+	}
+	if (mArraySizeIJ.JJ == 1)
+	{
+		mWords = columnSpan;
+		return;
+	}
+
+	//Row spans
+	for (int II = 0; II < mArraySizeIJ.II; II++)
+	{
+		U64 *row{ &mWords[static_cast<std::size_t>(II) * mNwordsPerRow] };
+		int firstWord{ 0 }, lastWord{ mNwordsPerRow - 1 };
+		while (firstWord < mNwordsPerRow && row[firstWord] == 0)
+			firstWord++;
+		if (firstWord == mNwordsPerRow)
+			continue;																				//Dark row
+		while (row[lastWord] == 0)
+			lastWord--;
+
+		int firstBit{ 0 }, lastBit{ 63 };
+		while (((row[firstWord] >> firstBit) & 1ULL) == 0)
+			firstBit++;
+		while (((row[lastWord] >> lastBit) & 1ULL) == 0)
+			lastBit--;
+
+		for (int iterWord = firstWord; iterWord <= lastWord; iterWord++)
+		{
+			U64 span{ ~0ULL };
+			if (iterWord == firstWord)
+				span &= ~0ULL << firstBit;
+			if (iterWord == lastWord)
+				span &= ~0ULL >> (63 - lastBit);
+			row[iterWord] |= span;
+		}
+	}
+
+	for (std::size_t iterWord = 0; iterWord < nWords; iterWord++)
+		mWords[iterWord] &= columnSpan[iterWord];
+}
+
+//Save the bitmap as a text file: one row of '0's and '1's per II
+void TileBitmap::saveToText(const std::string folderPath, std::string filename, const OVERRIDE override) const
+{
+	std::ofstream fileHandle;
+
+	if (override == OVERRIDE::DIS)
+		filename = Util::doesFileExist(folderPath, filename, ".txt");
+
+	fileHandle.open(folderPath + filename + ".txt");
+
+	std::string line(mArraySizeIJ.JJ, '0');
+	for (int II = 0; II < mArraySizeIJ.II; II++)
+	{
+		for (int JJ = 0; JJ < mArraySizeIJ.JJ; JJ++)
+			line[JJ] = test({ II, JJ }) ? '1' : '0';
+		fileHandle << line << "\n";	//End the row
+	}
+
+	fileHandle.close();
+}
+
+//Read a bitmap saved by saveToText
+TileBitmap TileBitmap::loadFromText(const std::string folderPath, const std::string filename, const TILEDIM2 tileArraySizeIJ)
+{
+	std::ifstream fileHandle{ folderPath + filename + ".txt" };
+	if (!fileHandle.is_open())
+		throw std::runtime_error((std::string)__FUNCTION__ + ": Failed opening the file " + filename + ".txt");
+
+	TileBitmap bitmap{ tileArraySizeIJ };
+	std::string line;
+	for (int II = 0; II < tileArraySizeIJ.II; II++)
+	{
+		if (!std::getline(fileHandle, line) || static_cast<int>(line.size()) < tileArraySizeIJ.JJ)
+			throw std::runtime_error((std::string)__FUNCTION__ + ": The boolmap in " + filename + ".txt does not match the tile array size");
+		for (int JJ = 0; JJ < tileArraySizeIJ.JJ; JJ++)
+			if (line.at(JJ) == '1')
+				bitmap.set({ II, JJ });
+	}
+	return bitmap;
+}
+
+void TileBitmap::checkTileIndices_(const TILEIJ tileIndicesIJ) const
+{
+	if (tileIndicesIJ.II < 0 || tileIndicesIJ.II >= mArraySizeIJ.II)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile row index II must be in the range [0-" + std::to_string(mArraySizeIJ.II - 1) + "]");
+	if (tileIndicesIJ.JJ < 0 || tileIndicesIJ.JJ >= mArraySizeIJ.JJ)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile column index JJ must be in the range [0-" + std::to_string(mArraySizeIJ.JJ - 1) + "]");
+}
+
+void TileBitmap::checkSize_(const TileBitmap &other) const
+{
+	if (mArraySizeIJ.II != other.mArraySizeIJ.II || mArraySizeIJ.JJ != other.mArraySizeIJ.JJ)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The tile array sizes do not match");
+}
+
+//Shift the bits of a row by 1 tile. shift = +1 moves the tile JJ to JJ + 1 and shift = -1 moves it to JJ - 1. The tiles shifted in from outside the array are dark
+void TileBitmap::shiftRow_(const U64 *input, U64 *output, const int shift) const
+{
+	if (shift > 0)
+		for (int iterWord = mNwordsPerRow - 1; iterWord >= 0; iterWord--)
+			output[iterWord] = (input[iterWord] << 1) | (iterWord > 0 ? input[iterWord - 1] >> 63 : 0);
+	else
+		for (int iterWord = 0; iterWord < mNwordsPerRow; iterWord++)
+			output[iterWord] = (input[iterWord] >> 1) | (iterWord < mNwordsPerRow - 1 ? input[iterWord + 1] << 63 : 0);
+	output[mNwordsPerRow - 1] &= mLastWordMask;
+}
+
+//The square structuring element is separable: first along JJ, then along II. Each pass is repeated margin_tiles times with a structuring element of side 3
+void TileBitmap::morphology_(const int margin_tiles, const bool isDilation)
+{
+	if (margin_tiles < 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The margin must be >= 0");
+
+	std::vector<U64> shiftedLeft(mNwordsPerRow), shiftedRight(mNwordsPerRow);
+	for (int iterMargin = 0; iterMargin < margin_tiles; iterMargin++)
+		for (int II = 0; II < mArraySizeIJ.II; II++)
+		{
+			U64 *row{ &mWords[static_cast<std::size_t>(II) * mNwordsPerRow] };
+			shiftRow_(row, shiftedRight.data(), 1);
+			shiftRow_(row, shiftedLeft.data(), -1);
+			for (int iterWord = 0; iterWord < mNwordsPerRow; iterWord++)
+				row[iterWord] = isDilation ? row[iterWord] | shiftedLeft[iterWord] | shiftedRight[iterWord] : row[iterWord] & shiftedLeft[iterWord] & shiftedRight[iterWord];
+		}
+
+	std::vector<U64> previous(mWords.size());
+	for (int iterMargin = 0; iterMargin < margin_tiles; iterMargin++)
+	{
+		previous = mWords;
+		for (int II = 0; II < mArraySizeIJ.II; II++)
+			for (int iterWord = 0; iterWord < mNwordsPerRow; iterWord++)
+			{
+				const std::size_t index{ static_cast<std::size_t>(II) * mNwordsPerRow + iterWord };
+				const U64 above{ II > 0 ? previous[index - mNwordsPerRow] : 0 };
+				const U64 below{ II < mArraySizeIJ.II - 1 ? previous[index + mNwordsPerRow] : 0 };
+				mWords[index] = isDilation ? previous[index] | above | below : previous[index] & above & below;
+			}
+	}
+}
+#pragma endregion "TileBitmap"
+
+#pragma region "ScratchArena"
+//Totals over the arenas of all the threads
+static std::atomic<U64> g_scratchResident_byte{ 0 };
+static std::atomic<U64> g_scratchHighWater_byte{ 0 };
+static std::atomic<U64> g_scratchNallocations{ 0 };
+static std::atomic<U64> g_scratchNreuses{ 0 };
+
+ScratchArena::ScratchArena() :
+	mImage{ nullptr },
+	mImageCapacity_byte{ 0 },
+	mSlotCapacity_byte{}
+{}
+
+ScratchArena::~ScratchArena()
+{
+	release();
+}
+
+ScratchArena& ScratchArena::local()
+{
+	thread_local ScratchArena arena;
+	return arena;
+}
+
+//Return the image block with room for exactly nPix pixels, so that it can be swapped with an array of the same size
+//The block is reallocated only if the size changes. Its content is undefined
+U8* ScratchArena::acquireImage(const int nPix)
+{
+	if (nPix <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The number of pixels must be > 0");
+
+	const std::size_t size_byte{ static_cast<std::size_t>(nPix) * sizeof(U8) };
+	if (mImage != nullptr && mImageCapacity_byte == size_byte)
+		g_scratchNreuses++;
+	else
+	{
+		delete[] mImage;
+		mImage = nullptr;
+		mImage = new U8[size_byte];
+		resize_(mImageCapacity_byte, size_byte);
+		mImageCapacity_byte = size_byte;
+		g_scratchNallocations++;
+	}
+	return mImage;
+}
+
+//Swap the image block with the array. The array must have been allocated with new[] and have the size of the last acquireImage()
+void ScratchArena::swapImage(U8* &array)
+{
+	if (mImage == nullptr)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": The image block has not been acquired");
+
+	std::swap(mImage, array);
+}
+
+//Free the memory of the calling thread's arena
+void ScratchArena::release()
+{
+	delete[] mImage;
+	mImage = nullptr;
+	resize_(mImageCapacity_byte, 0);
+	mImageCapacity_byte = 0;
+
+	for (int iterSlot = 0; iterSlot < mNslots; iterSlot++)
+	{
+		mSlots[iterSlot].reset();
+		resize_(mSlotCapacity_byte[iterSlot], 0);
+		mSlotCapacity_byte[iterSlot] = 0;
+	}
+}
+
+U64 ScratchArena::readResident_byte()
+{
+	return g_scratchResident_byte;
+}
+
+U64 ScratchArena::readHighWater_byte()
+{
+	return g_scratchHighWater_byte;
+}
+
+U64 ScratchArena::readNallocations()
+{
+	return g_scratchNallocations;
+}
+
+U64 ScratchArena::readNreuses()
+{
+	return g_scratchNreuses;
+}
+
+//The slots only grow, so the largest request sets the capacity
+U8* ScratchArena::acquireSlot_(const SLOT slot, const std::size_t size_byte, const bool zeroed)
+{
+	const int slotIndex{ static_cast<int>(slot) };
+	if (slotIndex < 0 || slotIndex >= mNslots)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": Invalid slot");
+
+	if (size_byte > mSlotCapacity_byte[slotIndex])
+	{
+		mSlots[slotIndex].reset();
+		mSlots[slotIndex].reset(new U8[size_byte]);
+		resize_(mSlotCapacity_byte[slotIndex], size_byte);
+		mSlotCapacity_byte[slotIndex] = size_byte;
+		g_scratchNallocations++;
+	}
+	else
+		g_scratchNreuses++;
+
+	if (zeroed)
+		std::memset(mSlots[slotIndex].get(), 0, size_byte);
+
+	return mSlots[slotIndex].get();
+}
+
+//Update the totals when a block changes size
+void ScratchArena::resize_(const std::size_t oldSize_byte, const std::size_t newSize_byte)
+{
+	g_scratchResident_byte -= oldSize_byte;
+	const U64 resident_byte{ g_scratchResident_byte += newSize_byte };
+
+	U64 highWater_byte{ g_scratchHighWater_byte };
+	while (resident_byte > highWater_byte && !g_scratchHighWater_byte.compare_exchange_weak(highWater_byte, resident_byte))
+		;
+}
+#pragma endregion "ScratchArena"
+
 #pragma region "TiffU8"
 //Construct a tiff from a file
 TiffU8::TiffU8(const std::string folderPath, const std::string filename) :
@@ -367,6 +1229,25 @@ TiffU8::TiffU8(const TiffU8& tiff):
 	std::memcpy(mArray, tiff.mArray, mNpixAllFrames * sizeof(U8));
 }
 
+//Move constructor. Take over the array of the input tiff, which is left empty
+TiffU8::TiffU8(TiffU8&& tiff) noexcept :
+	mArray{ tiff.mArray },
+	mHeightPerFrame_pix{ tiff.mHeightPerFrame_pix },
+	mWidthPerFrame_pix{ tiff.mWidthPerFrame_pix },
+	mNframes{ tiff.mNframes },
+	mBytesPerLine{ tiff.mBytesPerLine },
+	mNpixPerFrame{ tiff.mNpixPerFrame },
+	mNpixAllFrames{ tiff.mNpixAllFrames }
+{
+	tiff.mArray = nullptr;
+	tiff.mHeightPerFrame_pix = 0;
+	tiff.mWidthPerFrame_pix = 0;
+	tiff.mNframes = 0;
+	tiff.mBytesPerLine = 0;
+	tiff.mNpixPerFrame = 0;
+	tiff.mNpixAllFrames = 0;
+}
+
 //Construct a Tiff from an array
 TiffU8::TiffU8(const U8* inputArray, const int heightPerFrame_pix, const int widthPerFrame_pix, const int nFrames) :
 	mHeightPerFrame_pix{ heightPerFrame_pix },
@@ -418,9 +1299,45 @@ TiffU8::TiffU8(const int heightPerFrame_pix, const int widthPerFrame_pix, const
 	mArray = new U8[mNpixAllFrames]();
 }
 
-TiffU8::~TiffU8()
+TiffU8::~TiffU8()
+{
+	delete[] mArray;
+}
+
+//Copy assignment. Allocate the new array before releasing the current one
+TiffU8& TiffU8::operator=(const TiffU8& tiff)
+{
+	if (this != &tiff)
+	{
+		//Reuse the current array if it has the same size
+		if (mArray == nullptr || mNpixAllFrames != tiff.mNpixAllFrames)
+		{
+			U8 *array{ new U8[tiff.mNpixAllFrames] };
+			delete[] mArray;
+			mArray = array;
+		}
+		std::memcpy(mArray, tiff.mArray, tiff.mNpixAllFrames * sizeof(U8));
+		mHeightPerFrame_pix = tiff.mHeightPerFrame_pix;
+		mWidthPerFrame_pix = tiff.mWidthPerFrame_pix;
+		mNframes = tiff.mNframes;
+		mBytesPerLine = tiff.mBytesPerLine;
+		mNpixPerFrame = tiff.mNpixPerFrame;
+		mNpixAllFrames = tiff.mNpixAllFrames;
+	}
+	return *this;
+}
+
+//Move assignment. Swap the arrays so that the input tiff releases the current one
+TiffU8& TiffU8::operator=(TiffU8&& tiff) noexcept
 {
-	delete[] mArray;
+	std::swap(mArray, tiff.mArray);
+	std::swap(mHeightPerFrame_pix, tiff.mHeightPerFrame_pix);
+	std::swap(mWidthPerFrame_pix, tiff.mWidthPerFrame_pix);
+	std::swap(mNframes, tiff.mNframes);
+	std::swap(mBytesPerLine, tiff.mBytesPerLine);
+	std::swap(mNpixPerFrame, tiff.mNpixPerFrame);
+	std::swap(mNpixAllFrames, tiff.mNpixAllFrames);
+	return *this;
 }
 
 //Access the Tiff data in the TiffU8 object
@@ -429,6 +1346,12 @@ U8* const TiffU8::data() const
 	return mArray;
 }
 
+//View of all the frames, without copying the pixels
+ImageView TiffU8::view() const
+{
+	return ImageView{ mArray, mHeightPerFrame_pix, mWidthPerFrame_pix, mNframes, mWidthPerFrame_pix, 1, mNpixPerFrame };
+}
+
 int TiffU8::readHeightPerFrame_pix() const
 {
 	return mHeightPerFrame_pix;
@@ -557,104 +1480,29 @@ void TiffU8::mergePMT16Xchan(const int heightPerChannelPerFrame, const U8* input
 }
 
 //Divide the concatenated images in a stack of nFrames and save it (the microscope concatenates all the images and hands over a long image that has to be resized into individual images)
+//Choose whether to save the first frame at the top (UPWARD) or bottom (DOWNWARD) of the stack
 void TiffU8::saveToFile(const std::string folderPath, std::string filename, const TIFFSTRUCT tiffStruct, const OVERRIDE override, const SCANDIR scanDirZ) const
 {
-	int height_pix, width_pix, nFrames;
-
-	//Multi page structure
-	if (tiffStruct == TIFFSTRUCT::MULTIPAGE)
-	{
-		height_pix = mHeightPerFrame_pix;
-		width_pix = mWidthPerFrame_pix;
-		nFrames = mNframes;
-	}
-	//Single page
-	else
-	{
-		height_pix = mHeightPerFrame_pix * mNframes;
-		width_pix = mWidthPerFrame_pix;
-		nFrames = 1;
-	}
-
-	/*For debugging
-	std::cout << nFrames << "\n";
-	std::cout << Pixel height << "\n";
-	std::cout << Pixel width << "\n";
-	*/
-
-	if (override == OVERRIDE::DIS)
-		filename = Util::doesFileExist(folderPath, filename, ".tif");	//Check if the file exits. It gives some overhead
-
-	TIFF *tiffHandle{ TIFFOpen((folderPath + filename + ".tif").c_str(), "w") };
-
-	if (tiffHandle == nullptr)
-		throw std::runtime_error((std::string)__FUNCTION__ + ": Saving " + filename + ".tif failed");
-
-	U8 *buffer = (U8*)_TIFFmalloc(mBytesPerLine);	//Buffer used to store the row of pixel information for writing to file
-
-	if (buffer == NULL) //Check that the buffer memory was allocated
-	{
-		TIFFClose(tiffHandle);
-		throw std::runtime_error((std::string)__FUNCTION__ + ": Could not allocate memory for raster of TIFF image");
-	}
-
-	//Choose whether to save the first frame at the top or bottom of the stack
-	int iterFrame, lastFrame;
+	ImageView frames{ view() };
 	switch (scanDirZ)
 	{
 	case SCANDIR::UPWARD:	//Forward saving: the first frame is at the top of the stack
-		iterFrame = 0;
-		lastFrame = nFrames - 1;
 		break;
-	case SCANDIR::DOWNWARD:	//Reverse saving: the first frame is at the bottom of the stack
-		iterFrame = nFrames - 1;
-		lastFrame = 0;
+	case SCANDIR::DOWNWARD:	//Reverse saving: the first frame is at the bottom of the stack. A single page is saved as it is
+		if (tiffStruct == TIFFSTRUCT::MULTIPAGE)
+			frames = frames.reverseFrames();
 		break;
 	default:
 		throw std::invalid_argument((std::string)__FUNCTION__ + ": Invalid scan direction");
 	}
+	frames.saveToFile(folderPath, filename, tiffStruct, override);
+}
 
-	do
-	{
-		//TAGS
-		TIFFSetField(tiffHandle, TIFFTAG_IMAGELENGTH, height_pix);										//Set the pixel height of the image
-		TIFFSetField(tiffHandle, TIFFTAG_IMAGEWIDTH, width_pix);										//Set the pixel width of the image
-		//TIFFSetField(tiffHandle, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);							//PLANARCONFIG_CONTIG (for example, RGBRGBRGB) or PLANARCONFIG_SEPARATE (R, G, and B separate)
-		TIFFSetField(tiffHandle, TIFFTAG_SAMPLESPERPIXEL, 1);											//Set number of channels per pixel
-		TIFFSetField(tiffHandle, TIFFTAG_BITSPERSAMPLE, 8);												//Set the size of the channels
-		TIFFSetField(tiffHandle, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);								//Set the origin of the image. Many readers ignore this tag (ImageJ, Windows preview, etc...)
-		TIFFSetField(tiffHandle, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);							//Single channel with min as black				
-		TIFFSetField(tiffHandle, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tiffHandle, width_pix));	//Set the strip size of the file to be size of one row of pixels
-		//TIFFSetField(tiffHandle, TIFFTAG_SUBFILETYPE, FILETYPE_PAGE);									//Specify that it's a frame within the multipage file
-		//TIFFSetField(tiffHandle, TIFFTAG_PAGENUMBER, iterFrame, nFrames);								//Specify the frame number
-
-		//IMAGEJ TAG FOR USING HYPERSTACKS
-		std::string TIFFTAG_ImageJ = "ImageJ=1.52e\nimages=" + std::to_string(nFrames) + "\nchannels=1\nslices=" + std::to_string(nFrames) + "\nhyperstack=true\nmode=grayscale\nunit=\\u00B5m\nloop=false ";
-		TIFFSetField(tiffHandle, TIFFTAG_IMAGEDESCRIPTION, TIFFTAG_ImageJ.c_str());
-
-		//Write a frame to the file one strip at a time
-		for (int iterRow_pix = 0; iterRow_pix < height_pix; iterRow_pix++)
-		{
-			std::memcpy(buffer, &mArray[(iterFrame * height_pix + iterRow_pix) * mBytesPerLine], mBytesPerLine);
-			if (TIFFWriteScanline(tiffHandle, buffer, iterRow_pix, 0) < 0)
-				break;
-		}
-
-		//Create a new page if nFrames > 1. It gives a large overhead
-		if(nFrames > 1)
-			TIFFWriteDirectory(tiffHandle);						
-
-		if (iterFrame == lastFrame)
-			break;
-
-		//Increase the iterator for UPWARD. Decrease for DOWNWARD
-		iterFrame += Util::convertScandirToInt(scanDirZ);	
-	} while (true);
-
-	_TIFFfree(buffer);										//Destroy the buffer
-	TIFFClose(tiffHandle);									//Close the output tiff file
-
-	std::cout << "Successfully saved: " << filename << ".tif\n";
+//CRC-32 of the pixels in the order saved by saveToFile() as MULTIPAGE with the same scan direction. It is the checksum recorded in the tile manifest
+//A Tiff loaded from the saved file has the same checksum with SCANDIR::UPWARD
+U32 TiffU8::computeCRC32(const SCANDIR scanDirZ) const
+{
+	return (scanDirZ == SCANDIR::DOWNWARD ? view().reverseFrames() : view()).computeCRC32();
 }
 
 //Save mArray as a text file
@@ -674,7 +1522,7 @@ void TiffU8::mirrorOddFrames()
 {
 	if (mNframes > 1)
 	{
-		U8 *buffer = new U8[mBytesPerLine];		//Buffer used to store a row of pixels
+		U8 *buffer{ ScratchArena::local().acquire<U8>(ScratchArena::SLOT::LINE, mBytesPerLine) };		//Buffer used to store a row of pixels
 
 		for (int iterFrame = 1; iterFrame < mNframes; iterFrame += 2)
 		{
@@ -688,14 +1536,13 @@ void TiffU8::mirrorOddFrames()
 				std::memcpy(&mArray[moneMei*mBytesPerLine], buffer, mBytesPerLine);
 			}
 		}
-		delete[] buffer;	//Release the memory
 	}
 }
 
 //Mirror the entire array mArray vertically
 void TiffU8::mirrorSingleFrame()
 {
-	U8 *buffer = new U8[mBytesPerLine];		//Buffer used to store a row of pixels
+	U8 *buffer{ ScratchArena::local().acquire<U8>(ScratchArena::SLOT::LINE, mBytesPerLine) };		//Buffer used to store a row of pixels
 
 	//Swap the first and last rows of the sub-image, then do the second and second last rows, etc
 	for (int IterRow = 0; IterRow < mHeightPerFrame_pix / 2; IterRow++)
@@ -706,7 +1553,6 @@ void TiffU8::mirrorSingleFrame()
 		std::memcpy(&mArray[eneTene*mBytesPerLine], &mArray[moneMei*mBytesPerLine], mBytesPerLine);
 		std::memcpy(&mArray[moneMei*mBytesPerLine], buffer, mBytesPerLine);
 	}
-	delete[] buffer;	//Release the memory
 }
 
 //The galvo (vectical axis of the image) performs bi-directional scanning and the data is saved in a long image (vertical strip)
@@ -716,7 +1562,7 @@ void TiffU8::averageEvenOddFrames()
 	if (mNframes > 2)
 	{
 		//Calculate the average of the even and odd frames separately
-		unsigned int* avg{ new unsigned int[2 * mNpixPerFrame]() };
+		unsigned int* avg{ ScratchArena::local().acquire<unsigned int>(ScratchArena::SLOT::ACCUMULATOR, 2 * mNpixPerFrame, true) };
 		for (int iterFrame = 0; iterFrame < mNframes; iterFrame++)
 			for (int iterPix = 0; iterPix < mNpixPerFrame; iterPix++)
 			{
@@ -737,7 +1583,6 @@ void TiffU8::averageEvenOddFrames()
 		}
 
 		mNframes = 2;	//Keep the odd and even averages in separate pages
-		delete[] avg;
 	}
 }
 
@@ -746,7 +1591,7 @@ void TiffU8::averageFrames()
 {
 	if (mNframes > 1)
 	{
-		unsigned int* sum{ new unsigned int[mNpixPerFrame]() };
+		unsigned int* sum{ ScratchArena::local().acquire<unsigned int>(ScratchArena::SLOT::ACCUMULATOR, mNpixPerFrame, true) };
 
 		//For each pixel, calculate the sum intensity over all the frames
 		for (int iterFrame = 0; iterFrame < mNframes; iterFrame++)
@@ -759,7 +1604,6 @@ void TiffU8::averageFrames()
 
 		//Update the number of frames in the stack to 1
 		mNframes = 1;
-		delete[] sum;
 	}
 }
 
@@ -779,7 +1623,7 @@ void TiffU8::binFrames(const int nFramesPerBin)
 	{
 		const int nBins{ mNframes / nFramesPerBin };								//Number of bins in the stack
 		const int nPixPerBin{ mNpixPerFrame * nFramesPerBin };
-		unsigned int* sum{ new unsigned int[nBins * mNpixPerFrame]() };
+		unsigned int* sum{ ScratchArena::local().acquire<unsigned int>(ScratchArena::SLOT::ACCUMULATOR, nBins * mNpixPerFrame, true) };
 
 		//Take the first nFramesPerBin frames and average them. Then continue averaging every nFramesPerBin frames until the end of the stack
 		for (int binIndex = 0; binIndex < nBins; binIndex++)
@@ -794,7 +1638,6 @@ void TiffU8::binFrames(const int nFramesPerBin)
 
 		//Update the number of frames in the stack
 		mNframes = nBins;
-		delete[] sum;
 	}
 }
 
@@ -834,7 +1677,8 @@ void TiffU8::correctRSdistortionGPU(const double FFOVfast)
 	const float PI_float{ static_cast<float>(PI) };
 
 	//Precompute the mapping of the fast coordinate (k)
-	float *kPrecomputed{ new float[mWidthPerFrame_pix] };
+	ScratchArena &arena{ ScratchArena::local() };
+	float *kPrecomputed{ arena.acquire<float>(ScratchArena::SLOT::LUT, mWidthPerFrame_pix) };
 	for (int k = 0; k < mWidthPerFrame_pix; k++) {
 		const float x = 1.f * k / (mWidthPerFrame_pix - 1.f);
 		const float a = 1.f - 2 * xbar1 - 2 * (xbar2 - xbar1) * x;
@@ -910,7 +1754,7 @@ void TiffU8::correctRSdistortionGPU(const double FFOVfast)
 	queue.finish();
 
 	//Read correctedArray from the device
-	unsigned char* correctedArray = new unsigned char[mNpixAllFrames];
+	unsigned char* correctedArray{ arena.acquireImage(mNpixAllFrames) };
 	queue.enqueueReadBuffer(buffer_correctedArray, CL_TRUE, 0, sizeof(unsigned char) * mNpixAllFrames, correctedArray);
 
 	double debugger;
@@ -928,9 +1772,7 @@ void TiffU8::correctRSdistortionGPU(const double FFOVfast)
 	std::cout << "Debugger: " << debugger << "\n";
 	*/
 
-	delete[] kPrecomputed;
-	delete[] mArray;			//Free the memory-block containing the old, uncorrected array
-	mArray = correctedArray;	//Reassign the pointer mArray to the newly corrected array
+	arena.swapImage(mArray);	//The corrected array becomes mArray and the old, uncorrected array goes back to the arena
 }
 
 //Called by TiffU8::correctRSdistortionCPU()
@@ -951,7 +1793,8 @@ void TiffU8::correctRSdistortionCPU(const double FFOVfast)
 	if (FFOVfast <= 0)
 		throw std::invalid_argument((std::string)__FUNCTION__ + ": FFOV must be > 0");
 
-	U8* correctedArray = new U8[mNpixAllFrames];
+	ScratchArena &arena{ ScratchArena::local() };
+	U8* correctedArray{ arena.acquireImage(mNpixAllFrames) };
 
 	//Start and stop time of the RS scan that define FFOVfast
 	const double t1{ 0.5 * (g_lineclockHalfPeriod - mWidthPerFrame_pix * g_pixelDwellTime) };
@@ -979,7 +1822,7 @@ void TiffU8::correctRSdistortionCPU(const double FFOVfast)
 	const float PI_float{ static_cast<float>(PI) };
 
 	// precompute the mapping of the fast coordinate (k)
-	float *kk_precomputed = new float[mWidthPerFrame_pix];
+	float *kk_precomputed{ arena.acquire<float>(ScratchArena::SLOT::LUT, mWidthPerFrame_pix) };
 	for (int k = 0; k < mWidthPerFrame_pix; k++) {
 		const float x{ 1.f * k / (mWidthPerFrame_pix - 1.f) };
 		const float a{ 1.f - 2 * xbar1 - 2 * (xbar2 - xbar1) * x };
@@ -1001,9 +1844,7 @@ void TiffU8::correctRSdistortionCPU(const double FFOVfast)
 		}
 	}
 
-	delete[] kk_precomputed;
-	delete[] mArray;			//Free the memory-block containing the old, uncorrected array
-	mArray = correctedArray;	//Reassign the pointer mArray to the newly corrected array
+	arena.swapImage(mArray);	//The corrected array becomes mArray and the old, uncorrected array goes back to the arena
 }
 
 //When using 16X beamlets, the slow axis is slightly stretched out (3 pixels on the edges, 0 pixels at the center)
@@ -1013,14 +1854,15 @@ void TiffU8::correctFOVslowCPU(const double FFOVslow)
 	if (FFOVslow <= 0)
 		throw std::invalid_argument((std::string)__FUNCTION__ + ": FFOV must be > 0");
 
-	U8* correctedArray = new U8[mNpixAllFrames];
+	ScratchArena &arena{ ScratchArena::local() };
+	U8* correctedArray{ arena.acquireImage(mNpixAllFrames) };
 
 	//Normalized variables
 	const float xbar2{ 1.007f };
 	const float xbar1{ 1.f - xbar2 };
 
 	// precompute the mapping of the slow coordinate (k)
-	float *kk_precomputed = new float[mHeightPerFrame_pix];
+	float *kk_precomputed{ arena.acquire<float>(ScratchArena::SLOT::LUT, mHeightPerFrame_pix) };
 	for (int k = 0; k < mHeightPerFrame_pix; k++) {
 		const float x{ 1.f * k / (mHeightPerFrame_pix - 1.f) };
 		const float xnew{ xbar1 + (xbar2 - xbar1) * x };
@@ -1040,8 +1882,7 @@ void TiffU8::correctFOVslowCPU(const double FFOVslow)
 		}
 	}
 
-	delete[] mArray;			//Free the memory-block containing the old, uncorrected array
-	mArray = correctedArray;	//Reassign the pointer mArray to the newly corrected array
+	arena.swapImage(mArray);	//The corrected array becomes mArray and the old, uncorrected array goes back to the arena
 }
 
 //The PMT16X channels have some crosstalk. Every strip (corresponding to a PMT16X channel) has ghost images from the neighboring strips
@@ -1052,7 +1893,8 @@ void TiffU8::suppressCrosstalk(const double crosstalkRatio, const double fineTun
 		throw std::invalid_argument((std::string)__FUNCTION__ + ": The crosstalk ratio must be in the range [0, 1.0]");
 
 	const int nPixPerFramePerBeamlet{ mNpixPerFrame / g_nChanPMT };	//Number of pixels in a strip
-	U8* correctedArray{ new U8[mNpixAllFrames] };
+	ScratchArena &arena{ ScratchArena::local() };
+	U8* correctedArray{ arena.acquireImage(mNpixAllFrames) };
 
 	for (int iterFrame = 0; iterFrame < mNframes; iterFrame++)
 	{
@@ -1089,8 +1931,7 @@ void TiffU8::suppressCrosstalk(const double crosstalkRatio, const double fineTun
 		}
 	}
 
-	delete[] mArray;			//Free the memory-block containing the old, uncorrected array
-	mArray = correctedArray;	//Reassign the pointer mArray to the newly corrected array
+	arena.swapImage(mArray);	//The corrected array becomes mArray and the old, uncorrected array goes back to the arena
 }
 
 //Upscale the pixel counts for the lower and higher channels of the PMT16X. The channel indices go from 0 to g_nChanPMT-1
@@ -1109,19 +1950,20 @@ void TiffU8::flattenFieldLinear(const double scaleFactor, const int lowerChan, c
 	const double lowerSlope{ (scaleFactor - 1.0) / lowerChan };							//Interpolation slope for the lower channels
 	const double higherSlope{ (scaleFactor - 1.0) / ((g_nChanPMT - 1) - higherChan) };	//Interpolation slope for the higer channels
 
-	std::vector<double> vec_upscalingFactors(g_nChanPMT, 1.0);							//Vector of upscaling factors
+	double *upscalingFactors{ ScratchArena::local().acquire<double>(ScratchArena::SLOT::LUT, g_nChanPMT) };	//Upscaling factors
+	std::fill(upscalingFactors, upscalingFactors + g_nChanPMT, 1.0);
 
 	//Lower channels: from CH00 to lowerChan
 	for (int chanIndex = 0; chanIndex <= lowerChan; chanIndex++)
-		vec_upscalingFactors.at(chanIndex) = -lowerSlope * chanIndex + scaleFactor;
+		upscalingFactors[chanIndex] = -lowerSlope * chanIndex + scaleFactor;
 
 	//Higher channels: from higherChan to CH15
 	for (int chanIndex = higherChan; chanIndex < g_nChanPMT; chanIndex++)
-		vec_upscalingFactors.at(chanIndex) = higherSlope * (chanIndex - (g_nChanPMT - 1)) + scaleFactor;
+		upscalingFactors[chanIndex] = higherSlope * (chanIndex - (g_nChanPMT - 1)) + scaleFactor;
 
 	//For debugging
 	//for (int chanIndex = 0; chanIndex < g_nChanPMT; chanIndex++)
-		//std::cout << "upscaling " << chanIndex << " = " << vec_upscalingFactors.at(chanIndex) << "\n";
+		//std::cout << "upscaling " << chanIndex << " = " << upscalingFactors[chanIndex] << "\n";
 
 	//Upscale mArray
 	const int nPixPerFramePerBeamlet{ mNpixPerFrame / g_nChanPMT };	//Number of pixels in a strip
@@ -1129,7 +1971,7 @@ void TiffU8::flattenFieldLinear(const double scaleFactor, const int lowerChan, c
 		for (int iterPix = 0; iterPix < nPixPerFramePerBeamlet; iterPix++)
 			for (int chanIndex = 0; chanIndex < g_nChanPMT; chanIndex++)
 				mArray[iterFrame * mNpixPerFrame + chanIndex * nPixPerFramePerBeamlet + iterPix] = Util::clipU8dual(
-					vec_upscalingFactors.at(chanIndex) * mArray[iterFrame * mNpixPerFrame + chanIndex * nPixPerFramePerBeamlet + iterPix]);
+					upscalingFactors[chanIndex] * mArray[iterFrame * mNpixPerFrame + chanIndex * nPixPerFramePerBeamlet + iterPix]);
 }
 
 //Upscale the pixel counts exponentially by channel. The channel indices go from 0 to g_nChanPMT-1
@@ -1138,14 +1980,14 @@ void TiffU8::flattenFieldGaussian(const double expFactor)
 	if (expFactor < 0 || expFactor > 0.1)
 		throw std::invalid_argument((std::string)__FUNCTION__ + ": The scale factor must be in the range [0-0.1]");
 
-	std::vector<double> vec_upscalingFactors;	//Vector of upscaling factors
+	double *upscalingFactors{ ScratchArena::local().acquire<double>(ScratchArena::SLOT::LUT, g_nChanPMT) };	//Upscaling factors
 	const double PMTchanOffset{ 7.5 };				//To center the channel index about 7.5 (0 to 7 on the left and 8 to 15 on the right)
 	for (int PMTchanIndex = 0; PMTchanIndex < g_nChanPMT; PMTchanIndex++)
-		vec_upscalingFactors.push_back(std::exp(expFactor * (PMTchanIndex - PMTchanOffset) * (PMTchanIndex - PMTchanOffset)));
+		upscalingFactors[PMTchanIndex] = std::exp(expFactor * (PMTchanIndex - PMTchanOffset) * (PMTchanIndex - PMTchanOffset));
 
 	//For debugging
 	//for (int chanIndex = 0; chanIndex < g_nChanPMT; chanIndex++)
-		//std::cout << "upscaling " << chanIndex << " = " << vec_upscalingFactors.at(chanIndex) << "\n";
+		//std::cout << "upscaling " << chanIndex << " = " << upscalingFactors[chanIndex] << "\n";
 
 	//Upscale mArray
 	const int nPixPerFramePerBeamlet{ mNpixPerFrame / g_nChanPMT };	//Number of pixels in a strip
@@ -1153,14 +1995,14 @@ void TiffU8::flattenFieldGaussian(const double expFactor)
 		for (int chanIndex = 0; chanIndex < g_nChanPMT; chanIndex++)
 			for (int iterPix = 0; iterPix < nPixPerFramePerBeamlet; iterPix++)
 				mArray[iterFrame * mNpixPerFrame + chanIndex * nPixPerFramePerBeamlet + iterPix] = Util::clipU8dual(
-					vec_upscalingFactors.at(chanIndex) * mArray[iterFrame * mNpixPerFrame + chanIndex * nPixPerFramePerBeamlet + iterPix]);
+					upscalingFactors[chanIndex] * mArray[iterFrame * mNpixPerFrame + chanIndex * nPixPerFramePerBeamlet + iterPix]);
 }
 
 void TiffU8::flattenFieldFluorescentSlide(const std::string FSlideFilename, const double upscaleFactor)
 {
 	TiffU8 FSlideTiff{ "", FSlideFilename };
 	
-	unsigned int* sum{ new unsigned int[g_nChanPMT]() };
+	unsigned int* sum{ ScratchArena::local().acquire<unsigned int>(ScratchArena::SLOT::ACCUMULATOR, g_nChanPMT, true) };
 	const int nPixPerFramePerBeamlet{ mNpixPerFrame / g_nChanPMT };	//Number of pixels in a strip
 
 	//Calculate the sum of the values in each strip of the fluorescent slide
@@ -1264,4 +2106,459 @@ void TiffU8::loadTiffU8(const std::string folderPath, const std::string filename
 	_TIFFfree(buffer);		//Release the memory
 	TIFFClose(tiffHandle);	//Close the tif file. I hope the pointer TIFFTAG_ImageJ is cleaned up here
 }
-#pragma endregion "TiffU8"
\ No newline at end of file
+#pragma endregion "TiffU8"
+
+#pragma region "ImageView"
+ImageView::ImageView(U8 *origin, const int heightPerFrame_pix, const int widthPerFrame_pix, const int nFrames, const std::ptrdiff_t rowStride, const std::ptrdiff_t colStride, const std::ptrdiff_t frameStride) :
+	mOrigin{ origin },
+	mHeightPerFrame_pix{ heightPerFrame_pix },
+	mWidthPerFrame_pix{ widthPerFrame_pix },
+	mNframes{ nFrames },
+	mRowStride{ rowStride },
+	mColStride{ colStride },
+	mFrameStride{ frameStride }
+{
+	if (origin == nullptr)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The image is empty");
+	if (heightPerFrame_pix <= 0 || widthPerFrame_pix <= 0 || nFrames <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The image pixel width, pixel height, and number of frames must be > 0");
+}
+
+int ImageView::readHeightPerFrame_pix() const
+{
+	return mHeightPerFrame_pix;
+}
+
+int ImageView::readWidthPerFrame_pix() const
+{
+	return mWidthPerFrame_pix;
+}
+
+int ImageView::readNframes() const
+{
+	return mNframes;
+}
+
+//View of the rectangle [top_pix, top_pix + height_pix) x [left_pix, left_pix + width_pix) of every frame
+ImageView ImageView::crop(const int top_pix, const int left_pix, const int height_pix, const int width_pix) const
+{
+	if (top_pix < 0 || height_pix <= 0 || top_pix + height_pix > mHeightPerFrame_pix)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The row range must be inside [0-" + std::to_string(mHeightPerFrame_pix) + "]");
+	if (left_pix < 0 || width_pix <= 0 || left_pix + width_pix > mWidthPerFrame_pix)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The column range must be inside [0-" + std::to_string(mWidthPerFrame_pix) + "]");
+	if (mMirroredParity != -1 && height_pix != mHeightPerFrame_pix)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The rows of a view with mirrored odd frames can not be cropped");
+
+	ImageView view{ *this };
+	view.mOrigin += top_pix * mRowStride + left_pix * mColStride;
+	view.mHeightPerFrame_pix = height_pix;
+	view.mWidthPerFrame_pix = width_pix;
+	return view;
+}
+
+//View of the frames [firstFrameIndex, firstFrameIndex + nFrames)
+ImageView ImageView::selectFrames(const int firstFrameIndex, const int nFrames) const
+{
+	if (firstFrameIndex < 0 || nFrames <= 0 || firstFrameIndex + nFrames > mNframes)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The frame range must be inside [0-" + std::to_string(mNframes) + "]");
+
+	ImageView view{ *this };
+	view.mOrigin += firstFrameIndex * mFrameStride;
+	view.mNframes = nFrames;
+	if (mMirroredParity != -1)
+		view.mMirroredParity = (mMirroredParity + firstFrameIndex) % 2;
+	return view;
+}
+
+//Divide the frames, concatenated vertically, in nFrames. Same as TiffU8::splitFrames()
+ImageView ImageView::splitFrames(const int nFrames) const
+{
+	if (nFrames <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The frame number must be > 0");
+	if ((mNframes > 1 && mFrameStride != mHeightPerFrame_pix * mRowStride) || mMirroredParity != -1)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The frames are not concatenated vertically");
+	if ((mHeightPerFrame_pix * mNframes) % nFrames)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The total pixel height must be a multiple of the number of frames");
+
+	ImageView view{ *this };
+	view.mHeightPerFrame_pix = mHeightPerFrame_pix * mNframes / nFrames;
+	view.mNframes = nFrames;
+	view.mFrameStride = view.mHeightPerFrame_pix * mRowStride;
+	return view;
+}
+
+//Concatenate the frames vertically in a single frame. Same as TiffU8::mergeFrames()
+ImageView ImageView::mergeFrames() const
+{
+	return splitFrames(1);
+}
+
+//Mirror every frame vertically
+ImageView ImageView::mirrorRows() const
+{
+	ImageView view{ *this };
+	view.mOrigin += (mHeightPerFrame_pix - 1) * mRowStride;
+	view.mRowStride = -mRowStride;
+	return view;
+}
+
+//Reverse the direction of the lines
+ImageView ImageView::mirrorColumns() const
+{
+	ImageView view{ *this };
+	view.mOrigin += (mWidthPerFrame_pix - 1) * mColStride;
+	view.mColStride = -mColStride;
+	return view;
+}
+
+//Mirror the odd frames (the frame index starts from 0) vertically. Same as TiffU8::mirrorOddFrames() but without swapping the rows
+ImageView ImageView::mirrorOddFrames() const
+{
+	ImageView view{ *this };
+	switch (mMirroredParity)
+	{
+	case -1:	//None mirrored -> odd mirrored
+		view.mMirroredParity = 1;
+		break;
+	case 1:		//Odd mirrored -> none mirrored
+		view.mMirroredParity = -1;
+		break;
+	default:	//Even mirrored -> all mirrored
+		view.mMirroredParity = -1;
+		view = view.mirrorRows();
+	}
+	return view;
+}
+
+//Reverse the order of the frames
+ImageView ImageView::reverseFrames() const
+{
+	ImageView view{ *this };
+	view.mOrigin += (mNframes - 1) * mFrameStride;
+	view.mFrameStride = -mFrameStride;
+	if (mMirroredParity != -1)
+		view.mMirroredParity = (mNframes - 1 + mMirroredParity) % 2;
+	return view;
+}
+
+//Copy a row of a frame to a contiguous output
+void ImageView::copyRow(const int frameIndex, const int row_pix, U8 *output) const
+{
+	const U8* const input{ &pixel(frameIndex, row_pix, 0) };
+	if (mColStride == 1)
+		std::memcpy(output, input, mWidthPerFrame_pix * sizeof(U8));
+	else
+		for (int iterCol_pix = 0; iterCol_pix < mWidthPerFrame_pix; iterCol_pix++)
+			output[iterCol_pix] = input[iterCol_pix * mColStride];
+}
+
+//CRC-32 of the pixels in the order of the frames, rows, and columns of the view, which is the order in which saveToFile() writes them
+U32 ImageView::computeCRC32() const
+{
+	std::vector<U8> row(mWidthPerFrame_pix);
+	U32 crc{ 0 };
+	for (int iterFrame = 0; iterFrame < mNframes; iterFrame++)
+		for (int iterRow_pix = 0; iterRow_pix < mHeightPerFrame_pix; iterRow_pix++)
+		{
+			const U8 *input{ &pixel(iterFrame, iterRow_pix, 0) };
+			if (mColStride != 1)
+			{
+				copyRow(iterFrame, iterRow_pix, row.data());
+				input = row.data();
+			}
+			crc = Util::computeCRC32(input, mWidthPerFrame_pix, crc);
+		}
+	return crc;
+}
+
+//Copy the view to a new contiguous tiff
+TiffU8 ImageView::copyToTiff() const
+{
+	TiffU8 tiff{ mHeightPerFrame_pix, mWidthPerFrame_pix, mNframes };
+	for (int iterFrame = 0; iterFrame < mNframes; iterFrame++)
+		for (int iterRow_pix = 0; iterRow_pix < mHeightPerFrame_pix; iterRow_pix++)
+			copyRow(iterFrame, iterRow_pix, &tiff.data()[(static_cast<std::size_t>(iterFrame) * mHeightPerFrame_pix + iterRow_pix) * mWidthPerFrame_pix]);
+	return tiff;
+}
+
+//Save each frame in a different page (MULTIPAGE) or all the frames concatenated vertically in a single page (SINGLEPAGE). The rows are read through the view, so the image is never copied
+void ImageView::saveToFile(const std::string folderPath, std::string filename, const TIFFSTRUCT tiffStruct, const OVERRIDE override) const
+{
+	const int nPages{ tiffStruct == TIFFSTRUCT::MULTIPAGE ? mNframes : 1 };
+	const int nFramesPerPage{ mNframes / nPages };
+	const int height_pix{ mHeightPerFrame_pix * nFramesPerPage };
+	const int width_pix{ mWidthPerFrame_pix };
+
+	if (override == OVERRIDE::DIS)
+		filename = Util::doesFileExist(folderPath, filename, ".tif");	//Check if the file exits. It gives some overhead
+
+	TIFF *tiffHandle{ TIFFOpen((folderPath + filename + ".tif").c_str(), "w") };
+
+	if (tiffHandle == nullptr)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": Saving " + filename + ".tif failed");
+
+	U8 *buffer = (U8*)_TIFFmalloc(width_pix * sizeof(U8));	//Buffer used to store the row of pixel information for writing to file
+
+	if (buffer == NULL) //Check that the buffer memory was allocated
+	{
+		TIFFClose(tiffHandle);
+		throw std::runtime_error((std::string)__FUNCTION__ + ": Could not allocate memory for raster of TIFF image");
+	}
+
+	for (int iterPage = 0; iterPage < nPages; iterPage++)
+	{
+		//TAGS
+		TIFFSetField(tiffHandle, TIFFTAG_IMAGELENGTH, height_pix);										//Set the pixel height of the image
+		TIFFSetField(tiffHandle, TIFFTAG_IMAGEWIDTH, width_pix);										//Set the pixel width of the image
+		//TIFFSetField(tiffHandle, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);							//PLANARCONFIG_CONTIG (for example, RGBRGBRGB) or PLANARCONFIG_SEPARATE (R, G, and B separate)
+		TIFFSetField(tiffHandle, TIFFTAG_SAMPLESPERPIXEL, 1);											//Set number of channels per pixel
+		TIFFSetField(tiffHandle, TIFFTAG_BITSPERSAMPLE, 8);												//Set the size of the channels
+		TIFFSetField(tiffHandle, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);								//Set the origin of the image. Many readers ignore this tag (ImageJ, Windows preview, etc...)
+		TIFFSetField(tiffHandle, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);							//Single channel with min as black				
+		TIFFSetField(tiffHandle, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tiffHandle, width_pix));	//Set the strip size of the file to be size of one row of pixels
+		//TIFFSetField(tiffHandle, TIFFTAG_SUBFILETYPE, FILETYPE_PAGE);									//Specify that it's a frame within the multipage file
+		//TIFFSetField(tiffHandle, TIFFTAG_PAGENUMBER, iterPage, nPages);								//Specify the frame number
+
+		//IMAGEJ TAG FOR USING HYPERSTACKS
+		std::string TIFFTAG_ImageJ = "ImageJ=1.52e\nimages=" + std::to_string(nPages) + "\nchannels=1\nslices=" + std::to_string(nPages) + "\nhyperstack=true\nmode=grayscale\nunit=\\u00B5m\nloop=false ";
+		TIFFSetField(tiffHandle, TIFFTAG_IMAGEDESCRIPTION, TIFFTAG_ImageJ.c_str());
+
+		//Write a page to the file one strip at a time
+		for (int iterRow_pix = 0; iterRow_pix < height_pix; iterRow_pix++)
+		{
+			copyRow(iterPage * nFramesPerPage + iterRow_pix / mHeightPerFrame_pix, iterRow_pix % mHeightPerFrame_pix, buffer);
+			if (TIFFWriteScanline(tiffHandle, buffer, iterRow_pix, 0) < 0)
+			{
+				_TIFFfree(buffer);
+				TIFFClose(tiffHandle);
+				throw std::runtime_error((std::string)__FUNCTION__ + ": Writing a row to " + filename + ".tif failed");
+			}
+		}
+
+		//Create a new page if nPages > 1. It gives a large overhead
+		if (nPages > 1)
+			TIFFWriteDirectory(tiffHandle);
+	}
+
+	_TIFFfree(buffer);										//Destroy the buffer
+	TIFFClose(tiffHandle);									//Close the output tiff file
+
+	std::cout << "Successfully saved: " << filename << ".tif\n";
+}
+#pragma endregion "ImageView"
+
+#pragma region "ChunkedCanvas"
+namespace
+{
+	std::atomic<int> canvasCounter{ 0 };	//For giving a unique name to the backing file of each canvas
+}
+
+//Call function(chunk, chunkRow_pix, chunkCol_pix, rectRow_pix, rectCol_pix, nRows, nCols) for each intersection of the rectangle with a chunk
+//The chunks are visited once each, in row-major order, so only one chunk has to be resident at a time
+template<class Function>
+void ChunkedCanvas::forEachChunkInRect_(const int top_pix, const int left_pix, const int height_pix, const int width_pix, Function function) const
+{
+	if (height_pix == 0 || width_pix == 0)
+		return;
+
+	for (int chunkII = top_pix / mChunkSize_pix; chunkII <= (top_pix + height_pix - 1) / mChunkSize_pix; chunkII++)
+		for (int chunkJJ = left_pix / mChunkSize_pix; chunkJJ <= (left_pix + width_pix - 1) / mChunkSize_pix; chunkJJ++)
+		{
+			const int chunkTop_pix{ chunkII * mChunkSize_pix };
+			const int chunkLeft_pix{ chunkJJ * mChunkSize_pix };
+			const int rowMin_pix{ (std::max)(top_pix, chunkTop_pix) };
+			const int rowMax_pix{ (std::min)(top_pix + height_pix, chunkTop_pix + mChunkSize_pix) };
+			const int colMin_pix{ (std::max)(left_pix, chunkLeft_pix) };
+			const int colMax_pix{ (std::min)(left_pix + width_pix, chunkLeft_pix + mChunkSize_pix) };
+			function(acquireChunk_(chunkII * mNchunksJJ + chunkJJ), rowMin_pix - chunkTop_pix, colMin_pix - chunkLeft_pix, rowMin_pix - top_pix, colMin_pix - left_pix, rowMax_pix - rowMin_pix, colMax_pix - colMin_pix);
+		}
+}
+
+//The backing file is created in folderPath. memoryBudget_byte caps the memory taken by the resident chunks
+ChunkedCanvas::ChunkedCanvas(const int height_pix, const int width_pix, const std::string folderPath, const U64 memoryBudget_byte, const int chunkSize_pix) :
+	mHeight_pix{ height_pix },
+	mWidth_pix{ width_pix },
+	mChunkSize_pix{ chunkSize_pix },
+	mNchunksII{ chunkSize_pix > 0 ? Util::intceil(1. * height_pix / chunkSize_pix) : 0 },
+	mNchunksJJ{ chunkSize_pix > 0 ? Util::intceil(1. * width_pix / chunkSize_pix) : 0 },
+	mMaxResidentChunks{ chunkSize_pix > 0 ? static_cast<int>((std::max)(memoryBudget_byte / (static_cast<U64>(chunkSize_pix) * chunkSize_pix), static_cast<U64>(1))) : 0 },
+	mFilePath{ folderPath + "_Canvas_" + std::to_string(GetCurrentProcessId()) + "_" + std::to_string(canvasCounter++) + ".tmp" }
+{
+	if (height_pix <= 0 || width_pix <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The canvas height and width must be > 0");
+	if (chunkSize_pix <= 0)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The chunk size must be > 0");
+
+	mFileHandle.open(mFilePath, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!mFileHandle.is_open())
+		throw std::runtime_error((std::string)__FUNCTION__ + ": Failed creating " + mFilePath);
+
+	mOnDisk.assign(mNchunksII * mNchunksJJ, false);
+}
+
+//The content of the canvas is discarded. Call saveToFile() to keep it
+ChunkedCanvas::~ChunkedCanvas()
+{
+	mFileHandle.close();
+	std::error_code errorCode;
+	std::filesystem::remove(mFilePath, errorCode);
+}
+
+int ChunkedCanvas::readHeight_pix() const
+{
+	return mHeight_pix;
+}
+
+int ChunkedCanvas::readWidth_pix() const
+{
+	return mWidth_pix;
+}
+
+int ChunkedCanvas::readChunkSize_pix() const
+{
+	return mChunkSize_pix;
+}
+
+//Copy the rectangle [top_pix, top_pix + height_pix) x [left_pix, left_pix + width_pix) of the input to the canvas
+void ChunkedCanvas::writeRect(const U8 *input, const int inputBytesPerRow, const int top_pix, const int left_pix, const int height_pix, const int width_pix)
+{
+	checkRect_(top_pix, left_pix, height_pix, width_pix);
+
+	std::lock_guard<std::mutex> lock{ mMutex };
+	forEachChunkInRect_(top_pix, left_pix, height_pix, width_pix, [&](Chunk &chunk, const int chunkRow_pix, const int chunkCol_pix, const int rectRow_pix, const int rectCol_pix, const int nRows, const int nCols)
+	{
+		for (int iterRow_pix = 0; iterRow_pix < nRows; iterRow_pix++)
+			std::memcpy(&chunk.mPixels[(chunkRow_pix + iterRow_pix) * mChunkSize_pix + chunkCol_pix], &input[static_cast<std::size_t>(rectRow_pix + iterRow_pix) * inputBytesPerRow + rectCol_pix], nCols * sizeof(U8));
+		chunk.mDirty = true;
+	});
+}
+
+//Copy the rectangle [top_pix, top_pix + height_pix) x [left_pix, left_pix + width_pix) of the canvas to the output
+void ChunkedCanvas::readRect(U8 *output, const int outputBytesPerRow, const int top_pix, const int left_pix, const int height_pix, const int width_pix) const
+{
+	checkRect_(top_pix, left_pix, height_pix, width_pix);
+
+	std::lock_guard<std::mutex> lock{ mMutex };
+	forEachChunkInRect_(top_pix, left_pix, height_pix, width_pix, [&](Chunk &chunk, const int chunkRow_pix, const int chunkCol_pix, const int rectRow_pix, const int rectCol_pix, const int nRows, const int nCols)
+	{
+		for (int iterRow_pix = 0; iterRow_pix < nRows; iterRow_pix++)
+			std::memcpy(&output[static_cast<std::size_t>(rectRow_pix + iterRow_pix) * outputBytesPerRow + rectCol_pix], &chunk.mPixels[(chunkRow_pix + iterRow_pix) * mChunkSize_pix + chunkCol_pix], nCols * sizeof(U8));
+	});
+}
+
+//Return a copy of a rectangle of the canvas as a single-frame tiff
+TiffU8 ChunkedCanvas::readTiff(const int top_pix, const int left_pix, const int height_pix, const int width_pix) const
+{
+	TiffU8 tiff{ height_pix, width_pix, 1 };
+	readRect(tiff.data(), width_pix, top_pix, left_pix, height_pix, width_pix);
+	return tiff;
+}
+
+//Save the canvas as a single-page Tiff, as TiffU8::saveToFile() does. The rows are read one band of chunks at a time
+void ChunkedCanvas::saveToFile(const std::string folderPath, std::string filename, const OVERRIDE override) const
+{
+	if (override == OVERRIDE::DIS)
+		filename = Util::doesFileExist(folderPath, filename, ".tif");	//Check if the file exits. It gives some overhead
+
+	TIFF *tiffHandle{ TIFFOpen((folderPath + filename + ".tif").c_str(), "w") };
+
+	if (tiffHandle == nullptr)
+		throw std::runtime_error((std::string)__FUNCTION__ + ": Saving " + filename + ".tif failed");
+
+	//TAGS
+	TIFFSetField(tiffHandle, TIFFTAG_IMAGELENGTH, mHeight_pix);										//Set the pixel height of the image
+	TIFFSetField(tiffHandle, TIFFTAG_IMAGEWIDTH, mWidth_pix);										//Set the pixel width of the image
+	TIFFSetField(tiffHandle, TIFFTAG_SAMPLESPERPIXEL, 1);											//Set number of channels per pixel
+	TIFFSetField(tiffHandle, TIFFTAG_BITSPERSAMPLE, 8);												//Set the size of the channels
+	TIFFSetField(tiffHandle, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);								//Set the origin of the image
+	TIFFSetField(tiffHandle, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);							//Single channel with min as black
+	TIFFSetField(tiffHandle, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tiffHandle, mWidth_pix));	//Set the strip size of the file to be size of one row of pixels
+	const std::string TIFFTAG_ImageJ = "ImageJ=1.52e\nimages=1\nchannels=1\nslices=1\nhyperstack=true\nmode=grayscale\nunit=\\u00B5m\nloop=false ";
+	TIFFSetField(tiffHandle, TIFFTAG_IMAGEDESCRIPTION, TIFFTAG_ImageJ.c_str());
+
+	std::vector<U8> band(static_cast<std::size_t>(mChunkSize_pix) * mWidth_pix);	//Rows of a band of chunks
+	for (int bandTop_pix = 0; bandTop_pix < mHeight_pix; bandTop_pix += mChunkSize_pix)
+	{
+		const int nRows{ (std::min)(mChunkSize_pix, mHeight_pix - bandTop_pix) };
+		readRect(band.data(), mWidth_pix, bandTop_pix, 0, nRows, mWidth_pix);
+		for (int iterRow_pix = 0; iterRow_pix < nRows; iterRow_pix++)
+			if (TIFFWriteScanline(tiffHandle, &band[static_cast<std::size_t>(iterRow_pix) * mWidth_pix], bandTop_pix + iterRow_pix, 0) < 0)
+			{
+				TIFFClose(tiffHandle);
+				throw std::runtime_error((std::string)__FUNCTION__ + ": Writing a row to " + filename + ".tif failed");
+			}
+	}
+	TIFFClose(tiffHandle);
+
+	std::cout << "Successfully saved: " << filename << ".tif\n";
+}
+
+U64 ChunkedCanvas::readResident_byte() const
+{
+	std::lock_guard<std::mutex> lock{ mMutex };
+	return static_cast<U64>(mResidentChunks.size()) * mChunkSize_pix * mChunkSize_pix;
+}
+
+//Highest memory taken by the resident chunks since the canvas was created
+U64 ChunkedCanvas::readPeakResident_byte() const
+{
+	std::lock_guard<std::mutex> lock{ mMutex };
+	return mPeakResident_byte;
+}
+
+void ChunkedCanvas::checkRect_(const int top_pix, const int left_pix, const int height_pix, const int width_pix) const
+{
+	if (top_pix < 0 || height_pix < 0 || top_pix + height_pix > mHeight_pix)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The row range must be inside [0-" + std::to_string(mHeight_pix) + "]");
+	if (left_pix < 0 || width_pix < 0 || left_pix + width_pix > mWidth_pix)
+		throw std::invalid_argument((std::string)__FUNCTION__ + ": The column range must be inside [0-" + std::to_string(mWidth_pix) + "]");
+}
+
+//Return a resident chunk and mark it as the most recently used. Load it from the backing file if needed, evicting the least recently used chunk when the budget is full
+ChunkedCanvas::Chunk& ChunkedCanvas::acquireChunk_(const int chunkIndex) const
+{
+	auto iterChunk{ mResidentChunks.find(chunkIndex) };
+	if (iterChunk != mResidentChunks.end())
+	{
+		mLru.splice(mLru.begin(), mLru, iterChunk->second.mLruPosition);
+		return iterChunk->second;
+	}
+
+	while (static_cast<int>(mResidentChunks.size()) >= mMaxResidentChunks)
+		evictChunk_();
+
+	const std::size_t chunkSize_byte{ static_cast<std::size_t>(mChunkSize_pix) * mChunkSize_pix };
+	Chunk &chunk{ mResidentChunks[chunkIndex] };
+	chunk.mPixels.assign(chunkSize_byte, 0);
+	chunk.mDirty = false;
+	if (mOnDisk.at(chunkIndex))
+	{
+		mFileHandle.seekg(static_cast<std::streamoff>(chunkIndex) * static_cast<std::streamoff>(chunkSize_byte));	//Cast before multiplying, the offset can exceed 4 GB
+		mFileHandle.read(reinterpret_cast<char*>(chunk.mPixels.data()), chunkSize_byte);
+		if (!mFileHandle)
+			throw std::runtime_error((std::string)__FUNCTION__ + ": Failed reading a chunk from " + mFilePath);
+	}
+	mLru.push_front(chunkIndex);
+	chunk.mLruPosition = mLru.begin();
+
+	mPeakResident_byte = (std::max)(mPeakResident_byte, static_cast<U64>(mResidentChunks.size()) * chunkSize_byte);
+	return chunk;
+}
+
+//Drop the least recently used chunk. Write it to the backing file first if it has been modified
+void ChunkedCanvas::evictChunk_() const
+{
+	const int chunkIndex{ mLru.back() };
+	Chunk &chunk{ mResidentChunks.at(chunkIndex) };
+	if (chunk.mDirty)
+	{
+		mFileHandle.seekp(static_cast<std::streamoff>(chunkIndex) * static_cast<std::streamoff>(chunk.mPixels.size()));
+		mFileHandle.write(reinterpret_cast<const char*>(chunk.mPixels.data()), chunk.mPixels.size());
+		if (!mFileHandle)
+			throw std::runtime_error((std::string)__FUNCTION__ + ": Failed writing a chunk to " + mFilePath);
+		mOnDisk.at(chunkIndex) = true;
+	}
+	mLru.pop_back();
+	mResidentChunks.erase(chunkIndex);
+}
+#pragma endregion "ChunkedCanvas"